@@ -30,6 +30,7 @@ enum ShadingInterpolation
 };
 
 
+class CqParameterKey;
 class IqLightsource;
 class IqShader;
 
@@ -71,6 +72,18 @@ public:
 	 */
 	virtual const	TqInt	GetIntegerAttributeDef( const char* strName, const char* strParam, TqInt defaultVal) const = 0;
 
+	/** \name Attribute access by interned key
+	 * Faster equivalents of the above for use on hot paths.
+	 */
+	//@{
+	virtual const	IqParameter* GetAttribute( const CqParameterKey& key ) const = 0;
+	virtual	const	TqFloat*	GetFloatAttribute( const CqParameterKey& key ) const = 0;
+	virtual	const	TqInt*	GetIntegerAttribute( const CqParameterKey& key ) const = 0;
+	virtual	const	CqString* GetStringAttribute( const CqParameterKey& key ) const = 0;
+	virtual	const	CqColor*	GetColorAttribute( const CqParameterKey& key ) const = 0;
+	virtual const	TqInt	GetIntegerAttributeDef( const CqParameterKey& key, TqInt defaultVal) const = 0;
+	//@}
+
 	/** Get a named float attribute as writable
 	 */
 	virtual	TqFloat*	GetFloatAttributeWrite( const char* strName, const char* strParam ) = 0;
@@ -16,6 +16,7 @@
 #include <aqsis/aqsis.h>
 
 #include <aqsis/core/interfacefwd.h>
+#include <aqsis/math/vector3d.h>
 
 namespace Aqsis {
 
@@ -47,6 +48,15 @@ public:
 	 * \param pPs the point being lit.
 	 */
 	virtual	void	Evaluate( IqShaderData* pPs, IqShaderData* pNs, IqSurface* pSurface ) = 0;
+	/** Determine whether the light may illuminate any point in a sphere.
+	 *
+	 * Lights which can't be shown to miss the sphere return true, so this
+	 * may be used to skip evaluating the light for a grid.
+	 *
+	 * \param center - centre of the sphere, in "current" space.
+	 * \param radius - radius of the sphere.
+	 */
+	virtual	bool	mayIlluminate( const CqVector3D& center, TqFloat radius ) = 0;
 	/** Get a pointer to the attributes associated with this lightsource.
 	 * \return a CqAttributes pointer.
 	 */
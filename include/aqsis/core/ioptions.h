@@ -39,6 +39,7 @@
 namespace Aqsis {
 
 class CqImagersource;
+class CqParameterKey;
 class CqRegion;
 class CqString;
 class IqShader;
@@ -93,6 +94,17 @@ public:
 	virtual const	CqVector3D*	GetPointOption( const char* strName, const char* strParam ) const = 0;
 	virtual const	CqColor*	GetColorOption( const char* strName, const char* strParam ) const = 0;
 
+	/** \name Option access by interned key
+	 * Faster equivalents of the above for use on hot paths.
+	 */
+	//@{
+	virtual const	TqFloat*	GetFloatOption( const CqParameterKey& key ) const = 0;
+	virtual const	TqInt*	GetIntegerOption( const CqParameterKey& key ) const = 0;
+	virtual const	CqString* GetStringOption( const CqParameterKey& key ) const = 0;
+	virtual const	CqVector3D*	GetPointOption( const CqParameterKey& key ) const = 0;
+	virtual const	CqColor*	GetColorOption( const CqParameterKey& key ) const = 0;
+	//@}
+
 	virtual TqFloat*	GetFloatOptionWrite( const char* strName, const char* strParam, TqInt arraySize = 1 ) = 0;
 	virtual TqInt*	GetIntegerOptionWrite( const char* strName, const char* strParam, TqInt arraySize = 1 ) = 0;
 	virtual CqString* GetStringOptionWrite( const char* strName, const char* strParam, TqInt arraySize = 1 ) = 0;
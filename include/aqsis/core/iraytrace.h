@@ -0,0 +1,137 @@
+//------------------------------------------------------------------------------
+/**
+ *	@file	iraytrace.h
+ *	@author	Paul Gregory
+ *	@brief	Declare the interface class for common raytracer access.
+ *
+ *	Last change by:		$Author$
+ *	Last change date:	$Date$
+ */
+//------------------------------------------------------------------------------
+
+
+#ifndef	___iraytrace_Loaded___
+#define	___iraytrace_Loaded___
+
+#include	<aqsis/aqsis.h>
+
+#include	<cfloat>
+
+#include	<boost/shared_ptr.hpp>
+
+#include	<aqsis/math/color.h>
+#include	<aqsis/math/vector3d.h>
+
+namespace Aqsis {
+
+class IqSurface;
+
+//----------------------------------------------------------------------
+/** \brief A ray to be traced against the raytracing database.
+ *
+ * Rays live in "world" space.  The direction need not be normalised;
+ * distances along the ray are measured in units of the direction vector.
+ */
+struct SqRay
+{
+	CqVector3D	origin;		///< Ray origin.
+	CqVector3D	direction;	///< Ray direction.
+	TqFloat		tMin;		///< Hits closer than this are ignored.
+	TqFloat		tMax;		///< Hits further away than this are ignored.
+
+	SqRay()
+		: origin(),
+		direction(0, 0, 1),
+		tMin(0),
+		tMax(FLT_MAX)
+	{}
+	SqRay(const CqVector3D& o, const CqVector3D& d, TqFloat tmin = 0,
+			TqFloat tmax = FLT_MAX)
+		: origin(o),
+		direction(d),
+		tMin(tmin),
+		tMax(tmax)
+	{}
+};
+
+//----------------------------------------------------------------------
+/** \brief Information about the closest intersection along a ray.
+ */
+struct SqRayHit
+{
+	TqFloat		t;		///< Ray parameter of the hit point.
+	CqVector3D	Ng;		///< World space geometric normal at the hit point (unnormalised).
+	CqColor		Cs;		///< Surface color of the primitive which was hit.
+	CqColor		Os;		///< Surface opacity of the primitive which was hit.
+};
+
+
+class IqRaytrace
+{
+public:
+	virtual ~IqRaytrace()
+	{}
+
+
+	/** Initialise the raytracing subsystem.
+	 *
+	 * Called at the start of each world block; discards any database left
+	 * over from a previous frame.
+	 */
+	virtual	void	Initialise()=0;
+
+	/** Add a primitive to the raytracing space subdivision structure.
+	 */
+	virtual	void	AddPrimitive(const boost::shared_ptr<IqSurface>& pSurface)=0;
+
+	/** Prepare the structure for raytrace queries.
+	 */
+	virtual void	Finalise()=0;
+
+	/** Determine whether the database contains any traceable geometry.
+	 */
+	virtual bool	IsEmpty() const=0;
+
+	/** Find the closest intersection along a ray.
+	 *
+	 * \param ray - ray to trace.
+	 * \param hit - filled in with the details of the closest hit, if any.
+	 * \return true if the ray hit something.
+	 */
+	virtual bool	Intersect(const SqRay& ray, SqRayHit& hit) const=0;
+
+	/** Determine whether anything lies along a ray.
+	 *
+	 * This is cheaper than Intersect() since traversal may stop at the first
+	 * hit found.
+	 */
+	virtual bool	Occluded(const SqRay& ray) const=0;
+
+	/** Find the closest intersections for a batch of rays.
+	 *
+	 * The rays are traced in packets, so coherent batches (for instance many
+	 * rays leaving the same shading point) are much cheaper per ray than
+	 * individual calls to Intersect().
+	 *
+	 * \param rays - array of numRays rays.
+	 * \param hits - array of numRays hit records to fill in.
+	 * \param didHit - array of numRays flags, set to true for rays which hit.
+	 */
+	virtual void	IntersectBatch(const SqRay* rays, SqRayHit* hits,
+							bool* didHit, TqInt numRays) const=0;
+
+	/** Determine which of a batch of rays are occluded.
+	 *
+	 * \param rays - array of numRays rays.
+	 * \param occluded - array of numRays flags to fill in.
+	 */
+	virtual void	OccludedBatch(const SqRay* rays, bool* occluded,
+							TqInt numRays) const=0;
+};
+
+
+//-----------------------------------------------------------------------
+
+} // namespace Aqsis
+
+#endif	//	___iraytrace_Loaded___
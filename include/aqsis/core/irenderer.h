@@ -25,6 +25,8 @@ namespace Aqsis {
 
 struct IqTextureMapOld;
 struct IqTextureCache;
+class IqRaytrace;
+class CqParameterKey;
 
 class IqRenderer
 {
@@ -43,6 +45,14 @@ public:
 	virtual	const	CqString* GetStringOption( const char* strName, const char* strParam ) const = 0;
 	virtual	const	CqVector3D*	GetPointOption( const char* strName, const char* strParam ) const = 0;
 	virtual	const	CqColor*	GetColorOption( const char* strName, const char* strParam ) const = 0;
+	/** \name Option access by interned key
+	 * Faster equivalents of the above for use on hot paths.
+	 */
+	//@{
+	virtual	const	TqFloat*	GetFloatOption( const CqParameterKey& key ) const = 0;
+	virtual	const	TqInt*	GetIntegerOption( const CqParameterKey& key ) const = 0;
+	virtual	const	CqString* GetStringOption( const CqParameterKey& key ) const = 0;
+	//@}
 
 	virtual	TqFloat*	GetFloatOptionWrite( const char* strName, const char* strParam ) = 0;
 	virtual	TqInt*	GetIntegerOptionWrite( const char* strName, const char* strParam ) = 0;
@@ -78,6 +88,12 @@ public:
 	virtual	IqTextureMapOld* GetLatLongMap( const CqString& fileName ) = 0;
 	//@}
 
+	/** \brief Get the raytracing subsystem.
+	 *
+	 * \return the raytracer, or NULL if raytracing isn't available.
+	 */
+	virtual	IqRaytrace*	pRaytracer() const = 0;
+
 	virtual	bool	GetBasisMatrix( CqMatrix& matBasis, const CqString& name ) = 0;
 
 	virtual TqInt	RegisterOutputData( const char* name ) = 0;
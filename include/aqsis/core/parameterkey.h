@@ -0,0 +1,75 @@
+// Aqsis
+// Copyright (C) 1997 - 2001, Paul C. Gregory
+//
+// Contact: pgregory@aqsis.org
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation; either
+// version 2 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+/** \file
+		\brief Declares CqParameterKey, a precompiled name for option and
+			attribute lookups.
+*/
+
+#ifndef PARAMETERKEY_H_INCLUDED
+#define PARAMETERKEY_H_INCLUDED 1
+
+#include <aqsis/aqsis.h>
+
+#include <aqsis/util/nametable.h>
+
+namespace Aqsis {
+
+//----------------------------------------------------------------------
+/** \brief Interned name of an option or attribute parameter.
+ *
+ * Looking up an option or attribute by string walks maps keyed on the
+ * option and parameter names.  A key interns both names once, after which
+ * lookups through the key are plain array indexing.  Keys used on hot paths
+ * should be constructed once, typically as file scope constants:
+ *
+ * \code
+ * const CqParameterKey key_sides("System", "Sides");
+ * ...
+ * if(pAttributes()->GetIntegerAttribute(key_sides)[0] == 1)
+ * \endcode
+ */
+class CqParameterKey
+{
+	public:
+		/** \brief Intern the given option or attribute name and parameter name.
+		 */
+		CqParameterKey(const char* strName, const char* strParam)
+			: m_nameId(CqNameTable::intern(strName)),
+			m_paramId(CqNameTable::intern(strParam))
+		{ }
+		/// Get the interned id of the option or attribute name.
+		TqInt nameId() const
+		{
+			return m_nameId;
+		}
+		/// Get the interned id of the parameter name.
+		TqInt paramId() const
+		{
+			return m_paramId;
+		}
+	private:
+		TqInt m_nameId;
+		TqInt m_paramId;
+};
+
+} // namespace Aqsis
+
+#endif // PARAMETERKEY_H_INCLUDED
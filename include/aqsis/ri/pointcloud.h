@@ -52,9 +52,18 @@ AQSIS_TEX_SHARE int PtcGetPointCloudInfo ( PtcPointCloud pointcloud, const char
 // Get one point from the Point clound file
 AQSIS_TEX_SHARE int PtcReadDataPoint ( PtcPointCloud pointcloud, float *point, float*normal, float *radius, float *user_data );
 
-// Get one normal, radius, user_data from the location point
+// Get one normal, radius, user_data from the point nearest to the location point
 AQSIS_TEX_SHARE int PtcFindDataPoint ( PtcPointCloud pointcloud, float *point, float*normal, float *radius, float *user_data );
 
+// Find the indices of the maxpoints points nearest to the location point
+AQSIS_TEX_SHARE int PtcFindNearestDataPoints ( PtcPointCloud pointcloud, float *point, int maxpoints, int *indices, float *distsquared );
+
+// Find the indices of up to maxpoints points within radius of the location point
+AQSIS_TEX_SHARE int PtcFindDataPointsInRadius ( PtcPointCloud pointcloud, float *point, float radius, int maxpoints, int *indices, float *distsquared );
+
+// Get one point by the index returned from one of the searches above
+AQSIS_TEX_SHARE int PtcGetDataPoint ( PtcPointCloud pointcloud, int index, float *point, float*normal, float *radius, float *user_data );
+
 
 // Close Point cloud file
 AQSIS_TEX_SHARE void PtcClosePointCloudFile ( PtcPointCloud pointcloud );
@@ -40,6 +40,9 @@
 #include <aqsis/config.h>
 
 #include <iosfwd>
+#include <string>
+
+#include <boost/shared_ptr.hpp>
 
 namespace Aqsis
 {
@@ -60,6 +63,44 @@ class AQSIS_RIUTIL_SHARE RibParser
         /// bases from their names, parse string tokens, etc.
         static RibParser* create(Ri::RendererServices& services);
 
+        /// Open a RIB file for parsing with parseStream()
+        ///
+        /// Regular files are memory mapped, and the parser then reads
+        /// straight out of the mapping rather than copying the file through
+        /// a stream buffer.  Anything which can't be mapped (pipes, devices,
+        /// files too large for the address space) is opened as an ordinary
+        /// std::ifstream.
+        ///
+        /// \param fileName - name of the file to open
+        /// \return the opened stream; check it with operator!() before use.
+        static boost::shared_ptr<std::istream> openFile(const std::string& fileName);
+
+        /// Bring a file opened with openFile() into memory without parsing it
+        ///
+        /// Every page of a memory mapped file is touched so that a later
+        /// parse doesn't wait on the disk.  This is meant to be run on a
+        /// background thread ahead of parsing.
+        ///
+        /// \param in - stream returned by openFile()
+        /// \return false if the stream isn't memory mapped, in which case
+        ///         nothing is read.
+        static bool prefetchFile(std::istream& in);
+
+        /// Read a block of RIB from a stream into memory without parsing it
+        ///
+        /// Reading stops at the end of the stream, or at the 0377 byte which
+        /// ends the output generated for each request to a RunProgram
+        /// procedural.  The RIB is tokenized to find the end of the block,
+        /// so binary encoded data is handled correctly, but the bytes are
+        /// copied verbatim.  The block can later be parsed with parseStream()
+        /// from a std::istringstream.
+        ///
+        /// \param in - stream to read from
+        /// \param block - the characters read are appended here
+        /// \return true if the block ended with a 0377 byte, false if the end
+        ///         of the stream was reached first.
+        static bool readBlock(std::istream& in, std::string& block);
+
         /// Parse a RIB stream, sending requests to the callback interface
         ///
         /// \param ribStream - RIB stream to be parsed.  May be gzipped.
@@ -19,6 +19,7 @@
 #include	<vector>
 #include	<iosfwd>
 
+#include	<boost/filesystem/path.hpp>
 #include	<boost/shared_ptr.hpp>
 
 #include	<aqsis/core/interfacefwd.h>
@@ -175,6 +176,19 @@ AQSIS_SHADERVM_SHARE boost::shared_ptr<IqShader> createShaderVM(IqRenderer* rend
 AQSIS_SHADERVM_SHARE boost::shared_ptr<IqShader> createShaderVM(IqRenderer* renderContext,
 										   std::istream& programFile,
 										   const std::string& dsoPath);
+
+/** \brief Create a CqShaderVM from the compiled shader at the given path.
+ *
+ * Loaded programs are kept in a process-wide cache keyed by path, DSO search
+ * path, file size and modification time, so loading an unchanged shader again
+ * (after a FlushShaders() or in a later render) only recreates the local
+ * variables rather than re-parsing the file.
+ *
+ * \throw XqBadShader if the file can't be read or is invalid.
+ */
+AQSIS_SHADERVM_SHARE boost::shared_ptr<IqShader> createShaderVM(IqRenderer* renderContext,
+										   const boost::filesystem::path& programPath,
+										   const std::string& dsoPath);
 //@}
 
 /** \brief Reset ShaderVM static variables
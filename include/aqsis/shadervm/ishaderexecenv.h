@@ -28,6 +28,8 @@
 
 #include	<aqsis/aqsis.h>
 
+#include	<vector>
+
 #include	<boost/shared_ptr.hpp>
 
 #include	<aqsis/shadervm/ishaderdata.h>
@@ -48,6 +50,15 @@ typedef void (*DSOMethod)(void*,int,void**);
 typedef void* (*DSOInit)(int,void*);
 typedef void (*DSOShutdown)(void*);
 
+/** \brief Cone passed to an illuminate() statement of a light shader.
+ */
+struct SqIlluminateCone
+{
+	CqVector3D from;	///< Position of the light.
+	CqVector3D axis;	///< Axis of the cone, as passed to illuminate().
+	TqFloat angle;		///< Half angle of the cone in radians.
+};
+
 /** \enum EqEnvVars
  * Identifiers for the standard environment variables.
  */
@@ -199,6 +210,17 @@ struct AQSIS_SHADERVM_SHARE IqShaderExecEnv
 	/** Reset the illuminance cache.
 	 */
 	virtual	void	InvalidateIlluminanceCache() = 0;
+	/** Get the cones of the illuminate() statements executed by a light shader.
+	 *
+	 * A light may run several illuminate() statements, and may light points
+	 * in any of their cones.  The cones are only known when the position,
+	 * axis and angle passed to each illuminate() were uniform and all
+	 * shading points were running.
+	 *
+	 * \param cones - returns one cone for each illuminate() statement.
+	 * \return false if the region lit during the last execution isn't known.
+	 */
+	virtual	bool	illuminateCones( std::vector<SqIlluminateCone>& cones ) const = 0;
 	/** Get the current execution state. Bits in the vector indicate which SIMD indexes have passed the current condition.
 	 */
 	virtual	CqBitVector& CurrentState() = 0;
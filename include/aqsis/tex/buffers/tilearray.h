@@ -41,18 +41,20 @@
 
 #include <aqsis/aqsis.h>
 
+#include <algorithm>
+#include <utility>
 #include <vector>
 
-#include <boost/intrusive_ptr.hpp>
+#include <boost/bind/bind.hpp>
 #include <boost/scoped_ptr.hpp>
-#include <boost/scoped_array.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/noncopyable.hpp>
 
-//#include <aqsis/util/memorysentry.h>
 #include <aqsis/tex/io/itiledtexinputfile.h>
 #include <aqsis/tex/buffers/texturebuffer.h>
+#include <aqsis/tex/buffers/tilecache.h>
+#include <aqsis/util/trace.h>
 #include "randomtable.h"
-#include <aqsis/util/smartptr.h>
 
 namespace Aqsis {
 
@@ -83,15 +85,21 @@ class CqTextureTile;
  * iterator mechanism for traversing all pixels within a given region.  This
  * allows for efficient filtering to be performed over the texture, without
  * worrying about the underlying tiled structure.
+ *
+ * Tiles are read from file on demand and held in the global CqTileCache, so
+ * they may be discarded and read again later if the texture memory limit is
+ * reached.  Tiles which are known to be needed soon can be read in the
+ * background by the CqTilePrefetcher using prefetch().
  */
 template<typename T>
-class CqTileArray : boost::noncopyable //, public CqMemoryMonitored
+class CqTileArray : boost::noncopyable
 {
 	private:
 		typedef CqTextureTile<CqTextureBuffer<T> > TqTile;
 	public:
 		class CqIterator;
 		class CqStochasticIterator;
+		class CqPixel;
 
 		typedef CqIterator TqIterator;
 		typedef CqStochasticIterator TqStochasticIterator;
@@ -105,6 +113,8 @@ class CqTileArray : boost::noncopyable //, public CqMemoryMonitored
 		 */
 		CqTileArray(const boost::shared_ptr<IqTiledTexInputFile>& inFile,
 				TqInt subImageIdx);
+		/// Discard the tiles of this array from the tile cache.
+		~CqTileArray();
 
 		//--------------------------------------------------
 		/// \name Access to buffer dimensions & metadata
@@ -127,13 +137,15 @@ class CqTileArray : boost::noncopyable //, public CqMemoryMonitored
 		 *
 		 * Note that this function is not be very efficient, since the correct
 		 * tile has to be deduced for each invocation, which involves two
-		 * integer divisions.
+		 * integer divisions and a tile cache lookup.  The returned pixel holds
+		 * a reference to its tile, so stays valid even if the tile is evicted
+		 * from the cache meanwhile; use the pixel iterators where possible.
 		 *
 		 * \param x - pixel index in width direction (column index)
 		 * \param y - pixel index in height direction (row index)
-		 * \return a lightweight vector holding a reference to the channels data
+		 * \return a lightweight vector onto the channel data of the pixel
 		 */
-		const TqSampleVector operator()(const TqInt x, const TqInt y) const;
+		const CqPixel operator()(const TqInt x, const TqInt y) const;
 		/** \brief Access to pixels through a pixel iterator
 		 *
 		 * The pixel iterator will iterate through all the pixels the provided
@@ -153,13 +165,32 @@ class CqTileArray : boost::noncopyable //, public CqMemoryMonitored
 		 */
 		TqStochasticIterator beginStochastic(const SqFilterSupport& support,
 				TqInt numSamples) const;
+		/** \brief Queue the tiles covering the given supports for loading.
+		 *
+		 * Each tile which isn't resident is requested from the global
+		 * CqTilePrefetcher once, however many supports cover it.  Supports
+		 * are clipped to the array.
+		 *
+		 * \param supports - regions which will be iterated over soon.
+		 * \param numSupports - length of the supports array.
+		 */
+		void prefetch(const SqFilterSupport* supports, TqInt numSupports) const;
 		//@}
 	private:
 		/** \brief Access to the underlying tiles
+		 *
+		 * The tile is looked up in the tile cache, and read from file if it
+		 * isn't resident.
 		 *
 		 * \return The tile holding the underlying data at the given indices.
 		 */
-		boost::intrusive_ptr<TqTile> getTile(const TqInt x, const TqInt y) const;
+		boost::shared_ptr<TqTile> getTile(const TqInt x, const TqInt y) const;
+		/** \brief Read a tile from file and insert it into the tile cache.
+		 *
+		 * If the tile was loaded by another thread while waiting for the
+		 * file, that tile is returned instead.
+		 */
+		boost::shared_ptr<TqTile> loadTile(const TqInt x, const TqInt y) const;
 
 		/// Underlying texture file.
 		boost::shared_ptr<IqTiledTexInputFile> m_inFile;
@@ -179,8 +210,33 @@ class CqTileArray : boost::noncopyable //, public CqMemoryMonitored
 		TqInt m_widthInTiles;
 		/// Height of the array
 		TqInt m_heightInTiles;
-		/// "2D" array of tiles.  Tiles may be founnd in O(1) time using this array.
-		boost::scoped_array<boost::intrusive_ptr<TqTile> > m_tiles;
+		/// Owner id identifying the tiles of this array in the tile cache.
+		TqUint m_cacheOwner;
+};
+
+
+//------------------------------------------------------------------------------
+/** \brief A single pixel of a CqTileArray.
+ *
+ * The pixel shares ownership of its tile, so the channel data it refers to
+ * can't be freed by the tile cache while the pixel is alive.
+ */
+template<typename T>
+class CqTileArray<T>::CqPixel
+{
+	public:
+		/// Get channel \a index of the pixel, as for CqSampleVector.
+		TqFloat operator[](TqInt index) const;
+	private:
+		/// Construct a pixel at position (x,y) of the given tile.
+		CqPixel(const boost::shared_ptr<TqTile>& tile, TqInt x, TqInt y);
+
+		friend class CqTileArray<T>;
+
+		/// Tile holding the pixel data.
+		boost::shared_ptr<TqTile> m_tile;
+		/// View onto the pixel data in m_tile.
+		TqSampleVector m_samples;
 };
 
 
@@ -243,6 +299,8 @@ class CqTileArray<T>::CqIterator
 		/// Current tile y-coordinate
 		TqInt m_tileY;
 
+		/// Current tile; holding it keeps the tile alive if it's evicted.
+		boost::shared_ptr<TqTile> m_currTile;
 		/// Current position in the underlying tiles.
 		TqBaseIter m_currPos;
 
@@ -321,6 +379,8 @@ class CqTileArray<T>::CqStochasticIterator
 		TqFloat m_remainingArea;
 		/// Number of samples remaining for tiles yet to be filtered over.
 		TqInt m_remainingSamples;
+		/// Current tile; holding it keeps the tile alive if it's evicted.
+		boost::shared_ptr<TqTile> m_currTile;
 		/// Current position in the underlying tiles.
 		TqBaseIter m_currPos;
 
@@ -337,14 +397,12 @@ class CqTileArray<T>::CqStochasticIterator
  * the actual pixels.  ArrayT should be a model of FilterableArrayConcept to
  * provide pixel iterators to iterate over the contained pixels.
  *
- * The wrapper adds two things to the underlying array:
- *   - Adjust the origin of the array to some point (x0, y0)
- *   - Facilities to enable being held by a tiled array (intrusive reference
- *     counting, and support for determining recent usage for tile cache
- *     rejection (FIXME coming soon) )
+ * The wrapper adjusts the origin of the array to some point (x0, y0).  Tiles
+ * are shared between threads through the tile cache, so they are held by
+ * boost::shared_ptr, which has a thread safe reference count.
  */
 template<typename ArrayT>
-class CqTextureTile : public CqIntrusivePtrCounted
+class CqTextureTile : boost::noncopyable
 {
 	private:
 		/// Underlying array of pixels
@@ -487,9 +545,16 @@ CqTileArray<T>::CqTileArray(const boost::shared_ptr<IqTiledTexInputFile>& inFile
 	m_tileHeight(inFile->tileInfo().height),
 	m_widthInTiles((m_width-1)/m_tileWidth + 1), // "ceil(m_width/m_tileWidth)"
 	m_heightInTiles((m_height-1)/m_tileHeight + 1),
-	m_tiles(new boost::intrusive_ptr<TqTile>[m_widthInTiles*m_heightInTiles])
+	m_cacheOwner(CqTileCache::instance().newOwner())
 { }
 
+template<typename T>
+CqTileArray<T>::~CqTileArray()
+{
+	CqTilePrefetcher::instance().removeOwner(m_cacheOwner);
+	CqTileCache::instance().removeOwner(m_cacheOwner);
+}
+
 template<typename T>
 inline TqInt CqTileArray<T>::width() const
 {
@@ -509,10 +574,10 @@ inline TqInt CqTileArray<T>::numChannels() const
 }
 
 template<typename T>
-const typename CqTileArray<T>::TqSampleVector
+const typename CqTileArray<T>::CqPixel
 CqTileArray<T>::operator()(const TqInt x, const TqInt y) const
 {
-	return (*getTile(x/m_tileWidth, y/m_tileHeight))(x,y);
+	return CqPixel(getTile(x/m_tileWidth, y/m_tileHeight), x, y);
 }
 
 template<typename T>
@@ -532,22 +597,96 @@ inline typename CqTileArray<T>::TqStochasticIterator CqTileArray<T>::beginStocha
 }
 
 template<typename T>
-boost::intrusive_ptr<typename CqTileArray<T>::TqTile> CqTileArray<T>::getTile(
+void CqTileArray<T>::prefetch(const SqFilterSupport* supports,
+		TqInt numSupports) const
+{
+	CqTilePrefetcher& prefetcher = CqTilePrefetcher::instance();
+	if(!prefetcher.enabled())
+		return;
+	// Collect the tiles covered, ordered by row so that they're read in
+	// roughly file order.
+	std::vector<std::pair<TqInt,TqInt> > tiles;
+	const SqFilterSupport bounds(0,m_width, 0,m_height);
+	for(TqInt i = 0; i < numSupports; ++i)
+	{
+		SqFilterSupport support = intersect(supports[i], bounds);
+		if(support.isEmpty())
+			continue;
+		TqInt tileXEnd = (support.sx.end-1)/m_tileWidth + 1;
+		TqInt tileYEnd = (support.sy.end-1)/m_tileHeight + 1;
+		for(TqInt y = support.sy.start/m_tileHeight; y < tileYEnd; ++y)
+			for(TqInt x = support.sx.start/m_tileWidth; x < tileXEnd; ++x)
+				tiles.push_back(std::make_pair(y, x));
+	}
+	std::sort(tiles.begin(), tiles.end());
+	tiles.erase(std::unique(tiles.begin(), tiles.end()), tiles.end());
+	CqTileCache& cache = CqTileCache::instance();
+	for(TqInt i = 0, end = tiles.size(); i < end; ++i)
+	{
+		SqTileKey key(m_cacheOwner, tiles[i].second, tiles[i].first);
+		// This also marks resident tiles as recently used, so they aren't
+		// evicted before the grid gets to them.
+		if(!cache.find(key, false))
+		{
+			prefetcher.request(key, boost::bind(&CqTileArray<T>::loadTile,
+						this, key.x, key.y));
+		}
+	}
+}
+
+template<typename T>
+boost::shared_ptr<typename CqTileArray<T>::TqTile> CqTileArray<T>::getTile(
 		const TqInt x, const TqInt y) const
 {
 	assert(x < m_widthInTiles);
 	assert(y < m_heightInTiles);
-	boost::intrusive_ptr<TqTile>& tilePtr = m_tiles[y*m_widthInTiles + x];
-	if(!tilePtr)
+	boost::shared_ptr<TqTile> tile = boost::static_pointer_cast<TqTile>(
+			CqTileCache::instance().find(SqTileKey(m_cacheOwner, x, y)));
+	if(!tile)
+		tile = loadTile(x, y);
+	return tile;
+}
+
+template<typename T>
+boost::shared_ptr<typename CqTileArray<T>::TqTile> CqTileArray<T>::loadTile(
+		const TqInt x, const TqInt y) const
+{
+	CqTileCache& cache = CqTileCache::instance();
+	SqTileKey key(m_cacheOwner, x, y);
+	// The tile is inserted before the file is released, so that a thread
+	// waiting for the same tile finds it in the cache.
+	CqTileCache::CqReadLock lock(m_inFile.get());
+	boost::shared_ptr<TqTile> tile
+		= boost::static_pointer_cast<TqTile>(cache.find(key, false));
+	if(tile)
+		return tile;
+	tile.reset(new TqTile(x*m_tileWidth, y*m_tileHeight));
 	{
-		tilePtr = boost::intrusive_ptr<TqTile>(
-				new TqTile(x*m_tileWidth, y*m_tileHeight));
-		m_inFile->readTile(tilePtr->pixels(), x, y, m_subImageIdx);
+		AQSIS_TRACE_SCOPE_XY("Read_texture_tile", x, y);
+		m_inFile->readTile(tile->pixels(), x, y, m_subImageIdx);
 	}
-	return tilePtr;
+	const CqTextureBuffer<T>& pixels = tile->pixels();
+	std::size_t size = sizeof(T)*pixels.width()*pixels.height()
+		*pixels.numChannels();
+	return boost::static_pointer_cast<TqTile>(cache.insert(key, tile, size));
 }
 
 
+//------------------------------------------------------------------------------
+// CqTileArray::CqPixel implementation
+template<typename T>
+inline CqTileArray<T>::CqPixel::CqPixel(const boost::shared_ptr<TqTile>& tile,
+		TqInt x, TqInt y)
+	: m_tile(tile),
+	m_samples((*tile)(x,y))
+{ }
+
+template<typename T>
+inline TqFloat CqTileArray<T>::CqPixel::operator[](TqInt index) const
+{
+	return m_samples[index];
+}
+
 //------------------------------------------------------------------------------
 // CqTileArray::CqIterator implementation
 template<typename T>
@@ -578,7 +717,8 @@ void CqTileArray<T>::CqIterator::nextTile()
 	{
 		// Grab the next tile as long as we're within the overall
 		// filter support.
-		m_currPos = m_tileArray->getTile(m_tileX,m_tileY)->begin(m_support);
+		m_currTile = m_tileArray->getTile(m_tileX,m_tileY);
+		m_currPos = m_currTile->begin(m_support);
 	}
 }
 
@@ -619,8 +759,9 @@ CqTileArray<T>::CqIterator::CqIterator(const CqTileArray<T>& tileArray,
 	m_tileY(support.sy.start/tileArray.m_tileHeight),
 	// Check support.sx.empty() etc in order to make sure the tile
 	// index is still valid when the support is outside the buffer
-	m_currPos(m_tileArray->getTile(support.sx.isEmpty() ? 0 : m_tileX,
-				support.sy.isEmpty() ? 0 : m_tileY)->begin(m_support))
+	m_currTile(m_tileArray->getTile(support.sx.isEmpty() ? 0 : m_tileX,
+				support.sy.isEmpty() ? 0 : m_tileY)),
+	m_currPos(m_currTile->begin(m_support))
 {
 	// Make sure that inSupport() works correctly when the support is empty.
 	if(support.isEmpty())
@@ -689,8 +830,8 @@ void CqTileArray<T>::CqStochasticIterator::nextTile()
 		m_remainingArea -= area;
 	}
 	// Grab the underlying iterator for the next tile
-	m_currPos = m_tileArray->getTile(m_tileX,m_tileY)->beginStochastic(m_support,
-			numSamples);
+	m_currTile = m_tileArray->getTile(m_tileX,m_tileY);
+	m_currPos = m_currTile->beginStochastic(m_support, numSamples);
 	m_remainingSamples -= numSamples;
 }
 
@@ -731,6 +872,7 @@ CqTileArray<T>::CqStochasticIterator::CqStochasticIterator(const CqTileArray<T>&
 	m_tileY(support.sy.start/tileArray.m_tileHeight),
 	m_remainingArea(support.area()),
 	m_remainingSamples(numSamps),
+	m_currTile(),
 	m_currPos()
 {
 	// Make sure that inSupport() works correctly when the support region is
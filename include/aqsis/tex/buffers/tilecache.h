@@ -0,0 +1,263 @@
+// Aqsis
+// Copyright (C) 2001, Paul C. Gregory and the other authors and contributors
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// * Neither the name of the software's owners nor the names of its
+//   contributors may be used to endorse or promote products derived from this
+//   software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+// (This is the New BSD license)
+
+/**
+ * \file
+ *
+ * \brief Declare a global, memory-bounded cache for texture tiles.
+ */
+
+#ifndef TILECACHE_H_INCLUDED
+#define TILECACHE_H_INCLUDED
+
+#include <aqsis/aqsis.h>
+
+#include <cstddef>
+
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/scoped_array.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+
+namespace Aqsis {
+
+//------------------------------------------------------------------------------
+/// Key identifying a tile held in a CqTileCache.
+struct SqTileKey
+{
+	/// Id of the owning tile array, as returned by CqTileCache::newOwner().
+	TqUint owner;
+	/// Tile x-coordinate, in tiles.
+	TqInt x;
+	/// Tile y-coordinate, in tiles.
+	TqInt y;
+
+	SqTileKey(TqUint owner, TqInt x, TqInt y)
+		: owner(owner), x(x), y(y)
+	{ }
+
+	bool operator<(const SqTileKey& rhs) const
+	{
+		if(owner != rhs.owner)
+			return owner < rhs.owner;
+		if(y != rhs.y)
+			return y < rhs.y;
+		return x < rhs.x;
+	}
+};
+
+/// Counters describing the behaviour of a CqTileCache.
+struct SqTileCacheStats
+{
+	TqUlong hits;				///< Lookups which found a resident tile
+	TqUlong misses;				///< Lookups which had to read the tile from file
+	TqUlong evictions;			///< Tiles discarded to stay under the memory limit
+	std::size_t memoryUsed;		///< Bytes of tile data currently resident
+	std::size_t peakMemory;		///< Largest value of memoryUsed seen
+
+	SqTileCacheStats()
+		: hits(0), misses(0), evictions(0), memoryUsed(0), peakMemory(0)
+	{ }
+};
+
+
+//------------------------------------------------------------------------------
+/** \brief A cache of texture tiles with a bound on the total memory used.
+ *
+ * All tiled texture data (see CqTileArray) is held in a single process-wide
+ * instance of this cache so that the memory ceiling applies to all textures
+ * together.  Each tile array registers itself as an owner, which identifies
+ * the file and mipmap level; tiles are then keyed by owner and tile position.
+ *
+ * The cache is split into a number of stripes, each with its own lock, LRU
+ * list and a share of the memory budget, so that lookups from different
+ * threads rarely contend.  When inserting a tile would take a stripe over its
+ * budget the least recently used tiles of that stripe are discarded.  Tiles
+ * are held by shared pointer, so a discarded tile stays alive for as long as
+ * a pixel iterator is still using it.
+ */
+class AQSIS_TEX_SHARE CqTileCache : boost::noncopyable
+{
+	public:
+		/// Type-erased pointer to a tile
+		typedef boost::shared_ptr<void> TqTilePtr;
+
+		/** \brief Construct an empty cache
+		 *
+		 * \param maxMemory - memory ceiling for tile data in bytes.
+		 */
+		CqTileCache(std::size_t maxMemory);
+		~CqTileCache();
+
+		/// Get the global cache used by all tile arrays.
+		static CqTileCache& instance();
+
+		/** \brief Set the memory ceiling.
+		 *
+		 * Tiles over the new limit are discarded lazily, as new tiles are
+		 * inserted.
+		 */
+		void setMaxMemory(std::size_t maxMemory);
+		/// Get the memory ceiling in bytes.
+		std::size_t maxMemory() const;
+
+		/// Allocate a new owner id for a tile array.
+		TqUint newOwner();
+		/** \brief Discard all tiles belonging to the given owner.
+		 *
+		 * Tile arrays call this on destruction, since their tiles can no
+		 * longer be looked up.
+		 */
+		void removeOwner(TqUint owner);
+
+		/** \brief Look up a tile
+		 *
+		 * \param key - key for the tile
+		 * \param countLookup - if false, the lookup isn't recorded in the hit
+		 *                      and miss counters.
+		 * \return the tile, or a null pointer if it's not resident.
+		 */
+		TqTilePtr find(const SqTileKey& key, bool countLookup = true);
+		/** \brief Insert a newly loaded tile.
+		 *
+		 * If another thread has inserted the same tile in the meantime the
+		 * existing tile is kept and returned instead.
+		 *
+		 * \param key - key for the tile
+		 * \param tile - tile data
+		 * \param size - memory used by the tile in bytes
+		 * \return the resident tile for the key.
+		 */
+		TqTilePtr insert(const SqTileKey& key, const TqTilePtr& tile,
+				std::size_t size);
+		/// Discard all tiles.
+		void clear();
+
+		/// Get the current values of the cache counters.
+		SqTileCacheStats stats() const;
+		/// Reset the hit, miss and eviction counters.
+		void resetStats();
+
+		/** \brief Lock serialising reads from a texture file.
+		 *
+		 * The texture file readers aren't thread safe, so tile loads from a
+		 * given file need to be serialised.  The locks are striped by file
+		 * address.
+		 */
+		class AQSIS_TEX_SHARE CqReadLock : boost::noncopyable
+		{
+			public:
+				CqReadLock(const void* file);
+				~CqReadLock();
+			private:
+				TqInt m_index;
+		};
+
+	private:
+		struct SqStripe;
+
+		/// Number of independently locked parts of the cache.
+		static const TqInt m_numStripes = 16;
+
+		SqStripe& stripeFor(const SqTileKey& key) const;
+
+		/// Cache stripes
+		boost::scoped_array<SqStripe> m_stripes;
+		/// Memory ceiling in bytes, read and written under a lock.
+		std::size_t m_maxMemory;
+		/// Next owner id to hand out.
+		TqUint m_nextOwner;
+};
+
+
+//------------------------------------------------------------------------------
+/** \brief Pool of threads which load texture tiles ahead of use.
+ *
+ * Shadeops know the regions a whole grid will filter over before they start
+ * sampling, so the tiles covering them can be queued here and read from disk
+ * in the background rather than stalling the shading thread one tile at a
+ * time.
+ *
+ * Requests are only hints.  Tiles which are already queued aren't queued
+ * again, new requests are dropped while the queue is full, and a tile needed
+ * before a thread gets to it is simply read on demand.  The loaders take the
+ * file's CqTileCache::CqReadLock, so a shading thread which wants a tile that
+ * is being prefetched waits for the read instead of repeating it.
+ */
+class AQSIS_TEX_SHARE CqTilePrefetcher : boost::noncopyable
+{
+	public:
+		/// Function which reads a tile into the tile cache.
+		typedef boost::function<void ()> TqLoadFunc;
+
+		CqTilePrefetcher();
+		/// Stop the prefetch threads, discarding any queued requests.
+		~CqTilePrefetcher();
+
+		/// Get the global prefetcher used by all tile arrays.
+		static CqTilePrefetcher& instance();
+
+		/** \brief Set the number of prefetch threads.
+		 *
+		 * Threads are started when the first request arrives.  Zero disables
+		 * prefetching, as does building without threading support.
+		 */
+		void setNumThreads(TqInt numThreads);
+		/// Check whether requests will be acted on.
+		bool enabled() const;
+
+		/** \brief Queue a tile to be loaded.
+		 *
+		 * \param key - key of the tile in the tile cache
+		 * \param load - function which reads the tile into the cache.  It may
+		 *               be called on any thread until removeOwner() is called
+		 *               for key.owner.
+		 */
+		void request(const SqTileKey& key, const TqLoadFunc& load);
+		/** \brief Discard queued requests for the given owner.
+		 *
+		 * Waits for any of the owner's tiles which are being loaded, after
+		 * which none of its load functions will be called.
+		 */
+		void removeOwner(TqUint owner);
+
+	private:
+		struct SqState;
+
+		/// Number of threads to use, guarded by the mutex in m_state.
+		TqInt m_numThreads;
+		/// Request queue and threads.
+		boost::scoped_ptr<SqState> m_state;
+};
+
+} // namespace Aqsis
+
+#endif // TILECACHE_H_INCLUDED
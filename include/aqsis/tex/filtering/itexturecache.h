@@ -91,6 +91,14 @@ struct AQSIS_TEX_SHARE IqTextureCache
 	//--------------------------------------------------
 	/// Delete all textures from the cache
 	virtual void flush() = 0;
+	/** \brief Delete a single texture from the cache
+	 *
+	 * Used when a texture file has been rewritten during the render, so that
+	 * the next lookup reads the new file while other textures stay cached.
+	 *
+	 * \param name - the texture file name, as passed to the find functions.
+	 */
+	virtual void flush(const char* name) = 0;
 
 	/** \brief Return the texture file attributes for the named file.
 	 *
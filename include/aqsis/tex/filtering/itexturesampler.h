@@ -103,6 +103,22 @@ class AQSIS_TEX_SHARE IqTextureSampler
 		 */
 		virtual const CqTextureSampleOptions& defaultSampleOptions() const;
 
+		/** \brief Start loading the texture data needed to sample some regions.
+		 *
+		 * Shadeops pass the filter regions of a whole grid here before
+		 * sampling them one at a time, so that texture tiles can be read in
+		 * the background rather than when the filter first touches them.
+		 * This is only a hint, and the default implementation does nothing.
+		 *
+		 * \param samplePllgrams - regions which will be sampled
+		 * \param sampleOpts - options each region will be sampled with,
+		 *                     parallel to samplePllgrams.  The wrap modes
+		 *                     are taken from the first.
+		 * \param numPllgrams - length of the samplePllgrams array
+		 */
+		virtual void prefetch(const SqSamplePllgram* samplePllgrams,
+				const CqTextureSampleOptions* sampleOpts, TqInt numPllgrams) const;
+
 		//--------------------------------------------------
 		/// \name Factory functions
 		//@{
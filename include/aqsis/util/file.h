@@ -110,6 +110,31 @@ AQSIS_UTIL_SHARE std::vector<std::string> Glob(const std::string& pattern);
  */
 AQSIS_UTIL_SHARE std::vector<std::string> cliGlob(const std::string& pattern);
 
+/** \brief Get a name for a temporary file to write in place of another.
+ *
+ * The name is built from fileName, the process id and a counter, so several
+ * processes or threads writing the same file at once each get their own
+ * temporary file in the same directory.  Use replaceFile() to move it into
+ * place when it's complete.
+ *
+ * \param fileName - name of the file which will eventually be written.
+ */
+AQSIS_UTIL_SHARE std::string uniqueTempName(const std::string& fileName);
+
+/** \brief Move a completed temporary file over another file.
+ *
+ * On posix the rename replaces fileName atomically, so readers see either
+ * the old file or the new one, never a missing or partial file.  Windows
+ * can't rename over an existing file, so the old file is removed first
+ * there.  On failure the temporary file is removed.
+ *
+ * \param tmpName - temporary file, usually from uniqueTempName().
+ * \param fileName - file to replace.
+ * \return true if the file was replaced.
+ */
+AQSIS_UTIL_SHARE bool replaceFile(const std::string& tmpName,
+		const std::string& fileName);
+
 
 /** \brief Splits a list of paths delimited by ';' or ':' into tokens.
  *
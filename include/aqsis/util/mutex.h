@@ -0,0 +1,60 @@
+// Aqsis
+// Copyright (C) 1997 - 2001, Paul C. Gregory
+//
+// Contact: pgregory@aqsis.org
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation; either
+// version 2 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+/** \file
+		\brief Declares TqMutex and TqMutexLock, which compile to nothing when
+		threading is disabled.
+*/
+
+#ifndef MUTEX_H_INCLUDED
+#define MUTEX_H_INCLUDED 1
+
+#include <aqsis/aqsis.h>
+
+#ifdef ENABLE_THREADING
+#include <boost/thread/mutex.hpp>
+#endif
+
+namespace Aqsis {
+
+#ifdef ENABLE_THREADING
+typedef boost::mutex TqMutex;
+typedef boost::mutex::scoped_lock TqMutexLock;
+#else
+/// Placeholder mutex used when threading support is compiled out.
+class CqNullMutex
+{
+	public:
+		void lock() {}
+		void unlock() {}
+};
+/// Placeholder lock used when threading support is compiled out.
+class CqNullMutexLock
+{
+	public:
+		CqNullMutexLock(CqNullMutex&) {}
+};
+typedef CqNullMutex TqMutex;
+typedef CqNullMutexLock TqMutexLock;
+#endif
+
+} // namespace Aqsis
+
+#endif // MUTEX_H_INCLUDED
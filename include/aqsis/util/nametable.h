@@ -0,0 +1,61 @@
+// Aqsis
+// Copyright (C) 1997 - 2001, Paul C. Gregory
+//
+// Contact: pgregory@aqsis.org
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation; either
+// version 2 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+/** \file
+		\brief Declares CqNameTable, which maps names to small integer ids.
+*/
+
+#ifndef NAMETABLE_H_INCLUDED
+#define NAMETABLE_H_INCLUDED 1
+
+#include <aqsis/aqsis.h>
+
+namespace Aqsis {
+
+//----------------------------------------------------------------------
+/** \brief Global table of interned names.
+ *
+ * Each distinct name is given a small integer id the first time it is
+ * interned, counting up from zero.  The ids are stable for the lifetime of
+ * the program, so they can be used to index arrays in place of string
+ * lookups in maps.
+ *
+ * When threading is enabled the table is locked, so names may be interned
+ * from any thread.  Hot paths should still intern their names once up front
+ * and keep the ids rather than looking names up repeatedly.
+ */
+class AQSIS_UTIL_SHARE CqNameTable
+{
+	public:
+		/** \brief Get the id for a name, adding the name if necessary.
+		 */
+		static TqInt intern(const char* name);
+		/** \brief Get the id for a name which has already been interned.
+		 *
+		 * \return the id, or -1 if the name has never been interned.
+		 */
+		static TqInt find(const char* name);
+		/// Get the number of names which have been interned.
+		static TqInt size();
+};
+
+} // namespace Aqsis
+
+#endif // NAMETABLE_H_INCLUDED
@@ -0,0 +1,135 @@
+// Aqsis
+// Copyright (C) 1997 - 2001, Paul C. Gregory
+//
+// Contact: pgregory@aqsis.org
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation; either
+// version 2 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+/** \file
+ * \brief Per-thread wall clock tracing of renderer operations.
+ *
+ * The timers in timer.h accumulate process CPU time into global totals, which
+ * says little about where the time goes when buckets are rendered on several
+ * threads.  Tracing instead records the wall clock start and end time of each
+ * traced scope in a ring buffer belonging to the thread which ran it.  The
+ * events can be written out in the Chrome trace event format, which can be
+ * loaded into chrome://tracing or Perfetto to show a timeline per thread.
+ *
+ * Tracing is switched off by default; a disabled trace scope costs a single
+ * test of a global flag.
+ */
+
+#ifndef TRACE_H_INCLUDED
+#define TRACE_H_INCLUDED
+
+#include <aqsis/aqsis.h>
+
+#include <iosfwd>
+
+#include <boost/cstdint.hpp>
+
+namespace Aqsis {
+
+/** \brief Flag indicating whether tracing is switched on.
+ *
+ * Use enableTracing() to set it.  The flag is read without any locking, so
+ * it must only change while no other threads are tracing; see
+ * enableTracing().
+ */
+extern AQSIS_UTIL_SHARE bool g_tracingEnabled;
+
+/** \brief Switch tracing on or off.
+ *
+ * Switching tracing on discards any previously recorded events and starts the
+ * trace clock from zero.
+ *
+ * This isn't synchronised with threads which are tracing scopes, so it must
+ * only be called between frames, while no rendering threads are running.
+ * The renderer switches tracing on at WorldBegin and off at WorldEnd once the
+ * frame is finished; threads started during the frame see the flag as it was
+ * when they were started.
+ *
+ * \param enabled - true to record traced scopes.
+ * \param bufferSize - number of events held by each thread; once a thread's
+ *                     buffer is full its oldest events are overwritten.
+ */
+AQSIS_UTIL_SHARE void enableTracing(bool enabled, TqInt bufferSize = 1 << 17);
+
+/// Return the time since tracing was switched on, in microseconds.
+AQSIS_UTIL_SHARE boost::uint64_t traceTime();
+
+/** \brief Record a traced event on the current thread.
+ *
+ * \param name - name of the event.  Only the pointer is stored, so this
+ *               should be a string literal.
+ * \param start - start time of the event, from traceTime().
+ * \param end - end time of the event, from traceTime().
+ * \param x, y - coordinates of the bucket or tile the event worked on, or -1
+ *               if there are none.
+ */
+AQSIS_UTIL_SHARE void traceEvent(const char* name, boost::uint64_t start,
+		boost::uint64_t end, TqInt x = -1, TqInt y = -1);
+
+/** \brief Write out the recorded events and clear them.
+ *
+ * The events are written as a JSON object in the Chrome trace event format,
+ * with a separate track for each thread which recorded events.
+ *
+ * \param out - stream to write to.
+ */
+AQSIS_UTIL_SHARE void writeTrace(std::ostream& out);
+
+
+//------------------------------------------------------------------------------
+/** \brief Record the time spent in a scope as a trace event.
+ *
+ * Nothing is recorded if tracing was switched off when the scope was entered.
+ */
+class CqTraceScope
+{
+	public:
+		/** \brief Start tracing a scope.
+		 *
+		 * \param name - name of the event, which should be a string literal.
+		 * \param x, y - optional bucket or tile coordinates.
+		 */
+		CqTraceScope(const char* name, TqInt x = -1, TqInt y = -1)
+			: m_name(g_tracingEnabled ? name : 0),
+			m_x(x),
+			m_y(y),
+			m_start(m_name ? traceTime() : 0)
+		{ }
+		~CqTraceScope()
+		{
+			if(m_name)
+				traceEvent(m_name, m_start, traceTime(), m_x, m_y);
+		}
+
+	private:
+		const char* m_name;
+		TqInt m_x;
+		TqInt m_y;
+		boost::uint64_t m_start;
+};
+
+} // namespace Aqsis
+
+/// Trace the time spent in the current scope under the given name.
+#define AQSIS_TRACE_SCOPE(name) Aqsis::CqTraceScope aq_trace_scope__(name)
+/// Trace the time spent in the current scope, tagged with bucket or tile coordinates.
+#define AQSIS_TRACE_SCOPE_XY(name, x, y) \
+	Aqsis::CqTraceScope aq_trace_scope__(name, x, y)
+
+#endif // TRACE_H_INCLUDED
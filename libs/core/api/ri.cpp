@@ -60,7 +60,9 @@
 #include	<aqsis/util/logging.h>
 #include	<aqsis/util/logging_streambufs.h>
 #include	<aqsis/util/smartptr.h>
+#include	<aqsis/util/trace.h>
 #include	<aqsis/tex/maketexture.h>
+#include	<aqsis/tex/buffers/tilecache.h>
 #include	"stats.h"
 #include	<aqsis/math/random.h>
 #include	"../../riutil/errorhandlerimpl.h"
@@ -627,6 +629,40 @@ RtVoid RiCxxCore::WorldBegin()
 	QGetRenderContext()->matSpaceToSpace("current", "world", NULL, NULL, 0, currToWorldMat);
 	QGetRenderContext()->textureCache().setCurrToWorldMatrix(currToWorldMat);
 
+	// Set the memory limit for texture tiles; the option is in kB.
+	std::size_t textureMemory = 1024*1024;
+	const TqInt* poptTexMem = QGetRenderContext()->poptCurrent()->GetIntegerOption( "limits", "texturememory" );
+	if( poptTexMem && poptTexMem[0] > 0 )
+		textureMemory = poptTexMem[0];
+	CqTileCache::instance().setMaxMemory(textureMemory*1024);
+	CqTileCache::instance().resetStats();
+	// Threads loading texture tiles ahead of the shadeops which need them.
+	// Off unless asked for, since it only pays when textures miss the cache.
+	TqInt texturePrefetchThreads = 0;
+	const TqInt* poptTexPrefetch = QGetRenderContext()->poptCurrent()->GetIntegerOption( "limits", "textureprefetchthreads" );
+	if( poptTexPrefetch )
+		texturePrefetchThreads = poptTexPrefetch[0];
+	CqTilePrefetcher::instance().setNumThreads(texturePrefetchThreads);
+
+	// Open the cache of diced grids if one is named; the size is in kB.  New
+	// grids are held in memory until WorldEnd, so the size also bounds the
+	// extra memory used by the cache.
+	const CqString* poptDiceCache = QGetRenderContext()->poptCurrent()->GetStringOption( "render", "dicecache" );
+	if( poptDiceCache && !poptDiceCache[0].empty() )
+	{
+		std::size_t diceCacheSize = 1024*1024;
+		const TqInt* poptDiceCacheSize = QGetRenderContext()->poptCurrent()->GetIntegerOption( "limits", "dicecachesize" );
+		if( poptDiceCacheSize && poptDiceCacheSize[0] > 0 )
+			diceCacheSize = poptDiceCacheSize[0];
+		QGetRenderContext()->diceCache().open( poptDiceCache[0], diceCacheSize*1024 );
+	}
+
+	// Start tracing if a trace file is named; the trace is written at the end
+	// of the world.
+	const CqString* poptTraceFile = QGetRenderContext()->poptCurrent()->GetStringOption( "statistics", "tracefile" );
+	if( poptTraceFile && !poptTraceFile[0].empty() )
+		enableTracing( true );
+
 	// Reset the current transformation to identity, this now represents the object-->world transform.
 	QGetRenderContext() ->ptransSetTime( CqMatrix() );
 
@@ -657,6 +693,10 @@ RtVoid RiCxxCore::WorldBegin()
 	QGetRenderContext()->initialiseCropWindow();
 	QGetRenderContext()->pImage()->SetImage();
 
+	// Start a fresh raytracing database for this world.
+	if(QGetRenderContext()->pRaytracer())
+		QGetRenderContext()->pRaytracer()->Initialise();
+
 	CqRandom().Reseed('a'+'q'+'s'+'i'+'s');
 }
 
@@ -667,6 +707,11 @@ RtVoid RiCxxCore::WorldBegin()
 
 RtVoid RiCxxCore::WorldEnd()
 {
+	// Finalise the raytracer database now that all primitives are in, so
+	// that it's available to the shadow passes as well as the main render.
+	if(QGetRenderContext()->pRaytracer())
+		QGetRenderContext()->pRaytracer()->Finalise();
+
 	QGetRenderContext()->RenderAutoShadows();
 
 	bool fFailed = false;
@@ -681,13 +726,10 @@ RtVoid RiCxxCore::WorldEnd()
 	if( NULL != poptGridSize )
 		QGetRenderContext() ->poptWriteCurrent()->GetFloatOptionWrite( "System", "SqrtGridSize" )[0] = sqrt( static_cast<float>(poptGridSize[0]) );
 
-	// Finalise the raytracer database now that all primitives are in.
-	if(QGetRenderContext()->pRaytracer())
-		QGetRenderContext()->pRaytracer()->Finalise();
-
 	// Render the world
 	try
 	{
+		AQSIS_TRACE_SCOPE("Render_world");
 		QGetRenderContext() ->RenderWorld();
 	}
 	catch ( CqString strError )
@@ -696,6 +738,9 @@ RtVoid RiCxxCore::WorldEnd()
 		fFailed = true;
 	}
 
+	// Save any newly diced grids.
+	QGetRenderContext()->diceCache().close();
+
 	// Remove all cached textures.
 	QGetRenderContext()->textureCache().flush();
 
@@ -708,6 +753,21 @@ RtVoid RiCxxCore::WorldEnd()
 	// Stop the frame timer
 	AQSIS_TIMER_STOP(Frame);
 
+	// Write out the trace of the world, if one was requested.
+	if( g_tracingEnabled )
+	{
+		const CqString* poptTraceFile = QGetRenderContext()->poptCurrent()->GetStringOption( "statistics", "tracefile" );
+		if( poptTraceFile && !poptTraceFile[0].empty() )
+		{
+			std::ofstream traceFile( poptTraceFile[0].c_str() );
+			writeTrace( traceFile );
+			if( !traceFile )
+				Aqsis::log() << error << "Could not write trace file \""
+					<< poptTraceFile[0] << "\"" << std::endl;
+		}
+		enableTracing( false );
+	}
+
 	if ( !fFailed )
 	{
 		// Get the verbosity level from the options..
@@ -3322,7 +3382,7 @@ RtVoid RiCxxCore::SubdivisionMesh(RtConstToken scheme, const IntArray& nvertices
 			pPointsClass->Transform( matOtoW, matNOtoW, matVOtoW);
 
 			boost::shared_ptr<CqSubdivision2> pSubd2( new CqSubdivision2( pPointsClass ) );
-			pSubd2->Prepare( cVerts );
+			pSubd2->Prepare( cVerts, nfaces, sumnVerts );
 
 			boost::shared_ptr<CqSurfaceSubdivisionMesh> pMesh( new CqSurfaceSubdivisionMesh(pSubd2, nfaces ) );
 
@@ -3425,13 +3485,12 @@ RtVoid RiCxxCore::SubdivisionMesh(RtConstToken scheme, const IntArray& nvertices
 RtVoid RiCxxCore::ReadArchive(RtConstToken name, RtArchiveCallback callback, const ParamList& pList)
 {
 	// Open the archive file
-	boost::filesystem::ifstream archiveFile(
-			QGetRenderContext()->poptCurrent()->findRiFile(name, "archive"),
-			std::ios::binary);
+	boost::shared_ptr<std::istream> archiveFile = RibParser::openFile(native(
+			QGetRenderContext()->poptCurrent()->findRiFile(name, "archive")));
 	// Parse the archive
 	RtArchiveCallback savedCallback = m_archiveCallback;
 	m_archiveCallback = callback;
-	m_apiServices.parseRib(archiveFile, name);
+	m_apiServices.parseRib(*archiveFile, name);
 	m_archiveCallback = savedCallback;
 }
 
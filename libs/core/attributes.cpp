@@ -347,6 +347,60 @@ CqColor* CqAttributes::GetColorAttributeWrite( const char* strName, const char*
 }
 
 
+//---------------------------------------------------------------------
+/** \name Attribute access by interned key
+ * These are equivalent to the versions taking attribute and parameter names,
+ * but avoid any string lookups.
+ */
+//@{
+
+const TqFloat* CqAttributes::GetFloatAttribute( const CqParameterKey& key ) const
+{
+	const CqParameter * pParam = pParameter( key );
+	if ( pParam != 0 && pParam->Type() == type_float )
+		return ( static_cast<const CqParameterTyped<TqFloat, TqFloat>*>( pParam ) ->pValue() );
+	else
+		return ( 0 );
+}
+
+const TqInt* CqAttributes::GetIntegerAttribute( const CqParameterKey& key ) const
+{
+	const CqParameter * pParam = pParameter( key );
+	if ( pParam != 0 && pParam->Type() == type_integer )
+		return ( static_cast<const CqParameterTyped<TqInt, TqFloat>*>( pParam ) ->pValue() );
+	else
+		return ( 0 );
+}
+
+const CqString* CqAttributes::GetStringAttribute( const CqParameterKey& key ) const
+{
+	const CqParameter * pParam = pParameter( key );
+	if ( pParam != 0 && pParam->Type() == type_string )
+		return ( static_cast<const CqParameterTyped<CqString, CqString>*>( pParam ) ->pValue() );
+	else
+		return ( 0 );
+}
+
+const CqColor* CqAttributes::GetColorAttribute( const CqParameterKey& key ) const
+{
+	const CqParameter * pParam = pParameter( key );
+	if ( pParam != 0 && pParam->Type() == type_color )
+		return ( static_cast<const CqParameterTyped<CqColor, CqColor>*>( pParam ) ->pValue() );
+	else
+		return ( 0 );
+}
+
+const TqInt CqAttributes::GetIntegerAttributeDef( const CqParameterKey& key, TqInt defaultVal ) const
+{
+	const TqInt* attr = GetIntegerAttribute(key);
+	if(attr)
+		return *attr;
+	return defaultVal;
+}
+
+//@}
+
+
 //---------------------------------------------------------------------
 /** Get a matrix system attribute parameter.
  * \param strName The name of the attribute.
@@ -243,6 +243,14 @@ class CqAttributes : public IqAttributes, public boost::enable_shared_from_this<
 
 		const	CqParameter* pParameter( const char* strName, const char* strParam ) const;
 		CqParameter* pParameterWrite( const char* strName, const char* strParam );
+		/** Get a read only pointer to an attribute parameter using an interned key.
+		 * \return A pointer to the parameter, or 0 if not found.
+		 */
+		const	CqParameter* pParameter( const CqParameterKey& key ) const
+		{
+			const CqNamedParameterList* pList = m_aAttributes.Find( key.nameId() );
+			return ( pList ? pList->pParameter( key ) : 0 );
+		}
 
 		virtual const	IqParameter* GetAttribute( const char* strName, const char* strParam ) const;
 		virtual IqParameter* GetAttributeWrite( const char* strName, const char* strParam );
@@ -258,6 +266,13 @@ class CqAttributes : public IqAttributes, public boost::enable_shared_from_this<
 
 		virtual const	TqInt	GetIntegerAttributeDef( const char* strName, const char* strParam, TqInt defaultVal) const;
 
+		virtual const	IqParameter* GetAttribute( const CqParameterKey& key ) const;
+		virtual const	TqFloat*	GetFloatAttribute( const CqParameterKey& key ) const;
+		virtual const	TqInt*	GetIntegerAttribute( const CqParameterKey& key ) const;
+		virtual const	CqString* GetStringAttribute( const CqParameterKey& key ) const;
+		virtual const	CqColor*	GetColorAttribute( const CqParameterKey& key ) const;
+		virtual const	TqInt	GetIntegerAttributeDef( const CqParameterKey& key, TqInt defaultVal) const;
+
 		virtual TqFloat*	GetFloatAttributeWrite( const char* strName, const char* strParam );
 		virtual TqInt*	GetIntegerAttributeWrite( const char* strName, const char* strParam );
 		virtual CqString* GetStringAttributeWrite( const char* strName, const char* strParam );
@@ -435,9 +450,22 @@ class CqAttributes : public IqAttributes, public boost::enable_shared_from_this<
 						return boost::shared_ptr<CqNamedParameterList>(static_cast<CqNamedParameterList*>(0));
 				}
 
+				/** Find a parameter list by its interned name.
+				 */
+				const CqNamedParameterList* Find( TqInt id ) const
+				{
+					return ( static_cast<TqUint>(id) < m_ParameterListsById.size() ? m_ParameterListsById[ id ] : 0 );
+				}
+
 				void Add( const boost::shared_ptr<CqNamedParameterList>& pOption )
 				{
-					m_ParameterLists.insert(value_type(pOption->strName(), pOption) );
+					if( m_ParameterLists.insert(value_type(pOption->strName(), pOption) ).second )
+					{
+						TqUint id = pOption->id();
+						if( id >= m_ParameterListsById.size() )
+							m_ParameterListsById.resize( id + 1, 0 );
+						m_ParameterListsById[ id ] = pOption.get();
+					}
 				}
 
 				void Remove( const boost::shared_ptr<CqNamedParameterList>& pOption )
@@ -445,6 +473,9 @@ class CqAttributes : public IqAttributes, public boost::enable_shared_from_this<
 					plist_iterator it = m_ParameterLists.find( pOption->strName() );
 					if( it != m_ParameterLists.end() )
 					{
+						TqUint id = it->second->id();
+						if( id < m_ParameterListsById.size() )
+							m_ParameterListsById[ id ] = 0;
 						m_ParameterLists.erase(it);
 					}
 				}
@@ -462,6 +493,8 @@ class CqAttributes : public IqAttributes, public boost::enable_shared_from_this<
 
 			private:
 				plist_type	m_ParameterLists;
+				/// The entries of m_ParameterLists, indexed by interned name.
+				std::vector<CqNamedParameterList*>	m_ParameterListsById;
 		};
 #endif
 
@@ -494,6 +527,11 @@ inline IqParameter* CqAttributes::GetAttributeWrite( const char* strName, const
 	return pParameterWrite(strName, strParam);
 }
 
+inline const	IqParameter* CqAttributes::GetAttribute( const CqParameterKey& key ) const
+{
+	return pParameter(key);
+}
+
 
 /// Global attribute stack.
 extern std::list<CqAttributes*>	Attribute_stack;
@@ -62,7 +62,10 @@ struct SqBucketCacheSegment
 	};
 	EqBucketCacheSide side;
 	TqInt			  size;
+	/// Pixels of the segment, owned by the segment.
 	std::vector<CqImagePixelPtr>	cache;
+
+	~SqBucketCacheSegment();
 };
 
 
@@ -261,6 +264,13 @@ inline void CqBucket::setSize(TqInt xsize, TqInt ysize)
 	m_ySize = ysize;
 }
 
+inline SqBucketCacheSegment::~SqBucketCacheSegment()
+{
+	for(std::vector<CqImagePixelPtr>::iterator i = cache.begin(),
+			end = cache.end(); i != end; ++i)
+		delete *i;
+}
+
 inline void CqBucket::clearCache()
 {
 
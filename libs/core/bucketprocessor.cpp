@@ -18,7 +18,7 @@
 
 #include	"bucketprocessor.h"
 
-#include	<valarray>
+#include	<algorithm>
 
 #include	<aqsis/math/math.h>
 #include	"bucket.h"
@@ -28,6 +28,15 @@
 
 namespace Aqsis {
 
+namespace {
+
+// Options and attributes looked up while rendering, interned once.
+const CqParameterKey cullHiddenKey( "cull", "hidden" );
+const CqParameterKey diceRasterorientKey( "dice", "rasterorient" );
+const CqParameterKey systemExposureKey( "System", "Exposure" );
+
+} // unnamed namespace
+
 CqBucketProcessor::CqBucketProcessor(CqImageBuffer& imageBuf,
                                      const SqOptionCache& optCache)
 	: m_bucket(0),
@@ -39,7 +48,20 @@ CqBucketProcessor::CqBucketProcessor(CqImageBuffer& imageBuf,
 	m_DofBounds(),
 	m_aieImage(),
 	m_pixelPool(optCache.xSamps, optCache.ySamps),
+	m_sampleStore(),
+	m_appliedSegments(),
+	m_waitingMPs(),
 	m_aFilterValues(),
+	m_filterValuesX(),
+	m_filterValuesY(),
+	m_filterSeparable(false),
+	m_filterChannels(),
+	m_numFilterAovs(0),
+	m_depthIndex(0),
+	m_filterSamples(),
+	m_filterRowData(),
+	m_filterRowWeights(),
+	m_filterRowCounts(),
 	m_CurrentMpgSampleInfo(),
 	m_OcclusionTree(),
 	m_DataRegion(),
@@ -51,6 +73,15 @@ CqBucketProcessor::CqBucketProcessor(CqImageBuffer& imageBuf,
 	setupCacheInformation();
 }
 
+CqBucketProcessor::~CqBucketProcessor()
+{
+	// Hand back any borrowed pixels, then give the pool ownership of the rest.
+	dropSegments();
+	for(std::vector<CqImagePixelPtr>::iterator i = m_aieImage.begin(),
+			end = m_aieImage.end(); i != end; ++i)
+		m_pixelPool.free(*i);
+}
+
 void CqBucketProcessor::setupCacheInformation()
 {
 	// Calculate and store the cache region sizes for overlap cacheing
@@ -90,12 +121,24 @@ void CqBucketProcessor::reset()
 
 	m_bucket = 0;
 	m_hasValidSamples = false;
+	// Release all the semitransparent hits of the bucket at once.
+	m_sampleStore.reset();
 }
 
 void CqBucketProcessor::preProcess(IqSampler* sampler)
 {
 	assert(m_bucket);
 
+	// Take a snapshot of the cache segments provided by the neighbouring
+	// buckets; when buckets are rendered concurrently more may arrive while
+	// this bucket is being processed, and those are simply dropped again in
+	// postProcess().
+	CqBucket::TqCache cache;
+	{
+		TqMutexLock lock(m_imageBuf.bucketMutex(*m_bucket));
+		cache = m_bucket->cacheSegments();
+	}
+
 	{
 		AQSIS_TIME_SCOPE(Prepare_bucket);
 
@@ -126,13 +169,13 @@ void CqBucketProcessor::preProcess(IqSampler* sampler)
 
 		// Now shrink the sample region according to any cache segments that have been
 		// applied.
-		if(m_bucket->cacheSegments()[SqBucketCacheSegment::left])
+		if(cache[SqBucketCacheSegment::left])
 			sminx += m_DiscreteShiftX*2;
-		if(m_bucket->cacheSegments()[SqBucketCacheSegment::right])
+		if(cache[SqBucketCacheSegment::right])
 			smaxx -= m_DiscreteShiftX*2;
-		if(m_bucket->cacheSegments()[SqBucketCacheSegment::top])
+		if(cache[SqBucketCacheSegment::top])
 			sminy += m_DiscreteShiftY*2;
-		if(m_bucket->cacheSegments()[SqBucketCacheSegment::bottom])
+		if(cache[SqBucketCacheSegment::bottom])
 			smaxy -= m_DiscreteShiftY*2;
 		m_SampleRegion = CqRegion(sminx, sminy, smaxx, smaxy);
 
@@ -178,8 +221,7 @@ void CqBucketProcessor::preProcess(IqSampler* sampler)
 		}
 		InitialiseFilterValues();
 	}
-	
-	const CqBucket::TqCache& cache = m_bucket->cacheSegments();
+
 	if(cache[SqBucketCacheSegment::left])
 		applyCacheSegment(SqBucketCacheSegment::left, cache[SqBucketCacheSegment::left]);
 	if(cache[SqBucketCacheSegment::right])
@@ -218,18 +260,12 @@ void CqBucketProcessor::process()
 	// Render any waiting subsurfaces.
 	// \todo Need to refine the exit condition, to ensure that all previous buckets have been
 	// duly processed.
-	while ( m_bucket->hasPendingSurfaces() )
+	while ( boost::shared_ptr<CqSurface> surface = nextSurface() )
 	{
-		boost::shared_ptr<CqSurface> surface = m_bucket->pTopSurface();
-		if (surface)
+		RenderSurface( surface );
 		{
-			// Advance to next surface
-			m_bucket->popSurface();
-			RenderSurface( surface );
-			{
-				AQSIS_TIME_SCOPE(Render_MPGs);
-				RenderWaitingMPs();
-			}
+			AQSIS_TIME_SCOPE(Render_MPGs);
+			RenderWaitingMPs();
 		}
 	}
 	{
@@ -238,6 +274,14 @@ void CqBucketProcessor::process()
 	}
 }
 
+boost::shared_ptr<CqSurface> CqBucketProcessor::nextSurface()
+{
+	TqMutexLock lock(m_imageBuf.bucketMutex(*m_bucket));
+	boost::shared_ptr<CqSurface> surface = m_bucket->pTopSurface();
+	m_bucket->popSurface();
+	return surface;
+}
+
 void CqBucketProcessor::postProcess()
 {
 	if (!m_bucket)
@@ -260,98 +304,111 @@ void CqBucketProcessor::postProcess()
 
 	std::vector<CqBucket*> neighbours;
 	m_imageBuf.axialNeighbours(*m_bucket, neighbours);
-	if(neighbours[CqImageBuffer::left] && !neighbours[CqImageBuffer::left]->IsProcessed())
+	if(neighbours[CqImageBuffer::left])
 	{
-		boost::shared_ptr<SqBucketCacheSegment> cacheSegment(new SqBucketCacheSegment);
-		buildCacheSegment(SqBucketCacheSegment::left, cacheSegment);
-		neighbours[CqImageBuffer::left]->setCacheSegment(SqBucketCacheSegment::right, cacheSegment);
-
-		if(!neighbours[CqImageBuffer::left]->cacheSegments()[SqBucketCacheSegment::top_right])
+		TqMutexLock lock(m_imageBuf.bucketMutex(*neighbours[CqImageBuffer::left]));
+		if(!neighbours[CqImageBuffer::left]->IsProcessed())
 		{
-			top_left = boost::shared_ptr<SqBucketCacheSegment>(new SqBucketCacheSegment);
-			buildCacheSegment(SqBucketCacheSegment::top_left, top_left);
-			neighbours[CqImageBuffer::left]->setCacheSegment(SqBucketCacheSegment::top_right, top_left);
-		}
-		if(!neighbours[CqImageBuffer::left]->cacheSegments()[SqBucketCacheSegment::bottom_right])
-		{
-			bottom_left = boost::shared_ptr<SqBucketCacheSegment>(new SqBucketCacheSegment);
-			buildCacheSegment(SqBucketCacheSegment::bottom_left, bottom_left);
-			neighbours[CqImageBuffer::left]->setCacheSegment(SqBucketCacheSegment::bottom_right, bottom_left);
-		}
-	}
-	if(neighbours[CqImageBuffer::right] && !neighbours[CqImageBuffer::right]->IsProcessed())
-	{
-		boost::shared_ptr<SqBucketCacheSegment> cacheSegment(new SqBucketCacheSegment);
-		buildCacheSegment(SqBucketCacheSegment::right, cacheSegment);
-		neighbours[CqImageBuffer::right]->setCacheSegment(SqBucketCacheSegment::left, cacheSegment);
-		if(!neighbours[CqImageBuffer::right]->cacheSegments()[SqBucketCacheSegment::top_left])
-		{
-			top_right = boost::shared_ptr<SqBucketCacheSegment>(new SqBucketCacheSegment);
-			buildCacheSegment(SqBucketCacheSegment::top_right, top_right);
-			neighbours[CqImageBuffer::right]->setCacheSegment(SqBucketCacheSegment::top_left, top_right);
-		}
-		if(!neighbours[CqImageBuffer::right]->cacheSegments()[SqBucketCacheSegment::bottom_left])
-		{
-			bottom_right = boost::shared_ptr<SqBucketCacheSegment>(new SqBucketCacheSegment);
-			buildCacheSegment(SqBucketCacheSegment::bottom_right, bottom_right);
-			neighbours[CqImageBuffer::right]->setCacheSegment(SqBucketCacheSegment::bottom_left, bottom_right);
-		}
-	}
-	if(neighbours[CqImageBuffer::above] && !neighbours[CqImageBuffer::above]->IsProcessed())
-	{
-		boost::shared_ptr<SqBucketCacheSegment> cacheSegment(new SqBucketCacheSegment);
-		buildCacheSegment(SqBucketCacheSegment::top, cacheSegment);
-		neighbours[CqImageBuffer::above]->setCacheSegment(SqBucketCacheSegment::bottom, cacheSegment);
-		if(!neighbours[CqImageBuffer::above]->cacheSegments()[SqBucketCacheSegment::bottom_left])
-		{
-			if(!top_left)
+			boost::shared_ptr<SqBucketCacheSegment> cacheSegment(new SqBucketCacheSegment);
+			buildCacheSegment(SqBucketCacheSegment::left, cacheSegment);
+			neighbours[CqImageBuffer::left]->setCacheSegment(SqBucketCacheSegment::right, cacheSegment);
+
+			if(!neighbours[CqImageBuffer::left]->cacheSegments()[SqBucketCacheSegment::top_right])
 			{
 				top_left = boost::shared_ptr<SqBucketCacheSegment>(new SqBucketCacheSegment);
 				buildCacheSegment(SqBucketCacheSegment::top_left, top_left);
+				neighbours[CqImageBuffer::left]->setCacheSegment(SqBucketCacheSegment::top_right, top_left);
+			}
+			if(!neighbours[CqImageBuffer::left]->cacheSegments()[SqBucketCacheSegment::bottom_right])
+			{
+				bottom_left = boost::shared_ptr<SqBucketCacheSegment>(new SqBucketCacheSegment);
+				buildCacheSegment(SqBucketCacheSegment::bottom_left, bottom_left);
+				neighbours[CqImageBuffer::left]->setCacheSegment(SqBucketCacheSegment::bottom_right, bottom_left);
 			}
-			neighbours[CqImageBuffer::above]->setCacheSegment(SqBucketCacheSegment::bottom_left, top_left);
 		}
-		if(!neighbours[CqImageBuffer::above]->cacheSegments()[SqBucketCacheSegment::bottom_right])
+	}
+	if(neighbours[CqImageBuffer::right])
+	{
+		TqMutexLock lock(m_imageBuf.bucketMutex(*neighbours[CqImageBuffer::right]));
+		if(!neighbours[CqImageBuffer::right]->IsProcessed())
 		{
-			if(!top_right)
+			boost::shared_ptr<SqBucketCacheSegment> cacheSegment(new SqBucketCacheSegment);
+			buildCacheSegment(SqBucketCacheSegment::right, cacheSegment);
+			neighbours[CqImageBuffer::right]->setCacheSegment(SqBucketCacheSegment::left, cacheSegment);
+			if(!neighbours[CqImageBuffer::right]->cacheSegments()[SqBucketCacheSegment::top_left])
 			{
 				top_right = boost::shared_ptr<SqBucketCacheSegment>(new SqBucketCacheSegment);
 				buildCacheSegment(SqBucketCacheSegment::top_right, top_right);
+				neighbours[CqImageBuffer::right]->setCacheSegment(SqBucketCacheSegment::top_left, top_right);
+			}
+			if(!neighbours[CqImageBuffer::right]->cacheSegments()[SqBucketCacheSegment::bottom_left])
+			{
+				bottom_right = boost::shared_ptr<SqBucketCacheSegment>(new SqBucketCacheSegment);
+				buildCacheSegment(SqBucketCacheSegment::bottom_right, bottom_right);
+				neighbours[CqImageBuffer::right]->setCacheSegment(SqBucketCacheSegment::bottom_left, bottom_right);
 			}
-			neighbours[CqImageBuffer::above]->setCacheSegment(SqBucketCacheSegment::bottom_right, top_right);
 		}
 	}
-	if(neighbours[CqImageBuffer::below] && !neighbours[CqImageBuffer::below]->IsProcessed())
+	if(neighbours[CqImageBuffer::above])
 	{
-		boost::shared_ptr<SqBucketCacheSegment> cacheSegment(new SqBucketCacheSegment);
-		buildCacheSegment(SqBucketCacheSegment::bottom, cacheSegment);
-		neighbours[CqImageBuffer::below]->setCacheSegment(SqBucketCacheSegment::top, cacheSegment);
-		if(!neighbours[CqImageBuffer::below]->cacheSegments()[SqBucketCacheSegment::top_left])
+		TqMutexLock lock(m_imageBuf.bucketMutex(*neighbours[CqImageBuffer::above]));
+		if(!neighbours[CqImageBuffer::above]->IsProcessed())
 		{
-			if(!bottom_left)
+			boost::shared_ptr<SqBucketCacheSegment> cacheSegment(new SqBucketCacheSegment);
+			buildCacheSegment(SqBucketCacheSegment::top, cacheSegment);
+			neighbours[CqImageBuffer::above]->setCacheSegment(SqBucketCacheSegment::bottom, cacheSegment);
+			if(!neighbours[CqImageBuffer::above]->cacheSegments()[SqBucketCacheSegment::bottom_left])
 			{
-				bottom_left = boost::shared_ptr<SqBucketCacheSegment>(new SqBucketCacheSegment);
-				buildCacheSegment(SqBucketCacheSegment::bottom_left, bottom_left);
+				if(!top_left)
+				{
+					top_left = boost::shared_ptr<SqBucketCacheSegment>(new SqBucketCacheSegment);
+					buildCacheSegment(SqBucketCacheSegment::top_left, top_left);
+				}
+				neighbours[CqImageBuffer::above]->setCacheSegment(SqBucketCacheSegment::bottom_left, top_left);
+			}
+			if(!neighbours[CqImageBuffer::above]->cacheSegments()[SqBucketCacheSegment::bottom_right])
+			{
+				if(!top_right)
+				{
+					top_right = boost::shared_ptr<SqBucketCacheSegment>(new SqBucketCacheSegment);
+					buildCacheSegment(SqBucketCacheSegment::top_right, top_right);
+				}
+				neighbours[CqImageBuffer::above]->setCacheSegment(SqBucketCacheSegment::bottom_right, top_right);
 			}
-			neighbours[CqImageBuffer::below]->setCacheSegment(SqBucketCacheSegment::top_left, bottom_left);
 		}
-		if(!neighbours[CqImageBuffer::below]->cacheSegments()[SqBucketCacheSegment::top_right])
+	}
+	if(neighbours[CqImageBuffer::below])
+	{
+		TqMutexLock lock(m_imageBuf.bucketMutex(*neighbours[CqImageBuffer::below]));
+		if(!neighbours[CqImageBuffer::below]->IsProcessed())
 		{
-			if(!bottom_right)
+			boost::shared_ptr<SqBucketCacheSegment> cacheSegment(new SqBucketCacheSegment);
+			buildCacheSegment(SqBucketCacheSegment::bottom, cacheSegment);
+			neighbours[CqImageBuffer::below]->setCacheSegment(SqBucketCacheSegment::top, cacheSegment);
+			if(!neighbours[CqImageBuffer::below]->cacheSegments()[SqBucketCacheSegment::top_left])
 			{
-				bottom_right = boost::shared_ptr<SqBucketCacheSegment>(new SqBucketCacheSegment);
-				buildCacheSegment(SqBucketCacheSegment::bottom_right, bottom_right);
+				if(!bottom_left)
+				{
+					bottom_left = boost::shared_ptr<SqBucketCacheSegment>(new SqBucketCacheSegment);
+					buildCacheSegment(SqBucketCacheSegment::bottom_left, bottom_left);
+				}
+				neighbours[CqImageBuffer::below]->setCacheSegment(SqBucketCacheSegment::top_left, bottom_left);
+			}
+			if(!neighbours[CqImageBuffer::below]->cacheSegments()[SqBucketCacheSegment::top_right])
+			{
+				if(!bottom_right)
+				{
+					bottom_right = boost::shared_ptr<SqBucketCacheSegment>(new SqBucketCacheSegment);
+					buildCacheSegment(SqBucketCacheSegment::bottom_right, bottom_right);
+				}
+				neighbours[CqImageBuffer::below]->setCacheSegment(SqBucketCacheSegment::top_right, bottom_right);
 			}
-			neighbours[CqImageBuffer::below]->setCacheSegment(SqBucketCacheSegment::top_right, bottom_right);
 		}
 	}
 
-	for(TqInt cseg = 0; cseg < SqBucketCacheSegment::last; ++cseg)
-	{
-		if(m_bucket->cacheSegments()[cseg])
-			dropSegment(cseg);
-	}
+	dropSegments();
 
+	TqMutexLock lock(m_imageBuf.bucketMutex(*m_bucket));
 	m_bucket->clearCache();
 
 	assert(!m_bucket->IsProcessed());
@@ -369,35 +426,38 @@ void CqBucketProcessor::CombineElements()
 		for(TqInt x = m_SampleRegion.xMin() - m_DisplayRegion.xMin() + m_DiscreteShiftX, endX = m_SampleRegion.xMax() - m_DisplayRegion.xMin() + m_DiscreteShiftX; x < endX; ++x)
 		{
 			m_aieImage[(y*m_DataRegion.width())+x]->Combine(m_optCache.depthFilter,
-			                                                m_optCache.zThreshold);
+			                                                m_optCache.zThreshold,
+			                                                m_sampleStore);
 		}
 	}
 }
 
+//----------------------------------------------------------------------
+/** Add weighted sample data into an accumulator.
+ *
+ * This is the inner loop of the pixel filter, run over all the output data
+ * for every sample touched by the filter, so it's kept simple enough for the
+ * compiler to vectorise.
+ */
+static inline void accumulateWeighted(TqFloat* acc, const TqFloat* data,
+		TqFloat weight, TqInt n)
+{
+	for(TqInt k = 0; k < n; ++k)
+		acc[k] += data[k] * weight;
+}
+
 //----------------------------------------------------------------------
 /** Filter the samples in this bucket according to type and filter widths.
  */
 
 void CqBucketProcessor::FilterBucket()
 {
-	CqImagePixelPtr * pie;
-
-	std::map<TqInt, CqRenderer::SqOutputDataEntry> channelMap;
-	// Setup the channel buffer ready to accept the output data.
-	// First fill in the default display value r, g, b, a, and z.
-	m_channelBuffer.clearChannels();
-	channelMap[m_channelBuffer.addChannel("Ci", 3)] = CqRenderer::SqOutputDataEntry(Sample_Red, 3, type_float);
-	channelMap[m_channelBuffer.addChannel("Oi", 3)] = CqRenderer::SqOutputDataEntry(Sample_ORed, 3, type_float);
-	channelMap[m_channelBuffer.addChannel("a", 1)] = CqRenderer::SqOutputDataEntry(Sample_Alpha, 1, type_float);
-	channelMap[m_channelBuffer.addChannel("z", 1)] = CqRenderer::SqOutputDataEntry(Sample_Depth, 1, type_float);
-	channelMap[m_channelBuffer.addChannel("coverage", 1)] = CqRenderer::SqOutputDataEntry(Sample_Coverage, 1, type_float);
+	// Setup the channel buffer ready to accept the output data.  The layout
+	// only changes when output data is registered, so it's normally built
+	// once for the first bucket.
 	std::map<std::string, CqRenderer::SqOutputDataEntry>& outputMap = QGetRenderContext()->GetMapOfOutputDataEntries();
-	std::map<std::string, CqRenderer::SqOutputDataEntry>::iterator aov_i = outputMap.begin();
-	std::map<std::string, CqRenderer::SqOutputDataEntry>::iterator aov_end = outputMap.end();
-	for(; aov_i != aov_end; ++aov_i)
-		channelMap[m_channelBuffer.addChannel(aov_i->first, aov_i->second.m_NumSamples)] = aov_i->second;
-
-	TqInt depthIndex = m_channelBuffer.getChannelIndex("z");
+	if(m_filterChannels.empty() || m_numFilterAovs != outputMap.size())
+		setupFilterChannels();
 
 	// Allocate a buffer for the channel information, big enough to hold the display region.
 	m_channelBuffer.allocate(DisplayRegion().width(), DisplayRegion().height());
@@ -407,180 +467,31 @@ void CqBucketProcessor::FilterBucket()
 	std::vector<TqFloat>	aCoverages;
 	aCoverages.resize( DisplayRegion().area() );
 
-	TqInt xmax = m_DiscreteShiftX;
-	TqInt ymax = m_DiscreteShiftY;
-	TqFloat xfwo2 = std::ceil(m_optCache.xFiltSize) * 0.5f;
-	TqFloat yfwo2 = std::ceil(m_optCache.yFiltSize) * 0.5f;
-	TqInt numSubPixels = ( m_optCache.xSamps * m_optCache.ySamps );
-
-	TqInt	xlen = DataRegion().width();
-
-	TqInt SampleCount = 0;
-
 	TqInt x, y;
 	TqInt i = 0;
 
 	TqInt endy = DisplayRegion().yMax();
 	TqInt endx = DisplayRegion().xMax();
 
-	bool useSeperable = true;
-
 	if(m_hasValidSamples)
 	{
-		// non-seperable is faster for very small filter widths.
-		if(m_optCache.xFiltSize <= 16.0 || m_optCache.yFiltSize <= 16.0)
-			useSeperable = false;
-
-		// FIXME: Separable filters currently crash!  Additionally,
-		// * Some filter types are inherently unseparable (eg, disk, catmull-rom)
-		// * Separable filters are a lot faster where applicable.  The comment
-		//   & heuristic above appears to be incorrect.
-		useSeperable = false;
-
-		if(useSeperable)
+		// The separable path costs a pass over the extra rows of the filter
+		// area, so it only pays once the filter spans more than one row of
+		// pixels.
+		if(m_filterSeparable && m_DiscreteShiftY > 0)
+			FilterBucketSeparable(datasize, aCoverages);
+		else
 		{
-			// seperable filter. filtering by fx,fy is equivalent to filtering
-			// by fx,1 followed by 1,fy.
+			TqInt xmax = m_DiscreteShiftX;
+			TqInt ymax = m_DiscreteShiftY;
+			TqFloat xfwo2 = std::ceil(m_optCache.xFiltSize) * 0.5f;
+			TqFloat yfwo2 = std::ceil(m_optCache.yFiltSize) * 0.5f;
+			TqInt numSubPixels = ( m_optCache.xSamps * m_optCache.ySamps );
+			TqInt xlen = DataRegion().width();
 
-			TqInt size = DisplayRegion().width() * DisplayRegion().height() * m_optCache.ySamps;
-			std::valarray<TqFloat> intermediateSamples( 0.0f, size * datasize);
-			std::valarray<TqInt> sampleCounts(0, size);
-			for ( y = DisplayRegion().yMin() - ymax; y < endy + ymax ; y++ )
-			{
-				TqFloat ycent = y + 0.5f;
-				TqInt pixelRow = (y-(DisplayRegion().yMin()-ymax)) * m_optCache.ySamps;
-				for ( x = DisplayRegion().xMin(); x < endx ; x++ )
-				{
-					TqFloat xcent = x + 0.5f;
-
-					// Get the element at the left side of the filter area.
-					ImageElement( x - xmax, y, pie );
-
-					TqInt pixelIndex = pixelRow*DisplayRegion().width() + x-DisplayRegion().xMin();
-
-					// filter just in x first
-					for ( TqInt sy = 0; sy < m_optCache.ySamps; sy++ )
-					{
-						TqFloat gTot = 0.0;
-						SampleCount = 0;
-						std::valarray<TqFloat> samples( 0.0f, datasize);
-
-						CqImagePixelPtr* pie2 = pie;
-						for ( TqInt fx = -xmax; fx <= xmax; fx++ )
-						{
-							TqInt index = (ymax*(2*xmax + 1) + fx + xmax) * numSubPixels;
-							// Now go over each subsample within the pixel
-							TqInt sampleIndex = sy * m_optCache.xSamps;
-
-							for ( TqInt sx = 0; sx < m_optCache.xSamps; sx++ )
-							{
-								SqSampleData const& sampleData = (*pie2)->SampleData( sampleIndex );
-								CqVector2D vecS = sampleData.position;
-								vecS -= CqVector2D( xcent, ycent );
-								if ( vecS.x() >= -xfwo2 && vecS.y() >= -yfwo2 && vecS.x() <= xfwo2 && vecS.y() <= yfwo2 )
-								{
-									TqFloat g = m_aFilterValues[index + sampleIndex];
-									gTot += g;
-									SqImageSample& opv = (*pie2)->occludingHit(sampleIndex);
-									if ( opv.flags & SqImageSample::Flag_Valid )
-									{
-										TqFloat* data = (*pie2)->sampleHitData(opv);
-										for ( TqInt k = 0; k < datasize; ++k )
-											samples[k] += data[k] * g;
-										sampleCounts[pixelIndex]++;
-									}
-								}
-								sampleIndex++;
-							}
-							pie2++;
-						}
-
-						// store the intermediate result
-						for ( TqInt k = 0; k < datasize; k ++)
-							intermediateSamples[pixelIndex*datasize + k] = samples[k] / gTot;
-
-						pixelIndex += DisplayRegion().width();
-					}
-				}
-			}
-
-			// now filter in y.
-			for ( y = DisplayRegion().yMin(); y < endy ; y++ )
-			{
-				TqFloat ycent = y + 0.5f;
-				for ( x = DisplayRegion().xMin(); x < endx ; x++ )
-				{
-					TqFloat xcent = x + 0.5f;
-					TqFloat gTot = 0.0;
-					SampleCount = 0;
-					std::valarray<TqFloat> samples( 0.0f, datasize);
-
-					TqInt fy;
-					// Get the element at the top of the filter area.
-					ImageElement( x, y - ymax, pie );
-					for ( fy = -ymax; fy <= ymax; fy++ )
-					{
-						CqImagePixelPtr* pie2 = pie;
-
-						TqInt index = ((fy + ymax)*(2*xmax + 1) + xmax) * numSubPixels;
-						// Now go over each y subsample within the pixel
-						TqInt sx = m_optCache.xSamps / 2; // use the samples in the centre of the pixel.
-						TqInt sy = 0;
-						TqInt sampleIndex = sx;
-						TqInt pixelRow = (y + fy - (DisplayRegion().yMin()-ymax)) * m_optCache.ySamps;
-						TqInt pixelIndex = pixelRow*DisplayRegion().width() + x-DisplayRegion().xMin();
-
-						for ( sy = 0; sy < m_optCache.ySamps; sy++ )
-						{
-							SqSampleData const& sampleData = (*pie2)->SampleData( sampleIndex );
-							CqVector2D vecS = sampleData.position;
-							vecS -= CqVector2D( xcent, ycent );
-							if ( vecS.x() >= -xfwo2 && vecS.y() >= -yfwo2 && vecS.x() <= xfwo2 && vecS.y() <= yfwo2 )
-							{
-								TqFloat g = m_aFilterValues[index + sampleIndex];
-								gTot += g;
-								if(sampleCounts[pixelIndex] > 0)
-								{
-									SampleCount += sampleCounts[pixelIndex];
-									for ( TqInt k = 0; k < datasize; k++)
-										samples[k] += intermediateSamples[pixelIndex * datasize + k] * g;
-								}
-							}
-							sampleIndex += m_optCache.xSamps;
-							pixelIndex += DisplayRegion().width();
-						}
-
-						pie += xlen;
-					}
-
-					// Set depth to infinity if no samples.
-					if ( SampleCount == 0 )
-					{
-						aCoverages[i] = 0.0;
-					}
-					else
-					{
-						float oneOverGTot = 1.0 / gTot;
+			m_filterSamples.resize(datasize);
+			TqFloat* samples = datasize > 0 ? &m_filterSamples[0] : 0;
 
-						// Copy the filtered sample data into the channel buffer.
-						for( std::map<TqInt, CqRenderer::SqOutputDataEntry>::iterator channel_i = channelMap.begin(); channel_i != channelMap.end(); ++channel_i )
-						{
-							for(TqInt i = 0; i < channel_i->second.m_NumSamples; ++i)
-								m_channelBuffer(x, y, channel_i->first)[i] = samples[channel_i->second.m_Offset + i] * oneOverGTot;
-						}
-
-						if ( SampleCount >= numSubPixels)
-							aCoverages[ i ] = 1.0;
-						else
-							aCoverages[ i ] = ( TqFloat ) SampleCount / ( TqFloat ) (numSubPixels );
-					}
-
-					i++;
-				}
-			}
-		}
-		else
-		{
 			// non-seperable filter
 			for ( y = DisplayRegion().yMin(); y < endy ; y++ )
 			{
@@ -589,76 +500,41 @@ void CqBucketProcessor::FilterBucket()
 				{
 					TqFloat xcent = x + 0.5f;
 					TqFloat gTot = 0.0;
-					SampleCount = 0;
-					std::valarray<TqFloat> samples( 0.0f, datasize);
+					TqInt SampleCount = 0;
+					std::fill(m_filterSamples.begin(), m_filterSamples.end(), 0.0f);
 
 					// Get the element at the upper left corner of the filter area.
+					CqImagePixelPtr* pie;
 					ImageElement( x - xmax, y - ymax, pie );
 					for (TqInt fy = -ymax; fy <= ymax; fy++, pie += xlen )
 					{
 						CqImagePixelPtr* pie2 = pie;
 						for (TqInt fx = -xmax; fx <= xmax; fx++, ++pie2 )
 						{
-							TqInt index = ((fy + ymax)*(2*xmax+1) + fx + xmax) * numSubPixels;
+							const TqFloat* weights = &m_aFilterValues[((fy + ymax)*(2*xmax+1) + fx + xmax) * numSubPixels];
 							// Now go over each subsample within the pixel
-							TqInt sampleIndex = 0;
-							for (TqInt sy = 0; sy < m_optCache.ySamps; sy++ )
+							for (TqInt sampleIndex = 0; sampleIndex < numSubPixels; sampleIndex++ )
 							{
-								for (TqInt sx = 0; sx < m_optCache.xSamps; sx++ )
+								SqSampleData const& sampleData = (*pie2)->SampleData( sampleIndex );
+								TqFloat sx = sampleData.position.x() - xcent;
+								TqFloat sy = sampleData.position.y() - ycent;
+								if ( sx >= -xfwo2 && sy >= -yfwo2 && sx <= xfwo2 && sy <= yfwo2 )
 								{
-									SqSampleData const& sampleData = (*pie2)->SampleData( sampleIndex );
-									CqVector2D vecS = sampleData.position;
-									vecS -= CqVector2D( xcent, ycent );
-									if ( vecS.x() >= -xfwo2 && vecS.y() >= -yfwo2 && vecS.x() <= xfwo2 && vecS.y() <= yfwo2 )
+									TqFloat g = weights[sampleIndex];
+									gTot += g;
+									SqImageSample& opv = (*pie2)->occludingHit(sampleIndex);
+									if ( opv.flags & SqImageSample::Flag_Valid )
 									{
-										TqFloat g = m_aFilterValues[index+sampleIndex];
-										gTot += g;
-										SqImageSample& opv = (*pie2)->occludingHit(sampleIndex);
-										if ( opv.flags & SqImageSample::Flag_Valid )
-										{
-											TqFloat* data = (*pie2)->sampleHitData(opv);
-											for ( TqInt k = 0; k < datasize; ++k )
-												samples[k] += data[k] * g;
-											SampleCount++;
-										}
+										accumulateWeighted(samples, (*pie2)->sampleHitData(opv), g, datasize);
+										SampleCount++;
 									}
-									sampleIndex++;
 								}
 							}
 						}
 					}
 
-
-					// Set depth to infinity if no samples.
-					if ( SampleCount == 0 )
-					{
-						for( std::map<TqInt, CqRenderer::SqOutputDataEntry>::iterator channel_i = channelMap.begin(); channel_i != channelMap.end(); ++channel_i )
-						{
-							for(TqInt i = 0; i < channel_i->second.m_NumSamples; ++i)
-								m_channelBuffer(x-DisplayRegion().xMin(), y-DisplayRegion().yMin(), channel_i->first)[i] = 0.0f;
-						}
-						// Set the depth to infinity.
-						m_channelBuffer(x-DisplayRegion().xMin(), y-DisplayRegion().yMin(), depthIndex)[0] = FLT_MAX;
-						aCoverages[i] = 0.0;
-					}
-					else
-					{
-						float oneOverGTot = 1.0 / gTot;
-						
-						// Copy the filtered sample data into the channel buffer.
-						for( std::map<TqInt, CqRenderer::SqOutputDataEntry>::iterator channel_i = channelMap.begin(); channel_i != channelMap.end(); ++channel_i )
-						{
-							for(TqInt i = 0; i < channel_i->second.m_NumSamples; ++i)
-								m_channelBuffer(x-DisplayRegion().xMin(), y-DisplayRegion().yMin(), channel_i->first)[i] = samples[channel_i->second.m_Offset + i] * oneOverGTot;
-						}
-
-						if ( SampleCount >= numSubPixels)
-							aCoverages[ i ] = 1.0;
-						else
-							aCoverages[ i ] = ( TqFloat ) SampleCount / ( TqFloat ) (numSubPixels );
-					}
-
-					i++;
+					aCoverages[i++] = StoreFilteredPixel(x - DisplayRegion().xMin(),
+							y - DisplayRegion().yMin(), samples, gTot, SampleCount);
 				}
 			}
 		}
@@ -666,20 +542,10 @@ void CqBucketProcessor::FilterBucket()
 	else
 	{
 		// empty bucket.
-		// Copy the filtered sample data into the channel buffer.
 		for(TqInt y = 0; y < DisplayRegion().height(); ++y)
 		{
 			for(TqInt x = 0; x < DisplayRegion().width(); ++x)
-			{
-				for( std::map<TqInt, CqRenderer::SqOutputDataEntry>::iterator channel_i = channelMap.begin(); channel_i != channelMap.end(); ++channel_i )
-				{
-					for(TqInt i = 0; i < channel_i->second.m_NumSamples; ++i)
-						m_channelBuffer(x, y, channel_i->first)[i] = 0.0f;
-				}
-				// Set the depth to infinity.
-				m_channelBuffer(x, y, depthIndex)[0] = FLT_MAX;
-				aCoverages[ i++ ] = 0.0f;
-			}
+				aCoverages[ i++ ] = StoreFilteredPixel(x, y, 0, 0.0f, 0);
 		}
 	}
 
@@ -759,6 +625,201 @@ void CqBucketProcessor::ImageElement( TqInt iXPos, TqInt iYPos, CqImagePixelPtr*
 	pie = &m_aieImage[ i ];
 }
 
+//----------------------------------------------------------------------
+/** Filter the samples in this bucket with a separable filter.
+ *
+ * Filtering by f(x,y) = fx(x)*fy(y) is done by first filtering each row of
+ * sub-pixel samples in x, and then filtering the results in y.  This
+ * reduces the work per pixel from (2*xmax+1)*(2*ymax+1) pixels of samples
+ * to (2*xmax+1) + (2*ymax+1) rows.
+ *
+ * The x pass keeps the weighted sums and the weight totals separately so
+ * that the final normalisation is the same as for the non-separable filter.
+ * The test against the y extent of the filter is made using the centre of
+ * each row of sub-pixels rather than the actual sample positions.
+ */
+void CqBucketProcessor::FilterBucketSeparable(TqInt datasize, std::vector<TqFloat>& aCoverages)
+{
+	TqInt xmax = m_DiscreteShiftX;
+	TqInt ymax = m_DiscreteShiftY;
+	TqFloat xfwo2 = std::ceil(m_optCache.xFiltSize) * 0.5f;
+	TqFloat yfwo2 = std::ceil(m_optCache.yFiltSize) * 0.5f;
+	TqInt xSamps = m_optCache.xSamps;
+	TqInt ySamps = m_optCache.ySamps;
+
+	TqInt xMin = DisplayRegion().xMin();
+	TqInt yMin = DisplayRegion().yMin();
+	TqInt width = DisplayRegion().width();
+	TqInt height = DisplayRegion().height();
+
+	// Storage for each sub-pixel row of every output column, covering the
+	// display region extended by the filter in y.
+	TqInt numRows = (height + 2*ymax) * ySamps;
+	m_filterRowData.assign(numRows * width * datasize, 0.0f);
+	m_filterRowWeights.assign(numRows * width, 0.0f);
+	m_filterRowCounts.assign(numRows * width, 0);
+
+	// Filter in x.
+	for(TqInt y = yMin - ymax; y < yMin + height + ymax; y++)
+	{
+		TqInt rowIndex = (y - (yMin - ymax)) * ySamps;
+		for(TqInt x = xMin; x < xMin + width; x++)
+		{
+			TqFloat xcent = x + 0.5f;
+			// Get the element at the left side of the filter area.
+			CqImagePixelPtr* pie;
+			ImageElement( x - xmax, y, pie );
+			for(TqInt sy = 0; sy < ySamps; sy++)
+			{
+				TqInt entry = (rowIndex + sy) * width + x - xMin;
+				TqFloat* rowData = datasize > 0 ? &m_filterRowData[entry * datasize] : 0;
+				TqFloat gTot = 0.0f;
+				TqInt sampleCount = 0;
+				CqImagePixelPtr* pie2 = pie;
+				for(TqInt fx = -xmax; fx <= xmax; fx++, ++pie2)
+				{
+					const TqFloat* weights = &m_filterValuesX[(fx + xmax) * xSamps];
+					TqInt sampleIndex = sy * xSamps;
+					for(TqInt sx = 0; sx < xSamps; sx++, sampleIndex++)
+					{
+						TqFloat sampleX = (*pie2)->SampleData(sampleIndex).position.x() - xcent;
+						if(sampleX >= -xfwo2 && sampleX <= xfwo2)
+						{
+							TqFloat g = weights[sx];
+							gTot += g;
+							SqImageSample& opv = (*pie2)->occludingHit(sampleIndex);
+							if(opv.flags & SqImageSample::Flag_Valid)
+							{
+								accumulateWeighted(rowData, (*pie2)->sampleHitData(opv), g, datasize);
+								sampleCount++;
+							}
+						}
+					}
+				}
+				m_filterRowWeights[entry] = gTot;
+				m_filterRowCounts[entry] = sampleCount;
+			}
+		}
+	}
+
+	// Filter the rows in y.
+	m_filterSamples.resize(datasize);
+	TqFloat* samples = datasize > 0 ? &m_filterSamples[0] : 0;
+	TqInt i = 0;
+	for(TqInt y = 0; y < height; y++)
+	{
+		for(TqInt x = 0; x < width; x++)
+		{
+			TqFloat gTot = 0.0f;
+			TqInt sampleCount = 0;
+			std::fill(m_filterSamples.begin(), m_filterSamples.end(), 0.0f);
+			for(TqInt fy = -ymax; fy <= ymax; fy++)
+			{
+				TqInt rowIndex = (y + fy + ymax) * ySamps;
+				const TqFloat* weights = &m_filterValuesY[(fy + ymax) * ySamps];
+				for(TqInt sy = 0; sy < ySamps; sy++)
+				{
+					TqFloat rowY = (sy + 0.5f) / ySamps + fy - 0.5f;
+					if(rowY < -yfwo2 || rowY > yfwo2)
+						continue;
+					TqInt entry = (rowIndex + sy) * width + x;
+					TqFloat g = weights[sy];
+					gTot += g * m_filterRowWeights[entry];
+					if(m_filterRowCounts[entry] > 0)
+					{
+						sampleCount += m_filterRowCounts[entry];
+						accumulateWeighted(samples, &m_filterRowData[entry * datasize], g, datasize);
+					}
+				}
+			}
+			aCoverages[i++] = StoreFilteredPixel(x, y, samples, gTot, sampleCount);
+		}
+	}
+}
+
+//----------------------------------------------------------------------
+/** Set up the channels of the channel buffer to match the output data.
+ */
+void CqBucketProcessor::setupFilterChannels()
+{
+	// First fill in the default display value r, g, b, a, and z.
+	m_channelBuffer.clearChannels();
+	m_filterChannels.clear();
+	SqFilterChannel channel;
+	channel.index = m_channelBuffer.addChannel("Ci", 3);
+	channel.offset = Sample_Red;
+	channel.size = 3;
+	m_filterChannels.push_back(channel);
+	channel.index = m_channelBuffer.addChannel("Oi", 3);
+	channel.offset = Sample_ORed;
+	m_filterChannels.push_back(channel);
+	channel.index = m_channelBuffer.addChannel("a", 1);
+	channel.offset = Sample_Alpha;
+	channel.size = 1;
+	m_filterChannels.push_back(channel);
+	channel.index = m_depthIndex = m_channelBuffer.addChannel("z", 1);
+	channel.offset = Sample_Depth;
+	m_filterChannels.push_back(channel);
+	channel.index = m_channelBuffer.addChannel("coverage", 1);
+	channel.offset = Sample_Coverage;
+	m_filterChannels.push_back(channel);
+
+	std::map<std::string, CqRenderer::SqOutputDataEntry>& outputMap = QGetRenderContext()->GetMapOfOutputDataEntries();
+	std::map<std::string, CqRenderer::SqOutputDataEntry>::iterator aov_i = outputMap.begin();
+	std::map<std::string, CqRenderer::SqOutputDataEntry>::iterator aov_end = outputMap.end();
+	for(; aov_i != aov_end; ++aov_i)
+	{
+		channel.index = m_channelBuffer.addChannel(aov_i->first, aov_i->second.m_NumSamples);
+		channel.offset = aov_i->second.m_Offset;
+		channel.size = aov_i->second.m_NumSamples;
+		m_filterChannels.push_back(channel);
+	}
+	m_numFilterAovs = outputMap.size();
+}
+
+//----------------------------------------------------------------------
+/** Store the filtered sample data for a pixel in the channel buffer.
+ *
+ * \param x, y - position of the pixel relative to the display region.
+ * \param samples - weighted sum of the sample data.
+ * \param gTot - total filter weight.
+ * \param sampleCount - number of valid samples contributing to samples.
+ * \return The coverage of the pixel.
+ */
+TqFloat CqBucketProcessor::StoreFilteredPixel(TqInt x, TqInt y,
+		const TqFloat* samples, TqFloat gTot, TqInt sampleCount)
+{
+	std::vector<SqFilterChannel>::const_iterator channel_i = m_filterChannels.begin();
+	std::vector<SqFilterChannel>::const_iterator channel_end = m_filterChannels.end();
+	// Set depth to infinity if no samples.
+	if ( sampleCount == 0 )
+	{
+		for( ; channel_i != channel_end; ++channel_i )
+		{
+			TqFloat* buffer = m_channelBuffer(x, y, channel_i->index);
+			for(TqInt k = 0; k < channel_i->size; ++k)
+				buffer[k] = 0.0f;
+		}
+		m_channelBuffer(x, y, m_depthIndex)[0] = FLT_MAX;
+		return 0.0f;
+	}
+
+	TqFloat oneOverGTot = 1.0f / gTot;
+	// Copy the filtered sample data into the channel buffer.
+	for( ; channel_i != channel_end; ++channel_i )
+	{
+		TqFloat* buffer = m_channelBuffer(x, y, channel_i->index);
+		const TqFloat* data = samples + channel_i->offset;
+		for(TqInt k = 0; k < channel_i->size; ++k)
+			buffer[k] = data[k] * oneOverGTot;
+	}
+
+	TqInt numSubPixels = m_optCache.xSamps * m_optCache.ySamps;
+	if ( sampleCount >= numSubPixels )
+		return 1.0f;
+	return static_cast<TqFloat>(sampleCount) / numSubPixels;
+}
+
 //----------------------------------------------------------------------
 /** Expose the samples in this bucket according to specified gain and gamma settings.
  */
@@ -769,8 +830,8 @@ void CqBucketProcessor::ExposeBucket()
 	if(!m_hasValidSamples && !QGetRenderContext()->poptCurrent()->pshadImager())
 		return;
 
-	TqFloat exposegain = QGetRenderContext() ->poptCurrent()->GetFloatOption( "System", "Exposure" ) [ 0 ];
-	TqFloat exposegamma = QGetRenderContext() ->poptCurrent()->GetFloatOption( "System", "Exposure" ) [ 1 ];
+	TqFloat exposegain = QGetRenderContext() ->poptCurrent()->GetFloatOption( systemExposureKey ) [ 0 ];
+	TqFloat exposegamma = QGetRenderContext() ->poptCurrent()->GetFloatOption( systemExposureKey ) [ 1 ];
 	// Early exit if the exposure & gain are trivial
 	if ( exposegain == 1.0 && exposegamma == 1.0 )
 		return;
@@ -853,6 +914,61 @@ void CqBucketProcessor::InitialiseFilterValues()
 			}
 		}
 	}
+
+	// Tabulate the filter along each axis, and check whether the full table
+	// is their product.  The separable filters (box, gaussian, sinc,
+	// mitchell) pass this test, others such as disk and catmull-rom don't.
+	m_filterValuesX.resize((2*xmax+1)*m_optCache.xSamps);
+	for(TqInt px = -xmax; px <= xmax; px++)
+	{
+		for (TqInt sx = 0; sx < m_optCache.xSamps; sx++ )
+		{
+			TqFloat fx = (sx + 0.5f) / m_optCache.xSamps + px - 0.5f;
+			TqFloat w = 0;
+			if ( fx >= -xfwo2 && fx <= xfwo2 )
+				w = ( *pFilter ) ( fx, 0, std::ceil(m_optCache.xFiltSize), std::ceil(m_optCache.yFiltSize) );
+			m_filterValuesX[ (px + xmax)*m_optCache.xSamps + sx ] = w;
+		}
+	}
+	m_filterValuesY.resize((2*ymax+1)*m_optCache.ySamps);
+	for(TqInt py = -ymax; py <= ymax; py++)
+	{
+		for (TqInt sy = 0; sy < m_optCache.ySamps; sy++ )
+		{
+			TqFloat fy = (sy + 0.5f) / m_optCache.ySamps + py - 0.5f;
+			TqFloat w = 0;
+			if ( fy >= -yfwo2 && fy <= yfwo2 )
+				w = ( *pFilter ) ( 0, fy, std::ceil(m_optCache.xFiltSize), std::ceil(m_optCache.yFiltSize) );
+			m_filterValuesY[ (py + ymax)*m_optCache.ySamps + sy ] = w;
+		}
+	}
+
+	TqFloat centre = ( *pFilter ) ( 0, 0, std::ceil(m_optCache.xFiltSize), std::ceil(m_optCache.yFiltSize) );
+	m_filterSeparable = centre != 0;
+	if(m_filterSeparable)
+	{
+		TqFloat maxWeight = 0;
+		for(std::vector<TqFloat>::const_iterator w = m_aFilterValues.begin(); w != m_aFilterValues.end(); ++w)
+			maxWeight = std::max(maxWeight, std::fabs(*w));
+		TqFloat tolerance = 1e-4f * maxWeight;
+		for(TqInt py = -ymax; py <= ymax && m_filterSeparable; py++)
+		{
+			for(TqInt px = -xmax; px <= xmax && m_filterSeparable; px++)
+			{
+				TqInt subPixelIndex = ((py + ymax)*(2*xmax+1) + px + xmax)*numSubPixels;
+				for (TqInt sy = 0; sy < m_optCache.ySamps; sy++ )
+				{
+					TqFloat wy = m_filterValuesY[ (py + ymax)*m_optCache.ySamps + sy ] / centre;
+					for (TqInt sx = 0; sx < m_optCache.xSamps; sx++, ++subPixelIndex )
+					{
+						TqFloat wx = m_filterValuesX[ (px + xmax)*m_optCache.xSamps + sx ];
+						if(std::fabs(m_aFilterValues[subPixelIndex] - wx*wy) > tolerance)
+							m_filterSeparable = false;
+					}
+				}
+			}
+		}
+	}
 }
 
 void CqBucketProcessor::CalculateDofBounds()
@@ -923,14 +1039,21 @@ void CqBucketProcessor::CalculateDofBounds()
 
 void CqBucketProcessor::RenderWaitingMPs()
 {
-	for ( std::vector<boost::shared_ptr<CqMicroPolygon> >::iterator itMP = m_bucket->micropolygons().begin();
-			itMP != m_bucket->micropolygons().end();
+	// Take the waiting micropolygons out of the bucket, leaving the (empty)
+	// storage from the last call in their place.  Other threads may add more
+	// to the bucket while these are being rendered.
+	{
+		TqMutexLock lock(m_imageBuf.bucketMutex(*m_bucket));
+		m_waitingMPs.swap(m_bucket->micropolygons());
+	}
+	for ( std::vector<boost::shared_ptr<CqMicroPolygon> >::iterator itMP = m_waitingMPs.begin();
+			itMP != m_waitingMPs.end();
 			itMP++ )
 	{
 		CqMicroPolygon* mp = (*itMP).get();
 		RenderMicroPoly( mp );
 	}
-	m_bucket->micropolygons().clear();
+	m_waitingMPs.clear();
 
 	m_OcclusionTree.updateTree();
 }
@@ -941,15 +1064,20 @@ void CqBucketProcessor::RenderWaitingMPs()
  */
 void CqBucketProcessor::RenderSurface( boost::shared_ptr<CqSurface>& surface )
 {
+	// Hidden surfaces may only be culled when the nearest sample alone
+	// determines the pixel.
+	const bool occlusionCull = !surface->pCSGNode()
+		&& !( (m_optCache.displayMode & DMode_Z) &&
+		      (m_optCache.depthFilter == Filter_Max ||
+		       m_optCache.depthFilter == Filter_Average) )
+		&& surface->fCachedBound()
+		&& surface->pAttributes()->GetIntegerAttributeDef( cullHiddenKey, 1 ) == 1;
+
 	// Cull surface if it's hidden
-	if ( !surface->pCSGNode() && !( (m_optCache.displayMode & DMode_Z) &&
-	                                (m_optCache.depthFilter == Filter_Max ||
-	                                 m_optCache.depthFilter == Filter_Average) ) )
+	if ( occlusionCull )
 	{
 		AQSIS_TIME_SCOPE(Occlusion_culling);
-		if ( surface->fCachedBound() &&
-			 ( surface->pAttributes()->GetIntegerAttributeDef( "cull", "hidden", 1 ) == 1 ) &&
-		     m_OcclusionTree.canCull(surface->GetCachedRasterBound()) )
+		if ( m_OcclusionTree.canCull(surface->GetCachedRasterBound()) )
 		{
 			m_imageBuf.RepostSurface(*m_bucket, surface);
 			STATS_INC( GPR_occlusion_culled );
@@ -966,7 +1094,7 @@ void CqBucketProcessor::RenderSurface( boost::shared_ptr<CqSurface>& surface )
 											 QGetRenderContextI()->Time(),
 											 diceCoords);
 		const TqInt* rasterOrient = surface->pAttributes()->
-								GetIntegerAttribute("dice", "rasterorient");
+								GetIntegerAttribute( diceRasterorientKey );
 		if(rasterOrient && *rasterOrient == 0)
 		{
 			// Non raster-oriented dicing: dice the object as if all parts of
@@ -1026,10 +1154,21 @@ void CqBucketProcessor::RenderSurface( boost::shared_ptr<CqSurface>& surface )
 			ADDREF( pGrid );
 			// Only shade in all cases since the Displacement could be called in the shadow map creation too.
 			// \note Timings for shading are broken down into component parts within this function.
-			pGrid->Shade();
+			pGrid->Shade( true, occlusionCull ? &m_OcclusionTree : 0 );
 			pGrid->TransferOutputVariables();
 
-			if ( pGrid->vfCulled() == false )
+			if ( pGrid->vfOcclusionCulled() )
+			{
+				// The grid is hidden in this bucket, but may be visible in
+				// the buckets which follow.  Pass the surface on with the
+				// displaced grid bound, which is usually much tighter than
+				// the surface bound, so that the next buckets can cull it
+				// before dicing.
+				CqBound bound = pGrid->OcclusionBound();
+				surface->CacheRasterBound( bound );
+				m_imageBuf.RepostSurface(*m_bucket, surface);
+			}
+			else if ( pGrid->vfCulled() == false )
 			{
 				AQSIS_TIME_SCOPE(Bust_grids);
 				// Split any grids in this bucket waiting to be processed.
@@ -1052,6 +1191,7 @@ void CqBucketProcessor::RenderSurface( boost::shared_ptr<CqSurface>& surface )
 			TqInt cSplits = surface->Split( aSplits );
 			for ( TqInt i = 0; i < cSplits; i++ )
 			{
+				aSplits[ i ]->InheritDiceKeySeed( *surface, i );
 				m_imageBuf.PostSurface( aSplits[ i ] );
 			}
 		}
@@ -1201,7 +1341,7 @@ void CqBucketProcessor::RenderMPG_Static( CqMicroPolygon* pMPG)
 					if ( SampleHit )
 					{
 						sample_hits++;
-						StoreSample( pMPG, pie2->get(), index, D, uv );
+						StoreSample( pMPG, *pie2, index, D, uv );
 					}
 				}
 				index_start += iXSamples;
@@ -1424,7 +1564,7 @@ void CqBucketProcessor::RenderMPG_MBOrDof( CqMicroPolygon* pMPG, bool IsMoving,
 							{
 								sample_hits++;
 								// note index has already been incremented, so we use the previous value.
-								StoreSample( pMPG, pie2->get(), index-1, D, uv );
+								StoreSample( pMPG, *pie2, index-1, D, uv );
 							}
 						}
 						else
@@ -1458,7 +1598,7 @@ void CqBucketProcessor::RenderMPG_MBOrDof( CqMicroPolygon* pMPG, bool IsMoving,
 							{
 								sample_hits++;
 								// note index has already been incremented, so we use the previous value.
-								StoreSample( pMPG, pie2->get(), index-1, D, uv );
+								StoreSample( pMPG, *pie2, index-1, D, uv );
 							}
 						}
 					} while (!UsingDof && index < indexT1);
@@ -1487,6 +1627,8 @@ void CqBucketProcessor::StoreSample( CqMicroPolygon* pMPG, CqImagePixel* pie2, T
 	const SqGridInfo& currentGridInfo = pMPG->pGrid()->GetCachedGridInfo();
 	// Get a pointer to the hit storage.
 	SqImageSample* hit = 0;
+	SqDeepHit* deepHit = 0;
+	TqFloat* hitData = 0;
 	if((m_CurrentMpgSampleInfo.isOpaque || (currentGridInfo.matteFlag
 				& SqImageSample::Flag_MatteAlpha)) && isCullable)
 	{
@@ -1533,14 +1675,17 @@ void CqBucketProcessor::StoreSample( CqMicroPolygon* pMPG, CqImagePixel* pie2, T
 			m_OcclusionTree.setSampleDepth(D, sampleData.occlusionIndex);
 		}
 		hit->flags = SqImageSample::Flag_Valid;
+		hitData = pie2->sampleHitData(*hit);
 	}
 	else
 	{
-		// Otherwise create some new storage for the hit data in sample hit
-		// vector.
-		pie2->Values(index).push_back(SqImageSample());
-		hit = &pie2->Values(index).back();
-		pie2->allocateHitData(*hit);
+		// Otherwise allocate storage for the hit from the sample store of
+		// the bucket.
+		deepHit = m_sampleStore.allocateHit(SqImageSample::sampleSize);
+		pie2->addDeepHit(index, deepHit);
+		hitData = deepHit->data();
+		// Channels which aren't written below default to zero.
+		std::fill(hitData + Sample_Coverage, hitData + SqImageSample::sampleSize, 0.0f);
 	}
 
 	// Compute the color and opacity of the micropolygon at the hit point.
@@ -1549,7 +1694,6 @@ void CqBucketProcessor::StoreSample( CqMicroPolygon* pMPG, CqImagePixel* pie2, T
 	pMPG->InterpolateOutputs(m_CurrentMpgSampleInfo, uv, col, opa);
 
 	// Store the hit data for later use.
-	TqFloat* hitData = pie2->sampleHitData(*hit);
 	hitData[ Sample_Red ] = col[0];
 	hitData[ Sample_Green ] = col[1];
 	hitData[ Sample_Blue ] = col[2];
@@ -1561,8 +1705,16 @@ void CqBucketProcessor::StoreSample( CqMicroPolygon* pMPG, CqImagePixel* pie2, T
 		StoreExtraData(pMPG, hitData);
 
 	// Update CSG pointer and flags.
-	hit->csgNode = pMPG->pGrid()->pCSGNode();
-	hit->flags |= currentGridInfo.matteFlag;
+	if(deepHit)
+	{
+		m_sampleStore.setCsgNode(*deepHit, pMPG->pGrid()->pCSGNode());
+		deepHit->flags |= currentGridInfo.matteFlag;
+	}
+	else
+	{
+		hit->csgNode = pMPG->pGrid()->pCSGNode();
+		hit->flags |= currentGridInfo.matteFlag;
+	}
 
 	// Mark the pixel as containing valid samples, used later for the cacheing and reuse.
 	pie2->markHasValidSamples();
@@ -1644,6 +1796,14 @@ void CqBucketProcessor::StoreExtraData( CqMicroPolygon* pMPG, TqFloat* hitData)
 
 void CqBucketProcessor::buildCacheSegment(SqBucketCacheSegment::EqBucketCacheSide side, boost::shared_ptr<SqBucketCacheSegment>& seg)
 {
+	if(m_appliedSegments[side])
+	{
+		// The pixels here are borrowed from a segment built by another
+		// bucket, which covers exactly the same region; pass that on instead.
+		seg = m_appliedSegments[side];
+		return;
+	}
+
 	CqRegion& segmentRegion = m_cacheRegions[side];
 
 	TqInt segRowLen = segmentRegion.width();
@@ -1676,11 +1836,13 @@ void CqBucketProcessor::applyCacheSegment(SqBucketCacheSegment::EqBucketCacheSid
 			m_hasValidSamples |= m_aieImage[which]->hasValidSamples();
 		}
 	}
+	m_appliedSegments[side] = seg;
 }
 
 
 void CqBucketProcessor::dropSegment(TqInt side)
 {
+	// The borrowed pixels stay with the segment; replace them with our own.
 	CqRegion& segmentRegion = m_cacheRegions[side]; 
 
 	for(TqInt y = segmentRegion.yMin(), sy = 0, endY = segmentRegion.yMax(); y < endY; ++y, ++sy)
@@ -1693,5 +1855,17 @@ void CqBucketProcessor::dropSegment(TqInt side)
 	}
 }
 
+void CqBucketProcessor::dropSegments()
+{
+	for(TqInt side = 0; side < SqBucketCacheSegment::last; ++side)
+	{
+		if(m_appliedSegments[side])
+		{
+			dropSegment(side);
+			m_appliedSegments[side].reset();
+		}
+	}
+}
+
 
 } // namespace Aqsis
@@ -60,6 +60,7 @@ class CqBucketProcessor
 	public:
 		/** Default constructor */
 		CqBucketProcessor(CqImageBuffer& imageBuf, const SqOptionCache& optCache);
+		~CqBucketProcessor();
 
 		/** Set the bucket to be processed */
 		void setBucket(CqBucket* bucket);
@@ -106,11 +107,16 @@ class CqBucketProcessor
 		void	CalculateDofBounds();
 		void	CombineElements();
 		void	FilterBucket();
+		void	FilterBucketSeparable(TqInt datasize, std::vector<TqFloat>& aCoverages);
+		void	setupFilterChannels();
+		TqFloat	StoreFilteredPixel(TqInt x, TqInt y, const TqFloat* samples,
+						TqFloat gTot, TqInt sampleCount);
 		void	ExposeBucket();
 
 		void	buildCacheSegment(SqBucketCacheSegment::EqBucketCacheSide side, boost::shared_ptr<SqBucketCacheSegment>& seg);
 		void	applyCacheSegment(SqBucketCacheSegment::EqBucketCacheSide side, const boost::shared_ptr<SqBucketCacheSegment>& seg);
 		void	dropSegment(TqInt side);
+		void	dropSegments();
 
 		void ImageElement( TqInt iXPos, TqInt iYPos, CqImagePixelPtr*& pie );
 
@@ -118,6 +124,9 @@ class CqBucketProcessor
 		/** Render any waiting MPs.
 		 */
 		void RenderWaitingMPs();
+		/** Remove the closest waiting surface from the bucket, returning
+		 * null when there are none left. */
+		boost::shared_ptr<CqSurface> nextSurface();
 		void RenderSurface( boost::shared_ptr<CqSurface>& surface);
 		void ImageElement( TqInt iXPos, TqInt iYPos, CqImagePixel*& pie ) const;
 		/** Render a particular micropolygon.
@@ -158,9 +167,41 @@ class CqBucketProcessor
 		std::vector<CqBound>		m_DofBounds;
 		std::vector<CqImagePixelPtr>	m_aieImage;
 		CqPixelPool m_pixelPool;
+		/// Storage for the semitransparent sample hits of the current bucket.
+		CqSampleStore m_sampleStore;
+		/// Cache segments whose pixels are currently borrowed by m_aieImage.
+		CqBucket::TqCache m_appliedSegments;
+		/// Micropolygons taken from the bucket for rendering.
+		std::vector<boost::shared_ptr<CqMicroPolygon> > m_waitingMPs;
 
 		/// Vector of precalculated filter weights
 		std::vector<TqFloat>	m_aFilterValues;
+		/// Filter weights along the x axis for each sub-pixel column.
+		std::vector<TqFloat>	m_filterValuesX;
+		/// Filter weights along the y axis for each sub-pixel row.
+		std::vector<TqFloat>	m_filterValuesY;
+		/// True if m_aFilterValues is the product of the x and y weights.
+		bool	m_filterSeparable;
+
+		/// Position of an output channel in the channel buffer and sample data.
+		struct SqFilterChannel
+		{
+			TqInt	index;		///< Index of the channel in m_channelBuffer.
+			TqInt	offset;		///< Offset of the channel in the sample data.
+			TqInt	size;		///< Number of floats in the channel.
+		};
+		/// Output channels, rebuilt when the set of output data changes.
+		std::vector<SqFilterChannel>	m_filterChannels;
+		/// Number of arbitrary output variables in m_filterChannels.
+		TqUint	m_numFilterAovs;
+		/// Index of the depth channel in m_channelBuffer.
+		TqInt	m_depthIndex;
+		/// Scratch space for the filtered sample data of a pixel.
+		std::vector<TqFloat>	m_filterSamples;
+		/// Scratch space for the rows filtered in x by the separable filter.
+		std::vector<TqFloat>	m_filterRowData;
+		std::vector<TqFloat>	m_filterRowWeights;
+		std::vector<TqInt>	m_filterRowCounts;
 
 		SqMpgSampleInfo m_CurrentMpgSampleInfo;
 
@@ -373,7 +414,7 @@ inline CqImagePixel* CqSampleIterator::getPixel(TqInt pixelX, TqInt pixelY)
 	TqInt x = pixelX - m_processor->m_DataRegion.xMin();
 	TqInt y = pixelY - m_processor->m_DataRegion.yMin();
 	return m_processor->m_aieImage[
-		y*m_processor->m_DataRegion.width() + x].get();
+		y*m_processor->m_DataRegion.width() + x];
 }
 
 
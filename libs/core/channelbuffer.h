@@ -31,12 +31,15 @@
 
 #include <aqsis/aqsis.h>
 
+#include <algorithm>
 #include <string>
 #include <map>
 #include <vector>
 #include <stdexcept>
 #include <iostream>
 
+#include <aqsis/util/exception.h>
+
 #include "iddmanager.h"
 
 namespace Aqsis {
@@ -50,7 +53,7 @@ class CqChannelBuffer : public IqChannelBuffer
 {
 	public:
 		CqChannelBuffer();
-		virtual ~CqChannelBuffer() {}	
+		virtual ~CqChannelBuffer();
 
 		void clearChannels();
 		TqInt addChannel(const std::string& name, TqInt size);
@@ -70,6 +73,7 @@ class CqChannelBuffer : public IqChannelBuffer
 		TqInt	m_width;
 		TqInt	m_height;
 		TqInt m_elementSize;
+		TqInt	m_allocated;	///< Number of values m_data has room for.
 		std::map<std::string, std::pair<TqInt, TqInt> >	m_channels;
 		TqChannelValues	*m_data;
 };
@@ -86,14 +90,23 @@ inline void CqChannelBuffer::clearChannels()
 		delete [] m_data;
 	m_data = NULL;
 	m_elementSize = 0;
+	m_allocated = 0;
 }
 
 inline CqChannelBuffer::CqChannelBuffer()
-: m_elementSize(0),
+: m_width(0),
+  m_height(0),
+  m_elementSize(0),
+  m_allocated(0),
   m_data(NULL)
 {
 }
 
+inline CqChannelBuffer::~CqChannelBuffer()
+{
+	delete [] m_data;
+}
+
 inline TqInt CqChannelBuffer::addChannel(const std::string& name, TqInt size)
 {
 	if(m_channels.find(name) != m_channels.end())
@@ -118,21 +131,19 @@ inline TqInt CqChannelBuffer::getChannelIndex(const std::string& name) const
 
 inline void CqChannelBuffer::allocate(TqInt width, TqInt height)
 {
-	TqChannelValues	*old = m_data;
-	int oldsize = m_width*m_height*m_elementSize;
-	m_width = width;
-	m_height = height;
-
-	m_data = new TqChannelValues[m_width*m_height*m_elementSize];
-	if(m_data)
+	TqInt size = width*height*m_elementSize;
+	// Reuse the existing storage when it's big enough, which is the common
+	// case of consecutive buckets of the same size.  Channels may have been
+	// added since it was allocated, so compare against what was allocated.
+	if(!m_data || size > m_allocated)
 	{
-		memset(m_data, 0, m_width*m_height*m_elementSize);
-		if(old)
-		{
-			memcpy(m_data, old, oldsize);
-			delete [] old;
-		}
+		delete [] m_data;
+		m_data = new TqChannelValues[size];
+		m_allocated = size;
 	}
+	m_width = width;
+	m_height = height;
+	std::fill(m_data, m_data + size, TqChannelValues(0));
 }
 
 inline IqChannelBuffer::TqChannelPtr CqChannelBuffer::operator()(TqInt x, TqInt y, TqInt index)
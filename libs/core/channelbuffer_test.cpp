@@ -0,0 +1,68 @@
+// Aqsis
+// Copyright (C) 1997 - 2001, Paul C. Gregory
+//
+// Contact: pgregory@aqsis.org
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation; either
+// version 2 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+/** \file Unit tests for the display channel buffer.
+ */
+
+#include "channelbuffer.h"
+
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/auto_unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(channelbuffer_tests)
+
+using namespace Aqsis;
+
+BOOST_AUTO_TEST_CASE(channelbuffer_layout)
+{
+	CqChannelBuffer buffer;
+	BOOST_CHECK_EQUAL(buffer.addChannel("rgb", 3), 0);
+	BOOST_CHECK_EQUAL(buffer.addChannel("a", 1), 3);
+	buffer.allocate(3, 2);
+	BOOST_CHECK_EQUAL(buffer.width(), 3);
+	BOOST_CHECK_EQUAL(buffer.height(), 2);
+	BOOST_CHECK_EQUAL(buffer.getChannelIndex("a"), 3);
+	// Channels of neighbouring pixels are stored one after another.
+	BOOST_CHECK_EQUAL(buffer(1, 0, 0) - buffer(0, 0, 0), 4);
+	BOOST_CHECK_EQUAL(buffer(0, 1, 0) - buffer(0, 0, 0), 12);
+}
+
+BOOST_AUTO_TEST_CASE(channelbuffer_grows_with_new_channels)
+{
+	// Adding a channel after allocating must give a larger buffer for the
+	// same pixel size, not reuse the old one.
+	CqChannelBuffer buffer;
+	buffer.addChannel("r", 1);
+	buffer.allocate(4, 4);
+	buffer.addChannel("z", 1);
+	buffer.allocate(4, 4);
+	for(TqInt y = 0; y < 4; ++y)
+		for(TqInt x = 0; x < 4; ++x)
+			BOOST_CHECK_EQUAL(buffer(x, y, 1)[0], 0);
+	*buffer(3, 3, 1) = 2;
+	BOOST_CHECK_EQUAL(*buffer(3, 3, 1), 2);
+
+	// A smaller bucket reuses the storage, and is cleared.
+	*buffer(0, 0, 0) = 1;
+	buffer.allocate(2, 2);
+	BOOST_CHECK_EQUAL(*buffer(0, 0, 0), 0);
+	BOOST_CHECK_EQUAL(*buffer(1, 1, 1), 0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
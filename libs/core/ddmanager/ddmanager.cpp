@@ -32,6 +32,7 @@
 
 #include	<cstring>
 
+#include	<boost/bind.hpp>
 #include	<boost/static_assert.hpp>
 #include	<boost/format.hpp>
 
@@ -40,6 +41,7 @@
 #include	"imagebuffer.h"
 #include	<aqsis/shadervm/ishaderexecenv.h>
 #include	<aqsis/util/logging.h>
+#include	<aqsis/util/trace.h>
 #include	<aqsis/ri/ndspy.h>
 #include	<aqsis/version.h>
 #include	"debugdd.h"
@@ -63,6 +65,13 @@ SqDDMemberData CqDDManager::m_MemberData("DspyImageOpen", "DspyImageQuery",
         "DspyImageData", "DspyImageClose", "DspyImageDelayClose",
         "r", "g", "b", "a", "z");
 
+namespace {
+
+/// Maximum number of formatted buckets waiting to be written to each display.
+const TqUint maxQueuedBuckets = 16;
+
+} // anonymous namespace
+
 TqInt CqDDManager::AddDisplay( const TqChar* name, const TqChar* type, const TqChar* mode, TqInt modeID, TqInt dataOffset, TqInt dataSize, std::map<std::string, void*> mapOfArguments )
 {
 	/// \todo The shared_ptr should be declared before the if-else block and initialized inside,
@@ -99,6 +108,8 @@ TqInt CqDDManager::AddDisplay( const TqChar* name, const TqChar* type, const TqC
 
 CqDisplayRequest::~CqDisplayRequest()
 {
+	FlushBuckets();
+	delete [] m_DataRow;
 	std::vector<UserParameter>::iterator iup;
 	for (iup = m_customParams.begin(); iup != m_customParams.end(); ++iup )
 	{
@@ -421,7 +432,12 @@ void CqDisplayRequest::LoadDisplayLibrary( SqDDMemberData& ddMemberData, CqSimpl
 
 	// Nullified the data part
 	m_DataRow = 0;
-	m_DataBucket = 0;
+
+	// Scanline order displays are sent rows of buckets top to bottom, starting
+	// with the row of buckets containing the top of the crop window.
+	const TqInt* bucketSize = QGetRenderContext()->poptCurrent()->GetIntegerOption( "limits", "bucketsize" );
+	TqInt yBucketSize = bucketSize ? bucketSize[1] : 16;
+	m_nextScanlineRow = QGetRenderContext()->cropWindowYMin() / yBucketSize * yBucketSize;
 
 	if ( NULL != m_OpenMethod )
 	{
@@ -633,11 +649,16 @@ void CqDisplayRequest::LoadDisplayLibrary( SqDDMemberData& ddMemberData, CqSimpl
 			owinfo.overwrite = 1;
 			err = (*m_QueryMethod)(m_imageHandle, PkOverwriteQuery, sizeof(owinfo), &owinfo);
 		}
+
+		StartWriter();
 	}
 }
 
 void CqDisplayRequest::CloseDisplayLibrary()
 {
+	// Make sure everything queued has reached the display before closing it.
+	FlushBuckets();
+
 	// Call the DspyImageClose method on the display to shut things down.
 	// If there is a delayed close method, call it in preference.
 	if ( m_DelayCloseMethod)
@@ -645,11 +666,6 @@ void CqDisplayRequest::CloseDisplayLibrary()
 	else if ( NULL != m_CloseMethod )
 		(*m_CloseMethod)(m_imageHandle);
 
-	if (m_DataBucket != 0)
-	{
-		delete [] m_DataBucket;
-		m_DataBucket = 0;
-	}
 	if (m_DataRow != 0)
 	{
 		delete [] m_DataRow;
@@ -989,49 +1005,136 @@ void CqDisplayRequest::DisplayBucket( const CqRegion& DRegion, const IqChannelBu
 	if ( !m_valid || !m_DataMethod )
 		return;
 
-	TqInt	xmin = DRegion.xMin();
-	TqInt	ymin = DRegion.yMin();
-	TqInt	xmaxplus1 = DRegion.xMax();
-	TqInt	ymaxplus1 = DRegion.yMax();
-	PtDspyError err;
-
 	// Dispatch to display sub-type methods
 	// Copy relevant data from the bucket and store locally,
-	// while quantizing and/or compressing
-	FormatBucketForDisplay( DRegion, pBuffer );
-	// Now that the bucket data has been constructed, send it to the display
-	// either lines by lines or bucket by bucket.
+	// while quantizing and/or compressing.  This has to be done before
+	// returning, since the channel buffer is reused for the next bucket.
+	TqFormattedBucketPtr bucket(new SqFormattedBucket);
+	bucket->region = DRegion;
+	bucket->data.resize(m_elementSize * static_cast<int>(DRegion.area()));
+	if(bucket->data.empty())
+		return;
+	FormatBucketForDisplay( DRegion, pBuffer, &bucket->data[0] );
+
+#ifdef	ENABLE_THREADING
+	if(m_writerThread)
+	{
+		// Hand the bucket over to the writer thread, waiting for space in
+		// the queue if the display is falling behind.
+		boost::mutex::scoped_lock lock(m_queueMutex);
+		while(m_bucketQueue.size() >= maxQueuedBuckets)
+			m_queueNotFull.wait(lock);
+		m_bucketQueue.push_back(bucket);
+		m_queueNotEmpty.notify_one();
+		return;
+	}
+#endif
+	WriteBucket(bucket);
+}
+
+void CqDisplayRequest::WriteBucket(const TqFormattedBucketPtr& bucket)
+{
+	const CqRegion& region = bucket->region;
+	AQSIS_TRACE_SCOPE_XY("Write_display_bucket", region.xMin(), region.yMin());
 	// Check if the display needs scanlines, and if so, accumulate bucket data
 	// until a scanline is complete. Send to display when complete.
 	if (m_flags.flags & PkDspyFlagsWantsScanLineOrder)
 	{
-		if (CollapseBucketsToScanlines( DRegion ))
-		{
-			// Filled a scan line: time to send complete rows to display
-			SendToDisplay(ymin, ymaxplus1);
-		}
+		SqScanlineRow& row = m_scanlineRows[region.yMin()];
+		row.ymaxplus1 = max(row.ymaxplus1, region.yMax());
+		row.width += region.width();
+		row.buckets.push_back(bucket);
+		SendScanlineRows(false);
 	}
 	else
 	{
 		// Send the bucket information as they come in
-		err = (m_DataMethod)(m_imageHandle, xmin, xmaxplus1, ymin, ymaxplus1, m_elementSize, m_DataBucket);
+		(m_DataMethod)(m_imageHandle, region.xMin(), region.xMax(),
+				region.yMin(), region.yMax(), m_elementSize, &bucket->data[0]);
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Send complete rows of buckets to a scanline order display, in order from
+// the top of the image.  When flushing, send whatever rows there are.
+//-----------------------------------------------------------------------------
+void CqDisplayRequest::SendScanlineRows(bool flush)
+{
+	while (!m_scanlineRows.empty())
+	{
+		std::map<TqInt, SqScanlineRow>::iterator row = m_scanlineRows.begin();
+		if (!flush && (row->first != m_nextScanlineRow || row->second.width < m_width))
+			break;
+		if (m_DataRow == 0)
+			m_DataRow = new unsigned char[m_elementSize * m_width * m_height];
+		std::vector<TqFormattedBucketPtr>& buckets = row->second.buckets;
+		for (std::vector<TqFormattedBucketPtr>::const_iterator bucket = buckets.begin();
+				bucket != buckets.end(); ++bucket)
+			CollapseBucketsToScanlines((*bucket)->region, &(*bucket)->data[0]);
+		// Filled a scan line: time to send complete rows to display
+		SendToDisplay(row->first, row->second.ymaxplus1);
+		m_nextScanlineRow = row->second.ymaxplus1;
+		m_scanlineRows.erase(row);
 	}
+}
 
+void CqDisplayRequest::StartWriter()
+{
+	m_scanlineRows.clear();
+#ifdef	ENABLE_THREADING
+	m_stopWriter = false;
+	m_writerThread.reset(new boost::thread(
+				boost::bind(&CqDisplayRequest::WriterLoop, this)));
+#endif
 }
 
-void CqDisplayRequest::FormatBucketForDisplay( const CqRegion& DRegion, const IqChannelBuffer* pBuffer )
+#ifdef	ENABLE_THREADING
+void CqDisplayRequest::WriterLoop()
 {
-	static CqRandom random( 61 );
+	while (true)
+	{
+		TqFormattedBucketPtr bucket;
+		{
+			boost::mutex::scoped_lock lock(m_queueMutex);
+			while (m_bucketQueue.empty() && !m_stopWriter)
+				m_queueNotEmpty.wait(lock);
+			if (m_bucketQueue.empty())
+				return;
+			bucket = m_bucketQueue.front();
+			m_bucketQueue.pop_front();
+			m_queueNotFull.notify_one();
+		}
+		WriteBucket(bucket);
+	}
+}
+#endif
 
-	if (m_DataBucket == 0)
-		m_DataBucket = new unsigned char[m_elementSize * static_cast<int>(DRegion.area())];
-	if ((m_flags.flags & PkDspyFlagsWantsScanLineOrder) && m_DataRow == 0)
+void CqDisplayRequest::FlushBuckets()
+{
+#ifdef	ENABLE_THREADING
+	if (m_writerThread)
 	{
-		m_DataRow = new unsigned char[m_elementSize * m_width * m_height];
+		// Let the writer drain the queue, then wait for it to finish.
+		{
+			boost::mutex::scoped_lock lock(m_queueMutex);
+			m_stopWriter = true;
+			m_queueNotEmpty.notify_one();
+		}
+		m_writerThread->join();
+		m_writerThread.reset();
 	}
+#endif
+	// Rows which never completed (for instance because the render was
+	// aborted) still go to the display.
+	SendScanlineRows(true);
+}
+
+void CqDisplayRequest::FormatBucketForDisplay( const CqRegion& DRegion, const IqChannelBuffer* pBuffer, unsigned char* pData )
+{
+	static CqRandom random( 61 );
 
 	// Fill in the bucket data for each channel in each element, honoring the requested order and formats.
-	unsigned char* pdata = m_DataBucket;
+	unsigned char* pdata = pData;
 
 	std::vector<std::pair<TqInt, TqInt> > offsets;
 	std::vector<PtDspyDevFormat>::iterator iformat;
@@ -1118,18 +1221,18 @@ void CqDisplayRequest::FormatBucketForDisplay( const CqRegion& DRegion, const Iq
 }
 
 
-void CqDeepDisplayRequest::FormatBucketForDisplay( const CqRegion& DRegion, const IqChannelBuffer* pBuffer )
+void CqDeepDisplayRequest::FormatBucketForDisplay( const CqRegion& DRegion, const IqChannelBuffer* pBuffer, unsigned char* pData )
 {
 
 }
 
 //-----------------------------------------------------------------------------
-// Return true if a scanline of buckets has been accumulated, false otherwise.
+// Copy a bucket into the row of scanlines it belongs to.
 //-----------------------------------------------------------------------------
-bool CqDisplayRequest::CollapseBucketsToScanlines( const CqRegion& DRegion )
+void CqDisplayRequest::CollapseBucketsToScanlines( const CqRegion& DRegion, const unsigned char* pData )
 {
 
-	unsigned char* pdata = m_DataBucket;
+	const unsigned char* pdata = pData;
 	TqInt	xmin = DRegion.xMin();
 	TqInt	ymin = DRegion.yMin();
 	TqInt	xmaxplus1 = DRegion.xMax();
@@ -1144,19 +1247,10 @@ bool CqDisplayRequest::CollapseBucketsToScanlines( const CqRegion& DRegion )
 			pdata += m_elementSize;
 		}
 	}
-
-	if (xmaxplus1 >= m_width)
-	{
-		// Filled a scan line
-		Aqsis::log() << debug << "filled a scanline" << std::endl;
-		return true;
-	}
-	return false;
 }
 
-bool CqDeepDisplayRequest::CollapseBucketsToScanlines( const CqRegion& DRegion )
+void CqDeepDisplayRequest::CollapseBucketsToScanlines( const CqRegion& DRegion, const unsigned char* pData )
 {
-	return false;
 }
 
 void CqDisplayRequest::SendToDisplay(TqInt ymin, TqInt ymaxplus1)
@@ -27,10 +27,20 @@
 #ifndef ___ddmanager_Loaded___
 #define ___ddmanager_Loaded___
 
+#include	<deque>
+#include	<map>
 #include	<vector>
 
+#include	<boost/shared_ptr.hpp>
+#ifdef	ENABLE_THREADING
+#include	<boost/thread/thread.hpp>
+#include	<boost/thread/mutex.hpp>
+#include	<boost/thread/condition.hpp>
+#endif
+
 #include	<aqsis/aqsis.h>
 #include	<aqsis/math/matrix.h>
+#include	<aqsis/math/region.h>
 #include	<aqsis/ri/ri.h>
 #include	"iddmanager.h"
 #include	<aqsis/util/plugins.h>
@@ -85,6 +95,13 @@ struct SqDDMemberData
 /** \class CqDisplayRequest
  * Base class for display requests.
  *
+ * Buckets are quantized on the rendering thread, then handed to a writer
+ * thread owned by the request which passes them on to the display driver.
+ * The queue between the two is bounded, so a slow driver eventually holds
+ * up rendering rather than letting formatted buckets pile up in memory.
+ * Drivers which want scanline order are sent complete rows of buckets from
+ * top to bottom, whatever order the buckets were rendered in.
+ *
  * \todo <b>Code review</b>: This class could be tweaked to use a more
  * RAII-like style.
  */
@@ -92,6 +109,11 @@ class CqDisplayRequest : public IqDisplayRequest
 {
 	public:
 		CqDisplayRequest()
+			: m_DataRow(0),
+			m_nextScanlineRow(0)
+#ifdef	ENABLE_THREADING
+			, m_stopWriter(false)
+#endif
 		{}
 
 		CqDisplayRequest(bool valid, const TqChar* name, const TqChar* type, const TqChar* mode,
@@ -101,7 +123,12 @@ class CqDisplayRequest : public IqDisplayRequest
 				m_modeHash(modeHash), m_modeID(modeID), m_AOVOffset(dataOffset),
 				m_AOVSize(dataSize), m_QuantizeZeroVal(quantizeZeroVal), m_QuantizeOneVal(quantizeOneVal),
 				m_QuantizeMinVal(quantizeMinVal), m_QuantizeMaxVal(quantizeMaxVal), m_QuantizeDitherVal(quantizeDitherVal), m_QuantizeSpecified(quantizeSpecified), m_QuantizeDitherSpecified(quantizeDitherSpecified),
-				m_isLoaded(false)
+				m_isLoaded(false),
+				m_DataRow(0),
+				m_nextScanlineRow(0)
+#ifdef	ENABLE_THREADING
+				, m_stopWriter(false)
+#endif
 		{}
 		virtual ~CqDisplayRequest();
 
@@ -124,11 +151,14 @@ class CqDisplayRequest : public IqDisplayRequest
 		void PrepareCustomParameters( std::map<std::string, void*>& mapParams );
 		void PrepareSystemParameters();
 
-		/* Prepare a bucket for display, then send to the display device.
-		 * We implement the standard functionality, but allow child classes
-		 * to override.
+		/* Prepare a bucket for display, then queue it to be sent to the
+		 * display device.  We implement the standard functionality, but allow
+		 * child classes to override.
 		 */
 		virtual void DisplayBucket( const CqRegion& DRegion, const IqChannelBuffer* pBuffer);
+		/* Wait until all queued buckets have been sent to the display device.
+		 */
+		void FlushBuckets();
 
 		//----------------------------------------------
 		// Pure virtual functions
@@ -138,19 +168,42 @@ class CqDisplayRequest : public IqDisplayRequest
 		virtual const std::string& 	name() const;
 		virtual bool isLoaded() const;
 		/* Does quantization, or in the case of DSM does the compression.
+		 * The formatted data is written to pData.
 		 */
-		virtual void FormatBucketForDisplay( const CqRegion& DRegion, const IqChannelBuffer* pBuffer);
-		/* Collapses a row of buckets into a scanline by copying the
+		virtual void FormatBucketForDisplay( const CqRegion& DRegion, const IqChannelBuffer* pBuffer, unsigned char* pData);
+		/* Collapses a bucket into the current row of scanlines by copying the
 		 * quantized data into a format readable by the display.
 		 * Used when the display wants scanline order.
-		 * Return true if a full row is ready, false otherwise.
 		 */
-		virtual bool CollapseBucketsToScanlines(const CqRegion& DRegion);
+		virtual void CollapseBucketsToScanlines(const CqRegion& DRegion, const unsigned char* pData);
 		/* Sends the data to the display.
 		*/
 		virtual void SendToDisplay(TqInt ymin, TqInt ymaxplus1);
 
 	protected:
+		/// Quantized data for a bucket, waiting to be sent to the display.
+		struct SqFormattedBucket
+		{
+			CqRegion region;
+			std::vector<unsigned char> data;
+		};
+		typedef boost::shared_ptr<SqFormattedBucket> TqFormattedBucketPtr;
+		/// Buckets of a row which are held back from a scanline order display.
+		struct SqScanlineRow
+		{
+			TqInt ymaxplus1;
+			TqInt width;
+			std::vector<TqFormattedBucketPtr> buckets;
+			SqScanlineRow() : ymaxplus1(0), width(0) {}
+		};
+
+		void WriteBucket(const TqFormattedBucketPtr& bucket);
+		void SendScanlineRows(bool flush);
+		void StartWriter();
+#ifdef	ENABLE_THREADING
+		void WriterLoop();
+#endif
+
 		bool			m_valid;
 		std::string 	m_name;
 		std::string 	m_type;
@@ -188,8 +241,25 @@ class CqDisplayRequest : public IqDisplayRequest
 		//  Specifically, the stuff which deals with holding the data
 		//  which has been copied out of the bucket and quantized:
 		unsigned char  *m_DataRow;    // A row of bucket's data
-		unsigned char  *m_DataBucket; // A bucket's data
 
+		/// Rows of buckets for scanline order displays, keyed by their top.
+		std::map<TqInt, SqScanlineRow> m_scanlineRows;
+		/// Top of the next row to send to a scanline order display.
+		TqInt			m_nextScanlineRow;
+#ifdef	ENABLE_THREADING
+		/// Formatted buckets waiting for the writer thread.
+		std::deque<TqFormattedBucketPtr> m_bucketQueue;
+		/// Protects m_bucketQueue and m_stopWriter.
+		boost::mutex	m_queueMutex;
+		/// Signalled when the writer takes a bucket off the queue.
+		boost::condition m_queueNotFull;
+		/// Signalled when a bucket is queued or the writer should stop.
+		boost::condition m_queueNotEmpty;
+		/// Thread passing queued buckets to the display driver.
+		boost::shared_ptr<boost::thread> m_writerThread;
+		/// Set to make the writer thread exit once the queue is empty.
+		bool			m_stopWriter;
+#endif
 };
 
 //---------------------------------------------------------------------
@@ -213,13 +283,12 @@ class CqDeepDisplayRequest : virtual public CqDisplayRequest
 
 		/* Does quantization, or in the case of DSM does the compression.
 		 */
-		virtual void FormatBucketForDisplay( const CqRegion& DRegion, const IqChannelBuffer* pBuffer);
-		/* Collapses a row of buckets into a scanline by copying the
+		virtual void FormatBucketForDisplay( const CqRegion& DRegion, const IqChannelBuffer* pBuffer, unsigned char* pData);
+		/* Collapses a bucket into the current row of scanlines by copying the
 		 * quantized data into a format readable by the display.
 		 * Used when the display wants scanline order.
-		 * Return true if a full row is ready, false otherwise.
 		 */
-		virtual bool CollapseBucketsToScanlines(const CqRegion& DRegion );
+		virtual void CollapseBucketsToScanlines(const CqRegion& DRegion, const unsigned char* pData);
 		/*
 		 * Sends the data to the display.
 		 */
@@ -0,0 +1,411 @@
+// Aqsis
+// Copyright (C) 1997 - 2001, Paul C. Gregory
+//
+// Contact: pgregory@aqsis.org
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation; either
+// version 2 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+/** \file
+ * \brief Persistent cache of diced grids.
+ */
+
+#include "dicecache.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+#include <boost/filesystem/operations.hpp>
+#include <boost/iostreams/device/mapped_file.hpp>
+
+#include <aqsis/math/color.h>
+#include <aqsis/math/vector3d.h>
+#include <aqsis/shadervm/ishader.h>
+#include <aqsis/shadervm/ishaderdata.h>
+#include <aqsis/shadervm/ishaderexecenv.h>
+#include <aqsis/util/file.h>
+#include <aqsis/util/logging.h>
+
+namespace Aqsis {
+
+namespace {
+
+// The cache file starts with a header of fileMagic followed by the version
+// and the size of the float and vector types, so that files written by
+// builds with a different layout are ignored.  The header is followed by a
+// sequence of entries, each made of the 64 bit key, the 64 bit check hash,
+// a 32 bit data size and the data.  All values are in native byte order.
+const char fileMagic[8] = { 'A', 'Q', 'S', 'D', 'I', 'C', 'E', '\0' };
+const TqUint32 fileVersion = 2;
+const std::size_t fileHeaderSize = sizeof(fileMagic) + 4*sizeof(TqUint32);
+const std::size_t entryHeaderSize = 2*sizeof(boost::uint64_t) + sizeof(TqUint32);
+
+// Grid entries hold lDone and the number of variables, followed by a record
+// for each variable: the variable index, type and number of values, followed
+// by the values.
+struct SqVarHeader
+{
+	TqInt32 varID;
+	TqInt32 type;
+	TqInt32 count;
+};
+
+void writeFileHeader(std::ostream& out)
+{
+	TqUint32 header[4] = { fileVersion, sizeof(TqFloat), sizeof(CqVector3D),
+		sizeof(CqColor) };
+	out.write(fileMagic, sizeof(fileMagic));
+	out.write(reinterpret_cast<const char*>(header), sizeof(header));
+}
+
+bool checkFileHeader(const char* data, std::size_t size)
+{
+	if(size < fileHeaderSize || std::memcmp(data, fileMagic, sizeof(fileMagic)) != 0)
+		return false;
+	TqUint32 header[4];
+	std::memcpy(header, data + sizeof(fileMagic), sizeof(header));
+	return header[0] == fileVersion && header[1] == sizeof(TqFloat)
+		&& header[2] == sizeof(CqVector3D) && header[3] == sizeof(CqColor);
+}
+
+/// Get the address and size of the values of a grid variable.
+bool varData(IqShaderData* var, char*& data, std::size_t& size)
+{
+	TqFloat* f = 0;
+	CqVector3D* v = 0;
+	CqColor* c = 0;
+	switch(var->Type())
+	{
+		case type_float:
+			var->GetValuePtr(f);
+			data = reinterpret_cast<char*>(f);
+			size = sizeof(TqFloat);
+			break;
+		case type_point:
+		case type_normal:
+		case type_vector:
+			var->GetValuePtr(v);
+			data = reinterpret_cast<char*>(v);
+			size = sizeof(CqVector3D);
+			break;
+		case type_color:
+			var->GetValuePtr(c);
+			data = reinterpret_cast<char*>(c);
+			size = sizeof(CqColor);
+			break;
+		default:
+			return false;
+	}
+	size *= var->Size();
+	return data != 0;
+}
+
+/** Get the matrix transforming the values of a grid variable of the given
+ * type, or null if the values don't need transforming.
+ */
+const CqMatrix* varTransform(TqInt type, const CqMatrix& matTx,
+		const CqMatrix& matITTx, const CqMatrix& matRTx)
+{
+	const CqMatrix* mat = 0;
+	switch(type)
+	{
+		case type_point:
+			mat = &matTx;
+			break;
+		case type_normal:
+			mat = &matITTx;
+			break;
+		case type_vector:
+			mat = &matRTx;
+			break;
+		default:
+			return 0;
+	}
+	return mat->fIdentity() ? 0 : mat;
+}
+
+/// Transform an array of vectors, which needn't be aligned.
+void transformValues(char* data, std::size_t size, const CqMatrix& mat)
+{
+	for(std::size_t pos = 0; pos + sizeof(CqVector3D) <= size; pos += sizeof(CqVector3D))
+	{
+		CqVector3D v;
+		std::memcpy(&v, data + pos, sizeof(v));
+		v = mat * v;
+		std::memcpy(data + pos, &v, sizeof(v));
+	}
+}
+
+} // unnamed namespace
+
+
+CqDiceCache::CqDiceCache()
+	: m_fileName(),
+	m_maxSize(0),
+	m_usedSize(0),
+	m_modified(false),
+	m_file(),
+	m_entries(),
+	m_hits(0),
+	m_misses(0)
+{ }
+
+CqDiceCache::~CqDiceCache()
+{
+	close();
+}
+
+void CqDiceCache::open(const std::string& fileName, std::size_t maxSize)
+{
+	close();
+	m_fileName = fileName;
+	m_maxSize = maxSize;
+	if(boostfs::exists(fileName) && boostfs::file_size(fileName) > 0)
+	{
+		try
+		{
+			m_file.reset(new boost::iostreams::mapped_file_source(fileName));
+			readIndex();
+		}
+		catch(std::exception& e)
+		{
+			Aqsis::log() << warning << "Could not read dice cache \""
+				<< fileName << "\": " << e.what() << "\n";
+			m_file.reset();
+			m_entries.clear();
+		}
+	}
+}
+
+void CqDiceCache::readIndex()
+{
+	const char* data = m_file->data();
+	std::size_t size = m_file->size();
+	if(!checkFileHeader(data, size))
+	{
+		Aqsis::log() << warning << "Ignoring invalid dice cache \""
+			<< m_fileName << "\"\n";
+		return;
+	}
+	std::size_t pos = fileHeaderSize;
+	// Stop at the first truncated entry; the file may have been cut short.
+	while(size - pos >= entryHeaderSize)
+	{
+		boost::uint64_t key = 0;
+		boost::uint64_t check = 0;
+		TqUint32 entrySize = 0;
+		std::memcpy(&key, data + pos, sizeof(key));
+		std::memcpy(&check, data + pos + sizeof(key), sizeof(check));
+		std::memcpy(&entrySize, data + pos + sizeof(key) + sizeof(check),
+				sizeof(entrySize));
+		if(size - pos - entryHeaderSize < entrySize)
+			break;
+		SqEntry& entry = m_entries[key];
+		entry.check = check;
+		entry.data = data + pos + entryHeaderSize;
+		entry.size = entrySize;
+		entry.used = false;
+		pos += entryHeaderSize + entrySize;
+	}
+}
+
+void CqDiceCache::close()
+{
+	if(m_fileName.empty())
+		return;
+	if(m_hits + m_misses > 0)
+		Aqsis::log() << info << "Dice cache \"" << m_fileName << "\": "
+			<< m_hits << " hits, " << m_misses << " misses\n";
+	if(m_modified)
+	{
+		// Write entries used by this render first, then as many of the
+		// unused ones as fit.  The new file is written alongside the old
+		// one and renamed over it so that other renders never see a
+		// partially written cache.
+		std::string tmpName = uniqueTempName(m_fileName);
+		std::ofstream out(tmpName.c_str(), std::ios::out | std::ios::binary);
+		writeFileHeader(out);
+		std::size_t fileSize = fileHeaderSize;
+		for(int pass = 0; pass < 2; ++pass)
+		{
+			for(TqEntryMap::const_iterator i = m_entries.begin(); i != m_entries.end(); ++i)
+			{
+				const SqEntry& entry = i->second;
+				if(entry.used != (pass == 0))
+					continue;
+				std::size_t entrySize = entryHeaderSize + entry.size;
+				if(fileSize + entrySize > m_maxSize)
+					continue;
+				TqUint32 dataSize = entry.size;
+				out.write(reinterpret_cast<const char*>(&i->first), sizeof(i->first));
+				out.write(reinterpret_cast<const char*>(&entry.check), sizeof(entry.check));
+				out.write(reinterpret_cast<const char*>(&dataSize), sizeof(dataSize));
+				out.write(entry.data, entry.size);
+				fileSize += entrySize;
+			}
+		}
+		out.close();
+		// The mapping must be closed before the file can be replaced.
+		m_file.reset();
+		if(!out)
+		{
+			Aqsis::log() << warning << "Could not write dice cache \""
+				<< tmpName << "\"\n";
+			std::remove(tmpName.c_str());
+		}
+		else if(!replaceFile(tmpName, m_fileName))
+		{
+			Aqsis::log() << warning << "Could not save dice cache \""
+				<< m_fileName << "\"\n";
+		}
+	}
+	m_file.reset();
+	m_entries.clear();
+	m_fileName.clear();
+	m_usedSize = 0;
+	m_modified = false;
+	m_hits = 0;
+	m_misses = 0;
+}
+
+bool CqDiceCache::isOpen() const
+{
+	return !m_fileName.empty();
+}
+
+bool CqDiceCache::find(boost::uint64_t key, boost::uint64_t check,
+		std::vector<char>& data)
+{
+	const SqEntry* entry = 0;
+	{
+#		ifdef ENABLE_THREADING
+		boost::mutex::scoped_lock lock(m_mutex);
+#		endif
+		TqEntryMap::iterator i = m_entries.find(key);
+		// An entry with a different check hash was made from different
+		// input which happens to share the key.
+		if(i == m_entries.end() || i->second.check != check)
+		{
+			++m_misses;
+			return false;
+		}
+		if(!i->second.used)
+		{
+			i->second.used = true;
+			m_usedSize += entryHeaderSize + i->second.size;
+		}
+		++m_hits;
+		entry = &i->second;
+	}
+	// Entries are never changed or removed while the cache is open, so the
+	// data can be copied without holding the lock.
+	data.assign(entry->data, entry->data + entry->size);
+	return true;
+}
+
+void CqDiceCache::insert(boost::uint64_t key, boost::uint64_t check,
+		const std::vector<char>& data)
+{
+#	ifdef ENABLE_THREADING
+	boost::mutex::scoped_lock lock(m_mutex);
+#	endif
+	std::size_t entrySize = entryHeaderSize + data.size();
+	if(fileHeaderSize + m_usedSize + entrySize > m_maxSize
+		|| m_entries.find(key) != m_entries.end())
+		return;
+	SqEntry& entry = m_entries[key];
+	entry.check = check;
+	entry.storage = data;
+	entry.data = entry.storage.empty() ? 0 : &entry.storage[0];
+	entry.size = data.size();
+	entry.used = true;
+	m_usedSize += entrySize;
+	m_modified = true;
+}
+
+bool CqDiceCache::restoreGrid(const CqDiceKey& key, IqShaderExecEnv* env,
+		TqInt& lDone, const CqMatrix& matTx, const CqMatrix& matITTx,
+		const CqMatrix& matRTx)
+{
+	std::vector<char> data;
+	if(!find(key.value(), key.check(), data))
+		return false;
+	const char* pos = data.empty() ? 0 : &data[0];
+	const char* end = pos + data.size();
+	TqInt32 header[2];
+	if(static_cast<std::size_t>(end - pos) < sizeof(header))
+		return false;
+	std::memcpy(header, pos, sizeof(header));
+	pos += sizeof(header);
+	for(TqInt i = 0; i < header[1]; ++i)
+	{
+		SqVarHeader varHeader;
+		if(static_cast<std::size_t>(end - pos) < sizeof(varHeader))
+			return false;
+		std::memcpy(&varHeader, pos, sizeof(varHeader));
+		pos += sizeof(varHeader);
+		if(varHeader.varID < 0 || varHeader.varID >= EnvVars_Last)
+			return false;
+		IqShaderData* var = env->pVar(varHeader.varID);
+		char* varValues = 0;
+		std::size_t varSize = 0;
+		if(!var || var->Type() != varHeader.type
+			|| static_cast<TqInt>(var->Size()) != varHeader.count
+			|| !varData(var, varValues, varSize)
+			|| static_cast<std::size_t>(end - pos) < varSize)
+			return false;
+		std::memcpy(varValues, pos, varSize);
+		if(const CqMatrix* mat = varTransform(var->Type(), matTx, matITTx, matRTx))
+			transformValues(varValues, varSize, *mat);
+		pos += varSize;
+	}
+	lDone = header[0];
+	return true;
+}
+
+void CqDiceCache::storeGrid(const CqDiceKey& key, IqShaderExecEnv* env,
+		TqInt lDone, const CqMatrix& matTx, const CqMatrix& matITTx,
+		const CqMatrix& matRTx)
+{
+	std::vector<char> data;
+	TqInt32 header[2] = { lDone, 0 };
+	data.insert(data.end(), reinterpret_cast<const char*>(header),
+			reinterpret_cast<const char*>(header + 2));
+	for(TqInt varID = 0; varID < EnvVars_Last; ++varID)
+	{
+		IqShaderData* var = env->pVar(varID);
+		if(!isDONE(lDone, varID) || !var)
+			continue;
+		char* varValues = 0;
+		std::size_t varSize = 0;
+		// Grids holding variables of other types aren't cached.
+		if(!varData(var, varValues, varSize))
+			return;
+		SqVarHeader varHeader = { varID, var->Type(),
+			static_cast<TqInt32>(var->Size()) };
+		data.insert(data.end(), reinterpret_cast<const char*>(&varHeader),
+				reinterpret_cast<const char*>(&varHeader + 1));
+		std::size_t start = data.size();
+		data.insert(data.end(), varValues, varValues + varSize);
+		// Transform the copy into key space, leaving the grid untouched.
+		if(const CqMatrix* mat = varTransform(var->Type(), matTx, matITTx, matRTx))
+			transformValues(&data[start], varSize, *mat);
+		++header[1];
+	}
+	std::memcpy(&data[0], header, sizeof(header));
+	insert(key.value(), key.check(), data);
+}
+
+} // namespace Aqsis
@@ -0,0 +1,232 @@
+// Aqsis
+// Copyright (C) 1997 - 2001, Paul C. Gregory
+//
+// Contact: pgregory@aqsis.org
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation; either
+// version 2 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+/** \file
+ * \brief Persistent cache of diced grids.
+ *
+ * Dicing a surface produces the same grid every time it's rendered with the
+ * same geometry and dice sizes.  The dice cache stores the diced primitive
+ * variables of each grid under a key made from everything which went into
+ * dicing it, so that later renders can copy the grid data instead
+ * of dicing again.  The cache is kept in a single file which is memory mapped
+ * when a world begins and rewritten when it ends, so it's shared between
+ * frames and between separate runs of the renderer.
+ */
+
+#ifndef DICECACHE_H_INCLUDED
+#define DICECACHE_H_INCLUDED 1
+
+#include <aqsis/aqsis.h>
+
+#include <cstddef>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <boost/cstdint.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/scoped_ptr.hpp>
+#ifdef ENABLE_THREADING
+#include <boost/thread/mutex.hpp>
+#endif
+
+#include <aqsis/math/matrix.h>
+#include <aqsis/util/sstring.h>
+
+namespace boost { namespace iostreams { class mapped_file_source; } }
+
+namespace Aqsis {
+
+struct IqShaderExecEnv;
+
+//------------------------------------------------------------------------------
+/** \brief Key identifying the input to a dicing operation.
+ *
+ * The key is a 64 bit FNV-1a hash of everything added to it.  Surfaces add
+ * their primitive variables and any other state that affects dicing, and
+ * the dicer adds the dice sizes and the variables needed by the shaders.
+ * A second, independent hash of the same input is kept alongside, so that
+ * the cache can tell when two different inputs share a key.
+ */
+class CqDiceKey
+{
+	public:
+		CqDiceKey()
+			: m_hash(0xcbf29ce484222325ULL),
+			m_check(0x84222325cbf29ce4ULL)
+		{ }
+
+		/// Add raw bytes to the key.
+		void add(const void* data, std::size_t size)
+		{
+			const unsigned char* p = static_cast<const unsigned char*>(data);
+			for(std::size_t i = 0; i < size; ++i)
+			{
+				m_hash ^= p[i];
+				m_hash *= 0x100000001b3ULL;
+				m_check = (m_check ^ p[i]) * 0x9e3779b97f4a7c15ULL;
+				m_check ^= m_check >> 29;
+			}
+		}
+		/// Add a value made of floats or integers, without any padding.
+		template<typename T>
+		void add(const T& value)
+		{
+			add(&value, sizeof(T));
+		}
+		void add(const CqString& value)
+		{
+			add(value.c_str(), value.size() + 1);
+		}
+		void add(const CqMatrix& value)
+		{
+			for(TqInt i = 0; i < 4; ++i)
+				for(TqInt j = 0; j < 4; ++j)
+					add(value[i][j]);
+		}
+
+		/// The hash used to index the cache.
+		boost::uint64_t value() const
+		{
+			return m_hash;
+		}
+		/// The second hash, checked against the stored entry.
+		boost::uint64_t check() const
+		{
+			return m_check;
+		}
+
+	private:
+		boost::uint64_t m_hash;
+		boost::uint64_t m_check;
+};
+
+
+//------------------------------------------------------------------------------
+/** \brief Persistent cache of diced grid data.
+ *
+ * Entries are opaque blocks of data indexed by CqDiceKey values.  Entries
+ * read from the cache file stay in the memory mapping; entries added during
+ * the render are held in memory until close() writes them out, so a render
+ * which dices many new grids holds up to the size limit in grid copies until
+ * the cache is closed at the end of the world.  The file is
+ * rewritten as a whole, with entries used by the current render first, and
+ * older unused entries are dropped once the file would exceed its size
+ * limit.
+ */
+class CqDiceCache : boost::noncopyable
+{
+	public:
+		CqDiceCache();
+		~CqDiceCache();
+
+		/** \brief Open a cache file.
+		 *
+		 * A missing or invalid file is treated as an empty cache, and is
+		 * created when the cache is closed.
+		 *
+		 * \param fileName - name of the cache file.
+		 * \param maxSize - maximum size of the cache file in bytes.
+		 */
+		void open(const std::string& fileName, std::size_t maxSize);
+		/// Write out any new entries and close the cache.
+		void close();
+		/// Return true if a cache file is open.
+		bool isOpen() const;
+
+		/** \brief Look up an entry.
+		 *
+		 * \param key - key of the entry.
+		 * \param check - second hash of the entry input.
+		 * \param data - returns the entry data.
+		 * \return false if there's no entry for key, or if the entry was
+		 * stored with a different check hash.
+		 */
+		bool find(boost::uint64_t key, boost::uint64_t check, std::vector<char>& data);
+		/** \brief Add an entry.
+		 *
+		 * Entries which already exist are ignored, as are entries which would
+		 * take the entries used by this render over the size limit.
+		 */
+		void insert(boost::uint64_t key, boost::uint64_t check,
+				const std::vector<char>& data);
+
+		/** \brief Fill the variables of a grid from the cache.
+		 *
+		 * Grids are cached in the space their key was made in, and point,
+		 * normal and vector variables are transformed out of it with the
+		 * given matrices as they're restored.
+		 *
+		 * \param key - key for the dicing inputs of the grid.
+		 * \param env - shader variables of the grid, initialised for its size.
+		 * \param lDone - returns the set of variables filled in.
+		 * \param matTx - transformation for points, from key space to the grid.
+		 * \param matITTx - transformation for normals.
+		 * \param matRTx - transformation for vectors.
+		 * \return false if the grid isn't in the cache.
+		 */
+		bool restoreGrid(const CqDiceKey& key, IqShaderExecEnv* env, TqInt& lDone,
+				const CqMatrix& matTx = CqMatrix(),
+				const CqMatrix& matITTx = CqMatrix(),
+				const CqMatrix& matRTx = CqMatrix());
+		/** \brief Store the diced variables of a grid in the cache.
+		 *
+		 * \param key - key for the dicing inputs of the grid.
+		 * \param env - shader variables of a freshly diced grid.
+		 * \param lDone - set of variables diced into the grid.
+		 * \param matTx - transformation for points, from the grid to key space.
+		 * \param matITTx - transformation for normals.
+		 * \param matRTx - transformation for vectors.
+		 */
+		void storeGrid(const CqDiceKey& key, IqShaderExecEnv* env, TqInt lDone,
+				const CqMatrix& matTx = CqMatrix(),
+				const CqMatrix& matITTx = CqMatrix(),
+				const CqMatrix& matRTx = CqMatrix());
+
+	private:
+		struct SqEntry
+		{
+			boost::uint64_t check;		///< Second hash of the entry input.
+			const char* data;			///< Entry data, in the mapping or in storage.
+			std::size_t size;			///< Size of the entry data.
+			bool used;					///< True if the entry was used this render.
+			std::vector<char> storage;	///< Data of entries added this render.
+		};
+		typedef std::map<boost::uint64_t, SqEntry> TqEntryMap;
+
+		void readIndex();
+
+		std::string m_fileName;
+		std::size_t m_maxSize;
+		/// Size of the entries used or added this render, including headers.
+		std::size_t m_usedSize;
+		/// True if any entries were added since the cache was opened.
+		bool m_modified;
+		boost::scoped_ptr<boost::iostreams::mapped_file_source> m_file;
+		TqEntryMap m_entries;
+		TqInt m_hits;
+		TqInt m_misses;
+#ifdef ENABLE_THREADING
+		boost::mutex m_mutex;
+#endif
+};
+
+} // namespace Aqsis
+
+#endif // DICECACHE_H_INCLUDED
@@ -0,0 +1,261 @@
+// Aqsis
+// Copyright (C) 1997 - 2001, Paul C. Gregory
+//
+// Contact: pgregory@aqsis.org
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation; either
+// version 2 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+/** \file Unit tests for the dice cache.
+ */
+
+#include "dicecache.h"
+
+#include <cstdio>
+
+#include <aqsis/math/color.h>
+#include <aqsis/math/vector3d.h>
+#include <aqsis/shadervm/ishader.h>
+#include <aqsis/shadervm/ishaderdata.h>
+#include <aqsis/shadervm/ishaderexecenv.h>
+
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/auto_unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(dicecache_tests)
+
+using namespace Aqsis;
+
+namespace {
+
+CqDiceKey gridKey(TqInt id)
+{
+	CqDiceKey key;
+	key.add(id);
+	return key;
+}
+
+const char* cacheName = "dicecache_test.aqdice";
+
+std::vector<char> makeData(TqInt size, char fill)
+{
+	return std::vector<char>(size, fill);
+}
+
+/// Create the shader variables for a 4x4 micropolygon grid.
+boost::shared_ptr<IqShaderExecEnv> makeGridEnv(IqShader* shader, TqInt uses)
+{
+	boost::shared_ptr<IqShaderExecEnv> env = IqShaderExecEnv::create(0);
+	env->Initialise(4, 4, 16, 25, true, IqConstAttributesPtr(),
+			IqConstTransformPtr(), shader, uses);
+	return env;
+}
+
+} // unnamed namespace
+
+
+BOOST_AUTO_TEST_CASE(dice_key_depends_on_values)
+{
+	CqDiceKey a;
+	CqDiceKey b;
+	a.add(1.0f);
+	b.add(1.0f);
+	BOOST_CHECK_EQUAL(a.value(), b.value());
+	a.add(TqInt(16));
+	b.add(TqInt(17));
+	BOOST_CHECK(a.value() != b.value());
+
+	// Matrices are hashed by their elements only.
+	CqDiceKey c;
+	CqDiceKey d;
+	c.add(CqMatrix());
+	d.add(CqMatrix(1, 1, 1));
+	BOOST_CHECK_EQUAL(c.value(), d.value());
+
+	// The check hash is independent of the key.
+	BOOST_CHECK_EQUAL(a.check(), a.check());
+	BOOST_CHECK(a.check() != b.check());
+	BOOST_CHECK(a.check() != a.value());
+}
+
+BOOST_AUTO_TEST_CASE(dice_cache_persists_entries)
+{
+	std::remove(cacheName);
+	{
+		CqDiceCache cache;
+		cache.open(cacheName, 1024*1024);
+		BOOST_REQUIRE(cache.isOpen());
+		std::vector<char> data;
+		BOOST_CHECK(!cache.find(1, 10, data));
+		cache.insert(1, 10, makeData(100, 'a'));
+		cache.insert(2, 20, makeData(10, 'b'));
+		// Entries added in this render can be found straight away.
+		BOOST_REQUIRE(cache.find(1, 10, data));
+		BOOST_CHECK(data == makeData(100, 'a'));
+		cache.close();
+		BOOST_CHECK(!cache.isOpen());
+	}
+	{
+		CqDiceCache cache;
+		cache.open(cacheName, 1024*1024);
+		std::vector<char> data;
+		BOOST_REQUIRE(cache.find(2, 20, data));
+		BOOST_CHECK(data == makeData(10, 'b'));
+		BOOST_REQUIRE(cache.find(1, 10, data));
+		BOOST_CHECK(data == makeData(100, 'a'));
+		BOOST_CHECK(!cache.find(3, 30, data));
+		// An entry made from different input with the same key isn't used.
+		BOOST_CHECK(!cache.find(1, 11, data));
+	}
+	std::remove(cacheName);
+}
+
+BOOST_AUTO_TEST_CASE(dice_cache_drops_unused_entries)
+{
+	std::remove(cacheName);
+	const std::size_t maxSize = 900;
+	{
+		CqDiceCache cache;
+		cache.open(cacheName, maxSize);
+		cache.insert(1, 10, makeData(400, 'a'));
+		cache.insert(2, 20, makeData(400, 'b'));
+		// Too big to fit alongside the other entries.
+		cache.insert(3, 30, makeData(400, 'c'));
+		std::vector<char> data;
+		BOOST_CHECK(!cache.find(3, 30, data));
+	}
+	{
+		// Use one old entry and add a new one.  The unused entry no longer
+		// fits in the file and is dropped.
+		CqDiceCache cache;
+		cache.open(cacheName, maxSize);
+		std::vector<char> data;
+		BOOST_REQUIRE(cache.find(2, 20, data));
+		cache.insert(4, 40, makeData(100, 'd'));
+		BOOST_CHECK(cache.find(4, 40, data));
+		cache.close();
+		cache.open(cacheName, maxSize);
+		BOOST_CHECK(!cache.find(1, 10, data));
+		BOOST_CHECK(cache.find(2, 20, data));
+		BOOST_CHECK(cache.find(4, 40, data));
+	}
+	std::remove(cacheName);
+}
+
+BOOST_AUTO_TEST_CASE(dice_cache_restores_grids)
+{
+	std::remove(cacheName);
+	boost::shared_ptr<IqShader> shader = createShaderVM(0);
+	TqInt uses = (1 << EnvVars_P) | (1 << EnvVars_Cs) | (1 << EnvVars_u)
+		| (1 << EnvVars_v);
+	// Cs is used by the shaders but not diced, so it isn't stored.
+	TqInt lDone = (1 << EnvVars_P) | (1 << EnvVars_u) | (1 << EnvVars_v);
+	{
+		boost::shared_ptr<IqShaderExecEnv> env = makeGridEnv(shader.get(), uses);
+		for(TqInt i = 0; i < 25; ++i)
+		{
+			env->pVar(EnvVars_P)->SetPoint(CqVector3D(i, 2*i, 3*i), i);
+			env->pVar(EnvVars_u)->SetFloat(0.25f*(i%5), i);
+			env->pVar(EnvVars_v)->SetFloat(0.25f*(i/5), i);
+		}
+		CqDiceCache cache;
+		cache.open(cacheName, 1024*1024);
+		cache.storeGrid(gridKey(42), env.get(), lDone);
+	}
+	{
+		CqDiceCache cache;
+		cache.open(cacheName, 1024*1024);
+		boost::shared_ptr<IqShaderExecEnv> env = makeGridEnv(shader.get(), uses);
+		TqInt restoredDone = 0;
+		BOOST_CHECK(!cache.restoreGrid(gridKey(43), env.get(), restoredDone));
+		BOOST_REQUIRE(cache.restoreGrid(gridKey(42), env.get(), restoredDone));
+		BOOST_CHECK_EQUAL(restoredDone, lDone);
+		for(TqInt i = 0; i < 25; ++i)
+		{
+			CqVector3D P;
+			env->pVar(EnvVars_P)->GetPoint(P, i);
+			BOOST_CHECK_EQUAL(P, CqVector3D(i, 2*i, 3*i));
+			TqFloat u = 0;
+			TqFloat v = 0;
+			env->pVar(EnvVars_u)->GetFloat(u, i);
+			env->pVar(EnvVars_v)->GetFloat(v, i);
+			BOOST_CHECK_EQUAL(u, 0.25f*(i%5));
+			BOOST_CHECK_EQUAL(v, 0.25f*(i/5));
+		}
+
+		// A grid of a different size doesn't match the cached variables.
+		boost::shared_ptr<IqShaderExecEnv> bigEnv = IqShaderExecEnv::create(0);
+		bigEnv->Initialise(8, 4, 32, 45, true, IqConstAttributesPtr(),
+				IqConstTransformPtr(), shader.get(), uses);
+		BOOST_CHECK(!cache.restoreGrid(gridKey(42), bigEnv.get(), restoredDone));
+	}
+	std::remove(cacheName);
+}
+
+BOOST_AUTO_TEST_CASE(dice_cache_transforms_grids)
+{
+	std::remove(cacheName);
+	boost::shared_ptr<IqShader> shader = createShaderVM(0);
+	TqInt uses = (1 << EnvVars_P) | (1 << EnvVars_N) | (1 << EnvVars_u);
+	TqInt lDone = uses;
+	// Grids are stored in key space: translated for points, scaled for
+	// normals and unchanged for floats.
+	CqMatrix toKey;
+	toKey.Translate(CqVector3D(10, 0, 0));
+	CqMatrix normalToKey;
+	normalToKey.Scale(2.0f);
+	CqMatrix fromKey;
+	fromKey.Translate(CqVector3D(0, -5, 0));
+	CqMatrix normalFromKey;
+	normalFromKey.Scale(0.5f);
+	{
+		boost::shared_ptr<IqShaderExecEnv> env = makeGridEnv(shader.get(), uses);
+		for(TqInt i = 0; i < 25; ++i)
+		{
+			env->pVar(EnvVars_P)->SetPoint(CqVector3D(i, 0, 0), i);
+			env->pVar(EnvVars_N)->SetNormal(CqVector3D(0, 0, i), i);
+			env->pVar(EnvVars_u)->SetFloat(i, i);
+		}
+		CqDiceCache cache;
+		cache.open(cacheName, 1024*1024);
+		cache.storeGrid(gridKey(1), env.get(), lDone, toKey, normalToKey, CqMatrix());
+		// Storing leaves the grid itself alone.
+		CqVector3D P;
+		env->pVar(EnvVars_P)->GetPoint(P, 3);
+		BOOST_CHECK_EQUAL(P, CqVector3D(3, 0, 0));
+	}
+	{
+		CqDiceCache cache;
+		cache.open(cacheName, 1024*1024);
+		boost::shared_ptr<IqShaderExecEnv> env = makeGridEnv(shader.get(), uses);
+		TqInt restoredDone = 0;
+		BOOST_REQUIRE(cache.restoreGrid(gridKey(1), env.get(), restoredDone,
+					fromKey, normalFromKey, CqMatrix()));
+		for(TqInt i = 0; i < 25; ++i)
+		{
+			CqVector3D P;
+			CqVector3D N;
+			TqFloat u = 0;
+			env->pVar(EnvVars_P)->GetPoint(P, i);
+			env->pVar(EnvVars_N)->GetNormal(N, i);
+			env->pVar(EnvVars_u)->GetFloat(u, i);
+			BOOST_CHECK_EQUAL(P, CqVector3D(i + 10, -5, 0));
+			BOOST_CHECK_EQUAL(N, CqVector3D(0, 0, i));
+			BOOST_CHECK_EQUAL(u, i);
+		}
+	}
+	std::remove(cacheName);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -43,6 +43,12 @@
 #include <aqsis/util/plugins.h>
 #include <aqsis/ri/ri.h>
 #include <aqsis/math/vector4d.h>
+#include "threadscheduler.h"
+
+#include <boost/bind.hpp>
+#ifdef	ENABLE_THREADING
+#include <boost/thread.hpp>
+#endif
 
 #if _MSC_VER
 #pragma warning(disable:4786)	// hide stl warnings (VS6)
@@ -551,9 +557,10 @@ class blobby_vm_assembler
 //---------------------------------------------------------------------
 /** Constructor.
  */
-CqBlobby::CqBlobby(TqInt nleaf, TqInt ncode, TqInt* code, TqInt nfloats, TqFloat* floats, TqInt nstrings, char** strings) : m_nleaf(nleaf), m_ncode(ncode), m_code(code), m_nfloats(nfloats), m_floats(floats), m_nstrings(nstrings), m_strings(strings)
+CqBlobby::CqBlobby(TqInt nleaf, TqInt ncode, TqInt* code, TqInt nfloats, TqFloat* floats, TqInt nstrings, char** strings) : m_threadSafe(true), m_nleaf(nleaf), m_ncode(ncode), m_code(code), m_nfloats(nfloats), m_floats(floats), m_nstrings(nstrings), m_strings(strings)
 {
 	blobby_vm_assembler(nleaf, ncode, code, nfloats, floats, nstrings, strings, m_instructions, m_bbox);
+	compile();
 }
 
 //---------------------------------------------------------------------
@@ -579,445 +586,610 @@ TqInt CqBlobby::Split( std::vector<boost::shared_ptr<CqSurface> >& aSplits )
 }
 
 //---------------------------------------------------------------------
-/** Return the float value based on each operands. In particular Add will
- *  accumulate the result of each opcode together. Now this function is
- *  particulary important since it is used to weight each operand and deduce
- *  how well will be split the parent blobby' parameters (via ri.cpp).
- *  Not particular intelligent since it is redoing what the next method is
- *  computing however more keen eyes could combine both methods together to
- *  raise the performance significantly.
+/** Compile the assembled program for evaluation.
+ *
+ * The leaf primitives are decoded once into m_leaves, with everything that
+ * doesn't depend on the sample position precomputed, and the program becomes
+ * a flat list of operations referring to them.  Each leaf also gets the bound
+ * of its support so that it can be skipped away from its neighbourhood.
  */
-/** Blobby virtual machine program execution - calculates the value of an implicit surface at a given 3D point */
-TqFloat CqBlobby::implicit_value( const CqVector3D& Point, TqInt n, std::vector <TqFloat> &splits )
+void CqBlobby::compile()
 {
-	register TqFloat sum = 0.0f;
-	register TqFloat result;
-	std::stack<TqFloat> stack;
-	TqInt int_index = 0;
-	stack.push(0);
-
-	register unsigned long pc;
+	// Start of the code computing each value on the evaluation stack.
+	std::vector<TqInt> starts;
+	m_threadSafe = true;
 
-	for(pc = 0; pc < m_instructions.size(); )
+	for(TqUint pc = 0; pc < m_instructions.size(); )
 	{
-		switch(m_instructions[pc++].opcode)
+		SqLeaf leaf;
+		leaf.opcode = m_instructions[pc++].opcode;
+		leaf.value = 0.0f;
+		leaf.index = 0;
+		leaf.floatIndex = 0;
+		leaf.bounded = false;
+		switch(leaf.opcode)
 		{
-				case NEGATE:
-				case IDEMPOTENTATE:
-					break;
 				case CONSTANT:
+					leaf.value = m_instructions[pc++].value;
+					break;
+
+				case ELLIPSOID:
 				{
-					result = m_instructions[pc++].value;
-					sum += result;
-					splits[int_index++] = result;
+					leaf.matrix = m_instructions[pc++].get_matrix();
+					leaf.bound = CqBound(-1, -1, -1, 1, 1, 1);
+					leaf.bound.Transform(leaf.matrix.Inverse());
+					leaf.bounded = true;
 				}
 				break;
 
-				case ELLIPSOID:
+				case SEGMENT:
 				{
-					const TqFloat r2 = (m_instructions[pc++].get_matrix() * Point).Magnitude2();
-					result = r2 <= 1 ? 1 - 3*r2 + 3*r2*r2 - r2*r2*r2 : 0;
-					sum += result;
-					splits[int_index++] = result;
+					const CqMatrix m = m_instructions[pc++].get_matrix();
+					leaf.start = m_instructions[pc++].get_vector();
+					leaf.end = m_instructions[pc++].get_vector();
+					const TqFloat radius = m_instructions[pc++].value;
+					// The blob at the nearest segment point is transformed by
+					// Translation( segment_point ) * Scaling ( radius ) * m.
+					// Everything but the translation can be inverted here.
+					leaf.matrix = m.Inverse() * CqMatrix( 1/radius, 1/radius, 1/radius );
+					leaf.bound = CqBound(-1, -1, -1, 1, 1, 1);
+					leaf.bound.Transform(CqMatrix( leaf.start ) * CqMatrix( radius, radius, radius ) * m);
+					CqBound endBound(-1, -1, -1, 1, 1, 1);
+					endBound.Transform(CqMatrix( leaf.end ) * CqMatrix( radius, radius, radius ) * m);
+					leaf.bound.Encapsulate(&endBound);
+					leaf.bounded = true;
 				}
 				break;
 
 				case PLANE:
 				{
-					TqInt which = (TqInt) m_instructions[pc++].value;
-					TqInt n = (TqInt) m_instructions[pc++].value;
-
-					CqString depthname = m_strings[which];
-					/** \todo Fix to use the new-style texture maps.  Using
-					 * GetOcclusionMap happens to access the old texture
-					 * sampling machinary through GetShadowMap()
-					 */
-					IqTextureMapOld* pMap = QGetRenderContextI() ->GetOcclusionMap( depthname );
-
-					TqFloat A, B, C, D;
-					std::valarray<TqFloat> fv;
-					TqFloat avg, depth;
-
-					depth = -Point.z();
-
-					fv.resize(1);
-					fv[0]= 0.0f;
-
-
-					A = m_floats[n];
-					B = m_floats[n+1];
-					C = m_floats[n+2];
-					D = m_floats[n+3];
-
-					if ( pMap != 0 && pMap->IsValid() )
-					{
-						CqVector3D swidth(0.0f);
-						CqVector3D twidth(0.0f);
-						CqVector3D aq_P = Point;
-						pMap->SampleMap( aq_P, swidth, twidth, fv, 0, &avg, &depth );
-					}
-
-
-					result = repulsion(depth, A, B, C, D);
-					sum += result;
-					splits[int_index++] = result;
+					leaf.index = (TqInt) m_instructions[pc++].value;
+					leaf.floatIndex = (TqInt) m_instructions[pc++].value;
+					// Depth map lookups aren't safe from several threads.
+					m_threadSafe = false;
 				}
 				break;
 
 				case AIR:
 				{
-					/*
-					A dynamic blob op can be used like any other primitive blob in a Blobby object.  DBOs have two required parameters and can have an arbitrary number of float, string, or integer parameters that arepassed to the DBO functions.
-
-					9000 2 nameix transformix
-					9000 4 nameix transformix nfloat floatix
-					9000 6 nameix transformix nfloat floatix nstring stringix 
-					9000 (7+nint) nameix transformix nfloat floatix nstring stringix nintint_1...int_nint 
-
-					nameix is an index into the string array for the name of the DBO.  
-					AIR will search the proceduresearch path for a DLL or shared object with the corresponding name. 
-					transformix is an index into the float array for a matrix giving the blob-to-object space transformation.
-					floatix (if present) is the index in the float array of the first of the nfloat float parameters. 
-					stringix (if present) is the index in the string array of the first of the nstring string parameters.
+					leaf.index = m_instructions[pc++].count;
+					leaf.matrix = m_instructions[pc++].get_matrix();
+					pc++; // Skip the center of the bound
+					leaf.end = m_instructions[pc++].get_vector();
+					leaf.start = m_instructions[pc++].get_vector();
+					// Nothing is known about the thread safety of DBO plugins.
+					m_threadSafe = false;
+				}
+				break;
 
-					 on the stack you will find
+				case ADD:
+				case MULTIPLY:
+				case MIN:
+				case MAX:
+					pushOperation(leaf.opcode, m_instructions[pc++].count, starts);
+					continue;
 
-					m_instructions.push_back(CqBlobby::instruction(CqBlobby::AIR));
-					m_instructions.push_back(CqBlobby::instruction(op.index)); // idx to Count
-					m_instructions.push_back(transformation.Inverse()); // Push the inverse matrix
-					m_instructions.push_back(mid); // Push the center  of this blobby according to its bbox
-					m_instructions.push_back(mx); // Push the max  of this blobby according to its bbox
-					m_instructions.push_back(mn); // Push the min  of this blobby according to its bbox
+				case SUBTRACT:
+				case DIVIDE:
+					pushOperation(leaf.opcode, 2, starts);
+					continue;
 
-					*/
+				case NEGATE:
+				case IDEMPOTENTATE:
+					continue;
+		}
+		starts.push_back(m_program.size());
+		m_program.push_back(SqOp(leaf.opcode, m_leaves.size()));
+		m_leaves.push_back(leaf);
+	}
+}
 
-					TqInt count, e, f, g, h, i, j;
+//---------------------------------------------------------------------
+/** Add an operation on the values at the top of the stack to the program.
+ *
+ * If there are too few values on the stack, which can happen when unsupported
+ * operations have been left out of the program, zeros are used in their place.
+ */
+void CqBlobby::pushOperation(EqOpcodeName opcode, TqInt count, std::vector<TqInt>& starts)
+{
+	TqInt depth = starts.size();
+	if(count > depth)
+	{
+		const TqInt missing = count - depth;
+		const TqInt pos = depth > 0 ? starts[0] : m_program.size();
+		m_program.insert(m_program.begin() + pos, missing, SqOp(CONSTANT, -1));
+		for(TqInt i = 0; i < depth; ++i)
+			starts[i] += missing;
+		for(TqInt i = missing-1; i >= 0; --i)
+			starts.insert(starts.begin(), pos + i);
+		depth = count;
+	}
+	const TqInt start = count > 0 ? starts[depth - count] : m_program.size();
+	starts.resize(depth - count);
+	m_program.push_back(SqOp(opcode, count));
+	starts.push_back(start);
+}
 
-					e = f = g = h = i = j = 0;
-					count = m_instructions[pc++].count;
+//---------------------------------------------------------------------
+/** Return the value of a single leaf primitive at a given point.
+ */
+TqFloat CqBlobby::leafValue(const SqLeaf& leaf, const CqVector3D& Point) const
+{
+	switch(leaf.opcode)
+	{
+			case CONSTANT:
+				return leaf.value;
 
-					if (m_code[count] >= 7)
-					{
-						e = 7 - m_code[count]; // How many strings
-						f = count + 7;
-					}
-					if (m_code[count] >= 4)
-					{
-						g = m_code[count + 3]; // How many floats
-						h = m_code[count + 4]; // Idx to the floats
-					}
-					if (m_code[count] >= 6)
-					{
-						i = m_code[count + 5]; // How many strings
-						j = m_code[count + 6]; // Idx to the strings
-					}
+			case ELLIPSOID:
+			{
+				const TqFloat r2 = (leaf.matrix * Point).Magnitude2();
+				return r2 <= 1 ? 1 - 3*r2 + 3*r2*r2 - r2*r2*r2 : 0;
+			}
 
+			case SEGMENT:
+			{
+				// Distance from the nearest segment point
+				const CqVector3D segment_point = nearest_segment_point(Point, leaf.start, leaf.end);
+				const TqFloat r2 = (leaf.matrix * (Point - segment_point)).Magnitude2();
+				return (r2 <= 1) ? (1 - 3*r2 + 3*r2*r2 - r2*r2*r2) : 0;
+			}
 
+			case PLANE:
+			{
+				CqString depthname = m_strings[leaf.index];
+				/** \todo Fix to use the new-style texture maps.  Using
+				 * GetOcclusionMap happens to access the old texture
+				 * sampling machinary through GetShadowMap()
+				 */
+				IqTextureMapOld* pMap = QGetRenderContextI() ->GetOcclusionMap( depthname );
+
+				std::valarray<TqFloat> fv;
+				TqFloat avg, depth;
+				depth = -Point.z();
+
+				fv.resize(1);
+				fv[0]= 0.0f;
+
+				const TqInt n = leaf.floatIndex;
+				TqFloat A = m_floats[n];
+				TqFloat B = m_floats[n+1];
+				TqFloat C = m_floats[n+2];
+				TqFloat D = m_floats[n+3];
+
+				if ( pMap != 0 && pMap->IsValid() )
+				{
+					CqVector3D swidth(0.0f);
+					CqVector3D twidth(0.0f);
+					CqVector3D aq_P = Point;
+					pMap->SampleMap( aq_P, swidth, twidth, fv, 0, &avg, &depth);
+				}
 
-					TqFloat point[3];
-					const CqMatrix transformation = m_instructions[pc++].get_matrix();
-					const CqVector3D mid = m_instructions[pc++].get_vector();
-					const CqVector3D mx = m_instructions[pc++].get_vector();
-					const CqVector3D mn = m_instructions[pc++].get_vector();
-					const CqBound bound(mn, mx);
+				return repulsion(depth, A, B, C, D);
+			}
 
-					TqState s;
-					CqVector3D tmp = transformation * Point;
-					point[0] = tmp.x();
-					point[1] = tmp.y();
-					point[2] = tmp.z();
+			case AIR:
+			{
+				/*
+				A dynamic blob op can be used like any other primitive blob in a Blobby object.  DBOs have two required parameters and can have an arbitrary number of float, string, or integer parameters that arepassed to the DBO functions.
+
+				9000 2 nameix transformix
+				9000 4 nameix transformix nfloat floatix
+				9000 6 nameix transformix nfloat floatix nstring stringix 
+				9000 (7+nint) nameix transformix nfloat floatix nstring stringix nintint_1...int_nint 
+
+				nameix is an index into the string array for the name of the DBO.  
+				AIR will search the proceduresearch path for a DLL or shared object with the corresponding name. 
+				transformix is an index into the float array for a matrix giving the blob-to-object space transformation.
+				floatix (if present) is the index in the float array of the first of the nfloat float parameters. 
+				stringix (if present) is the index in the string array of the first of the nstring string parameters.
+				*/
+				TqInt count, e, f, g, h, i, j;
+
+				e = f = g = h = i = j = 0;
+				count = leaf.index;
+
+				if (m_code[count] >= 7)
+				{
+					e = 7 - m_code[count]; // How many strings
+					f = count + 7;
+				}
+				if (m_code[count] >= 4)
+				{
+					g = m_code[count + 3]; // How many floats
+					h = m_code[count + 4]; // Idx to the floats
+				}
+				if (m_code[count] >= 6)
+				{
+					i = m_code[count + 5]; // How many strings
+					j = m_code[count + 6]; // Idx to the strings
+				}
 
-					if ((point[2]>= 0.0) && bound.Contains3D(tmp) && pImplicitValue )
-					{
-						(*pImplicitValue)(&s, &result, point,
-							             e, &m_code[f],
-							             g, &m_floats[h],
-							             i, &m_strings[j]);
-						result = 1.0 - result;
-					}
+				TqFloat point[3];
+				const CqBound bound(leaf.start, leaf.end);
 
-					sum += result;
-					splits[int_index++] = result;
-				}
-				break;
+				TqState s;
+				CqVector3D tmp = leaf.matrix * Point;
+				point[0] = tmp.x();
+				point[1] = tmp.y();
+				point[2] = tmp.z();
 
-				case SEGMENT:
+				TqFloat result = 0.0f;
+				if ((point[2]>= 0.0) && bound.Contains3D(tmp) && pImplicitValue )
 				{
-					const CqMatrix m = m_instructions[pc++].get_matrix();
-					const CqVector3D start = m_instructions[pc++].get_vector();
-					const CqVector3D end = m_instructions[pc++].get_vector();
-					const TqFloat radius = m_instructions[pc++].value;
-
-					// Nearest segment point
-					const CqVector3D segment_point = nearest_segment_point(Point, start, end);
-					// Translation( segment_point ) * Scaling ( radius ) * m
-					const CqMatrix transformation = CqMatrix( segment_point ) * CqMatrix( radius, radius, radius ) * m;
-					// Distance
-					const TqFloat r2 = (transformation.Inverse() * Point).Magnitude2();
-					// Value
-					const TqFloat result = (r2 <= 1) ? (1 - 3*r2 + 3*r2*r2 - r2*r2*r2) : 0;
-
-					sum += result;
-					splits[int_index++] = result;
+					(*pImplicitValue)(&s, &result, point,
+						          e, &m_code[f],
+						          g, &m_floats[h],
+						         i, &m_strings[j]);
+					result = 1.0 - result;
 				}
-				break;
-
-				case CqBlobby::SUBTRACT:
-				case CqBlobby::DIVIDE:
-				case CqBlobby::ADD:
-				case CqBlobby::MULTIPLY:
-				case CqBlobby::MIN:
-				case CqBlobby::MAX:
-				break;
+				return result;
+			}
 
-		}
-		if (int_index >= n)
-			break;
+			default:
+				return 0.0f;
 	}
-
-	return sum;
 }
 
 //---------------------------------------------------------------------
-/** Return the float value based on each opcodes.
- *  This is the most important method it is used by MarchingCubes.cpp to
- *  polygonize the primitives
+/** Blobby program execution - calculates the value of an implicit surface at
+ *  a given 3D point.
+ *
+ *  \param program - the compiled program, or a pruned copy of it.
+ *  \param Point - position to evaluate at.
+ *  \param stack - scratch space for the evaluation stack.
  */
-TqFloat CqBlobby::implicit_value( const CqVector3D& Point )
+TqFloat CqBlobby::evaluate(const TqProgram& program, const CqVector3D& Point,
+		std::vector<TqFloat>& stack) const
 {
-	std::stack<TqFloat> stack;
-	stack.push(0);
-	register TqFloat result;
-	register unsigned long pc;
-
-	for(pc = 0; pc < m_instructions.size(); )
+	stack.clear();
+	TqFloat result;
+	for(TqProgram::const_iterator op = program.begin(), end = program.end(); op != end; ++op)
 	{
-		switch(m_instructions[pc++].opcode)
+		switch(op->opcode)
 		{
-				case NEGATE:
-				case IDEMPOTENTATE:
-					break;
 				case CONSTANT:
-				{
-					stack.push(m_instructions[pc++].value);
-				}
-				break;
+					stack.push_back(op->arg < 0 ? 0.0f : m_leaves[op->arg].value);
+					break;
 
 				case ELLIPSOID:
-				{
-					const TqFloat r2 = (m_instructions[pc++].get_matrix() * Point).Magnitude2();
-					result = r2 <= 1 ? 1 - 3*r2 + 3*r2*r2 - r2*r2*r2 : 0;
+				case SEGMENT:
+				case PLANE:
+				case AIR:
+					stack.push_back(leafValue(m_leaves[op->arg], Point));
+					break;
 
-					//Aqsis::log() << info << "Ellipsoid: result " << result << std::endl;
-					stack.push(result);
+				case SUBTRACT:
+				{
+					TqFloat a = stack.back();
+					stack.pop_back();
+					TqFloat b = stack.back();
+					result = 0.0;
+					if (a != 0.0)
+						result = b/a;
+					stack.back() = result;
 				}
 				break;
 
-				case PLANE:
+				case DIVIDE:
 				{
-					TqInt which = (TqInt) m_instructions[pc++].value;
-					TqInt n = (TqInt) m_instructions[pc++].value;
-
-					CqString depthname = m_strings[which];
-					/** \todo Fix to use the new-style texture maps.  Using
-					 * GetOcclusionMap happens to access the old texture
-					 * sampling machinary through GetShadowMap()
-					 */
-					IqTextureMapOld* pMap = QGetRenderContextI() ->GetOcclusionMap( depthname );
-
-					TqFloat A, B, C, D;
-					std::valarray<TqFloat> fv;
-					TqFloat avg, depth;
-					depth = -Point.z();
-
-					fv.resize(1);
-					fv[0]= 0.0f;
-
-
-					A = m_floats[n];
-					B = m_floats[n+1];
-					C = m_floats[n+2];
-					D = m_floats[n+3];
-
-					if ( pMap != 0 && pMap->IsValid() )
-					{
-						CqVector3D swidth(0.0f);
-						CqVector3D twidth(0.0f);
-						CqVector3D aq_P = Point;
-						pMap->SampleMap( aq_P, swidth, twidth, fv, 0, &avg, &depth);
-					}
-
-					//Aqsis::log() << info << "A " << A << " B " << B << " C " << C << " D " << D << std::endl;
-					result = repulsion(depth, A, B, C, D);
-
-					//Aqsis::log() << info << "Plane: result " << result << std::endl;
-					stack.push(result);
+					TqFloat a = stack.back();
+					stack.pop_back();
+					stack.back() = stack.back() - a;
 				}
 				break;
 
-				case AIR:
+				case ADD:
 				{
-					TqInt count, e, f, g, h, i, j;
-
-					e = f = g = h = i = j = 0;
-					count = m_instructions[pc++].count;
-
-					if (m_code[count] >= 7)
-					{
-						e = 7 - m_code[count]; // How many strings
-						f = count + 7;
-					}
-					if (m_code[count] >= 4)
-					{
-						g = m_code[count + 3]; // How many floats
-						h = m_code[count + 4]; // Idx to the floats
-					}
-					if (m_code[count] >= 6)
-					{
-						i = m_code[count + 5]; // How many strings
-						j = m_code[count + 6]; // Idx to the strings
-					}
-
-
-					TqFloat point[3];
-					const CqMatrix transformation = m_instructions[pc++].get_matrix();
-					const CqVector3D mid = m_instructions[pc++].get_vector();
-					const CqVector3D mx = m_instructions[pc++].get_vector();
-					const CqVector3D mn = m_instructions[pc++].get_vector();
-					const CqBound bound(mn, mx);
-
-					TqState s;
-					CqVector3D tmp = transformation * Point;
-					point[0] = tmp.x();
-					point[1] = tmp.y();
-					point[2] = tmp.z();
-
-					if ((point[2]>= 0.0) && bound.Contains3D(tmp) && pImplicitValue )
-					{
-						(*pImplicitValue)(&s, &result, point,
-							          e, &m_code[f],
-							          g, &m_floats[h],
-							         i, &m_strings[j]);
-						result = 1.0 - result;
-					}
-
-					//Aqsis::log() << info << " Result " << result << std::endl;
-
-					stack.push(result);
+					const TqInt first = stack.size() - op->arg;
+					result = 0.0;
+					for(TqInt i = stack.size() - 1; i >= first; --i)
+						result += stack[i];
+					stack.resize(first);
+					stack.push_back(result);
 				}
 				break;
 
-				case SEGMENT:
+				case MULTIPLY:
 				{
-					const CqMatrix m = m_instructions[pc++].get_matrix();
-					const CqVector3D start = m_instructions[pc++].get_vector();
-					const CqVector3D end = m_instructions[pc++].get_vector();
-					const TqFloat radius = m_instructions[pc++].value;
-
-					// Nearest segment point
-					const CqVector3D segment_point = nearest_segment_point(Point, start, end);
-					// Translation( segment_point ) * Scaling ( radius ) * m
-					const CqMatrix transformation = CqMatrix( segment_point ) * CqMatrix( radius, radius, radius ) * m;
-					// Distance
-					const TqFloat r2 = (transformation.Inverse() * Point).Magnitude2();
-
-					// Value
-					result = (r2 <= 1) ? (1 - 3*r2 + 3*r2*r2 - r2*r2*r2) : 0;
-
-					//Aqsis::log() << info << "Segment: result " << result << std::endl;
-					stack.push(result);
+					const TqInt first = stack.size() - op->arg;
+					result = stack.back();
+					for(TqInt i = stack.size() - 2; i >= first; --i)
+						result *= stack[i];
+					stack.resize(first);
+					stack.push_back(result);
 				}
 				break;
 
-				case SUBTRACT:
+				case MIN:
 				{
-					TqFloat a = stack.top();
-					stack.pop();
-					TqFloat b = stack.top();
-					stack.pop();
-					//Aqsis::log() << info << "idex a " << a << " idex b " << b << std::endl;
-					result = 0.0;
-					if (a != 0.0)
-						result = b/a;
-
-					stack.push(result);
+					const TqInt first = stack.size() - op->arg;
+					result = stack.back();
+					for(TqInt i = stack.size() - 2; i >= first; --i)
+						result = min(result, stack[i]);
+					stack.resize(first);
+					stack.push_back(result);
 				}
 				break;
 
-				case DIVIDE:
+				case MAX:
 				{
-					TqFloat a = stack.top();
-					stack.pop();
-					TqFloat b = stack.top();
-					stack.pop();
-
-					result = b - a;
-					stack.push(result);
+					const TqInt first = stack.size() - op->arg;
+					result = stack.back();
+					for(TqInt i = stack.size() - 2; i >= first; --i)
+						result = max(result, stack[i]);
+					stack.resize(first);
+					stack.push_back(result);
 				}
 				break;
 
-				case ADD:
+				case NEGATE:
+				case IDEMPOTENTATE:
+					break;
+		}
+	}
+
+	return stack.empty() ? 0.0f : stack.back();
+}
+
+//---------------------------------------------------------------------
+/** Make a copy of the program specialised to a region of space.
+ *
+ * Bounded leaves which don't touch the region are zero throughout it, so
+ * they're dropped from sums, and products containing them are dropped
+ * entirely.  Other operations get an explicit zero in their place.
+ *
+ * \param activeLeaves - increasing indices of the bounded leaves which touch
+ *                       the region.  Unbounded leaves are always kept.
+ * \param program - the specialised program.
+ * \return false if the field is zero throughout the region, in which case
+ *         the program is empty.
+ */
+bool CqBlobby::pruneProgram(const std::vector<TqInt>& activeLeaves, TqProgram& program) const
+{
+	// Values on the stack of the pruned program: their code starts at
+	// start, or is absent if they're zero.
+	struct SqValue
+	{
+		TqInt start;
+		bool zero;
+	};
+	std::vector<SqValue> values;
+	TqProgram tail;
+	program.clear();
+
+	TqUint nextActive = 0;
+	for(TqProgram::const_iterator op = m_program.begin(), end = m_program.end(); op != end; ++op)
+	{
+		SqValue value = { static_cast<TqInt>(program.size()), false };
+		switch(op->opcode)
+		{
+				case CONSTANT:
+				case ELLIPSOID:
+				case SEGMENT:
+				case PLANE:
+				case AIR:
 				{
-					const TqInt count = m_instructions[pc++].count;
-					result = 0.0;
-					for(TqInt i = 0; i != count; ++i)
+					// Leaves appear in the program in increasing index order.
+					bool active = op->arg >= 0 && !m_leaves[op->arg].bounded;
+					if(op->arg >= 0 && nextActive < activeLeaves.size()
+						&& activeLeaves[nextActive] == op->arg)
 					{
-						result += stack.top();
-						stack.pop();
+						active = true;
+						++nextActive;
 					}
-					stack.push(result);
+					if(active)
+						program.push_back(*op);
+					else
+						value.zero = true;
 				}
 				break;
 
-				case MULTIPLY:
+				default:
 				{
-					const TqInt count = m_instructions[pc++].count;
-					result = stack.top();
-					stack.pop();
-					for(TqInt i = 1; i != count; ++i)
+					const TqInt count = op->opcode == SUBTRACT || op->opcode == DIVIDE ? 2 : op->arg;
+					const TqInt first = values.size() - count;
+					TqInt cNonZero = 0;
+					TqInt iNonZero = -1;
+					for(TqInt i = values.size() - 1; i >= first; --i)
 					{
-						result *= stack.top();
-						stack.pop();
+						if(!values[i].zero)
+						{
+							++cNonZero;
+							iNonZero = i;
+						}
 					}
-					stack.push(result);
-				}
-				break;
-
-				case MIN:
-				{
-					const TqInt count = m_instructions[pc++].count;
-					result = stack.top();
-					stack.pop();
-					for(TqInt i = 1; i != count; ++i)
+					// The code of the non-zero operands is contiguous from here.
+					const TqInt codeStart = cNonZero > 0 ? values[iNonZero].start : program.size();
+					value.start = codeStart;
+					if(cNonZero == 0
+						|| (op->opcode == MULTIPLY && cNonZero < count)
+						|| (op->opcode == SUBTRACT && values[first+1].zero))
 					{
-						result = min(result, stack.top());
-						stack.pop();
+						program.erase(program.begin() + codeStart, program.end());
+						value.zero = true;
 					}
-					stack.push(result);
-				}
-				break;
-				case MAX:
-				{
-					const TqInt count = m_instructions[pc++].count;
-					result = stack.top();
-					stack.pop();
-					for(TqInt i = 1; i != count; ++i)
+					else if(op->opcode == ADD)
 					{
-						result = max(result, stack.top());
-						stack.pop();
+						if(cNonZero > 1)
+							program.push_back(SqOp(ADD, cNonZero));
 					}
-					stack.push(result);
+					else
+					{
+						if(cNonZero < count)
+						{
+							// Put the zeros back between the remaining operands.
+							tail.assign(program.begin() + codeStart, program.end());
+							program.erase(program.begin() + codeStart, program.end());
+							for(TqInt i = first; i < first + count; ++i)
+							{
+								if(values[i].zero)
+									program.push_back(SqOp(CONSTANT, -1));
+								else
+								{
+									TqInt next = i + 1;
+									while(next < first + count && values[next].zero)
+										++next;
+									const TqInt segmentEnd = next < first + count
+										? values[next].start : codeStart + tail.size();
+									program.insert(program.end(),
+										tail.begin() + (values[i].start - codeStart),
+										tail.begin() + (segmentEnd - codeStart));
+								}
+							}
+						}
+						program.push_back(*op);
+					}
+					values.resize(first);
 				}
 				break;
 		}
+		values.push_back(value);
 	}
 
-	return stack.top();
+	if(values.empty() || values.back().zero)
+	{
+		program.clear();
+		return false;
+	}
+	return true;
 }
 
+//---------------------------------------------------------------------
+/** Return the float value based on each operands. In particular Add will
+ *  accumulate the result of each opcode together. Now this function is
+ *  particulary important since it is used to weight each operand and deduce
+ *  how well will be split the parent blobby' parameters (via ri.cpp).
+ */
+TqFloat CqBlobby::implicit_value( const CqVector3D& Point, TqInt n, std::vector <TqFloat> &splits )
+{
+	TqFloat sum = 0.0f;
+	const TqInt count = min<TqInt>(n, m_leaves.size());
+	for(TqInt i = 0; i < count; ++i)
+	{
+		const SqLeaf& leaf = m_leaves[i];
+		TqFloat result = 0.0f;
+		if(!leaf.bounded || leaf.bound.Contains3D(Point))
+			result = leafValue(leaf, Point);
+		sum += result;
+		splits[i] = result;
+	}
+
+	return sum;
+}
+
+//---------------------------------------------------------------------
+/** Return the float value based on each opcodes.
+ */
+TqFloat CqBlobby::implicit_value( const CqVector3D& Point )
+{
+	std::vector<TqFloat> stack;
+	return evaluate(m_program, Point, stack);
+}
+
+
+//---------------------------------------------------------------------
+/** A block of the polygonization grid, sampled and polygonized as a unit.
+ */
+struct CqBlobby::SqBlock
+{
+	/// Position of the first sample.
+	TqFloat x;
+	TqFloat y;
+	TqFloat z;
+	/// Sample spacing.
+	TqFloat x_voxel_size;
+	TqFloat y_voxel_size;
+	TqFloat z_voxel_size;
+	/// Bounded leaves whose support overlaps the block, in increasing order.
+	std::vector<TqInt> leaves;
+	/// Resulting vertices in blobby space, and triangles indexing them.
+	std::vector<Vertex> vertices;
+	std::vector<Triangle> triangles;
+	/// Whether the field is non-zero anywhere in the block.
+	bool isrequired;
+};
+
+//---------------------------------------------------------------------
+/** Sample the field over a block and run marching cubes on it.
+ */
+void CqBlobby::polygonizeBlock(SqBlock* block) const
+{
+	TqProgram program;
+	block->isrequired = pruneProgram(block->leaves, program);
+	std::vector<TqInt>().swap(block->leaves);
+	if(!block->isrequired)
+		return;
+
+	// Initialize Marching Cubes algorithm
+	MarchingCubes mc(OPTIMUM_GRID_SIZE+1, OPTIMUM_GRID_SIZE+1, OPTIMUM_GRID_SIZE+1);
+
+	mc.init_all();
+
+	std::vector<TqFloat> stack;
+	bool isrequired = false;
+	TqFloat x, y, z = block->z;
+	for( TqInt k = 0 ; k < OPTIMUM_GRID_SIZE+1; k++, z += block->z_voxel_size )
+	{
+		y = block->y;
+		for( TqInt j = 0 ; j < OPTIMUM_GRID_SIZE+1; j++, y += block->y_voxel_size )
+		{
+			x = block->x;
+			for( TqInt i = 0 ; i < OPTIMUM_GRID_SIZE+1; i++, x += block->x_voxel_size )
+			{
+				const TqFloat iv = evaluate( program, CqVector3D( x, y, z ), stack );
+				isrequired |= (iv != 0.0);
+				mc.set_data( static_cast<TqFloat>( iv - 0.421875 ), i, j, k );
+			}
+		}
+	}
+	block->isrequired = isrequired;
+	if(!isrequired)
+		return;
+
+	// Run Marching Cubes
+	// when we are sure it is required.
+	mc.run() ;
+
+	if ((mc.ntrigs() == 0) || mc.nverts() == 0)
+		return;
+
+	// Compute vertex positions in the blobbies world (they were returned in grid coordinates)
+	block->vertices.resize(mc.nverts());
+	for (TqInt tmp = 0; tmp < mc.nverts(); tmp++)
+	{
+		block->vertices[tmp].x = block->x + block->x_voxel_size * mc.vertices()[tmp].x;
+		block->vertices[tmp].y = block->y + block->y_voxel_size * mc.vertices()[tmp].y;
+		block->vertices[tmp].z = block->z + block->z_voxel_size * mc.vertices()[tmp].z;
+	}
+	block->triangles.assign(mc.triangles(), mc.triangles() + mc.ntrigs());
+}
+
+
+namespace {
+
+/// Find the range of blocks of the given size overlapping [lo,hi].
+void blockRange(TqFloat lo, TqFloat hi, TqFloat start, TqFloat blockSize,
+		TqInt numBlocks, TqInt& first, TqInt& last)
+{
+	first = 0;
+	last = numBlocks - 1;
+	if(blockSize > 0)
+	{
+		first = max<TqInt>(first, static_cast<TqInt>(floor((lo - start) / blockSize)));
+		last = min<TqInt>(last, static_cast<TqInt>(floor((hi - start) / blockSize)));
+	}
+}
+
+} // unnamed namespace
 
 /** \fn TqInt polygonize( TqInt& NPoints, TqInt& NPolys, TqInt*& NVertices, TqInt*& Vertices, TqFloat*& Points, TqFloat PixelsWidth, TqFloat PixelsHeight )
     \brief Polygonizes RiBlobby and outputs RiPointsPolygons data.
+
+    The grid is split into blocks which are sampled and polygonized
+    independently.  Blocks are only sampled if the support of some leaf
+    overlaps them, and then only using those leaves, so the cost follows the
+    surface area rather than the volume of the bound.
+
     \param PixelWidth Blobby's bounding-box width in pixels.
     \param PixelHeight Blobby's bounding-box height in pixels.
     \param NPoints Resulting point count.
@@ -1028,7 +1200,7 @@ TqFloat CqBlobby::implicit_value( const CqVector3D& Point )
  */
 TqInt CqBlobby::polygonize( TqInt PixelsWidth, TqInt PixelsHeight, TqInt& NPoints, TqInt& NPolys, TqInt*& NVertices, TqInt*& Vertices, TqFloat*& Points )
 {
-	register TqInt i,j,k;
+	register TqInt i;
 
 	// Make sure the blobby is big enough to show
 	if(PixelsWidth <= 0 || PixelsHeight <= 0)
@@ -1060,128 +1232,85 @@ TqInt CqBlobby::polygonize( TqInt PixelsWidth, TqInt PixelsHeight, TqInt& NPoint
 	const TqInt div_y = y_resolution/OPTIMUM_GRID_SIZE + 1;
 	const TqInt div_x = x_resolution/OPTIMUM_GRID_SIZE + 1;
 
-	int nverts = 0;
-	int ntrigs = 0;
-	Vertex* vertices = 0;
-	Triangle* triangles = 0;
-
-	Aqsis::log() << info << "We will need to call mc " << div_x  * div_y * div_z << std::endl;
-	TqInt cnt = 1;
-
+	std::vector<SqBlock> blocks(div_x * div_y * div_z);
 	for (TqInt k1=0; k1 < div_z; k1 ++)
 	{
 		for (TqInt y1=0; y1 < div_y; y1++)
 		{
 			for (TqInt x1=0; x1 < div_x; x1++)
 			{
-
-				TqFloat x,y,z;
-
-				z = z_start + (TqFloat) k1 * (TqFloat) OPTIMUM_GRID_SIZE * z_voxel_size;
-				bool isrequired = false;
-
-				// Initialize Marching Cubes algorithm
-				MarchingCubes mc(OPTIMUM_GRID_SIZE+1, OPTIMUM_GRID_SIZE+1, OPTIMUM_GRID_SIZE+1);
-
-				mc.init_all();
-
-				for( k = 0 ; k < OPTIMUM_GRID_SIZE+1; k++, z += z_voxel_size )
-				{
-					y = y_start + (TqFloat) y1 * (TqFloat)OPTIMUM_GRID_SIZE * y_voxel_size;
-					for( j = 0 ; j < OPTIMUM_GRID_SIZE+1; j++, y += y_voxel_size )
-					{
-
-						x = x_start + (TqFloat) x1 * (TqFloat)OPTIMUM_GRID_SIZE * x_voxel_size;
-						for( i = 0 ; i < OPTIMUM_GRID_SIZE+1; i++, x += x_voxel_size )
-						{
-							const TqFloat iv = implicit_value( CqVector3D( x, y, z ) );
-							isrequired |= (iv != 0.0);
-							//Aqsis::log() << info << iv << std::endl;
-							mc.set_data( static_cast<TqFloat>( iv - 0.421875 ), i, j, k );
-						}
-					}
-				}
-
-				z = z_start + (TqFloat) k1 * (TqFloat)OPTIMUM_GRID_SIZE * z_voxel_size;
-				y = y_start + (TqFloat) y1 * (TqFloat)OPTIMUM_GRID_SIZE * y_voxel_size;
-				x = x_start + (TqFloat) x1 * (TqFloat)OPTIMUM_GRID_SIZE * x_voxel_size;
-
-
-				if (!isrequired)
-				{
-					Aqsis::log() << info << "Don't need to call mc " << cnt++ << std::endl;
-					continue;
-				}
-
-				// Run Marching Cubes
-				// when we are sure it is required.
-
-
-				{
-					// Inform the status class how far we have got, and update UI.
-					float Complete = ( float ) ( cnt++ );
-					Complete /= (div_x  * div_y * div_z);
-					Complete *= 100.0f;
-					Aqsis::log() << info << "Polygonize a blobby " << Complete << "% complete" << std::endl;
-				}
-
-				mc.run() ;
-
-				if ((mc.ntrigs() == 0) || mc.nverts() == 0)
-				{
-					Aqsis::log() << info << "Don't merge the vertices they are empty " << cnt-1 << std::endl;
-					continue;
-				}
-
-				TqInt overts = nverts;
-				if (nverts == 0)
-				{
-					nverts = mc.nverts();
-					vertices = (Vertex*) malloc(nverts * sizeof(Vertex));
-
-				}
-				else
-				{
-					nverts += mc.nverts();
-					vertices = (Vertex*) realloc(vertices, nverts * sizeof(Vertex));
-
-				}
-
-				// Compute vertex positions in the blobbies world (they were returned in grid coordinates)
-				for (TqInt tmp = 0; tmp < mc.nverts(); tmp++)
-				{
-					vertices[overts+tmp].x = x + x_voxel_size * mc.vertices()[tmp].x;
-					vertices[overts+tmp].y = y + y_voxel_size * mc.vertices()[tmp].y;
-					vertices[overts+tmp].z = z + z_voxel_size * mc.vertices()[tmp].z;
-				}
-
-				TqInt otrigs = ntrigs;
-
-				if (ntrigs == 0)
-				{
-					ntrigs = mc.ntrigs();
-					triangles = (Triangle *) malloc(ntrigs * sizeof(Triangle));
-					memcpy(triangles, mc.triangles(), ntrigs * sizeof(Triangle));
-				}
-				else
-				{
-
-					ntrigs += mc.ntrigs();
-					triangles = (Triangle *) realloc(triangles,  ntrigs * sizeof(Triangle));
-					for (TqInt tmp = 0; tmp < mc.ntrigs(); tmp++)
-					{
-						triangles[otrigs+tmp].v1 = mc.triangles()[tmp].v1 + overts;
-						triangles[otrigs+tmp].v2 = mc.triangles()[tmp].v2 + overts;
-						triangles[otrigs+tmp].v3 = mc.triangles()[tmp].v3 + overts;
-					}
-				}
-
-
-
+				SqBlock& block = blocks[(k1*div_y + y1)*div_x + x1];
+				block.x = x_start + (TqFloat) x1 * (TqFloat) OPTIMUM_GRID_SIZE * x_voxel_size;
+				block.y = y_start + (TqFloat) y1 * (TqFloat) OPTIMUM_GRID_SIZE * y_voxel_size;
+				block.z = z_start + (TqFloat) k1 * (TqFloat) OPTIMUM_GRID_SIZE * z_voxel_size;
+				block.x_voxel_size = x_voxel_size;
+				block.y_voxel_size = y_voxel_size;
+				block.z_voxel_size = z_voxel_size;
+				block.isrequired = false;
 			}
 		}
 	}
 
+	// Bin the bounded leaves into the blocks their support overlaps, with a
+	// voxel of slack for the rounding of the sample positions.
+	const TqFloat x_block_size = OPTIMUM_GRID_SIZE * x_voxel_size;
+	const TqFloat y_block_size = OPTIMUM_GRID_SIZE * y_voxel_size;
+	const TqFloat z_block_size = OPTIMUM_GRID_SIZE * z_voxel_size;
+	for (TqInt leaf = 0, numLeaves = m_leaves.size(); leaf < numLeaves; ++leaf)
+	{
+		if(!m_leaves[leaf].bounded)
+			continue;
+		const CqBound& bound = m_leaves[leaf].bound;
+		TqInt x0, x1, y0, y1, z0, z1;
+		blockRange(bound.vecMin().x() - x_voxel_size, bound.vecMax().x() + x_voxel_size,
+				x_start, x_block_size, div_x, x0, x1);
+		blockRange(bound.vecMin().y() - y_voxel_size, bound.vecMax().y() + y_voxel_size,
+				y_start, y_block_size, div_y, y0, y1);
+		blockRange(bound.vecMin().z() - z_voxel_size, bound.vecMax().z() + z_voxel_size,
+				z_start, z_block_size, div_z, z0, z1);
+		for (TqInt bz = z0; bz <= z1; ++bz)
+			for (TqInt by = y0; by <= y1; ++by)
+				for (TqInt bx = x0; bx <= x1; ++bx)
+					blocks[(bz*div_y + by)*div_x + bx].leaves.push_back(leaf);
+	}
+
+	TqInt numThreads = 1;
+#ifdef	ENABLE_THREADING
+	const TqInt* threads = QGetRenderContext()->GetIntegerOption("limits", "threads");
+	if(threads)
+		numThreads = threads[0];
+	if(numThreads <= 0)
+		numThreads = max<TqInt>(1, boost::thread::hardware_concurrency());
+#endif
+	// Blobbies met while rendering a bucket are already on a worker thread;
+	// polygonize those serially rather than starting a pool per blobby.
+	if(numThreads > 1 && m_threadSafe && blocks.size() > 1
+			&& !CqThreadScheduler::isWorkerThread())
+	{
+		CqThreadScheduler scheduler(numThreads);
+		for (TqUint b = 0; b < blocks.size(); ++b)
+			scheduler.addWorkUnit(boost::bind(&CqBlobby::polygonizeBlock, this, &blocks[b]));
+		scheduler.joinAll();
+	}
+	else
+	{
+		for (TqUint b = 0; b < blocks.size(); ++b)
+			polygonizeBlock(&blocks[b]);
+	}
+
+	// Merge the blocks in order.
+	TqInt nverts = 0;
+	TqInt ntrigs = 0;
+	TqInt nrequired = 0;
+	for (TqUint b = 0; b < blocks.size(); ++b)
+	{
+		nverts += blocks[b].vertices.size();
+		ntrigs += blocks[b].triangles.size();
+		if(blocks[b].isrequired)
+			++nrequired;
+	}
+	Aqsis::log() << debug << "Polygonized a blobby using " << nrequired << " of "
+		<< blocks.size() << " grid blocks" << std::endl;
 
 	NPoints = nverts;
 	NPolys = ntrigs;
@@ -1189,29 +1318,30 @@ TqInt CqBlobby::polygonize( TqInt PixelsWidth, TqInt PixelsHeight, TqInt& NPoint
 	Vertices = new TqInt[3 * NPolys];
 	Points = new TqFloat[3 * NPoints];
 
-	// Set vertex indices
 	TqInt* nvert = NVertices;
 	TqInt* vert = Vertices;
-	for ( i = 0; i < ntrigs; ++i )
-	{
-		*nvert++ = 3;
-		*vert++ = triangles[i].v1;
-		*vert++ = triangles[i].v2;
-		*vert++ = triangles[i].v3;
-	}
-
-
 	TqFloat* point = Points;
-	for ( i = 0; i < nverts; i++ )
+	TqInt overts = 0;
+	for (TqUint b = 0; b < blocks.size(); ++b)
 	{
-		*point++ = vertices[i].x;
-		*point++ = vertices[i].y;
-		*point++ = vertices[i].z;
+		const std::vector<Triangle>& triangles = blocks[b].triangles;
+		for ( i = 0; i < static_cast<TqInt>(triangles.size()); ++i )
+		{
+			*nvert++ = 3;
+			*vert++ = triangles[i].v1 + overts;
+			*vert++ = triangles[i].v2 + overts;
+			*vert++ = triangles[i].v3 + overts;
+		}
+		const std::vector<Vertex>& vertices = blocks[b].vertices;
+		for ( i = 0; i < static_cast<TqInt>(vertices.size()); i++ )
+		{
+			*point++ = vertices[i].x;
+			*point++ = vertices[i].y;
+			*point++ = vertices[i].z;
+		}
+		overts += vertices.size();
 	}
 
-	free(vertices);
-	free(triangles);
-
 	// Cleanup the DBO i/f
 	if (DBO_handle)
 	{
@@ -1231,5 +1361,3 @@ TqInt CqBlobby::polygonize( TqInt PixelsWidth, TqInt PixelsHeight, TqInt& NPoint
 
 } // namespace Aqsis
 //---------------------------------------------------------------------
-
-
@@ -175,9 +175,61 @@ class CqBlobby : public CqSurface
 		typedef std::vector<instruction> instructions_t;
 
 	private:
+		/// A leaf primitive of the compiled program, with its parameters decoded.
+		struct SqLeaf
+		{
+			EqOpcodeName opcode;
+			/// Inverse transformation of an ellipsoid or DBO.  For segments,
+			/// the inverse of the blob transformation scaled by the radius.
+			CqMatrix matrix;
+			/// Start of a segment, or minimum of a DBO's bound.
+			CqVector3D start;
+			/// End of a segment, or maximum of a DBO's bound.
+			CqVector3D end;
+			/// Value of a constant.
+			TqFloat value;
+			/// String index of a plane, or code index of a DBO.
+			TqInt index;
+			/// Float index of a plane's parameters.
+			TqInt floatIndex;
+			/// Region outside which the leaf's value is zero.
+			CqBound bound;
+			/// Whether the leaf has a bound at all.
+			bool bounded;
+		};
+
+		/// Operation of the compiled program.
+		struct SqOp
+		{
+			SqOp(EqOpcodeName Opcode, TqInt Arg) : opcode(Opcode), arg(Arg)
+			{}
+			EqOpcodeName opcode;
+			/// Leaf index for leaf opcodes, or the number of operands.  A
+			/// CONSTANT with a negative leaf index stands for zero.
+			TqInt arg;
+		};
+		typedef std::vector<SqOp> TqProgram;
+
+		struct SqBlock;
+
+		void compile();
+		void pushOperation(EqOpcodeName opcode, TqInt count, std::vector<TqInt>& starts);
+		TqFloat leafValue(const SqLeaf& leaf, const CqVector3D& Point) const;
+		TqFloat evaluate(const TqProgram& program, const CqVector3D& Point,
+				std::vector<TqFloat>& stack) const;
+		bool pruneProgram(const std::vector<TqInt>& activeLeaves, TqProgram& program) const;
+		void polygonizeBlock(SqBlock* block) const;
+
 		// Program (list of instructions) that computes implicit values
 		instructions_t m_instructions;
 
+		// The program compiled for evaluation, in postfix order, and its leaves
+		// in program order.
+		TqProgram m_program;
+		std::vector<SqLeaf> m_leaves;
+		// False if some leaves can't be evaluated from several threads.
+		bool m_threadSafe;
+
 		// Bounding-box
 		CqBound m_bbox;
 
@@ -189,6 +241,9 @@ class CqBlobby : public CqSurface
 		TqFloat* m_floats;
 		TqInt m_nstrings;
 		char** m_strings;
+	public:
+		/// Class to expose private functions for testing.
+		struct Test;
 };
 
 //-----------------------------------------------------------------------
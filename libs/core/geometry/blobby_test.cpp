@@ -0,0 +1,284 @@
+// Aqsis
+// Copyright (C) 1997 - 2001, Paul C. Gregory
+//
+// Contact: pgregory@aqsis.org
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation; either
+// version 2 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+/** \file Unit tests for the compiled blobby programs.
+ */
+
+#include "blobby.h"
+
+#include <vector>
+
+#include <aqsis/ri/ri.h>
+
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/auto_unit_test.hpp>
+#include <boost/test/floating_point_comparison.hpp>
+
+namespace Aqsis
+{
+// Expose the compiled program of CqBlobby for testing.
+struct CqBlobby::Test
+{
+	/// Value at Point of the program pruned to the leaves overlapping region.
+	static TqFloat prunedValue(const CqBlobby& blobby, const CqBound& region,
+			const CqVector3D& Point, bool& required)
+	{
+		std::vector<TqInt> activeLeaves;
+		for(TqInt i = 0, end = blobby.m_leaves.size(); i < end; ++i)
+		{
+			const SqLeaf& leaf = blobby.m_leaves[i];
+			if(leaf.bounded
+				&& leaf.bound.vecMin().x() <= region.vecMax().x()
+				&& leaf.bound.vecMin().y() <= region.vecMax().y()
+				&& leaf.bound.vecMin().z() <= region.vecMax().z()
+				&& region.vecMin().x() <= leaf.bound.vecMax().x()
+				&& region.vecMin().y() <= leaf.bound.vecMax().y()
+				&& region.vecMin().z() <= leaf.bound.vecMax().z())
+				activeLeaves.push_back(i);
+		}
+		TqProgram program;
+		required = blobby.pruneProgram(activeLeaves, program);
+		std::vector<TqFloat> stack;
+		return blobby.evaluate(program, Point, stack);
+	}
+};
+}
+
+BOOST_AUTO_TEST_SUITE(blobby_tests)
+
+using namespace Aqsis;
+
+namespace {
+
+/// RiBlobby arguments, built up one instruction at a time.
+struct SqBlobbyCode
+{
+	std::vector<TqInt> code;
+	std::vector<TqFloat> floats;
+	/// Start of each instruction in code.
+	std::vector<TqInt> starts;
+	TqInt numLeaves;
+
+	SqBlobbyCode() : numLeaves(0) {}
+
+	/// Add a spherical ellipsoid, returning its instruction index.
+	TqInt sphere(const CqVector3D& centre, TqFloat radius)
+	{
+		const TqFloat m[16] = {
+			radius, 0, 0, 0,
+			0, radius, 0, 0,
+			0, 0, radius, 0,
+			centre.x(), centre.y(), centre.z(), 1 };
+		starts.push_back(code.size());
+		code.push_back(1001);
+		code.push_back(floats.size());
+		floats.insert(floats.end(), m, m + 16);
+		++numLeaves;
+		return starts.size() - 1;
+	}
+	TqInt constant(TqFloat value)
+	{
+		starts.push_back(code.size());
+		code.push_back(1000);
+		code.push_back(floats.size());
+		floats.push_back(value);
+		++numLeaves;
+		return starts.size() - 1;
+	}
+	/// Add an n-ary operation (0 to 3), or subtract (4) or divide (5).
+	TqInt op(TqInt opcode, const std::vector<TqInt>& operands)
+	{
+		starts.push_back(code.size());
+		code.push_back(opcode);
+		if(opcode < 4)
+			code.push_back(operands.size());
+		code.insert(code.end(), operands.begin(), operands.end());
+		return starts.size() - 1;
+	}
+	TqInt op(TqInt opcode, TqInt a, TqInt b)
+	{
+		std::vector<TqInt> operands;
+		operands.push_back(a);
+		operands.push_back(b);
+		return op(opcode, operands);
+	}
+
+	boost::shared_ptr<CqBlobby> blobby()
+	{
+		return boost::shared_ptr<CqBlobby>(new CqBlobby(numLeaves, code.size(),
+					&code[0], floats.size(), &floats[0], 0, 0));
+	}
+
+	/** Value of instruction i at P, read straight from the RiBlobby code.
+	 *
+	 * This follows the stack interpreter which ran the uncompiled
+	 * instructions.
+	 */
+	TqFloat value(TqInt i, const CqVector3D& P) const
+	{
+		const TqInt* c = &code[starts[i]];
+		switch(c[0])
+		{
+			case 1000:
+				return floats[c[1]];
+			case 1001:
+			{
+				const TqFloat* m = &floats[c[1]];
+				const CqVector3D d = (P - CqVector3D(m[12], m[13], m[14]))/m[0];
+				const TqFloat r2 = d.Magnitude2();
+				return r2 <= 1 ? 1 - 3*r2 + 3*r2*r2 - r2*r2*r2 : 0;
+			}
+			case 4:
+				return value(c[1], P) - value(c[2], P);
+			case 5:
+			{
+				const TqFloat a = value(c[2], P);
+				return a != 0 ? value(c[1], P)/a : 0;
+			}
+			default:
+			{
+				TqFloat result = value(c[2], P);
+				for(TqInt j = 1; j < c[1]; ++j)
+				{
+					const TqFloat v = value(c[2+j], P);
+					switch(c[0])
+					{
+						case 0: result += v; break;
+						case 1: result *= v; break;
+						case 2: result = max(result, v); break;
+						case 3: result = min(result, v); break;
+					}
+				}
+				return result;
+			}
+		}
+	}
+	TqFloat value(const CqVector3D& P) const
+	{
+		return value(starts.size() - 1, P);
+	}
+};
+
+/// Three spheres in a row, far enough apart for pruning to separate them.
+void addSpheres(SqBlobbyCode& b, std::vector<TqInt>& spheres)
+{
+	spheres.push_back(b.sphere(CqVector3D(0, 0, 0), 1));
+	spheres.push_back(b.sphere(CqVector3D(1.5, 0, 0), 1));
+	spheres.push_back(b.sphere(CqVector3D(5, 0, 0), 1));
+}
+
+/// Check the compiled program against the RiBlobby code along the x-axis,
+/// both in full and pruned to regions around the sample points.
+void checkProgram(SqBlobbyCode& b)
+{
+	boost::shared_ptr<CqBlobby> blobby = b.blobby();
+	for(TqFloat x = -1.5; x <= 6.5; x += 0.25)
+	{
+		const CqVector3D P(x, 0.1, -0.2);
+		const TqFloat expected = b.value(P);
+		BOOST_CHECK_CLOSE(blobby->implicit_value(P) + 1, expected + 1, 1e-4);
+
+		const CqBound region(P - CqVector3D(0.2, 0.2, 0.2), P + CqVector3D(0.2, 0.2, 0.2));
+		bool required = false;
+		const TqFloat pruned = CqBlobby::Test::prunedValue(*blobby, region, P, required);
+		BOOST_CHECK_CLOSE(pruned + 1, expected + 1, 1e-4);
+		if(!required)
+			BOOST_CHECK_EQUAL(expected, 0);
+	}
+}
+
+} // unnamed namespace
+
+BOOST_AUTO_TEST_CASE(blobby_add_multiply_min_max)
+{
+	RiBegin(RI_NULL);
+	for(TqInt opcode = 0; opcode < 4; ++opcode)
+	{
+		SqBlobbyCode b;
+		std::vector<TqInt> spheres;
+		addSpheres(b, spheres);
+		b.op(opcode, spheres);
+		checkProgram(b);
+	}
+	RiEnd();
+}
+
+BOOST_AUTO_TEST_CASE(blobby_subtract_divide)
+{
+	RiBegin(RI_NULL);
+	for(TqInt opcode = 4; opcode < 6; ++opcode)
+	{
+		// Each of the operands is pruned somewhere along the axis.
+		SqBlobbyCode b;
+		std::vector<TqInt> spheres;
+		addSpheres(b, spheres);
+		b.op(opcode, b.op(0, spheres[0], spheres[2]), spheres[1]);
+		checkProgram(b);
+	}
+	RiEnd();
+}
+
+BOOST_AUTO_TEST_CASE(blobby_nested_with_constants)
+{
+	RiBegin(RI_NULL);
+	SqBlobbyCode b;
+	std::vector<TqInt> spheres;
+	addSpheres(b, spheres);
+	const TqInt c = b.constant(0.25);
+	std::vector<TqInt> operands;
+	operands.push_back(b.op(1, spheres[0], c));
+	operands.push_back(b.op(3, spheres[1], spheres[2]));
+	operands.push_back(b.op(4, spheres[2], b.op(2, spheres[0], c)));
+	operands.push_back(b.op(5, spheres[1], b.op(0, spheres[0], c)));
+	b.op(0, operands);
+	checkProgram(b);
+	RiEnd();
+}
+
+BOOST_AUTO_TEST_CASE(blobby_implicit_value_splits)
+{
+	RiBegin(RI_NULL);
+	SqBlobbyCode b;
+	std::vector<TqInt> spheres;
+	addSpheres(b, spheres);
+	b.op(0, spheres);
+	boost::shared_ptr<CqBlobby> blobby = b.blobby();
+
+	// At the centre of the first sphere it contributes one.  The second
+	// sphere is 1.5 away, so outside its unit radius.
+	std::vector<TqFloat> splits(3, -1);
+	BOOST_CHECK_CLOSE(blobby->implicit_value(CqVector3D(0, 0, 0), 3, splits), 1.0f, 1e-4);
+	BOOST_CHECK_CLOSE(splits[0], 1.0f, 1e-4);
+	BOOST_CHECK_EQUAL(splits[1], 0);
+	BOOST_CHECK_EQUAL(splits[2], 0);
+
+	// Half way to the second sphere both contribute bump(0.75^2).
+	const TqFloat r2 = 0.75*0.75;
+	const TqFloat bump = 1 - 3*r2 + 3*r2*r2 - r2*r2*r2;
+	BOOST_CHECK_CLOSE(blobby->implicit_value(CqVector3D(0.75, 0, 0), 3, splits),
+			2*bump, 1e-4);
+	BOOST_CHECK_CLOSE(splits[0], bump, 1e-4);
+	BOOST_CHECK_CLOSE(splits[1], bump, 1e-4);
+	BOOST_CHECK_EQUAL(splits[2], 0);
+	BOOST_CHECK_CLOSE(blobby->implicit_value(CqVector3D(0.75, 0, 0)), 2*bump, 1e-4);
+	RiEnd();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -1375,6 +1375,26 @@ void CqSurfaceNURBS::Bound(CqBound* bound) const
 }
 
 
+//---------------------------------------------------------------------
+/** Add the knot vectors and orders, which are used when dicing, to a dice
+ *  cache key along with the primitive variables.
+ */
+
+bool CqSurfaceNURBS::AddToDiceKey( CqDiceKey& key ) const
+{
+	AddPrimitiveVariablesToDiceKey( key );
+	key.add( m_uOrder );
+	key.add( m_vOrder );
+	key.add( m_cuVerts );
+	key.add( m_cvVerts );
+	if ( !m_auKnots.empty() )
+		key.add( &m_auKnots[ 0 ], m_auKnots.size() * sizeof( TqFloat ) );
+	if ( !m_avKnots.empty() )
+		key.add( &m_avKnots[ 0 ], m_avKnots.size() * sizeof( TqFloat ) );
+	return ( true );
+}
+
+
 //---------------------------------------------------------------------
 /** Dice the patch into a mesh of micropolygons.
  */
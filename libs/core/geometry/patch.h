@@ -107,6 +107,14 @@ class CqSurfacePatchBicubic : public CqSurface
 		virtual void NaturalDice( CqParameter* pParameter, TqInt uDiceSize, TqInt vDiceSize, IqShaderData* pData );
 		virtual	TqInt PreSubdivide( std::vector<boost::shared_ptr<CqSurface> >& aSplits, bool u );
 		virtual void NaturalSubdivide( CqParameter* pParam, CqParameter* pParam1, CqParameter* pParam2, bool u );
+		/** The control points are held in the Bezier basis, so the patch
+		 *  is entirely described by its primitive variables.
+		 */
+		virtual bool	AddToDiceKey( CqDiceKey& key ) const
+		{
+			AddPrimitiveVariablesToDiceKey( key );
+			return ( true );
+		}
 
 		void	ConvertToBezierBasis( CqMatrix& matuBasis, CqMatrix& matvBasis );
 
@@ -178,6 +186,12 @@ class CqSurfacePatchBilinear : public CqSurface
 		virtual	TqInt	Split( std::vector<boost::shared_ptr<CqSurface> >& aSplits );
 		virtual	TqInt	PreSubdivide( std::vector<boost::shared_ptr<CqSurface> >& aSplits, bool u );
 		virtual void	PostDice(CqMicroPolyGrid * pGrid);
+		virtual bool	AddToDiceKey( CqDiceKey& key ) const
+		{
+			AddPrimitiveVariablesToDiceKey( key );
+			key.add( m_fHasPhantomFourthVertex );
+			return ( true );
+		}
 
 	protected:
 		bool	m_fHasPhantomFourthVertex;
@@ -280,6 +280,13 @@ class CqMicroPolyGridPoints : public CqMicroPolyGrid
 		{}
 
 		virtual	void	Split( long xmin, long xmax, long ymin, long ymax );
+		/** The bound of P doesn't include the point widths, so points are
+		 * never occlusion culled as a grid.
+		 */
+		virtual bool	CalcRasterBound( CqBound& bound )
+		{
+			return false;
+		}
 
 		virtual	TqUint	GridSize() const
 		{
@@ -32,17 +32,153 @@
 
 #include <cstdio>
 #include <cstring>
+#include <fstream>
 #include <list>
+#include <sstream>
 
+#include <boost/bind.hpp>
 #include <boost/tokenizer.hpp>
 
 #include "renderer.h"
+#include <aqsis/riutil/ribparser.h>
 #include <aqsis/util/file.h>
 #include <aqsis/util/plugins.h>
 #include <aqsis/core/corecontext.h>
 
 namespace Aqsis {
 
+// Global runprogram repository.
+// TODO: Make this a member of CqRenderer, making sure that runprogram file
+// handles and processes get correctly closed at destruction time.
+static CqRunProgramRepository g_activeRunPrograms;
+
+// Global procedural prefetcher.  This must be destroyed before the
+// runprogram repository, since the prefetch threads use it.
+static CqProceduralPrefetcher g_proceduralPrefetcher(g_activeRunPrograms);
+
+/// Expanding a procedural changes the current render context, so only one
+/// procedural can be expanded at a time.
+static TqMutex g_expandMutex;
+
+
+/** \brief Read the RIB for a procedural into memory.
+ *
+ * This may run on a prefetch thread, so errors are stored in the prefetch to
+ * be reported later by expandPrefetch().
+ */
+static void readPrefetch(SqProceduralPrefetch& prefetch,
+		CqRunProgramRepository& runPrograms)
+{
+	try
+	{
+		if(prefetch.runProgram)
+		{
+			try
+			{
+				prefetch.haveRib = runPrograms.request(prefetch.source,
+						prefetch.detail, prefetch.args, prefetch.rib);
+			}
+			catch(std::ios_base::failure& /*e*/)
+			{
+				prefetch.brokenPipe = true;
+			}
+		}
+		else
+		{
+			// Archives are memory mapped and parsed straight from the
+			// mapping, so reading ahead just pages them in.  Files which
+			// can't be mapped are read into memory instead.
+			boost::shared_ptr<std::istream> archive
+				= RibParser::openFile(prefetch.source);
+			if(!*archive)
+				return;
+			if(RibParser::prefetchFile(*archive))
+			{
+				prefetch.archive = archive;
+				prefetch.haveRib = true;
+			}
+			else
+			{
+				std::ostringstream contents;
+				if(contents << archive->rdbuf())
+				{
+					prefetch.rib = contents.str();
+					prefetch.haveRib = true;
+				}
+			}
+		}
+	}
+	catch(const XqException& e)
+	{
+		prefetch.errorCode = e.code();
+		prefetch.errorSeverity = RIE_ERROR;
+		prefetch.errorMessage = e.what();
+	}
+	catch(const std::exception& e)
+	{
+		prefetch.errorCode = RIE_BUG;
+		prefetch.errorSeverity = RIE_SEVERE;
+		prefetch.errorMessage = e.what();
+	}
+	catch(...)
+	{
+		prefetch.errorCode = RIE_BUG;
+		prefetch.errorSeverity = RIE_SEVERE;
+		prefetch.errorMessage = "unknown exception encountered";
+	}
+}
+
+/** \brief Parse the RIB read for a procedural, or report the errors which
+ * occurred while reading it.
+ */
+static void expandPrefetch(const SqProceduralPrefetch& prefetch)
+{
+	try
+	{
+		if(prefetch.errorCode != RIE_NOERROR)
+		{
+			QGetRenderContext()->pErrorHandler()(prefetch.errorCode,
+					prefetch.errorSeverity,
+					const_cast<char*>(prefetch.errorMessage.c_str()));
+		}
+		else if(prefetch.brokenPipe)
+		{
+			Aqsis::log() << error << "RiProcRunProgram: Broken pipe for RunProgram ["
+				<< prefetch.source << "]  (premature exit?)\n";
+		}
+		else if(prefetch.haveRib && prefetch.archive)
+		{
+			cxxRenderContext()->parseRib(*prefetch.archive, prefetch.streamName.c_str());
+			STATS_INC( GEO_prc_created_dra );
+		}
+		else if(prefetch.haveRib)
+		{
+			std::istringstream ribStream(prefetch.rib);
+			cxxRenderContext()->parseRib(ribStream, prefetch.streamName.c_str());
+			if(prefetch.runProgram)
+				STATS_INC( GEO_prc_created_prp );
+			else
+				STATS_INC( GEO_prc_created_dra );
+		}
+	}
+	// TODO: Replace the following catches with a catch guard.
+	catch(const XqException& e)
+	{
+		QGetRenderContext()->pErrorHandler()(e.code(), RIE_ERROR,
+				const_cast<char*>(e.what()));
+	}
+	catch(const std::exception& e)
+	{
+		QGetRenderContext()->pErrorHandler()(RIE_BUG, RIE_SEVERE,
+				const_cast<char*>(e.what()));
+	}
+	catch(...)
+	{
+		QGetRenderContext()->pErrorHandler()(RIE_BUG, RIE_SEVERE,
+				const_cast<char*>("unknown exception encountered"));
+	}
+}
+
 
 /**
  * CqProcedural constructor.
@@ -72,6 +208,8 @@ CqProcedural::CqProcedural(RtPointer data, CqBound &B, RtProcSubdivFunc subfunc,
 
 TqInt CqProcedural::Split( std::vector<boost::shared_ptr<CqSurface> >& aSplits )
 {
+	TqMutexLock expandLock( g_expandMutex );
+
 	// Store current context, set current context to the stored one
 	boost::shared_ptr<CqModeBlock> pconSave = QGetRenderContext()->pconCurrent( m_pconStored );
 
@@ -79,17 +217,15 @@ TqInt CqProcedural::Split( std::vector<boost::shared_ptr<CqSurface> >& aSplits )
 
 	m_pconStored->m_ptransCurrent = m_pTransform;
 
-	/// \note: The bound is in "raster" coordinates by now, as during posting to the imagebuffer
-	/// the the Culling routines do the job for us, see CqSurface::CacheRasterBound.
-	CqBound bound = m_Bound;
-	//    bound.Transform(QGetRenderContext()->matSpaceToSpace("camera", "raster"));
-	float detail = ( bound.vecMax().x() - bound.vecMin().x() ) * ( bound.vecMax().y() - bound.vecMin().y() );
+	float detail = Detail();
 	//std::cout << "detail: " << detail << std::endl;
 
 	// Call the procedural secific Split()
 	RiAttributeBegin();
 
-	if(m_pSubdivFunc)
+	if(m_prefetch && g_proceduralPrefetcher.claim(*m_prefetch))
+		expandPrefetch(*m_prefetch);
+	else if(m_pSubdivFunc)
 		m_pSubdivFunc(m_pData, detail);
 
 	RiAttributeEnd();
@@ -103,6 +239,28 @@ TqInt CqProcedural::Split( std::vector<boost::shared_ptr<CqSurface> >& aSplits )
 }
 
 
+void CqProcedural::PrefetchSplit( TqInt priority )
+{
+	if( m_prefetch )
+		return;
+	// Prefetching is opt-in, like texture prefetch.
+	TqInt numThreads = 0;
+	if(const TqInt* threads = QGetRenderContext()->poptCurrent()
+			->GetIntegerOption("limits", "prefetchthreads"))
+		numThreads = threads[0];
+	m_prefetch = g_proceduralPrefetcher.prefetch(m_pSubdivFunc, m_pData,
+			Detail(), priority, numThreads);
+}
+
+
+TqFloat CqProcedural::Detail() const
+{
+	/// \note: The bound is in "raster" coordinates by now, as during posting to the imagebuffer
+	/// the the Culling routines do the job for us, see CqSurface::CacheRasterBound.
+	return ( m_Bound.vecMax().x() - m_Bound.vecMin().x() ) * ( m_Bound.vecMax().y() - m_Bound.vecMin().y() );
+}
+
+
 //---------------------------------------------------------------------
 /** Transform the quadric primitive by the specified matrix.
  */
@@ -118,6 +276,8 @@ void    CqProcedural::Transform( const CqMatrix& matTx, const CqMatrix& matITTx,
  */
 CqProcedural::~CqProcedural()
 {
+	if( m_prefetch )
+		g_proceduralPrefetcher.abandon( *m_prefetch );
 	if( m_pFreeFunc )
 		m_pFreeFunc( m_pData );
 }
@@ -297,6 +457,22 @@ std::iostream* CqRunProgramRepository::find(const std::string& command)
 	}
 }
 
+bool CqRunProgramRepository::request(const std::string& command,
+		TqFloat detail, const std::string& args, std::string& rib)
+{
+	TqMutexLock lock(m_mutex);
+	// Get a pipe connected to the procedural
+	std::iostream* pipe = find(command);
+	if(!pipe)
+		return false;
+	// Push in the procedural arguments
+	(*pipe) << detail << " " << args << "\n" << std::flush;
+	// And read back the resulting RIB, up to the end of block marker.
+	if(!RibParser::readBlock(*pipe, rib))
+		pipe->setstate(std::ios::eofbit);
+	return true;
+}
+
 /** \brief Split the given command line up into a set of tokens seperated with
  * white space.
  *
@@ -352,56 +528,196 @@ TqPopenStream* CqRunProgramRepository::startNewRunProgram(
 
 
 //------------------------------------------------------------------------------
+// CqProceduralPrefetcher implementation
+//
 
-// Global runprogram repository.
-// TODO: Make this a member of CqRenderer, making sure that runprogram file
-// handles and processes get correctly closed at destruction time.
-static CqRunProgramRepository g_activeRunPrograms;
+namespace {
+
+/// Maximum number of prefetched procedurals waiting to be split.  This
+/// bounds the memory used to hold their RIB.
+const TqInt maxReadyPrefetches = 16;
+
+} // unnamed namespace
+
+SqProceduralPrefetch::SqProceduralPrefetch()
+	: state(State_Queued),
+	abandoned(false),
+	priority(0),
+	sequence(0),
+	runProgram(false),
+	source(),
+	streamName(),
+	args(),
+	detail(0),
+	haveRib(false),
+	rib(),
+	archive(),
+	brokenPipe(false),
+	errorCode(RIE_NOERROR),
+	errorSeverity(RIE_INFO),
+	errorMessage()
+{ }
+
+CqProceduralPrefetcher::CqProceduralPrefetcher(CqRunProgramRepository& runPrograms)
+	: m_runPrograms(runPrograms)
+#ifdef	ENABLE_THREADING
+	,
+	m_queue(),
+	m_numReady(0),
+	m_nextSequence(0),
+	m_stop(false)
+#endif
+{ }
 
-extern "C" RtVoid	RiProcRunProgram( RtPointer data, RtFloat detail )
+CqProceduralPrefetcher::~CqProceduralPrefetcher()
 {
-	try
+#ifdef	ENABLE_THREADING
 	{
-		char** args = reinterpret_cast<char**>(data);
-		// Get a pipe connected to the procedural
-		std::string command = args[0];
-		std::iostream* pipe = g_activeRunPrograms.find(command);
-		if(!pipe)
-			return;
-		try
-		{
-			// Push in the procedural arguments
-			(*pipe) << detail << " " << args[1] << "\n" << std::flush;
-			// And parse the resulting RIB from the pipe.
-			cxxRenderContext()->parseRib(*pipe, ("[" + command + "]").c_str());
-			STATS_INC( GEO_prc_created_prp );
-		}
-		catch(std::ios_base::failure& /*e*/)
-		{
-			Aqsis::log() << error << "RiProcRunProgram: Broken pipe for RunProgram ["
-				<< command << "]  (premature exit?)\n";
-		}
+		boost::mutex::scoped_lock lock(m_mutex);
+		m_stop = true;
+		m_workAvailable.notify_all();
 	}
-	// TODO: Replace the following catches with a catch guard.
-	catch(const XqValidation& e)
+	for(TqInt i = 0, end = m_threads.size(); i < end; ++i)
+		m_threads[i]->join();
+#endif
+}
+
+boost::shared_ptr<SqProceduralPrefetch> CqProceduralPrefetcher::prefetch(
+		RtProcSubdivFunc subdivFunc, RtPointer data, TqFloat detail,
+		TqInt priority, TqInt numThreads)
+{
+	TqPrefetchPtr prefetch;
+#ifdef	ENABLE_THREADING
+	if(numThreads <= 0)
+		return prefetch;
+	char** args = reinterpret_cast<char**>(data);
+	if(subdivFunc == &RiProcDelayedReadArchive)
 	{
-		QGetRenderContext()->pErrorHandler()(e.code(), RIE_ERROR,
-				const_cast<char*>(e.what()));
+		// Leave missing archives to be reported by RiReadArchive.
+		boost::filesystem::path path = QGetRenderContext()->poptCurrent()
+			->findRiFileNothrow(args[0], "archive");
+		if(path.empty())
+			return prefetch;
+		prefetch.reset(new SqProceduralPrefetch());
+		prefetch->source = native(path);
+		prefetch->streamName = args[0];
 	}
-	catch(const XqException& e)
+	else if(subdivFunc == &RiProcRunProgram)
 	{
-		QGetRenderContext()->pErrorHandler()(e.code(), RIE_ERROR,
-				const_cast<char*>(e.what()));
+		prefetch.reset(new SqProceduralPrefetch());
+		prefetch->runProgram = true;
+		prefetch->source = args[0];
+		prefetch->streamName = "[" + prefetch->source + "]";
+		prefetch->args = args[1];
+		prefetch->detail = detail;
 	}
-	catch(const std::exception& e)
+	else
+		return prefetch;
+	prefetch->priority = priority;
+
+	boost::mutex::scoped_lock lock(m_mutex);
+	prefetch->sequence = m_nextSequence++;
+	m_queue.push(prefetch);
+	while(static_cast<TqInt>(m_threads.size()) < numThreads)
 	{
-		QGetRenderContext()->pErrorHandler()(RIE_BUG, RIE_SEVERE,
-				const_cast<char*>(e.what()));
+		m_threads.push_back(boost::shared_ptr<boost::thread>(new boost::thread(
+				boost::bind(&CqProceduralPrefetcher::workerLoop, this))));
 	}
-	catch(...)
+	m_workAvailable.notify_one();
+#endif
+	return prefetch;
+}
+
+bool CqProceduralPrefetcher::claim(SqProceduralPrefetch& prefetch)
+{
+	bool readHere = true;
+#ifdef	ENABLE_THREADING
 	{
-		QGetRenderContext()->pErrorHandler()(RIE_BUG, RIE_SEVERE,
-				const_cast<char*>("unknown exception encountered"));
+		boost::mutex::scoped_lock lock(m_mutex);
+		while(prefetch.state == SqProceduralPrefetch::State_Running)
+			m_prefetchDone.wait(lock);
+		if(prefetch.state == SqProceduralPrefetch::State_Done)
+		{
+			--m_numReady;
+			m_workAvailable.notify_all();
+		}
+		readHere = prefetch.state == SqProceduralPrefetch::State_Queued;
+		prefetch.state = SqProceduralPrefetch::State_Claimed;
+	}
+#endif
+	// Nobody has got to the prefetch yet, so don't wait for them.
+	if(readHere)
+		readPrefetch(prefetch, m_runPrograms);
+	return prefetch.haveRib || prefetch.brokenPipe
+		|| prefetch.errorCode != RIE_NOERROR;
+}
+
+void CqProceduralPrefetcher::abandon(SqProceduralPrefetch& prefetch)
+{
+#ifdef	ENABLE_THREADING
+	boost::mutex::scoped_lock lock(m_mutex);
+	switch(prefetch.state)
+	{
+		case SqProceduralPrefetch::State_Running:
+			prefetch.abandoned = true;
+			break;
+		case SqProceduralPrefetch::State_Done:
+			--m_numReady;
+			m_workAvailable.notify_all();
+			// Fall through
+		case SqProceduralPrefetch::State_Queued:
+			prefetch.state = SqProceduralPrefetch::State_Claimed;
+			break;
+		case SqProceduralPrefetch::State_Claimed:
+			break;
+	}
+#endif
+}
+
+#ifdef	ENABLE_THREADING
+void CqProceduralPrefetcher::workerLoop()
+{
+	boost::mutex::scoped_lock lock(m_mutex);
+	while(true)
+	{
+		while(!m_stop && (m_queue.empty() || m_numReady >= maxReadyPrefetches))
+			m_workAvailable.wait(lock);
+		if(m_stop)
+			return;
+		TqPrefetchPtr prefetch = m_queue.top();
+		m_queue.pop();
+		// Claimed or abandoned prefetches are left in the queue until they
+		// come to the top.
+		if(prefetch->state != SqProceduralPrefetch::State_Queued)
+			continue;
+		prefetch->state = SqProceduralPrefetch::State_Running;
+		lock.unlock();
+		readPrefetch(*prefetch, m_runPrograms);
+		lock.lock();
+		if(prefetch->abandoned)
+			prefetch->state = SqProceduralPrefetch::State_Claimed;
+		else
+		{
+			prefetch->state = SqProceduralPrefetch::State_Done;
+			++m_numReady;
+		}
+		m_prefetchDone.notify_all();
 	}
 }
+#endif
 
+
+//------------------------------------------------------------------------------
+
+extern "C" RtVoid	RiProcRunProgram( RtPointer data, RtFloat detail )
+{
+	char** args = reinterpret_cast<char**>(data);
+	SqProceduralPrefetch prefetch;
+	prefetch.runProgram = true;
+	prefetch.source = args[0];
+	prefetch.streamName = "[" + prefetch.source + "]";
+	prefetch.args = args[1];
+	prefetch.detail = detail;
+	readPrefetch(prefetch, g_activeRunPrograms);
+	expandPrefetch(prefetch);
+}
@@ -29,16 +29,28 @@
 
 #include <aqsis/aqsis.h>
 
+#include <iosfwd>
 #include <map>
+#include <queue>
+#include <string>
+#include <vector>
 
 #include <boost/shared_ptr.hpp>
+#ifdef	ENABLE_THREADING
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition.hpp>
+#endif
 
 #include <aqsis/math/matrix.h>
 #include <aqsis/util/popen.h>
 #include "surface.h"
+#include "threadscheduler.h"
 
 namespace Aqsis {
 
+struct SqProceduralPrefetch;
+
 
 /** \brief Class to store RiProcedural() arguments before the procedural is
  * called to generate geometry.
@@ -54,6 +66,10 @@ class CqProcedural : public CqSurface
 		 * \return Integer count of new GPrims created.
 		 */
 		virtual	TqInt	Split( std::vector<boost::shared_ptr<CqSurface> >& aSplits );
+		/** Start reading the RIB for DelayedReadArchive and RunProgram
+		 * procedurals on the prefetch threads.
+		 */
+		virtual void	PrefetchSplit( TqInt priority );
 		virtual ~CqProcedural();
 
 		//---------------------------------------------- Inlined Public Methods
@@ -113,6 +129,9 @@ class CqProcedural : public CqSurface
 		}
 		//------------------------------------------------------ Protexted
 	protected:
+		/// Level of detail passed to the subdivide function.
+		TqFloat Detail() const;
+
 		/* Contexy saved when the Procedural was declared */
 		boost::shared_ptr<CqModeBlock> m_pconStored;
 
@@ -121,6 +140,8 @@ class CqProcedural : public CqSurface
 		RtProcSubdivFunc m_pSubdivFunc;
 		RtProcFreeFunc m_pFreeFunc;
 
+		/// RIB generated ahead of time by the prefetch threads, if any.
+		boost::shared_ptr<SqProceduralPrefetch> m_prefetch;
 };
 
 
@@ -156,6 +177,22 @@ class CqRunProgramRepository
 		 */
 		std::iostream* find(const std::string& command);
 
+		/** \brief Send a request to a RunProgram child process and read
+		 * back the RIB which it generates.
+		 *
+		 * Requests to the same repository are serialised, so this may be
+		 * called from any thread.
+		 *
+		 * \param command - command line for the child process, as for find().
+		 * \param detail - level of detail for the request.
+		 * \param args - argument string for the request.
+		 * \param rib - the generated RIB is appended here.
+		 * \return false if there is no child process for the command.
+		 * \throw std::ios_base::failure if the pipe to the child breaks.
+		 */
+		bool request(const std::string& command, TqFloat detail,
+				const std::string& args, std::string& rib);
+
 	private:
 		typedef boost::shared_ptr<TqPopenStream> TqPopenStreamPtr;
 		typedef std::map<std::string, TqPopenStreamPtr> TqRunProgramMap;
@@ -167,6 +204,135 @@ class CqRunProgramRepository
 
 		/// Set of active pipes for child processes.
 		TqRunProgramMap m_activeRunPrograms;
+		/// Serialises access to the child processes.
+		TqMutex m_mutex;
+};
+
+
+//------------------------------------------------------------------------------
+/** \brief RIB read on behalf of a procedural by the prefetch threads.
+ */
+struct SqProceduralPrefetch
+{
+	/// Progress of the prefetch.
+	enum EqState
+	{
+		State_Queued,	///< Waiting for a prefetch thread.
+		State_Running,	///< Being read by a prefetch thread.
+		State_Done,		///< Read, waiting for the procedural to be split.
+		State_Claimed	///< Taken by the procedural, or abandoned.
+	};
+
+	EqState state;
+	/// Set if the procedural was destroyed while the RIB was being read.
+	bool abandoned;
+	/// Bucket index at which the procedural is first needed.
+	TqInt priority;
+	/// Order in which the prefetches were requested, to break ties.
+	TqInt sequence;
+
+	/// True for a RunProgram procedural, false for DelayedReadArchive.
+	bool runProgram;
+	/// Archive file path, or RunProgram command line.
+	std::string source;
+	/// Name of the RIB stream for error messages.
+	std::string streamName;
+	/// RunProgram argument string and level of detail.
+	std::string args;
+	TqFloat detail;
+
+	/// True once rib or archive holds the complete RIB for the procedural.
+	bool haveRib;
+	std::string rib;
+	/// Memory mapped DelayedReadArchive file, parsed in place of rib.
+	boost::shared_ptr<std::istream> archive;
+	/// Set if a RunProgram child process exited before finishing its RIB.
+	bool brokenPipe;
+	/// Error raised while reading, reported when the procedural is split.
+	TqInt errorCode;
+	TqInt errorSeverity;
+	std::string errorMessage;
+
+	SqProceduralPrefetch();
+};
+
+
+//------------------------------------------------------------------------------
+/** \brief Pool of threads which read the RIB for procedurals ahead of time.
+ *
+ * Expanding a DelayedReadArchive or RunProgram procedural means waiting for
+ * the archive to come off disk, or for the child program to generate its
+ * RIB.  The prefetcher does this work on background threads as soon as the
+ * procedural is posted to a bucket, taking procedurals in bucket order so
+ * that those needed soonest are read first.
+ *
+ * Parsing the RIB modifies the renderer state, so it still happens when the
+ * procedural is split, in the same order as without prefetching.  Only the
+ * source of the characters changes, so the generated geometry is identical.
+ */
+class CqProceduralPrefetcher
+{
+	public:
+		CqProceduralPrefetcher(CqRunProgramRepository& runPrograms);
+		/// Stop the prefetch threads, abandoning any queued work.
+		~CqProceduralPrefetcher();
+
+		/** \brief Queue a procedural for prefetching.
+		 *
+		 * \param subdivFunc, data - procedural subdivide function and data.
+		 * \param detail - level of detail for the procedural.
+		 * \param priority - bucket index at which the procedural is needed.
+		 * \param numThreads - number of prefetch threads to use.
+		 * \return the queued prefetch, or null if the procedural can't be
+		 * prefetched.
+		 */
+		boost::shared_ptr<SqProceduralPrefetch> prefetch(
+				RtProcSubdivFunc subdivFunc, RtPointer data, TqFloat detail,
+				TqInt priority, TqInt numThreads);
+
+		/** \brief Take the prefetched RIB for a procedural.
+		 *
+		 * Waits for the prefetch if it's being read; if no thread has got to
+		 * it yet the RIB is read on the calling thread instead.
+		 *
+		 * \return false if nothing could be read, in which case the
+		 * procedural should be expanded as normal.
+		 */
+		bool claim(SqProceduralPrefetch& prefetch);
+
+		/// Discard a prefetch whose procedural is being destroyed.
+		void abandon(SqProceduralPrefetch& prefetch);
+
+	private:
+		typedef boost::shared_ptr<SqProceduralPrefetch> TqPrefetchPtr;
+		/// Order for the queue: lowest priority value first.
+		struct SqLaterPrefetch
+		{
+			bool operator()(const TqPrefetchPtr& a, const TqPrefetchPtr& b) const
+			{
+				if(a->priority != b->priority)
+					return a->priority > b->priority;
+				return a->sequence > b->sequence;
+			}
+		};
+
+		CqRunProgramRepository& m_runPrograms;
+#ifdef	ENABLE_THREADING
+		void workerLoop();
+
+		std::priority_queue<TqPrefetchPtr, std::vector<TqPrefetchPtr>,
+			SqLaterPrefetch> m_queue;
+		/// Number of prefetches read and not yet claimed.
+		TqInt m_numReady;
+		TqInt m_nextSequence;
+		bool m_stop;
+		boost::mutex m_mutex;
+		/// Signalled when work is queued or ready prefetches are claimed.
+		boost::condition m_workAvailable;
+		/// Signalled when a prefetch thread finishes a prefetch.
+		boost::condition m_prefetchDone;
+		std::vector<boost::shared_ptr<boost::thread> > m_threads;
+#endif
 };
 
 
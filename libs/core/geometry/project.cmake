@@ -42,5 +42,11 @@ set(geometry_hdrs
 )
 make_absolute(geometry_hdrs ${geometry_SOURCE_DIR})
 
+set(geometry_test_srcs
+	blobby_test.cpp
+	subdivision2_test.cpp
+)
+make_absolute(geometry_test_srcs ${geometry_SOURCE_DIR})
+
 include_directories(${geometry_SOURCE_DIR})
 
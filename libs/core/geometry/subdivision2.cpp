@@ -25,11 +25,19 @@
 
 #include	"subdivision2.h"
 
+#include	<algorithm>
+#include	<deque>
 #include	<fstream>
 #include	<vector>
 
+#include	<boost/bind.hpp>
+#ifdef	ENABLE_THREADING
+#include	<boost/thread.hpp>
+#endif
+
 #include	"patch.h"
 #include	"micropolygon.h"
+#include	"threadscheduler.h"
 #include	<aqsis/math/vectorcast.h>
 
 namespace Aqsis {
@@ -42,6 +50,7 @@ namespace Aqsis {
 
 CqSubdivision2::CqSubdivision2( )
 		: CqMotionSpec<boost::shared_ptr<CqPolygonPoints> >( boost::shared_ptr<CqPolygonPoints>() ),
+		m_cBaseLaths( 0 ),
 		m_bInterpolateBoundary( false ),
 		m_faceVertexParams(),
 		m_fFinalised(false)
@@ -55,6 +64,7 @@ CqSubdivision2::CqSubdivision2( )
 
 CqSubdivision2::CqSubdivision2( const boost::shared_ptr<CqPolygonPoints>& pPoints )
 	:  CqMotionSpec<boost::shared_ptr<CqPolygonPoints> >(pPoints),
+	m_cBaseLaths( 0 ),
 	m_bInterpolateBoundary( false ),
 	m_faceVertexParams(),
 	m_fFinalised(false)
@@ -81,7 +91,8 @@ CqSubdivision2::CqSubdivision2( const boost::shared_ptr<CqPolygonPoints>& pPoint
 
 CqSubdivision2::~CqSubdivision2()
 {
-	// Delete the array of laths generated during the facet adding phase.
+	// Delete the laths generated during subdivision, the base mesh laths are
+	// freed with m_baseLaths.
 	for(std::vector<CqLath*>::const_iterator iLath=apLaths().begin(); iLath!=apLaths().end(); iLath++)
 		if(*iLath)
 			delete(*iLath);
@@ -116,6 +127,8 @@ CqLath* CqSubdivision2::pFacet(TqInt iIndex)
  */
 CqLath* CqSubdivision2::pVertex(TqInt iIndex)
 {
+	if(iIndex < static_cast<TqInt>(m_apBaseVertices.size()) && m_apBaseVertices[iIndex])
+		return(m_apBaseVertices[iIndex]);
 	assert(iIndex < static_cast<TqInt>(m_aapVertices.size()) && m_aapVertices[iIndex].size() >= 1);
 	return(m_aapVertices[iIndex][0]);
 }
@@ -148,6 +161,8 @@ const CqLath* CqSubdivision2::pFacet(TqInt iIndex) const
  */
 const CqLath* CqSubdivision2::pVertex(TqInt iIndex) const
 {
+	if(iIndex < static_cast<TqInt>(m_apBaseVertices.size()) && m_apBaseVertices[iIndex])
+		return(m_apBaseVertices[iIndex]);
 	assert(iIndex < static_cast<TqInt>(m_aapVertices.size()) && m_aapVertices[iIndex].size() >= 1);
 	return(m_aapVertices[iIndex][0]);
 }
@@ -160,12 +175,18 @@ const CqLath* CqSubdivision2::pVertex(TqInt iIndex) const
  *	vertices then use SetVertex to initialise them.
  *
  *	@param	cVerts	Then number of vertices that will be needed.
+ *	@param	cFacets	The number of facets that will be added, if known.
+ *	@param	cFaceVertices	The total number of facet vertices, if known.
  */
-void CqSubdivision2::Prepare(TqInt cVerts)
+void CqSubdivision2::Prepare(TqInt cVerts, TqInt cFacets, TqInt cFaceVertices)
 {
 	// Initialise the array of vertex indexes to the appropriate size.
 	m_aapVertices.resize(cVerts);
 
+	m_facetSizes.reserve(cFacets);
+	m_facetVertices.reserve(cFaceVertices);
+	m_facetFaceVertices.reserve(cFaceVertices);
+
 	m_fFinalised=false;
 }
 
@@ -1145,99 +1166,43 @@ void CqSubdivision2::AddFaceVertex(CqLath* pVertex, TqInt& iVIndex, TqInt& iFVIn
 //------------------------------------------------------------------------------
 /**
  *	Add a new facet to the topology structure.
- *	Adds the facet by adding new laths for the specified vertex indices, and
- *	linking them to each other clockwise about the facet. By convention, as
- *	outside of the topology structure facets are stored counter clockwise, the
- *	vertex indices should be passed to this function as counter clockwise and
- *	they will be internally altered to specify the facet as clockwise.
+ *	Records the vertex indices of the facet; the laths for all the facets are
+ *	created together by Finalise(), linking them to each other clockwise about
+ *	the facet. By convention, as outside of the topology structure facets are
+ *	stored counter clockwise, the vertex indices should be passed to this
+ *	function as counter clockwise and they will be internally altered to
+ *	specify the facet as clockwise.
  *
  *	@param	cVerts		The number of vertices in the facet.
  *	@param	pIndices	Pointer to an array of vertex indices.
- *
- *	@return				Pointer to one of the laths which represent this new
- *						facet in the topology structure.
+ *	@param	iFVIndex	Face vertex index of the first vertex in the facet.
  */
-CqLath* CqSubdivision2::AddFacet(TqInt cVerts, TqInt* pIndices, TqInt iFVIndex)
+void CqSubdivision2::AddFacet(TqInt cVerts, TqInt* pIndices, TqInt iFVIndex)
 {
-	CqLath* pLastLath=NULL;
-	CqLath* pFirstLath=NULL;
-	// Add the laths for this facet, referencing the appropriate vertexes as we go.
+	m_facetSizes.push_back(cVerts);
 	for(TqInt iVert = 0; iVert < cVerts; iVert++)
 	{
-		CqLath* pNewLath = new CqLath();
-		pNewLath->SetVertexIndex(pIndices[iVert]);
-		pNewLath->SetFaceVertexIndex(iFVIndex+iVert);
-
-		if(pLastLath)
-			pNewLath->SetpClockwiseFacet(pLastLath);
-
-		m_apLaths.push_back(pNewLath);
-		pLastLath = pNewLath;
-		if(iVert == 0)
-			pFirstLath = pLastLath;
-
-		// We also need to keep up to date a complete list of which laths refer to which
-		// vertices to aid us in finalising the topology structure later.
-		m_aapVertices[pIndices[iVert]].push_back(pLastLath);
+		m_facetVertices.push_back(pIndices[iVert]);
+		m_facetFaceVertices.push_back(iFVIndex+iVert);
 	}
-	// complete the chain by linking the last one as the next clockwise one to the first.
-	pFirstLath->SetpClockwiseFacet(pLastLath);
-
-	// Add the start lath in as the one referring to this facet in the list.
-	m_apFacets.push_back(pFirstLath);
-
-	return(pFirstLath);
 }
 
 //------------------------------------------------------------------------------
 /**
  *	Add a new facet to the topology structure.
- *	Adds the facet by adding new laths for the specified vertex indices, and
- *	linking them to each other clockwise about the facet. By convention, as
- *	outside of the topology structure facets are stored counter clockwise, the
- *	vertex indices should be passed to this function as counter clockwise and
- *	they will be internally altered to specify the facet as clockwise.
+ *	As above, but with explicit face vertex indices.
  *
  *	@param	cVerts		The number of vertices in the facet.
  *	@param	pIndices	Pointer to an array of vertex indices.
  *	@param	pFIndices	Pointer to an array of face vertex indices.
- *
- *	@return				Pointer to one of the laths which represent this new
- *						facet in the topology structure.
  */
-CqLath* CqSubdivision2::AddFacet(TqInt cVerts, TqInt* pIndices, TqInt* pFVIndices)
+void CqSubdivision2::AddFacet(TqInt cVerts, TqInt* pIndices, TqInt* pFVIndices)
 {
-	CqLath* pLastLath=NULL;
-	CqLath* pFirstLath=NULL;
-	// Add the laths for this facet, referencing the appropriate vertexes as we go.
-	for(TqInt iVert = 0; iVert < cVerts; iVert++)
-	{
-		CqLath* pNewLath = new CqLath();
-		pNewLath->SetVertexIndex(pIndices[iVert]);
-		pNewLath->SetFaceVertexIndex(pFVIndices[iVert]);
-
-		if(pLastLath)
-			pNewLath->SetpClockwiseFacet(pLastLath);
-
-		m_apLaths.push_back(pNewLath);
-		pLastLath = pNewLath;
-		if(iVert == 0)
-			pFirstLath = pLastLath;
-
-		// We also need to keep up to date a complete list of which laths refer to which
-		// vertices to aid us in finalising the topology structure later.
-		m_aapVertices[pIndices[iVert]].push_back(pLastLath);
-	}
-	// complete the chain by linking the last one as the next clockwise one to the first.
-	pFirstLath->SetpClockwiseFacet(pLastLath);
-
-	// Add the start lath in as the one referring to this facet in the list.
-	m_apFacets.push_back(pFirstLath);
-
-	return(pFirstLath);
+	m_facetSizes.push_back(cVerts);
+	m_facetVertices.insert(m_facetVertices.end(), pIndices, pIndices+cVerts);
+	m_facetFaceVertices.insert(m_facetFaceVertices.end(), pFVIndices, pFVIndices+cVerts);
 }
 
-
 CqSubdivision2* CqSubdivision2::Clone() const
 {
 	// Create a clone of the points class.
@@ -1276,62 +1241,91 @@ CqSubdivision2* CqSubdivision2::Clone() const
 	return(clone);
 }
 
-//------------------------------------------------------------------------------
-/**
- *	Finalise the linkage of the laths.
- *	After adding vertices and facets, call this to complete the linkage of the
- *	laths. To overcome any non-manifold areas in the mesh, this function may
- *	change the topology in order to produce a manifold mesh, or series of
- *	manifold meshes. This also means that all facets in the mesh may no longer
- *	be joined in a complete loop, so care must be taken when traversing the
- *	topology to ensure that all facets are processed.
+namespace {
+
+/// Base mesh vertices below which it's not worth threading a link task.
+const TqInt minVerticesPerLinkTask = 16384;
+
+/** Get the lath counter clockwise about the facet from pLath.
+ *
+ * Unlike CqLath::ccf() this only walks the clockwise facet links, so it
+ * doesn't read the vertex links which other threads may be building.
  */
-bool CqSubdivision2::Finalise()
+CqLath* ccfInFacet(CqLath* pLath)
 {
-	CqString objname( "unnamed" );
-	const CqString* pattrName = pPoints()->pAttributes()->GetStringAttribute( "identifier", "name" );
-	if ( pattrName != 0 )
-		objname = pattrName[ 0 ];
-	std::vector<std::vector<CqLath*> >::iterator ivert;
-	for(TqInt i = 0; i < static_cast<TqInt>(m_aapVertices.size()); ++i)
-	{
-		ivert = m_aapVertices.begin() + i;
-		TqInt cLaths = (*ivert).size();
+	CqLath* pPrev = pLath->cf();
+	while(pPrev->cf() != pLath)
+		pPrev = pPrev->cf();
+	return pPrev;
+}
 
-		// If there is only one lath, it can't be connected to anything.
-		if(cLaths<=1)
-			continue;
+/** Link the clockwise vertex pointers of the laths about a single vertex.
+ *
+ * \param apLaths - laths referencing the vertex.
+ * \param cLaths - number of laths in apLaths.
+ * \param aVisited - set to flag the laths which were linked together.
+ * \return false if some laths couldn't be linked, which means the vertex is
+ *         non-manifold.
+ */
+bool linkVertexLaths(CqLath** apLaths, TqInt cLaths, std::vector<bool>& aVisited)
+{
+	// If there is only one lath, it can't be connected to anything.
+	if(cLaths<=1)
+		return true;
 
-		// Create an array for the laths on this vertex that have been visited.
-		std::vector<bool>  aVisited;
-		aVisited.resize(cLaths);
-		TqInt cVisited = 0;
+	aVisited.assign(cLaths, false);
+	TqInt cVisited = 0;
 
-		// Initialise it to all false.
-		aVisited.assign(cLaths, false);
+	CqLath* pCurrent = apLaths[0];
+	CqLath* pStart = pCurrent;
+	TqInt iStart = 0;
+
+	bool fDone = false;
+	while(!fDone)
+	{
+		// Find a clockwise vertex match for the counterclockwise vertex index of this lath.
+		TqInt ccwVertex = ccfInFacet(pCurrent)->VertexIndex();
+		TqInt iLath = 0;
+		for(iLath = 0; iLath < cLaths; iLath++)
+		{
+			// Only check non-visited laths.
+			if(!aVisited[iLath] && apLaths[iLath]->cf()->VertexIndex() == ccwVertex)
+			{
+				pCurrent->SetpClockwiseVertex(apLaths[iLath]);
+				pCurrent = apLaths[iLath];
+				// Mark the linked to lath as visited.
+				aVisited[iLath] = true;
+				cVisited++;
 
-		CqLath* pCurrent = (*ivert)[0];
-		CqLath* pStart = pCurrent;
-		TqInt iCurrent = 0;
-		TqInt iStart = 0;
+				break;
+			}
+		}
+		// If we didn't find a match then we are done.
+		fDone = iLath==cLaths;
+	}
 
-		bool fDone = false;
+	// If the last lath wasn't linked, then we have a boundary condition, so
+	// start again from the initial lath and process backwards.
+	if(NULL == pCurrent->cv())
+	{
+		fDone = false;
 		while(!fDone)
 		{
-			// Find a clockwise vertex match for the counterclockwise vertex index of this lath.
-			TqInt ccwVertex = pCurrent->ccf()->VertexIndex();
+			// Find a counterclockwise vertex match for the clockwise vertex index of this lath.
+			TqInt cwVertex = pStart->cf()->VertexIndex();
 			TqInt iLath = 0;
 			for(iLath = 0; iLath < cLaths; iLath++)
 			{
 				// Only check non-visited laths.
-				if(!aVisited[iLath] && (*ivert)[iLath]->cf()->VertexIndex() == ccwVertex)
+				if(!aVisited[iLath] && ccfInFacet(apLaths[iLath])->VertexIndex() == cwVertex)
 				{
-					pCurrent->SetpClockwiseVertex((*ivert)[iLath]);
-					pCurrent = (*ivert)[iLath];
-					iCurrent = iLath;
+					// Link the current to the match.
+					apLaths[iLath]->SetpClockwiseVertex(pStart);
 					// Mark the linked to lath as visited.
-					aVisited[iLath] = true;
+					aVisited[iStart] = true;
 					cVisited++;
+					pStart = apLaths[iLath];
+					iStart = iLath;
 
 					break;
 				}
@@ -1339,66 +1333,265 @@ bool CqSubdivision2::Finalise()
 			// If we didn't find a match then we are done.
 			fDone = iLath==cLaths;
 		}
+	}
+	aVisited[iStart] = true;
+	cVisited++;
+	// If we have not visited all the laths referencing this vertex, then we have a non-manifold situation.
+	return cVisited >= cLaths;
+}
+
+/// A range of base mesh vertices to be linked by linkVertexRange().
+struct SqVertexLinkTask
+{
+	TqInt begin;
+	TqInt end;
+	const TqInt* lathStart;
+	CqLath** vertexLaths;
+	/// Vertices in the range which were found to be non-manifold.
+	std::vector<TqInt> nonManifold;
+};
+
+void linkVertexRange(SqVertexLinkTask* task)
+{
+	std::vector<bool> aVisited;
+	for(TqInt i = task->begin; i < task->end; ++i)
+	{
+		TqInt first = task->lathStart[i];
+		if(!linkVertexLaths(task->vertexLaths + first, task->lathStart[i+1] - first, aVisited))
+			task->nonManifold.push_back(i);
+	}
+}
+
+} // unnamed namespace
+
+//------------------------------------------------------------------------------
+/**
+ *	Finalise the linkage of the laths.
+ *	After adding vertices and facets, call this to complete the linkage of the
+ *	laths. To overcome any non-manifold areas in the mesh, this function may
+ *	change the topology in order to produce a manifold mesh, or series of
+ *	manifold meshes. This also means that all facets in the mesh may no longer
+ *	be joined in a complete loop, so care must be taken when traversing the
+ *	topology to ensure that all facets are processed.
+ */
+bool CqSubdivision2::Finalise()
+{
+	buildBaseLaths();
+
+	// Sort the base laths by vertex with a counting sort, so that the laths
+	// referencing vertex i are vertexLaths[lathStart[i]] up to
+	// vertexLaths[lathStart[i+1]-1].
+	TqInt cVerts = m_aapVertices.size();
+	std::vector<TqInt> lathStart(cVerts+1, 0);
+	for(TqInt i = 0; i < m_cBaseLaths; ++i)
+	{
+		assert(m_baseLaths[i].VertexIndex() < cVerts);
+		++lathStart[m_baseLaths[i].VertexIndex()+1];
+	}
+	for(TqInt i = 0; i < cVerts; ++i)
+		lathStart[i+1] += lathStart[i];
+	std::vector<CqLath*> vertexLaths(m_cBaseLaths);
+	{
+		std::vector<TqInt> next(lathStart.begin(), lathStart.end()-1);
+		for(TqInt i = 0; i < m_cBaseLaths; ++i)
+			vertexLaths[next[m_baseLaths[i].VertexIndex()]++] = &m_baseLaths[i];
+	}
+
+	linkBaseVertices(lathStart, vertexLaths);
+
+	// Keep one lath for each base vertex.  Laths which were moved onto a
+	// duplicate vertex no longer reference the vertex they were sorted under.
+	m_apBaseVertices.assign(cVerts, 0);
+	for(TqInt i = 0; i < cVerts; ++i)
+	{
+		for(TqInt j = lathStart[i]; j < lathStart[i+1]; ++j)
+		{
+			if(vertexLaths[j]->VertexIndex() == i)
+			{
+				m_apBaseVertices[i] = vertexLaths[j];
+				break;
+			}
+		}
+	}
+
+	m_fFinalised = true;
+	return( true );
+}
+
+
+//------------------------------------------------------------------------------
+/**
+ *	Create the laths for the facets added since Prepare().
+ *	All the laths are allocated in a single block and linked clockwise about
+ *	their facets; the facet description is then discarded.
+ */
+void CqSubdivision2::buildBaseLaths()
+{
+	m_cBaseLaths = m_facetVertices.size();
+	m_baseLaths.reset(new CqLath[m_cBaseLaths]);
+	m_apFacets.reserve(m_apFacets.size() + m_facetSizes.size());
+
+	CqLath* pLath = m_baseLaths.get();
+	TqInt iFV = 0;
+	for(TqInt iFacet = 0, cFacets = m_facetSizes.size(); iFacet < cFacets; ++iFacet)
+	{
+		CqLath* pFirstLath = pLath;
+		for(TqInt iVert = 0; iVert < m_facetSizes[iFacet]; ++iVert, ++pLath, ++iFV)
+		{
+			pLath->SetVertexIndex(m_facetVertices[iFV]);
+			pLath->SetFaceVertexIndex(m_facetFaceVertices[iFV]);
+			if(iVert > 0)
+				pLath->SetpClockwiseFacet(pLath-1);
+		}
+		// complete the chain by linking the last one as the next clockwise one to the first.
+		pFirstLath->SetpClockwiseFacet(pLath-1);
+
+		// Add the start lath in as the one referring to this facet in the list.
+		m_apFacets.push_back(pFirstLath);
+	}
+
+	std::vector<TqInt>().swap(m_facetSizes);
+	std::vector<TqInt>().swap(m_facetVertices);
+	std::vector<TqInt>().swap(m_facetFaceVertices);
+}
+
+
+//------------------------------------------------------------------------------
+/**
+ *	Link the laths about each base mesh vertex.
+ *	The vertices are independent, so large meshes are linked on several
+ *	threads.  Non-manifold vertices are then fixed one at a time, since
+ *	fixing them adds new vertices to the mesh, and the vertices next to the
+ *	laths moved onto a new vertex are relinked.
+ *
+ *	@param	lathStart	Start of the laths for each vertex in vertexLaths.
+ *	@param	vertexLaths	Pointers to the base laths, sorted by vertex.
+ */
+void CqSubdivision2::linkBaseVertices(std::vector<TqInt>& lathStart,
+		std::vector<CqLath*>& vertexLaths)
+{
+	TqInt cVerts = lathStart.size() - 1;
+
+	TqInt numThreads = 1;
+#ifdef	ENABLE_THREADING
+	const TqInt* threads = QGetRenderContext()->GetIntegerOption("limits", "threads");
+	if(threads)
+		numThreads = threads[0];
+	if(numThreads <= 0)
+		numThreads = std::max<TqInt>(1, boost::thread::hardware_concurrency());
+#endif
+	TqInt cTasks = 1;
+	if(numThreads > 1 && cVerts >= 2*minVerticesPerLinkTask)
+		cTasks = std::min<TqInt>(4*numThreads, cVerts/minVerticesPerLinkTask);
+
+	std::vector<SqVertexLinkTask> tasks(cTasks);
+	for(TqInt i = 0; i < cTasks; ++i)
+	{
+		tasks[i].begin = static_cast<TqInt>(static_cast<TqFloat>(cVerts)*i/cTasks);
+		tasks[i].end = i+1 == cTasks ? cVerts
+			: static_cast<TqInt>(static_cast<TqFloat>(cVerts)*(i+1)/cTasks);
+		tasks[i].lathStart = &lathStart[0];
+		tasks[i].vertexLaths = vertexLaths.empty() ? 0 : &vertexLaths[0];
+	}
+	if(cTasks > 1)
+	{
+		CqThreadScheduler scheduler(numThreads);
+		for(TqInt i = 0; i < cTasks; ++i)
+			scheduler.addWorkUnit(boost::bind(&linkVertexRange, &tasks[i]));
+		scheduler.joinAll();
+	}
+	else
+		linkVertexRange(&tasks[0]);
+
+	// Fix the non-manifold vertices one at a time.  Moving laths onto a new
+	// vertex changes the edges seen by the vertices next to them in their
+	// facets, so those vertices are queued to be linked again too.
+	std::deque<TqInt> toRelink;
+	std::vector<bool> queued(cVerts, false);
+	for(TqInt iTask = 0; iTask < cTasks; ++iTask)
+	{
+		const std::vector<TqInt>& nonManifold = tasks[iTask].nonManifold;
+		for(TqInt i = 0, end = nonManifold.size(); i < end; ++i)
+		{
+			toRelink.push_back(nonManifold[i]);
+			queued[nonManifold[i]] = true;
+		}
+	}
+	if(toRelink.empty())
+		return;
 
-		// If the last lath wasn't linked, then we have a boundary condition, so
-		// start again from the initial lath and process backwards.
-		if(NULL == pCurrent->cv())
+	CqString objname( "unnamed" );
+	const CqString* pattrName = pPoints()->pAttributes()->GetStringAttribute( "identifier", "name" );
+	if ( pattrName != 0 )
+		objname = pattrName[ 0 ];
+	std::vector<CqLath*> aLaths;
+	std::vector<CqLath*> aRemaining;
+	std::vector<bool> aVisited;
+	while(!toRelink.empty())
+	{
+		TqInt iVert = toRelink.front();
+		toRelink.pop_front();
+		queued[iVert] = false;
+		if(iVert < cVerts)
 		{
-			fDone = false;
-			while(!fDone)
+			// Skip laths which have been moved onto a duplicate vertex.
+			aLaths.clear();
+			for(TqInt j = lathStart[iVert]; j < lathStart[iVert+1]; ++j)
 			{
-				// Find a counterclockwise vertex match for the clockwise vertex index of this lath.
-				TqInt cwVertex = pStart->cf()->VertexIndex();
-				TqInt iLath = 0;
-				for(iLath = 0; iLath < cLaths; iLath++)
-				{
-					// Only check non-visited laths.
-					if(!aVisited[iLath] && (*ivert)[iLath]->ccf()->VertexIndex() == cwVertex)
-					{
-						// Link the current to the match.
-						(*ivert)[iLath]->SetpClockwiseVertex(pStart);
-						// Mark the linked to lath as visited.
-						aVisited[iStart] = true;
-						cVisited++;
-						pStart = (*ivert)[iLath];
-						iStart = iLath;
-
-						break;
-					}
-				}
-				// If we didn't find a match then we are done.
-				fDone = iLath==cLaths;
+				if(vertexLaths[j]->VertexIndex() == iVert)
+					aLaths.push_back(vertexLaths[j]);
 			}
 		}
-		aVisited[iStart] = true;
-		cVisited++;
-		// If we have not visited all the laths referencing this vertex, then we have a non-manifold situation.
-		if(cVisited < cLaths)
+		else
+			aLaths = m_aapVertices[iVert];
+		while(true)
 		{
-			Aqsis::log() << error << "Found a non-manifold vertex in the control hull of object \"" << objname.c_str() << "\" at vertex " << pCurrent->VertexIndex() << std::endl;
+			for(TqInt iLath = 0, cLaths = aLaths.size(); iLath < cLaths; ++iLath)
+				aLaths[iLath]->SetpClockwiseVertex(NULL);
+			if(aLaths.empty() || linkVertexLaths(&aLaths[0], aLaths.size(), aVisited))
+				break;
+
+			CqLath* pLinked = aLaths[std::find(aVisited.begin(), aVisited.end(), true)
+				- aVisited.begin()];
+			Aqsis::log() << error << "Found a non-manifold vertex in the control hull of object \"" << objname.c_str() << "\" at vertex " << pLinked->VertexIndex() << std::endl;
 			// Now create a duplicate vertex at the same position as this one, and move all
 			// remaining laths to point to that.
 			TqInt iNewVert=-1, iNewFVert;
-			DuplicateVertex(pCurrent, iNewVert, iNewFVert);
-			
-			for(TqInt iLath = 0; iLath < static_cast<TqInt>(m_aapVertices[i].size()); ++iLath)
+			DuplicateVertex(pLinked, iNewVert, iNewFVert);
+			queued.resize(m_aapVertices.size(), false);
+
+			aRemaining.clear();
+			std::vector<CqLath*> aKept;
+			for(TqInt iLath = 0, cLaths = aLaths.size(); iLath < cLaths; ++iLath)
 			{
-				if(!aVisited[iLath])
+				if(aVisited[iLath])
 				{
-					std::vector<CqLath*>::iterator lath = m_aapVertices[i].begin() + iLath;
-					(*lath)->SetVertexIndex(iNewVert);
-					(*lath)->SetFaceVertexIndex(iNewFVert);
-					m_aapVertices[iNewVert].push_back((*lath));
-					m_aapVertices[i].erase(lath);
-					aVisited.erase(aVisited.begin() + iLath);
-					--iLath;
+					aKept.push_back(aLaths[iLath]);
+					continue;
+				}
+				CqLath* pMoved = aLaths[iLath];
+				pMoved->SetVertexIndex(iNewVert);
+				pMoved->SetFaceVertexIndex(iNewFVert);
+				aRemaining.push_back(pMoved);
+				// Relink the neighbouring vertices in the facet of the lath.
+				TqInt aNeighbours[2] = { pMoved->cf()->VertexIndex(),
+					ccfInFacet(pMoved)->VertexIndex() };
+				for(TqInt k = 0; k < 2; ++k)
+				{
+					if(aNeighbours[k] != iNewVert && !queued[aNeighbours[k]])
+					{
+						queued[aNeighbours[k]] = true;
+						toRelink.push_back(aNeighbours[k]);
+					}
 				}
 			}
+			// Duplicated vertices keep their laths in m_aapVertices.
+			if(pLinked->VertexIndex() >= cVerts)
+				m_aapVertices[pLinked->VertexIndex()].swap(aKept);
+			m_aapVertices[iNewVert] = aRemaining;
+			aLaths.swap(aRemaining);
 		}
 	}
-
-	m_fFinalised = true;
-	return( true );
 }
 
 
@@ -1720,7 +1913,12 @@ void CqSubdivision2::OutputInfo(const char* fname, std::vector<CqLath*>* paFaces
 	if( NULL == paLaths )
 		paLaths = &m_apFacets;
 
-	paLaths = &m_apLaths;
+	std::vector<CqLath*> apAllLaths;
+	apAllLaths.reserve(cLaths());
+	for(TqInt i = 0; i < m_cBaseLaths; ++i)
+		apAllLaths.push_back(&m_baseLaths[i]);
+	apAllLaths.insert(apAllLaths.end(), m_apLaths.begin(), m_apLaths.end());
+	paLaths = &apAllLaths;
 
 	CqMatrix matCameraToObject0;
 	QGetRenderContext() ->matSpaceToSpace( "camera", "object", NULL, pPoints()->pTransform().get(), pPoints()->pTransform()->Time(0), matCameraToObject0 );
@@ -33,6 +33,8 @@
 #include "surface.h"
 #include "polygon.h"
 
+#include <boost/scoped_array.hpp>
+
 namespace Aqsis {
 
 //------------------------------------------------------------------------------
@@ -75,7 +77,7 @@ class CqSubdivision2 : public CqMotionSpec<boost::shared_ptr<CqPolygonPoints> >
 		/// Get the number of laths representing this topology.
 		TqInt	cLaths() const
 		{
-			return(m_apLaths.size());
+			return(m_cBaseLaths + m_apLaths.size());
 		}
 		/// Get the number of faces representing this topology.
 		TqInt	cVertices() const
@@ -83,7 +85,7 @@ class CqSubdivision2 : public CqMotionSpec<boost::shared_ptr<CqPolygonPoints> >
 			return(m_aapVertices.size());
 		}
 
-		/// Get a refrence to the array of autoatically generated laths.
+		/// Get a refrence to the array of laths generated by subdivision.
 		const std::vector<CqLath*>& apLaths() const
 		{
 			return(m_apLaths);
@@ -95,9 +97,9 @@ class CqSubdivision2 : public CqMotionSpec<boost::shared_ptr<CqPolygonPoints> >
 			return ( GetMotionObject( Time( TimeIndex ) ) );
 		}
 
-		void		Prepare(TqInt cVerts);
-		CqLath*		AddFacet(TqInt cVerts, TqInt* pIndices, TqInt iFVIndex);
-		CqLath*		AddFacet(TqInt cVerts, TqInt* pIndices, TqInt* pFVIndices);
+		void		Prepare(TqInt cVerts, TqInt cFacets = 0, TqInt cFaceVertices = 0);
+		void		AddFacet(TqInt cVerts, TqInt* pIndices, TqInt iFVIndex);
+		void		AddFacet(TqInt cVerts, TqInt* pIndices, TqInt* pFVIndices);
 		bool		Finalise();
 		void		SubdivideFace(CqLath* pFace, std::vector<CqLath*>& apSubFaces);
 		bool		CanUsePatch( CqLath* pFace );
@@ -201,15 +203,31 @@ class CqSubdivision2 : public CqMotionSpec<boost::shared_ptr<CqPolygonPoints> >
 				TqInt iIndex);
 
 		void subdivideNeighbourFaces(CqLath* vert);
+		void buildBaseLaths();
+		void linkBaseVertices(std::vector<TqInt>& lathStart,
+				std::vector<CqLath*>& vertexLaths);
 
 		typedef std::map<const CqLath*, TqFloat> TqSharpnessMap;
 
 		/// Array of pointers to laths, one each representing each facet.
 		std::vector<CqLath*>				m_apFacets;
 		/// Array of arrays of pointers to laths each array representing the total laths referencing a single vertex.
+		/// The arrays for base mesh vertices are left empty, see m_apBaseVertices.
 		std::vector<std::vector<CqLath*> >	m_aapVertices;
-		/// Array of lath pointers, one for each lath generated.
+		/// Array of lath pointers, one for each lath generated by subdivision.
 		std::vector<CqLath*>				m_apLaths;
+		/// Number of vertices in each facet added since Prepare().
+		std::vector<TqInt>					m_facetSizes;
+		/// Vertex indices of the added facets, in facet order.
+		std::vector<TqInt>					m_facetVertices;
+		/// Face vertex indices of the added facets, in facet order.
+		std::vector<TqInt>					m_facetFaceVertices;
+		/// Laths of the base mesh, built in a single block by Finalise().
+		boost::scoped_array<CqLath>			m_baseLaths;
+		/// Number of laths in m_baseLaths.
+		TqInt								m_cBaseLaths;
+		/// One lath referencing each base mesh vertex, or NULL for unused vertices.
+		std::vector<CqLath*>				m_apBaseVertices;
 		/// Map of face indices which are to be treated as holes in the surface, i.e. not rendered.
 		std::map<TqInt, bool>				m_mapHoles;
 		/// Flag indicating whether this surface interpolates it's boundaries or not.
@@ -0,0 +1,134 @@
+// Aqsis
+// Copyright (C) 1997 - 2001, Paul C. Gregory
+//
+// Contact: pgregory@aqsis.org
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation; either
+// version 2 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+/** \file Unit tests for building the topology of subdivision meshes.
+ */
+
+#include "subdivision2.h"
+
+#include <vector>
+
+#include <aqsis/ri/ri.h>
+
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/auto_unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(subdivision2_tests)
+
+using namespace Aqsis;
+
+namespace {
+
+/// Build the topology of a mesh of facets with the given vertices.
+boost::shared_ptr<CqSubdivision2> makeMesh(TqInt cVerts,
+		const std::vector<TqInt>& nverts, std::vector<TqInt>& verts)
+{
+	boost::shared_ptr<CqPolygonPoints> points(
+			new CqPolygonPoints(cVerts, nverts.size(), verts.size()));
+	points->AddPrimitiveVariable(
+			new CqParameterTypedVertex<CqVector4D, type_hpoint, CqVector3D>("P", 1));
+	points->P()->SetSize(cVerts);
+	for(TqInt i = 0; i < cVerts; ++i)
+		points->P()->pValue(i)[0] = CqVector4D(i, i % 3, i % 5);
+	boost::shared_ptr<CqSubdivision2> subd(new CqSubdivision2(points));
+	subd->Prepare(cVerts, nverts.size(), verts.size());
+	for(TqInt face = 0, iV = 0, nfaces = nverts.size(); face < nfaces; ++face)
+	{
+		subd->AddFacet(nverts[face], &verts[iV], iV);
+		iV += nverts[face];
+	}
+	subd->Finalise();
+	return subd;
+}
+
+/// The lath before pLath in its facet, found without using vertex links.
+const CqLath* prevInFacet(const CqLath* pLath)
+{
+	const CqLath* pPrev = pLath->cf();
+	while(pPrev->cf() != pLath)
+		pPrev = pPrev->cf();
+	return pPrev;
+}
+
+/** Check that all the vertex links of the laths cross an edge.
+ *
+ * A lath L is linked to the lath about the same vertex in the next facet
+ * across the edge from L's vertex to the one before it in its facet.
+ */
+void checkVertexLinks(const CqSubdivision2& subd)
+{
+	for(TqInt face = 0; face < subd.cFacets(); ++face)
+	{
+		const CqLath* pStart = subd.pFacet(face);
+		const CqLath* pLath = pStart;
+		do
+		{
+			const CqLath* pLinked = pLath->cv();
+			if(pLinked)
+			{
+				BOOST_CHECK_EQUAL(pLinked->VertexIndex(), pLath->VertexIndex());
+				BOOST_CHECK_EQUAL(pLinked->cf()->VertexIndex(),
+						prevInFacet(pLath)->VertexIndex());
+			}
+			pLath = pLath->cf();
+		}
+		while(pLath != pStart);
+	}
+}
+
+} // unnamed namespace
+
+BOOST_AUTO_TEST_CASE(subdivision2_manifold_mesh)
+{
+	RiBegin(RI_NULL);
+	// A closed cube.
+	TqInt nverts[] = {4, 4, 4, 4, 4, 4};
+	TqInt verts[] = {0,1,3,2, 2,3,5,4, 4,5,7,6, 6,7,1,0, 1,7,5,3, 6,0,2,4};
+	std::vector<TqInt> nvertsV(nverts, nverts + 6);
+	std::vector<TqInt> vertsV(verts, verts + 24);
+	boost::shared_ptr<CqSubdivision2> subd = makeMesh(8, nvertsV, vertsV);
+	BOOST_CHECK_EQUAL(subd->cVertices(), 8);
+	checkVertexLinks(*subd);
+	// Every vertex is surrounded by its three faces.
+	for(TqInt i = 0; i < 8; ++i)
+	{
+		std::vector<CqLath*> faces;
+		subd->pVertex(i)->Qvf(faces);
+		BOOST_CHECK_EQUAL(faces.size(), 3U);
+	}
+	RiEnd();
+}
+
+BOOST_AUTO_TEST_CASE(subdivision2_nonmanifold_edge)
+{
+	RiBegin(RI_NULL);
+	// Three of the triangles share the edge from vertex 0 to vertex 3.  Fixing
+	// this moves some laths onto duplicate vertices, after which the laths
+	// about the neighbouring vertices must be linked again.
+	TqInt nverts[] = {3, 3, 3, 3};
+	TqInt verts[] = {3,0,2, 0,3,4, 0,3,1, 4,3,2};
+	std::vector<TqInt> nvertsV(nverts, nverts + 4);
+	std::vector<TqInt> vertsV(verts, verts + 12);
+	boost::shared_ptr<CqSubdivision2> subd = makeMesh(5, nvertsV, vertsV);
+	BOOST_CHECK_GT(subd->cVertices(), 5);
+	checkVertexLinks(*subd);
+	RiEnd();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
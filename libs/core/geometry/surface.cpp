@@ -24,14 +24,33 @@
 */
 
 #include	<aqsis/aqsis.h>
+
+#include	<cstring>
+#include	<typeinfo>
+
 #include	"renderer.h"
 #include	"micropolygon.h"
 #include	"surface.h"
 #include	<aqsis/math/vector2d.h>
 #include	"imagebuffer.h"
+#include	"dicecache.h"
 
 namespace Aqsis {
 
+namespace {
+
+// Options and attributes looked up while rendering, interned once.
+const CqParameterKey identifierNameKey( "identifier", "name" );
+const CqParameterKey systemColorKey( "System", "Color" );
+const CqParameterKey systemGeometricFocusFactorKey( "System", "GeometricFocusFactor" );
+const CqParameterKey systemGeometricMotionFactorKey( "System", "GeometricMotionFactor" );
+const CqParameterKey systemOpacityKey( "System", "Opacity" );
+const CqParameterKey systemShadingRateKey( "System", "ShadingRate" );
+const CqParameterKey systemShutterKey( "System", "Shutter" );
+const CqParameterKey systemTextureCoordinatesKey( "System", "TextureCoordinates" );
+
+} // unnamed namespace
+
 //TqFloat CqSurface::m_fGridSize = sqrt(256.0);
 
 
@@ -57,7 +76,7 @@ void CqSurface::SetSurfaceParameters( const CqSurface& From )
 
 CqString CqSurface::strName() const
 {
-	const CqString * pattrLightName = pAttributes() ->GetStringAttribute( "identifier", "name" );
+	const CqString * pattrLightName = pAttributes() ->GetStringAttribute( identifierNameKey );
 	CqString strName( "not named" );
 	if ( pattrLightName != 0 )
 		strName = pattrLightName[ 0 ];
@@ -159,7 +178,9 @@ CqSurface::CqSurface()
 	m_SplitDir(SplitDir_U),
 	m_CachedBound(false),
 	m_Bound(),
-	m_pCSGNode()
+	m_pCSGNode(),
+	m_fHasDiceKeySeed(false),
+	m_diceKeySeed()
 {
 	// Set a refernce with the current attributes.
 	m_pAttributes = QGetRenderContext() ->pattrCurrent();
@@ -175,7 +196,7 @@ CqSurface::CqSurface()
 		else
 		{
 			CqString objname( "unnamed" );
-			const CqString* pattrName = m_pAttributes->GetStringAttribute( "identifier", "name" );
+			const CqString* pattrName = m_pAttributes->GetStringAttribute( identifierNameKey );
 			if ( pattrName != 0 )
 				objname = pattrName[ 0 ];
 			Aqsis::log() << warning << "Primitive \"" << objname.c_str() << "\" defined when not in 'Primitive' solid block" << std::endl;
@@ -216,6 +237,45 @@ void CqSurface::CloneData( CqSurface* clone ) const
 	clone->ClonePrimitiveVariables(*this);
 }
 
+//---------------------------------------------------------------------
+/** Seed the dice cache key from the world space primitive variables.
+ */
+
+void CqSurface::SeedDiceKey()
+{
+	m_diceKeySeed = CqDiceKey();
+	// Keep seeded keys apart from keys made from camera space data.
+	m_diceKeySeed.add( CqString( "world" ) );
+	m_fHasDiceKeySeed = AddToDiceKey( m_diceKeySeed );
+}
+
+//---------------------------------------------------------------------
+/** Derive the dice cache key seed of a split from the parent surface.
+ */
+
+void CqSurface::InheritDiceKeySeed( const CqSurface& parent, TqInt index )
+{
+	m_fHasDiceKeySeed = parent.m_fHasDiceKeySeed;
+	if ( !m_fHasDiceKeySeed )
+		return;
+	m_diceKeySeed = parent.m_diceKeySeed;
+	m_diceKeySeed.add( parent.m_SplitDir );
+	m_diceKeySeed.add( parent.m_fDiceable );
+	m_diceKeySeed.add( index );
+}
+
+//---------------------------------------------------------------------
+/** Add all the primitive variables to a dice cache key.
+ */
+
+void CqSurface::AddPrimitiveVariablesToDiceKey( CqDiceKey& key ) const
+{
+	std::vector<CqParameter*>::const_iterator iUP;
+	std::vector<CqParameter*>::const_iterator end = m_aUserParams.end();
+	for ( iUP = m_aUserParams.begin(); iUP != end; iUP++ )
+		( *iUP ) ->AddToDiceKey( key );
+}
+
 //---------------------------------------------------------------------
 /** Copy all the primitive variables from the donor to this.
  */
@@ -254,7 +314,7 @@ void CqSurface::SetDefaultPrimitiveVariables( bool bUseDef_st )
 		s() ->SetSize( 4 );
 		TqInt i;
 		for ( i = 0; i < 4; i++ )
-			s() ->pValue() [ i ] = m_pAttributes->GetFloatAttribute( "System", "TextureCoordinates" ) [ i * 2 ];
+			s() ->pValue() [ i ] = m_pAttributes->GetFloatAttribute( systemTextureCoordinatesKey ) [ i * 2 ];
 	}
 
 	if ( USES( bUses, EnvVars_t ) && bUseDef_st && !bHasVar(EnvVars_t))
@@ -263,7 +323,7 @@ void CqSurface::SetDefaultPrimitiveVariables( bool bUseDef_st )
 		t() ->SetSize( 4 );
 		TqInt i;
 		for ( i = 0; i < 4; i++ )
-			t() ->pValue() [ i ] = m_pAttributes->GetFloatAttribute( "System", "TextureCoordinates" ) [ ( i * 2 ) + 1 ];
+			t() ->pValue() [ i ] = m_pAttributes->GetFloatAttribute( systemTextureCoordinatesKey ) [ ( i * 2 ) + 1 ];
 	}
 
 	if ( USES( bUses, EnvVars_u ) )
@@ -425,19 +485,14 @@ void CqSurface::NaturalDice( CqParameter* pParam, TqInt uDiceSize,
 
 
 //---------------------------------------------------------------------
-/** Dice the patch into a mesh of micropolygons.
+/** Dice the primitive variables of the surface into a grid.
+ * \param pGrid The grid to fill in.
+ * \param lUses The set of variables needed by the shaders.
+ * \return The set of variables filled in.
  */
 
-CqMicroPolyGridBase* CqSurface::Dice()
+TqInt CqSurface::DiceVariables( CqMicroPolyGrid* pGrid, TqInt lUses )
 {
-	PreDice( m_uDiceSize, m_vDiceSize );
-
-	// Create a new CqMicorPolyGrid for this patch
-	CqMicroPolyGrid* pGrid = new CqMicroPolyGrid();
-	pGrid->Initialise( m_uDiceSize, m_vDiceSize, shared_from_this() );
-
-	TqInt lUses = Uses();
-
 	// Allow the surface to fill in as much as possible on the grid in one go for speed.
 	TqInt lDone = DiceAll( pGrid );
 
@@ -480,19 +535,86 @@ CqMicroPolyGridBase* CqSurface::Dice()
 		}
 	}
 
+	return ( lDone );
+}
+
+
+//---------------------------------------------------------------------
+/** Dice the patch into a mesh of micropolygons.
+ */
+
+CqMicroPolyGridBase* CqSurface::Dice()
+{
+	PreDice( m_uDiceSize, m_vDiceSize );
+
+	// Create a new CqMicorPolyGrid for this patch
+	CqMicroPolyGrid* pGrid = new CqMicroPolyGrid();
+	pGrid->Initialise( m_uDiceSize, m_vDiceSize, shared_from_this() );
+
+	TqInt lUses = Uses();
+
+	// If the surface has been diced the same way before, copy the diced
+	// variables out of the dice cache.  Surfaces seeded before the camera
+	// transform keep their grids in world space, so they are found again
+	// after the camera moves; others fall back to a key made from their
+	// camera space data.
+	CqDiceCache& diceCache = QGetRenderContext()->diceCache();
+	CqDiceKey diceKey;
+	bool cacheable = false;
+	if ( diceCache.isOpen() )
+	{
+		if ( m_fHasDiceKeySeed )
+		{
+			diceKey = m_diceKeySeed;
+			cacheable = true;
+		}
+		else
+			cacheable = AddToDiceKey( diceKey );
+	}
+	if ( cacheable )
+	{
+		const char* typeName = typeid( *this ).name();
+		diceKey.add( typeName, std::strlen( typeName ) );
+		diceKey.add( m_uDiceSize );
+		diceKey.add( m_vDiceSize );
+		diceKey.add( lUses );
+	}
+	CqMatrix matWtoC, matNWtoC, matVWtoC;
+	CqMatrix matCtoW, matNCtoW, matVCtoW;
+	if ( cacheable && m_fHasDiceKeySeed )
+	{
+		// The same transformations as CqRenderer::StorePrimitive() used.
+		IqTransform* transform = pTransform().get();
+		QGetRenderContext() ->matSpaceToSpace( "world", "camera", NULL, transform, 0, matWtoC );
+		QGetRenderContext() ->matNSpaceToSpace( "world", "camera", NULL, transform, 0, matNWtoC );
+		QGetRenderContext() ->matVSpaceToSpace( "world", "camera", NULL, transform, 0, matVWtoC );
+		QGetRenderContext() ->matSpaceToSpace( "camera", "world", NULL, transform, 0, matCtoW );
+		QGetRenderContext() ->matNSpaceToSpace( "camera", "world", NULL, transform, 0, matNCtoW );
+		QGetRenderContext() ->matVSpaceToSpace( "camera", "world", NULL, transform, 0, matVCtoW );
+	}
+	TqInt lDone = 0;
+	if ( !cacheable || !diceCache.restoreGrid( diceKey, pGrid->pShaderExecEnv().get(), lDone,
+			matWtoC, matNWtoC, matVWtoC ) )
+	{
+		lDone = DiceVariables( pGrid, lUses );
+		if ( cacheable )
+			diceCache.storeGrid( diceKey, pGrid->pShaderExecEnv().get(), lDone,
+					matCtoW, matNCtoW, matVCtoW );
+	}
+
 	// Special case handlers for primitive variables that have defaults.
 	if ( !isDONE( lDone, EnvVars_Cs ) && USES( lUses, EnvVars_Cs ) && ( NULL != pGrid->pVar(EnvVars_Cs) ) )
 	{
-		if ( NULL != pAttributes() ->GetColorAttribute( "System", "Color" ) )
-			pGrid->pVar(EnvVars_Cs) ->SetColor( pAttributes() ->GetColorAttribute( "System", "Color" ) [ 0 ] );
+		if ( NULL != pAttributes() ->GetColorAttribute( systemColorKey ) )
+			pGrid->pVar(EnvVars_Cs) ->SetColor( pAttributes() ->GetColorAttribute( systemColorKey ) [ 0 ] );
 		else
 			pGrid->pVar(EnvVars_Cs) ->SetColor( CqColor( 1, 1, 1 ) );
 	}
 
 	if ( !isDONE( lDone, EnvVars_Os ) && USES( lUses, EnvVars_Os ) && ( NULL != pGrid->pVar(EnvVars_Os) ) )
 	{
-		if ( NULL != pAttributes() ->GetColorAttribute( "System", "Opacity" ) )
-			pGrid->pVar(EnvVars_Os) ->SetColor( pAttributes() ->GetColorAttribute( "System", "Opacity" ) [ 0 ] );
+		if ( NULL != pAttributes() ->GetColorAttribute( systemOpacityKey ) )
+			pGrid->pVar(EnvVars_Os) ->SetColor( pAttributes() ->GetColorAttribute( systemOpacityKey ) [ 0 ] );
 		else
 			pGrid->pVar(EnvVars_Os) ->SetColor( CqColor( 1, 1, 1 ) );
 	}
@@ -690,7 +812,7 @@ static void transformCuboid(CqVector3D out[8], const CqVector3D in[8],
 TqFloat CqSurface::AdjustedShadingRate() const
 {
 	TqFloat shadingRate =
-		m_pAttributes->GetFloatAttribute("System", "ShadingRate")[0];
+		m_pAttributes->GetFloatAttribute( systemShadingRateKey )[0];
 	CqRenderer* context = QGetRenderContext();
 	if(context->UsingDepthOfField())
 	{
@@ -702,7 +824,7 @@ TqFloat CqSurface::AdjustedShadingRate() const
 		// If this isn't included then render time increases roughly
 		// quadratically with number of pixels which makes things very slow.
 		const TqFloat focusFactor =
-			m_pAttributes->GetFloatAttribute("System", "GeometricFocusFactor")[0];
+			m_pAttributes->GetFloatAttribute( systemGeometricFocusFactorKey )[0];
 		const TqFloat minCoC = context->MinCoCForBound(m_Bound);
 
 		// We need a factor which decides the desired ratio of the area of the
@@ -729,14 +851,14 @@ TqFloat CqSurface::AdjustedShadingRate() const
 	// Adjust shadingRate based on motionfactor
 
 	//get motionfactor variable from rib, camera transform
-	const TqFloat* motionFactor = m_pAttributes->GetFloatAttribute("System", "GeometricMotionFactor");
+	const TqFloat* motionFactor = m_pAttributes->GetFloatAttribute( systemGeometricMotionFactorKey );
 	TqFloat motionFac = motionFactor[0];
 	CqTransformPtr cameraTransform = context->GetCameraTransform();
 
 	if (motionFac > 0.0 && (isMoving() || cameraTransform->isMoving() ) )
 	{
 		// get the exposure-time (Time of shutter close - Time of shutter open)
-		const TqFloat* shutterTimes = context->GetFloatOption( "System", "Shutter" );
+		const TqFloat* shutterTimes = context->GetFloatOption( systemShutterKey );
 		assert(shutterTimes);
 		TqFloat exposureTime = shutterTimes[1] - shutterTimes[0];
 
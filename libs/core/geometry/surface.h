@@ -101,6 +101,18 @@ class CqSurface : public IqSurface, private boost::noncopyable, public boost::en
 		virtual void	RenderComplete()
 		{}
 
+		/** Start any slow work needed by a later Split() in the background.
+		 *
+		 * Called when the surface is posted to a bucket.  Surfaces which need
+		 * to read files or run other programs to split themselves can make an
+		 * early start on it here.
+		 *
+		 * \param priority - index of the bucket the surface was posted to in
+		 *                   the bucket order; lower values are needed sooner.
+		 */
+		virtual void	PrefetchSplit( TqInt priority )
+		{}
+
 		/** Get the value of the dice size in u, determined during a Diceable() call
 		 */
 		TqInt uDiceSize() const
@@ -547,8 +559,37 @@ class CqSurface : public IqSurface, private boost::noncopyable, public boost::en
 		{}
 
 		virtual	CqMicroPolyGridBase* Dice();
+		TqInt	DiceVariables( CqMicroPolyGrid* pGrid, TqInt lUses );
 		virtual	TqInt	Split( std::vector<boost::shared_ptr<CqSurface> >& aSplits );
 
+		/** \brief Add everything which affects the diced grid to a dice cache key.
+		 *
+		 * Grids are only taken from the dice cache for surfaces which override
+		 * this to add their primitive variables and any other state used when
+		 * dicing.  The dice sizes and the variables needed by the shaders are
+		 * added by Dice().
+		 *
+		 * \return false if the grids of this surface can't be cached.
+		 */
+		virtual bool	AddToDiceKey( CqDiceKey& key ) const
+		{
+			return ( false );
+		}
+		/** \brief Start the dice cache key of the surface from its world space data.
+		 *
+		 * Called before the surface is transformed into camera space, so that
+		 * keys made from the seed don't depend on the camera.
+		 */
+		void	SeedDiceKey();
+		/** \brief Derive the dice cache key seed of a split from its parent.
+		 *
+		 * Cacheable surfaces split according to their split direction alone,
+		 * so a split is identified by the parent seed, the way the parent
+		 * was split and the index of the split.  Splits of surfaces without
+		 * a seed don't get one.
+		 */
+		void	InheritDiceKeySeed( const CqSurface& parent, TqInt index );
+
 		virtual bool isMoving() const
 		{
 			return m_pTransform->isMoving();
@@ -596,6 +637,10 @@ class CqSurface : public IqSurface, private boost::noncopyable, public boost::en
 		 *  on the derived classes.
 		 */
 		void CloneData(CqSurface* clone) const;
+		/** Add all the primitive variables to a dice cache key, for use by
+		 *  implementations of AddToDiceKey().
+		 */
+		void AddPrimitiveVariablesToDiceKey( CqDiceKey& key ) const;
 		std::vector<CqParameter*>	m_aUserParams;			///< Storage for user defined paramter variables.
 		TqInt	m_aiStdPrimitiveVars[ EnvVars_Last ];		///< Quick lookup index into the primitive variables table for standard variables.
 
@@ -608,6 +653,8 @@ class CqSurface : public IqSurface, private boost::noncopyable, public boost::en
 		bool	m_CachedBound;		///< Whether or not the bound has been cached
 		CqBound	m_Bound;			///< The cached object bound
 		boost::shared_ptr<CqCSGTreeNode>	m_pCSGNode;		///< Pointer to the 'primitive' CSG node this surface belongs to, NULL if not part of a solid.
+		bool	m_fHasDiceKeySeed;	///< Whether m_diceKeySeed identifies the world space surface.
+		CqDiceKey	m_diceKeySeed;	///< Camera independent start of the dice cache key.
 }
 ;
 
@@ -30,6 +30,8 @@
 #endif
 #include	<math.h>
 
+#include	<boost/bind.hpp>
+
 #include	<aqsis/math/math.h>
 #include	"stats.h"
 #include	"options.h"
@@ -44,117 +46,38 @@
 
 namespace Aqsis {
 
-static TqInt bucketmodulo = -1;
-//static TqInt bucketdirection = -1;
+namespace {
 
-#define MULTIPROCESSING_NBUCKETS 1
-/** Implementing a work unit for a boost::thread (the operator()()
- * method), that is, a piece of code that will run in parallel.
- */
-class CqThreadProcessor
-{
-public:
-	CqThreadProcessor(CqBucketProcessor* bucketProcessor) :
-		m_bucketProcessor(bucketProcessor) { }
-	void operator()()
-	{
-		// printf("%p > start\n", m_bucketProcessor);
-		m_bucketProcessor->process();
-		// printf("%p < stop\n", m_bucketProcessor);
-	}
-
-private:
-	CqBucketProcessor* m_bucketProcessor;
-};
+// Attributes looked up for every surface, interned once.
+const CqParameterKey displacementboundCoordinatesystemKey( "displacementbound", "coordinatesystem" );
+const CqParameterKey displacementboundSphereKey( "displacementbound", "sphere" );
 
+} // unnamed namespace
 
-/* mafm: implementation of a processor (work unit for a boost::thread)
- * where it takes buckets ready to process and does so continuously.
- * One simple addition would be to wait for new available buckets
- * which are provided dynamically.  This is not applicable at the
- * moment though, it would need RenderSurfaces() to process all of the
- * surfaces of the buckets before assigning them as ready; but at the
- * moment RenderSurfaces() can't run before assigning the bucket to
- * the bucket processor, and it doesn't seem possible to break this
- * interdependency.
-
-boost::mutex displayMutex;
+static TqInt bucketmodulo = -1;
+//static TqInt bucketdirection = -1;
 
-class CqThreadProcessor2
+/** \brief Per-thread state for rendering buckets.
+ *
+ * The bucket processor holds the sample storage for a bucket, and the
+ * samplers keep scratch arrays for the sample positions they hand out, so
+ * every thread rendering buckets needs its own set.
+ */
+struct SqBucketWorker
 {
-public:
-	CqThreadProcessor2(const CqImageBuffer* imageBuffer,
-			   std::vector<CqBucket*>& bucketList,
-			   bool fImager,
-			   const CqColor& zThreshold,
-			   EqDepthFilter depthfilter,
-			   const CqVector2D& bHalf) :
-		m_imageBuffer(imageBuffer),
-		m_bucketList(bucketList),
-		m_fImager(fImager),
-		m_zThreshold(zThreshold),
-		m_depthfilter(depthfilter),
-		m_bHalf(bHalf) { }
-
-	void operator()()
-	{
-		while ( !m_bucketList.empty() )
-		{
-			CqBucket* bucket = m_bucketList.front();
-			m_bucketList.erase( m_bucketList.begin() );
-
-			m_bucketProcessor.setBucket( bucket );
-			if ( m_fImager )
-				m_bucketProcessor.setInitiallyEmpty(false);
-			
-			// Set up some bounds for the bucket.
-			const CqVector2D bPos = m_imageBuffer->BucketPosition( bucket->getCol(),
-									       bucket->getRow() );
-			const CqVector2D bSize = m_imageBuffer->BucketSize( bucket->getCol(),
-									    bucket->getRow() );
-			const CqVector2D vecMin = bPos - m_bHalf;
-			const CqVector2D vecMax = bPos + bSize + m_bHalf;
-
-			TqInt xmin = static_cast<TqInt>( vecMin.x() );
-			TqInt ymin = static_cast<TqInt>( vecMin.y() );
-			TqInt xmax = static_cast<TqInt>( vecMax.x() );
-			TqInt ymax = static_cast<TqInt>( vecMax.y() );
-			if ( xmin < m_imageBuffer->CropWindowXMin() - m_imageBuffer->FilterXWidth() / 2 )
-				xmin = static_cast<TqInt>(m_imageBuffer->CropWindowXMin() - m_imageBuffer->FilterXWidth() / 2.0f);
-			if ( ymin < m_imageBuffer->CropWindowYMin() - m_imageBuffer->FilterYWidth() / 2 )
-				ymin = static_cast<TqInt>(m_imageBuffer->CropWindowYMin() - m_imageBuffer->FilterYWidth() / 2.0f);
-			if ( xmax > m_imageBuffer->CropWindowXMax() + m_imageBuffer->FilterXWidth() / 2 )
-				xmax = static_cast<TqInt>(m_imageBuffer->CropWindowXMax() + m_imageBuffer->FilterXWidth() / 2.0f);
-			if ( ymax > m_imageBuffer->CropWindowYMax() + m_imageBuffer->FilterYWidth() / 2 )
-				ymax = static_cast<TqInt>(m_imageBuffer->CropWindowYMax() + m_imageBuffer->FilterYWidth() / 2.0f);
-
-			m_bucketProcessor.preProcess( bPos, bSize,
-						      m_imageBuffer->PixelXSamples(), m_imageBuffer->PixelYSamples(), m_imageBuffer->FilterXWidth(), m_imageBuffer->FilterYWidth(),
-						      xmin, xmax, ymin, ymax,
-						      m_imageBuffer->ClippingNear(), m_imageBuffer->ClippingFar() );
-			m_bucketProcessor.process();
-			m_bucketProcessor.postProcess( m_fImager, m_depthfilter, m_zThreshold );
-			{
-				TIME_SCOPE("Display bucket");
-				boost::mutex::scoped_lock lock(displayMutex);
-				QGetRenderContext() ->pDDmanager() ->DisplayBucket( bucket );
-			}
-			m_bucketProcessor.reset();
-		}
-	}
-
-private:
-	CqBucketProcessor m_bucketProcessor;
-	const CqImageBuffer* m_imageBuffer;
-	std::vector<CqBucket*> m_bucketList;
-	bool m_fImager;
-	CqColor m_zThreshold;
-	EqDepthFilter m_depthfilter;
-	CqVector2D m_bHalf;
+	CqBucketProcessor processor;
+	CqMultiJitteredSampler jitteredSampler;
+	CqGridSampler gridSampler;
+	IqSampler* sampler;
+
+	SqBucketWorker(CqImageBuffer& imageBuf, const SqOptionCache& optCache, bool jitter)
+		: processor(imageBuf, optCache),
+		jitteredSampler(optCache.xSamps, optCache.ySamps),
+		gridSampler(optCache.xSamps, optCache.ySamps),
+		sampler(jitter ? static_cast<IqSampler*>(&jitteredSampler) : &gridSampler)
+	{ }
 };
 
-*/
-
 
 //----------------------------------------------------------------------
 /** Destructor
@@ -225,6 +148,8 @@ void	CqImageBuffer::SetImage()
 
 	m_CurrentBucketCol = m_bucketRegion.xMin();
 	m_CurrentBucketRow = m_bucketRegion.yMin();
+
+	m_bucketsDone = 0;
 }
 
 
@@ -363,8 +288,8 @@ void CqImageBuffer::PostSurface( const boost::shared_ptr<CqSurface>& pSurface )
 	// Take into account the displacement bound extension.
 	TqFloat db = 0.0f;
 	CqString strCoordinateSystem( "object" );
-	const TqFloat* pattrDispclacementBound = pSurface->pAttributes() ->GetFloatAttribute( "displacementbound", "sphere" );
-	const CqString* pattrCoordinateSystem = pSurface->pAttributes() ->GetStringAttribute( "displacementbound", "coordinatesystem" );
+	const TqFloat* pattrDispclacementBound = pSurface->pAttributes() ->GetFloatAttribute( displacementboundSphereKey );
+	const CqString* pattrCoordinateSystem = pSurface->pAttributes() ->GetStringAttribute( displacementboundCoordinatesystemKey );
 	if ( pattrDispclacementBound != 0 )
 		db = pattrDispclacementBound[ 0 ];
 	if ( pattrCoordinateSystem != 0 )
@@ -415,34 +340,32 @@ void CqImageBuffer::PostSurface( const boost::shared_ptr<CqSurface>& pSurface )
 	XMaxb = clamp( XMaxb, m_bucketRegion.xMin(), m_bucketRegion.xMax()-1 );
 	YMaxb = clamp( YMaxb, m_bucketRegion.yMin(), m_bucketRegion.yMax()-1 );
 
-	// Sanity check we are not putting into a bucket that has already been processed.
-	CqBucket* bucket = &Bucket( XMinb, YMinb );
-	if ( bucket->IsProcessed() )
+	// Put the surface into the first bucket that the bound touches and which
+	// hasn't been processed yet.
+	for ( TqInt yb = YMinb; yb <= YMaxb; ++yb )
 	{
-		// Scan over the buckets that the bound touches, looking for the first one that isn't processed.
-		TqInt yb = YMinb;
-		TqInt xb = XMinb + 1;
-		bool done = false;
-		while(!done && yb <= YMaxb)
+		for ( TqInt xb = XMinb; xb <= XMaxb; ++xb )
 		{
-			while(!done && xb <= XMaxb)
+			CqBucket& availBucket = Bucket( xb, yb );
 			{
-				CqBucket& availBucket = Bucket(xb, yb);
-				if(!availBucket.IsProcessed())
-				{
-					availBucket.AddGPrim(pSurface);
-					done = true;
-				}
-				++xb;
+				TqMutexLock lock( bucketMutex( availBucket ) );
+				if ( availBucket.IsProcessed() )
+					continue;
 			}
-			xb = XMinb;
-			++yb;
+			// Start the prefetch before another thread can pick the
+			// surface up to split it, but without holding the bucket lock,
+			// since queueing the prefetch takes the prefetcher's own lock.
+			pSurface->PrefetchSplit( BucketIndex( xb, yb ) );
+			{
+				TqMutexLock lock( bucketMutex( availBucket ) );
+				// The bucket may have been finished in the meantime.
+				if ( availBucket.IsProcessed() )
+					continue;
+				availBucket.AddGPrim( pSurface );
+			}
+			return;
 		}
 	}
-	else
-	{
-		bucket->AddGPrim( pSurface );
-	}
 }
 
 
@@ -461,7 +384,11 @@ void CqImageBuffer::RepostSurface(const CqBucket& oldBucket,
 	TqInt xpos = oldBucket.getXPosition() + oldBucket.getXSize();
 	if ( nextBucketX < m_bucketRegion.xMax() && rasterBound.vecMax().x() >= xpos )
 	{
-		Bucket( nextBucketX, nextBucketY ).AddGPrim( surface );
+		CqBucket& nextBucket = Bucket( nextBucketX, nextBucketY );
+		{
+			TqMutexLock lock( bucketMutex( nextBucket ) );
+			nextBucket.AddGPrim( surface );
+		}
 		wasPosted = true;
 	}
 	else
@@ -477,7 +404,11 @@ void CqImageBuffer::RepostSurface(const CqBucket& oldBucket,
 			( nextBucketY  < m_bucketRegion.yMax() ) &&
 			( rasterBound.vecMax().y() >= ypos ) )
 		{
-			Bucket( nextBucketX, nextBucketY ).AddGPrim( surface );
+			CqBucket& nextBucket = Bucket( nextBucketX, nextBucketY );
+			{
+				TqMutexLock lock( bucketMutex( nextBucket ) );
+				nextBucket.AddGPrim( surface );
+			}
 			wasPosted = true;
 		}
 	}
@@ -577,6 +508,7 @@ void CqImageBuffer::AddMPG( boost::shared_ptr<CqMicroPolygon>& pmpgNew )
 		for ( TqInt j = iYBa; j <= iYBb; j++ )
 		{
 			CqBucket* bucket = &Bucket( i, j );
+			TqMutexLock lock( bucketMutex( *bucket ) );
 			// Only add the MPG if the bucket isn't processed.
 			// \note It is possible for this to happen validly, if a primitive is occlusion culled in a 
 			// previous bucket, and not in a subsequent one. When it gets processed in the later bucket
@@ -656,118 +588,90 @@ void CqImageBuffer::RenderImage()
 #endif
 	}
 
-	// A counter for the number of processed buckets (used for progress reporting)
-	TqInt iBucket = 0;
-
-	std::vector<boost::shared_ptr<CqBucketProcessor> > bucketProcessors;
-	TqInt numConcurrentBuckets = 1;
-
-/* mafm: Sample code to use with the CqThreadProcessor2 alternative
- * approach.
-
-	std::vector<std::vector<CqBucket*> > bucketLists;
-	bucketLists.resize(MULTIPROCESSING_NBUCKETS);
-	int index = 0;
-	do
-	{
-		bucketLists[index % MULTIPROCESSING_NBUCKETS].push_back( &(CurrentBucket()) );
-		++index;
-	} while ( NextBucket(order) );
-	boost::thread_group threadGroup;
-	for (int i = 0; i < MULTIPROCESSING_NBUCKETS; ++i)
+	// Determine whether the user has asked for sample jittering
+	bool jitter = true;
+	if(const TqInt* jitterOpt = QGetRenderContext()->poptCurrent()->
+			GetIntegerOption("Hider", "jitter"))
 	{
-		threadGroup.create_thread( CqThreadProcessor2(this, bucketLists[i], fImager, zThreshold, depthfilter, bHalf) );
+		jitter = jitterOpt[0] != 0;
 	}
-	threadGroup.join_all();
-	return;
-*/
 
-#ifdef		ENABLE_THREADING
-	numConcurrentBuckets = MULTIPROCESSING_NBUCKETS;
-#endif
-
-	for(int i = 0; i < numConcurrentBuckets; ++i)
-	{
-		bucketProcessors.push_back(boost::shared_ptr<CqBucketProcessor>(
-					new CqBucketProcessor(*this, m_optCache)));
-	}
-	CqMultiJitteredSampler jitteredSampler(m_optCache.xSamps, m_optCache.ySamps);
-	CqGridSampler gridSampler(m_optCache.xSamps, m_optCache.ySamps);
+	// Buckets are rendered one at a time: surface shading, the statistics
+	// counters and procedural expansion aren't safe to run from several
+	// threads at once.
+	m_bucketsDone = 0;
+	SqBucketWorker worker(*this, m_optCache, jitter);
+	RenderBucketsSerial(worker, order);
 
-	// Determine whether the user has asked for sample jittering
-	IqSampler* sampler = &jitteredSampler;
-	if(const TqInt* jitter = QGetRenderContext()->poptCurrent()->
-			GetIntegerOption("Hider", "jitter"))
+	// Pass >100 through to progress to allow it to indicate completion.
+	if ( pProgressHandler )
 	{
-		if(jitter[0] == 0)
-			sampler = &gridSampler;
+		( *pProgressHandler ) ( 100.0f, QGetRenderContext() ->CurrentFrame() );
 	}
+}
 
-	// Iterate over all buckets...
-	bool pendingBuckets = true;
-	while ( pendingBuckets && !m_fQuit )
-	{
-		CqThreadScheduler threadScheduler(numConcurrentBuckets);
-		std::vector<CqThreadProcessor> threadProcessors;
 
-		for (int i = 0; pendingBuckets && i < numConcurrentBuckets; ++i)
-		{
-			bucketProcessors[i]->setBucket(&CurrentBucket());
+//----------------------------------------------------------------------
+/** Render a single bucket and send it to the display as soon as it's done.
+ *
+ * \param worker - per-thread processor and samplers to use.
+ * \param bucket - bucket to render.
+ */
+void CqImageBuffer::RenderBucket( SqBucketWorker& worker, CqBucket& bucket )
+{
+	AQSIS_TRACE_SCOPE_XY("Bucket", bucket.getCol(), bucket.getRow());
+	CqBucketProcessor& bucketProcessor = worker.processor;
+	bucketProcessor.setBucket(&bucket);
 
-			// Prepare the bucket processor
-			bucketProcessors[i]->preProcess(sampler);
+	// Prepare the bucket processor
+	bucketProcessor.preProcess(worker.sampler);
 
 #if ENABLE_MPDUMP
-			// Dump the pixel sample positions into a dump file
-			if(m_mpdump.IsOpen())
-				m_mpdump.dumpPixelSamples(*bucketProcessors[i]);
+	// Dump the pixel sample positions into a dump file
+	if(m_mpdump.IsOpen())
+		m_mpdump.dumpPixelSamples(bucketProcessor);
 #endif
 
-			// Kick off a thread to process this bucket.
-			threadProcessors.push_back( CqThreadProcessor( bucketProcessors[i].get() ) );
-			threadScheduler.addWorkUnit( threadProcessors.back() );
-
-			// Advance to next bucket, quit if nothing left
-			iBucket += 1;
-			pendingBuckets = NextBucket(order);
-		}
-
-		// Wait for all current buckets to complete before allocating more to the available threads.
-		threadScheduler.joinAll();
-		threadProcessors.clear();
+	bucketProcessor.process();
+	if(m_fQuit)
+	{
+		bucketProcessor.reset();
+		return;
+	}
 
-		for (int i = 0; !m_fQuit && i < numConcurrentBuckets; ++i)
-		{
-			bucketProcessors[i]->postProcess();
-			{
-				AQSIS_TIME_SCOPE(Display_bucket);
-				const CqBucket* bucket = bucketProcessors[i]->getBucket();
-				if (bucket)
-				{
-					QGetRenderContext() ->pDDmanager() ->DisplayBucket( bucketProcessors[i]->DisplayRegion(), &(bucketProcessors[i]->getChannelBuffer()) );
-				}
-			}
-			bucketProcessors[i]->reset();
+	bucketProcessor.postProcess();
+	{
+		AQSIS_TIME_SCOPE(Display_bucket);
+		QGetRenderContext() ->pDDmanager() ->DisplayBucket( bucketProcessor.DisplayRegion(), &(bucketProcessor.getChannelBuffer()) );
+	}
 
-			if ( pProgressHandler )
-			{
-				// Inform the status class how far we have got, and update UI.
-				float Complete = (100.0f * iBucket) / static_cast<float> ( m_bucketRegion.area() );
-				QGetRenderContext() ->Stats().SetComplete( Complete );
-				( *pProgressHandler ) ( Complete, QGetRenderContext() ->CurrentFrame() );
-			}
+	TqInt iBucket = ++m_bucketsDone;
+	if ( RtProgressFunc pProgressHandler = QGetRenderContext()->pProgressHandler() )
+	{
+		// Inform the status class how far we have got, and update UI.
+		float Complete = (100.0f * iBucket) / static_cast<float> ( m_bucketRegion.area() );
+		QGetRenderContext() ->Stats().SetComplete( Complete );
+		( *pProgressHandler ) ( Complete, QGetRenderContext() ->CurrentFrame() );
+	}
 
 #ifdef WIN32
-			if ( !( iBucket % bucketmodulo ) )
-				SetProcessWorkingSetSize( GetCurrentProcess(), 0xffffffff, 0xffffffff );
+	if ( !( iBucket % bucketmodulo ) )
+		SetProcessWorkingSetSize( GetCurrentProcess(), 0xffffffff, 0xffffffff );
 #endif
-		}
-	}
+	bucketProcessor.reset();
+}
 
-	// Pass >100 through to progress to allow it to indicate completion.
-	if ( pProgressHandler )
+
+//----------------------------------------------------------------------
+/** Render all the buckets one after another in the given order.
+ */
+void CqImageBuffer::RenderBucketsSerial( SqBucketWorker& worker, EqBucketOrder order )
+{
+	bool pendingBuckets = true;
+	while ( pendingBuckets && !m_fQuit )
 	{
-		( *pProgressHandler ) ( 100.0f, QGetRenderContext() ->CurrentFrame() );
+		RenderBucket( worker, CurrentBucket() );
+		pendingBuckets = NextBucket(order);
 	}
 }
 
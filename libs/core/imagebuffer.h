@@ -32,16 +32,20 @@
 
 #include	<vector>
 
+#include	<boost/array.hpp>
+
 #include	"surface.h"
 #include	<aqsis/math/vector2d.h>
 #include   	"bucket.h"
 #include	"mpdump.h"
 #include	"optioncache.h"
+#include	"threadscheduler.h"
 
 namespace Aqsis {
 
 
 class CqMicroPolygon;
+struct SqBucketWorker;
 
 
 // Enumeration of the type of rendering order of the buckets (experimental)
@@ -71,7 +75,7 @@ enum EqBucketOrder {
   the first bucket that touches its bound.
  
   Once all the gprims are posted to the buffer the image can be rendered by calling
-  RenderImage(). Now all buckets will be processed one after another. 
+  RenderImage(). Now all buckets will be processed one after another.
  
   \see CqBucket, CqSurface, CqRenderer
  */
@@ -84,7 +88,8 @@ class CqImageBuffer
 				m_cXBuckets( 0 ),
 				m_cYBuckets( 0 ),
 				m_CurrentBucketCol( 0 ),
-				m_CurrentBucketRow( 0 )
+				m_CurrentBucketRow( 0 ),
+				m_bucketsDone( 0 )
 		{}
 		~CqImageBuffer();
 
@@ -122,7 +127,25 @@ class CqImageBuffer
 		 */
 		void	axialNeighbours(CqBucket const& bucket, std::vector<CqBucket*>& neighbours);
 
+		/** \brief Get the mutex guarding the surface and micropolygon queues
+		 * and the cache segments of a bucket.
+		 *
+		 * The mutexes are shared between several buckets, so at most one of
+		 * them should be held at any time.
+		 */
+		TqMutex& bucketMutex(const CqBucket& bucket);
+
 	private:
+		/// Render, filter and display a single bucket.
+		void	RenderBucket( SqBucketWorker& worker, CqBucket& bucket );
+		/// Render all buckets in order on the calling thread.
+		void	RenderBucketsSerial( SqBucketWorker& worker, EqBucketOrder order );
+		/// Linear index of a bucket in the bucket order.
+		TqInt	BucketIndex( TqInt col, TqInt row ) const
+		{
+			return row*m_cXBuckets + col;
+		}
+
 		/// Get a pointer to the bucket at position x,y in the grid.
 		CqBucket& Bucket( TqInt x, TqInt y)
 		{
@@ -144,6 +167,9 @@ class CqImageBuffer
 		TqInt	m_CurrentBucketCol;	///< Column index of the bucket currently being processed.
 		TqInt	m_CurrentBucketRow;	///< Row index of the bucket currently being processed.
 
+		TqInt	m_bucketsDone;		///< Number of buckets finished so far (for progress reporting).
+		boost::array<TqMutex, 64> m_bucketMutexes;	///< Striped locks for bucket queues, see bucketMutex().
+
 #if ENABLE_MPDUMP
 		CqMPDump	m_mpdump;
 #endif
@@ -189,6 +215,14 @@ inline void CqImageBuffer::axialNeighbours(CqBucket const& bucket, std::vector<C
 
 //-----------------------------------------------------------------------
 
+inline TqMutex& CqImageBuffer::bucketMutex(const CqBucket& bucket)
+{
+	return m_bucketMutexes[BucketIndex(bucket.getCol(), bucket.getRow())
+		% m_bucketMutexes.size()];
+}
+
+//-----------------------------------------------------------------------
+
 } // namespace Aqsis
 
 //}  // End of #ifdef IMAGEBUFFER_H_INCLUDED
@@ -40,6 +40,59 @@ namespace Aqsis {
 
 TqInt SqImageSample::sampleSize(9);
 
+//----------------------------------------------------------------------
+// CqSampleStore
+
+CqSampleStore::CqSampleStore(std::size_t chunkSize)
+	: m_chunkSize(chunkSize),
+	m_first(0),
+	m_current(0),
+	m_pos(0),
+	m_end(0),
+	m_capacity(0),
+	m_csgNodes(),
+	m_noCsgNode(),
+	m_combineScratch()
+{ }
+
+CqSampleStore::~CqSampleStore()
+{
+	SqChunk* chunk = m_first;
+	while(chunk)
+	{
+		SqChunk* next = chunk->next;
+		delete[] reinterpret_cast<char*>(chunk);
+		chunk = next;
+	}
+}
+
+void CqSampleStore::nextChunk(std::size_t bytes)
+{
+	// Reuse the chunk following the current one if it's big enough.  This is
+	// the usual case once the chunks have grown during the first buckets.
+	SqChunk* next = m_current ? m_current->next : m_first;
+	if(!next || next->size < bytes)
+	{
+		// Otherwise link a new chunk in after the current one.  Any smaller
+		// chunk is kept further down the list for later use.
+		std::size_t size = max(bytes, m_chunkSize);
+		SqChunk* chunk = reinterpret_cast<SqChunk*>(
+				new char[sizeof(SqChunk) + size]);
+		chunk->next = next;
+		chunk->size = size;
+		if(m_current)
+			m_current->next = chunk;
+		else
+			m_first = chunk;
+		m_capacity += size;
+		next = chunk;
+	}
+	m_current = next;
+	m_pos = chunkData(next);
+	m_end = m_pos + next->size;
+}
+
+
 //----------------------------------------------------------------------
 /** Constructor
  */
@@ -48,31 +101,19 @@ CqImagePixel::CqImagePixel(TqInt xSamples, TqInt ySamples)
 		: m_XSamples(xSamples),
 		m_YSamples(ySamples),
 		m_samples(new SqSampleData[xSamples*ySamples]),
-		m_hitSamples(),
+		m_occludingData(new TqFloat[xSamples*ySamples*SqImageSample::sampleSize]),
 		m_DofOffsetIndices(new TqInt[xSamples*ySamples]),
-		m_refCount(0),
 		m_hasValidSamples(false)
 {
 	assert(xSamples > 0);
 	assert(ySamples > 0);
 
 	TqInt nSamples = numSamples();
-	// Allocate sample storage for all the occluding hits.
+	// Assign the storage for all the occluding hits.
 	TqInt sampSize = SqImageSample::sampleSize;
-	m_hitSamples.resize(nSamples*sampSize);
+	std::fill(&m_occludingData[0], &m_occludingData[0] + nSamples*sampSize, 0.0f);
 	for(TqInt i = 0; i < nSamples; ++i)
-		m_samples[i].occludingHit.index = i*sampSize;
-}
-
-void CqImagePixel::swap(CqImagePixel& other)
-{
-	assert(m_XSamples == other.m_XSamples);
-	assert(m_YSamples == other.m_YSamples);
-
-	m_hitSamples.swap(other.m_hitSamples);
-	m_samples.swap(other.m_samples);
-	m_DofOffsetIndices.swap(other.m_DofOffsetIndices);
-	m_hasValidSamples = other.m_hasValidSamples;
+		m_samples[i].occludingHit.data = &m_occludingData[i*sampSize];
 }
 
 void CqImagePixel::setupGridPattern(CqVector2D& offset, TqFloat opentime,
@@ -105,17 +146,13 @@ void CqImagePixel::setupGridPattern(CqVector2D& offset, TqFloat opentime,
 void CqImagePixel::clear()
 {
 	TqInt nSamples = numSamples();
-	TqInt sampSize = SqImageSample::sampleSize;
-	m_hitSamples.resize(nSamples*sampSize);
 	m_hasValidSamples = false;
 	for(TqInt i = 0; i < nSamples; ++i)
 	{
-		if(!m_samples[i].data.empty())
-			m_samples[i].data.clear();
+		// The hits themselves are released along with the sample store.
+		m_samples[i].deepHits = 0;
 		m_samples[i].occludingHit.flags = 0;
-		// Reallocate the occluding samples, as their storage indices may have
-		// changed during the Combine() stage.
-		m_samples[i].occludingHit.index = i*sampSize;
+		m_samples[i].occludingHit.csgNode.reset();
 		// Reset the occluding depth to the maximum.
 		m_samples[i].occlZ = FLT_MAX;
 	}
@@ -141,11 +178,14 @@ class CqAscendingDepthSort
 		}
 };
 
-void CqImagePixel::Combine( enum EqDepthFilter depthfilter, CqColor zThreshold )
+void CqImagePixel::Combine( enum EqDepthFilter depthfilter, CqColor zThreshold,
+		CqSampleStore& store )
 {
 	TqUint samplecount = 0;
 	TqInt sampleIndex = 0;
 	TqInt nSamples = numSamples();
+	TqInt sampSize = SqImageSample::sampleSize;
+	std::vector<SqImageSample>& hits = store.combineScratch();
 	for(TqInt sampIdx = 0; sampIdx < nSamples; ++sampIdx)
 	{
 		SqSampleData& sampleData = m_samples[sampIdx];
@@ -153,15 +193,28 @@ void CqImagePixel::Combine( enum EqDepthFilter depthfilter, CqColor zThreshold )
 		SqImageSample& occlHit = sampleData.occludingHit;
 		sampleIndex++;
 
-		if(!sampleData.data.empty())
+		if(sampleData.deepHits)
 		{
+			// Gather the hits from the store into the scratch list so they
+			// can be sorted and passed through the CSG trees.
+			hits.clear();
+			for(SqDeepHit* deep = sampleData.deepHits; deep; deep = deep->next)
+			{
+				hits.push_back(SqImageSample());
+				SqImageSample& hit = hits.back();
+				hit.data = deep->data();
+				hit.flags = deep->flags;
+				if(deep->csgIndex >= 0)
+					hit.csgNode = store.csgNode(*deep);
+			}
+			sampleData.deepHits = 0;
 			if (occlHit.flags & SqImageSample::Flag_Valid)
 			{
 				//	insert occlHit into samples if it holds valid data.
-				sampleData.data.push_back(occlHit);
+				hits.push_back(occlHit);
 			}
 			// Sort the samples by depth.
-			std::sort(sampleData.data.begin(), sampleData.data.end(), CqAscendingDepthSort(*this));
+			std::sort(hits.begin(), hits.end(), CqAscendingDepthSort(*this));
 
 			// Find out if any of the samples are in a CSG tree.
 			bool bProcessed;
@@ -173,13 +226,13 @@ void CqImagePixel::Combine( enum EqDepthFilter depthfilter, CqColor zThreshold )
 					bProcessed = false;
 					//Warning ProcessTree add or remove elements in samples list
 					//We could not optimized the for loop here at all.
-					for ( std::vector<SqImageSample>::iterator isample = sampleData.data.begin();
-					        isample != sampleData.data.end();
+					for ( std::vector<SqImageSample>::iterator isample = hits.begin();
+					        isample != hits.end();
 					        ++isample )
 					{
 						if ( isample->csgNode )
 						{
-							isample->csgNode->ProcessTree( sampleData.data );
+							isample->csgNode->ProcessTree( hits );
 							bProcessed = true;
 							break;
 						}
@@ -194,8 +247,8 @@ void CqImagePixel::Combine( enum EqDepthFilter depthfilter, CqColor zThreshold )
 			TqFloat opaqueDepths[2] = { sampleData.occlZ, FLT_MAX };
 			TqFloat maxOpaqueDepth = FLT_MAX;
 
-			for ( std::vector<SqImageSample>::reverse_iterator sample = sampleData.data.rbegin();
-			        sample != sampleData.data.rend();
+			for ( std::vector<SqImageSample>::reverse_iterator sample = hits.rbegin();
+			        sample != hits.rend();
 			        sample++ )
 			{
 				TqFloat* sample_data = sampleHitData(*sample);
@@ -246,28 +299,19 @@ void CqImagePixel::Combine( enum EqDepthFilter depthfilter, CqColor zThreshold )
 			}
 
 			// Write the collapsed color values back into the occluding entry.
-			if ( !sampleData.data.empty() )
+			if ( !hits.empty() )
 			{
-				// Make sure the extra sample data from the top entry is copied
-				// to the occluding sample, which is then sent to the display.
-				occlHit = *sampleData.data.begin();
-				TqFloat* occlData = sampleHitData(occlHit);
-				// Set the color and opacity.
-				occlData[Sample_Red] = samplecolor.r();
-				occlData[Sample_Green] = samplecolor.g();
-				occlData[Sample_Blue] = samplecolor.b();
-				occlData[Sample_ORed] = sampleopacity.r();
-				occlData[Sample_OGreen] = sampleopacity.g();
-				occlData[Sample_OBlue] = sampleopacity.b();
-				occlHit.flags |= SqImageSample::Flag_Valid;
+				SqImageSample& topHit = hits.front();
 
-				TqFloat& occlDepth = occlData[Sample_Depth];
+				// Filter the depth first: the occluding hit is one of the
+				// hits, and its data is overwritten by the copy below.
+				TqFloat occlDepth = sampleHitData(topHit)[Sample_Depth];
 				if ( depthfilter != Filter_Min )
 				{
 					if ( depthfilter == Filter_MidPoint )
 					{
 						// Use midpoint for depth
-						if ( sampleData.data.size() > 1 )
+						if ( hits.size() > 1 )
 							occlDepth = ( ( opaqueDepths[0] + opaqueDepths[1] ) * 0.5f );
 						else
 							occlDepth = FLT_MAX;
@@ -281,7 +325,7 @@ void CqImagePixel::Combine( enum EqDepthFilter depthfilter, CqColor zThreshold )
 						std::vector<SqImageSample>::iterator sample;
 						TqFloat totDepth = 0.0f;
 						TqInt totCount = 0;
-						for ( sample = sampleData.data.begin(); sample != sampleData.data.end(); sample++ )
+						for ( sample = hits.begin(); sample != hits.end(); sample++ )
 						{
 							TqFloat* sample_data = sampleHitData(*sample);
 							if(sample_data[Sample_ORed] >= zThreshold.r() || sample_data[Sample_OGreen] >= zThreshold.g() || sample_data[Sample_OBlue] >= zThreshold.b())
@@ -298,6 +342,25 @@ void CqImagePixel::Combine( enum EqDepthFilter depthfilter, CqColor zThreshold )
 				}
 				else
 					occlDepth = opaqueDepths[0];
+
+				// Make sure the extra sample data from the top entry is copied
+				// to the occluding sample, which is then sent to the display.
+				// The data is copied into the pixel's own storage since the
+				// store is recycled along with the bucket.
+				TqFloat* occlData = &m_occludingData[sampIdx*sampSize];
+				if(topHit.data != occlData)
+					std::copy(topHit.data, topHit.data + sampSize, occlData);
+				topHit.data = occlData;
+				occlHit = topHit;
+				// Set the color and opacity.
+				occlData[Sample_Red] = samplecolor.r();
+				occlData[Sample_Green] = samplecolor.g();
+				occlData[Sample_Blue] = samplecolor.b();
+				occlData[Sample_ORed] = sampleopacity.r();
+				occlData[Sample_OGreen] = sampleopacity.g();
+				occlData[Sample_OBlue] = sampleopacity.b();
+				occlData[Sample_Depth] = occlDepth;
+				occlHit.flags |= SqImageSample::Flag_Valid;
 			}
 		}
 		else
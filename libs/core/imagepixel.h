@@ -30,9 +30,10 @@
 
 #include	<vector>
 #include	<cfloat> // for FLT_MAX
+#include	<cstddef>
 
-#include	<boost/intrusive_ptr.hpp>
 #include	<boost/scoped_array.hpp>
+#include	<boost/shared_ptr.hpp>
 #include	<boost/noncopyable.hpp>
 
 #include	<aqsis/math/color.h>
@@ -63,20 +64,18 @@ enum EqSampleIndices
 
 /** \brief Holder for data from a hit of a micropoly against a sample point.
  *
- * We allocate hit data in a single large block for all the samples inside a
- * pixel.  This explicit pooling of the data improves cache locality
- * dramatically which is particularly necessary when pulling pixels from the
- * bucket overlap cache and for scenes with lots of semitransparent depth
- * complexity.
+ * The hit data for the occluding hits lives in a single block owned by the
+ * CqImagePixel, while the data for semitransparent hits lives in the
+ * CqSampleStore of the bucket being rendered.
  *
- * The float array values stored at index in the associated CqImagePixel follow
- * the EqSampleIndices enum for the standard values, anything above
- * Sample_Alpha is a custom entry AOV usage.  See SqImagePixel::sampleHitData()
+ * The float array values pointed to by data follow the EqSampleIndices enum
+ * for the standard values, anything above Sample_Alpha is a custom entry AOV
+ * usage.  See CqImagePixel::sampleHitData()
  */
 struct SqImageSample
 {
-	/// Index to the data sample hit array managed by the associated CqImagePixel
-	TqInt index;
+	/// Hit data for the sample, SqImageSample::sampleSize floats long.
+	TqFloat* data;
 	/// Flags for this sample, using the anonymous enum below.
 	TqUint flags;
 	/// A shared pointer to the CSG node for this sample.
@@ -116,6 +115,27 @@ struct SqImageSample
 };
 
 
+/** \brief A semitransparent sample hit held in a CqSampleStore.
+ *
+ * Hits at the same sample point are chained into a singly linked list.  The
+ * SqImageSample::sampleSize floats of hit data follow the header directly in
+ * the store.
+ */
+struct SqDeepHit
+{
+	/// Next hit at the same sample point, or null.
+	SqDeepHit* next;
+	/// Flags for the hit, as for SqImageSample::flags.
+	TqUint flags;
+	/// Index of the CSG node in the owning store, or -1 if not part of a CSG.
+	TqInt csgIndex;
+
+	/// Get the hit data following the header.
+	TqFloat* data();
+	const TqFloat* data() const;
+};
+
+
 /** Structure to hold the info about a sample point.
  */
 
@@ -126,7 +146,7 @@ struct SqSampleData : private boost::noncopyable
 	TqUint      occlusionIndex;     ///< Index for sample in occlusion tree.
 	TqFloat		time;				///< Float sample time.
 	TqFloat		detailLevel;		///< Float level-of-detail sample.
-	std::vector<SqImageSample> data;	///< Array of surface "hits" for this sample.
+	SqDeepHit*	deepHits;			///< List of semitransparent surface "hits" for this sample.
 	/** \brief Minimum depth hit which occludes any hits further away
 	 *
 	 * During micropolygon sampling, occludingHit is used to store the surface
@@ -151,6 +171,81 @@ struct SqSampleData : private boost::noncopyable
 };
 
 
+//-----------------------------------------------------------------------
+/** \brief Arena holding the semitransparent sample hits for a bucket.
+ *
+ * Hits are bump allocated from a linked list of large chunks, so storing a
+ * hit never touches the general purpose allocator once the chunks have grown
+ * to the depth complexity of the scene.  All hits are released together by
+ * reset() in constant time; the chunks are kept for the next bucket.
+ *
+ * A store is owned by a single bucket processor, so no locking is needed.
+ * The hits must not outlive the bucket: CqImagePixel::Combine() copies the
+ * final result of each sample into storage owned by the pixel.
+ */
+class CqSampleStore : private boost::noncopyable
+{
+	public:
+		/** \brief Construct an empty store.
+		 *
+		 * \param chunkSize - minimum size in bytes of the chunks allocated.
+		 */
+		CqSampleStore(std::size_t chunkSize = 64*1024);
+		~CqSampleStore();
+
+		/** \brief Allocate a new hit with room for the given amount of data.
+		 *
+		 * The hit is not linked into any list and has no flags set.
+		 *
+		 * \param dataSize - number of floats of hit data.
+		 */
+		SqDeepHit* allocateHit(TqInt dataSize);
+
+		/// Attach a CSG node to a hit allocated from this store.
+		void setCsgNode(SqDeepHit& hit, const boost::shared_ptr<CqCSGTreeNode>& node);
+		/// Get the CSG node attached to a hit, or a null pointer.
+		const boost::shared_ptr<CqCSGTreeNode>& csgNode(const SqDeepHit& hit) const;
+
+		/// Release all hits at once, keeping the memory for reuse.
+		void reset();
+
+		/// Total size in bytes of the chunks owned by the store.
+		std::size_t capacity() const;
+
+		/// Scratch space used by CqImagePixel::Combine() to sort the hits.
+		std::vector<SqImageSample>& combineScratch();
+
+	private:
+		/// Header of a chunk of memory; the chunk data follows directly.
+		struct SqChunk
+		{
+			SqChunk* next;
+			std::size_t size;
+		};
+
+		/// Move to a chunk which can hold at least the given number of bytes.
+		void nextChunk(std::size_t bytes);
+		static char* chunkData(SqChunk* chunk);
+
+		/// Minimum chunk size.
+		std::size_t m_chunkSize;
+		/// Head of the list of chunks.
+		SqChunk* m_first;
+		/// Chunk currently being allocated from, or null after reset().
+		SqChunk* m_current;
+		/// Allocation position and end of the current chunk.
+		char* m_pos;
+		char* m_end;
+		/// Total size of the chunks.
+		std::size_t m_capacity;
+		/// CSG nodes referenced by hits, indexed by SqDeepHit::csgIndex.
+		std::vector<boost::shared_ptr<CqCSGTreeNode> > m_csgNodes;
+		/// Returned by csgNode() for hits without a CSG node.
+		boost::shared_ptr<CqCSGTreeNode> m_noCsgNode;
+		std::vector<SqImageSample> m_combineScratch;
+};
+
+
 //-----------------------------------------------------------------------
 /** Storage class for all data relating to a single pixel in the image.
  */
@@ -165,14 +260,6 @@ class CqImagePixel : private boost::noncopyable
 		 */
 		CqImagePixel(TqInt xSamples, TqInt ySamples);
 
-		/** \brief Swap the internal sample data with another pixel.
-		 *
-		 * This function swaps both the sample data and associated DoF indices
-		 * with another pixel by efficiently swapping the internal data
-		 * structures.
-		 */
-		void swap(CqImagePixel& other);
-
 		/** \brief Get the number of horizontal samples in this pixel
 		 * \return The number of samples as an integer.
 		 */
@@ -216,10 +303,12 @@ class CqImagePixel : private boost::noncopyable
 		 */
 		void clear();
 
-		/** \brief Get a reference to the array of values for the specified sample.
-		 * \param index the index of the sample point within the pixel
+		/** \brief Add a semitransparent hit to the specified sample.
+		 *
+		 * \param index - the index of the sample point within the pixel
+		 * \param hit - a hit allocated from the sample store of the bucket.
 		 */
-		std::vector<SqImageSample>& Values( TqInt index );
+		void addDeepHit( TqInt index, SqDeepHit* hit );
 
 		/** \brief Get a reference to the image hit that represents the top
 		 * if the closest sample is occluding.
@@ -231,26 +320,26 @@ class CqImagePixel : private boost::noncopyable
 		//@{
 		/** \brief Return the sample data associated with a micropolygon sample hit.
 		 *
-		 * \param hit - a sample hit which has had data allocated with allocateHitData()
+		 * \param hit - a sample hit with valid data
 		 */
 		const TqFloat* sampleHitData(const SqImageSample& hit) const;
 		TqFloat* sampleHitData(const SqImageSample& hit);
 		//@}
 
-		/// Allocate space for a single block of sample hit data.
-		void allocateHitData(SqImageSample& hit);
-
 		/** \brief Combine the sample values accumulated at each sample.
 		 *  
 		 *  The successful sample hits recorded at each sample point are
 		 *  combined using alpha blending to produce a final visible color
-		 *  at the top of the sample.
+		 *  at the top of the sample.  The result is left in the occluding
+		 *  hit, so the pixel no longer refers to the store afterwards.
 		 *
 		 *  \param eDepthFilter - The filter to use to combine depth values.
 		 *  \param zThreshold - The color value at which to consider a sample opaque
 		 *  					when sampling depth.
+		 *  \param store - The store holding the semitransparent hits.
 		 */
-		void	Combine( EqDepthFilter eDepthFilter, CqColor zThreshold );
+		void	Combine( EqDepthFilter eDepthFilter, CqColor zThreshold,
+						 CqSampleStore& store );
 
 		/** \brief Get the sample data for the specified sample index.
 		 *
@@ -284,9 +373,6 @@ class CqImagePixel : private boost::noncopyable
 		 */
 		static CqVector2D projectToCircle(const CqVector2D& pos);
 
-		/// Return the number of references to the pixel
-		TqInt refCount() const;
-
 		/// Mark this pixel as having valid samples.
 		void markHasValidSamples();
 	
@@ -303,40 +389,37 @@ class CqImagePixel : private boost::noncopyable
 		void setSamples(IqSampler* sampler, CqVector2D& offset);
 
 	private:
-		/// boost::intrusive_ptr required function, to increment the reference count.
-		friend		void intrusive_ptr_add_ref(CqImagePixel* p);
-		/// boost::intrusive_ptr required function, to decrement the reference count.
-		/// and delete if necessary.
-		friend		void intrusive_ptr_release(CqImagePixel* p);
-
 		/// The number of samples in the horizontal direction.
 		TqInt m_XSamples;
 		/// The number of samples in the vertical direction.
 		TqInt m_YSamples;
 		/// Array of sample positions within this pixel
 		boost::scoped_array<SqSampleData> m_samples;
-		/// Vector storing sample data for the sample hits within the pixel.
-		std::vector<TqFloat> m_hitSamples;
+		/// Hit data for the occluding hits, one block per sample.
+		boost::scoped_array<TqFloat> m_occludingData;
 		/// A mapping from dof bounding-box index to the sample that contains a
 		/// dof offset in that bb.
 		boost::scoped_array<TqInt> m_DofOffsetIndices;
-		/// Reference count for boost::intrusive_ptr
-		int m_refCount;
 		/// A flag to indicate successful sample hits in this pixel.
 		bool m_hasValidSamples;
 }; 
 
-/// Intrusive reference counted pointer to a pixel class.
-typedef	boost::intrusive_ptr<CqImagePixel>			CqImagePixelPtr;
+/** \brief Pointer to a pixel.
+ *
+ * Pixels are not reference counted.  Each pixel is owned either by the
+ * CqPixelPool of a bucket processor, or by the bucket cache segment it has
+ * been handed over in; other holders just borrow it.
+ */
+typedef	CqImagePixel*			CqImagePixelPtr;
 
 
 /** \brief A pool for reusing pixel data structures.
  *
- * Reusing pixels is useful, since it allows the allocated per-pixel
- * sample hit storage to grow adaptively to the necessary size, after
- * which no further allocation is necessary.
+ * Reusing pixels avoids reallocating the per-pixel sample storage for
+ * every bucket.  The pool is used by a single bucket processor and deletes
+ * the pixels it holds when destroyed.
  */
-class CqPixelPool
+class CqPixelPool : private boost::noncopyable
 {
 	public:
 		/** \brief Initialise the pool
@@ -345,14 +428,14 @@ class CqPixelPool
 		 * \param ySamples - number of subpixel samples in the y-direction
 		 */
 		CqPixelPool(TqInt xSamples, TqInt ySamples);
+		~CqPixelPool();
 
 		/// Allocate a new CqImagePixel, or return a pooled one.
 		CqImagePixelPtr allocate();
 
 		/** \brief Add a pixel to the pool to be reused, and reset the pointer.
 		 *
-		 * The pixel is only freed if the associated reference count is one.
-		 * If not, perform no action.
+		 * The caller must own the pixel.
 		 */
 		void free(CqImagePixelPtr& pixel);
 	private:
@@ -369,20 +452,20 @@ class CqPixelPool
 //------------------------------------------------------------------------------
 // SqImageSample implementation
 inline SqImageSample::SqImageSample()
-	: index(-1),
+	: data(0),
 	flags(0),
 	csgNode()
 { }
 
 inline SqImageSample::SqImageSample(const SqImageSample& from)
-	: index(from.index),
+	: data(from.data),
 	flags(from.flags),
 	csgNode(from.csgNode)
 { }
 
 inline SqImageSample& SqImageSample::operator=(const SqImageSample& from)
 {
-	index = from.index;
+	data = from.data;
 	flags = from.flags;
 	csgNode = from.csgNode;
 
@@ -390,6 +473,19 @@ inline SqImageSample& SqImageSample::operator=(const SqImageSample& from)
 }
 
 
+//------------------------------------------------------------------------------
+// SqDeepHit implementation
+inline TqFloat* SqDeepHit::data()
+{
+	return reinterpret_cast<TqFloat*>(this + 1);
+}
+
+inline const TqFloat* SqDeepHit::data() const
+{
+	return reinterpret_cast<const TqFloat*>(this + 1);
+}
+
+
 //------------------------------------------------------------------------------
 // SqSampleData implementation
 inline SqSampleData::SqSampleData()
@@ -398,12 +494,76 @@ inline SqSampleData::SqSampleData()
 	occlusionIndex(0),
 	time(0),
 	detailLevel(0),
-	data(),
+	deepHits(0),
 	occludingHit(),
 	occlZ(FLT_MAX)
 { }
 
 
+//------------------------------------------------------------------------------
+// CqSampleStore implementation
+inline SqDeepHit* CqSampleStore::allocateHit(TqInt dataSize)
+{
+	// Keep every allocation aligned for the SqDeepHit header.
+	const std::size_t align = sizeof(void*);
+	std::size_t bytes = sizeof(SqDeepHit) + dataSize*sizeof(TqFloat);
+	bytes = (bytes + align - 1) & ~(align - 1);
+	if(static_cast<std::size_t>(m_end - m_pos) < bytes)
+		nextChunk(bytes);
+	SqDeepHit* hit = reinterpret_cast<SqDeepHit*>(m_pos);
+	m_pos += bytes;
+	hit->next = 0;
+	hit->flags = 0;
+	hit->csgIndex = -1;
+	return hit;
+}
+
+inline void CqSampleStore::setCsgNode(SqDeepHit& hit,
+		const boost::shared_ptr<CqCSGTreeNode>& node)
+{
+	if(node)
+	{
+		hit.csgIndex = m_csgNodes.size();
+		m_csgNodes.push_back(node);
+	}
+	else
+		hit.csgIndex = -1;
+}
+
+inline const boost::shared_ptr<CqCSGTreeNode>& CqSampleStore::csgNode(
+		const SqDeepHit& hit) const
+{
+	if(hit.csgIndex < 0)
+		return m_noCsgNode;
+	return m_csgNodes[hit.csgIndex];
+}
+
+inline void CqSampleStore::reset()
+{
+	m_current = 0;
+	m_pos = 0;
+	m_end = 0;
+	// Only non-empty for scenes using CSG.
+	if(!m_csgNodes.empty())
+		m_csgNodes.clear();
+}
+
+inline std::size_t CqSampleStore::capacity() const
+{
+	return m_capacity;
+}
+
+inline std::vector<SqImageSample>& CqSampleStore::combineScratch()
+{
+	return m_combineScratch;
+}
+
+inline char* CqSampleStore::chunkData(SqChunk* chunk)
+{
+	return reinterpret_cast<char*>(chunk + 1);
+}
+
+
 //------------------------------------------------------------------------------
 // CqImagePixel implementation
 inline TqInt CqImagePixel::XSamples() const
@@ -435,15 +595,12 @@ inline CqVector2D CqImagePixel::projectToCircle(const CqVector2D& pos)
 	return adj*pos;
 }
 
-inline TqInt CqImagePixel::refCount() const
+inline void CqImagePixel::addDeepHit( TqInt index, SqDeepHit* hit )
 {
-	return m_refCount;
-}
-
-inline std::vector<SqImageSample>& CqImagePixel::Values( TqInt index )
-{
-    assert(index < numSamples());
-	return m_samples[index].data;
+	assert(index < numSamples());
+	// The hits are sorted by depth in Combine(), so just push on the front.
+	hit->next = m_samples[index].deepHits;
+	m_samples[index].deepHits = hit;
 }
 
 inline SqImageSample& CqImagePixel::occludingHit( TqInt index )
@@ -454,28 +611,14 @@ inline SqImageSample& CqImagePixel::occludingHit( TqInt index )
 
 inline const TqFloat* CqImagePixel::sampleHitData(const SqImageSample& hit) const
 {
-	assert(hit.index >= 0);
-	assert(hit.index + SqImageSample::sampleSize <= static_cast<TqInt>(m_hitSamples.size()));
-	return &m_hitSamples[hit.index];
+	assert(hit.data);
+	return hit.data;
 }
 
 inline TqFloat* CqImagePixel::sampleHitData(const SqImageSample& hit)
 {
-	assert(hit.index >= 0);
-	assert(hit.index + SqImageSample::sampleSize <= static_cast<TqInt>(m_hitSamples.size()));
-	return &m_hitSamples[hit.index];
-}
-
-inline void CqImagePixel::allocateHitData(SqImageSample& hit)
-{
-	assert(hit.index == -1);
-	// Using a std::vector for m_hitSamples allows the sample size to grow as
-	// necessary with O(log(N)) reallocations for N hits.  The reallocation
-	// time is irrelevant when CqImagePixel's are recycled through the pipeline
-	// since the vector grows to the necessary size in the first few buckets
-	// and remains there for the rest of the frame.
-	hit.index = m_hitSamples.size();
-	m_hitSamples.resize(m_hitSamples.size() + SqImageSample::sampleSize);
+	assert(hit.data);
+	return hit.data;
 }
 
 inline SqSampleData const& CqImagePixel::SampleData( TqInt index ) const
@@ -490,17 +633,6 @@ inline SqSampleData& CqImagePixel::SampleData( TqInt index )
 	return m_samples[index];
 }
 
-inline void intrusive_ptr_add_ref(Aqsis::CqImagePixel* p)
-{
-	++(p->m_refCount);
-}
-
-inline void intrusive_ptr_release(Aqsis::CqImagePixel* p)
-{
-	if(--(p->m_refCount) == 0)
-		delete p;
-}
-
 inline void CqImagePixel::markHasValidSamples()
 {
 	m_hasValidSamples = true;
@@ -519,6 +651,13 @@ inline CqPixelPool::CqPixelPool(TqInt xSamples, TqInt ySamples)
 	m_pool()
 { }
 
+inline CqPixelPool::~CqPixelPool()
+{
+	for(std::vector<CqImagePixelPtr>::iterator i = m_pool.begin(),
+			end = m_pool.end(); i != end; ++i)
+		delete *i;
+}
+
 inline CqImagePixelPtr CqPixelPool::allocate()
 {
 	if(!m_pool.empty())
@@ -530,18 +669,15 @@ inline CqImagePixelPtr CqPixelPool::allocate()
 		pixel->clear();
 		return pixel;
 	}
-	return CqImagePixelPtr(new CqImagePixel(m_xSamples, m_ySamples));
+	return new CqImagePixel(m_xSamples, m_ySamples);
 }
 
 inline void CqPixelPool::free(CqImagePixelPtr& pixel)
 {
 	assert(pixel->XSamples() == m_xSamples);
 	assert(pixel->YSamples() == m_ySamples);
-	if(pixel->refCount() == 1)
-	{
-		m_pool.push_back(pixel);
-		pixel = 0;
-	}
+	m_pool.push_back(pixel);
+	pixel = 0;
 }
 
 
@@ -0,0 +1,134 @@
+// Aqsis
+// Copyright (C) 1997 - 2001, Paul C. Gregory
+//
+// Contact: pgregory@aqsis.org
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation; either
+// version 2 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+/** \file Unit tests for the pixel sample storage.
+ */
+
+#include "imagepixel.h"
+
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/auto_unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(imagepixel_tests)
+
+using namespace Aqsis;
+
+namespace {
+
+SqDeepHit* makeHit(CqSampleStore& store, TqFloat depth, TqFloat col, TqFloat opa)
+{
+	SqDeepHit* hit = store.allocateHit(SqImageSample::sampleSize);
+	TqFloat* data = hit->data();
+	for(TqInt i = 0; i < SqImageSample::sampleSize; ++i)
+		data[i] = 0;
+	data[Sample_Red] = data[Sample_Green] = data[Sample_Blue] = col;
+	data[Sample_ORed] = data[Sample_OGreen] = data[Sample_OBlue] = opa;
+	data[Sample_Depth] = depth;
+	return hit;
+}
+
+} // unnamed namespace
+
+
+BOOST_AUTO_TEST_CASE(sample_store_reuses_chunks)
+{
+	CqSampleStore store(1024);
+	SqDeepHit* first = 0;
+	for(TqInt i = 0; i < 1000; ++i)
+	{
+		SqDeepHit* hit = makeHit(store, i, 0, 0);
+		if(i == 0)
+			first = hit;
+		BOOST_CHECK_EQUAL(hit->data()[Sample_Depth], TqFloat(i));
+	}
+	// Earlier hits are untouched by later allocations.
+	BOOST_CHECK_EQUAL(first->data()[Sample_Depth], 0.0f);
+	std::size_t capacity = store.capacity();
+	BOOST_CHECK(capacity > 1024);
+
+	// After a reset, the same memory is handed out again.
+	store.reset();
+	BOOST_CHECK_EQUAL(store.allocateHit(SqImageSample::sampleSize), first);
+	for(TqInt i = 1; i < 1000; ++i)
+		makeHit(store, i, 0, 0);
+	BOOST_CHECK_EQUAL(store.capacity(), capacity);
+}
+
+BOOST_AUTO_TEST_CASE(sample_store_large_hit)
+{
+	CqSampleStore store(64);
+	makeHit(store, 0, 0, 0);
+	// Hits larger than the chunk size get a chunk of their own.
+	SqDeepHit* hit = store.allocateHit(100);
+	hit->data()[99] = 1;
+	BOOST_CHECK(store.capacity() >= 100*sizeof(TqFloat));
+}
+
+BOOST_AUTO_TEST_CASE(imagepixel_combine_deep_hits)
+{
+	CqSampleStore store;
+	CqImagePixel pixel(1, 1);
+
+	// Two half transparent hits, added back to front.
+	pixel.addDeepHit(0, makeHit(store, 2, 0.5f, 0.5f));
+	pixel.addDeepHit(0, makeHit(store, 1, 0.25f, 0.5f));
+	pixel.Combine(Filter_Min, CqColor(1, 1, 1), store);
+
+	const SqImageSample& hit = pixel.occludingHit(0);
+	BOOST_REQUIRE(hit.flags & SqImageSample::Flag_Valid);
+	// Premultiplied "over" compositing.
+	const TqFloat* data = pixel.sampleHitData(hit);
+	BOOST_CHECK_CLOSE(data[Sample_Red], 0.5f, 1e-4f);
+	BOOST_CHECK_CLOSE(data[Sample_ORed], 0.75f, 1e-4f);
+	BOOST_CHECK_EQUAL(pixel.SampleData(0).deepHits, static_cast<SqDeepHit*>(0));
+
+	// The result must not refer to the store, which is recycled with the
+	// bucket.
+	store.reset();
+	makeHit(store, 10, 10, 10);
+	makeHit(store, 10, 10, 10);
+	BOOST_CHECK_CLOSE(data[Sample_Red], 0.5f, 1e-4f);
+}
+
+BOOST_AUTO_TEST_CASE(imagepixel_combine_average_depth_with_occluder)
+{
+	CqSampleStore store;
+	CqImagePixel pixel(1, 1);
+
+	// An opaque occluding hit behind a half transparent one.
+	SqImageSample& occlHit = pixel.occludingHit(0);
+	TqFloat* occlData = pixel.sampleHitData(occlHit);
+	occlData[Sample_Red] = occlData[Sample_Green] = occlData[Sample_Blue] = 1;
+	occlData[Sample_ORed] = occlData[Sample_OGreen] = occlData[Sample_OBlue] = 1;
+	occlData[Sample_Depth] = 4;
+	occlHit.flags |= SqImageSample::Flag_Valid;
+	pixel.SampleData(0).occlZ = 4;
+	pixel.addDeepHit(0, makeHit(store, 1, 0.25f, 0.5f));
+
+	pixel.Combine(Filter_Average, CqColor(1, 1, 1), store);
+
+	const TqFloat* data = pixel.sampleHitData(pixel.occludingHit(0));
+	BOOST_CHECK_CLOSE(data[Sample_Red], 0.75f, 1e-4f);
+	BOOST_CHECK_CLOSE(data[Sample_ORed], 1.0f, 1e-4f);
+	// Only the occluder is opaque, so the average depth is its own depth,
+	// not the depth of the transparent hit in front of it.
+	BOOST_CHECK_CLOSE(data[Sample_Depth], 4.0f, 1e-4f);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
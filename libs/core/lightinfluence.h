@@ -0,0 +1,192 @@
+// Aqsis
+// Copyright (C) 1997 - 2001, Paul C. Gregory
+//
+// Contact: pgregory@aqsis.org
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation; either
+// version 2 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+/** \file
+ * \brief Conservative test of whether a light source can reach a region.
+ */
+
+#ifndef LIGHTINFLUENCE_H_INCLUDED
+#define LIGHTINFLUENCE_H_INCLUDED 1
+
+#include	<cfloat>
+
+#include	<aqsis/aqsis.h>
+#include	<aqsis/math/math.h>
+#include	<aqsis/math/vector3d.h>
+
+namespace Aqsis {
+
+/** \brief Region of space a light source can illuminate.
+ *
+ * The region is described by the cone passed to the illuminate() statement
+ * of a light shader, which lights a point when the unit vector L from the
+ * light to the point satisfies acos(L.axis) <= angle, cut off at a distance
+ * of radius from the light.  All tests err on the side of the light being
+ * able to reach a region.
+ */
+struct SqLightInfluence
+{
+	bool hasCone;			///< Whether the fields below describe the light.
+	CqVector3D from;		///< Position of the light.
+	CqVector3D axis;		///< Cone axis; not necessarily normalised.
+	TqFloat angle;			///< Cone half angle in radians.
+	TqFloat radius;			///< Distance beyond which the light has no effect.
+
+	SqLightInfluence()
+		: hasCone(false),
+		from(),
+		axis(0, 1, 0),
+		angle(M_PI),
+		radius(FLT_MAX)
+	{ }
+
+	/** \brief Determine whether the light may illuminate part of a sphere.
+	 *
+	 * \param center - centre of the sphere.
+	 * \param boundRadius - radius of the sphere.
+	 * \return false only if no point in the sphere can be lit.
+	 */
+	bool mayIlluminate(const CqVector3D& center, TqFloat boundRadius) const;
+
+	/** \brief Widen the cone to take in a second illuminate() cone.
+	 *
+	 * The result is the narrowest cone around both.  Cones from a different
+	 * position can't be bounded by one cone, so hasCone is cleared.
+	 *
+	 * \param coneFrom - position of the light for the second cone.
+	 * \param coneAxis - axis of the second cone; not necessarily normalised.
+	 * \param coneAngle - half angle of the second cone in radians.
+	 */
+	void addCone(const CqVector3D& coneFrom, const CqVector3D& coneAxis,
+			TqFloat coneAngle);
+};
+
+
+//==============================================================================
+// Implementation details
+//==============================================================================
+
+inline bool SqLightInfluence::mayIlluminate(const CqVector3D& center,
+		TqFloat boundRadius) const
+{
+	if(!hasCone)
+		return true;
+	CqVector3D toCenter = center - from;
+	TqFloat dist = toCenter.Magnitude();
+	if(dist - boundRadius > radius)
+		return false;
+	if(dist <= boundRadius || angle >= M_PI)
+		return true;
+	// Slack for rounding in the angle computations below.
+	const TqFloat eps = 1e-4f;
+	// The shadeop doesn't normalise the axis, so L.axis >= cos(angle) is
+	// equivalent to a cone about the unit axis with a cosine scaled by the
+	// inverse of the axis length.
+	TqFloat axisLen = axis.Magnitude();
+	TqFloat cosAngle = std::cos(angle);
+	if(axisLen <= 0)
+		return cosAngle <= eps;
+	TqFloat cosCone = cosAngle/axisLen;
+	if(cosCone <= -1)
+		return true;
+	if(cosCone > 1 + eps)
+		return false;
+	TqFloat coneAngle = std::acos(clamp(cosCone, -1.0f, 1.0f));
+	TqFloat boundAngle = std::asin(boundRadius/dist);
+	TqFloat centerAngle = std::acos(clamp((toCenter*axis)/(dist*axisLen),
+				-1.0f, 1.0f));
+	return centerAngle - boundAngle <= coneAngle + eps;
+}
+
+/** \brief Find the cone about a unit axis lit by illuminate().
+ *
+ * \return false if the cone is empty.
+ */
+inline bool illuminateUnitCone(const CqVector3D& axis, TqFloat angle,
+		CqVector3D& unitAxis, TqFloat& unitAngle)
+{
+	// As in mayIlluminate(), the cosine is scaled by the inverse axis length.
+	TqFloat axisLen = axis.Magnitude();
+	TqFloat cosAngle = std::cos(angle);
+	unitAxis = CqVector3D(0, 0, 1);
+	unitAngle = M_PI;
+	if(axisLen <= 0)
+		return cosAngle <= 0;
+	TqFloat cosCone = cosAngle/axisLen;
+	if(cosCone > 1)
+		return false;
+	unitAxis = axis/axisLen;
+	unitAngle = std::acos(clamp(cosCone, -1.0f, 1.0f));
+	return true;
+}
+
+inline void SqLightInfluence::addCone(const CqVector3D& coneFrom,
+		const CqVector3D& coneAxis, TqFloat coneAngle)
+{
+	if(!hasCone)
+		return;
+	if(coneFrom != from)
+	{
+		hasCone = false;
+		return;
+	}
+	CqVector3D axis1, axis2;
+	TqFloat angle1, angle2;
+	bool lit1 = illuminateUnitCone(axis, angle, axis1, angle1);
+	if(!illuminateUnitCone(coneAxis, coneAngle, axis2, angle2))
+		return;
+	if(!lit1)
+	{
+		axis = axis2;
+		angle = angle2;
+		return;
+	}
+	TqFloat between = std::acos(clamp(axis1*axis2, -1.0f, 1.0f));
+	if(between + angle2 <= angle1)
+	{
+		axis = axis1;
+		angle = angle1;
+		return;
+	}
+	if(between + angle1 <= angle2)
+	{
+		axis = axis2;
+		angle = angle2;
+		return;
+	}
+	TqFloat halfAngle = (between + angle1 + angle2)/2;
+	TqFloat sinBetween = std::sin(between);
+	if(halfAngle >= M_PI || sinBetween <= 1e-4f)
+	{
+		// Opposing cones; any axis will do for a cone this wide.
+		axis = axis1;
+		angle = M_PI;
+		return;
+	}
+	// Turn the first axis towards the second until the cone just takes in
+	// both.
+	TqFloat turn = halfAngle - angle1;
+	axis = (std::sin(between - turn)*axis1 + std::sin(turn)*axis2)/sinBetween;
+	angle = halfAngle;
+}
+
+} // namespace Aqsis
+
+#endif // LIGHTINFLUENCE_H_INCLUDED
@@ -0,0 +1,123 @@
+// Aqsis
+// Copyright (C) 1997 - 2001, Paul C. Gregory
+//
+// Contact: pgregory@aqsis.org
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation; either
+// version 2 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+/** \file Unit tests for light source culling.
+ */
+
+#include "lightinfluence.h"
+
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/auto_unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(lightinfluence_tests)
+
+using namespace Aqsis;
+
+namespace {
+
+// A spotlight at the origin pointing along +z with a 30 degree half angle.
+SqLightInfluence spotlight()
+{
+	SqLightInfluence influence;
+	influence.hasCone = true;
+	influence.from = CqVector3D(0, 0, 0);
+	influence.axis = CqVector3D(0, 0, 1);
+	influence.angle = degToRad(30);
+	return influence;
+}
+
+} // unnamed namespace
+
+
+BOOST_AUTO_TEST_CASE(lightinfluence_unknown_never_culled)
+{
+	SqLightInfluence influence;
+	BOOST_CHECK(influence.mayIlluminate(CqVector3D(0, 0, -1000), 1));
+}
+
+BOOST_AUTO_TEST_CASE(lightinfluence_cone)
+{
+	SqLightInfluence influence = spotlight();
+	// Inside the cone, and behind the light.
+	BOOST_CHECK(influence.mayIlluminate(CqVector3D(0, 0, 10), 0.1f));
+	BOOST_CHECK(!influence.mayIlluminate(CqVector3D(0, 0, -10), 1));
+	// Outside the cone at 45 degrees, unless the sphere reaches into it.
+	BOOST_CHECK(!influence.mayIlluminate(CqVector3D(10, 0, 10), 1));
+	BOOST_CHECK(influence.mayIlluminate(CqVector3D(10, 0, 10), 5));
+	// Spheres containing the light are always lit.
+	BOOST_CHECK(influence.mayIlluminate(CqVector3D(0, 0, -1), 2));
+}
+
+BOOST_AUTO_TEST_CASE(lightinfluence_unnormalised_axis)
+{
+	// The illuminate() shadeop compares L.axis against cos(angle) without
+	// normalising the axis, so a long axis widens the cone.
+	SqLightInfluence influence = spotlight();
+	influence.axis = CqVector3D(0, 0, 2);
+	BOOST_CHECK(influence.mayIlluminate(CqVector3D(10, 0, 10), 0.1f));
+	BOOST_CHECK(!influence.mayIlluminate(CqVector3D(10, 0, -1), 0.1f));
+}
+
+BOOST_AUTO_TEST_CASE(lightinfluence_radius)
+{
+	SqLightInfluence influence = spotlight();
+	influence.angle = M_PI;
+	influence.radius = 5;
+	BOOST_CHECK(influence.mayIlluminate(CqVector3D(0, 0, -5), 1));
+	BOOST_CHECK(!influence.mayIlluminate(CqVector3D(0, 0, -7), 1));
+}
+
+BOOST_AUTO_TEST_CASE(lightinfluence_two_cones)
+{
+	// A light with a second illuminate() cone along +x reaches into both.
+	SqLightInfluence influence = spotlight();
+	influence.addCone(CqVector3D(0, 0, 0), CqVector3D(1, 0, 0), degToRad(30));
+	BOOST_REQUIRE(influence.hasCone);
+	BOOST_CHECK(influence.mayIlluminate(CqVector3D(0, 0, 10), 0.1f));
+	BOOST_CHECK(influence.mayIlluminate(CqVector3D(10, 0, 0), 0.1f));
+	BOOST_CHECK(influence.mayIlluminate(CqVector3D(10, 0, 10), 0.1f));
+	// Behind both cones, and off to the side of both.
+	BOOST_CHECK(!influence.mayIlluminate(CqVector3D(0, 0, -10), 1));
+	BOOST_CHECK(!influence.mayIlluminate(CqVector3D(-10, 0, 0), 1));
+	BOOST_CHECK(!influence.mayIlluminate(CqVector3D(0, 10, 0), 1));
+}
+
+BOOST_AUTO_TEST_CASE(lightinfluence_nested_cones)
+{
+	// A narrower cone inside the first leaves it unchanged, and a wider one
+	// replaces it.
+	SqLightInfluence influence = spotlight();
+	influence.addCone(CqVector3D(0, 0, 0), CqVector3D(0, 0, 1), degToRad(10));
+	BOOST_CHECK(!influence.mayIlluminate(CqVector3D(10, 0, 10), 1));
+	influence.addCone(CqVector3D(0, 0, 0), CqVector3D(0, 0, 1), degToRad(60));
+	BOOST_CHECK(influence.mayIlluminate(CqVector3D(10, 0, 10), 1));
+	BOOST_CHECK(!influence.mayIlluminate(CqVector3D(0, 0, -10), 1));
+}
+
+BOOST_AUTO_TEST_CASE(lightinfluence_cones_from_two_positions)
+{
+	// Cones from different positions aren't bounded, so nothing is culled.
+	SqLightInfluence influence = spotlight();
+	influence.addCone(CqVector3D(0, 0, -20), CqVector3D(0, 0, -1),
+			degToRad(30));
+	BOOST_CHECK(!influence.hasCone);
+	BOOST_CHECK(influence.mayIlluminate(CqVector3D(0, 0, -10), 1));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
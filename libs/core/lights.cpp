@@ -26,10 +26,18 @@
 #include	<aqsis/aqsis.h>
 #include	"lights.h"
 #include	<aqsis/util/file.h>
+#include	<aqsis/core/parameterkey.h>
 #include	"renderer.h"
+#include	"stats.h"
 
 namespace Aqsis {
 
+namespace {
+
+const CqParameterKey lightInfluenceRadiusKey( "light", "influenceradius" );
+
+} // unnamed namespace
+
 //---------------------------------------------------------------------
 /** Default constructor.
  */
@@ -38,11 +46,17 @@ CqLightsource::CqLightsource( const boost::shared_ptr<IqShader>& pShader, bool f
 		m_pShader( pShader ),
 		m_pAttributes(),
 		m_pTransform(),
-		m_pShaderExecEnv(IqShaderExecEnv::create(QGetRenderContextI()))
+		m_pShaderExecEnv(IqShaderExecEnv::create(QGetRenderContextI())),
+		m_influence(),
+		m_cones()
 {
 	// Set a reference with the current attributes.
 	m_pAttributes = QGetRenderContext() ->pattrCurrent();
 
+	const TqFloat* influenceRadius = m_pAttributes->GetFloatAttribute( lightInfluenceRadiusKey );
+	if ( influenceRadius && influenceRadius[0] > 0 )
+		m_influence.radius = influenceRadius[0];
+
 	m_pShader->SetType(Type_Lightsource);
 	m_pTransform = QGetRenderContext() ->ptransCurrent();
 }
@@ -103,6 +117,43 @@ void CqLightsource::Initialise( TqInt uGridRes, TqInt vGridRes, TqInt microPolyg
 }
 
 
+//---------------------------------------------------------------------
+/** Evaluate the light shader for the given points.
+ * \param pPs the points being lit.
+ * \param pNs the normals at the points being lit.
+ */
+void CqLightsource::Evaluate( IqShaderData* pPs, IqShaderData* pNs, IqSurface* pSurface )
+{
+	Ps() ->SetValueFromVariable( pPs );
+	Ns() ->SetValueFromVariable( pNs );
+	m_pShaderExecEnv->SetCurrentSurface(pSurface);
+	m_pShader->Evaluate( m_pShaderExecEnv.get() );
+	STATS_INC( SHD_lights_evaluated );
+
+	// Remember where the light can reach, for culling against later grids.
+	m_influence.hasCone = m_pShaderExecEnv->illuminateCones( m_cones );
+	if ( m_influence.hasCone )
+	{
+		m_influence.from = m_cones[0].from;
+		m_influence.axis = m_cones[0].axis;
+		m_influence.angle = m_cones[0].angle;
+		for ( TqUint i = 1; i < m_cones.size(); ++i )
+			m_influence.addCone( m_cones[i].from, m_cones[i].axis, m_cones[i].angle );
+	}
+}
+
+
+//---------------------------------------------------------------------
+/** Determine whether the light may illuminate any point in a sphere.
+ */
+bool CqLightsource::mayIlluminate( const CqVector3D& center, TqFloat radius )
+{
+	if ( m_influence.mayIlluminate( center, radius ) )
+		return ( true );
+	STATS_INC( SHD_lights_culled );
+	return ( false );
+}
+
 
 //---------------------------------------------------------------------
 //---------------------------------------------------------------------
@@ -44,6 +44,7 @@
 #include <aqsis/version.h>
 #include <aqsis/core/ilightsource.h>
 #include "attributes.h"
+#include "lightinfluence.h"
 #include "transform.h"
 
 namespace Aqsis {
@@ -86,13 +87,14 @@ class CqLightsource : public IqLightsource, public boost::enable_shared_from_thi
 		/** Evaluate the shader.
 		 * \param pPs the point being lit.
 		 */
-		virtual void	Evaluate( IqShaderData* pPs, IqShaderData* pNs, IqSurface* pSurface )
-		{
-			Ps() ->SetValueFromVariable( pPs );
-			Ns() ->SetValueFromVariable( pNs );
-			m_pShaderExecEnv->SetCurrentSurface(pSurface);
-			m_pShader->Evaluate( m_pShaderExecEnv.get() );
-		}
+		virtual void	Evaluate( IqShaderData* pPs, IqShaderData* pNs, IqSurface* pSurface );
+		/** Determine whether the light may illuminate any point in a sphere.
+		 *
+		 * The cone of the light is taken from the illuminate() statements
+		 * run during the previous evaluation, so lights are never culled
+		 * before they have been evaluated once.
+		 */
+		virtual bool	mayIlluminate( const CqVector3D& center, TqFloat radius );
 		/** Get a pointer to the attributes state associated with this GPrim.
 		 * \return A pointer to a CqAttributes class.
 		 */
@@ -265,6 +267,8 @@ class CqLightsource : public IqLightsource, public boost::enable_shared_from_thi
 		CqAttributesPtr	m_pAttributes;			///< Pointer to the associated attributes.
 		CqTransformPtr m_pTransform;		///< Pointer to the transformation state associated with this GPrim.
 		boost::shared_ptr<IqShaderExecEnv>	m_pShaderExecEnv;	///< Pointer to the shader execution environment.
+		SqLightInfluence	m_influence;	///< Region the light was found to reach when last evaluated.
+		std::vector<SqIlluminateCone>	m_cones;	///< Cones of the illuminate() statements of the last evaluation.
 }
 ;
 
@@ -34,11 +34,29 @@
 #include	"trimcurve.h"
 #include	<aqsis/math/derivatives.h>
 #include	"bucketprocessor.h"
+#include	"occlusion.h"
 
 #include	"mpdump.h"
 
 namespace Aqsis {
 
+namespace {
+
+// Options and attributes looked up while rendering, interned once.
+const CqParameterKey aqsisExpandgridsKey( "aqsis", "expandgrids" );
+const CqParameterKey cullBackfacingKey( "cull", "backfacing" );
+const CqParameterKey limitsZthresholdKey( "limits", "zthreshold" );
+const CqParameterKey systemFilterWidthKey( "System", "FilterWidth" );
+const CqParameterKey systemLevelOfDetailBoundsKey( "System", "LevelOfDetailBounds" );
+const CqParameterKey systemMatteKey( "System", "Matte" );
+const CqParameterKey systemOrientationKey( "System", "Orientation" );
+const CqParameterKey systemProjectionKey( "System", "Projection" );
+const CqParameterKey systemShutterKey( "System", "Shutter" );
+const CqParameterKey systemSidesKey( "System", "Sides" );
+const CqParameterKey trimcurveSenseKey( "trimcurve", "sense" );
+
+} // unnamed namespace
+
 
 CqObjectPool<CqMicroPolygon> CqMicroPolygon::m_thePool;
 CqObjectPool<CqMovingMicroPolygonKey>	CqMovingMicroPolygonKey::m_thePool;
@@ -47,7 +65,7 @@ void CqMicroPolyGridBase::CacheGridInfo(const boost::shared_ptr<const CqSurface>
 {
 	const IqAttributes& attrs = *pAttributes();
 	// Determine the matte flag type.
-	switch(attrs.GetIntegerAttribute("System", "Matte")[0])
+	switch(attrs.GetIntegerAttribute( systemMatteKey )[0])
 	{
 		case 0:  m_CurrentGridInfo.matteFlag = 0;                              break;
 		default: m_CurrentGridInfo.matteFlag = SqImageSample::Flag_Matte;      break;
@@ -62,7 +80,7 @@ void CqMicroPolyGridBase::CacheGridInfo(const boost::shared_ptr<const CqSurface>
 		= !(QGetRenderContext() ->GetMapOfOutputDataEntries().empty());
 
 	m_CurrentGridInfo.lodBounds
-		= attrs.GetFloatAttribute("System", "LevelOfDetailBounds");
+		= attrs.GetFloatAttribute( systemLevelOfDetailBoundsKey );
 }
 
 
@@ -178,7 +196,7 @@ void CqMicroPolyGrid::CalcNormals()
 	// of the cross product must be reversed if the formula is to give the
 	// correct normal after RiScale(1,1,-1) or similar transformations.
 	bool CSO = this->pSurface()->pTransform()->GetHandedness(this->pSurface()->pTransform()->Time(0));
-	bool O = pAttributes() ->GetIntegerAttribute( "System", "Orientation" ) [ 0 ] != 0;
+	bool O = pAttributes() ->GetIntegerAttribute( systemOrientationKey ) [ 0 ] != 0;
 	bool flipNormals = O ^ CSO;
 
 	const CqVector3D* pP = 0;
@@ -338,11 +356,65 @@ void CqMicroPolyGrid::ExpandGridBoundaries(TqFloat amount)
 }
 
 
+//---------------------------------------------------------------------
+/** Compute the raster bound of the grid for occlusion culling.
+ */
+
+bool CqMicroPolyGrid::CalcRasterBound( CqBound& bound )
+{
+	// The points only give the position at shutter open for moving grids.
+	if ( pSurface()->pTransform()->cTimes() > 1 ||
+		 QGetRenderContext()->GetCameraTransform()->cTimes() > 1 )
+		return false;
+
+	const CqVector3D* pP = NULL;
+	pVar(EnvVars_P)->GetPointPtr( pP );
+	TqInt gs = m_pShaderExecEnv->shadingPointCount();
+
+	TqFloat minz = FLT_MAX;
+	TqFloat maxz = -FLT_MAX;
+	for ( TqInt i = 0; i < gs; i++ )
+	{
+		minz = min( minz, pP[i].z() );
+		maxz = max( maxz, pP[i].z() );
+	}
+	// Points behind the epsilon plane don't project sensibly.
+	if ( minz <= FLT_EPSILON )
+		return false;
+
+	CqMatrix matCameraToRaster;
+	QGetRenderContext() ->matSpaceToSpace( "camera", "raster", NULL, NULL, QGetRenderContext()->Time(), matCameraToRaster );
+	bound = CqBound();
+	for ( TqInt i = 0; i < gs; i++ )
+		bound.Encapsulate( matCameraToRaster * pP[i] );
+
+	TqFloat expandX = 0;
+	TqFloat expandY = 0;
+	if ( QGetRenderContext() ->UsingDepthOfField() )
+	{
+		const CqVector2D minZCoc = QGetRenderContext()->GetCircleOfConfusion( minz );
+		const CqVector2D maxZCoc = QGetRenderContext()->GetCircleOfConfusion( maxz );
+		expandX = max( minZCoc.x(), maxZCoc.x() );
+		expandY = max( minZCoc.y(), maxZCoc.y() );
+	}
+	const TqFloat* filtSize = QGetRenderContext()->poptCurrent()
+	                          ->GetFloatOption( systemFilterWidthKey );
+	if ( filtSize )
+	{
+		expandX += filtSize[0] / 2.0f;
+		expandY += filtSize[1] / 2.0f;
+	}
+	bound.vecMin() = CqVector3D( bound.vecMin().x() - expandX, bound.vecMin().y() - expandY, minz );
+	bound.vecMax() = CqVector3D( bound.vecMax().x() + expandX, bound.vecMax().y() + expandY, maxz );
+	return true;
+}
+
+
 //---------------------------------------------------------------------
 /** Shade the grid using the surface parameters of the surface passed and store the color values for each micropolygon.
  */
 
-void CqMicroPolyGrid::Shade( bool canCullGrid )
+void CqMicroPolyGrid::Shade( bool canCullGrid, const CqOcclusionTree* occlusion )
 {
 	// Sanity checks
 	if ( NULL == pVar(EnvVars_P) || NULL == pVar(EnvVars_I) )
@@ -353,7 +425,7 @@ void CqMicroPolyGrid::Shade( bool canCullGrid )
 	TqInt gsmin1 = gs - 1;
 
 	// Expand grids to prevent grid cracking if enabled
-	const TqFloat* gridExpand = pAttributes()->GetFloatAttribute("aqsis", "expandgrids");
+	const TqFloat* gridExpand = pAttributes()->GetFloatAttribute( aqsisExpandgridsKey );
 	if(gridExpand && *gridExpand > 0)
 		ExpandGridBoundaries(*gridExpand);
 
@@ -378,7 +450,7 @@ void CqMicroPolyGrid::Shade( bool canCullGrid )
 		setDv();
 
 	// Set I, the incident ray direction.
-	switch(QGetRenderContext()->GetIntegerOption("System", "Projection")[0])
+	switch(QGetRenderContext()->GetIntegerOption( systemProjectionKey )[0])
 	{
 		case ProjectionOrthographic:
 			{
@@ -429,8 +501,8 @@ void CqMicroPolyGrid::Shade( bool canCullGrid )
 	}
 
 	// Now try and cull any hidden MPs if Sides==1
-	if ( ( pAttributes() ->GetIntegerAttribute( "System", "Sides" ) [ 0 ] == 1 ) && !m_pCSGNode &&
-		 ( pAttributes() ->GetIntegerAttributeDef( "cull", "backfacing", 1 ) == 1 ) )
+	if ( ( pAttributes() ->GetIntegerAttribute( systemSidesKey ) [ 0 ] == 1 ) && !m_pCSGNode &&
+		 ( pAttributes() ->GetIntegerAttributeDef( cullBackfacingKey, 1 ) == 1 ) )
 	{
 		AQSIS_TIME_SCOPE(Backface_culling);
 
@@ -473,6 +545,22 @@ void CqMicroPolyGrid::Shade( bool canCullGrid )
 		}
 	}
 
+	// Once the final position of the grid is known, check whether it's
+	// hidden behind the samples already rendered before running the surface
+	// and atmosphere shaders.
+	if ( canCullGrid && occlusion && CalcRasterBound( m_occlusionBound ) )
+	{
+		AQSIS_TIME_SCOPE(Occlusion_culling);
+		if ( occlusion->canCull( m_occlusionBound ) )
+		{
+			m_fCulled = true;
+			m_fOcclusionCulled = true;
+			STATS_INC( GRD_occlusion_culled );
+			DeleteVariables( true );
+			return ;
+		}
+	}
+
 	// Now shade the grid.
 	boost::shared_ptr<IqShader> pshadSurface = pSurface() ->pAttributes() ->pshadSurface(QGetRenderContext()->Time());
 	if ( pshadSurface )
@@ -492,7 +580,7 @@ void CqMicroPolyGrid::Shade( bool canCullGrid )
 
 	// Cull any MPGs whose alpha is completely transparent after shading.
 	const CqColor* zThr = QGetRenderContext()->poptCurrent()
-	                      ->GetColorOption("limits", "zthreshold");
+	                      ->GetColorOption( limitsZthresholdKey );
 	if ( USES( lUses, EnvVars_Oi ) && !(zThr && *zThr == gColBlack) )
 	{
 		AQSIS_TIME_SCOPE(Transparency_culling_micropolygons);
@@ -620,7 +708,7 @@ void CqMicroPolyGrid::DeleteVariables( bool all )
 		// it's not needed is when the zthreshold color is [0,0,0], which makes
 		// all surfaces (even fully transparent) make it into the depth output.
 		const CqColor* zThr = QGetRenderContext()->poptCurrent()
-		                      ->GetColorOption( "limits", "zthreshold" );
+		                      ->GetColorOption( limitsZthresholdKey );
 		if ( all || (zThr && *zThr == CqColor(0.0f)) )
 			m_pShaderExecEnv->DeleteVariable( EnvVars_Oi );
 	}
@@ -752,7 +840,7 @@ void CqMicroPolyGrid::Split( long xmin, long xmax, long ymin, long ymax )
 
 	AQSIS_TIMER_START(Bust_grids);
 	// Get the required trim curve sense, if specified, defaults to "inside".
-	const CqString* pattrTrimSense = pAttributes() ->GetStringAttribute( "trimcurve", "sense" );
+	const CqString* pattrTrimSense = pAttributes() ->GetStringAttribute( trimcurveSenseKey );
 	CqString strTrimSense( "inside" );
 	if ( pattrTrimSense != 0 )
 		strTrimSense = pattrTrimSense[ 0 ];
@@ -915,9 +1003,12 @@ CqMotionMicroPolyGrid::~CqMotionMicroPolyGrid()
 
 //---------------------------------------------------------------------
 /** Shade the primary grid.
+ *
+ * Motion blurred grids are never culled as a whole, so the occlusion tree
+ * is ignored here.
  */
 
-void CqMotionMicroPolyGrid::Shade( bool canCullGrid )
+void CqMotionMicroPolyGrid::Shade( bool canCullGrid, const CqOcclusionTree* occlusion )
 {
 	CqMicroPolyGrid * pGrid = static_cast<CqMicroPolyGrid*>( GetMotionObject( Time( 0 ) ) );
 	pGrid->Shade(false);
@@ -956,8 +1047,8 @@ void CqMotionMicroPolyGrid::Split( long xmin, long xmax, long ymin, long ymax )
 	CqMatrix matCameraToRaster;
 	QGetRenderContext() ->matSpaceToSpace( "camera", "raster", NULL, NULL, QGetRenderContext()->Time(), matCameraToRaster );
 	// Check to see if this surface is single sided, if so, we can do backface culling.
-	bool canBeBFCulled = ( pAttributes() ->GetIntegerAttribute( "System", "Sides" ) [ 0 ] == 1 ) && !pGridA->usesCSG() &&
-						 ( pAttributes() ->GetIntegerAttributeDef( "cull", "backfacing", 1 ) == 1 );
+	bool canBeBFCulled = ( pAttributes() ->GetIntegerAttribute( systemSidesKey ) [ 0 ] == 1 ) && !pGridA->usesCSG() &&
+						 ( pAttributes() ->GetIntegerAttributeDef( cullBackfacingKey, 1 ) == 1 );
 
 	ADDREF( pGridA );
 
@@ -1054,7 +1145,7 @@ void CqMotionMicroPolyGrid::Split( long xmin, long xmax, long ymin, long ymax )
 
 	AQSIS_TIMER_START(Bust_grids);
 	// Get the required trim curve sense, if specified, defaults to "inside".
-	const CqString* pattrTrimSense = pAttributes() ->GetStringAttribute( "trimcurve", "sense" );
+	const CqString* pattrTrimSense = pAttributes() ->GetStringAttribute( trimcurveSenseKey );
 	CqString strTrimSense( "inside" );
 	if ( pattrTrimSense != 0 )
 		strTrimSense = pattrTrimSense[ 0 ];
@@ -1594,7 +1685,7 @@ bool CqMicroPolygon::Sample( CqHitTestCache& hitTestCache, SqSampleData const& s
 		if ( IsTrimmed() )
 		{
 			// Get the required trim curve sense, if specified, defaults to "inside".
-			const CqString * pattrTrimSense = pGrid() ->pAttributes() ->GetStringAttribute( "trimcurve", "sense" );
+			const CqString * pattrTrimSense = pGrid() ->pAttributes() ->GetStringAttribute( trimcurveSenseKey );
 			CqString strTrimSense( "inside" );
 			if ( pattrTrimSense != 0 )
 				strTrimSense = pattrTrimSense[ 0 ];
@@ -1688,8 +1779,8 @@ void CqMicroPolygonMotion::Initialise()
  */
 void CqMicroPolygonMotion::BuildBoundList(TqUint timeRanges)
 {
-	TqFloat opentime = QGetRenderContext() ->poptCurrent()->GetFloatOption( "System", "Shutter" ) [ 0 ];
-	TqFloat closetime = QGetRenderContext() ->poptCurrent()->GetFloatOption( "System", "Shutter" ) [ 1 ];
+	TqFloat opentime = QGetRenderContext() ->poptCurrent()->GetFloatOption( systemShutterKey ) [ 0 ];
+	TqFloat closetime = QGetRenderContext() ->poptCurrent()->GetFloatOption( systemShutterKey ) [ 1 ];
 
 	m_BoundList.Clear();
 
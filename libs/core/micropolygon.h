@@ -52,6 +52,7 @@ class CqImageBuffer;
 class CqSurface;
 class CqMicroPolygon;
 class CqBucketProcessor;
+class CqOcclusionTree;
 
 // This struct holds info about a grid that can be cached and used for all its mpgs.
 struct SqGridInfo
@@ -104,7 +105,7 @@ struct SqMpgSampleInfo
 class CqMicroPolyGridBase : public CqRefCount
 {
 	public:
-		CqMicroPolyGridBase() : m_fCulled( false ), m_fTriangular( false )
+		CqMicroPolyGridBase() : m_fCulled( false ), m_fOcclusionCulled( false ), m_fTriangular( false )
 		{}
 		virtual	~CqMicroPolyGridBase()
 		{}
@@ -114,8 +115,12 @@ class CqMicroPolyGridBase : public CqRefCount
 		 */
 		virtual	void	Split( long xmin, long xmax, long ymin, long ymax ) = 0;
 		/** Pure virtual, shade the grid.
+		 * \param canCullGrid Whether the whole grid may be culled.
+		 * \param occlusion If non-null, the grid is tested against this depth
+		 * tree after displacement and culled before surface shading if it's
+		 * completely hidden.
 		 */
-		virtual	void	Shade(bool canCullGrid = true ) = 0;
+		virtual	void	Shade(bool canCullGrid = true, const CqOcclusionTree* occlusion = 0 ) = 0;
 		virtual	void	TransferOutputVariables() = 0;
 		/*
 		 * Delete all the variables per grid 
@@ -134,6 +139,21 @@ class CqMicroPolyGridBase : public CqRefCount
 		{
 			return m_fCulled;
 		}
+		/** Query whether the grid was culled by the occlusion test in Shade().
+		 */
+		bool vfOcclusionCulled() const
+		{
+			return m_fOcclusionCulled;
+		}
+		/** Get the raster bound used for the occlusion test.
+		 *
+		 * Only valid if vfOcclusionCulled() is true.  The bound is in the same
+		 * hybrid raster/camera space as CqSurface::GetCachedRasterBound().
+		 */
+		const CqBound& OcclusionBound() const
+		{
+			return m_occlusionBound;
+		}
 		/** Query whether this grid is being rendered as a triangle.
 		 */
 		virtual bool fTriangular() const
@@ -197,6 +217,8 @@ class CqMicroPolyGridBase : public CqRefCount
 
 	protected:
 		bool m_fCulled; ///< Boolean indicating the entire grid is culled.
+		bool m_fOcclusionCulled; ///< Boolean indicating the grid was culled as hidden before shading.
+		CqBound m_occlusionBound; ///< Displaced raster bound of the grid, used for occlusion culling.
 		CqTriangleSplitLine	m_TriangleSplitLine;	///< Two endpoints of the line that is used to turn the quad into a triangle at sample time.
 		bool	m_fTriangular;			///< Flag indicating that this grid should be rendered as a triangular grid with a phantom fourth corner.
 
@@ -231,6 +253,18 @@ class CqMicroPolyGrid : public CqMicroPolyGridBase
 
 		virtual void CalcNormals();
 		virtual void CalcSurfaceDerivatives();
+		/** \brief Compute the bound of the grid points in raster space.
+		 *
+		 * The bound is expanded for depth of field and the filter width in
+		 * the same way as CqImageBuffer::CullSurface() expands surface
+		 * bounds, and z is left in camera space.
+		 *
+		 * \param bound - returns the bound.
+		 * \return false if no conservative bound can be computed from P
+		 *         alone, for instance when the grid is motion blurred or
+		 *         crosses the epsilon plane.
+		 */
+		virtual bool CalcRasterBound(CqBound& bound);
 		/** \brief Expand the boundary micropolygons to cover grid cracks.
 		 *
 		 * This function expands the boundary of a grid by moving the boundary
@@ -289,7 +323,7 @@ class CqMicroPolyGrid : public CqMicroPolyGridBase
 
 		// Overrides from CqMicroPolyGridBase
 		virtual	void	Split( long xmin, long xmax, long ymin, long ymax );
-		virtual	void	Shade( bool canCullGrid = true );
+		virtual	void	Shade( bool canCullGrid = true, const CqOcclusionTree* occlusion = 0 );
 		virtual	void	TransferOutputVariables();
 
 		/** Get a pointer to the surface which this grid belongs.
@@ -408,7 +442,7 @@ class CqMotionMicroPolyGrid : public CqMicroPolyGridBase, public CqMotionSpec<Cq
 
 
 		virtual	void	Split( long xmin, long xmax, long ymin, long ymax );
-		virtual	void	Shade( bool canCullGrid = true );
+		virtual	void	Shade( bool canCullGrid = true, const CqOcclusionTree* occlusion = 0 );
 		virtual	void	TransferOutputVariables();
 		
 		/**
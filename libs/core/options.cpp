@@ -237,6 +237,7 @@ CqOptions& CqOptions::operator=( const CqOptions& From )
 	{
 		m_aOptions[ i ] = From.m_aOptions[ i ];
 	}
+	m_aOptionsById = From.m_aOptionsById;
 
 	return ( *this );
 }
@@ -342,14 +343,31 @@ boost::shared_ptr<CqNamedParameterList> CqOptions::pOptionWrite( const char* str
 			{
 				boost::shared_ptr<CqNamedParameterList> pNew( new CqNamedParameterList( *( *i ) ) );
 				( *i ) = pNew;
+				indexOption( pNew.get(), true );
 				return ( pNew );
 			}
 		}
 	}
-	m_aOptions.push_back( boost::shared_ptr<CqNamedParameterList>( new CqNamedParameterList( strName ) ) );
+	AddOption( boost::shared_ptr<CqNamedParameterList>( new CqNamedParameterList( strName ) ) );
 	return ( m_aOptions.back() );
 }
 
+//---------------------------------------------------------------------
+/** Add an option to the index used for lookups by interned key.
+ * \param pOption The option to add.
+ * \param replace If false, an existing option of the same name is kept,
+ *                matching the lookup by name which finds the first one.
+ */
+
+void CqOptions::indexOption( CqNamedParameterList* pOption, bool replace )
+{
+	TqUint id = pOption->id();
+	if ( id >= m_aOptionsById.size() )
+		m_aOptionsById.resize( id + 1, 0 );
+	if ( replace || !m_aOptionsById[ id ] )
+		m_aOptionsById[ id ] = pOption;
+}
+
 //---------------------------------------------------------------------
 /** Get a system option parameter, takes name and parameter name.
  * \param strName The name of the option.
@@ -634,6 +652,60 @@ const CqColor* CqOptions::GetColorOption( const char* strName, const char* strPa
 		return ( 0 );
 }
 
+//---------------------------------------------------------------------
+/** \name Option access by interned key
+ * These are equivalent to the versions taking option and parameter names,
+ * but avoid any string lookups.
+ */
+//@{
+
+const TqFloat* CqOptions::GetFloatOption( const CqParameterKey& key ) const
+{
+	const CqParameter * pParam = pParameter( key );
+	if ( pParam != 0 )
+		return ( static_cast<const CqParameterTyped<TqFloat, TqFloat>*>( pParam ) ->pValue() );
+	else
+		return ( 0 );
+}
+
+const TqInt* CqOptions::GetIntegerOption( const CqParameterKey& key ) const
+{
+	const CqParameter * pParam = pParameter( key );
+	if ( pParam != 0 )
+		return ( static_cast<const CqParameterTyped<TqInt, TqFloat>*>( pParam ) ->pValue() );
+	else
+		return ( 0 );
+}
+
+const CqString* CqOptions::GetStringOption( const CqParameterKey& key ) const
+{
+	const CqParameter * pParam = pParameter( key );
+	if ( pParam != 0 )
+		return ( static_cast<const CqParameterTyped<CqString, CqString>*>( pParam ) ->pValue() );
+	else
+		return ( 0 );
+}
+
+const CqVector3D* CqOptions::GetPointOption( const CqParameterKey& key ) const
+{
+	const CqParameter * pParam = pParameter( key );
+	if ( pParam != 0 )
+		return ( static_cast<const CqParameterTyped<CqVector3D, CqVector3D>*>( pParam ) ->pValue() );
+	else
+		return ( 0 );
+}
+
+const CqColor* CqOptions::GetColorOption( const CqParameterKey& key ) const
+{
+	const CqParameter * pParam = pParameter( key );
+	if ( pParam != 0 )
+		return ( static_cast<const CqParameterTyped<CqColor, CqColor>*>( pParam ) ->pValue() );
+	else
+		return ( 0 );
+}
+
+//@}
+
 EqVariableType CqOptions::getParameterType(const char* strName, const char* strParam) const
 {
 	const CqParameter* pParam = pParameter(strName, strParam);
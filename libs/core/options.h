@@ -68,12 +68,14 @@ class CqOptions : public IqOptions
 		void	AddOption( const boost::shared_ptr<CqNamedParameterList>& pOption )
 		{
 			m_aOptions.push_back( pOption );
+			indexOption( pOption.get(), false );
 		}
 		/** Clear all user options from the state.
 		 */
 		void	ClearOptions()
 		{
 			m_aOptions.clear();
+			m_aOptionsById.clear();
 			InitialiseDefaultOptions();
 		}
 		/** Initialise default system options.
@@ -91,12 +93,28 @@ class CqOptions : public IqOptions
 		boost::shared_ptr<CqNamedParameterList> pOptionWrite( const char* strName );
 		const	CqParameter* pParameter( const char* strName, const char* strParam ) const;
 		CqParameter* pParameterWrite( const char* strName, const char* strParam );
+		/** Get a read only pointer to an option parameter using an interned key.
+		 * \return A pointer to the parameter, or 0 if not found.
+		 */
+		const	CqParameter* pParameter( const CqParameterKey& key ) const
+		{
+			TqUint id = key.nameId();
+			if ( id < m_aOptionsById.size() && m_aOptionsById[ id ] )
+				return ( m_aOptionsById[ id ]->pParameter( key ) );
+			return ( 0 );
+		}
 		virtual const	TqFloat*	GetFloatOption( const char* strName, const char* strParam ) const;
 		virtual const	TqInt*	GetIntegerOption( const char* strName, const char* strParam ) const;
 		virtual const	CqString* GetStringOption( const char* strName, const char* strParam ) const;
 		virtual const	CqVector3D*	GetPointOption( const char* strName, const char* strParam ) const;
 		virtual const	CqColor*	GetColorOption( const char* strName, const char* strParam ) const;
 
+		virtual const	TqFloat*	GetFloatOption( const CqParameterKey& key ) const;
+		virtual const	TqInt*	GetIntegerOption( const CqParameterKey& key ) const;
+		virtual const	CqString* GetStringOption( const CqParameterKey& key ) const;
+		virtual const	CqVector3D*	GetPointOption( const CqParameterKey& key ) const;
+		virtual const	CqColor*	GetColorOption( const CqParameterKey& key ) const;
+
 		virtual TqFloat*	GetFloatOptionWrite( const char* strName, const char* strParam, TqInt arraySize = 1 );
 		virtual TqInt*	GetIntegerOptionWrite( const char* strName, const char* strParam, TqInt arraySize = 1 );
 		virtual CqString* GetStringOptionWrite( const char* strName, const char* strParam, TqInt arraySize = 1 );
@@ -155,7 +173,11 @@ class CqOptions : public IqOptions
 		//@}
 
 	private:
+		void	indexOption( CqNamedParameterList* pOption, bool replace );
+
 		std::vector<boost::shared_ptr<CqNamedParameterList> >	m_aOptions;	///< Vector of user specified options.
+		/// The entries of m_aOptions, indexed by the interned option name.
+		std::vector<CqNamedParameterList*>	m_aOptionsById;
 
 		RtFilterFunc m_funcFilter;						///< Pointer to the pixel filter function.
 		CqImagersource* m_pshadImager;		///< Pointer to the imager shader.
@@ -374,11 +374,16 @@ CqParameter* ( *gVariableCreateFuncsFaceVertexArray[] ) ( const char* strName, T
 
 CqNamedParameterList::CqNamedParameterList( const CqNamedParameterList& From ) :
 		m_strName( From.m_strName ),
-		m_hash( From.m_hash)
+		m_aParametersById(),
+		m_hash( From.m_hash),
+		m_id( From.m_id )
 {
+	m_aParametersById.reserve( From.m_aParametersById.size() );
 	for ( std::map<std::string, CqParameter*>::const_iterator i = From.m_aParameters.begin(); i != From.m_aParameters.end(); i++ )
 	{
-		m_aParameters[i->first] = i->second->Clone();
+		CqParameter* pParameter = i->second->Clone();
+		m_aParameters[i->first] = pParameter;
+		setParameterById( CqNameTable::find( i->first.c_str() ), pParameter );
 	}
 }
 
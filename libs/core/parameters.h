@@ -29,8 +29,10 @@
 
 #include	<aqsis/aqsis.h>
 
-#include <vector>
+#include <algorithm>
 #include <map>
+#include <utility>
+#include <vector>
 
 #include	<boost/shared_ptr.hpp>
 
@@ -38,7 +40,9 @@
 #include	<aqsis/core/isurface.h>
 #include	<aqsis/shadervm/ishaderdata.h>
 #include	<aqsis/core/iparameter.h>
+#include	<aqsis/core/parameterkey.h>
 #include	"bilinear.h"
+#include	"dicecache.h"
 #include	<aqsis/riutil/primvartoken.h>
 #include	<aqsis/math/vectorcast.h>
 
@@ -145,6 +149,11 @@ class CqParameter : public IqParameter
 		 */
 		virtual	void	SetValue(const CqParameter* pFrom, TqInt idxTarget, TqInt idxSource ) = 0;
 
+		/** Pure virtual, add the name, type and values of the parameter to a dice cache key.
+		 * \param key The key to add to.
+		 */
+		virtual	void	AddToDiceKey( CqDiceKey& key ) const = 0;
+
 		/** Get a reference to the parameter name.
 		 */
 		const	CqString& strName() const
@@ -211,6 +220,22 @@ class CqParameterTyped : public CqParameter
 			*pValue( idxTarget ) = *pFromTyped->pValue( idxSource );
 		}
 
+		virtual	void	AddToDiceKey( CqDiceKey& key ) const
+		{
+			key.add( this->m_strName );
+			key.add( static_cast<TqInt>( this->Class() ) );
+			key.add( static_cast<TqInt>( this->Type() ) );
+			key.add( this->m_Count );
+			TqInt size = this->Size();
+			key.add( size );
+			for ( TqInt i = 0; i < size; i++ )
+			{
+				const T* values = pValue( i );
+				for ( TqInt j = 0; j < this->m_Count; j++ )
+					key.add( values[ j ] );
+			}
+		}
+
 	protected:
 };
 
@@ -1569,7 +1594,7 @@ class CqNamedParameterList
 		CqNamedParameterList( const char* strName ) : m_strName( strName )
 		{
 			m_hash = CqString::hash( strName );
-
+			m_id = CqNameTable::intern( strName );
 		}
 		CqNamedParameterList( const CqNamedParameterList& From );
 		~CqNamedParameterList()
@@ -1606,6 +1631,8 @@ class CqNamedParameterList
 			}
 
 			m_aParameters[pParameter->strName()] = const_cast<CqParameter*>( pParameter );
+			setParameterById( CqNameTable::intern( pParameter->strName().c_str() ),
+					const_cast<CqParameter*>( pParameter ) );
 		}
 		/** Get a read only pointer to a named parameter.
 		 * \param strName Character pointer pointing to zero terminated parameter name.
@@ -1635,14 +1662,55 @@ class CqNamedParameterList
 
 			return p;
 		}
+		/** Get a read only pointer to a parameter using an interned key.
+		 * \param key The key, only the parameter name of which is used.
+		 * \return A pointer to a CqParameter or 0 if not found.
+		 */
+		const	CqParameter* pParameter( const CqParameterKey& key ) const
+		{
+			TqParameterIdList::const_iterator i = std::lower_bound(
+					m_aParametersById.begin(), m_aParametersById.end(),
+					key.paramId(), idLess );
+			if( i != m_aParametersById.end() && i->first == key.paramId() )
+				return i->second;
+			return 0;
+		}
 		TqUlong hash()
 		{
 			return m_hash;
 		}
+		/** Get the interned id of the name of this list.
+		 */
+		TqInt id() const
+		{
+			return m_id;
+		}
 	private:
+		/// Parameters paired with the interned ids of their names, sorted by id.
+		typedef std::vector<std::pair<TqInt, CqParameter*> > TqParameterIdList;
+
+		static bool idLess( const std::pair<TqInt, CqParameter*>& entry, TqInt id )
+		{
+			return entry.first < id;
+		}
+		void setParameterById( TqInt id, CqParameter* pParameter )
+		{
+			TqParameterIdList::iterator i = std::lower_bound(
+					m_aParametersById.begin(), m_aParametersById.end(), id, idLess );
+			if( i != m_aParametersById.end() && i->first == id )
+				i->second = pParameter;
+			else
+				m_aParametersById.insert( i, std::make_pair( id, pParameter ) );
+		}
+
 		CqString	m_strName;			///< The name of this parameter list.
 		std::map<std::string, CqParameter*>	m_aParameters;		///< A map of name/value parameters.
+		/// The parameters in m_aParameters, looked up by the interned
+		/// parameter name.  Only the names in this list are stored, however
+		/// many names have been interned.
+		TqParameterIdList	m_aParametersById;
 		TqUlong m_hash;
+		TqInt	m_id;				///< Interned id of m_strName.
 }
 ;
 
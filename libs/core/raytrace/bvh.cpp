@@ -0,0 +1,627 @@
+// Aqsis
+// Copyright (C) 1997 - 2001, Paul C. Gregory
+//
+// Contact: pgregory@aqsis.org
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation; either
+// version 2 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+/** \file
+		\brief Implements a bounding volume hierarchy over triangles for raytracing.
+*/
+
+#include	"bvh.h"
+
+#include	<algorithm>
+#include	<cmath>
+
+#include	<boost/bind.hpp>
+
+#include	"threadscheduler.h"
+
+namespace Aqsis {
+
+namespace {
+
+/// Number of centroid bins per axis used to evaluate the SAH.
+const TqInt numBins = 16;
+/// Nodes with this many triangles or fewer always become leaves.
+const TqInt minLeafSize = 2;
+/// Largest leaf which will be created when splitting doesn't pay off.
+const TqInt maxLeafSize = 8;
+/// Nodes deeper than this become leaves regardless of their size.
+const TqInt maxDepth = 56;
+/// Smallest subtree which is worth handing to a worker thread.
+const TqInt minTaskSize = 4096;
+/// SAH cost of traversing a node, relative to one ray-triangle test.
+const TqFloat traversalCost = 1.0f;
+
+/// Size of the traversal stacks; must exceed maxDepth.
+const TqInt traversalStackSize = 64;
+
+/** Moller-Trumbore ray-triangle intersection.
+ *
+ * On a hit between tMin and tMax, returns true and fills in t, u and v.
+ */
+inline bool intersectTriangle(const SqRayTriangle& tri,
+		const TqFloat org[3], const TqFloat dir[3], TqFloat tMin, TqFloat tMax,
+		TqFloat& t, TqFloat& u, TqFloat& v)
+{
+	const TqFloat e1[3] = {tri.e1.x(), tri.e1.y(), tri.e1.z()};
+	const TqFloat e2[3] = {tri.e2.x(), tri.e2.y(), tri.e2.z()};
+	const TqFloat v0[3] = {tri.v0.x(), tri.v0.y(), tri.v0.z()};
+	TqFloat px = dir[1]*e2[2] - dir[2]*e2[1];
+	TqFloat py = dir[2]*e2[0] - dir[0]*e2[2];
+	TqFloat pz = dir[0]*e2[1] - dir[1]*e2[0];
+	TqFloat det = e1[0]*px + e1[1]*py + e1[2]*pz;
+	if(std::fabs(det) < 1e-20f)
+		return false;
+	TqFloat invDet = 1.0f/det;
+	TqFloat sx = org[0] - v0[0];
+	TqFloat sy = org[1] - v0[1];
+	TqFloat sz = org[2] - v0[2];
+	u = (sx*px + sy*py + sz*pz)*invDet;
+	if(u < 0 || u > 1)
+		return false;
+	TqFloat qx = sy*e1[2] - sz*e1[1];
+	TqFloat qy = sz*e1[0] - sx*e1[2];
+	TqFloat qz = sx*e1[1] - sy*e1[0];
+	v = (dir[0]*qx + dir[1]*qy + dir[2]*qz)*invDet;
+	if(v < 0 || u + v > 1)
+		return false;
+	t = (e2[0]*qx + e2[1]*qy + e2[2]*qz)*invDet;
+	return t > tMin && t < tMax;
+}
+
+/// Reciprocal of a ray direction component, avoiding infinities.
+inline TqFloat safeInverse(TqFloat d)
+{
+	const TqFloat eps = 1e-12f;
+	if(std::fabs(d) < eps)
+		d = d < 0 ? -eps : eps;
+	return 1.0f/d;
+}
+
+} // unnamed namespace
+
+
+//------------------------------------------------------------------------------
+// CqRayBvh::SqBox
+
+CqRayBvh::SqBox::SqBox()
+{
+	min[0] = min[1] = min[2] = FLT_MAX;
+	max[0] = max[1] = max[2] = -FLT_MAX;
+}
+
+void CqRayBvh::SqBox::extend(const SqBox& b)
+{
+	for(TqInt i = 0; i < 3; ++i)
+	{
+		min[i] = std::min(min[i], b.min[i]);
+		max[i] = std::max(max[i], b.max[i]);
+	}
+}
+
+void CqRayBvh::SqBox::extend(const TqFloat p[3])
+{
+	for(TqInt i = 0; i < 3; ++i)
+	{
+		min[i] = std::min(min[i], p[i]);
+		max[i] = std::max(max[i], p[i]);
+	}
+}
+
+TqFloat CqRayBvh::SqBox::area() const
+{
+	TqFloat dx = max[0] - min[0];
+	TqFloat dy = max[1] - min[1];
+	TqFloat dz = max[2] - min[2];
+	if(dx < 0 || dy < 0 || dz < 0)
+		return 0;
+	return 2*(dx*dy + dy*dz + dz*dx);
+}
+
+
+//------------------------------------------------------------------------------
+// CqRayBvh::SqCentroidLess
+
+struct CqRayBvh::SqCentroidLess
+{
+	TqInt axis;
+
+	SqCentroidLess(TqInt a)
+		: axis(a)
+	{}
+	bool operator()(const SqBuildPrim& a, const SqBuildPrim& b) const
+	{
+		return a.centroid[axis] < b.centroid[axis];
+	}
+};
+
+
+//------------------------------------------------------------------------------
+// CqRayBvh::SqRayPacket
+
+struct CqRayBvh::SqRayPacket
+{
+	TqFloat ox[4], oy[4], oz[4];
+	TqFloat dx[4], dy[4], dz[4];
+	TqFloat ix[4], iy[4], iz[4];
+	TqFloat tMin[4], tMax[4];
+
+	/// Load up to four rays; unused lanes are set up so they never hit.
+	SqRayPacket(const SqRay* rays, TqInt numRays)
+	{
+		for(TqInt k = 0; k < 4; ++k)
+		{
+			const SqRay& r = rays[k < numRays ? k : 0];
+			ox[k] = r.origin.x();
+			oy[k] = r.origin.y();
+			oz[k] = r.origin.z();
+			dx[k] = r.direction.x();
+			dy[k] = r.direction.y();
+			dz[k] = r.direction.z();
+			ix[k] = safeInverse(dx[k]);
+			iy[k] = safeInverse(dy[k]);
+			iz[k] = safeInverse(dz[k]);
+			tMin[k] = r.tMin;
+			tMax[k] = k < numRays ? r.tMax : -FLT_MAX;
+		}
+	}
+
+	/// Return a mask of the lanes which overlap the given box.
+	TqInt hitBox(const SqBox& b) const
+	{
+		bool hit[4];
+		for(TqInt k = 0; k < 4; ++k)
+		{
+			TqFloat x0 = (b.min[0] - ox[k])*ix[k];
+			TqFloat x1 = (b.max[0] - ox[k])*ix[k];
+			TqFloat y0 = (b.min[1] - oy[k])*iy[k];
+			TqFloat y1 = (b.max[1] - oy[k])*iy[k];
+			TqFloat z0 = (b.min[2] - oz[k])*iz[k];
+			TqFloat z1 = (b.max[2] - oz[k])*iz[k];
+			TqFloat tNear = std::max(std::max(std::min(x0, x1), std::min(y0, y1)),
+								std::max(std::min(z0, z1), tMin[k]));
+			TqFloat tFar = std::min(std::min(std::max(x0, x1), std::max(y0, y1)),
+								std::min(std::max(z0, z1), tMax[k]));
+			hit[k] = tNear <= tFar;
+		}
+		return hit[0] | (hit[1] << 1) | (hit[2] << 2) | (hit[3] << 3);
+	}
+};
+
+
+//------------------------------------------------------------------------------
+// CqRayBvh
+
+CqRayBvh::CqRayBvh()
+	: m_nodes(),
+	m_triangles(),
+	m_prims(),
+	m_taskDepth(0)
+{ }
+
+void CqRayBvh::clear()
+{
+	TqNodeList().swap(m_nodes);
+	std::vector<SqRayTriangle>().swap(m_triangles);
+}
+
+void CqRayBvh::build(std::vector<SqRayTriangle>& triangles, TqInt numThreads)
+{
+	clear();
+	if(triangles.empty())
+		return;
+
+	// Set up bounds and centroids of all triangles.
+	TqInt numTris = triangles.size();
+	m_prims.resize(numTris);
+	for(TqInt i = 0; i < numTris; ++i)
+	{
+		const SqRayTriangle& tri = triangles[i];
+		SqBuildPrim& prim = m_prims[i];
+		prim.bound = SqBox();
+		CqVector3D verts[3] = {tri.v0, tri.v0 + tri.e1, tri.v0 + tri.e2};
+		for(TqInt j = 0; j < 3; ++j)
+		{
+			TqFloat p[3] = {verts[j].x(), verts[j].y(), verts[j].z()};
+			prim.bound.extend(p);
+		}
+		for(TqInt j = 0; j < 3; ++j)
+			prim.centroid[j] = 0.5f*(prim.bound.min[j] + prim.bound.max[j]);
+		prim.triangle = i;
+	}
+
+	// Build the top of the tree here, deferring large subtrees below
+	// m_taskDepth to the worker threads.
+	std::vector<SqBuildTask> tasks;
+	m_taskDepth = 0;
+	if(numThreads > 1)
+	{
+		while((1 << m_taskDepth) < 4*numThreads)
+			++m_taskDepth;
+	}
+	m_nodes.resize(1);
+	buildNode(m_nodes, 0, 0, numTris, 0, numThreads > 1 ? &tasks : 0);
+
+	if(!tasks.empty())
+	{
+		CqThreadScheduler scheduler(numThreads);
+		for(TqInt i = 0, end = tasks.size(); i < end; ++i)
+			scheduler.addWorkUnit(boost::bind(&CqRayBvh::buildTask, this, &tasks[i]));
+		scheduler.joinAll();
+
+		// Splice the subtrees into the main node list.  Local node 0 takes
+		// the place of the placeholder; the rest are appended in order.
+		for(TqInt i = 0, end = tasks.size(); i < end; ++i)
+		{
+			TqNodeList& local = tasks[i].nodes;
+			TqInt base = m_nodes.size() - 1;
+			for(TqInt j = 0, numLocal = local.size(); j < numLocal; ++j)
+			{
+				SqNode& n = local[j];
+				if(n.count == 0)
+					n.index += base;
+			}
+			m_nodes[tasks[i].node] = local[0];
+			m_nodes.insert(m_nodes.end(), local.begin() + 1, local.end());
+		}
+	}
+
+	// Reorder the triangles to match the leaves.
+	m_triangles.resize(numTris);
+	for(TqInt i = 0; i < numTris; ++i)
+		m_triangles[i] = triangles[m_prims[i].triangle];
+	std::vector<SqBuildPrim>().swap(m_prims);
+	std::vector<SqRayTriangle>().swap(triangles);
+}
+
+void CqRayBvh::buildTask(SqBuildTask* task)
+{
+	task->nodes.resize(1);
+	buildNode(task->nodes, 0, task->begin, task->end, m_taskDepth, 0);
+}
+
+void CqRayBvh::buildNode(TqNodeList& nodes, TqInt nodeIndex, TqInt begin,
+		TqInt end, TqInt depth, std::vector<SqBuildTask>* tasks)
+{
+	TqInt count = end - begin;
+	if(tasks && depth >= m_taskDepth && count >= minTaskSize)
+	{
+		SqBuildTask task;
+		task.node = nodeIndex;
+		task.begin = begin;
+		task.end = end;
+		tasks->push_back(task);
+		return;
+	}
+
+	SqBox bound;
+	SqBox centroidBound;
+	for(TqInt i = begin; i < end; ++i)
+	{
+		bound.extend(m_prims[i].bound);
+		centroidBound.extend(m_prims[i].centroid);
+	}
+	nodes[nodeIndex].bound = bound;
+	nodes[nodeIndex].axis = 0;
+
+	TqInt axis = 0;
+	TqInt mid = begin;
+	bool makeLeaf = count <= minLeafSize || depth >= maxDepth;
+	if(!makeLeaf && !findSplit(centroidBound, begin, end, axis, mid))
+	{
+		if(count <= maxLeafSize)
+			makeLeaf = true;
+		else
+		{
+			// The SAH couldn't separate the centroids (they're probably all
+			// coincident); fall back to splitting the list in half.
+			for(TqInt i = 1; i < 3; ++i)
+			{
+				if(centroidBound.max[i] - centroidBound.min[i] >
+						centroidBound.max[axis] - centroidBound.min[axis])
+					axis = i;
+			}
+			mid = (begin + end)/2;
+			std::nth_element(m_prims.begin() + begin, m_prims.begin() + mid,
+				m_prims.begin() + end, SqCentroidLess(axis));
+		}
+	}
+
+	if(makeLeaf)
+	{
+		nodes[nodeIndex].index = begin;
+		nodes[nodeIndex].count = count;
+		return;
+	}
+
+	TqInt child = nodes.size();
+	nodes.resize(child + 2);
+	nodes[nodeIndex].index = child;
+	nodes[nodeIndex].count = 0;
+	nodes[nodeIndex].axis = axis;
+	buildNode(nodes, child, begin, mid, depth + 1, tasks);
+	buildNode(nodes, child + 1, mid, end, depth + 1, tasks);
+}
+
+bool CqRayBvh::findSplit(const SqBox& centroidBound, TqInt begin, TqInt end,
+		TqInt& axis, TqInt& mid)
+{
+	TqInt count = end - begin;
+	TqFloat bestCost = FLT_MAX;
+	TqInt bestAxis = -1;
+	TqInt bestBin = 0;
+	TqFloat nodeArea = 0;
+	for(TqInt a = 0; a < 3; ++a)
+	{
+		TqFloat extent = centroidBound.max[a] - centroidBound.min[a];
+		if(extent <= 0)
+			continue;
+		TqFloat scale = numBins/extent;
+
+		// Accumulate the triangles into bins.
+		SqBox binBounds[numBins];
+		TqInt binCounts[numBins] = {0};
+		for(TqInt i = begin; i < end; ++i)
+		{
+			const SqBuildPrim& prim = m_prims[i];
+			TqInt b = std::min(numBins - 1, static_cast<TqInt>(
+						(prim.centroid[a] - centroidBound.min[a])*scale));
+			++binCounts[b];
+			binBounds[b].extend(prim.bound);
+		}
+
+		// Sweep from the right to get the area and count of everything to
+		// the right of each split plane, then from the left to evaluate the
+		// cost of each plane.
+		TqFloat rightArea[numBins];
+		TqInt rightCount[numBins];
+		SqBox acc;
+		TqInt n = 0;
+		for(TqInt b = numBins - 1; b > 0; --b)
+		{
+			acc.extend(binBounds[b]);
+			n += binCounts[b];
+			rightArea[b] = acc.area();
+			rightCount[b] = n;
+		}
+		acc.extend(binBounds[0]);
+		nodeArea = acc.area();
+		acc = SqBox();
+		n = 0;
+		for(TqInt b = 0; b < numBins - 1; ++b)
+		{
+			acc.extend(binBounds[b]);
+			n += binCounts[b];
+			if(n == 0 || rightCount[b+1] == 0)
+				continue;
+			TqFloat cost = n*acc.area() + rightCount[b+1]*rightArea[b+1];
+			if(cost < bestCost)
+			{
+				bestCost = cost;
+				bestAxis = a;
+				bestBin = b;
+			}
+		}
+	}
+	if(bestAxis < 0)
+		return false;
+
+	// Compare against the cost of making a leaf; both costs are in units of
+	// ray-triangle tests.
+	TqFloat splitCost = traversalCost + (nodeArea > 0 ? bestCost/nodeArea : count);
+	if(count <= maxLeafSize && splitCost >= count)
+		return false;
+
+	const TqFloat splitMin = centroidBound.min[bestAxis];
+	const TqFloat scale = numBins/(centroidBound.max[bestAxis] - splitMin);
+	std::vector<SqBuildPrim>& prims = m_prims;
+	TqInt i = begin;
+	TqInt j = end - 1;
+	while(i <= j)
+	{
+		TqInt b = std::min(numBins - 1, static_cast<TqInt>(
+					(prims[i].centroid[bestAxis] - splitMin)*scale));
+		if(b <= bestBin)
+			++i;
+		else
+			std::swap(prims[i], prims[j--]);
+	}
+	if(i == begin || i == end)
+		return false;
+	axis = bestAxis;
+	mid = i;
+	return true;
+}
+
+bool CqRayBvh::intersect(const SqRay& ray, SqBvhHit& hit) const
+{
+	return traverse<false>(ray, hit);
+}
+
+bool CqRayBvh::occluded(const SqRay& ray) const
+{
+	SqBvhHit hit;
+	return traverse<true>(ray, hit);
+}
+
+void CqRayBvh::intersect(const SqRay* rays, SqBvhHit* hits, TqInt numRays) const
+{
+	for(TqInt i = 0; i < numRays; i += 4)
+		traversePacket<false>(rays + i, std::min(4, numRays - i), hits + i, 0);
+}
+
+void CqRayBvh::occluded(const SqRay* rays, bool* occluded, TqInt numRays) const
+{
+	SqBvhHit hits[4];
+	for(TqInt i = 0; i < numRays; i += 4)
+		traversePacket<true>(rays + i, std::min(4, numRays - i), hits, occluded + i);
+}
+
+template<bool anyHit>
+bool CqRayBvh::traverse(const SqRay& ray, SqBvhHit& hit) const
+{
+	hit.triangle = -1;
+	if(m_triangles.empty())
+		return false;
+
+	TqFloat org[3] = {ray.origin.x(), ray.origin.y(), ray.origin.z()};
+	TqFloat dir[3] = {ray.direction.x(), ray.direction.y(), ray.direction.z()};
+	TqFloat invDir[3];
+	for(TqInt i = 0; i < 3; ++i)
+		invDir[i] = safeInverse(dir[i]);
+	TqFloat tMax = ray.tMax;
+
+	TqInt stack[traversalStackSize];
+	TqInt stackSize = 0;
+	TqInt nodeIndex = 0;
+	while(true)
+	{
+		const SqNode& node = m_nodes[nodeIndex];
+		const SqBox& b = node.bound;
+		TqFloat tNear = ray.tMin;
+		TqFloat tFar = tMax;
+		for(TqInt i = 0; i < 3; ++i)
+		{
+			TqFloat t0 = (b.min[i] - org[i])*invDir[i];
+			TqFloat t1 = (b.max[i] - org[i])*invDir[i];
+			if(t0 > t1)
+				std::swap(t0, t1);
+			tNear = std::max(tNear, t0);
+			tFar = std::min(tFar, t1);
+		}
+		if(tNear <= tFar)
+		{
+			if(node.count > 0)
+			{
+				for(TqInt i = node.index, end = node.index + node.count; i < end; ++i)
+				{
+					TqFloat t, u, v;
+					if(intersectTriangle(m_triangles[i], org, dir, ray.tMin,
+								tMax, t, u, v))
+					{
+						tMax = t;
+						hit.t = t;
+						hit.u = u;
+						hit.v = v;
+						hit.triangle = i;
+						if(anyHit)
+							return true;
+					}
+				}
+			}
+			else
+			{
+				// Visit the nearer child first.
+				TqInt first = node.index;
+				TqInt second = node.index + 1;
+				if(dir[node.axis] < 0)
+					std::swap(first, second);
+				stack[stackSize++] = second;
+				nodeIndex = first;
+				continue;
+			}
+		}
+		if(stackSize == 0)
+			break;
+		nodeIndex = stack[--stackSize];
+	}
+	return hit.triangle >= 0;
+}
+
+template<bool anyHit>
+void CqRayBvh::traversePacket(const SqRay* rays, TqInt numRays,
+		SqBvhHit* hits, bool* occluded) const
+{
+	for(TqInt k = 0; k < numRays; ++k)
+	{
+		hits[k].triangle = -1;
+		if(anyHit)
+			occluded[k] = false;
+	}
+	if(m_triangles.empty())
+		return;
+
+	SqRayPacket packet(rays, numRays);
+	TqInt liveLanes = (1 << numRays) - 1;
+
+	TqInt stack[traversalStackSize];
+	TqInt stackSize = 0;
+	TqInt nodeIndex = 0;
+	while(true)
+	{
+		const SqNode& node = m_nodes[nodeIndex];
+		if(packet.hitBox(node.bound))
+		{
+			if(node.count > 0)
+			{
+				for(TqInt i = node.index, end = node.index + node.count; i < end; ++i)
+				{
+					const SqRayTriangle& tri = m_triangles[i];
+					for(TqInt k = 0; k < numRays; ++k)
+					{
+						if(!(liveLanes & (1 << k)))
+							continue;
+						TqFloat org[3] = {packet.ox[k], packet.oy[k], packet.oz[k]};
+						TqFloat dir[3] = {packet.dx[k], packet.dy[k], packet.dz[k]};
+						TqFloat t, u, v;
+						if(intersectTriangle(tri, org, dir, packet.tMin[k],
+									packet.tMax[k], t, u, v))
+						{
+							hits[k].t = t;
+							hits[k].u = u;
+							hits[k].v = v;
+							hits[k].triangle = i;
+							if(anyHit)
+							{
+								// Retire the lane; a negative range means
+								// it never overlaps another box.
+								occluded[k] = true;
+								liveLanes &= ~(1 << k);
+								packet.tMax[k] = -FLT_MAX;
+							}
+							else
+								packet.tMax[k] = t;
+						}
+					}
+					if(anyHit && !liveLanes)
+						return;
+				}
+			}
+			else
+			{
+				// Order the children using the direction of the first ray;
+				// rays in a packet are assumed to be roughly coherent.
+				TqInt first = node.index;
+				TqInt second = node.index + 1;
+				const TqFloat* d = node.axis == 0 ? packet.dx
+					: (node.axis == 1 ? packet.dy : packet.dz);
+				if(d[0] < 0)
+					std::swap(first, second);
+				stack[stackSize++] = second;
+				nodeIndex = first;
+				continue;
+			}
+		}
+		if(stackSize == 0)
+			break;
+		nodeIndex = stack[--stackSize];
+	}
+}
+
+} // namespace Aqsis
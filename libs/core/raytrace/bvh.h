@@ -0,0 +1,219 @@
+// Aqsis
+// Copyright (C) 1997 - 2001, Paul C. Gregory
+//
+// Contact: pgregory@aqsis.org
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation; either
+// version 2 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+/** \file
+		\brief Declares a bounding volume hierarchy over triangles for raytracing.
+*/
+
+#ifndef	BVH_H_INCLUDED
+#define	BVH_H_INCLUDED 1
+
+#include	<aqsis/aqsis.h>
+
+#include	<vector>
+
+#include	<aqsis/core/iraytrace.h>
+#include	<aqsis/math/vector3d.h>
+
+namespace Aqsis {
+
+//----------------------------------------------------------------------
+/** \brief A triangle stored in the ray acceleration structure.
+ *
+ * The triangle is stored as a vertex and two edges, which is the form needed
+ * by the Moller-Trumbore intersection test.
+ */
+struct SqRayTriangle
+{
+	CqVector3D	v0;		///< First vertex
+	CqVector3D	e1;		///< Second vertex minus the first
+	CqVector3D	e2;		///< Third vertex minus the first
+	TqInt		id;		///< User data, normally the index of the owning primitive.
+
+	SqRayTriangle()
+		: v0(), e1(), e2(), id(0)
+	{}
+	SqRayTriangle(const CqVector3D& a, const CqVector3D& b,
+			const CqVector3D& c, TqInt primId)
+		: v0(a), e1(b - a), e2(c - a), id(primId)
+	{}
+};
+
+/// Result of a ray query against a CqRayBvh.
+struct SqBvhHit
+{
+	TqFloat	t;			///< Ray parameter of the hit
+	TqFloat	u;			///< Barycentric coordinate along e1
+	TqFloat	v;			///< Barycentric coordinate along e2
+	TqInt	triangle;	///< Index of the triangle hit, or -1 for a miss.
+};
+
+
+//----------------------------------------------------------------------
+/** \brief Bounding volume hierarchy over a static set of triangles.
+ *
+ * The tree is built top down using the surface area heuristic evaluated over
+ * a fixed number of centroid bins per axis.  When more than one thread is
+ * available the lower levels of the tree are built in parallel on a
+ * CqThreadScheduler.
+ *
+ * Queries come in two flavours: single rays, and packets of up to four rays
+ * traversed together.  The packet code keeps each lane's data in separate
+ * arrays so the inner loops over lanes are straightforward for the compiler
+ * to vectorise.
+ */
+class CqRayBvh
+{
+	public:
+		CqRayBvh();
+
+		/** Build the hierarchy, replacing any existing contents.
+		 *
+		 * \param triangles - triangles to store.  The contents are consumed
+		 *                    (the vector is left empty).
+		 * \param numThreads - number of threads to use for the build.
+		 */
+		void build(std::vector<SqRayTriangle>& triangles, TqInt numThreads);
+		/// Discard all triangles.
+		void clear();
+
+		/// Return true if there are no triangles in the tree.
+		bool empty() const;
+		/// Number of triangles in the tree
+		TqInt numTriangles() const;
+		/// Number of nodes in the tree
+		TqInt numNodes() const;
+		/// Access a triangle by the index returned in a SqBvhHit
+		const SqRayTriangle& triangle(TqInt index) const;
+
+		/// Find the closest hit along a ray.
+		bool intersect(const SqRay& ray, SqBvhHit& hit) const;
+		/// Determine whether there is any hit along a ray.
+		bool occluded(const SqRay& ray) const;
+		/** Find the closest hits for an array of rays.
+		 *
+		 * Rays are traced in packets of four.  Misses are signalled by
+		 * setting hits[i].triangle to -1.
+		 */
+		void intersect(const SqRay* rays, SqBvhHit* hits, TqInt numRays) const;
+		/// Determine which of an array of rays hit anything.
+		void occluded(const SqRay* rays, bool* occluded, TqInt numRays) const;
+
+	private:
+		/// Axis aligned box used for both nodes and build primitives.
+		struct SqBox
+		{
+			TqFloat min[3];
+			TqFloat max[3];
+
+			SqBox();
+			void extend(const SqBox& b);
+			void extend(const TqFloat p[3]);
+			TqFloat area() const;
+		};
+
+		/** A node in the flattened tree.
+		 *
+		 * Interior nodes have count == 0 and store the index of their first
+		 * child; the second child always follows the first.  Leaves store
+		 * the index of their first triangle and the number of triangles.
+		 */
+		struct SqNode
+		{
+			SqBox	bound;
+			TqInt	index;
+			TqInt	count;
+			TqInt	axis;
+		};
+
+		/// Per-triangle data used during the build.
+		struct SqBuildPrim
+		{
+			SqBox	bound;
+			TqFloat	centroid[3];
+			TqInt	triangle;
+		};
+
+		typedef std::vector<SqNode> TqNodeList;
+
+		/// A subtree which is deferred to be built by a worker thread.
+		struct SqBuildTask
+		{
+			TqInt		node;
+			TqInt		begin;
+			TqInt		end;
+			TqNodeList	nodes;
+		};
+
+		/// Four rays with their data split into per-lane arrays.
+		struct SqRayPacket;
+		/// Orders build primitives by centroid along an axis.
+		struct SqCentroidLess;
+
+		void buildNode(TqNodeList& nodes, TqInt nodeIndex, TqInt begin,
+				TqInt end, TqInt depth, std::vector<SqBuildTask>* tasks);
+		void buildTask(SqBuildTask* task);
+		bool findSplit(const SqBox& centroidBound, TqInt begin, TqInt end,
+				TqInt& axis, TqInt& mid);
+
+		template<bool anyHit>
+		bool traverse(const SqRay& ray, SqBvhHit& hit) const;
+		template<bool anyHit>
+		void traversePacket(const SqRay* rays, TqInt numRays, SqBvhHit* hits,
+				bool* occluded) const;
+
+		/// Flattened tree nodes; the root is node 0.
+		TqNodeList m_nodes;
+		/// Triangles, ordered so that each leaf refers to a contiguous range.
+		std::vector<SqRayTriangle> m_triangles;
+		/// Scratch space for the build.
+		std::vector<SqBuildPrim> m_prims;
+		/// Depth of the tree at which subtrees are handed to worker threads.
+		TqInt m_taskDepth;
+};
+
+
+//------------------------------------------------------------
+// Implementation details
+//------------------------------------------------------------
+
+inline bool CqRayBvh::empty() const
+{
+	return m_triangles.empty();
+}
+
+inline TqInt CqRayBvh::numTriangles() const
+{
+	return m_triangles.size();
+}
+
+inline TqInt CqRayBvh::numNodes() const
+{
+	return m_nodes.size();
+}
+
+inline const SqRayTriangle& CqRayBvh::triangle(TqInt index) const
+{
+	return m_triangles[index];
+}
+
+} // namespace Aqsis
+
+#endif // BVH_H_INCLUDED
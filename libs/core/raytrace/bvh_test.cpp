@@ -0,0 +1,163 @@
+// Aqsis
+// Copyright (C) 1997 - 2001, Paul C. Gregory
+//
+// Contact: pgregory@aqsis.org
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation; either
+// version 2 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+/** \file Unit tests for the raytracing BVH.
+ */
+
+#include "bvh.h"
+
+#include <vector>
+#include <cstdlib>
+
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/auto_unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(bvh_tests)
+
+using namespace Aqsis;
+
+namespace {
+
+TqFloat randf()
+{
+	return std::rand()/static_cast<TqFloat>(RAND_MAX);
+}
+
+CqVector3D randPoint(TqFloat scale)
+{
+	return CqVector3D(scale*(randf()-0.5f), scale*(randf()-0.5f),
+			scale*(randf()-0.5f));
+}
+
+// A soup of small random triangles in a 10 unit cube.
+void makeTriangles(std::vector<SqRayTriangle>& tris, TqInt numTris)
+{
+	for(TqInt i = 0; i < numTris; ++i)
+	{
+		CqVector3D c = randPoint(10);
+		tris.push_back(SqRayTriangle(c + randPoint(1), c + randPoint(1),
+					c + randPoint(1), i));
+	}
+}
+
+SqRay randRay()
+{
+	CqVector3D org = randPoint(20);
+	CqVector3D target = randPoint(8);
+	return SqRay(org, target - org, 0, 2);
+}
+
+// Closest hit, found by testing every triangle.
+TqFloat bruteForceHit(const std::vector<SqRayTriangle>& tris, const SqRay& ray)
+{
+	TqFloat tHit = -1;
+	for(TqInt i = 0, end = tris.size(); i < end; ++i)
+	{
+		std::vector<SqRayTriangle> one(1, tris[i]);
+		CqRayBvh bvh;
+		bvh.build(one, 1);
+		SqBvhHit hit;
+		if(bvh.intersect(ray, hit) && (tHit < 0 || hit.t < tHit))
+			tHit = hit.t;
+	}
+	return tHit;
+}
+
+void checkAgainstBruteForce(TqInt numTris, TqInt numThreads)
+{
+	std::srand(42);
+	std::vector<SqRayTriangle> tris;
+	makeTriangles(tris, numTris);
+	std::vector<SqRayTriangle> trisCopy = tris;
+	CqRayBvh bvh;
+	bvh.build(trisCopy, numThreads);
+	BOOST_CHECK_EQUAL(bvh.numTriangles(), numTris);
+
+	const TqInt numRays = 50;
+	std::vector<SqRay> rays;
+	for(TqInt i = 0; i < numRays; ++i)
+		rays.push_back(randRay());
+	std::vector<SqBvhHit> packetHits(numRays);
+	bvh.intersect(&rays[0], &packetHits[0], numRays);
+	bool occluded[numRays];
+	bvh.occluded(&rays[0], occluded, numRays);
+
+	for(TqInt i = 0; i < numRays; ++i)
+	{
+		TqFloat tExpected = bruteForceHit(tris, rays[i]);
+		SqBvhHit hit;
+		bool didHit = bvh.intersect(rays[i], hit);
+		BOOST_CHECK_EQUAL(didHit, tExpected >= 0);
+		BOOST_CHECK_EQUAL(packetHits[i].triangle >= 0, tExpected >= 0);
+		BOOST_CHECK_EQUAL(bvh.occluded(rays[i]), tExpected >= 0);
+		BOOST_CHECK_EQUAL(occluded[i], tExpected >= 0);
+		if(didHit)
+		{
+			BOOST_CHECK_CLOSE(hit.t, tExpected, 1e-3f);
+			BOOST_CHECK_CLOSE(packetHits[i].t, tExpected, 1e-3f);
+		}
+	}
+}
+
+} // unnamed namespace
+
+
+BOOST_AUTO_TEST_CASE(bvh_single_triangle)
+{
+	std::vector<SqRayTriangle> tris;
+	tris.push_back(SqRayTriangle(CqVector3D(0,0,1), CqVector3D(1,0,1),
+				CqVector3D(0,1,1), 7));
+	CqRayBvh bvh;
+	bvh.build(tris, 1);
+
+	SqBvhHit hit;
+	BOOST_CHECK(bvh.intersect(SqRay(CqVector3D(0.25f,0.25f,0),
+					CqVector3D(0,0,1)), hit));
+	BOOST_CHECK_CLOSE(hit.t, 1.0f, 1e-4f);
+	BOOST_CHECK_EQUAL(bvh.triangle(hit.triangle).id, 7);
+
+	// Outside the triangle, and beyond the end of the ray.
+	BOOST_CHECK(!bvh.intersect(SqRay(CqVector3D(0.75f,0.75f,0),
+					CqVector3D(0,0,1)), hit));
+	BOOST_CHECK(!bvh.occluded(SqRay(CqVector3D(0.25f,0.25f,0),
+					CqVector3D(0,0,1), 0, 0.5f)));
+}
+
+BOOST_AUTO_TEST_CASE(bvh_empty)
+{
+	std::vector<SqRayTriangle> tris;
+	CqRayBvh bvh;
+	bvh.build(tris, 1);
+	BOOST_CHECK(bvh.empty());
+	SqBvhHit hit;
+	BOOST_CHECK(!bvh.intersect(SqRay(), hit));
+}
+
+BOOST_AUTO_TEST_CASE(bvh_matches_brute_force)
+{
+	checkAgainstBruteForce(5000, 1);
+}
+
+BOOST_AUTO_TEST_CASE(bvh_parallel_build_matches_brute_force)
+{
+	// Large enough that subtrees are handed to the worker threads.
+	checkAgainstBruteForce(50000, 2);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -26,8 +26,27 @@
 #include	<aqsis/aqsis.h>
 #include	"raytrace.h"
 
+#include	<cmath>
+
+#ifdef	ENABLE_THREADING
+#include	<boost/thread.hpp>
+#endif
+
+#include	<aqsis/util/logging.h>
+#include	"micropolygon.h"
+#include	"renderer.h"
+#include	"stats.h"
+#include	"surface.h"
+
 namespace Aqsis {
 
+namespace {
+
+/// Surfaces split more often than this are dropped from the ray database.
+const TqInt maxRaySplits = 24;
+
+} // unnamed namespace
+
 
 /// Required function that implements Class Factory design pattern for Raytrace libraries
 IqRaytrace* CreateRaytracer()
@@ -36,14 +55,249 @@ IqRaytrace* CreateRaytracer()
 }
 
 
-void CqRaytrace::Initialise()
+CqRaytrace::CqRaytrace()
+	: m_surfaces(),
+	m_primitives(),
+	m_bvh()
 {}
 
-void CqRaytrace::AddPrimitive(const boost::shared_ptr<IqSurface>& pSurface)
+CqRaytrace::~CqRaytrace()
 {}
 
+void CqRaytrace::Initialise()
+{
+	m_surfaces.clear();
+	m_primitives.clear();
+	m_bvh.clear();
+}
+
+void CqRaytrace::AddPrimitive(const boost::shared_ptr<IqSurface>& pSurface)
+{
+	boost::shared_ptr<CqSurface> surface
+		= boost::dynamic_pointer_cast<CqSurface>(pSurface);
+	if(!surface)
+		return;
+	const TqInt* trace = surface->pAttributes()->GetIntegerAttribute("visibility", "trace");
+	if(!trace || trace[0] == 0)
+		return;
+
+	// Take a copy, since the original is split and discarded by the main
+	// pipeline.  When rendering in multipass mode the primitive hasn't been
+	// moved into camera space yet, so do that to our copy now.
+	boost::shared_ptr<CqSurface> copy(surface->Clone());
+	if(!copy)
+	{
+		// Some primitives, such as unexpanded procedurals, can't be copied.
+		Aqsis::log() << warning << "Primitive \"" << surface->strName()
+			<< "\" can't be copied, so won't be visible to rays\n";
+		return;
+	}
+	const TqInt* multipass = QGetRenderContext()->GetIntegerOption("Render", "multipass");
+	if(multipass && multipass[0])
+	{
+		CqMatrix matWtoC, matNWtoC, matVWtoC;
+		QGetRenderContext() ->matSpaceToSpace( "world", "camera", NULL, copy->pTransform().get(), 0, matWtoC );
+		QGetRenderContext() ->matNSpaceToSpace( "world", "camera", NULL, copy->pTransform().get(), 0, matNWtoC );
+		QGetRenderContext() ->matVSpaceToSpace( "world", "camera", NULL, copy->pTransform().get(), 0, matVWtoC );
+		copy->Transform( matWtoC, matNWtoC, matVWtoC);
+	}
+	m_surfaces.push_back(copy);
+}
+
 void CqRaytrace::Finalise()
-{}
+{
+	m_primitives.clear();
+	m_bvh.clear();
+	if(m_surfaces.empty())
+		return;
+
+	AQSIS_TIME_SCOPE(Raytrace_build);
+
+	// Dice everything into triangles.  Dicing touches shared attribute and
+	// shader state, so this part is done serially.
+	std::vector<SqRayTriangle> triangles;
+	CqMatrix camToWorld;
+	QGetRenderContext()->matSpaceToSpace("camera", "world", NULL, NULL,
+										 QGetRenderContextI()->Time(),
+										 camToWorld);
+	for(TqInt i = 0, end = m_surfaces.size(); i < end; ++i)
+	{
+		SqTracePrimitive prim;
+		IqAttributesPtr attrs = m_surfaces[i]->pAttributes();
+		const CqColor* color = attrs->GetColorAttribute("System", "Color");
+		const CqColor* opacity = attrs->GetColorAttribute("System", "Opacity");
+		prim.Cs = color ? color[0] : CqColor(1, 1, 1);
+		prim.Os = opacity ? opacity[0] : CqColor(1, 1, 1);
+		m_primitives.push_back(prim);
+		diceSurface(m_surfaces[i], i, camToWorld, triangles);
+	}
+	std::vector<boost::shared_ptr<CqSurface> >().swap(m_surfaces);
+
+	TqInt numThreads = 1;
+#ifdef	ENABLE_THREADING
+	const TqInt* threads = QGetRenderContext()->GetIntegerOption("limits", "threads");
+	if(threads)
+		numThreads = threads[0];
+	if(numThreads <= 0)
+		numThreads = std::max<TqInt>(1, boost::thread::hardware_concurrency());
+#endif
+	TqInt numTriangles = triangles.size();
+	m_bvh.build(triangles, numThreads);
+
+	Aqsis::log() << info << "Raytrace database: " << m_primitives.size()
+		<< " primitives, " << numTriangles << " triangles, "
+		<< m_bvh.numNodes() << " BVH nodes" << std::endl;
+}
+
+bool CqRaytrace::IsEmpty() const
+{
+	return m_bvh.empty();
+}
+
+bool CqRaytrace::Intersect(const SqRay& ray, SqRayHit& hit) const
+{
+	SqBvhHit bvhHit;
+	if(!m_bvh.intersect(ray, bvhHit))
+		return false;
+	fillHit(bvhHit, hit);
+	return true;
+}
+
+bool CqRaytrace::Occluded(const SqRay& ray) const
+{
+	return m_bvh.occluded(ray);
+}
+
+void CqRaytrace::IntersectBatch(const SqRay* rays, SqRayHit* hits,
+		bool* didHit, TqInt numRays) const
+{
+	SqBvhHit bvhHits[4];
+	for(TqInt i = 0; i < numRays; i += 4)
+	{
+		TqInt packetSize = std::min(4, numRays - i);
+		m_bvh.intersect(rays + i, bvhHits, packetSize);
+		for(TqInt k = 0; k < packetSize; ++k)
+		{
+			didHit[i+k] = bvhHits[k].triangle >= 0;
+			if(didHit[i+k])
+				fillHit(bvhHits[k], hits[i+k]);
+		}
+	}
+}
+
+void CqRaytrace::OccludedBatch(const SqRay* rays, bool* occluded,
+		TqInt numRays) const
+{
+	m_bvh.occluded(rays, occluded, numRays);
+}
+
+void CqRaytrace::fillHit(const SqBvhHit& bvhHit, SqRayHit& hit) const
+{
+	const SqRayTriangle& tri = m_bvh.triangle(bvhHit.triangle);
+	const SqTracePrimitive& prim = m_primitives[tri.id];
+	hit.t = bvhHit.t;
+	hit.Ng = tri.e1 % tri.e2;
+	hit.Cs = prim.Cs;
+	hit.Os = prim.Os;
+}
+
+/** Split a surface until it's diceable, then dice it into triangles.
+ *
+ * Surfaces are diced in camera space, but the triangles are stored in world
+ * space so that the database stays valid for the shadow map passes, which
+ * render from a different camera.
+ *
+ * Dicing uses the non raster-oriented measure from the main pipeline (see
+ * CqBucketProcessor::process()) so that the tessellation is independent of
+ * which way the surface faces the camera; surfaces seen only in reflections
+ * are often edge on or off screen.
+ */
+void CqRaytrace::diceSurface(const boost::shared_ptr<CqSurface>& surface,
+		TqInt primId, const CqMatrix& camToWorld,
+		std::vector<SqRayTriangle>& triangles) const
+{
+	CqMatrix camToRaster;
+	QGetRenderContext()->matSpaceToSpace("camera", "raster", NULL, NULL,
+										 QGetRenderContextI()->Time(),
+										 camToRaster);
+	const TqFloat* clipping = QGetRenderContext()->GetFloatOption("System", "Clipping");
+	TqFloat nearClip = clipping ? clipping[0] : FLT_EPSILON;
+	const TqInt* projection = QGetRenderContext()->GetIntegerOption("System", "Projection");
+	bool perspective = projection && projection[0] == ProjectionPerspective;
+
+	std::vector<boost::shared_ptr<CqSurface> > toDice(1, surface);
+	while(!toDice.empty())
+	{
+		boost::shared_ptr<CqSurface> s = toDice.back();
+		toDice.pop_back();
+
+		TqFloat xscale = camToRaster[0][0];
+		TqFloat yscale = camToRaster[1][1];
+		if(perspective)
+		{
+			// Surfaces behind the camera are diced as though they were
+			// the same distance in front of it.
+			CqBound bound;
+			s->Bound(&bound);
+			TqFloat midz = std::max(nearClip, std::fabs(0.5f*(
+							bound.vecMin().z() + bound.vecMax().z())));
+			xscale /= midz;
+			yscale /= midz;
+		}
+		TqFloat zscale = std::max(std::fabs(xscale), std::fabs(yscale));
+		if(s->Diceable(CqMatrix(xscale, yscale, zscale)))
+		{
+			CqMicroPolyGridBase* grid = s->Dice();
+			if(grid)
+			{
+				ADDREF(grid);
+				addGridTriangles(grid, primId, camToWorld, triangles);
+				RELEASEREF(grid);
+			}
+		}
+		else if(!s->fDiscard() && s->SplitCount() < maxRaySplits)
+		{
+			std::vector<boost::shared_ptr<CqSurface> > splits;
+			s->Split(splits);
+			toDice.insert(toDice.end(), splits.begin(), splits.end());
+		}
+	}
+}
+
+/// Break each micropolygon of a diced grid into a pair of world space triangles.
+void CqRaytrace::addGridTriangles(CqMicroPolyGridBase* grid, TqInt primId,
+		const CqMatrix& camToWorld, std::vector<SqRayTriangle>& triangles) const
+{
+	IqShaderData* P = grid->pVar(EnvVars_P);
+	if(!P)
+		return;
+	TqInt uRes = grid->uGridRes();
+	TqInt vRes = grid->vGridRes();
+	TqInt uSize = uRes + 1;
+	for(TqInt v = 0; v < vRes; ++v)
+	{
+		for(TqInt u = 0; u < uRes; ++u)
+		{
+			CqVector3D p00, p10, p01, p11;
+			P->GetPoint(p00, v*uSize + u);
+			P->GetPoint(p10, v*uSize + u + 1);
+			P->GetPoint(p01, (v+1)*uSize + u);
+			P->GetPoint(p11, (v+1)*uSize + u + 1);
+			p00 = camToWorld*p00;
+			p10 = camToWorld*p10;
+			p01 = camToWorld*p01;
+			p11 = camToWorld*p11;
+			// Micropolygons may degenerate to triangles or lines at poles
+			// and edges; drop any triangles with no area.
+			SqRayTriangle t1(p00, p10, p11, primId);
+			if((t1.e1 % t1.e2).Magnitude2() > 0)
+				triangles.push_back(t1);
+			SqRayTriangle t2(p00, p11, p01, primId);
+			if((t2.e1 % t2.e2).Magnitude2() > 0)
+				triangles.push_back(t2);
+		}
+	}
+}
 
 
 //---------------------------------------------------------------------
@@ -14,26 +14,68 @@
 #define	___raytrace_Loaded___
 
 #include	<aqsis/aqsis.h>
-#include	"iraytrace.h"
+
+#include	<vector>
+
+#include	<aqsis/core/iraytrace.h>
+#include	<aqsis/math/color.h>
+#include	<aqsis/math/matrix.h>
+#include	"bvh.h"
 
 namespace Aqsis {
 
+class CqSurface;
+class CqMicroPolyGridBase;
 
-struct CqRaytrace : public IqRaytrace
+/** \brief Raytracer over diced geometry.
+ *
+ * Primitives with the "visibility" "trace" attribute set are copied into
+ * camera space as they are added.  At Finalise() each copy is split and diced
+ * into micropolygon grids at the shading rate, the grids are broken into
+ * triangles and the triangles are stored in a world space BVH.  Displacement isn't
+ * applied, so traced geometry matches the undisplaced surface.
+ */
+class CqRaytrace : public IqRaytrace
 {
-	CqRaytrace()
-	{}
-	virtual ~CqRaytrace()
-	{}
+	public:
+		CqRaytrace();
+		virtual ~CqRaytrace();
 
+		// Interface functions overridden from IqRaytrace
+		virtual	void	Initialise();
+		virtual	void	AddPrimitive(const boost::shared_ptr<IqSurface>& pSurface);
+		virtual void	Finalise();
+		virtual bool	IsEmpty() const;
+		virtual bool	Intersect(const SqRay& ray, SqRayHit& hit) const;
+		virtual bool	Occluded(const SqRay& ray) const;
+		virtual void	IntersectBatch(const SqRay* rays, SqRayHit* hits,
+							bool* didHit, TqInt numRays) const;
+		virtual void	OccludedBatch(const SqRay* rays, bool* occluded,
+							TqInt numRays) const;
 
-	// Interface functions overridden from IqRaytrace
-	virtual	void	Initialise();
-	virtual	void	AddPrimitive(const boost::shared_ptr<IqSurface>& pSurface);
-	virtual void	Finalise();
-};
+	private:
+		/// Shading information for a traced primitive.
+		struct SqTracePrimitive
+		{
+			CqColor	Cs;
+			CqColor	Os;
+		};
 
+		void diceSurface(const boost::shared_ptr<CqSurface>& surface,
+				TqInt primId, const CqMatrix& camToWorld,
+				std::vector<SqRayTriangle>& triangles) const;
+		void addGridTriangles(CqMicroPolyGridBase* grid, TqInt primId,
+				const CqMatrix& camToWorld,
+				std::vector<SqRayTriangle>& triangles) const;
+		void fillHit(const SqBvhHit& bvhHit, SqRayHit& hit) const;
 
+		/// Camera space copies of the primitives added since Initialise().
+		std::vector<boost::shared_ptr<CqSurface> > m_surfaces;
+		/// Shading information, indexed by SqRayTriangle::id.
+		std::vector<SqTracePrimitive> m_primitives;
+		/// Acceleration structure over the diced primitives.
+		CqRayBvh m_bvh;
+};
 
 
 //-----------------------------------------------------------------------
@@ -28,7 +28,6 @@
 #include	<cstring> // for memcmp, strcmp
 #include	<time.h>
 #include	<boost/bind.hpp>
-#include	<boost/filesystem/fstream.hpp>
 
 #include	"imagebuffer.h"
 #include	"lights.h"
@@ -83,6 +82,7 @@ CqRenderer::CqRenderer()
 	m_InstancedShaders(),
 	m_lights(),
 	m_textureCache(),
+	m_diceCache(),
 	m_fSaveGPrims(false),
 	m_pTransCamera(new CqTransform()),
 	m_pTransDefObj(new CqTransform()),
@@ -704,6 +704,11 @@ void CqRenderer::RenderWorld(bool clone)
 
 //----------------------------------------------------------------------
 /** Render any automatic shadow passes.
+ *
+ * The passes are rendered one after another, each with its own buckets
+ * rendered serially.  A pass replaces the camera, options, display manager
+ * and image buffer of the renderer in place, so passes can't overlap.  Only
+ * the shadow map written by a pass is dropped from the texture caches.
  */
 
 void CqRenderer::RenderAutoShadows()
@@ -787,8 +792,10 @@ void CqRenderer::RenderAutoShadows()
 				delete(m_pDDManager);
 				m_pDDManager = realDDManager;
 
-				CqTextureMapOld::FlushCache();
-				m_textureCache->flush();
+				// Only the shadow map has changed on disk, so other
+				// textures can stay cached for the remaining passes.
+				CqTextureMapOld::FlushCache( pMapName[0] );
+				m_textureCache->flush( pMapName[0].c_str() );
 				clippingVolume().clear();
 			}
 		}
@@ -1056,6 +1063,21 @@ const	CqColor*	CqRenderer::GetColorOption( const char* strName, const char* strP
 	return ( poptCurrent()->GetColorOption( strName, strParam ) );
 }
 
+const	TqFloat*	CqRenderer::GetFloatOption( const CqParameterKey& key ) const
+{
+	return ( poptCurrent()->GetFloatOption( key ) );
+}
+
+const	TqInt*	CqRenderer::GetIntegerOption( const CqParameterKey& key ) const
+{
+	return ( poptCurrent()->GetIntegerOption( key ) );
+}
+
+const	CqString*	CqRenderer::GetStringOption( const CqParameterKey& key ) const
+{
+	return ( poptCurrent()->GetStringOption( key ) );
+}
+
 
 TqFloat*	CqRenderer::GetFloatOptionWrite( const char* strName, const char* strParam )
 {
@@ -1176,8 +1198,7 @@ boost::shared_ptr<IqShader> CqRenderer::CreateShader(
 	fileName += RI_SHADER_EXTENSION;
 	boost::filesystem::path shaderPath
 		= poptCurrent()->findRiFileNothrow(fileName, "shader");
-	boost::filesystem::ifstream shaderFile(shaderPath);
-	if(shaderFile)
+	if(!shaderPath.empty())
 	{
 		Aqsis::log() << info << "Loading shader \"" << strName
 			<< "\" from file \"" << native(shaderPath)
@@ -1196,7 +1217,7 @@ boost::shared_ptr<IqShader> CqRenderer::CreateShader(
 		boost::shared_ptr<IqShader> pShader;
 		try
 		{
-			pShader = createShaderVM(this, shaderFile, dsoPath);
+			pShader = createShaderVM(this, shaderPath, dsoPath);
 		}
 		catch(XqBadShader& e)
 		{
@@ -1268,6 +1289,7 @@ void CqRenderer::StorePrimitive( const boost::shared_ptr<CqSurface>& pSurface )
 		QGetRenderContext() ->matSpaceToSpace( "world", "camera", NULL, pSurface->pTransform().get(), 0, matWtoC );
 		QGetRenderContext() ->matNSpaceToSpace( "world", "camera", NULL, pSurface->pTransform().get(), 0, matNWtoC );
 		QGetRenderContext() ->matVSpaceToSpace( "world", "camera", NULL, pSurface->pTransform().get(), 0, matVWtoC );
+		pSurface->SeedDiceKey();
 		pSurface->Transform( matWtoC, matNWtoC, matVWtoC);
 		pSurface->PrepareTrimCurve();
 		PostSurface(pSurface);
@@ -1284,6 +1306,7 @@ void CqRenderer::PostWorld()
 		QGetRenderContext() ->matSpaceToSpace( "world", "camera", NULL, pSurface->pTransform().get(), 0, matWtoC );
 		QGetRenderContext() ->matNSpaceToSpace( "world", "camera", NULL, pSurface->pTransform().get(), 0, matNWtoC );
 		QGetRenderContext() ->matVSpaceToSpace( "world", "camera", NULL, pSurface->pTransform().get(), 0, matVWtoC );
+		pSurface->SeedDiceKey();
 		pSurface->Transform( matWtoC, matNWtoC, matVWtoC);
 		pSurface->PrepareTrimCurve();
 		PostSurface(pSurface);
@@ -1302,6 +1325,7 @@ void CqRenderer::PostCloneOfWorld()
 		QGetRenderContext() ->matSpaceToSpace( "world", "camera", NULL, pSurface->pTransform().get(), 0, matWtoC );
 		QGetRenderContext() ->matNSpaceToSpace( "world", "camera", NULL, pSurface->pTransform().get(), 0, matNWtoC );
 		QGetRenderContext() ->matVSpaceToSpace( "world", "camera", NULL, pSurface->pTransform().get(), 0, matVWtoC );
+		pSurface->SeedDiceKey();
 		pSurface->Transform( matWtoC, matNWtoC, matVWtoC);
 		pSurface->PrepareTrimCurve();
 		PostSurface(pSurface);
@@ -43,12 +43,12 @@
 #include	<aqsis/riutil/tokendictionary.h>
 #include	"iddmanager.h"
 #include	<aqsis/core/irenderer.h>
-#include	"iraytrace.h"
-#include	"iraytrace.h"
+#include	<aqsis/core/iraytrace.h>
 #include	<aqsis/tex/filtering/itexturecache.h>
 #include	"lights.h"
 
 #include	"clippingvolume.h"
+#include	"dicecache.h"
 
 namespace Aqsis {
 
@@ -190,6 +190,9 @@ class CqRenderer : public IqRenderer
 		virtual	const	CqString* GetStringOption( const char* strName, const char* strParam ) const;
 		virtual	const	CqVector3D*	GetPointOption( const char* strName, const char* strParam ) const;
 		virtual	const	CqColor*	GetColorOption( const char* strName, const char* strParam ) const;
+		virtual	const	TqFloat*	GetFloatOption( const CqParameterKey& key ) const;
+		virtual	const	TqInt*	GetIntegerOption( const CqParameterKey& key ) const;
+		virtual	const	CqString* GetStringOption( const CqParameterKey& key ) const;
 
 		virtual	TqFloat*	GetFloatOptionWrite( const char* strName, const char* strParam );
 		virtual	TqInt*	GetIntegerOptionWrite( const char* strName, const char* strParam );
@@ -203,6 +206,11 @@ class CqRenderer : public IqRenderer
 		}
 
 		virtual	IqTextureCache& textureCache();
+		/// Get the cache of diced grids, which is open when enabled by the options.
+		CqDiceCache& diceCache()
+		{
+			return ( m_diceCache );
+		}
 		virtual	IqTextureMapOld* GetEnvironmentMap( const CqString& strFileName );
 		virtual	IqTextureMapOld* GetOcclusionMap(const CqString& fileName);
 		virtual	IqTextureMapOld* GetLatLongMap( const CqString& strFileName );
@@ -543,6 +551,7 @@ class CqRenderer : public IqRenderer
 		TqLightMap m_lights;
 
 		boost::shared_ptr<IqTextureCache> m_textureCache; ///< Cache for aqsistex texture access.
+		CqDiceCache m_diceCache;	///< Cache of diced grids shared between renders.
 		 
 
 		bool	m_fSaveGPrims;
@@ -33,6 +33,7 @@
 #include "renderer.h"
 #include "transform.h"
 #include <aqsis/math/math.h>
+#include <aqsis/tex/buffers/tilecache.h>
 
 namespace Aqsis {
 
@@ -222,11 +223,13 @@ void CqStats::PrintStats( TqInt level ) const
 		TqFloat	_grd_init_quote	= 0.0f;
 		TqFloat	_grd_shade_quote= 0.0f;
 		TqFloat	_grd_cull_quote = 0.0f;
+		TqFloat	_grd_oc_quote = 0.0f;
 		if (STATS_INT_GETI(GRD_created))
 		{
 			_grd_init_quote = 100.0f *  _grd_init / STATS_INT_GETI( GRD_created );
 			_grd_shade_quote = 100.0f *  _grd_shade / STATS_INT_GETI( GRD_created );
 			_grd_cull_quote = 100.0f *  STATS_INT_GETI( GRD_culled ) / STATS_INT_GETI( GRD_created );
+			_grd_oc_quote = 100.0f *  STATS_INT_GETI( GRD_occlusion_culled ) / STATS_INT_GETI( GRD_created );
 		}
 		if (_grd_init == 0)
 			_grd_init = 1;
@@ -250,7 +253,8 @@ void CqStats::PrintStats( TqInt level ) const
 		TqFloat	_grd_shd_g256	=	100.0f * STATS_INT_GETI( GRD_shd_size_g256 ) / _grd_shade;
 		MSG << "Grids:\n\t"
 		<< STATS_INT_GETI( GRD_created ) << " created, " << STATS_INT_GETI( GRD_peak ) << " peak,\n\t"
-		<< _grd_init << " initialized (" << _grd_init_quote << "%),\n\t" << _grd_shade << " shaded (" << _grd_shade_quote << "%), " << STATS_INT_GETI( GRD_culled ) << " culled (" << _grd_cull_quote << "%)\n\n"
+		<< _grd_init << " initialized (" << _grd_init_quote << "%),\n\t" << _grd_shade << " shaded (" << _grd_shade_quote << "%), " << STATS_INT_GETI( GRD_culled ) << " culled (" << _grd_cull_quote << "%),\n\t"
+		<< STATS_INT_GETI( GRD_occlusion_culled ) << " occlusion culled before shading (" << _grd_oc_quote << "%)\n\n"
 		<< "\tGrid count/size (diced grids):\n"
 		<< "\t+------+------+------+------+------+------+------+------+\n"
 		<< "\t|<=  4 |<=  8 |<= 16 |<= 32 |<= 64 |<=128 |<=256 | >256 |\n"
@@ -298,6 +302,22 @@ void CqStats::PrintStats( TqInt level ) const
 			Grid stats - End
 			-------------------------------------------------------------------
 		*/
+		/*
+			-------------------------------------------------------------------
+			Light stats
+		*/
+		TqInt _lit_all = STATS_INT_GETI( SHD_lights_evaluated ) + STATS_INT_GETI( SHD_lights_culled );
+		TqFloat _lit_cull_quote = 0.0f;
+		if (_lit_all)
+			_lit_cull_quote = 100.0f * STATS_INT_GETI( SHD_lights_culled ) / _lit_all;
+		MSG << "Lights:\n\t"
+		<< STATS_INT_GETI( SHD_lights_evaluated ) << " evaluated, "
+		<< STATS_INT_GETI( SHD_lights_culled ) << " culled (" << _lit_cull_quote << "%)\n"
+		<< std::endl;
+		/*
+			Light stats - End
+			-------------------------------------------------------------------
+		*/
 		/* MPGS */
 		/*
 			-------------------------------------------------------------------
@@ -411,6 +431,20 @@ void CqStats::PrintStats( TqInt level ) const
 		// MSG << "Transforms:\n\t";
 		// MSG << ( TqInt ) Transform_stack.size() << " created\n" << std::endl;
 		MSG << "Parameters:\n\t" << STATS_INT_GETI( PRM_created ) << " created, " << STATS_INT_GETI( PRM_peak ) << " peak\n" << std::endl;
+
+		/*
+			Texture tile cache
+			-------------------------------------------------------------------
+		*/
+		SqTileCacheStats tileStats = CqTileCache::instance().stats();
+		TqFloat _tex_h = 0.0f;
+		if ( tileStats.hits + tileStats.misses )
+			_tex_h = 100.0f * tileStats.hits / ( tileStats.hits + tileStats.misses );
+		MSG << "Texture tiles:\n\t" << tileStats.misses << " loaded, "
+		<< tileStats.hits << " cache hits (" << _tex_h << "%), "
+		<< tileStats.evictions << " evicted\n\t"
+		<< tileStats.peakMemory / 1024 << "kB peak of "
+		<< CqTileCache::instance().maxMemory() / 1024 << "kB allowed\n" << std::endl;
 	}
 	if ( level == 3 )
 	{
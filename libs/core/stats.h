@@ -33,6 +33,7 @@
 #include <iostream>
 
 #include <aqsis/util/timer.h>
+#include <aqsis/util/trace.h>
 #include <aqsis/ri/ri.h>
 #include <aqsis/util/enum.h>
 
@@ -55,12 +56,33 @@ extern void gStats_setF( TqInt index, TqFloat value );
 
 //----------------------------------------------------------------------
 // Timer stuff.
+//
+// Timed scopes are also traced under the name of the timer, so they show up
+// in the trace written with Option "statistics" "tracefile" whether or not
+// the timers are compiled in.
 
 #ifdef USE_TIMERS
 
+/** \brief Time a scope with a timer, and trace it under the timer name.
+ *
+ * Both are done by a single object so that AQSIS_TIME_SCOPE is a single
+ * declaration.
+ */
+class CqTimedScope
+{
+	public:
+		CqTimedScope(const char* name, CqTimer& timer)
+			: m_trace(name),
+			m_timer(timer)
+		{ }
+	private:
+		CqTraceScope m_trace;
+		CqScopeTimer m_timer;
+};
+
 /// Append time taken to the end of the current scope to the named timer.
-#define AQSIS_TIME_SCOPE(id) CqScopeTimer aq_scope_timer__(\
-		g_timerSet.getTimer(EqTimerStats::id))
+#define AQSIS_TIME_SCOPE(id) \
+	CqTimedScope aq_timed_scope__(#id, g_timerSet.getTimer(EqTimerStats::id))
 /// Start the named timer.
 #define AQSIS_TIMER_START(id) g_timerSet.getTimer(EqTimerStats::id).start()
 /// Stop the named timer and append the time since the corresponding TIMER_START
@@ -95,6 +117,8 @@ struct EqTimerStats
 		Surface_shading,
 		// texturing
 		Make_texture,
+		// raytracing
+		Raytrace_build,
 		// sampling
 		Combine_samples,
 		Filter_samples,
@@ -134,6 +158,8 @@ AQSIS_ENUM_INFO_BEGIN(EqTimerStats::Enum, EqTimerStats::LAST)
 	"Surface shading",
 	// texturing
 	"Make texture",
+	// raytracing
+	"Raytrace build",
 	// sampling
 	"Combine samples",
 	"Filter samples",
@@ -149,8 +175,8 @@ extern CqTimerSet<EqTimerStats> g_timerSet;
 
 #else // USE_TIMERS
 
-// dummy declarations if compiled without timers.
-#define AQSIS_TIME_SCOPE(name)
+// dummy declarations if compiled without timers; timed scopes are still traced.
+#define AQSIS_TIME_SCOPE(name) AQSIS_TRACE_SCOPE(#name)
 #define AQSIS_TIMER_START(identifier)
 #define AQSIS_TIMER_STOP(identifier)
 
@@ -321,6 +347,7 @@ class CqStats
 
 		       GRD_created,
 		       GRD_culled,
+		       GRD_occlusion_culled,
 		       GRD_current,
 		       GRD_peak,
 		       GRD_allocated,
@@ -374,6 +401,8 @@ class CqStats
 		       MPG_pushed_far_down,
 
 		       // Shading stats
+		       SHD_lights_evaluated,
+		       SHD_lights_culled,
 
 		       // Sampling stats
 
@@ -1074,6 +1074,18 @@ void CqTextureMapOld::FlushCache()
 	m_TextureMap_Cache.clear();
 }
 
+void CqTextureMapOld::FlushCache( const CqString& strName )
+{
+	// As above, deleting a map removes it from m_TextureMap_Cache.
+	std::vector<CqTextureMapOld*> tmpCache = m_TextureMap_Cache;
+	for(std::vector<CqTextureMapOld*>::iterator i = tmpCache.begin();
+			i != tmpCache.end(); ++i)
+	{
+		if((*i)->getName() == strName)
+			delete *i;
+	}
+}
+
 
 //---------------------------------------------------------------------
 /** Open a named texture map.
@@ -646,6 +646,10 @@ class CqTextureMapOld : public IqTextureMapOld
 		/** Clear the cache of texture maps.
 		 */
 		static void FlushCache();
+		/** Remove a single texture map from the cache.
+		 * \param strName the name the map was loaded with.
+		 */
+		static void FlushCache( const CqString& strName );
 
 		void CriticalMeasure();
 
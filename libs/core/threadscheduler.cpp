@@ -20,87 +20,266 @@
 
 #include	"threadscheduler.h"
 
+#include	<exception>
 
-namespace Aqsis {
+#include	<boost/bind.hpp>
+#ifdef	ENABLE_THREADING
+#include	<boost/thread/tss.hpp>
+#endif
 
-/**
- * \brief Wrapper class for a unit to be processed by a thread.
- *
- * It adds a notifying call to the scheduler to know when the thread
- * finished.
- */
-class CqUnitWrapper
-{
-public:
-	CqUnitWrapper(CqThreadScheduler* threadScheduler, const boost::function0<void>& unit) :
-		m_threadScheduler(threadScheduler), m_unit(unit)
-	{
-	}
+#include	<aqsis/util/exception.h>
+#include	<aqsis/util/logging.h>
+#include	<aqsis/util/sstring.h>
 
-	void operator()()
-	{
-		m_unit();
-		m_threadScheduler->notifyWorkUnitFinished();
-	}
 
-private:
-	CqThreadScheduler* m_threadScheduler;
-	const boost::function0<void> m_unit;
-};
+namespace Aqsis {
 
+#ifdef	ENABLE_THREADING
+namespace {
 
+// Marks the threads created by any scheduler.  The pointer is never owned,
+// so the cleanup function does nothing.
+void noCleanup(bool*) {}
+bool workerMarker = true;
+boost::thread_specific_ptr<bool> isWorker(&noCleanup);
+
+} // unnamed namespace
+#endif
 
 CqThreadScheduler::CqThreadScheduler(TqInt maxThreads) :
-	m_maxThreads(maxThreads), m_activeThreads(0)
+	m_maxThreads(maxThreads > 0 ? maxThreads : 1),
+	m_queues(),
+	m_nextQueue(0)
+#ifdef	ENABLE_THREADING
+	, m_threadGroup(),
+	m_threadIds(),
+	m_mutex(),
+	m_workAvailable(),
+	m_allDone(),
+	m_pendingUnits(0),
+	m_queuedUnits(0),
+	m_shutdown(false)
+#endif
 {
+#ifndef	ENABLE_THREADING
+	// Without threading support all the work happens on the calling thread.
+	m_maxThreads = 1;
+#endif
+	for(TqInt i = 0; i < m_maxThreads; ++i)
+		m_queues.push_back(boost::shared_ptr<SqWorkQueue>(new SqWorkQueue()));
+#ifdef	ENABLE_THREADING
+	// Hold the lock while creating the workers so that they can't look up
+	// their own id before m_threadIds is complete.
+	boost::mutex::scoped_lock lock(m_mutex);
+	for(TqInt i = 0; i < m_maxThreads; ++i)
+	{
+		boost::thread* thread = m_threadGroup.create_thread(
+				boost::bind(&CqThreadScheduler::workerLoop, this, i));
+		m_threadIds.push_back(thread->get_id());
+	}
+#endif
 }
 
 
 CqThreadScheduler::~CqThreadScheduler()
 {
+	joinAll();
+#ifdef	ENABLE_THREADING
+	{
+		boost::mutex::scoped_lock lock(m_mutex);
+		m_shutdown = true;
+	}
+	m_workAvailable.notify_all();
+	m_threadGroup.join_all();
+#endif
 }
 
 
 void CqThreadScheduler::addWorkUnit(const boost::function0<void>& unit)
 {
+	// Work added by a worker stays local to it; work added from outside is
+	// dealt out to the workers in turn.
+	TqInt queue = workerIndex();
 #ifdef	ENABLE_THREADING
-	boost::mutex::scoped_lock lock(m_mutexCondition);
-	if (m_activeThreads >= m_maxThreads)
 	{
-		m_threadsAvailable.wait(lock);
+		// Count the unit as pending before anyone can run it, so joinAll()
+		// can't see the count drop to zero while its parent still runs.
+		boost::mutex::scoped_lock lock(m_mutex);
+		++m_pendingUnits;
+		if(queue < 0)
+		{
+			queue = m_nextQueue;
+			m_nextQueue = (m_nextQueue + 1) % m_maxThreads;
+		}
 	}
-
-	{ 
-		boost::mutex::scoped_lock lock(m_mutexActiveThreads);
-		++m_activeThreads;
+	SqWorkQueue& q = *m_queues[queue];
+	{
+		boost::mutex::scoped_lock queueLock(q.mutex);
+		q.units.push_back(unit);
+	}
+	// The unit is only counted as queued once it can be found, so a worker
+	// which sees m_queuedUnits > 0 will find it unless another worker gets
+	// there first.  A worker may take it before it is counted, leaving the
+	// count briefly negative.
+	{
+		boost::mutex::scoped_lock lock(m_mutex);
+		++m_queuedUnits;
 	}
+	m_workAvailable.notify_one();
+#else // ENABLE_THREADING
+	if(queue < 0)
+	{
+		queue = m_nextQueue;
+		m_nextQueue = (m_nextQueue + 1) % m_maxThreads;
+	}
+	m_queues[queue]->units.push_back(unit);
+#endif
+}
+
+
+void CqThreadScheduler::joinAll()
+{
+#ifdef	ENABLE_THREADING
+	boost::mutex::scoped_lock lock(m_mutex);
+	while(m_pendingUnits > 0)
+		m_allDone.wait(lock);
+#else // ENABLE_THREADING
+	// If not threading, just run the queued units on this thread.
+	TqWorkUnit unit;
+	while(popOrSteal(0, unit))
+		runUnit(unit);
+#endif
+}
+
+
+TqInt CqThreadScheduler::numThreads() const
+{
+	return m_maxThreads;
+}
+
 
-	m_threadGroup.create_thread( CqUnitWrapper(this, unit) );
+bool CqThreadScheduler::isWorkerThread()
+{
+#ifdef	ENABLE_THREADING
+	return isWorker.get() != 0;
 #else // ENABLE_THREADING
-	// If not threading, just run the process asynchronously.
-	unit();
+	return false;
 #endif
 }
 
 
-void CqThreadScheduler::notifyWorkUnitFinished()
+TqInt CqThreadScheduler::workerIndex() const
 {
 #ifdef	ENABLE_THREADING
+	boost::thread::id self = boost::this_thread::get_id();
+	for(TqInt i = 0, end = m_threadIds.size(); i < end; ++i)
 	{
-		boost::mutex::scoped_lock lock(m_mutexActiveThreads);
-		--m_activeThreads;
+		if(m_threadIds[i] == self)
+			return i;
 	}
-	m_threadsAvailable.notify_one();
+	return -1;
+#else // ENABLE_THREADING
+	return 0;
 #endif
 }
 
 
-void CqThreadScheduler::joinAll()
+/** Take a work unit from the back of the given worker's own queue, or failing
+ * that steal one from the front of another worker's queue.
+ */
+bool CqThreadScheduler::popOrSteal(TqInt worker, TqWorkUnit& unit)
 {
+	for(TqInt i = 0; i < m_maxThreads; ++i)
+	{
+		bool own = (i == 0);
+		SqWorkQueue& q = *m_queues[(worker + i) % m_maxThreads];
 #ifdef	ENABLE_THREADING
-	m_threadGroup.join_all();
+		boost::mutex::scoped_lock lock(q.mutex);
 #endif
+		if(q.units.empty())
+			continue;
+		if(own)
+		{
+			unit = q.units.back();
+			q.units.pop_back();
+		}
+		else
+		{
+			unit = q.units.front();
+			q.units.pop_front();
+		}
+		return true;
+	}
+	return false;
+}
+
+
+void CqThreadScheduler::runUnit(const TqWorkUnit& unit)
+{
+	// Nothing may escape from here: an exception would end the worker thread
+	// and leave the unit counted as pending forever.
+	try
+	{
+		unit();
+	}
+	catch(const XqException& e)
+	{
+		Aqsis::log() << error << "Unhandled exception in work unit: "
+			<< e.what() << std::endl;
+	}
+	catch(const std::exception& e)
+	{
+		Aqsis::log() << error << "Unhandled exception in work unit: "
+			<< e.what() << std::endl;
+	}
+	catch(const CqString& e)
+	{
+		Aqsis::log() << error << "Unhandled exception in work unit: "
+			<< e << std::endl;
+	}
+	catch(...)
+	{
+		Aqsis::log() << error << "Unknown exception in work unit" << std::endl;
+	}
 }
 
 
+#ifdef	ENABLE_THREADING
+void CqThreadScheduler::workerLoop(TqInt worker)
+{
+	isWorker.reset(&workerMarker);
+	{
+		// Wait for the constructor to finish setting up m_threadIds.
+		boost::mutex::scoped_lock lock(m_mutex);
+	}
+	while(true)
+	{
+		TqWorkUnit unit;
+		// Search the queues holding only their own locks, so that workers
+		// taking and stealing units don't serialise on m_mutex.
+		if(!popOrSteal(worker, unit))
+		{
+			boost::mutex::scoped_lock lock(m_mutex);
+			while(!m_shutdown && m_queuedUnits <= 0)
+				m_workAvailable.wait(lock);
+			if(m_shutdown)
+				return;
+			// Something is queued; search again.
+			continue;
+		}
+		{
+			boost::mutex::scoped_lock lock(m_mutex);
+			--m_queuedUnits;
+		}
+		runUnit(unit);
+		{
+			boost::mutex::scoped_lock lock(m_mutex);
+			if(--m_pendingUnits == 0)
+				m_allDone.notify_all();
+		}
+	}
+}
+#endif
+
+
 } // namespace Aqsis
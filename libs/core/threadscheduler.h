@@ -29,7 +29,12 @@
 #define THREADSCHEDULER_H_INCLUDED 1
 
 #include	<aqsis/aqsis.h>
+
+#include	<deque>
+#include	<vector>
+
 #include	<boost/function.hpp>
+#include	<boost/shared_ptr.hpp>
 
 #ifdef	ENABLE_THREADING
 #include	<boost/thread/thread.hpp>
@@ -37,42 +42,90 @@
 #include	<boost/thread/condition.hpp>
 #endif
 
-namespace Aqsis { 
+#include	<aqsis/util/mutex.h>
 
+namespace Aqsis { 
 
 /**
- * \brief Class to schedule threads processing work units
+ * \brief Persistent pool of worker threads with work stealing.
+ *
+ * The scheduler starts a fixed number of worker threads which live until the
+ * scheduler is destroyed.  Each worker owns a deque of work units: units added
+ * from inside a worker go onto the back of that worker's own deque and are
+ * taken from the back again (so related work stays on the same core), while
+ * idle workers steal from the front of the other deques.  This keeps all
+ * workers busy even when the work units take wildly different amounts of time.
+ *
+ * When threading is disabled at compile time, work units are queued and then
+ * run on the calling thread by joinAll().
  */
 class CqThreadScheduler
 {
 public:
-	/** Default constructor */
+	/** Start a pool with the given number of worker threads */
 	CqThreadScheduler(TqInt maxThreads);
-	/** Destructor */
+	/** Destructor.  Waits for outstanding work, then stops the workers. */
 	~CqThreadScheduler();
 
 	/** Add a work unit to be processed */
 	void addWorkUnit(const boost::function0<void>& unit);
-	/** Notify that a work unit has been processed */
-	void notifyWorkUnitFinished();
-	/** Join all the threads, this is, wait for all the threads to
-	 * finish their job before continuing */
+	/** Wait until all work units added so far, and any which they add in
+	 * turn, have been processed.  The worker threads stay alive. */
 	void joinAll();
 
+	/** Number of worker threads in the pool */
+	TqInt numThreads() const;
+	/** Index of the worker running the calling thread, in the range
+	 * [0,numThreads()), or -1 when called from outside the pool. */
+	TqInt workerIndex() const;
+	/** True when called from a worker of any scheduler.  Code which may run
+	 * inside a work unit uses this to avoid starting a nested pool. */
+	static bool isWorkerThread();
+
 private:
-	/// Maximum number of threads to run
+	typedef boost::function0<void> TqWorkUnit;
+
+	/// Queue of work units owned by a single worker.
+	struct SqWorkQueue
+	{
+		std::deque<TqWorkUnit> units;
+#ifdef	ENABLE_THREADING
+		boost::mutex mutex;
+#endif
+	};
+
+	bool popOrSteal(TqInt worker, TqWorkUnit& unit);
+	void runUnit(const TqWorkUnit& unit);
+#ifdef	ENABLE_THREADING
+	void workerLoop(TqInt worker);
+#endif
+
+	/// Number of worker threads
 	TqInt m_maxThreads;
-	/// Current number of active threads running
-	TqInt m_activeThreads;
+	/// Per-worker queues of work units
+	std::vector<boost::shared_ptr<SqWorkQueue> > m_queues;
+	/// Queue to push to next when adding from outside the pool
+	TqInt m_nextQueue;
 #ifdef	ENABLE_THREADING
-	/// Hold the group of active threads
+	/// Hold the group of worker threads
 	boost::thread_group m_threadGroup;
-	/// Mutex for condition
-	boost::mutex m_mutexCondition;
-	/// Mutex for active threads
-	boost::mutex m_mutexActiveThreads;
-	/// Condition to wait for available threads
-	boost::condition m_threadsAvailable;
+	/// Ids of the worker threads, indexed by worker number
+	std::vector<boost::thread::id> m_threadIds;
+	/// Mutex protecting m_nextQueue, the counters and conditions below.
+	/// The queues have their own locks and are searched without it; it is
+	/// never held together with a queue lock.
+	boost::mutex m_mutex;
+	/// Signalled when new work is available or the pool is shutting down
+	boost::condition m_workAvailable;
+	/// Signalled when all queued work has been processed
+	boost::condition m_allDone;
+	/// Number of work units queued or running
+	TqInt m_pendingUnits;
+	/// Number of work units sitting in the queues.  Idle workers only sleep
+	/// while this isn't positive, so a unit can't be queued without waking one.
+	TqInt m_queuedUnits;
+	/// Set when the workers should exit
+	bool m_shutdown;
 #endif
 };
 
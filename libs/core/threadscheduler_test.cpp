@@ -0,0 +1,157 @@
+// Aqsis
+// Copyright (C) 1997 - 2001, Paul C. Gregory
+//
+// Contact: pgregory@aqsis.org
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation; either
+// version 2 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+/** \file Unit tests for the work stealing thread pool.
+ */
+
+#include "threadscheduler.h"
+
+#include <vector>
+
+#include <boost/bind.hpp>
+#ifdef ENABLE_THREADING
+#include <boost/thread/thread.hpp>
+#endif
+
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/auto_unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(threadscheduler_tests)
+
+using namespace Aqsis;
+
+namespace {
+
+const TqInt numUnits = 1000;
+
+/// Count the runs of each unit.
+struct SqRunCounts
+{
+	std::vector<TqInt> runs;
+	TqMutex mutex;
+
+	SqRunCounts() : runs(numUnits, 0) {}
+};
+
+void countRun(SqRunCounts* counts, TqInt unit)
+{
+	TqMutexLock lock(counts->mutex);
+	++counts->runs[unit];
+}
+
+/// Work unit which queues the second half of the units from inside the pool.
+void spawnUnits(CqThreadScheduler* scheduler, SqRunCounts* counts)
+{
+	for(TqInt i = numUnits/2; i < numUnits; ++i)
+		scheduler->addWorkUnit(boost::bind(&countRun, counts, i));
+}
+
+#ifdef ENABLE_THREADING
+/// State shared between the units of the stealing test.
+struct SqStealState
+{
+	TqInt owner;
+	TqInt ranElsewhere;
+	boost::mutex mutex;
+
+	SqStealState() : owner(-1), ranElsewhere(0) {}
+};
+
+void recordWorker(CqThreadScheduler* scheduler, SqStealState* state)
+{
+	boost::mutex::scoped_lock lock(state->mutex);
+	if(scheduler->workerIndex() != state->owner)
+		++state->ranElsewhere;
+}
+
+/** Queue units on the calling worker's own deque, then keep the worker busy
+ * until another worker has run one of them.  Anything run meanwhile must
+ * have been stolen.
+ */
+void queueAndBlock(CqThreadScheduler* scheduler, SqStealState* state)
+{
+	{
+		boost::mutex::scoped_lock lock(state->mutex);
+		state->owner = scheduler->workerIndex();
+	}
+	for(TqInt i = 0; i < 100; ++i)
+		scheduler->addWorkUnit(boost::bind(&recordWorker, scheduler, state));
+	// Give up after about five seconds so a broken pool fails rather than
+	// hangs.
+	for(TqInt i = 0; i < 5000; ++i)
+	{
+		{
+			boost::mutex::scoped_lock lock(state->mutex);
+			if(state->ranElsewhere > 0)
+				return;
+		}
+		boost::this_thread::sleep(boost::posix_time::milliseconds(1));
+	}
+}
+#endif
+
+} // unnamed namespace
+
+BOOST_AUTO_TEST_CASE(threadscheduler_runs_each_unit_once)
+{
+	SqRunCounts counts;
+	{
+		CqThreadScheduler scheduler(4);
+		for(TqInt i = 0; i < numUnits/2; ++i)
+			scheduler.addWorkUnit(boost::bind(&countRun, &counts, i));
+		scheduler.addWorkUnit(boost::bind(&spawnUnits, &scheduler, &counts));
+		scheduler.joinAll();
+		// Units queued from inside a unit are part of the same join.
+		for(TqInt i = 0; i < numUnits; ++i)
+			BOOST_CHECK_EQUAL(counts.runs[i], 1);
+
+		// The workers stay alive for a second batch.
+		for(TqInt i = 0; i < numUnits; ++i)
+			scheduler.addWorkUnit(boost::bind(&countRun, &counts, i));
+		scheduler.joinAll();
+	}
+	for(TqInt i = 0; i < numUnits; ++i)
+		BOOST_CHECK_EQUAL(counts.runs[i], 2);
+}
+
+BOOST_AUTO_TEST_CASE(threadscheduler_worker_index)
+{
+	CqThreadScheduler scheduler(3);
+#ifdef ENABLE_THREADING
+	BOOST_CHECK_EQUAL(scheduler.workerIndex(), -1);
+	BOOST_CHECK(!CqThreadScheduler::isWorkerThread());
+	BOOST_CHECK_EQUAL(scheduler.numThreads(), 3);
+#else
+	BOOST_CHECK_EQUAL(scheduler.numThreads(), 1);
+#endif
+}
+
+#ifdef ENABLE_THREADING
+BOOST_AUTO_TEST_CASE(threadscheduler_steals_work)
+{
+	SqStealState state;
+	CqThreadScheduler scheduler(4);
+	scheduler.addWorkUnit(boost::bind(&queueAndBlock, &scheduler, &state));
+	scheduler.joinAll();
+	BOOST_CHECK(state.owner >= 0);
+	BOOST_CHECK(state.ranElsewhere > 0);
+}
+#endif
+
+BOOST_AUTO_TEST_SUITE_END()
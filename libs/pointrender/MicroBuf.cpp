@@ -48,8 +48,8 @@ using Imath::C3f;
 const V3f MicroBuf::Normal = Imath::V3f(0,0,-1);
 
 MicroBuf::MicroBuf(int faceRes, int nchans, const float* defaultPix) :
-	m_res(faceRes), m_nchans(nchans), m_faceSize(nchans * faceRes * faceRes),
-			m_pixels() {
+	m_res(faceRes), m_nchans(nchans), m_planeSize(faceRes * faceRes),
+			m_faceSize(nchans * faceRes * faceRes), m_pixels() {
 
 	// Create the arrays.
 	m_pixels.reset(new float[m_faceSize * Face_end]);
@@ -85,14 +85,16 @@ MicroBuf::MicroBuf(int faceRes, int nchans, const float* defaultPix) :
 
 	// Set the default channel values for the pixels.
 	float* pix = m_defaultPixels.get();
-	for (int i = 0, iend = size(); i < iend; ++i, pix += m_nchans)
+	for (int iface = Face_begin; iface < Face_end; ++iface)
 		for (int c = 0; c < m_nchans; ++c)
-			pix[c] = defaultPix[c];
+			for (int i = 0; i < m_planeSize; ++i)
+				*pix++ = defaultPix[c];
 }
 
 MicroBuf::MicroBuf(MicroBuf& microbuf) :
 			m_res(microbuf.m_res),
 			m_nchans(microbuf.m_nchans),
+			m_planeSize(microbuf.m_planeSize),
 			m_faceSize(microbuf.m_faceSize),
 			m_pixels(microbuf.getRawData()) {
 }
@@ -120,6 +122,16 @@ const float* MicroBuf::face(Face which) const {
 	return &m_pixels[0] + which * m_faceSize;
 }
 
+float* MicroBuf::channel(Face which, int chan) {
+	assert(chan >= 0 && chan < m_nchans);
+	return face(which) + chan * m_planeSize;
+}
+
+const float* MicroBuf::channel(Face which, int chan) const {
+	assert(chan >= 0 && chan < m_nchans);
+	return face(which) + chan * m_planeSize;
+}
+
 MicroBuf::Face MicroBuf::faceIndex(V3f p) {
 	V3f absp = V3f(fabs(p.x), fabs(p.y), fabs(p.z));
 	if (absp.x >= absp.y && absp.x >= absp.z)
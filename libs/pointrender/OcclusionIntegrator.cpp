@@ -85,6 +85,20 @@ void OcclusionIntegrator::addSample(int u, int v, float distance,
 	pix[0] += coverage;
 }
 
+void OcclusionIntegrator::addRect(int ubegin, int uend, int vbegin, int vend,
+		float distance, const float* uCoverage, const float* vCoverage) {
+	int res = m_buf.getFaceResolution();
+	int width = uend - ubegin;
+	for (int iv = vbegin; iv < vend; ++iv) {
+		// Coverage is added as in addSample(); the single channel of the
+		// face is contiguous along the row.
+		float* pix = m_face + iv * res + ubegin;
+		float vCov = vCoverage[iv - vbegin];
+		for (int i = 0; i < width; ++i)
+			pix[i] += vCov * uCoverage[i];
+	}
+}
+
 float OcclusionIntegrator::occlusion(V3f N, float coneAngle) const {
 	// Integrate over face to get occlusion.
 	float occ = 0;
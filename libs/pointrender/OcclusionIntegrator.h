@@ -117,6 +117,28 @@ public:
 	 */
 	void addSample(int u, int v, float distance, float coverage);
 
+	/**
+	 * Add samples for a rectangle of pixels on the current face.
+	 *
+	 * This is equivalent to calling addSample() for each pixel, with the
+	 * coverage of pixel (u,v) given by uCoverage[u-ubegin]*vCoverage[v-vbegin].
+	 * The pixels of a row are processed together, so the loop can be
+	 * vectorized.
+	 *
+	 * @param ubegin, uend
+	 * 			The range of pixels on the 'u' axis (exclusive end).
+	 * @param vbegin, vend
+	 * 			The range of pixels on the 'v' axis (exclusive end).
+	 * @param distance
+	 * 			The distance to the sample.
+	 * @param uCoverage
+	 * 			The coverage of each column of the rectangle.
+	 * @param vCoverage
+	 * 			The coverage of each row of the rectangle.
+	 */
+	void addRect(int ubegin, int uend, int vbegin, int vend, float distance,
+			const float* uCoverage, const float* vCoverage);
+
 	/**
 	 * Set the data for the current sample, @see addSample().
 	 *
@@ -29,6 +29,7 @@
 
 
 
+#include <algorithm>
 #include <cfloat>
 #include <cmath>
 #include <cstring>
@@ -75,24 +76,58 @@ void RadiosityIntegrator::clear() {
 }
 
 void RadiosityIntegrator::addSample(int u, int v, float distance, float coverage) {
-	float* pix = m_face + (v * m_buf.getFaceResolution() + u) * m_buf.getNChans();
+	int res = m_buf.getFaceResolution();
+	int planeSize = res * res;
+	float* pix = m_face + v * res + u;
 	// TODO: Eventually remove dist if not needed
 	float& currDist = pix[0];
-	float& currCover = pix[1];
-	C3f & radiosity = *reinterpret_cast<C3f*> (pix + 2);
+	float& currCover = pix[planeSize];
 	if (distance < currDist)
 		currDist = distance;
 	if (currCover < 1) {
 		if (currCover + coverage <= 1) {
-			radiosity += coverage * m_currRadiosity;
+			pix[2*planeSize] += coverage * m_currRadiosity.x;
+			pix[3*planeSize] += coverage * m_currRadiosity.y;
+			pix[4*planeSize] += coverage * m_currRadiosity.z;
 			currCover += coverage;
 		} else {
-			radiosity += (1 - currCover) * m_currRadiosity;
+			pix[2*planeSize] += (1 - currCover) * m_currRadiosity.x;
+			pix[3*planeSize] += (1 - currCover) * m_currRadiosity.y;
+			pix[4*planeSize] += (1 - currCover) * m_currRadiosity.z;
 			currCover = 1;
 		}
 	}
 }
 
+void RadiosityIntegrator::addRect(int ubegin, int uend, int vbegin, int vend,
+		float distance, const float* uCoverage, const float* vCoverage) {
+	int res = m_buf.getFaceResolution();
+	int planeSize = res * res;
+	int width = uend - ubegin;
+	float red = m_currRadiosity.x;
+	float green = m_currRadiosity.y;
+	float blue = m_currRadiosity.z;
+	for (int iv = vbegin; iv < vend; ++iv) {
+		float* depth = m_face + iv * res + ubegin;
+		float* cover = depth + planeSize;
+		float* r = depth + 2*planeSize;
+		float* g = depth + 3*planeSize;
+		float* b = depth + 4*planeSize;
+		float vCov = vCoverage[iv - vbegin];
+		// Branch free version of addSample(): the coverage added is
+		// clamped so that the total never goes above one.
+		for (int i = 0; i < width; ++i) {
+			float add = std::max(0.0f, std::min(vCov * uCoverage[i],
+						1 - cover[i]));
+			depth[i] = std::min(depth[i], distance);
+			cover[i] += add;
+			r[i] += add * red;
+			g[i] += add * green;
+			b[i] += add * blue;
+		}
+	}
+}
+
 void RadiosityIntegrator::setFace(MicroBuf::Face face) {
 	m_face = m_buf.face(face);
 }
@@ -110,15 +145,17 @@ C3f RadiosityIntegrator::radiosity(V3f N, float coneAngle, float* occlusion) con
 	float occ = 0;
 	for (int iface = MicroBuf::Face_begin; iface < MicroBuf::Face_end; ++iface) {
 		MicroBuf::Face face = static_cast<MicroBuf::Face>(iface);
-		const float* facep = m_buf.face(face);
-		for (int iv = 0; iv < m_buf.getFaceResolution(); ++iv)
-			for (int iu = 0; iu < m_buf.getFaceResolution(); ++iu, facep += m_buf.getNChans()) {
+		const float* cover = m_buf.channel(face, 1);
+		const float* r = m_buf.channel(face, 2);
+		const float* g = m_buf.channel(face, 3);
+		const float* b = m_buf.channel(face, 4);
+		for (int iv = 0, i = 0; iv < m_buf.getFaceResolution(); ++iv)
+			for (int iu = 0; iu < m_buf.getFaceResolution(); ++iu, ++i) {
 				float d = dot(m_buf.rayDirection(face, iu, iv), N) - cosConeAngle;
 				if (d > 0) {
 					d *= m_buf.pixelSize(iu, iv);
-					C3f & radiosity = *(C3f*) (facep + 2);
-					rad += d * radiosity;
-					occ += d * facep[1];
+					rad += d * C3f(r[i], g[i], b[i]);
+					occ += d * cover[i];
 					totWeight += d;
 				}
 			}
@@ -31,6 +31,7 @@
 #include <cassert>
 #include <cmath>
 #include <cstring>
+#include <fstream>
 
 #include <Partio.h>
 
@@ -50,7 +51,16 @@ static void releasePartioFile(Partio::ParticlesInfo* file) {
 		file->release();
 }
 
-bool loadDiffusePointFile(PointArray& points, const std::string& fileName) {
+/// Number of floats in each point read from a point cloud file.
+static const int pointStride = 10;
+
+/**
+ * Read the points of an aqsis point cloud file.
+ *
+ * Each point is passed to output.add() as an array of pointStride floats.
+ */
+template<typename OutputT>
+static bool readDiffusePoints(const std::string& fileName, OutputT& output) {
 	namespace Pio = Partio;
 	boost::shared_ptr < Pio::ParticlesData > ptFile(Pio::read(fileName.c_str()), releasePartioFile);
 	if (!ptFile)
@@ -76,12 +86,7 @@ bool loadDiffusePointFile(PointArray& points, const std::string& fileName) {
 				<< "\"\n";
 		return false;
 	}
-	// Allocate extra space in output array
-	int npts = ptFile->numParticles();
-	points.stride = 10;
-	std::vector<float>& data = points.data;
-	data.resize(data.size() + npts * 10, 0);
-	float* out = &data[data.size() - npts * 10];
+	output.reserve(ptFile->numParticles());
 	// Iterate over all particles
 	Pio::ParticleAccessor posAcc(posAttr);
 	Pio::ParticleAccessor norAcc(norAttr);
@@ -93,33 +98,81 @@ bool loadDiffusePointFile(PointArray& points, const std::string& fileName) {
 	pt.addAccessor(rAcc);
 	if (hasRadiosity)
 		pt.addAccessor(radAcc);
+	float out[pointStride];
 	for (; pt != ptFile->end(); ++pt) {
 		// TODO: Use nicer types here?
 		const Pio::Data<float, 3>& P = posAcc.data<Pio::Data<float, 3> > (pt);
 		const Pio::Data<float, 3>& N = norAcc.data<Pio::Data<float, 3> > (pt);
 		const Pio::Data<float, 1>& R = rAcc.data<Pio::Data<float, 1> > (pt);
-		*out++ = P[0];
-		*out++ = P[1];
-		*out++ = P[2];
-		*out++ = N[0];
-		*out++ = N[1];
-		*out++ = N[2];
-		*out++ = R[0];
+		out[0] = P[0];
+		out[1] = P[1];
+		out[2] = P[2];
+		out[3] = N[0];
+		out[4] = N[1];
+		out[5] = N[2];
+		out[6] = R[0];
 		if (hasRadiosity) {
 			const Pio::Data<float, 3>& C = radAcc.data<Pio::Data<float, 3> > (
 					pt);
-			*out++ = C[0];
-			*out++ = C[1];
-			*out++ = C[2];
+			out[7] = C[0];
+			out[8] = C[1];
+			out[9] = C[2];
 		} else {
-			*out++ = 0;
-			*out++ = 0;
-			*out++ = 0;
+			out[7] = 0;
+			out[8] = 0;
+			out[9] = 0;
 		}
+		output.add(out);
 	}
 	return true;
 }
 
+/// Appends points to a PointArray.
+struct PointArrayOutput {
+	std::vector<float>& data;
+
+	PointArrayOutput(std::vector<float>& data) : data(data) {
+	}
+	void reserve(int npts) {
+		data.reserve(data.size() + npts * pointStride);
+	}
+	void add(const float* p) {
+		data.insert(data.end(), p, p + pointStride);
+	}
+};
+
+/// Writes points to a spool file.
+struct SpoolOutput {
+	std::ofstream& out;
+
+	SpoolOutput(std::ofstream& out) : out(out) {
+	}
+	void reserve(int) {
+	}
+	void add(const float* p) {
+		out.write(reinterpret_cast<const char*>(p), pointStride * sizeof(float));
+	}
+};
+
+bool loadDiffusePointFile(PointArray& points, const std::string& fileName) {
+	points.stride = pointStride;
+	PointArrayOutput output(points.data);
+	return readDiffusePoints(fileName, output);
+}
+
+bool spoolDiffusePointFile(const std::string& fileName,
+		const std::string& spoolName, int& stride) {
+	stride = pointStride;
+	std::ofstream out(spoolName.c_str(), std::ios::binary | std::ios::trunc);
+	if (!out)
+		return false;
+	SpoolOutput output(out);
+	if (!readDiffusePoints(fileName, output))
+		return false;
+	out.close();
+	return !out.fail();
+}
+
 DiffusePointOctree::DiffusePointOctree(const PointArray& points) :
 	m_root(0), m_dataSize(points.stride) {
 	size_t npoints = points.size();
@@ -173,14 +226,12 @@ DiffusePointOctree::Node* DiffusePointOctree::makeTree(int depth, const float**
 	V3f diag = bound.size();
 	node->boundRadius = diag.length() / 2.0f;
 	node->npoints = 0;
-	size_t pointsPerLeaf = 8;
 	// Limit max depth of tree to prevent infinite recursion when
 	// greater than pointsPerLeaf points lie at the same position in
 	// space.  floats effectively have 24 bit of precision in the
 	// significand, so there's never any point splitting more than 24
 	// times.
-	int maxDepth = 24;
-	if (npoints <= pointsPerLeaf || depth >= maxDepth) {
+	if (npoints <= size_t(pointsPerLeaf) || depth >= maxDepth) {
 		// Small number of child points: make this a leaf node and
 		// store the points directly in the data member.
 		node->npoints = npoints;
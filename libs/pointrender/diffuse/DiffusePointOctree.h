@@ -59,6 +59,26 @@ namespace Aqsis {
  */
 bool loadDiffusePointFile(PointArray& points, const std::string& fileName);
 
+/**
+ * Copy the points of an aqsis point cloud file to a spool file.
+ *
+ * The points are read as for loadDiffusePointFile(), and written to the
+ * spool file as raw native floats, stride floats per point, so that they can
+ * be streamed back without holding the whole point cloud in memory.
+ *
+ * @param fileName
+ * 		Point cloud file to read.
+ * @param spoolName
+ * 		Spool file to write; it's replaced if it exists.
+ * @param stride
+ * 		Set to the number of floats written for each point.
+ * @return
+ * 		true on success, false if the point cloud couldn't be read or the
+ * 		spool file couldn't be written.
+ */
+bool spoolDiffusePointFile(const std::string& fileName,
+		const std::string& spoolName, int& stride);
+
 
 /**
  * This class offers a naive way of storing diffuse surfels in a point hierarchy.
@@ -107,6 +127,12 @@ private:
 
 public:
 
+	/// Nodes with no more than this many points are made into leaves.
+	static const int pointsPerLeaf = 8;
+	/// Depth at which nodes are made into leaves however many points they
+	/// hold.
+	static const int maxDepth = 24;
+
 	/**
 	 * Construct an octree hierarchy of diffuse surfels/points from an
 	 * array of points.
@@ -33,10 +33,14 @@
 
 #include <cassert>
 #include <cmath>
+#include <cstdio>
 #include <cstring>
 
+#include <boost/filesystem/operations.hpp>
+
 #include <Partio.h>
 
+#include <aqsis/util/file.h>
 #include <aqsis/util/logging.h>
 
 #include "DiffusePointOctree.h"
@@ -44,27 +48,67 @@
 namespace Aqsis {
 
 
-DiffusePointOctree* DiffusePointOctreeCache::find(const std::string& fileName) {
+namespace {
+
+/**
+ * Load the paged octree for a point cloud, building it if necessary.
+ */
+boost::shared_ptr<PagedPointOctree> loadPagedTree(const std::string& fileName) {
+    std::string pagedName = fileName + ".aqoct";
+    boost::shared_ptr<PagedPointOctree> tree;
+    // Modification times only have a resolution of a second, so the file
+    // size is checked too before an existing tree is reused.
+    PagedPointOctree::SourceStamp source = { 0, 0 };
+    try {
+        if(boostfs::exists(fileName)) {
+            source.size = boostfs::file_size(fileName);
+            source.modTime = boostfs::last_write_time(fileName);
+            tree = PagedPointOctree::open(pagedName, source);
+        }
+    } catch(boostfs::filesystem_error& /*e*/) {
+        // Fall through and rebuild the tree.
+    }
+    if(tree)
+        return tree;
+
+    // TODO: Path handling
+    // Build the tree from a spooled copy of the points, so that neither the
+    // points nor the tree have to fit in memory.
+    std::string spoolName = uniqueTempName(pagedName + ".spool");
+    int stride = 0;
+    if(spoolDiffusePointFile(fileName, spoolName, stride)
+       && PagedPointOctree::build(spoolName, stride, pagedName, source))
+        tree = PagedPointOctree::open(pagedName, source);
+    std::remove(spoolName.c_str());
+    if(tree)
+        return tree;
+
+    PointArray points;
+    if(!loadDiffusePointFile(points, fileName)) {
+        Aqsis::log() << error << "Point cloud file \"" << fileName
+                     << "\" not found\n";
+        return tree;
+    }
+    Aqsis::log() << warning << "Could not write point octree file \""
+                 << pagedName << "\"; keeping the octree in memory\n";
+    DiffusePointOctree memTree(points);
+    tree = PagedPointOctree::fromTree(memTree);
+    return tree;
+}
+
+} // unnamed namespace
+
 
+const PagedPointOctree* DiffusePointOctreeCache::find(const std::string& fileName) {
+#ifdef ENABLE_THREADING
+    boost::mutex::scoped_lock lock(m_mutex);
+#endif
 	// Try to get octree from the cache ...
     MapType::const_iterator i = m_cache.find(fileName);
     if(i == m_cache.end()) {
-
-        // Not in the cache, open the file ...
-        // TODO: Path handling
-        PointArray points;
-
-        // Convert to octree
-        boost::shared_ptr<DiffusePointOctree> tree;
-        if(loadDiffusePointFile(points, fileName)) {
-            tree.reset(new DiffusePointOctree(points));
-        } else {
-            Aqsis::log() << error << "Point cloud file \"" << fileName
-                         << "\" not found\n";
-        }
-
-        // Insert into map.  If we couldn't load the file, we insert
-        // a null pointer to record the failure.
+        // Not in the cache, load or build the octree.  If we couldn't load
+        // the file, we insert a null pointer to record the failure.
+        boost::shared_ptr<PagedPointOctree> tree = loadPagedTree(fileName);
         m_cache.insert(MapType::value_type(fileName, tree));
         return tree.get();
     }
@@ -75,6 +119,9 @@ DiffusePointOctree* DiffusePointOctreeCache::find(const std::string& fileName) {
 
 
 void DiffusePointOctreeCache::clear() {
+#ifdef ENABLE_THREADING
+    boost::mutex::scoped_lock lock(m_mutex);
+#endif
     m_cache.clear();
 }
 
@@ -31,18 +31,34 @@
 #define DIFFUSEPOINTOCTREECACHE_H_
 
 #include <map>
+#include <string>
 
 #include <boost/shared_ptr.hpp>
-#include "DiffusePointOctree.h"
+#ifdef ENABLE_THREADING
+#include <boost/thread/mutex.hpp>
+#endif
+
+#include "PagedPointOctree.h"
 
 namespace Aqsis {
 
+/**
+ * Cache of point octrees, keyed by the name of their point cloud file.
+ *
+ * Octrees are kept in paged form next to the point cloud, in a file with the
+ * extension ".aqoct".  The paged file is rebuilt when it's missing or older
+ * than the point cloud, so each point cloud is only turned into an octree
+ * once.  Pages are loaded on demand into the texture tile cache.
+ */
 class DiffusePointOctreeCache {
 
 private:
 
-	typedef std::map<std::string, boost::shared_ptr<DiffusePointOctree> > MapType;
+	typedef std::map<std::string, boost::shared_ptr<PagedPointOctree> > MapType;
 	MapType m_cache; //< The cache
+#ifdef ENABLE_THREADING
+	boost::mutex m_mutex; //< Protects the cache
+#endif
 
 public:
 
@@ -56,7 +72,7 @@ public:
 	 * @return
 	 * 			The octree of the surfels in the pointcloud file.
 	 */
-	DiffusePointOctree* find(const std::string& fileName);
+	const PagedPointOctree* find(const std::string& fileName);
 
 	/**
 	 * Clear all the octrees of the cache.
@@ -0,0 +1,851 @@
+// Copyright (C) 2001, Paul C. Gregory and the other authors and contributors
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// * Neither the name of the software's owners nor the names of its
+//   contributors may be used to endorse or promote products derived from this
+//   software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+// (This is the New BSD license)
+
+#include "PagedPointOctree.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+
+#include <boost/bind.hpp>
+#include <boost/checked_delete.hpp>
+
+#include <aqsis/tex/buffers/tilecache.h>
+#include <aqsis/util/file.h>
+#include <aqsis/util/logging.h>
+
+namespace Aqsis {
+
+using Imath::V3f;
+using Imath::C3f;
+using Imath::Box3f;
+
+namespace {
+
+const char fileMagic[8] = { 'A', 'Q', 'S', 'O', 'C', 'T', 'R', 'E' };
+/// Written as a native integer to detect files from the other byte order.
+const TqUint32 byteOrderMark = 0x01020304;
+const TqUint32 fileVersion = 2;
+/// Size of the header fields at the start of page 0.
+const int headerSize = 60;
+/// Size of each page in bytes.
+const TqUint32 pageSize = 64*1024;
+/// Size of a node record in bytes.
+//
+// Record layout:
+//   0  center (3 floats), boundRadius
+//  16  aggP (3 floats), aggR
+//  32  aggN (3 floats), aggCol (3 floats)
+//  56  first child, or first point slot of a leaf
+//  60  npoints of a leaf, or nchildren | interiorFlag
+const TqUint32 recordSize = 64;
+const TqUint32 nodesPerPage = pageSize / recordSize;
+/// Marks the count field of an interior node record.
+const TqUint32 interiorFlag = 0x80000000;
+
+template<typename T>
+inline void put(char* dest, T value) {
+	std::memcpy(dest, &value, sizeof(T));
+}
+
+template<typename T>
+inline T get(const char* src) {
+	T value;
+	std::memcpy(&value, src, sizeof(T));
+	return value;
+}
+
+/**
+ * Get the number of points stored in each point page.
+ *
+ * @return
+ * 		The number of points, or zero if a point doesn't fit in a page.
+ */
+TqUint32 pointsPerPageFor(int dataSize) {
+	if (dataSize <= 0 || std::size_t(dataSize) > pageSize / sizeof(float)) {
+		Aqsis::log() << error << "Points of " << dataSize
+				<< " floats are too large for a paged point octree\n";
+		return 0;
+	}
+	return pageSize / (dataSize * sizeof(float));
+}
+
+/// Encode a node into its record.
+void encodeNode(char* rec, const DiffusePointOctree::Node& node,
+		TqUint32 link, TqUint32 count) {
+	for (int i = 0; i < 3; ++i) {
+		put<float>(rec + 4*i, node.center[i]);
+		put<float>(rec + 16 + 4*i, node.aggP[i]);
+		put<float>(rec + 32 + 4*i, node.aggN[i]);
+		put<float>(rec + 44 + 4*i, node.aggCol[i]);
+	}
+	put<float>(rec + 12, node.boundRadius);
+	put<float>(rec + 28, node.aggR);
+	put<TqUint32>(rec + 56, link);
+	put<TqUint32>(rec + 60, count);
+}
+
+/// Write the header page of a paged octree.
+void writeHeader(std::ostream& out, int dataSize, TqUint32 pointsPerPage,
+		TqUint32 nodeCount, TqUint32 nodePages, TqUint32 pointPages,
+		const PagedPointOctree::SourceStamp& source) {
+	std::vector<char> page(pageSize, 0);
+	char* h = &page[0];
+	std::memcpy(h, fileMagic, sizeof(fileMagic));
+	put<TqUint32>(h + 8, byteOrderMark);
+	put<TqUint32>(h + 12, fileVersion);
+	put<TqUint32>(h + 16, pageSize);
+	put<TqUint32>(h + 20, recordSize);
+	put<TqUint32>(h + 24, dataSize);
+	put<TqUint32>(h + 28, pointsPerPage);
+	put<TqUint32>(h + 32, nodeCount);
+	put<TqUint32>(h + 36, nodePages);
+	put<TqUint32>(h + 40, pointPages);
+	put<boost::uint64_t>(h + 44, source.size);
+	put<boost::int64_t>(h + 52, source.modTime);
+	out.write(&page[0], pageSize);
+}
+
+/// Deleter for pages owned by the tree rather than the tile cache.
+struct NullDeleter {
+	void operator()(void*) const {}
+};
+
+/**
+ * Assigns record indices and point pages to the nodes of a tree.
+ *
+ * The children of each node are given consecutive indices, and subtrees are
+ * laid out depth first so that nodes visited together share pages.
+ */
+struct TreeLayout {
+	typedef std::pair<const DiffusePointOctree::Node*, boost::uint64_t> Leaf;
+
+	TqUint32 pointsPerPage;
+	std::vector<char> records;
+	/// Leaves with the slot of their first point, in the order their points
+	/// are stored.
+	std::vector<Leaf> leaves;
+	TqUint32 nodeCount;
+	/// Next free point slot; slot i is point i % pointsPerPage of point page
+	/// i / pointsPerPage.
+	boost::uint64_t pointSlots;
+
+	TreeLayout(TqUint32 pointsPerPage) :
+		pointsPerPage(pointsPerPage), records(), leaves(), nodeCount(0),
+				pointSlots(0) {
+	}
+
+	TqUint32 allocate(TqUint32 count) {
+		TqUint32 first = nodeCount;
+		nodeCount += count;
+		records.resize(std::size_t(nodeCount) * recordSize);
+		return first;
+	}
+
+	void encode(TqUint32 index, const DiffusePointOctree::Node* node,
+			TqUint32 link, TqUint32 count) {
+		encodeNode(&records[std::size_t(index) * recordSize], *node, link,
+				count);
+	}
+
+	void add(const DiffusePointOctree::Node* node, TqUint32 index) {
+		if (node->npoints > 0) {
+			// Leaves which fit in a page don't straddle two pages.  Larger
+			// leaves start on a fresh page and run on into the next ones.
+			TqUint32 inPage = pointSlots % pointsPerPage;
+			if (inPage != 0 && inPage + node->npoints > pointsPerPage)
+				pointSlots += pointsPerPage - inPage;
+			encode(index, node, static_cast<TqUint32>(pointSlots),
+					node->npoints);
+			leaves.push_back(Leaf(node, pointSlots));
+			pointSlots += node->npoints;
+			return;
+		}
+		int nchildren = 0;
+		for (int i = 0; i < 8; ++i)
+			nchildren += node->children[i] != 0;
+		TqUint32 first = allocate(nchildren);
+		encode(index, node, first, nchildren | interiorFlag);
+		for (int i = 0; i < 8; ++i) {
+			if (node->children[i])
+				add(node->children[i], first++);
+		}
+	}
+};
+
+/// Area weighted sums for the aggregate values of a node.
+struct AggregateSums {
+	float sumA;
+	V3f sumP;
+	V3f sumN;
+	C3f sumCol;
+
+	AggregateSums() : sumA(0), sumP(0), sumN(0), sumCol(0) {
+	}
+
+	void addPoint(const float* p) {
+		float A = p[6] * p[6] * M_PI;
+		sumA += A;
+		sumP += A * V3f(p[0], p[1], p[2]);
+		sumN += A * V3f(p[3], p[4], p[5]);
+		sumCol += A * C3f(p[7], p[8], p[9]);
+	}
+
+	void addChild(const DiffusePointOctree::Node& child) {
+		float A = child.aggR * child.aggR*M_PI;
+		sumA += A;
+		sumP += A * child.aggP;
+		sumN += A * child.aggN;
+		sumCol += A * child.aggCol;
+	}
+
+	void finish(DiffusePointOctree::Node& node) const {
+		node.aggP = 1.0f / sumA * sumP;
+		node.aggN = sumN.normalized();
+		node.aggR = sqrtf(sumA/M_PI);
+		node.aggCol = 1.0f / sumA * sumCol;
+	}
+};
+
+/// Get the bound of child i of a node.
+Box3f childBound(const Box3f& bound, const V3f& c, int i) {
+	Box3f bnd;
+	bnd.min.x = (i % 2 == 0) ? bound.min.x : c.x;
+	bnd.min.y = ((i / 2) % 2 == 0) ? bound.min.y : c.y;
+	bnd.min.z = ((i / 4) % 2 == 0) ? bound.min.z : c.z;
+	bnd.max.x = (i % 2 == 0) ? c.x : bound.max.x;
+	bnd.max.y = ((i / 2) % 2 == 0) ? c.y : bound.max.y;
+	bnd.max.z = ((i / 4) % 2 == 0) ? c.z : bound.max.z;
+	return bnd;
+}
+
+/// Get the octant of a node which a point falls in.
+inline int childIndex(const float* p, const V3f& c) {
+	return 4 * (p[2] > c.z) + 2 * (p[1] > c.y) + (p[0] > c.x);
+}
+
+/**
+ * Builds a paged octree from spooled points, without holding all the points
+ * or nodes in memory.
+ *
+ * The tree is split exactly as DiffusePointOctree splits it, and laid out as
+ * TreeLayout lays it out, so the pages are the same as those written for a
+ * DiffusePointOctree of the same points.  Subtrees with more than maxPoints
+ * points are partitioned through temporary spool files, one for each child;
+ * smaller subtrees are built in memory.  Node records are written to a
+ * temporary file by index, and point pages to another as leaves are
+ * finished, and the two are copied into the paged file at the end.
+ */
+class SpooledTreeBuilder : boost::noncopyable {
+public:
+	typedef DiffusePointOctree::Node Node;
+
+	SpooledTreeBuilder(int dataSize, TqUint32 pointsPerPage,
+			std::size_t maxPoints, const std::string& tmpBase) :
+		m_dataSize(dataSize), m_pointBytes(dataSize * sizeof(float)),
+				m_pointsPerPage(pointsPerPage),
+				m_maxPoints(std::max<std::size_t>(maxPoints, 1)),
+				m_tmpBase(tmpBase), m_tmpFiles(), m_nodeCount(0),
+				m_nodes(), m_records(), m_bufferFrom(0), m_buffering(false),
+				m_points(), m_page(pageSize, 0), m_pointPage(0),
+				m_pointSlots(0) {
+	}
+
+	~SpooledTreeBuilder() {
+		m_nodes.close();
+		m_points.close();
+		for (std::size_t i = 0; i < m_tmpFiles.size(); ++i)
+			std::remove(m_tmpFiles[i].c_str());
+	}
+
+	/// Build the tree for the points in a spool file, and write it to out.
+	bool build(const std::string& spoolName,
+			const PagedPointOctree::SourceStamp& source, std::ostream& out) {
+		std::string nodesName = newTempFile();
+		std::string pointsName = newTempFile();
+		m_nodes.open(nodesName.c_str(), std::ios::in | std::ios::out
+				| std::ios::binary | std::ios::trunc);
+		m_points.open(pointsName.c_str(), std::ios::binary | std::ios::trunc);
+		if (!m_nodes || !m_points)
+			return fail("Could not create temporary point octree files");
+
+		// Find the bound and the number of points.
+		std::ifstream in(spoolName.c_str(), std::ios::binary);
+		if (!in)
+			return fail("Could not open point spool file");
+		boost::uint64_t npoints = 0;
+		Box3f bound;
+		std::vector<float> buf(chunkPoints * m_dataSize);
+		while (std::size_t count = readPoints(in, buf)) {
+			for (std::size_t i = 0; i < count; ++i) {
+				const float* p = &buf[i * m_dataSize];
+				bound.extendBy(V3f(p[0], p[1], p[2]));
+			}
+			npoints += count;
+		}
+		in.close();
+		// Make the bound cubic, as DiffusePointOctree does.
+		V3f d = bound.size();
+		V3f c = bound.center();
+		float maxDim2 = std::max(std::max(d.x, d.y), d.z) / 2;
+		bound.min = c - V3f(maxDim2);
+		bound.max = c + V3f(maxDim2);
+
+		if (npoints > 0) {
+			Node root;
+			if (!buildFromFile(0, spoolName, npoints, bound, allocate(1), root))
+				return false;
+		}
+		if (m_pointSlots > 0)
+			m_points.write(&m_page[0], pageSize);
+		m_points.close();
+		if (!m_nodes || m_points.fail())
+			return fail("Could not write temporary point octree files");
+		if (m_pointSlots > 0xFFFFFFFFu || m_nodeCount > 0xFFFFFFFFu)
+			return fail("Too many points for a paged point octree");
+
+		TqUint32 nodeCount = static_cast<TqUint32>(m_nodeCount);
+		TqUint32 nodePages = (nodeCount + nodesPerPage - 1) / nodesPerPage;
+		TqUint32 pointPages = static_cast<TqUint32>(
+				(m_pointSlots + m_pointsPerPage - 1) / m_pointsPerPage);
+		writeHeader(out, m_dataSize, m_pointsPerPage, nodeCount, nodePages,
+				pointPages, source);
+		m_nodes.seekg(0);
+		for (TqUint32 p = 0; p < nodePages; ++p) {
+			std::fill(m_page.begin(), m_page.end(), 0);
+			TqUint32 count = std::min(nodesPerPage, nodeCount - p * nodesPerPage);
+			if (!m_nodes.read(&m_page[0], count * recordSize))
+				return fail("Could not read temporary point octree file");
+			out.write(&m_page[0], pageSize);
+		}
+		std::ifstream points(pointsName.c_str(), std::ios::binary);
+		for (TqUint32 p = 0; p < pointPages; ++p) {
+			if (!points.read(&m_page[0], pageSize))
+				return fail("Could not read temporary point octree file");
+			out.write(&m_page[0], pageSize);
+		}
+		return out.good();
+	}
+
+private:
+	/// Number of points read from a spool file at once.
+	static const std::size_t chunkPoints = 4096;
+
+	bool fail(const char* message) {
+		Aqsis::log() << error << message << "\n";
+		return false;
+	}
+
+	std::string newTempFile() {
+		m_tmpFiles.push_back(uniqueTempName(m_tmpBase));
+		return m_tmpFiles.back();
+	}
+
+	/// Read up to buf.size() / m_dataSize points; returns the number read.
+	std::size_t readPoints(std::istream& in, std::vector<float>& buf) {
+		in.read(reinterpret_cast<char*>(&buf[0]), buf.size() * sizeof(float));
+		return static_cast<std::size_t>(in.gcount()) / m_pointBytes;
+	}
+
+	boost::uint64_t allocate(int count) {
+		boost::uint64_t first = m_nodeCount;
+		m_nodeCount += count;
+		if (m_buffering)
+			m_records.resize((m_nodeCount - m_bufferFrom) * recordSize);
+		return first;
+	}
+
+	void writeNode(boost::uint64_t index, const Node& node, TqUint32 link,
+			TqUint32 count) {
+		char rec[recordSize];
+		if (m_buffering && index >= m_bufferFrom) {
+			encodeNode(&m_records[(index - m_bufferFrom) * recordSize], node,
+					link, count);
+			return;
+		}
+		encodeNode(rec, node, link, count);
+		m_nodes.seekp(static_cast<std::streamoff>(index * recordSize));
+		m_nodes.write(rec, recordSize);
+	}
+
+	/// Allocate point slots for a leaf, as TreeLayout::add() does.
+	TqUint32 startLeaf(boost::uint64_t npoints) {
+		TqUint32 inPage = m_pointSlots % m_pointsPerPage;
+		if (inPage != 0 && inPage + npoints > m_pointsPerPage)
+			m_pointSlots += m_pointsPerPage - inPage;
+		return static_cast<TqUint32>(m_pointSlots);
+	}
+
+	void putPoint(const float* p) {
+		while (m_pointSlots / m_pointsPerPage > m_pointPage) {
+			m_points.write(&m_page[0], pageSize);
+			std::fill(m_page.begin(), m_page.end(), 0);
+			++m_pointPage;
+		}
+		std::memcpy(&m_page[(m_pointSlots % m_pointsPerPage) * m_pointBytes],
+				p, m_pointBytes);
+		++m_pointSlots;
+	}
+
+	void setBound(Node& node, const Box3f& bound) {
+		node.center = bound.center();
+		V3f diag = bound.size();
+		node.boundRadius = diag.length() / 2.0f;
+	}
+
+	/**
+	 * Build the subtree of the points in a spool file.
+	 *
+	 * Spool files other than the one at depth 0 were made by the builder, and
+	 * are removed once their points have been read.
+	 */
+	bool buildFromFile(int depth, const std::string& spoolName,
+			boost::uint64_t npoints, const Box3f& bound, boost::uint64_t index,
+			Node& node) {
+		if (npoints > m_maxPoints)
+			return buildSpooled(depth, spoolName, npoints, bound, index, node);
+		std::vector<float> data(npoints * m_dataSize);
+		{
+			std::ifstream in(spoolName.c_str(), std::ios::binary);
+			if (readPoints(in, data) != npoints)
+				return fail("Could not read point spool file");
+		}
+		if (depth > 0)
+			std::remove(spoolName.c_str());
+		std::vector<const float*> points(npoints);
+		for (std::size_t i = 0; i < npoints; ++i)
+			points[i] = &data[i * m_dataSize];
+		// The nodes below this one are allocated consecutively, so their
+		// records are collected and written together.
+		m_buffering = true;
+		m_bufferFrom = m_nodeCount;
+		m_records.clear();
+		buildInMemory(depth, &points[0], npoints, bound, index, node);
+		m_buffering = false;
+		if (!m_records.empty()) {
+			m_nodes.seekp(static_cast<std::streamoff>(m_bufferFrom * recordSize));
+			m_nodes.write(&m_records[0], m_records.size());
+		}
+		return true;
+	}
+
+	/// Build a subtree from points held in memory, as makeTree() does.
+	void buildInMemory(int depth, const float** points, std::size_t npoints,
+			const Box3f& bound, boost::uint64_t index, Node& node) {
+		setBound(node, bound);
+		AggregateSums sums;
+		if (npoints <= std::size_t(DiffusePointOctree::pointsPerLeaf)
+				|| depth >= DiffusePointOctree::maxDepth) {
+			TqUint32 first = startLeaf(npoints);
+			for (std::size_t j = 0; j < npoints; ++j) {
+				putPoint(points[j]);
+				sums.addPoint(points[j]);
+			}
+			sums.finish(node);
+			writeNode(index, node, first, static_cast<TqUint32>(npoints));
+			return;
+		}
+		// Partition the points into the children, keeping their order.
+		std::size_t np[8] = { 0 };
+		for (std::size_t i = 0; i < npoints; ++i)
+			++np[childIndex(points[i], node.center)];
+		std::size_t start[8];
+		std::size_t total = 0;
+		int nchildren = 0;
+		for (int i = 0; i < 8; ++i) {
+			start[i] = total;
+			total += np[i];
+			nchildren += np[i] != 0;
+		}
+		std::vector<const float*> sorted(npoints);
+		std::size_t next[8];
+		std::copy(start, start + 8, next);
+		for (std::size_t i = 0; i < npoints; ++i)
+			sorted[next[childIndex(points[i], node.center)]++] = points[i];
+		boost::uint64_t first = allocate(nchildren);
+		boost::uint64_t child = first;
+		for (int i = 0; i < 8; ++i) {
+			if (np[i] == 0)
+				continue;
+			Node childNode;
+			buildInMemory(depth + 1, &sorted[start[i]], np[i],
+					childBound(bound, node.center, i), child++, childNode);
+			sums.addChild(childNode);
+		}
+		sums.finish(node);
+		writeNode(index, node, static_cast<TqUint32>(first),
+				nchildren | interiorFlag);
+	}
+
+	/// Build a subtree by partitioning the points into child spool files.
+	bool buildSpooled(int depth, const std::string& spoolName,
+			boost::uint64_t npoints, const Box3f& bound, boost::uint64_t index,
+			Node& node) {
+		setBound(node, bound);
+		AggregateSums sums;
+		std::vector<float> buf(chunkPoints * m_dataSize);
+		std::ifstream in(spoolName.c_str(), std::ios::binary);
+		if (!in)
+			return fail("Could not read point spool file");
+		if (depth >= DiffusePointOctree::maxDepth) {
+			// Too many coincident points to split; stream them into a leaf.
+			TqUint32 first = startLeaf(npoints);
+			boost::uint64_t done = 0;
+			while (std::size_t count = readPoints(in, buf)) {
+				for (std::size_t i = 0; i < count; ++i) {
+					putPoint(&buf[i * m_dataSize]);
+					sums.addPoint(&buf[i * m_dataSize]);
+				}
+				done += count;
+			}
+			in.close();
+			if (done != npoints)
+				return fail("Could not read point spool file");
+			if (depth > 0)
+				std::remove(spoolName.c_str());
+			sums.finish(node);
+			writeNode(index, node, first, static_cast<TqUint32>(npoints));
+			return true;
+		}
+		std::string childNames[8];
+		boost::uint64_t np[8] = { 0 };
+		{
+			std::ofstream childFiles[8];
+			for (int i = 0; i < 8; ++i) {
+				childNames[i] = newTempFile();
+				childFiles[i].open(childNames[i].c_str(),
+						std::ios::binary | std::ios::trunc);
+			}
+			while (std::size_t count = readPoints(in, buf)) {
+				for (std::size_t j = 0; j < count; ++j) {
+					const float* p = &buf[j * m_dataSize];
+					int i = childIndex(p, node.center);
+					childFiles[i].write(reinterpret_cast<const char*>(p),
+							m_pointBytes);
+					++np[i];
+				}
+			}
+			for (int i = 0; i < 8; ++i) {
+				childFiles[i].close();
+				if (childFiles[i].fail())
+					return fail("Could not write point spool file");
+			}
+		}
+		in.close();
+		if (depth > 0)
+			std::remove(spoolName.c_str());
+		int nchildren = 0;
+		for (int i = 0; i < 8; ++i)
+			nchildren += np[i] != 0;
+		boost::uint64_t first = allocate(nchildren);
+		boost::uint64_t child = first;
+		for (int i = 0; i < 8; ++i) {
+			if (np[i] == 0) {
+				std::remove(childNames[i].c_str());
+				continue;
+			}
+			Node childNode;
+			if (!buildFromFile(depth + 1, childNames[i], np[i],
+					childBound(bound, node.center, i), child++, childNode))
+				return false;
+			sums.addChild(childNode);
+		}
+		sums.finish(node);
+		writeNode(index, node, static_cast<TqUint32>(first),
+				nchildren | interiorFlag);
+		return true;
+	}
+
+	int m_dataSize;
+	std::size_t m_pointBytes;
+	TqUint32 m_pointsPerPage;
+	std::size_t m_maxPoints;
+	/// Base name of the temporary files.
+	std::string m_tmpBase;
+	std::vector<std::string> m_tmpFiles;
+	boost::uint64_t m_nodeCount;
+	/// Temporary file of node records, by index.
+	std::fstream m_nodes;
+	/// Records of the nodes from m_bufferFrom on, while m_buffering.
+	std::vector<char> m_records;
+	boost::uint64_t m_bufferFrom;
+	bool m_buffering;
+	/// Temporary file of point pages.
+	std::ofstream m_points;
+	/// Point page being filled.
+	std::vector<char> m_page;
+	boost::uint64_t m_pointPage;
+	/// Next free point slot.
+	boost::uint64_t m_pointSlots;
+};
+
+} // unnamed namespace
+
+
+//------------------------------------------------------------------------------
+// PagedPointOctree::Reader
+
+PagedPointOctree::Reader::Reader(const PagedPointOctree& tree) :
+	m_tree(tree), m_nodePageIndex(0), m_nodePage(), m_pointPageIndex(0),
+			m_pointPage(), m_scratch() {
+}
+
+void PagedPointOctree::Reader::node(TqUint32 index, Node& node) {
+	TqUint32 pageIndex = 1 + index / m_tree.m_nodesPerPage;
+	if (!m_nodePage || pageIndex != m_nodePageIndex) {
+		m_nodePage = m_tree.page(pageIndex);
+		m_nodePageIndex = pageIndex;
+	}
+	const char* rec = static_cast<const char*>(m_nodePage.get())
+			+ (index % m_tree.m_nodesPerPage) * recordSize;
+	for (int i = 0; i < 3; ++i) {
+		node.center[i] = get<float>(rec + 4*i);
+		node.aggP[i] = get<float>(rec + 16 + 4*i);
+		node.aggN[i] = get<float>(rec + 32 + 4*i);
+		node.aggCol[i] = get<float>(rec + 44 + 4*i);
+	}
+	node.boundRadius = get<float>(rec + 12);
+	node.aggR = get<float>(rec + 28);
+	node.firstChild = get<TqUint32>(rec + 56);
+	TqUint32 count = get<TqUint32>(rec + 60);
+	if (count & interiorFlag) {
+		node.npoints = 0;
+		node.nchildren = count & ~interiorFlag;
+	} else {
+		node.npoints = count;
+		node.nchildren = 0;
+	}
+}
+
+const float* PagedPointOctree::Reader::pointPage(TqUint32 index) {
+	TqUint32 pageIndex = 1 + m_tree.m_nodePages + index;
+	if (!m_pointPage || pageIndex != m_pointPageIndex) {
+		m_pointPage = m_tree.page(pageIndex);
+		m_pointPageIndex = pageIndex;
+	}
+	return static_cast<const float*>(m_pointPage.get());
+}
+
+const float* PagedPointOctree::Reader::leafPoints(const Node& node) {
+	TqUint32 perPage = m_tree.m_pointsPerPage;
+	TqUint32 offset = node.firstChild % perPage;
+	int dataSize = m_tree.m_dataSize;
+	if (offset + node.npoints <= perPage)
+		return pointPage(node.firstChild / perPage) + offset * dataSize;
+	// The leaf is larger than a page, so gather its points together.
+	m_scratch.resize(std::size_t(node.npoints) * dataSize);
+	for (TqUint32 done = 0, npoints = node.npoints; done < npoints; ) {
+		TqUint32 slot = node.firstChild + done;
+		offset = slot % perPage;
+		TqUint32 count = std::min(perPage - offset, npoints - done);
+		const float* src = pointPage(slot / perPage) + offset * dataSize;
+		std::copy(src, src + count * dataSize,
+				&m_scratch[std::size_t(done) * dataSize]);
+		done += count;
+	}
+	return &m_scratch[0];
+}
+
+
+//------------------------------------------------------------------------------
+// PagedPointOctree
+
+PagedPointOctree::PagedPointOctree() :
+	m_dataSize(0), m_nodesPerPage(nodesPerPage), m_pointsPerPage(0),
+			m_nodeCount(0), m_nodePages(0), m_pointPages(0),
+			m_owner(CqTileCache::instance().newOwner()), m_file(), m_pages() {
+}
+
+PagedPointOctree::~PagedPointOctree() {
+	CqTileCache::instance().removeOwner(m_owner);
+}
+
+bool PagedPointOctree::serialize(const DiffusePointOctree& tree,
+		const SourceStamp& source, std::ostream& out) {
+	TqUint32 pointsPerPage = pointsPerPageFor(tree.dataSize());
+	if (pointsPerPage == 0)
+		return false;
+	TqUint32 pointBytes = tree.dataSize() * sizeof(float);
+	TreeLayout layout(pointsPerPage);
+	if (tree.root())
+		layout.add(tree.root(), layout.allocate(1));
+	if (layout.pointSlots > 0xFFFFFFFFu) {
+		Aqsis::log() << error << "Too many points for a paged point octree\n";
+		return false;
+	}
+	TqUint32 nodePages = (layout.nodeCount + nodesPerPage - 1) / nodesPerPage;
+	TqUint32 pointPages = static_cast<TqUint32>(
+			(layout.pointSlots + layout.pointsPerPage - 1) / layout.pointsPerPage);
+
+	writeHeader(out, tree.dataSize(), layout.pointsPerPage, layout.nodeCount,
+			nodePages, pointPages, source);
+
+	std::vector<char> page(pageSize, 0);
+	for (TqUint32 p = 0; p < nodePages; ++p) {
+		std::fill(page.begin(), page.end(), 0);
+		TqUint32 first = p * nodesPerPage;
+		TqUint32 count = std::min(nodesPerPage, layout.nodeCount - first);
+		std::memcpy(&page[0], &layout.records[std::size_t(first) * recordSize],
+				count * recordSize);
+		out.write(&page[0], pageSize);
+	}
+
+	// Pack the leaf points into the slots TreeLayout::add() allocated.
+	std::fill(page.begin(), page.end(), 0);
+	TqUint32 pointPage = 0;
+	for (std::vector<TreeLayout::Leaf>::const_iterator leaf =
+			layout.leaves.begin(); leaf != layout.leaves.end(); ++leaf) {
+		const float* data = leaf->first->data.get();
+		for (int i = 0, npoints = leaf->first->npoints; i < npoints; ++i) {
+			boost::uint64_t slot = leaf->second + i;
+			while (slot / layout.pointsPerPage > pointPage) {
+				out.write(&page[0], pageSize);
+				std::fill(page.begin(), page.end(), 0);
+				++pointPage;
+			}
+			std::memcpy(&page[(slot % layout.pointsPerPage) * pointBytes],
+					data + std::size_t(i) * tree.dataSize(), pointBytes);
+		}
+	}
+	if (pointPages > 0)
+		out.write(&page[0], pageSize);
+	return out.good();
+}
+
+bool PagedPointOctree::readHeader(std::istream& in, SourceStamp& source) {
+	char h[headerSize];
+	if (!in.read(h, headerSize))
+		return false;
+	if (std::memcmp(h, fileMagic, sizeof(fileMagic)) != 0
+			|| get<TqUint32>(h + 8) != byteOrderMark
+			|| get<TqUint32>(h + 12) != fileVersion
+			|| get<TqUint32>(h + 16) != pageSize
+			|| get<TqUint32>(h + 20) != recordSize)
+		return false;
+	m_dataSize = get<TqUint32>(h + 24);
+	m_pointsPerPage = get<TqUint32>(h + 28);
+	m_nodeCount = get<TqUint32>(h + 32);
+	m_nodePages = get<TqUint32>(h + 36);
+	m_pointPages = get<TqUint32>(h + 40);
+	source.size = get<boost::uint64_t>(h + 44);
+	source.modTime = get<boost::int64_t>(h + 52);
+	return m_dataSize > 0 && m_pointsPerPage > 0;
+}
+
+boost::shared_ptr<void> PagedPointOctree::page(TqUint32 index) const {
+	if (!m_pages.empty())
+		return boost::shared_ptr<void>(const_cast<char*>(
+				&m_pages[std::size_t(index) * pageSize]), NullDeleter());
+	CqTileCache& cache = CqTileCache::instance();
+	SqTileKey key(m_owner, index, 0);
+	if (CqTileCache::TqTilePtr resident = cache.find(key))
+		return resident;
+	boost::shared_ptr<char> data(new char[pageSize],
+			boost::checked_array_deleter<char>());
+	{
+		CqTileCache::CqReadLock lock(this);
+		m_file.clear();
+		m_file.seekg(static_cast<std::streamoff>(index) * pageSize);
+		if (!m_file.read(data.get(), pageSize)) {
+			// A truncated file decodes as empty nodes rather than garbage.
+			Aqsis::log() << error << "Could not read page " << index
+					<< " of point octree file\n";
+			std::memset(data.get(), 0, pageSize);
+		}
+	}
+	return cache.insert(key, data, pageSize);
+}
+
+template<typename SerializeT>
+bool PagedPointOctree::writeFile(const std::string& fileName,
+		SerializeT serializeFn) {
+	// Several renders may build the same file at once, so each writes its
+	// own temporary file and the last one to finish replaces the others.
+	std::string tmpName = uniqueTempName(fileName);
+	bool ok = false;
+	{
+		std::ofstream out(tmpName.c_str(), std::ios::binary);
+		ok = out && serializeFn(out);
+		out.close();
+		ok = ok && !out.fail();
+	}
+	if (!ok) {
+		std::remove(tmpName.c_str());
+		return false;
+	}
+	return replaceFile(tmpName, fileName);
+}
+
+bool PagedPointOctree::write(const DiffusePointOctree& tree,
+		const std::string& fileName, const SourceStamp& source) {
+	return writeFile(fileName, boost::bind(&PagedPointOctree::serialize,
+			boost::cref(tree), boost::cref(source), _1));
+}
+
+bool PagedPointOctree::build(const std::string& spoolName, int dataSize,
+		const std::string& fileName, const SourceStamp& source,
+		std::size_t maxPoints) {
+	TqUint32 pointsPerPage = pointsPerPageFor(dataSize);
+	if (pointsPerPage == 0)
+		return false;
+	SpooledTreeBuilder builder(dataSize, pointsPerPage, maxPoints,
+			fileName + ".build");
+	return writeFile(fileName, boost::bind(&SpooledTreeBuilder::build,
+			&builder, boost::cref(spoolName), boost::cref(source), _1));
+}
+
+boost::shared_ptr<PagedPointOctree> PagedPointOctree::open(
+		const std::string& fileName, const SourceStamp& source) {
+	boost::shared_ptr<PagedPointOctree> tree(new PagedPointOctree());
+	tree->m_file.open(fileName.c_str(), std::ios::binary);
+	SourceStamp fileSource;
+	if (!tree->m_file || !tree->readHeader(tree->m_file, fileSource)
+			|| fileSource.size != source.size
+			|| fileSource.modTime != source.modTime)
+		tree.reset();
+	return tree;
+}
+
+boost::shared_ptr<PagedPointOctree> PagedPointOctree::fromTree(
+		const DiffusePointOctree& tree) {
+	std::ostringstream out(std::ios::binary);
+	SourceStamp source = { 0, 0 };
+	if (!serialize(tree, source, out))
+		return boost::shared_ptr<PagedPointOctree>();
+	std::string pages = out.str();
+	boost::shared_ptr<PagedPointOctree> paged(new PagedPointOctree());
+	std::istringstream in(pages, std::ios::binary);
+	paged->readHeader(in, source);
+	paged->m_pages.assign(pages.begin(), pages.end());
+	return paged;
+}
+
+}
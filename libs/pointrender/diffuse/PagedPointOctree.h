@@ -0,0 +1,264 @@
+// Copyright (C) 2001, Paul C. Gregory and the other authors and contributors
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// * Neither the name of the software's owners nor the names of its
+//   contributors may be used to endorse or promote products derived from this
+//   software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+// (This is the New BSD license)
+
+#ifndef PAGEDPOINTOCTREE_H_
+#define PAGEDPOINTOCTREE_H_
+
+#include <cstddef>
+#include <fstream>
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+#include <OpenEXR/ImathVec.h>
+#include <OpenEXR/ImathColor.h>
+
+#include <boost/cstdint.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include <aqsis/aqsis.h>
+
+#include "DiffusePointOctree.h"
+
+namespace Aqsis {
+
+/**
+ * An octree of diffuse surfels which is stored in pages and loaded lazily.
+ *
+ * The tree is built once from a spool of points, or converted from a
+ * DiffusePointOctree, and written to disk.
+ * When rendering, pages of the file are read on demand into the global
+ * CqTileCache, so the memory used for point octrees is bounded together with
+ * the texture tiles.  If the file can't be written, the same pages are kept
+ * in memory instead.
+ *
+ * The file is made of fixed size pages:
+ *
+ * <pre>
+ * page 0                      header
+ * pages 1 .. nodePages        node records, nodesPerPage per page
+ * following pointPages pages  leaf points, pointsPerPage per page
+ * </pre>
+ *
+ * The children of a node are stored next to each other, so a node record
+ * only needs to hold its first child, and a record fits in 64 bytes.  The
+ * points of a leaf only straddle a page boundary when there are too many of
+ * them to fit in one page.  The header records the size and modification
+ * time of the point cloud the tree was built from, so a tree is only reused
+ * for the same point cloud.  Values are stored in native byte order; a file
+ * written on a machine with the other byte order is rejected and rebuilt.
+ */
+class PagedPointOctree : boost::noncopyable {
+
+public:
+
+	/**
+	 * An octree node, decoded from its record.
+	 *
+	 * Leaf nodes have npoints > 0, and their points are found with
+	 * Reader::leafPoints().  Interior nodes have nchildren children, with
+	 * indices firstChild to firstChild + nchildren - 1.
+	 */
+	struct Node {
+		Imath::V3f center;
+		float boundRadius;
+		Imath::V3f aggP;
+		Imath::V3f aggN;
+		float aggR;
+		Imath::C3f aggCol;
+		/// Index of the first child node, or the first point slot of a leaf.
+		TqUint32 firstChild;
+		int npoints;
+		int nchildren;
+	};
+
+	/// Default limit on the points held in memory by build(); about 40MB of
+	/// diffuse points.
+	static const std::size_t defaultMaxBuildPoints = 1 << 20;
+
+	/**
+	 * Identifies the point cloud file a tree was built from.
+	 */
+	struct SourceStamp {
+		boost::uint64_t size;
+		boost::int64_t modTime;
+	};
+
+	/**
+	 * Per-thread access to the nodes and points of a tree.
+	 *
+	 * The reader keeps the last node page and point page it used, so
+	 * neighbouring nodes can be read without going back to the shared cache.
+	 */
+	class Reader {
+	public:
+		Reader(const PagedPointOctree& tree);
+
+		/**
+		 * Decode the node with the given index.
+		 */
+		void node(TqUint32 index, Node& node);
+
+		/**
+		 * Get the points of a leaf node.
+		 *
+		 * @return
+		 * 		A pointer to node.npoints points of dataSize() floats each.
+		 * 		It stays valid until the next call to leafPoints().
+		 */
+		const float* leafPoints(const Node& node);
+
+	private:
+		/// Get the point page with the given index.
+		const float* pointPage(TqUint32 index);
+
+		const PagedPointOctree& m_tree;
+		TqUint32 m_nodePageIndex;
+		boost::shared_ptr<void> m_nodePage;
+		TqUint32 m_pointPageIndex;
+		boost::shared_ptr<void> m_pointPage;
+		/// Points of leaves which span several pages.
+		std::vector<float> m_scratch;
+	};
+
+	/**
+	 * Write a tree to a paged octree file.
+	 *
+	 * The file is written under a temporary name and renamed when complete,
+	 * so that a partially written file is never opened.
+	 *
+	 * @param source
+	 * 		Stamp of the point cloud the tree was built from.
+	 * @return
+	 * 		true on success, false if the file couldn't be written.
+	 */
+	static bool write(const DiffusePointOctree& tree,
+			const std::string& fileName, const SourceStamp& source);
+
+	/**
+	 * Build a paged octree file from a spool of points.
+	 *
+	 * The tree is the same as the one write() produces for a
+	 * DiffusePointOctree of the same points, but neither the points nor the
+	 * tree are held in memory at once: subtrees with more than maxPoints
+	 * points are split through temporary files next to fileName.
+	 *
+	 * @param spoolName
+	 * 		File of raw native floats, dataSize per point, as written by
+	 * 		spoolDiffusePointFile().
+	 * @param source
+	 * 		Stamp of the point cloud the points came from.
+	 * @param maxPoints
+	 * 		Largest number of points to hold in memory at once.
+	 * @return
+	 * 		true on success, false if the file couldn't be written.
+	 */
+	static bool build(const std::string& spoolName, int dataSize,
+			const std::string& fileName, const SourceStamp& source,
+			std::size_t maxPoints = defaultMaxBuildPoints);
+
+	/**
+	 * Open a paged octree file.
+	 *
+	 * @param source
+	 * 		Stamp of the current point cloud; the file must have been built
+	 * 		from a point cloud with exactly the same stamp.
+	 * @return
+	 * 		The tree, or a null pointer if the file is missing, invalid or
+	 * 		out of date.
+	 */
+	static boost::shared_ptr<PagedPointOctree> open(
+			const std::string& fileName, const SourceStamp& source);
+
+	/**
+	 * Convert a tree to the paged form, holding all the pages in memory.
+	 *
+	 * @return
+	 * 		The tree, or a null pointer if it has too many points, or its
+	 * 		points are too large to fit in a page.
+	 */
+	static boost::shared_ptr<PagedPointOctree> fromTree(const DiffusePointOctree& tree);
+
+	~PagedPointOctree();
+
+	/**
+	 * Get the index of the root node.
+	 */
+	TqUint32 root() const {
+		return 0;
+	}
+
+	/**
+	 * Get the number of nodes in the tree; zero for an empty point cloud.
+	 */
+	TqUint32 nodeCount() const {
+		return m_nodeCount;
+	}
+
+	/**
+	 * Get the number of floats representing each point/surfel.
+	 */
+	int dataSize() const {
+		return m_dataSize;
+	}
+
+private:
+
+	PagedPointOctree();
+
+	/// Read the header from the start of a file or buffer.
+	bool readHeader(std::istream& in, SourceStamp& source);
+	/// Get a page, reading it from file if it's not resident.
+	boost::shared_ptr<void> page(TqUint32 index) const;
+	/// Write a file under a temporary name with serializeFn(ostream&), then
+	/// move it into place.
+	template<typename SerializeT>
+	static bool writeFile(const std::string& fileName, SerializeT serializeFn);
+	/// Write a tree in the paged format.
+	static bool serialize(const DiffusePointOctree& tree,
+			const SourceStamp& source, std::ostream& out);
+
+	int m_dataSize;
+	TqUint32 m_nodesPerPage;
+	TqUint32 m_pointsPerPage;
+	TqUint32 m_nodeCount;
+	TqUint32 m_nodePages;
+	TqUint32 m_pointPages;
+	/// Owner id of the pages in the global tile cache.
+	TqUint m_owner;
+	/// File to read pages from, if they're not held in m_pages.
+	mutable std::ifstream m_file;
+	/// All pages, for trees held in memory.
+	std::vector<char> m_pages;
+};
+
+}
+
+#endif /* PAGEDPOINTOCTREE_H_ */
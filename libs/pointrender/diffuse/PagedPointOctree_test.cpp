@@ -0,0 +1,207 @@
+// Copyright (C) 2001, Paul C. Gregory and the other authors and contributors
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// * Neither the name of the software's owners nor the names of its
+//   contributors may be used to endorse or promote products derived from this
+//   software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+// (This is the New BSD license)
+
+#include "PagedPointOctree.h"
+
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <string>
+
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/auto_unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(pagedpointoctree_tests)
+
+using namespace Aqsis;
+
+namespace {
+
+const int stride = 10;
+
+void addPoint(PointArray& points, float x, float y, float z, float col) {
+	float p[stride] = { x, y, z, 0, 0, 1, 0.1f, col, col, col };
+	points.data.insert(points.data.end(), p, p + stride);
+}
+
+/// Points on a grid, plus a pile of coincident points which end up in a
+/// single leaf too large for one page.
+void makePoints(PointArray& points) {
+	points.stride = stride;
+	for (int i = 0; i < 20; ++i)
+		for (int j = 0; j < 20; ++j)
+			addPoint(points, i, j, 0, i + 0.01f*j);
+	for (int i = 0; i < 3000; ++i)
+		addPoint(points, 5.5f, 5.5f, 0, i);
+}
+
+/// Check the paged tree holds exactly the nodes and points of the original.
+void checkSame(const DiffusePointOctree::Node* orig,
+		PagedPointOctree::Reader& reader, TqUint32 index, int dataSize,
+		int& totPoints) {
+	PagedPointOctree::Node node;
+	reader.node(index, node);
+	BOOST_CHECK_EQUAL(node.center, orig->center);
+	BOOST_CHECK_EQUAL(node.aggP, orig->aggP);
+	BOOST_CHECK_EQUAL(node.aggCol, orig->aggCol);
+	BOOST_REQUIRE_EQUAL(node.npoints, orig->npoints);
+	if (orig->npoints > 0) {
+		const float* data = reader.leafPoints(node);
+		for (int i = 0; i < orig->npoints * dataSize; ++i)
+			BOOST_REQUIRE_EQUAL(data[i], orig->data[i]);
+		totPoints += node.npoints;
+		return;
+	}
+	int child = 0;
+	for (int i = 0; i < 8; ++i) {
+		if (orig->children[i])
+			checkSame(orig->children[i], reader, node.firstChild + child++,
+					dataSize, totPoints);
+	}
+	BOOST_CHECK_EQUAL(node.nchildren, child);
+}
+
+/// Write points to a spool file, as spoolDiffusePointFile() does.
+void spoolPoints(const PointArray& points, const char* spoolName) {
+	std::ofstream out(spoolName, std::ios::binary);
+	out.write(reinterpret_cast<const char*>(&points.data[0]),
+			points.data.size() * sizeof(float));
+}
+
+std::string readFile(const char* fileName) {
+	std::ifstream in(fileName, std::ios::binary);
+	return std::string(std::istreambuf_iterator<char>(in),
+			std::istreambuf_iterator<char>());
+}
+
+} // unnamed namespace
+
+BOOST_AUTO_TEST_CASE(pagedpointoctree_file_roundtrip)
+{
+	PointArray points;
+	makePoints(points);
+	DiffusePointOctree memTree(points);
+
+	const char* fileName = "pagedpointoctree_test.aqoct";
+	PagedPointOctree::SourceStamp source = { 1234, 5678 };
+	BOOST_REQUIRE(PagedPointOctree::write(memTree, fileName, source));
+	boost::shared_ptr<PagedPointOctree> tree =
+		PagedPointOctree::open(fileName, source);
+	BOOST_REQUIRE(tree);
+	BOOST_CHECK_EQUAL(tree->dataSize(), stride);
+
+	PagedPointOctree::Reader reader(*tree);
+	int totPoints = 0;
+	checkSame(memTree.root(), reader, tree->root(), stride, totPoints);
+	// No points are dropped, even from the oversized leaf.
+	BOOST_CHECK_EQUAL(totPoints, static_cast<int>(points.size()));
+
+	// The tree is only reused for exactly the same point cloud.
+	PagedPointOctree::SourceStamp newer = { 1234, 5679 };
+	BOOST_CHECK(!PagedPointOctree::open(fileName, newer));
+	PagedPointOctree::SourceStamp resized = { 1235, 5678 };
+	BOOST_CHECK(!PagedPointOctree::open(fileName, resized));
+
+	tree.reset();
+	std::remove(fileName);
+}
+
+BOOST_AUTO_TEST_CASE(pagedpointoctree_in_memory)
+{
+	PointArray points;
+	makePoints(points);
+	DiffusePointOctree memTree(points);
+
+	boost::shared_ptr<PagedPointOctree> tree =
+		PagedPointOctree::fromTree(memTree);
+	BOOST_REQUIRE(tree);
+	PagedPointOctree::Reader reader(*tree);
+	int totPoints = 0;
+	checkSame(memTree.root(), reader, tree->root(), stride, totPoints);
+	BOOST_CHECK_EQUAL(totPoints, static_cast<int>(points.size()));
+}
+
+BOOST_AUTO_TEST_CASE(pagedpointoctree_spooled_build)
+{
+	PointArray points;
+	makePoints(points);
+	DiffusePointOctree memTree(points);
+	const char* spoolName = "pagedpointoctree_test.spool";
+	spoolPoints(points, spoolName);
+
+	const char* memName = "pagedpointoctree_test_mem.aqoct";
+	const char* spooledName = "pagedpointoctree_test_spooled.aqoct";
+	PagedPointOctree::SourceStamp source = { 1234, 5678 };
+	BOOST_REQUIRE(PagedPointOctree::write(memTree, memName, source));
+	std::string memPages = readFile(memName);
+	// Build once holding all the points, and once splitting everything but
+	// the smallest subtrees through spool files; the coincident points go
+	// all the way down to a leaf streamed from a spool file.
+	std::size_t maxPoints[] = { PagedPointOctree::defaultMaxBuildPoints, 100 };
+	for (int i = 0; i < 2; ++i) {
+		BOOST_REQUIRE(PagedPointOctree::build(spoolName, stride, spooledName,
+				source, maxPoints[i]));
+		BOOST_CHECK(readFile(spooledName) == memPages);
+	}
+
+	boost::shared_ptr<PagedPointOctree> tree =
+		PagedPointOctree::open(spooledName, source);
+	BOOST_REQUIRE(tree);
+	PagedPointOctree::Reader reader(*tree);
+	int totPoints = 0;
+	checkSame(memTree.root(), reader, tree->root(), stride, totPoints);
+	BOOST_CHECK_EQUAL(totPoints, static_cast<int>(points.size()));
+
+	tree.reset();
+	std::remove(spoolName);
+	std::remove(memName);
+	std::remove(spooledName);
+}
+
+BOOST_AUTO_TEST_CASE(pagedpointoctree_rejects_oversized_points)
+{
+	// Points too large to fit in a page can't be stored.
+	const int bigStride = 20000;
+	PointArray points;
+	points.stride = bigStride;
+	points.data.resize(2 * bigStride, 0.1f);
+	DiffusePointOctree memTree(points);
+	BOOST_CHECK(!PagedPointOctree::fromTree(memTree));
+
+	const char* spoolName = "pagedpointoctree_test_big.spool";
+	const char* fileName = "pagedpointoctree_test_big.aqoct";
+	spoolPoints(points, spoolName);
+	PagedPointOctree::SourceStamp source = { 1, 2 };
+	BOOST_CHECK(!PagedPointOctree::build(spoolName, bigStride, fileName,
+			source));
+	BOOST_CHECK(!PagedPointOctree::open(fileName, source));
+	std::remove(spoolName);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
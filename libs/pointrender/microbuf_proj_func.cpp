@@ -29,6 +29,8 @@
 
 #include <OpenEXR/ImathFun.h>
 
+#include <vector>
+
 #include <boost/math/special_functions/sign.hpp>
 
 #include "OcclusionIntegrator.h"
@@ -311,6 +313,9 @@ static void renderDiskExact(IntegratorT& integrator, V3f p, V3f n, float r) {
 }
 
 
+/// Largest face resolution for which renderDisk() needs no heap allocation.
+static const int maxLocalRes = 64;
+
 /**
  * @see microbuf_proj_func.h
  */
@@ -441,6 +446,16 @@ void renderDisk(IntegratorT& integrator, V3f N, V3f p, V3f n, float r,
         b.ubegin = u - wOn2;  b.uend = u + wOn2;
         b.vbegin = v - wOn2;  b.vend = v + wOn2;
     }
+    // Scratch space for the coverage of the rows and columns of the square.
+    float localCoverage[2*maxLocalRes];
+    std::vector<float> largeCoverage;
+    float* uCoverage = localCoverage;
+    if(faceRes > maxLocalRes)
+    {
+        largeCoverage.resize(2*faceRes);
+        uCoverage = &largeCoverage[0];
+    }
+    float* vCoverage = uCoverage + faceRes;
     for(int iface = 0; iface < nfaces; ++iface)
     {
         BoundData& bd = boundData[iface];
@@ -449,20 +464,22 @@ void renderDisk(IntegratorT& integrator, V3f N, V3f p, V3f n, float r,
         int uendRas   = Imath::clamp(int(bd.uend) + 1, 0, faceRes);
         int vbeginRas = Imath::clamp(int(bd.vbegin),   0, faceRes);
         int vendRas   = Imath::clamp(int(bd.vend) + 1, 0, faceRes);
-        integrator.setFace(bd.faceIndex);
-        for(int iv = vbeginRas; iv < vendRas; ++iv)
+        if(ubeginRas >= uendRas || vbeginRas >= vendRas)
+            continue;
+        // Calculate the fraction coverage of the square over each pixel for
+        // antialiasing.  This estimate is what you'd get if you filtered the
+        // square representing the surfel with a 1x1 box filter.  It's the
+        // product of the coverage of the pixel's column and row, so these are
+        // computed once and the integrator fills whole rows at a time.
         for(int iu = ubeginRas; iu < uendRas; ++iu)
-        {
-            // Calculate the fraction coverage of the square over the current
-            // pixel for antialiasing.  This estimate is what you'd get if you
-            // filtered the square representing the surfel with a 1x1 box filter.
-            float urange = std::min<float>(iu+1, bd.uend) -
-                           std::max<float>(iu,   bd.ubegin);
-            float vrange = std::min<float>(iv+1, bd.vend) -
-                           std::max<float>(iv,   bd.vbegin);
-            float coverage = urange*vrange;
-            integrator.addSample(iu, iv, plen, coverage);
-        }
+            uCoverage[iu - ubeginRas] = std::min<float>(iu+1, bd.uend) -
+                                        std::max<float>(iu,   bd.ubegin);
+        for(int iv = vbeginRas; iv < vendRas; ++iv)
+            vCoverage[iv - vbeginRas] = std::min<float>(iv+1, bd.vend) -
+                                        std::max<float>(iv,   bd.vbegin);
+        integrator.setFace(bd.faceIndex);
+        integrator.addRect(ubeginRas, uendRas, vbeginRas, vendRas, plen,
+                           uCoverage, vCoverage);
     }
 }
 
@@ -478,6 +495,48 @@ template void renderDisk<OcclusionIntegrator>(OcclusionIntegrator&,
 template void renderDisk<RadiosityIntegrator>(RadiosityIntegrator&,
 		V3f N, V3f p, V3f n, float r, float cosConeAngle, float sinConeAngle);
 
+/**
+ * Render the points of a leaf node, sorted from front to back.
+ *
+ * @param data
+ * 			The points of the leaf, dataSize floats each.
+ * @param npoints
+ * 			The number of points in the leaf.
+ */
+template<typename IntegratorT>
+static void renderLeafPoints(IntegratorT& integrator, V3f P, V3f N,
+                             float cosConeAngle, float sinConeAngle,
+                             int dataSize, const float* data, int npoints)
+{
+    // Leaves normally hold at most eight points; only leaves at the maximum
+    // tree depth can hold more.
+    std::pair<float, int> localOrder[8];
+    std::vector<std::pair<float, int> > largeOrder;
+    std::pair<float, int>* childOrder = localOrder;
+    if(npoints > 8)
+    {
+        largeOrder.resize(npoints);
+        childOrder = &largeOrder[0];
+    }
+    for(int i = 0; i < npoints; ++i)
+    {
+        const float* d = data + i*dataSize;
+        V3f p = V3f(d[0], d[1], d[2]) - P;
+        childOrder[i].first = p.length2();
+        childOrder[i].second = i;
+    }
+    std::sort(childOrder, childOrder + npoints);
+    for(int i = 0; i < npoints; ++i)
+    {
+        const float* d = data + childOrder[i].second*dataSize;
+        V3f p = V3f(d[0], d[1], d[2]) - P;
+        V3f n = V3f(d[3], d[4], d[5]);
+        float r = d[6];
+        integrator.setPointData(d+7);
+        renderDisk(integrator, N, p, n, r, cosConeAngle, sinConeAngle);
+    }
+}
+
 /**
  * @see microbuf_proj_func.h
  */
@@ -535,26 +594,8 @@ static void renderNode(IntegratorT& integrator, V3f P, V3f N, float cosConeAngle
             if(node->npoints != 0)
             {
                 // Leaf node: simply render each child point.
-                std::pair<float, int> childOrder[8];
-                // INDIRECT
-                assert(node->npoints <= 8);
-                for(int i = 0; i < node->npoints; ++i)
-                {
-                    const float* data = &node->data[i*dataSize];
-                    V3f p = V3f(data[0], data[1], data[2]) - P;
-                    childOrder[i].first = p.length2();
-                    childOrder[i].second = i;
-                }
-                std::sort(childOrder, childOrder + node->npoints);
-                for(int i = 0; i < node->npoints; ++i)
-                {
-                    const float* data = &node->data[childOrder[i].second*dataSize];
-                    V3f p = V3f(data[0], data[1], data[2]) - P;
-                    V3f n = V3f(data[3], data[4], data[5]);
-                    float r = data[6];
-                    integrator.setPointData(data+7);
-                    renderDisk(integrator, N, p, n, r, cosConeAngle, sinConeAngle);
-                }
+                renderLeafPoints(integrator, P, N, cosConeAngle, sinConeAngle,
+                                 dataSize, node->data.get(), node->npoints);
                 continue;
             }
             else
@@ -583,6 +624,157 @@ static void renderNode(IntegratorT& integrator, V3f P, V3f N, float cosConeAngle
 
 
 
+/**
+ * Render the nodes of a paged octree.
+ *
+ * This is the same traversal as renderNode(), but nodes are decoded from
+ * their records one at a time as they're visited.
+ */
+template<typename IntegratorT>
+static void renderPagedTree(IntegratorT& integrator, V3f P, V3f N,
+                            float cosConeAngle, float sinConeAngle,
+                            float maxSolidAngle, const PagedPointOctree& tree)
+{
+    if(tree.nodeCount() == 0)
+        return;
+    int dataSize = tree.dataSize();
+    PagedPointOctree::Reader reader(tree);
+    PagedPointOctree::Node node;
+    PagedPointOctree::Node child;
+    TqUint32 nodeStack[200];
+    nodeStack[0] = tree.root();
+    int stackSize = 1;
+    while(stackSize > 0)
+    {
+        reader.node(nodeStack[--stackSize], node);
+        V3f c = node.center - P;
+        if(sphereOutsideCone(c, c.length2(), node.boundRadius, N,
+                            cosConeAngle, sinConeAngle))
+            continue;
+        float r = node.aggR;
+        V3f p = node.aggP - P;
+        float solidAngle = M_PI*r*r / p.length2();
+        if(solidAngle < maxSolidAngle)
+        {
+            integrator.setPointData(reinterpret_cast<const float*>(&node.aggCol));
+            renderDisk(integrator, N, p, node.aggN, r, cosConeAngle, sinConeAngle);
+        }
+        else if(node.npoints != 0)
+        {
+            renderLeafPoints(integrator, P, N, cosConeAngle, sinConeAngle,
+                             dataSize, reader.leafPoints(node), node.npoints);
+        }
+        else
+        {
+            // Children are stored together, so reading them all to sort
+            // them touches at most two node pages.
+            std::pair<float, TqUint32> children[8];
+            int nchildren = std::min(node.nchildren, 8);
+            for(int i = 0; i < nchildren; ++i)
+            {
+                TqUint32 index = node.firstChild + i;
+                reader.node(index, child);
+                children[i].first = (child.center - P).length2();
+                children[i].second = index;
+            }
+            std::sort(children, children + nchildren);
+            for(int i = nchildren-1; i >= 0; --i)
+                nodeStack[stackSize++] = children[i].second;
+        }
+    }
+}
+
+/**
+ * Render the nodes of a paged octree for a batch of shading points.
+ *
+ * Each node is decoded once for the whole batch.  A bit mask records which
+ * shading points still need to descend into a node; the per-point culling
+ * and solid angle tests are the same as in renderPagedTree().
+ */
+template<typename IntegratorT>
+static void renderPagedTreeBatch(IntegratorT** integrators, const V3f* P,
+                                 const V3f* N, int npoints, float cosConeAngle,
+                                 float sinConeAngle, float maxSolidAngle,
+                                 const PagedPointOctree& tree)
+{
+    if(tree.nodeCount() == 0)
+        return;
+    int dataSize = tree.dataSize();
+    PagedPointOctree::Reader reader(tree);
+    PagedPointOctree::Node node;
+    PagedPointOctree::Node child;
+    std::pair<TqUint32, TqUint32> nodeStack[200];
+    nodeStack[0] = std::make_pair(tree.root(),
+            npoints == maxMicroRasterizeBatch ? ~TqUint32(0)
+                                              : (TqUint32(1) << npoints) - 1);
+    int stackSize = 1;
+    while(stackSize > 0)
+    {
+        --stackSize;
+        reader.node(nodeStack[stackSize].first, node);
+        TqUint32 mask = nodeStack[stackSize].second;
+        // Shading points for which the children must be considered.
+        TqUint32 openMask = 0;
+        for(int j = 0; j < npoints; ++j)
+        {
+            if(!(mask & (TqUint32(1) << j)))
+                continue;
+            V3f c = node.center - P[j];
+            if(sphereOutsideCone(c, c.length2(), node.boundRadius, N[j],
+                                cosConeAngle, sinConeAngle))
+                continue;
+            float r = node.aggR;
+            V3f p = node.aggP - P[j];
+            float solidAngle = M_PI*r*r / p.length2();
+            if(solidAngle < maxSolidAngle)
+            {
+                integrators[j]->setPointData(reinterpret_cast<const float*>(&node.aggCol));
+                renderDisk(*integrators[j], N[j], p, node.aggN, r,
+                           cosConeAngle, sinConeAngle);
+            }
+            else
+                openMask |= TqUint32(1) << j;
+        }
+        if(!openMask)
+            continue;
+        if(node.npoints != 0)
+        {
+            const float* data = reader.leafPoints(node);
+            for(int j = 0; j < npoints; ++j)
+            {
+                if(openMask & (TqUint32(1) << j))
+                    renderLeafPoints(*integrators[j], P[j], N[j], cosConeAngle,
+                                     sinConeAngle, dataSize, data, node.npoints);
+            }
+            continue;
+        }
+        // Children are ordered by distance from the centre of the open
+        // shading points, which are close together.
+        V3f center(0);
+        int nopen = 0;
+        for(int j = 0; j < npoints; ++j)
+        {
+            if(openMask & (TqUint32(1) << j))
+            {
+                center += P[j];
+                ++nopen;
+            }
+        }
+        center /= nopen;
+        std::pair<float, TqUint32> children[8];
+        int nchildren = std::min(node.nchildren, 8);
+        for(int i = 0; i < nchildren; ++i)
+        {
+            TqUint32 index = node.firstChild + i;
+            reader.node(index, child);
+            children[i].first = (child.center - center).length2();
+            children[i].second = index;
+        }
+        std::sort(children, children + nchildren);
+        for(int i = nchildren-1; i >= 0; --i)
+            nodeStack[stackSize++] = std::make_pair(children[i].second, openMask);
+    }
+}
 
 
 template<typename IntegratorT>
@@ -595,6 +787,30 @@ void microRasterize(IntegratorT& integrator, V3f P, V3f N, float coneAngle,
                maxSolidAngle, points.dataSize(), points.root());
 }
 
+template<typename IntegratorT>
+void microRasterize(IntegratorT& integrator, V3f P, V3f N, float coneAngle,
+                    float maxSolidAngle, const PagedPointOctree& points)
+{
+    float cosConeAngle = cos(coneAngle);
+    float sinConeAngle = sin(coneAngle);
+    renderPagedTree(integrator, P, N, cosConeAngle, sinConeAngle,
+                    maxSolidAngle, points);
+}
+
+template<typename IntegratorT>
+void microRasterize(IntegratorT** integrators, const V3f* P, const V3f* N,
+                    int npoints, float coneAngle, float maxSolidAngle,
+                    const PagedPointOctree& points)
+{
+    assert(npoints <= maxMicroRasterizeBatch);
+    if(npoints <= 0)
+        return;
+    float cosConeAngle = cos(coneAngle);
+    float sinConeAngle = sin(coneAngle);
+    renderPagedTreeBatch(integrators, P, N, npoints, cosConeAngle,
+                         sinConeAngle, maxSolidAngle, points);
+}
+
 
 
 /**
@@ -608,4 +824,28 @@ template void microRasterize<OcclusionIntegrator>(
  */
 template void microRasterize<RadiosityIntegrator>(
         RadiosityIntegrator&, V3f, V3f, float, float, const DiffusePointOctree&);
+
+/**
+ * Explicit instantiation of the paged microRasterize() method for an  ::OcclusionIntegrator.
+ */
+template void microRasterize<OcclusionIntegrator>(
+        OcclusionIntegrator&, V3f, V3f, float, float, const PagedPointOctree&);
+
+/**
+ * Explicit instantiation of the paged microRasterize() method for an  ::RadiosityIntegrator.
+ */
+template void microRasterize<RadiosityIntegrator>(
+        RadiosityIntegrator&, V3f, V3f, float, float, const PagedPointOctree&);
+
+/**
+ * Explicit instantiation of the batched microRasterize() method for an  ::OcclusionIntegrator.
+ */
+template void microRasterize<OcclusionIntegrator>(OcclusionIntegrator**,
+        const V3f*, const V3f*, int, float, float, const PagedPointOctree&);
+
+/**
+ * Explicit instantiation of the batched microRasterize() method for an  ::RadiosityIntegrator.
+ */
+template void microRasterize<RadiosityIntegrator>(RadiosityIntegrator**,
+        const V3f*, const V3f*, int, float, float, const PagedPointOctree&);
 }
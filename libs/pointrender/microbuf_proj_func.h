@@ -34,6 +34,7 @@
 #include <OpenEXR/ImathMath.h>
 
 #include "diffuse/DiffusePointOctree.h"
+#include "diffuse/PagedPointOctree.h"
 #include "MicroBuf.h"
 
 namespace Aqsis {
@@ -59,6 +60,48 @@ template<typename IntegratorT>
 void microRasterize(IntegratorT& integrator, Imath::V3f P, Imath::V3f N,
 		float coneAngle, float maxSolidAngle, const DiffusePointOctree& points);
 
+/**
+ * Render diffuse surfels from a paged octree into a micro environment buffer.
+ *
+ * This is the same as the DiffusePointOctree version, except that the nodes
+ * are read from the pages of the tree as they are visited.
+ */
+template<typename IntegratorT>
+void microRasterize(IntegratorT& integrator, Imath::V3f P, Imath::V3f N,
+		float coneAngle, float maxSolidAngle, const PagedPointOctree& points);
+
+/// Maximum number of shading points in a batch for microRasterize().
+const int maxMicroRasterizeBatch = 32;
+
+/**
+ * Render diffuse surfels into the micro environment buffers of a batch of
+ * nearby shading points.
+ *
+ * The octree is traversed once for the whole batch, rather than once for
+ * each shading point.  Each point sees the same surfels and aggregates as it
+ * would in the single point version; only the order in which the children of
+ * a node are rendered is chosen for the batch as a whole.
+ *
+ * @param integrators
+ * 			The integrators for each shading point.
+ * @param P
+ * 			Positions of the shading points.
+ * @param N
+ * 			Normals of the shading points (normalized).
+ * @param npoints
+ * 			Number of shading points, at most maxMicroRasterizeBatch.
+ * @param coneAngle
+ * 			The cone about each normal N, see the single point version.
+ * @param maxSolidAngle
+ * 			Maximum solid angle allowed for points in interior tree nodes.
+ * @param points
+ * 			The paged point octree containing the surfels to be rendered.
+ */
+template<typename IntegratorT>
+void microRasterize(IntegratorT** integrators, const Imath::V3f* P,
+		const Imath::V3f* N, int npoints, float coneAngle, float maxSolidAngle,
+		const PagedPointOctree& points);
+
 
 /**
  * Rasterize surfel (disk) into the given integrator
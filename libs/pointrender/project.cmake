@@ -7,6 +7,7 @@ set(pointrender_srcs
     RadiosityIntegrator.cpp
     diffuse/DiffusePointOctree.cpp
     diffuse/DiffusePointOctreeCache.cpp
+    diffuse/PagedPointOctree.cpp
 )
 
 make_absolute(pointrender_srcs ${pointrender_SOURCE_DIR})
@@ -20,6 +21,7 @@ set(pointrender_hdrs
     RadiosityIntegrator.h
     diffuse/DiffusePointOctree.h
     diffuse/DiffusePointOctreeCache.h
+    diffuse/PagedPointOctree.h
 )
 
 make_absolute(pointrender_hdrs ${pointrender_SOURCE_DIR})
@@ -28,3 +30,8 @@ source_group("Header Files" FILES ${pointrender_hdrs})
 include_directories(${pointrender_SOURCE_DIR})
 
 set(pointrender_libs ${partio_libs} ${math_libs})
+
+set(pointrender_test_srcs
+    diffuse/PagedPointOctree_test.cpp
+)
+make_absolute(pointrender_test_srcs ${pointrender_SOURCE_DIR})
@@ -40,6 +40,8 @@
 #	include <boost/iostreams/filter/gzip.hpp>
 #endif
 
+#include <algorithm>
+
 #include <aqsis/util/exception.h>
 
 namespace Aqsis {
@@ -48,8 +50,11 @@ RibInputBuffer::RibInputBuffer(std::istream& inStream, const std::string& stream
 	: m_inStream(&inStream),
 	m_streamName(streamName),
 	m_gzipStream(),
-	m_bufPos(1),
-	m_bufEnd(2),
+	m_bufPos(m_buffer + 1),
+	m_bufEnd(m_buffer + 2),
+	m_mapPos(0),
+	m_mapEnd(0),
+	m_mapBegin(0),
 	m_currPos(1,0),
 	m_prevPos(-1,-1)
 {
@@ -71,6 +76,17 @@ RibInputBuffer::RibInputBuffer(std::istream& inStream, const std::string& stream
 			"gzipped RIB detected, but aqsis compiled without gzip support.");
 #		endif // USE_GZIPPED_RIB
 	}
+	else if(MappedFileBuf* mappedBuf = dynamic_cast<MappedFileBuf*>(inStream.rdbuf()))
+	{
+		// Read memory mapped files straight out of the mapping, starting
+		// from the current stream position.
+		const boost::iostreams::mapped_file_source& file = **mappedBuf;
+		std::streamoff offset = inStream.tellg();
+		const CharType* data = reinterpret_cast<const CharType*>(file.data());
+		m_mapBegin = data + std::max<std::streamoff>(offset, 0);
+		m_mapPos = m_mapBegin;
+		m_mapEnd = data + file.size();
+	}
 }
 
 /** \brief Fill the internal buffer with as many characters as possible
@@ -81,18 +97,24 @@ RibInputBuffer::RibInputBuffer(std::istream& inStream, const std::string& stream
  * read, a single character is read using the blocking std::istream::get()
  * function.
  *
- * Postconditions: The m_bufPos index is one before the next character in the
- * input stream.  The m_bufEnd index points to one after the last valid
+ * Postconditions: The m_bufPos pointer is at the next character in the
+ * input stream.  The m_bufEnd pointer points to one after the last valid
  * character.  m_bufPos < m_bufEnd
  */
 void RibInputBuffer::bufferNextChars()
 {
+	if(m_mapBegin)
+	{
+		nextMappedChars();
+		return;
+	}
 	// Precondition: m_bufPos is pointing to a one off the end of the valid
 	// characters in the buffer.
 	assert(m_bufPos == m_bufEnd);
 	// first make sure that we're not at the maximum extent of the buffer; if
 	// so we need to wrap around to the beginning.
-	if(m_bufEnd == m_bufSize)
+	int bufPos = m_bufPos - m_buffer;
+	if(bufPos == m_bufSize)
 	{
 		// Copy over some chars so that we can always unget() at least one and
 		// still look back into the buffer an additional char for line ending
@@ -100,26 +122,47 @@ void RibInputBuffer::bufferNextChars()
 		m_buffer[0] = m_buffer[m_bufSize-2];
 		m_buffer[1] = m_buffer[m_bufSize-1];
 		// Reset buffer position
-		m_bufPos = 1;
+		bufPos = 2;
 	}
 	// Now fill the buffer with as many characters as possible using a
 	// non-blocking read with readsome().
-	int numRead = m_inStream->readsome((char*)m_buffer + m_bufPos,
-									   m_bufSize - m_bufPos);
-	if(numRead > 0)
-	{
-		m_bufEnd = m_bufPos + numRead;
-	}
-	else
+	int numRead = m_inStream->readsome((char*)m_buffer + bufPos,
+									   m_bufSize - bufPos);
+	if(numRead <= 0)
 	{
 		// Else ugh: We failed to read a group of characters with the
 		// non-blocking read so we have to make an inefficient read of a single
 		// charater.  (Reading a single char may block, but that's acceptable.)
 		std::istream::int_type c = m_inStream->get();
 		// translate EOFs
-		m_buffer[m_bufPos] = (c == EOF) ? eof : c;
-		m_bufEnd = m_bufPos + 1;
+		m_buffer[bufPos] = (c == EOF) ? eof : c;
+		numRead = 1;
+	}
+	m_bufPos = m_buffer + bufPos;
+	m_bufEnd = m_bufPos + numRead;
+}
+
+/** \brief Move on to the next characters of a memory mapped file.
+ *
+ * Once the first character has been read, the rest of the file is used in
+ * place as the buffer; the mapping itself then provides the lookback needed
+ * by unget() and line ending detection.  The first character, and the EOF
+ * after the last one, go through the internal buffer instead since there's
+ * nothing before them in the mapping.
+ */
+void RibInputBuffer::nextMappedChars()
+{
+	if(m_mapPos != m_mapBegin && m_mapPos < m_mapEnd)
+	{
+		m_bufPos = m_mapPos;
+		m_bufEnd = m_mapEnd;
+		m_mapPos = m_mapEnd;
+		return;
 	}
+	m_buffer[1] = m_bufPos[-1];
+	m_buffer[2] = (m_mapPos < m_mapEnd) ? *m_mapPos++ : eof;
+	m_bufPos = m_buffer + 2;
+	m_bufEnd = m_buffer + 3;
 }
 
 /// Determine whether the given stream is gzipped.
@@ -40,6 +40,8 @@
 
 #include <iostream>
 
+#include <boost/iostreams/device/mapped_file.hpp>
+#include <boost/iostreams/stream.hpp>
 #include <boost/noncopyable.hpp>
 #include <boost/scoped_ptr.hpp>
 
@@ -68,6 +70,10 @@ struct SourcePos
  * stdin, the "end" of the rib stream may be encountered at any time.  This
  * class therefore makes sure that any input buffering of a requested number of
  * characters is non-blocking.
+ *
+ * Streams of type MappedFileStream (see RibParser::openFile()) are backed by a memory mapping of the
+ * whole file.  For these, characters are read straight out of the mapping
+ * without any copying into the internal buffer.
  */
 class RibInputBuffer : boost::noncopyable
 {
@@ -96,9 +102,18 @@ class RibInputBuffer : boost::noncopyable
 		/// Return the name of the input stream
 		const std::string& streamName() const;
 
+		/// Stream over a memory mapped file, read without copying.
+		typedef boost::iostreams::stream<
+			boost::iostreams::mapped_file_source> MappedFileStream;
+		/// Stream buffer type of a MappedFileStream.
+		typedef boost::iostreams::stream_buffer<
+			boost::iostreams::mapped_file_source> MappedFileBuf;
+
 	private:
+
 		static bool isGzippedStream(std::istream& in);
 		void bufferNextChars();
+		void nextMappedChars();
 
 		/// Stream we are reading from.
 		std::istream* m_inStream;
@@ -111,10 +126,18 @@ class RibInputBuffer : boost::noncopyable
 		static const int m_bufSize = 256;
 		/// Internal buffer of characters.
 		CharType m_buffer[m_bufSize];
-		/// Position of current character [ie, last char returned with get() ]
-		int m_bufPos;
-		/// Position of last valid character in input buffer.
-		int m_bufEnd;
+		/// Current character [ie, last char returned with get() ]
+		const CharType* m_bufPos;
+		/// One past the last valid character in the current buffer.
+		const CharType* m_bufEnd;
+
+		/// Next unread character of a memory mapped file, or null for
+		/// ordinary streams.
+		const CharType* m_mapPos;
+		/// End of the memory mapped file.
+		const CharType* m_mapEnd;
+		/// Start of the memory mapped file.
+		const CharType* m_mapBegin;
 
 		/// Current source location
 		SourcePos m_currPos;
@@ -133,12 +156,12 @@ inline RibInputBuffer::CharType RibInputBuffer::get()
 	++m_bufPos;
 	if(m_bufPos >= m_bufEnd)
 		bufferNextChars();
-	CharType c = m_buffer[m_bufPos];
+	CharType c = *m_bufPos;
 
 	// Keep line and column numbers up to date.
 	m_prevPos = m_currPos;
 	++m_currPos.col;
-	if(c == '\r' || (c == '\n' && m_buffer[m_bufPos-1] != '\r'))
+	if(c == '\r' || (c == '\n' && m_bufPos[-1] != '\r'))
 	{
 		++m_currPos.line;
 		m_currPos.col = 0;
@@ -152,7 +175,7 @@ inline void RibInputBuffer::unget()
 {
 	// Precondition: current buffer position is at least two chars into the
 	// buffer so that lookback can work.
-	assert(m_bufPos >= 1);
+	assert(m_bufPos != m_buffer);
 	--m_bufPos;
 	m_currPos = m_prevPos;
 }
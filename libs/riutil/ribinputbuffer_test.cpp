@@ -38,6 +38,7 @@
 #define BOOST_TEST_DYN_LINK
 
 #include <stdio.h>
+#include <fstream>
 #include <sstream>
 
 #include <boost/test/auto_unit_test.hpp>
@@ -119,4 +120,40 @@ BOOST_AUTO_TEST_CASE(RibInputBuffer_bufwrap_test)
 	BOOST_CHECK_EQUAL(extractedStr, inStr);
 }
 
+BOOST_AUTO_TEST_CASE(RibInputBuffer_mapped_file_test)
+{
+	// Test reading directly out of a memory mapped file, including the
+	// lookback needed by unget() at the start of the mapping.
+	const char* fileName = "RibInputBuffer_mapped_file_test.rib";
+	const std::string inStr = "some rib\ncharacters\nhere\n";
+	{
+		std::ofstream out(fileName, std::ios::binary);
+		out << inStr;
+	}
+	{
+		RibInputBuffer::MappedFileStream in(fileName);
+		BOOST_REQUIRE(in);
+		RibInputBuffer inBuf(in);
+
+		BOOST_CHECK_EQUAL(inBuf.get(), 's');
+		inBuf.unget();
+		BOOST_CHECK_EQUAL(inBuf.get(), 's');
+		for(int i = 0; i < 9; ++i)
+			inBuf.get();
+		BOOST_CHECK_EQUAL(inBuf.get(), 'h');
+		SourcePos pos = inBuf.pos();
+		BOOST_CHECK_EQUAL(pos.line, 2);
+		BOOST_CHECK_EQUAL(pos.col, 2);
+
+		std::istream::int_type c = 0;
+		std::string extractedStr = "some rib\nch";
+		while((c = inBuf.get()) != RibInputBuffer::eof)
+			extractedStr += c;
+		BOOST_CHECK_EQUAL(extractedStr, inStr);
+		inBuf.unget();
+		BOOST_CHECK(inBuf.get() == RibInputBuffer::eof);
+	}
+	remove(fileName);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
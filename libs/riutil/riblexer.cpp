@@ -198,7 +198,7 @@ RibLexer::FloatArray RibLexerImpl::getFloatArray(int length)
         // Read an array in [ num1 num2 ... num_n ] format
 
         m_tokenizer.get(); // consume '['
-        bool parsing = true;
+        bool parsing = !m_tokenizer.readFloatArray(buf);
         while(parsing)
         {
             const RibToken& tok = m_tokenizer.get();
@@ -134,6 +134,28 @@ BOOST_AUTO_TEST_CASE(RibLexerImpl_getFloatArray_test)
     BOOST_CHECK_THROW(f.lex.getFloatArray(), XqParseError);
 }
 
+BOOST_AUTO_TEST_CASE(RibLexerImpl_getFloatArray_fallback_test)
+{
+    // Arrays which the fast path can't handle on its own - comments and
+    // a trailing parameter - must still be read correctly.
+    Fixture f("[1 2 # comment\n 3]  [ ]  [4\n5] \"P\"");
+
+    RibLexer::FloatArray a1 = f.lex.getFloatArray();
+    BOOST_REQUIRE_EQUAL(a1.size(), 3U);
+    BOOST_CHECK_EQUAL(a1[0], 1.0f);
+    BOOST_CHECK_EQUAL(a1[1], 2.0f);
+    BOOST_CHECK_EQUAL(a1[2], 3.0f);
+
+    BOOST_CHECK_EQUAL(f.lex.getFloatArray().size(), 0U);
+
+    RibLexer::FloatArray a2 = f.lex.getFloatArray();
+    BOOST_REQUIRE_EQUAL(a2.size(), 2U);
+    BOOST_CHECK_EQUAL(a2[0], 4.0f);
+    BOOST_CHECK_EQUAL(a2[1], 5.0f);
+
+    BOOST_CHECK_EQUAL(f.lex.getString(), "P");
+}
+
 BOOST_AUTO_TEST_CASE(RibLexerImpl_getStringArray_test)
 {
     Fixture f("[\"asdf\" \"1234\" \"!@#$\"] 123");
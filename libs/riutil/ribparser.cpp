@@ -38,8 +38,12 @@
 
 #include <cfloat>
 #include <cstring>  // for strcpy
+#include <fstream>
+#include <streambuf>
 
+#include "ribinputbuffer.h"
 #include "riblexer.h"
+#include "ribtokenizer.h"
 #include <aqsis/riutil/errorhandler.h>
 
 namespace Aqsis
@@ -50,6 +54,92 @@ RibParser* RibParser::create(Ri::RendererServices& services)
     return new RibParserImpl(services);
 }
 
+boost::shared_ptr<std::istream> RibParser::openFile(const std::string& fileName)
+{
+    try
+    {
+        boost::shared_ptr<std::istream> mapped(
+                new RibInputBuffer::MappedFileStream(fileName));
+        if(*mapped)
+            return mapped;
+    }
+    catch(std::exception&)
+    {
+        // Fall through to use an ordinary file stream.
+    }
+    return boost::shared_ptr<std::istream>(
+            new std::ifstream(fileName.c_str(), std::ios::binary));
+}
+
+bool RibParser::prefetchFile(std::istream& in)
+{
+    RibInputBuffer::MappedFileBuf* mappedBuf =
+        dynamic_cast<RibInputBuffer::MappedFileBuf*>(in.rdbuf());
+    if(!mappedBuf)
+        return false;
+    const boost::iostreams::mapped_file_source& file = **mappedBuf;
+    const char* data = file.data();
+    // Read a byte from each page; the volatile keeps the reads from being
+    // optimised away.
+    const std::size_t pageSize = boost::iostreams::mapped_file_source::alignment();
+    volatile char touched = 0;
+    for(std::size_t i = 0; i < file.size(); i += pageSize)
+        touched = data[i];
+    (void)touched;
+    return true;
+}
+
+namespace {
+
+/// Stream buffer which records all characters read through it.
+///
+/// Characters are taken from the source one at a time, only when the reader
+/// asks for them, so nothing past the end of a RunProgram block is consumed
+/// as long as the reader stops there.
+class RecordingStreamBuf : public std::streambuf
+{
+    public:
+        RecordingStreamBuf(std::streambuf* source, std::string& record)
+            : m_source(source),
+            m_record(record),
+            m_char(0)
+        { }
+
+    protected:
+        virtual int_type underflow()
+        {
+            int_type c = m_source->sbumpc();
+            if(traits_type::eq_int_type(c, traits_type::eof()))
+                return c;
+            m_char = traits_type::to_char_type(c);
+            m_record += m_char;
+            setg(&m_char, &m_char, &m_char + 1);
+            return c;
+        }
+
+    private:
+        std::streambuf* m_source;
+        std::string& m_record;
+        char m_char;
+};
+
+} // anon. namespace
+
+bool RibParser::readBlock(std::istream& in, std::string& block)
+{
+    std::string::size_type startSize = block.size();
+    RecordingStreamBuf recordBuf(in.rdbuf(), block);
+    std::istream recordStream(&recordBuf);
+    {
+        RibTokenizer tokenizer;
+        tokenizer.pushInput(recordStream, "");
+        while(tokenizer.get().type() != RibToken::ENDOFFILE)
+        { }
+    }
+    return block.size() > startSize
+        && block[block.size()-1] == static_cast<char>(RibInputBuffer::eof);
+}
+
 //------------------------------------------------------------------------------
 // RibParserImpl implementation
 
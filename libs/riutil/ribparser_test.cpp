@@ -41,7 +41,9 @@
 #include "ribparser_impl.h"
 
 #include <cfloat>
+#include <cstdio>
 #include <cstdlib>
+#include <fstream>
 #include <sstream>
 
 #include <boost/assign/std/vector.hpp>
@@ -1151,6 +1153,48 @@ BOOST_AUTO_TEST_CASE(invalid_paramlist_missing_token)
     );
 }
 
+BOOST_AUTO_TEST_CASE(readBlock_test)
+{
+    // Blocks end at 0377, but a 0377 inside binary encoded data doesn't
+    // count.  The binary float below is encoded as 0244 followed by the
+    // four bytes 0x7f 0x7f 0xff 0xff (a NaN).
+    std::string block1 = "Sphere 1 -1 1 360 \"P\" [\244\177\177\377\377]\n\377";
+    std::string block2 = "WorldEnd\n";
+    std::istringstream in(block1 + block2);
+
+    std::string block;
+    BOOST_CHECK(RibParser::readBlock(in, block));
+    BOOST_CHECK_EQUAL(block, block1);
+
+    block.clear();
+    BOOST_CHECK(!RibParser::readBlock(in, block));
+    BOOST_CHECK_EQUAL(block, block2);
+}
+
+BOOST_AUTO_TEST_CASE(prefetchFile_test)
+{
+    // Files opened with openFile() are mapped and can be paged in ahead of
+    // parsing without moving the stream.
+    const char* fileName = "prefetchFile_test.rib";
+    {
+        std::ofstream out(fileName, std::ios::binary);
+        out << "WorldBegin\nWorldEnd\n";
+    }
+    {
+        boost::shared_ptr<std::istream> in = RibParser::openFile(fileName);
+        BOOST_REQUIRE(*in);
+        BOOST_CHECK(RibParser::prefetchFile(*in));
+        std::string firstLine;
+        std::getline(*in, firstLine);
+        BOOST_CHECK_EQUAL(firstLine, "WorldBegin");
+    }
+    std::remove(fileName);
+
+    // Other streams are left alone.
+    std::istringstream notMapped("WorldBegin\n");
+    BOOST_CHECK(!RibParser::prefetchFile(notMapped));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
 
 // vi: set et:
@@ -128,6 +128,60 @@ std::string RibTokenizer::streamPos() const
     return msg.str();
 }
 
+bool RibTokenizer::readFloatArray(std::vector<float>& buf)
+{
+	if(!m_inBuf || m_haveNext)
+		return false;
+	if(m_arrayElementsRemaining >= 0)
+	{
+		// Binary encoded float array.
+		for(; m_arrayElementsRemaining > 0; --m_arrayElementsRemaining)
+			buf.push_back(decodeFloat32(*m_inBuf));
+		m_arrayElementsRemaining = -1;
+		m_nextTok = RibToken::ARRAY_END;
+		return true;
+	}
+	while(true)
+	{
+		RibInputBuffer::CharType c = m_inBuf->get();
+		m_nextPos = m_inBuf->pos();
+		switch(c)
+		{
+			case ' ':
+			case '\t':
+			case '\n':
+			case '\r':
+				break;
+			case '0': case '1': case '2': case '3': case '4':
+			case '5': case '6': case '7': case '8': case '9':
+			case '-': case '+': case '.':
+				m_inBuf->unget();
+				readNumber(*m_inBuf, m_nextTok);
+				switch(m_nextTok.type())
+				{
+					case RibToken::INTEGER:
+						buf.push_back(m_nextTok.intVal());
+						break;
+					case RibToken::FLOAT:
+						buf.push_back(m_nextTok.floatVal());
+						break;
+					default:
+						// Leave the bad token for the caller to report.
+						m_haveNext = true;
+						return false;
+				}
+				break;
+			case ']':
+				m_nextTok = RibToken::ARRAY_END;
+				m_currPos = m_nextPos;
+				return true;
+			default:
+				m_inBuf->unget();
+				return false;
+		}
+	}
+}
+
 /** \brief Scan the next token from the underlying input stream.
  *
  * Optimization note: this is intentionally all one big function, since there's
@@ -111,6 +111,21 @@ class RibTokenizer : boost::noncopyable
 		 */
 		const RibToken& peek();
 
+		/** \brief Read the elements of a float array straight into a buffer.
+		 *
+		 * This is a fast path for the large arrays of vertex data which make
+		 * up most of a typical geometry RIB: numbers are decoded directly
+		 * from the input buffer without going through the general token
+		 * machinery.  It should be called just after the ARRAY_BEGIN token
+		 * has been obtained with get().  Reading stops at the first thing
+		 * which isn't a number, such as a comment or an invalid element.
+		 * The caller should then carry on reading array elements with get().
+		 *
+		 * \param buf - numbers are appended to this buffer.
+		 * \return true if the ARRAY_END token was consumed.
+		 */
+		bool readFloatArray(std::vector<float>& buf);
+
 		/** Return the position in the input file
 		 *
 		 * \return The position in the input file for the previous token
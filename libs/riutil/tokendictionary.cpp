@@ -148,6 +148,10 @@ const CqPrimvarToken standardVarsInit[] = {
 	CqPrimvarToken(class_uniform,  type_integer, 1, "texturememory"),
 	CqPrimvarToken(class_uniform,  type_integer, 2, "bucketsize"),
 	CqPrimvarToken(class_uniform,  type_integer, 1, "eyesplits"),
+	CqPrimvarToken(class_uniform,  type_integer, 1, "threads"),
+	CqPrimvarToken(class_uniform,  type_integer, 1, "prefetchthreads"),
+	CqPrimvarToken(class_uniform,  type_integer, 1, "textureprefetchthreads"),
+	CqPrimvarToken(class_uniform,  type_integer, 1, "dicecachesize"),
 	CqPrimvarToken(class_uniform,  type_color,   1, "zthreshold"),
 	// Option "searchpath"
 	CqPrimvarToken(class_uniform,  type_string,  1, "shader"),
@@ -159,6 +163,7 @@ const CqPrimvarToken standardVarsInit[] = {
 	// Option "statistics"
 	CqPrimvarToken(class_uniform,  type_integer, 1, "endofframe"),
 	CqPrimvarToken(class_uniform,  type_integer, 1, "echoapi"),
+	CqPrimvarToken(class_uniform,  type_string,  1, "tracefile"),
 	// Option "shutter"
 	CqPrimvarToken(class_uniform,  type_float,   1, "offset"),
 	// Projection
@@ -174,7 +179,9 @@ const CqPrimvarToken standardVarsInit[] = {
 	CqPrimvarToken(class_uniform,  type_string,  1, "shadinggroup"), // (not used in aqsis)
 	// Attribute "trimcurve"
 	CqPrimvarToken(class_uniform,  type_string,  1, "sense"),
-	// Attribute "shadow"
+	// Attribute "visibility"
+	CqPrimvarToken(class_uniform,  type_integer, 1, "trace"),
+	// Attribute "shadow" (bias is shared with Attribute "trace")
 	CqPrimvarToken(class_uniform,  type_float,   1, "bias0"),
 	CqPrimvarToken(class_uniform,  type_float,   1, "bias1"),
 	CqPrimvarToken(class_uniform,  type_float,   1, "bias"),
@@ -200,8 +207,11 @@ const CqPrimvarToken standardVarsInit[] = {
 	CqPrimvarToken(class_uniform,  type_integer, 1, "res"),
 	// Attribute "Render"
 	CqPrimvarToken(class_uniform,  type_integer, 1, "multipass"),
+	CqPrimvarToken(class_uniform,  type_string,  1, "dicecache"),
 	// Attribute "aqsis"
 	CqPrimvarToken(class_uniform,  type_float,   1, "expandgrids"),
+	// Attribute "light"
+	CqPrimvarToken(class_uniform,  type_float,   1, "influenceradius"),
 
 	//--------------------------------------------------
 	// Extra options not used by aqsis, but apparently commonly exported in RIB files.
@@ -0,0 +1,417 @@
+// Aqsis
+// Copyright (C) 1997 - 2001, Paul C. Gregory
+//
+// Contact: pgregory@aqsis.org
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation; either
+// version 2 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+/** \file
+ * \brief Streaming writer for point clouds baked with bake3d().
+ */
+
+#include	"bake3dwriter.h"
+
+#include	<algorithm>
+#include	<cfloat>
+#include	<cstdio>
+#include	<cstring>
+
+#include	<boost/cstdint.hpp>
+
+#include	<aqsis/util/file.h>
+#include	<aqsis/util/logging.h>
+
+namespace Aqsis {
+
+namespace {
+
+/// Number of floats in a chunk of a bake buffer (1MB).
+const TqInt chunkFloats = 256*1024;
+
+void releasePartioFile(Partio::ParticlesDataMutable* file)
+{
+	if(file) file->release();
+}
+
+/// Spread the low 21 bits of x so that there are two zero bits between each.
+boost::uint64_t spreadBits(boost::uint64_t x)
+{
+	x &= 0x1fffff;
+	x = (x | x << 32) & 0x1f00000000ffffULL;
+	x = (x | x << 16) & 0x1f0000ff0000ffULL;
+	x = (x | x << 8)  & 0x100f00f00f00f00fULL;
+	x = (x | x << 4)  & 0x10c30c30c30c30c3ULL;
+	x = (x | x << 2)  & 0x1249249249249249ULL;
+	return x;
+}
+
+/// Largest coordinate along each axis of the space filling curve.
+const float maxMortonCoord = 0x1fffff;
+
+/// Check that x is neither infinite nor NaN.
+inline bool isFinite(float x)
+{
+	return x >= -FLT_MAX && x <= FLT_MAX;
+}
+
+/** \brief Position of a point along a Morton order space filling curve.
+ *
+ * Coordinates are clamped to the curve, and NaNs are put at its start, so
+ * that broken points can't make the conversion to integer undefined.
+ */
+boost::uint64_t mortonKey(const float* P, const float* boundMin,
+		const float* scale)
+{
+	boost::uint64_t key = 0;
+	for(int i = 0; i < 3; ++i)
+	{
+		float q = (P[i] - boundMin[i])*scale[i];
+		if(!(q > 0))
+			q = 0;
+		else if(q > maxMortonCoord)
+			q = maxMortonCoord;
+		key |= spreadBits(static_cast<boost::uint64_t>(q)) << i;
+	}
+	return key;
+}
+
+/** \brief Order for points along the space filling curve.
+ *
+ * Points with the same Morton key are ordered by the bits of their
+ * positions, so the order only depends on thread scheduling for points at
+ * exactly the same position.
+ */
+class CqMortonLess
+{
+	public:
+		CqMortonLess(const std::vector<boost::uint64_t>& keys,
+				const std::vector<float>& positions)
+			: m_keys(keys),
+			m_positions(positions)
+		{ }
+
+		bool operator()(TqInt a, TqInt b) const
+		{
+			if(m_keys[a] != m_keys[b])
+				return m_keys[a] < m_keys[b];
+			for(int i = 0; i < 3; ++i)
+			{
+				TqUint32 pa = floatBits(m_positions[3*a + i]);
+				TqUint32 pb = floatBits(m_positions[3*b + i]);
+				if(pa != pb)
+					return pa < pb;
+			}
+			return false;
+		}
+
+	private:
+		static TqUint32 floatBits(float f)
+		{
+			TqUint32 bits;
+			std::memcpy(&bits, &f, sizeof(bits));
+			return bits;
+		}
+
+		const std::vector<boost::uint64_t>& m_keys;
+		const std::vector<float>& m_positions;
+};
+
+/// Reads back the chunks spooled by a set of bake buffers, in order.
+class CqSpoolReader
+{
+	public:
+		CqSpoolReader(const std::vector<boost::shared_ptr<CqBakeBuffer> >& buffers)
+			: m_buffers(buffers),
+			m_next(0),
+			m_file()
+		{ }
+
+		/** \brief Read the next chunk.
+		 *
+		 * \return false when there are no more chunks.
+		 */
+		bool next(TqInt& pointSize, std::vector<float>& data)
+		{
+			while(true)
+			{
+				TqInt32 header[2];
+				if(m_file.is_open() && m_file.read(reinterpret_cast<char*>(header),
+							sizeof(header)))
+				{
+					pointSize = header[0];
+					data.resize(header[0]*header[1]);
+					if(!data.empty())
+						m_file.read(reinterpret_cast<char*>(&data[0]),
+								data.size()*sizeof(float));
+					if(m_file)
+						return true;
+					Aqsis::log() << error << "bake3d: spool file is truncated\n";
+				}
+				m_file.close();
+				m_file.clear();
+				if(m_next >= m_buffers.size())
+					return false;
+				const CqBakeBuffer& buffer = *m_buffers[m_next++];
+				if(buffer.totalPoints() > 0)
+					m_file.open(buffer.spoolName().c_str(),
+							std::ios::in | std::ios::binary);
+			}
+		}
+
+	private:
+		const std::vector<boost::shared_ptr<CqBakeBuffer> >& m_buffers;
+		TqUint m_next;
+		std::ifstream m_file;
+};
+
+} // unnamed namespace
+
+
+//------------------------------------------------------------------------------
+// CqBakeBuffer
+
+CqBakeBuffer::CqBakeBuffer(const std::string& spoolName)
+	: m_spoolName(spoolName),
+	m_spool(),
+	m_chunk(),
+	m_pointSize(0),
+	m_totalPoints(0),
+	m_failed(false)
+{
+	m_chunk.reserve(chunkFloats);
+}
+
+CqBakeBuffer::~CqBakeBuffer()
+{
+	if(m_spool.is_open())
+	{
+		m_spool.close();
+		std::remove(m_spoolName.c_str());
+	}
+}
+
+void CqBakeBuffer::startChunk(TqInt pointSize)
+{
+	flush();
+	m_pointSize = pointSize;
+	if(m_chunk.capacity() < static_cast<TqUint>(pointSize))
+		m_chunk.reserve(pointSize);
+}
+
+bool CqBakeBuffer::flush()
+{
+	if(!m_chunk.empty() && !m_failed)
+	{
+		if(!m_spool.is_open())
+			m_spool.open(m_spoolName.c_str(),
+					std::ios::out | std::ios::binary | std::ios::trunc);
+		TqInt32 header[2] = { m_pointSize,
+			static_cast<TqInt32>(m_chunk.size()/m_pointSize) };
+		m_spool.write(reinterpret_cast<const char*>(header), sizeof(header));
+		m_spool.write(reinterpret_cast<const char*>(&m_chunk[0]),
+				m_chunk.size()*sizeof(float));
+		m_spool.flush();
+		if(!m_spool)
+		{
+			Aqsis::log() << error << "bake3d: Could not write spool file \""
+				<< m_spoolName << "\"; baked points will be lost\n";
+			m_failed = true;
+		}
+	}
+	m_chunk.clear();
+	return !m_failed;
+}
+
+
+//------------------------------------------------------------------------------
+// CqBake3dWriter
+
+CqBake3dWriter::CqBake3dWriter(const std::string& fileName)
+	: m_fileName(fileName),
+	m_attributes(),
+	m_pointSize(standardSize),
+	m_buffers()
+#ifdef ENABLE_THREADING
+	, m_threadBuffers(),
+	m_mutex()
+#endif
+{ }
+
+CqBake3dWriter::~CqBake3dWriter()
+{ }
+
+TqInt CqBake3dWriter::attributeOffset(const std::string& name,
+		Partio::ParticleAttributeType type, TqInt count)
+{
+#ifdef ENABLE_THREADING
+	boost::mutex::scoped_lock lock(m_mutex);
+#endif
+	for(std::vector<SqAttribute>::const_iterator attr = m_attributes.begin();
+			attr != m_attributes.end(); ++attr)
+	{
+		if(attr->name == name)
+			return attr->count == count ? attr->offset : -1;
+	}
+	SqAttribute attr = { name, type, count, m_pointSize };
+	m_attributes.push_back(attr);
+	m_pointSize += count;
+	return attr.offset;
+}
+
+TqInt CqBake3dWriter::pointSize()
+{
+#ifdef ENABLE_THREADING
+	boost::mutex::scoped_lock lock(m_mutex);
+#endif
+	return m_pointSize;
+}
+
+CqBakeBuffer& CqBake3dWriter::buffer()
+{
+#ifdef ENABLE_THREADING
+	boost::mutex::scoped_lock lock(m_mutex);
+	CqBakeBuffer*& buffer = m_threadBuffers[boost::this_thread::get_id()];
+	if(!buffer)
+		buffer = &newBuffer();
+	return *buffer;
+#else
+	if(m_buffers.empty())
+		return newBuffer();
+	return *m_buffers[0];
+#endif
+}
+
+CqBakeBuffer& CqBake3dWriter::newBuffer()
+{
+	// Two renders may bake to the same file at once, so the spool names
+	// must be unique to this process and buffer.
+	std::string spoolName = uniqueTempName(m_fileName + ".spool");
+	m_buffers.push_back(boost::shared_ptr<CqBakeBuffer>(new CqBakeBuffer(spoolName)));
+	return *m_buffers.back();
+}
+
+bool CqBake3dWriter::write()
+{
+#ifdef ENABLE_THREADING
+	boost::mutex::scoped_lock lock(m_mutex);
+#endif
+	bool ok = true;
+	TqInt npoints = 0;
+	for(TqUint i = 0; i < m_buffers.size(); ++i)
+	{
+		ok &= m_buffers[i]->flush();
+		npoints += m_buffers[i]->totalPoints();
+	}
+
+	// First pass over the spooled points: find the order of the points along
+	// a space filling curve through their bound.
+	std::vector<float> positions;
+	positions.reserve(3*npoints);
+	float boundMin[3] = { FLT_MAX, FLT_MAX, FLT_MAX };
+	float boundMax[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+	TqInt pointSize = 0;
+	std::vector<float> chunk;
+	{
+		CqSpoolReader reader(m_buffers);
+		while(reader.next(pointSize, chunk))
+		{
+			for(TqUint j = 0; j < chunk.size(); j += pointSize)
+			{
+				for(int i = 0; i < 3; ++i)
+				{
+					positions.push_back(chunk[j + i]);
+					if(!isFinite(chunk[j + i]))
+						continue;
+					boundMin[i] = std::min(boundMin[i], chunk[j + i]);
+					boundMax[i] = std::max(boundMax[i], chunk[j + i]);
+				}
+			}
+		}
+	}
+	npoints = positions.size()/3;
+	float scale[3];
+	for(int i = 0; i < 3; ++i)
+	{
+		float size = boundMax[i] - boundMin[i];
+		scale[i] = size > 0 && isFinite(size) ? maxMortonCoord/size : 0;
+	}
+	std::vector<boost::uint64_t> keys(npoints);
+	std::vector<TqInt> order(npoints);
+	for(TqInt i = 0; i < npoints; ++i)
+	{
+		keys[i] = mortonKey(&positions[3*i], boundMin, scale);
+		order[i] = i;
+	}
+	std::sort(order.begin(), order.end(), CqMortonLess(keys, positions));
+	std::vector<TqInt> destIndex(npoints);
+	for(TqInt i = 0; i < npoints; ++i)
+		destIndex[order[i]] = i;
+	std::vector<float>().swap(positions);
+	std::vector<boost::uint64_t>().swap(keys);
+	std::vector<TqInt>().swap(order);
+
+	boost::shared_ptr<Partio::ParticlesDataMutable> pointFile(
+			Partio::create(), releasePartioFile);
+	Partio::ParticleAttribute positionAttr =
+		pointFile->addAttribute("position", Partio::VECTOR, 3);
+	Partio::ParticleAttribute normalAttr =
+		pointFile->addAttribute("normal", Partio::VECTOR, 3);
+	Partio::ParticleAttribute radiusAttr =
+		pointFile->addAttribute("radius", Partio::FLOAT, 1);
+	std::vector<Partio::ParticleAttribute> attrs;
+	for(TqUint i = 0; i < m_attributes.size(); ++i)
+		attrs.push_back(pointFile->addAttribute(m_attributes[i].name.c_str(),
+					m_attributes[i].type, m_attributes[i].count));
+	pointFile->addParticles(npoints);
+
+	// Second pass: copy each point to its place in the sorted file.
+	{
+		CqSpoolReader reader(m_buffers);
+		TqInt source = 0;
+		while(reader.next(pointSize, chunk))
+		{
+			for(TqUint j = 0; j < chunk.size() && source < npoints; j += pointSize)
+			{
+				const float* rec = &chunk[j];
+				TqInt ptIdx = destIndex[source++];
+				std::copy(rec, rec + 3, pointFile->dataWrite<float>(positionAttr, ptIdx));
+				std::copy(rec + 3, rec + 6, pointFile->dataWrite<float>(normalAttr, ptIdx));
+				*pointFile->dataWrite<float>(radiusAttr, ptIdx) = rec[6];
+				for(TqUint i = 0; i < attrs.size(); ++i)
+				{
+					// Attributes added after the point was baked are zero.
+					const SqAttribute& attr = m_attributes[i];
+					float* out = pointFile->dataWrite<float>(attrs[i], ptIdx);
+					for(TqInt k = 0; k < attr.count; ++k)
+						out[k] = attr.offset + k < pointSize ? rec[attr.offset + k] : 0;
+				}
+			}
+		}
+	}
+	// Partio doesn't report errors, so remove any old file and check that
+	// the new one appeared.
+	std::remove(m_fileName.c_str());
+	Partio::write(m_fileName.c_str(), *pointFile);
+	if(!std::ifstream(m_fileName.c_str()))
+	{
+		Aqsis::log() << error << "bake3d: Could not write point cloud \""
+			<< m_fileName << "\"\n";
+		ok = false;
+	}
+	return ok;
+}
+
+} // namespace Aqsis
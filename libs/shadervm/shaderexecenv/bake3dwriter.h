@@ -0,0 +1,166 @@
+// Aqsis
+// Copyright (C) 1997 - 2001, Paul C. Gregory
+//
+// Contact: pgregory@aqsis.org
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation; either
+// version 2 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+/** \file
+ * \brief Streaming writer for point clouds baked with bake3d().
+ */
+
+#ifndef BAKE3DWRITER_H_INCLUDED
+#define BAKE3DWRITER_H_INCLUDED 1
+
+#include	<aqsis/aqsis.h>
+
+#include	<fstream>
+#include	<map>
+#include	<string>
+#include	<vector>
+
+#include	<boost/noncopyable.hpp>
+#include	<boost/shared_ptr.hpp>
+#ifdef ENABLE_THREADING
+#include	<boost/thread/mutex.hpp>
+#include	<boost/thread/thread.hpp>
+#endif
+
+#include	<Partio.h>
+
+namespace Aqsis {
+
+/** \brief Per-thread buffer of baked points.
+ *
+ * Points are appended to a fixed size chunk in memory.  Full chunks are
+ * written to a spool file belonging to the buffer in one sequential write, so
+ * the memory used while baking doesn't grow with the number of points.
+ */
+class CqBakeBuffer : boost::noncopyable
+{
+	public:
+		/// Create a buffer spooling to the given file.
+		CqBakeBuffer(const std::string& spoolName);
+		/// Remove the spool file.
+		~CqBakeBuffer();
+
+		/** \brief Append a point to the buffer.
+		 *
+		 * \param pointSize - number of floats in the point record.
+		 * \return the record of pointSize floats for the point, initialised
+		 *         to zero.  It's valid until the next call to newPoint().
+		 */
+		float* newPoint(TqInt pointSize)
+		{
+			if(pointSize != m_pointSize || m_chunk.size() + pointSize > m_chunk.capacity())
+				startChunk(pointSize);
+			m_chunk.resize(m_chunk.size() + pointSize, 0.0f);
+			++m_totalPoints;
+			return &m_chunk[m_chunk.size() - pointSize];
+		}
+
+		/// Write the chunk in memory to the spool file.
+		bool flush();
+		/// Total number of points added to the buffer.
+		TqInt totalPoints() const { return m_totalPoints; }
+		/// Name of the spool file.
+		const std::string& spoolName() const { return m_spoolName; }
+
+	private:
+		void startChunk(TqInt pointSize);
+
+		std::string m_spoolName;
+		std::ofstream m_spool;
+		/// Records for the current chunk; all have m_pointSize floats.
+		std::vector<float> m_chunk;
+		TqInt m_pointSize;
+		TqInt m_totalPoints;
+		bool m_failed;
+};
+
+/** \brief Writer for a point cloud file baked by bake3d().
+ *
+ * Each rendering thread appends points to its own CqBakeBuffer, so no lock is
+ * taken per point.  When the frame is finished, write() merges the spooled
+ * points, sorts them spatially and writes the point cloud with Partio.
+ * Sorting keeps nearby points together in the file, and makes the output
+ * independent of the order in which the threads baked the points, except
+ * for the order of points baked at exactly the same position.
+ *
+ * A point record holds the position, normal and radius, followed by the
+ * values of the attributes in the order they were added.  Attributes are
+ * only ever appended, so a record made with fewer attributes is a prefix of
+ * the final record; the missing values are written as zero.
+ */
+class CqBake3dWriter : boost::noncopyable
+{
+	public:
+		/// Number of floats at the start of a record: P, N and radius.
+		static const TqInt standardSize = 7;
+
+		CqBake3dWriter(const std::string& fileName);
+		~CqBake3dWriter();
+
+		/** \brief Find the offset of an attribute in point records.
+		 *
+		 * The attribute is added if it hasn't been baked to this file before.
+		 *
+		 * \return the offset of the attribute values in point records, or -1
+		 *         if the attribute was previously baked with a different size.
+		 */
+		TqInt attributeOffset(const std::string& name,
+				Partio::ParticleAttributeType type, TqInt count);
+
+		/// Number of floats in a record with all the current attributes.
+		TqInt pointSize();
+
+		/// Get the buffer for points baked by the calling thread.
+		CqBakeBuffer& buffer();
+
+		/** \brief Merge all the baked points and write the point cloud.
+		 *
+		 * \return false if the file couldn't be written.
+		 */
+		bool write();
+
+	private:
+		struct SqAttribute
+		{
+			std::string name;
+			Partio::ParticleAttributeType type;
+			TqInt count;
+			TqInt offset;
+		};
+
+		CqBakeBuffer& newBuffer();
+
+		std::string m_fileName;
+		std::vector<SqAttribute> m_attributes;
+		TqInt m_pointSize;
+		/// All buffers, in the order they were created.
+		std::vector<boost::shared_ptr<CqBakeBuffer> > m_buffers;
+#ifdef ENABLE_THREADING
+		typedef std::map<boost::thread::id, CqBakeBuffer*> TqThreadBuffers;
+		/// The buffer for each thread; owned by m_buffers.
+		TqThreadBuffers m_threadBuffers;
+		/// Protects the attributes and the list of buffers.
+		boost::mutex m_mutex;
+#endif
+};
+
+} // namespace Aqsis
+
+#endif // BAKE3DWRITER_H_INCLUDED
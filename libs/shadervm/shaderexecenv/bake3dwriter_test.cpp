@@ -0,0 +1,161 @@
+// Aqsis
+// Copyright (C) 1997 - 2001, Paul C. Gregory
+//
+// Contact: pgregory@aqsis.org
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation; either
+// version 2 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+/** \file Unit tests for merging and sorting baked point clouds.
+ */
+
+#include "bake3dwriter.h"
+
+#include <cstdio>
+#include <limits>
+#include <vector>
+
+#include <boost/bind.hpp>
+
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/auto_unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(bake3dwriter_tests)
+
+using namespace Aqsis;
+
+namespace {
+
+// Enough points that each buffer spools several chunks.
+const TqInt numPoints = 60000;
+
+void releasePartioFile(Partio::ParticlesDataMutable* file)
+{
+	if(file) file->release();
+}
+
+/// Position along x of point i; a permutation of 0 to numPoints-1.
+float pointX(TqInt i)
+{
+	return (i*7919) % numPoints;
+}
+
+/** Bake points begin to end-1, stepping by step.
+ *
+ * Points lie along the x axis, and carry their index as the "id" attribute.
+ * Only odd points set the "Cs" attribute, which is added by the first one.
+ */
+void bakePoints(CqBake3dWriter* writer, TqInt begin, TqInt end, TqInt step)
+{
+	TqInt idOffset = writer->attributeOffset("id", Partio::FLOAT, 1);
+	for(TqInt i = begin; i != end; i += step)
+	{
+		TqInt csOffset = -1;
+		if(i % 2 == 1)
+			csOffset = writer->attributeOffset("Cs", Partio::VECTOR, 3);
+		float* rec = writer->buffer().newPoint(writer->pointSize());
+		rec[0] = pointX(i);
+		rec[5] = 1;
+		rec[6] = 0.5f;
+		rec[idOffset] = i;
+		if(csOffset >= 0)
+			rec[csOffset] = rec[csOffset+1] = rec[csOffset+2] = i;
+	}
+}
+
+/// Read the ids of the points in file order, checking their records.
+void readIds(const char* fileName, std::vector<TqInt>& ids)
+{
+	boost::shared_ptr<Partio::ParticlesDataMutable> file(
+			Partio::read(fileName), releasePartioFile);
+	BOOST_REQUIRE(file);
+	BOOST_REQUIRE_EQUAL(file->numParticles(), numPoints);
+	Partio::ParticleAttribute posAttr, idAttr, csAttr;
+	BOOST_REQUIRE(file->attributeInfo("position", posAttr));
+	BOOST_REQUIRE(file->attributeInfo("id", idAttr));
+	BOOST_REQUIRE(file->attributeInfo("Cs", csAttr));
+	std::vector<bool> seen(numPoints, false);
+	for(TqInt j = 0; j < numPoints; ++j)
+	{
+		TqInt i = static_cast<TqInt>(file->data<float>(idAttr, j)[0]);
+		BOOST_REQUIRE(i >= 0 && i < numPoints && !seen[i]);
+		seen[i] = true;
+		ids.push_back(i);
+		BOOST_REQUIRE_EQUAL(file->data<float>(posAttr, j)[0], pointX(i));
+		// Points without "Cs", including those baked before it was added,
+		// get zero for it.
+		const float* cs = file->data<float>(csAttr, j);
+		BOOST_REQUIRE_EQUAL(cs[2], i % 2 == 1 ? i : 0);
+	}
+}
+
+} // unnamed namespace
+
+BOOST_AUTO_TEST_CASE(bake3dwriter_merge_and_sort)
+{
+	const char* fileName1 = "bake3dwriter_test1.ptc";
+	const char* fileName2 = "bake3dwriter_test2.ptc";
+	{
+		CqBake3dWriter writer(fileName1);
+		bakePoints(&writer, 0, numPoints, 1);
+		BOOST_REQUIRE(writer.write());
+	}
+	{
+		// Bake the same points in a different order, from two threads where
+		// available, so they are merged from separate spools.
+		CqBake3dWriter writer(fileName2);
+#ifdef ENABLE_THREADING
+		boost::thread other(boost::bind(&bakePoints, &writer, numPoints-1,
+					numPoints/2 - 1, -1));
+		bakePoints(&writer, 0, numPoints/2, 1);
+		other.join();
+#else
+		bakePoints(&writer, numPoints-1, -1, -1);
+#endif
+		BOOST_REQUIRE(writer.write());
+	}
+	std::vector<TqInt> ids1;
+	readIds(fileName1, ids1);
+	std::vector<TqInt> ids2;
+	readIds(fileName2, ids2);
+	// The points lie along the x axis, so they are sorted by x.
+	for(TqInt j = 0; j < numPoints; ++j)
+		BOOST_REQUIRE_EQUAL(pointX(ids1[j]), j);
+	BOOST_CHECK(ids1 == ids2);
+	std::remove(fileName1);
+	std::remove(fileName2);
+}
+
+BOOST_AUTO_TEST_CASE(bake3dwriter_nonfinite_positions)
+{
+	const char* fileName = "bake3dwriter_test3.ptc";
+	CqBake3dWriter writer(fileName);
+	float badValues[] = { std::numeric_limits<float>::quiet_NaN(),
+		std::numeric_limits<float>::infinity(),
+		-std::numeric_limits<float>::infinity() };
+	for(TqInt i = 0; i < 12; ++i)
+	{
+		float* rec = writer.buffer().newPoint(writer.pointSize());
+		rec[0] = i;
+		rec[i % 3] = badValues[i % 3];
+	}
+	BOOST_REQUIRE(writer.write());
+	boost::shared_ptr<Partio::ParticlesDataMutable> file(
+			Partio::read(fileName), releasePartioFile);
+	BOOST_REQUIRE(file);
+	BOOST_CHECK_EQUAL(file->numParticles(), 12);
+	std::remove(fileName);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -1,4 +1,5 @@
 set(shaderexecenv_srcs
+	bake3dwriter.cpp
 	shadeops_bake3d.cpp
 	shadeops_indirectdiffuse.cpp
 	shadeops_comp.cpp
@@ -16,7 +17,13 @@ set(shaderexecenv_srcs
 make_absolute(shaderexecenv_srcs ${shaderexecenv_SOURCE_DIR})
 
 set(shaderexecenv_hdrs
+	bake3dwriter.h
 	shaderexecenv.h
 )
 make_absolute(shaderexecenv_hdrs ${shaderexecenv_SOURCE_DIR})
+
+set(shaderexecenv_test_srcs
+	bake3dwriter_test.cpp
+)
+make_absolute(shaderexecenv_test_srcs ${shaderexecenv_SOURCE_DIR})
 include_directories(${shaderexecenv_SOURCE_DIR})
@@ -26,6 +26,7 @@
 
 #include <Partio.h>
 
+#include "bake3dwriter.h"
 #include "shaderexecenv.h"
 
 #include <aqsis/util/autobuffer.h>
@@ -127,53 +128,39 @@ static void releasePartioFile(Partio::ParticlesInfo* file)
 }
 
 namespace {
-/// A cache for open point cloud bake files for bake3d().
+/// A cache of writers for point cloud bake files for bake3d().
 class Bake3dCache
 {
     public:
-        /// Find or create a point cloud with the given name.
-        ///
-        /// The standard attributes; position, normal, and radius are added on
-        /// creation.
-        Partio::ParticlesDataMutable* find(const std::string& fileName)
+        /// Find or create the writer for a point cloud with the given name.
+        CqBake3dWriter* find(const std::string& fileName)
         {
-            Partio::ParticlesDataMutable* pointFile = 0;
-            FileMap::iterator ptcIter = m_files.find(fileName);
-            if(ptcIter == m_files.end())
-            {
-                // Create new bake file & insert into map.
-                pointFile = Partio::create();
-                m_files[fileName].reset(pointFile, releasePartioFile);
-                if(pointFile)
-                {
-                    // Add default attributes
-                    pointFile->addAttribute("position", Partio::VECTOR, 3);
-                    pointFile->addAttribute("normal", Partio::VECTOR, 3);
-                    pointFile->addAttribute("radius", Partio::FLOAT, 1);
-                }
-                else
-                {
-                    Aqsis::log() << error
-                        << "bake3d: Could not open point cloud \"" << fileName
-                        << "\" for writing\n";
-                }
-            }
-            else
-                pointFile = ptcIter->second.get();
-            return pointFile;
+#ifdef ENABLE_THREADING
+            boost::mutex::scoped_lock lock(m_mutex);
+#endif
+            boost::shared_ptr<CqBake3dWriter>& writer = m_files[fileName];
+            if(!writer)
+                writer.reset(new CqBake3dWriter(fileName));
+            return writer.get();
         }
 
-        /// Flush all files to disk and clear the cache
+        /// Write all files to disk and clear the cache
         void flush()
         {
+#ifdef ENABLE_THREADING
+            boost::mutex::scoped_lock lock(m_mutex);
+#endif
             for(FileMap::iterator i = m_files.begin(); i != m_files.end(); ++i)
-                Partio::write(i->first.c_str(), *i->second);
+                i->second->write();
             m_files.clear();
         }
 
     private:
-        typedef std::map<std::string, boost::shared_ptr<Partio::ParticlesDataMutable> > FileMap;
+        typedef std::map<std::string, boost::shared_ptr<CqBake3dWriter> > FileMap;
         FileMap m_files;
+#ifdef ENABLE_THREADING
+        boost::mutex m_mutex;
+#endif
 };
 }
 
@@ -261,32 +248,21 @@ void CqShaderExecEnv::SO_bake3d( IqShaderData* ptc,
     CqString ptcName;
     ptc->GetString(ptcName);
     // Find point cloud in cache, or create it if it doesn't exist.
-    Partio::ParticlesDataMutable* pointFile = g_bakeCloudCache.find(ptcName);
+    CqBake3dWriter* writer = g_bakeCloudCache.find(ptcName);
     bool varying = position->Class() == class_varying ||
                    normal->Class() == class_varying ||
                    Result->Class() == class_varying;
-    if(!pointFile)
-    {
-        // Error; set result to false and return.
-        int npoints = varying ? shadingPointCount() : 1;
-        for(int igrid = 0; igrid < npoints; ++igrid)
-            if(!varying || RS.Value(igrid))
-                Result->SetFloat(0.0f, igrid);
-        return;
-    }
     // Optional output control variables
     bool interpolate = false;
     const IqShaderData* radius = 0;
     const IqShaderData* radiusScale = 0;
     CqString coordSystem = "world";
-    // P, N and r output attributes are always present
-    Partio::ParticleAttribute positionAttr, normalAttr, radiusAttr;
-    pointFile->attributeInfo("position", positionAttr);
-    pointFile->attributeInfo("normal", normalAttr);
-    pointFile->attributeInfo("radius", radiusAttr);
-    // Extract list of user-specified output vars from arguments
+    // Extract list of user-specified output vars from arguments, with the
+    // offset and size of each in the point records.
     std::vector<UserVar> bakeVars;
     bakeVars.reserve(cParams/2);
+    std::vector<TqInt> bakeOffsets;
+    std::vector<TqInt> bakeCounts;
     CqString paramName;
     // Number of output floats.  Start with space for position and normal data.
     int nOutFloats = 6;
@@ -327,23 +303,19 @@ void CqShaderExecEnv::SO_bake3d( IqShaderData* ptc,
                             << paramName << "\"\n";
                         continue;
                 }
-                bakeVars.push_back(UserVar(paramValue, paramType));
                 // Find the named attribute in the point file, or create it if
                 // it doesn't exist.
-                UserVar& var = bakeVars.back();
-                if(pointFile->attributeInfo(paramName.c_str(), var.attr))
+                TqInt offset = writer->attributeOffset(paramName, parType, count);
+                if(offset < 0)
                 {
-                    if(var.attr.count != count)
-                    {
-                        Aqsis::log() << warning
-                            << "bake3d: can't bake variable \"" << paramName
-                            << "\"; previously baked with different type\n";
-                        bakeVars.pop_back();
-                    }
+                    Aqsis::log() << warning
+                        << "bake3d: can't bake variable \"" << paramName
+                        << "\"; previously baked with different type\n";
+                    continue;
                 }
-                else
-                    var.attr = pointFile->addAttribute(paramName.c_str(),
-                                                       parType, count);
+                bakeVars.push_back(UserVar(paramValue, paramType));
+                bakeOffsets.push_back(offset);
+                bakeCounts.push_back(count);
                 nOutFloats += count;
             }
         }
@@ -362,6 +334,11 @@ void CqShaderExecEnv::SO_bake3d( IqShaderData* ptc,
     CqAutoBuffer<TqFloat, 100> allData(interpolate ?
                                        2*nOutFloats : nOutFloats);
 
+    // Points are appended to the buffer of the current thread, in records
+    // large enough for all the attributes of the file.
+    CqBakeBuffer& bakeBuffer = writer->buffer();
+    TqInt pointSize = writer->pointSize();
+
     // Number of vertices in the grid
     int uSize = m_uGridRes+1;
     int vSize = m_vGridRes+1;
@@ -459,22 +436,18 @@ void CqShaderExecEnv::SO_bake3d( IqShaderData* ptc,
 
             // Save current point data to the point file
             float* d = &allData[0];
-            Partio::ParticleIndex ptIdx = pointFile->addParticle();
+            float* rec = bakeBuffer.newPoint(pointSize);
             // Save out standard attributes
-            float* P = pointFile->dataWrite<float>(positionAttr, ptIdx);
-            float* N = pointFile->dataWrite<float>(normalAttr, ptIdx);
-            float* r = pointFile->dataWrite<float>(radiusAttr, ptIdx);
             CqVector3D cqP = positionTrans * CqVector3D(d[0], d[1], d[2]); d += 3;
-            P[0] = cqP.x(); P[1] = cqP.y(); P[2] = cqP.z();
+            rec[0] = cqP.x(); rec[1] = cqP.y(); rec[2] = cqP.z();
             CqVector3D cqN = normalTrans * CqVector3D(d[0], d[1], d[2]); d += 3;
-            N[0] = cqN.x(); N[1] = cqN.y(); N[2] = cqN.z();
-            r[0] = radiusVal;
+            rec[3] = cqN.x(); rec[4] = cqN.y(); rec[5] = cqN.z();
+            rec[6] = radiusVal;
             // Save out user-defined attributes
             for(int i = 0, iend = bakeVars.size(); i < iend; ++i)
             {
-                UserVar& var = bakeVars[i];
-                float* out = pointFile->dataWrite<float>(var.attr, ptIdx);
-                for(int j = 0; j < var.attr.count; ++j)
+                float* out = rec + bakeOffsets[i];
+                for(int j = 0; j < bakeCounts[i]; ++j)
                     out[j] = *d++;
             }
             Result->SetFloat(1, igrid);
@@ -493,6 +466,7 @@ void CqShaderExecEnv::SO_bake3d( IqShaderData* ptc,
 static bool parseTexture3dVarargs(int nargs, IqShaderData** args,
                                   const Partio::ParticlesData* pointFile,
                                   CqString& coordSystem,
+                                  float& filterRadius,
                                   std::vector<UserVar>& userVars)
 {
     userVars.reserve(nargs/2);
@@ -512,8 +486,14 @@ static bool parseTexture3dVarargs(int nargs, IqShaderData** args,
         // list, and shouldn't be looked up in the file:
         if(paramName == "coordsystem" && paramType == type_string)
             paramValue->GetString(coordSystem);
-        else if(paramName == "filterradius")
-            ; // For brick maps; ignored for now
+        else if(paramName == "filterradius" && paramType == type_float)
+        {
+            // Limits the distance to the points used for filtering.
+            TqFloat r = 0;
+            paramValue->GetFloat(r);
+            if(r > 0)
+                filterRadius = r;
+        }
         else if(paramName == "filterscale")
             ; // For brick maps; ignored for now
         else if(paramName == "maxdepth")
@@ -588,10 +568,11 @@ void CqShaderExecEnv::SO_texture3d(IqShaderData* ptc,
     int npoints = varying ? shadingPointCount() : 1;
 
     CqString coordSystem = "world";
+    float filterRadius = FLT_MAX;
     std::vector<UserVar> userVars;
 
-    if(!pointFile || !parseTexture3dVarargs(cParams, apParams,
-                                            pointFile, coordSystem, userVars))
+    if(!pointFile || !parseTexture3dVarargs(cParams, apParams, pointFile,
+                                            coordSystem, filterRadius, userVars))
     {
         // Error - no point file or no arguments to look up: set result to 0
         // and return.
@@ -639,23 +620,24 @@ void CqShaderExecEnv::SO_texture3d(IqShaderData* ptc,
         V3f P(cqP.x(), cqP.y(), cqP.z());
         // The reinterpret_casts are ugly here of course, but V3f is basically
         // a POD type, so they work ok.
-        int pointsFound = pointFile->findNPoints(reinterpret_cast<float*>(&P),
-                                                 nfilter, FLT_MAX, indices,
-                                                 distSquared, &maxRadius2);
-        if(pointsFound < nfilter)
+        const int nfound = pointFile->findNPoints(reinterpret_cast<float*>(&P),
+                                                  nfilter, filterRadius, indices,
+                                                  distSquared, &maxRadius2);
+        if(nfound == 0)
         {
+            // Nothing within the filter radius.
             Result->SetFloat(0.0f, igrid);
-            Aqsis::log() << error << "Not enough points found to filter!";
+            continue;
         }
         // Read position, normal and radius
         V3f foundP[nfilter];
-        pointFile->dataAsFloat(positionAttr, nfilter, indices, false,
+        pointFile->dataAsFloat(positionAttr, nfound, indices, false,
                                reinterpret_cast<float*>(foundP));
         V3f foundN[nfilter];
-        pointFile->dataAsFloat(normalAttr, nfilter, indices, false,
+        pointFile->dataAsFloat(normalAttr, nfound, indices, false,
                                reinterpret_cast<float*>(foundN));
         float foundRadius[nfilter];
-        pointFile->dataAsFloat(radiusAttr, nfilter, indices, false, foundRadius);
+        pointFile->dataAsFloat(radiusAttr, nfound, indices, false, foundRadius);
 
         // Compute filter weights for nearby points.  inverseWidthSquared
         // decides the blurryness of the gaussian filter.  The value was chosen
@@ -667,7 +649,7 @@ void CqShaderExecEnv::SO_texture3d(IqShaderData* ptc,
         float weights[nfilter];
         float totWeight = 0;
         V3f N(cqN.x(), cqN.y(), cqN.z());
-        for(int i = 0; i < nfilter; ++i)
+        for(int i = 0; i < nfound; ++i)
         {
             // The weights depend on how well the normals are aligned, and the
             // distance between the current shading point and the points found
@@ -688,7 +670,7 @@ void CqShaderExecEnv::SO_texture3d(IqShaderData* ptc,
         }
         // Normalize the weights
         float renorm = totWeight != 0 ? 1/totWeight : 0;
-        for(int i = 0; i < nfilter; ++i)
+        for(int i = 0; i < nfound; ++i)
             weights[i] *= renorm;
 
         for(std::vector<UserVar>::const_iterator var = userVars.begin();
@@ -696,12 +678,12 @@ void CqShaderExecEnv::SO_texture3d(IqShaderData* ptc,
         {
             // Read and filter each piece of user-defined data
             float varData[16*nfilter];
-            pointFile->dataAsFloat(var->attr, nfilter, indices, false, varData);
+            pointFile->dataAsFloat(var->attr, nfound, indices, false, varData);
             int varSize = var->attr.count;
             float accum[16];
             for(int c = 0; c < varSize; ++c)
                 accum[c] = 0;
-            for(int i = 0; i < nfilter; ++i)
+            for(int i = 0; i < nfound; ++i)
                 for(int c = 0; c < varSize; ++c)
                     accum[c] += weights[i] * varData[i*varSize + c];
             // Ah, if only we could get at the raw floats stored by
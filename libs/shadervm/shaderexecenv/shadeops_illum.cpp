@@ -27,14 +27,27 @@
 #include	<string>
 #include	<stdio.h>
 
+#include	<boost/scoped_array.hpp>
+
 #include	<aqsis/math/math.h>
 #include	"shaderexecenv.h"
 #include	<aqsis/core/ilightsource.h>
+#include	<aqsis/core/parameterkey.h>
 
 #include	"../../pointrender/microbuf_proj_func.h"
 
 namespace Aqsis {
 
+namespace {
+
+// Options and attributes looked up while rendering, interned once.
+const CqParameterKey enableShadersLightingKey( "EnableShaders", "lighting" );
+const CqParameterKey systemClippingKey( "System", "Clipping" );
+const CqParameterKey systemOrientationKey( "System", "Orientation" );
+const CqParameterKey traceBiasKey( "trace", "bias" );
+
+} // unnamed namespace
+
 //----------------------------------------------------------------------
 // init_illuminance()
 // NOTE: There is duplication here between SO_init_illuminance and 
@@ -45,14 +58,14 @@ bool CqShaderExecEnv::SO_init_illuminance()
 	// Check if lighting is turned off.
 	if(getRenderContext())
 	{
-		const TqInt* enableLightingOpt = getRenderContext()->GetIntegerOption("EnableShaders", "lighting");
+		const TqInt* enableLightingOpt = getRenderContext()->GetIntegerOption( enableShadersLightingKey );
 		if(NULL != enableLightingOpt && enableLightingOpt[0] == 0)
 			return(false);
 	}
 
 	m_li = 0;
 	while ( m_li < m_pAttributes ->cLights() &&
-	        m_pAttributes ->pLight( m_li ) ->pShader() ->fAmbient() )
+	        ( m_pAttributes ->pLight( m_li ) ->pShader() ->fAmbient() || isCulled( m_li ) ) )
 	{
 		m_li++;
 	}
@@ -70,14 +83,14 @@ bool CqShaderExecEnv::SO_advance_illuminance()
 	// Check if lighting is turned off, should never need this check as SO_init_illuminance will catch first.
 	if(getRenderContext())
 	{
-		const TqInt* enableLightingOpt = getRenderContext()->GetIntegerOption("EnableShaders", "lighting");
+		const TqInt* enableLightingOpt = getRenderContext()->GetIntegerOption( enableShadersLightingKey );
 		if(NULL != enableLightingOpt && enableLightingOpt[0] == 0)
 			return(false);
 	}
 
 	m_li++;
 	while ( m_li < m_pAttributes ->cLights() &&
-	        m_pAttributes ->pLight( m_li ) ->pShader() ->fAmbient() )
+	        ( m_pAttributes ->pLight( m_li ) ->pShader() ->fAmbient() || isCulled( m_li ) ) )
 	{
 		m_li++;
 	}
@@ -103,7 +116,7 @@ void CqShaderExecEnv::SO_init_gather(IqShaderData* samples, IqShader* pShader)
 	// Check if lighting is turned off.
 	if(getRenderContext())
 	{
-		const TqInt* enableLightingOpt = getRenderContext()->GetIntegerOption("EnableShaders", "lighting");
+		const TqInt* enableLightingOpt = getRenderContext()->GetIntegerOption( enableShadersLightingKey );
 		if(NULL != enableLightingOpt && enableLightingOpt[0] == 0)
 			return;
 	}
@@ -119,7 +132,7 @@ bool CqShaderExecEnv::SO_advance_gather()
 	// Check if lighting is turned off, should never need this check as SO_init_illuminance will catch first.
 	if(getRenderContext())
 	{
-		const TqInt* enableLightingOpt = getRenderContext()->GetIntegerOption("EnableShaders", "lighting");
+		const TqInt* enableLightingOpt = getRenderContext()->GetIntegerOption( enableShadersLightingKey );
 		if(NULL != enableLightingOpt && enableLightingOpt[0] == 0)
 			return(false);
 	}
@@ -136,7 +149,7 @@ void CqShaderExecEnv::ValidateIlluminanceCache( IqShaderData* pP, IqShaderData*
 		// Check if lighting is turned off.
 		if(getRenderContext())
 		{
-			const TqInt* enableLightingOpt = getRenderContext()->GetIntegerOption("EnableShaders", "lighting");
+			const TqInt* enableLightingOpt = getRenderContext()->GetIntegerOption( enableShadersLightingKey );
 			if(NULL != enableLightingOpt && enableLightingOpt[0] == 0)
 			{
 				m_IlluminanceCacheValid = true;
@@ -146,10 +159,33 @@ void CqShaderExecEnv::ValidateIlluminanceCache( IqShaderData* pP, IqShaderData*
 
 		IqShaderData* Ns = (pN != NULL )? pN : N();
 		IqShaderData* Ps = (pP != NULL )? pP : P();
+
+		// Bound the points being lit by a sphere, so that lights which
+		// can't reach any of them are skipped rather than evaluated.
+		CqVector3D boundMin, boundMax, p;
+		Ps->GetPoint( boundMin, 0 );
+		boundMax = boundMin;
+		TqInt numPoints = Ps->Size();
+		for ( TqInt i = 1; i < numPoints; ++i )
+		{
+			Ps->GetPoint( p, i );
+			boundMin = min( boundMin, p );
+			boundMax = max( boundMax, p );
+		}
+		CqVector3D center = ( boundMin + boundMax ) * 0.5f;
+		TqFloat radius = ( boundMax - center ).Magnitude();
+
+		m_culledLights.assign( m_pAttributes ->cLights(), false );
 		TqUint li = 0;
 		while ( li < m_pAttributes ->cLights() )
 		{
 			IqLightsource * lp = m_pAttributes ->pLight( li );
+			if ( !lp->mayIlluminate( center, radius ) )
+			{
+				m_culledLights[ li ] = true;
+				li++;
+				continue;
+			}
 			// Initialise the lightsource
 			lp->Initialise( uGridRes(), vGridRes(), microPolygonCount(), shadingPointCount(), m_hasValidDerivatives );
 			m_Illuminate = 0;
@@ -349,8 +385,8 @@ void CqShaderExecEnv::SO_depth( IqShaderData* p, IqShaderData* Result, IqShader*
 	__iGrid = 0;
 	const CqBitVector& RS = RunningState();
 
-	TqFloat ClippingNear = getRenderContext() ->GetFloatOption( "System", "Clipping" ) [ 0 ] ;
-	TqFloat ClippingFar = getRenderContext() ->GetFloatOption( "System", "Clipping" ) [ 1 ] ;
+	TqFloat ClippingNear = getRenderContext() ->GetFloatOption( systemClippingKey ) [ 0 ] ;
+	TqFloat ClippingFar = getRenderContext() ->GetFloatOption( systemClippingKey ) [ 1 ] ;
 	TqFloat DeltaClipping = ClippingFar - ClippingNear;
 
 	do
@@ -379,7 +415,7 @@ void CqShaderExecEnv::SO_ambient( IqShaderData* Result, IqShader* pShader )
 	// Check if lighting is turned off.
 	if(getRenderContext())
 	{
-		const TqInt* enableLightingOpt = getRenderContext()->GetIntegerOption("EnableShaders", "lighting");
+		const TqInt* enableLightingOpt = getRenderContext()->GetIntegerOption( enableShadersLightingKey );
 		if(NULL != enableLightingOpt && enableLightingOpt[0] == 0)
 			return;
 	}
@@ -720,6 +756,23 @@ void CqShaderExecEnv::SO_trace( IqShaderData* P, IqShaderData* R, IqShaderData*
 	__fVarying=(R)->Class()==class_varying||__fVarying;
 	__fVarying=(Result)->Class()==class_varying||__fVarying;
 
+	IqRaytrace* pRaytracer = raytracer();
+
+	// Gather up the rays for all running points, so that they can be traced
+	// together as a batch.
+	std::vector<SqRay> rays;
+	std::vector<TqUint> rayPoints;
+	CqMatrix matToWorld, matVToWorld;
+	TqFloat bias = 0;
+	if(pRaytracer)
+	{
+		getRenderContext()->matSpaceToSpace("current", "world", pShader->getTransform(),
+				pTransform().get(), getRenderContext()->Time(), matToWorld);
+		getRenderContext()->matVSpaceToSpace("current", "world", pShader->getTransform(),
+				pTransform().get(), getRenderContext()->Time(), matVToWorld);
+		bias = rayBias();
+	}
+
 	__iGrid = 0;
 	const CqBitVector& RS = RunningState();
 	do
@@ -727,9 +780,38 @@ void CqShaderExecEnv::SO_trace( IqShaderData* P, IqShaderData* R, IqShaderData*
 		if(!__fVarying || RS.Value( __iGrid ) )
 		{
 			(Result)->SetColor(CqColor( 0, 0, 0 ),__iGrid);
+			if(pRaytracer)
+			{
+				CqVector3D _aq_P;
+				(P)->GetPoint(_aq_P,__iGrid);
+				CqVector3D _aq_R;
+				(R)->GetVector(_aq_R,__iGrid);
+				CqVector3D dir = matVToWorld * _aq_R;
+				if(dir.Magnitude2() > 0)
+				{
+					dir.Unit();
+					rays.push_back(SqRay(matToWorld * _aq_P, dir, bias));
+					rayPoints.push_back(__iGrid);
+				}
+			}
 		}
 	}
 	while( ( ++__iGrid < shadingPointCount() ) && __fVarying);
+
+	if(rays.empty())
+		return;
+
+	// There's no secondary shading yet, so the color seen along the ray is
+	// the unlit surface color of whatever it hits.
+	TqInt numRays = rays.size();
+	std::vector<SqRayHit> hits(numRays);
+	boost::scoped_array<bool> didHit(new bool[numRays]);
+	pRaytracer->IntersectBatch(&rays[0], &hits[0], didHit.get(), numRays);
+	for(TqInt i = 0; i < numRays; ++i)
+	{
+		if(didHit[i])
+			(Result)->SetColor(hits[i].Cs * hits[i].Os, rayPoints[i]);
+	}
 }
 
 
@@ -865,11 +947,37 @@ void CqShaderExecEnv::SO_illuminate( IqShaderData* P, IqShaderData* Axis, IqShad
 	if ( m_Illuminate > 0 )
 		res = false;
 
+	// An illuminate statement calls this once on entry, and once more when
+	// its body loops back, so even counts start a new statement.  Remember
+	// the cone of every statement when it's the same for every shading
+	// point, so that the light can be culled against grids it can't reach.
+	if ( m_Illuminate % 2 == 0 && m_illuminateConesKnown )
+	{
+		const CqBitVector& RS = RunningState();
+		m_illuminateConesKnown = P->Size() == 1
+			&& ( NULL == Axis || Axis->Size() == 1 )
+			&& ( NULL == Angle || Angle->Size() == 1 )
+			&& RS.Count() == RS.Size();
+		if ( m_illuminateConesKnown )
+		{
+			SqIlluminateCone cone;
+			P->GetPoint( cone.from, 0 );
+			cone.axis = CqVector3D( 0.0f, 1.0f, 0.0f );
+			if ( NULL != Axis )
+				Axis->GetVector( cone.axis, 0 );
+			cone.angle = M_PI;
+			if ( NULL != Angle )
+				Angle->GetFloat( cone.angle, 0 );
+			m_illuminateCones.push_back( cone );
+		}
+	}
+
 	__fVarying = true;
 	if ( res )
 	{
 		__iGrid = 0;
 		const CqBitVector& RS = RunningState();
+
 		do
 		{
 			if(!__fVarying || RS.Value( __iGrid ) )
@@ -929,6 +1037,9 @@ void CqShaderExecEnv::SO_solar( IqShaderData* Axis, IqShaderData* Angle, IqShade
 	if ( m_Illuminate > 0 )
 		res = false;
 
+	// Distant light isn't bounded by a cone from a point.
+	m_illuminateConesKnown = false;
+
 	__fVarying = true;
 	__iGrid = 0;
 	const CqBitVector& RS = RunningState();
@@ -966,21 +1077,165 @@ void CqShaderExecEnv::SO_gather( IqShaderData* category, IqShaderData* P, IqShad
 	bool __fVarying;
 	TqUint __iGrid;
 
+	IqRaytrace* pRaytracer = raytracer();
+
+	// Output variables requested with "ray:..." and "surface:..." parameters.
+	IqShaderData* rayOrigin = 0;
+	IqShaderData* rayDirection = 0;
+	IqShaderData* rayLength = 0;
+	IqShaderData* surfaceCs = 0;
+	IqShaderData* surfaceOs = 0;
+	IqShaderData* surfaceNg = 0;
+	for(int i = 0; i + 1 < cParams; i += 2)
+	{
+		CqString paramName;
+		apParams[i]->GetString(paramName, 0);
+		IqShaderData* paramValue = apParams[i+1];
+		if(paramName == "ray:origin")
+			rayOrigin = paramValue;
+		else if(paramName == "ray:direction")
+			rayDirection = paramValue;
+		else if(paramName == "ray:length")
+			rayLength = paramValue;
+		else if(paramName == "surface:Cs")
+			surfaceCs = paramValue;
+		else if(paramName == "surface:Os")
+			surfaceOs = paramValue;
+		else if(paramName == "surface:Ng")
+			surfaceNg = paramValue;
+	}
+
+	std::vector<SqRay> rays;
+	std::vector<TqUint> rayPoints;
+	std::vector<CqVector3D> rayDirs;
+	CqMatrix matToWorld, matVToWorld, matNToCurrent;
+	TqFloat bias = 0;
+	if(pRaytracer)
+	{
+		getRenderContext()->matSpaceToSpace("current", "world", pShader->getTransform(),
+				pTransform().get(), getRenderContext()->Time(), matToWorld);
+		getRenderContext()->matVSpaceToSpace("current", "world", pShader->getTransform(),
+				pTransform().get(), getRenderContext()->Time(), matVToWorld);
+		getRenderContext()->matNSpaceToSpace("world", "current", pShader->getTransform(),
+				pTransform().get(), getRenderContext()->Time(), matNToCurrent);
+		bias = rayBias();
+	}
+
 	__iGrid = 0;
 	__fVarying = true;
 	const CqBitVector& RS = RunningState();
 	do
 	{
-		if(!__fVarying || RS.Value( __iGrid ) )
+		m_CurrentState.SetValue( __iGrid, false );
+		if(pRaytracer && RS.Value( __iGrid ) )
 		{
-			m_CurrentState.SetValue( __iGrid, false );
+			CqVector3D _aq_P;
+			(P)->GetPoint(_aq_P,__iGrid);
+			CqVector3D _aq_N;
+			(N)->GetVector(_aq_N,__iGrid);
+			TqFloat _aq_angle;
+			(angle)->GetFloat(_aq_angle,__iGrid);
+			if(_aq_N.Magnitude2() > 0)
+			{
+				_aq_N.Unit();
+				// Pick a direction in the cone, in current space.
+				CqVector3D dir = sampleCone(_aq_N, std::cos(clamp<TqFloat>(_aq_angle, 0, M_PI)),
+						m_random.RandomFloat(), m_random.RandomFloat(), false);
+				CqVector3D dirWorld = matVToWorld * dir;
+				TqFloat lenWorld = dirWorld.Magnitude();
+				if(lenWorld > 0)
+				{
+					rays.push_back(SqRay(matToWorld * _aq_P, dirWorld/lenWorld, bias));
+					rayPoints.push_back(__iGrid);
+					rayDirs.push_back(dir);
+				}
+			}
 		}
-		else
-			m_CurrentState.SetValue( __iGrid, false );
 	}
 	while( ( ++__iGrid < shadingPointCount() ) && __fVarying);
+
+	if(rays.empty())
+		return;
+
+	TqInt numRays = rays.size();
+	std::vector<SqRayHit> hits(numRays);
+	boost::scoped_array<bool> didHit(new bool[numRays]);
+	pRaytracer->IntersectBatch(&rays[0], &hits[0], didHit.get(), numRays);
+	for(TqInt i = 0; i < numRays; ++i)
+	{
+		TqUint igrid = rayPoints[i];
+		m_CurrentState.SetValue(igrid, didHit[i]);
+		if(rayOrigin)
+		{
+			CqVector3D _aq_P;
+			(P)->GetPoint(_aq_P, igrid);
+			rayOrigin->SetPoint(_aq_P, igrid);
+		}
+		if(rayDirection)
+			rayDirection->SetVector(rayDirs[i], igrid);
+		if(!didHit[i])
+			continue;
+		if(rayLength)
+		{
+			// The hit distance is measured along the normalised world
+			// space direction; convert it back to current space.
+			rayLength->SetFloat(hits[i].t
+					/ (matVToWorld * rayDirs[i]).Magnitude(), igrid);
+		}
+		if(surfaceCs)
+			surfaceCs->SetColor(hits[i].Cs, igrid);
+		if(surfaceOs)
+			surfaceOs->SetColor(hits[i].Os, igrid);
+		if(surfaceNg)
+			surfaceNg->SetNormal(matNToCurrent * hits[i].Ng, igrid);
+	}
+}
+
+//----------------------------------------------------------------------
+// Raytracing helpers
+
+IqRaytrace* CqShaderExecEnv::raytracer() const
+{
+	if(!getRenderContext())
+		return 0;
+	IqRaytrace* pRaytracer = getRenderContext()->pRaytracer();
+	if(!pRaytracer || pRaytracer->IsEmpty())
+		return 0;
+	return pRaytracer;
+}
+
+TqFloat CqShaderExecEnv::rayBias() const
+{
+	// Offset along rays to avoid them hitting the surface they start from.
+	TqFloat bias = 0.01f;
+	if(m_pAttributes)
+	{
+		const TqFloat* traceBias = m_pAttributes->GetFloatAttribute( traceBiasKey );
+		if(traceBias)
+			bias = traceBias[0];
+	}
+	return bias;
 }
 
+CqVector3D CqShaderExecEnv::sampleCone(const CqVector3D& axis, TqFloat cosMax,
+		TqFloat r1, TqFloat r2, bool cosineWeighted)
+{
+	TqFloat cosTheta = cosineWeighted
+		? std::sqrt(1 - r1*(1 - cosMax*cosMax))
+		: 1 - r1*(1 - cosMax);
+	TqFloat sinTheta = std::sqrt(max(0.0f, 1 - cosTheta*cosTheta));
+	TqFloat phi = 2*M_PI*r2;
+	// Build an orthonormal basis around the axis.
+	CqVector3D u = std::fabs(axis.x()) > 0.5f ? CqVector3D(0, 1, 0)
+		: CqVector3D(1, 0, 0);
+	u = u % axis;
+	u.Unit();
+	CqVector3D v = axis % u;
+	return (std::cos(phi)*sinTheta)*u + (std::sin(phi)*sinTheta)*v
+		+ cosTheta*axis;
+}
+
+
 //----------------------------------------------------------------------
 // incident
 
@@ -1057,7 +1312,7 @@ void CqShaderExecEnv::SO_calculatenormal( IqShaderData* p, IqShaderData* Result,
 	bool CSO = pTransform()->GetHandedness(getRenderContext()->Time());
 	bool O = false;
 	if( pAttributes() )
-		O = pAttributes() ->GetIntegerAttribute( "System", "Orientation" ) [ 0 ] != 0;
+		O = pAttributes() ->GetIntegerAttribute( systemOrientationKey ) [ 0 ] != 0;
 	TqFloat neg = 1;
 	if ( !( (O && CSO) || (!O && !CSO) ) )
 		neg = -1;
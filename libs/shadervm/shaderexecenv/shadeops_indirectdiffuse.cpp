@@ -25,6 +25,10 @@
 
 #include	<string>
 #include	<stdio.h>
+#include	<cfloat>
+
+#include	<boost/scoped_array.hpp>
+#include	<boost/scoped_ptr.hpp>
 
 #include	<aqsis/math/math.h>
 #include	<aqsis/core/ilightsource.h>
@@ -89,7 +93,7 @@ void CqShaderExecEnv::pointCloudIntegrate(IqShaderData* P, IqShaderData* N,
 
 	// Extract options
 	CqString paramName;
-	const DiffusePointOctree* pointTree = 0;
+	const PagedPointOctree* pointTree = 0;
 	int faceRes = 10;
 	float maxSolidAngle = 0.03;
 	float coneAngle = M_PI_2;
@@ -171,15 +175,32 @@ void CqShaderExecEnv::pointCloudIntegrate(IqShaderData* P, IqShaderData* N,
 	if(pointTree)
 	{
 		int npoints = varying ? shadingPointCount() : 1;
+		// Neighbouring shading points are rasterized together, so that one
+		// traversal of the point hierarchy serves the whole batch.
+		const int batchSize = 8;
+		int nbatches = (npoints + batchSize - 1) / batchSize;
 #pragma omp parallel
 		{
 		// Compute occlusion for each point
-		IntegratorT integrator(faceRes);
+		boost::scoped_ptr<IntegratorT> integratorStore[batchSize];
+		IntegratorT* integrators[batchSize];
+		for(int i = 0; i < batchSize; ++i)
+		{
+			integratorStore[i].reset(new IntegratorT(faceRes));
+			integrators[i] = integratorStore[i].get();
+		}
+		V3f batchP[batchSize];
+		V3f batchN[batchSize];
+		int batchIndex[batchSize];
 #pragma omp for
-		for(int igrid = 0; igrid < npoints; ++igrid)
+		for(int ibatch = 0; ibatch < nbatches; ++ibatch)
 		{
-			if(!varying || RS.Value(igrid))
+			int nbatch = 0;
+			int batchEnd = std::min(npoints, (ibatch + 1)*batchSize);
+			for(int igrid = ibatch*batchSize; igrid < batchEnd; ++igrid)
 			{
+				if(varying && !RS.Value(igrid))
+					continue;
 				CqVector3D Pval;
 				// TODO: What about RiPoints?  They're not a 2D grid!
 				int v = igrid/uSize;
@@ -239,12 +260,17 @@ void CqShaderExecEnv::pointCloudIntegrate(IqShaderData* P, IqShaderData* N,
 				// absolute length scale.
 				if(bias != 0)
 					Pval2 += Nval2*bias;
-				integrator.clear();
-				microRasterize(integrator, Pval2, Nval2, coneAngle,
-							   maxSolidAngle, *pointTree);
-				storeIntegratedResult(integrator, Nval2, coneAngle, result,
-									  occlusionResult, igrid);
+				integrators[nbatch]->clear();
+				batchP[nbatch] = Pval2;
+				batchN[nbatch] = Nval2;
+				batchIndex[nbatch] = igrid;
+				++nbatch;
 			}
+			microRasterize(integrators, batchP, batchN, nbatch, coneAngle,
+						   maxSolidAngle, *pointTree);
+			for(int i = 0; i < nbatch; ++i)
+				storeIntegratedResult(*integrators[i], batchN[i], coneAngle,
+									  result, occlusionResult, batchIndex[i]);
 		}
 		}
 	}
@@ -276,8 +302,107 @@ static void storeIntegratedResult(const OcclusionIntegrator& integrator,
 // occlusion(P,N,samples)
 void CqShaderExecEnv::SO_occlusion_rt( IqShaderData* P, IqShaderData* N, IqShaderData* samples, IqShaderData* Result, IqShader* pShader, int cParams, IqShaderData** apParams )
 {
-	pointCloudIntegrate<OcclusionIntegrator>(P, N, Result, cParams, apParams,
-											 pShader);
+	// Use the point cloud when one is named, otherwise trace rays if there's
+	// any geometry to trace against.
+	bool havePointCloud = false;
+	CqString paramName;
+	for(int i = 0; i < cParams; i+=2)
+	{
+		apParams[i]->GetString(paramName, 0);
+		if(paramName == "filename")
+			havePointCloud = true;
+	}
+	if(!havePointCloud && raytracer())
+		raytraceOcclusion(P, N, samples, Result, cParams, apParams, pShader);
+	else
+		pointCloudIntegrate<OcclusionIntegrator>(P, N, Result, cParams,
+												 apParams, pShader);
+}
+
+
+void CqShaderExecEnv::raytraceOcclusion(IqShaderData* P, IqShaderData* N,
+										IqShaderData* samples,
+										IqShaderData* result, int cParams,
+										IqShaderData** apParams,
+										IqShader* pShader)
+{
+	// Extract options
+	CqString paramName;
+	float coneAngle = M_PI_2;
+	float maxDist = FLT_MAX;
+	float bias = rayBias();
+	for(int i = 0; i < cParams; i+=2)
+	{
+		apParams[i]->GetString(paramName, 0);
+		IqShaderData* paramValue = apParams[i+1];
+		if(paramValue->Type() != type_float)
+			continue;
+		if(paramName == "coneangle")
+			paramValue->GetFloat(coneAngle);
+		else if(paramName == "maxdist")
+			paramValue->GetFloat(maxDist);
+		else if(paramName == "bias")
+			paramValue->GetFloat(bias);
+	}
+	float cosMax = std::cos(clamp<float>(coneAngle, 0, M_PI_2));
+
+	CqMatrix matToWorld, matNToWorld;
+	getRenderContext()->matSpaceToSpace("current", "world", pShader->getTransform(),
+			pTransform().get(), getRenderContext()->Time(), matToWorld);
+	getRenderContext()->matNSpaceToSpace("current", "world", pShader->getTransform(),
+			pTransform().get(), getRenderContext()->Time(), matNToWorld);
+	IqRaytrace* pRaytracer = raytracer();
+
+	// All the rays from one shading point are traced together, stratified
+	// over the cone in a sqrt(n) x sqrt(n) grid.
+	std::vector<SqRay> rays;
+	boost::scoped_array<bool> occluded;
+
+	bool varying = result->Class() == class_varying;
+	const CqBitVector& RS = RunningState();
+	TqUint igrid = 0;
+	do
+	{
+		if(!varying || RS.Value(igrid))
+		{
+			CqVector3D Pval;
+			P->GetPoint(Pval, igrid);
+			CqVector3D Nval;
+			N->GetNormal(Nval, igrid);
+			TqFloat nsamples = 1;
+			samples->GetFloat(nsamples, igrid);
+			int strata = std::max(1, static_cast<int>(std::sqrt(nsamples)));
+			int numRays = strata*strata;
+
+			CqVector3D Pworld = matToWorld * Pval;
+			CqVector3D Nworld = matNToWorld * Nval;
+			float occlusion = 0;
+			if(Nworld.Magnitude2() > 0)
+			{
+				Nworld.Unit();
+				rays.resize(numRays);
+				occluded.reset(new bool[numRays]);
+				for(int j = 0; j < strata; ++j)
+				{
+					for(int i = 0; i < strata; ++i)
+					{
+						TqFloat r1 = (j + m_random.RandomFloat())/strata;
+						TqFloat r2 = (i + m_random.RandomFloat())/strata;
+						rays[j*strata + i] = SqRay(Pworld,
+							sampleCone(Nworld, cosMax, r1, r2, true),
+							bias, maxDist);
+					}
+				}
+				pRaytracer->OccludedBatch(&rays[0], occluded.get(), numRays);
+				int numOccluded = 0;
+				for(int k = 0; k < numRays; ++k)
+					numOccluded += occluded[k];
+				occlusion = static_cast<float>(numOccluded)/numRays;
+			}
+			result->SetFloat(occlusion, igrid);
+		}
+	}
+	while( ( ++igrid < shadingPointCount() ) && varying);
 }
 
 
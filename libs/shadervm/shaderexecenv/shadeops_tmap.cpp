@@ -31,6 +31,7 @@
 
 #include	<map>
 #include	<string>
+#include	<vector>
 #include	<cstdio>
 #include	<cstring>
 
@@ -42,6 +43,7 @@
 #include	<aqsis/tex/filtering/itexturesampler.h>
 #include	<aqsis/tex/io/texfileheader.h>
 #include	<aqsis/tex/buffers/channellist.h>
+#include	<aqsis/tex/buffers/tilecache.h>
 
 namespace Aqsis
 {
@@ -337,6 +339,57 @@ class CqShadowOptionExtractor
 };
 
 
+//------------------------------------------------------------------------------
+/** \brief Filter regions for a grid, gathered for the texture prefetcher.
+ *
+ * Each region is stored with the options it will be sampled with, including
+ * the varying ones, so that the prefetched tiles are the ones the filter
+ * will read.  Nothing is stored when prefetching is disabled.
+ */
+class CqPrefetchRegions
+{
+	public:
+		CqPrefetchRegions(TqInt maxRegions)
+			: m_enabled(CqTilePrefetcher::instance().enabled())
+		{
+			if(m_enabled)
+			{
+				m_regions.reserve(maxRegions);
+				m_opts.reserve(maxRegions);
+			}
+		}
+
+		/** \brief Add the filter region for a grid point.
+		 *
+		 * \param region - region to be filtered
+		 * \param optExtractor - extractor for the varying sample options
+		 * \param gridIdx - index of the grid point
+		 * \param uniformOpts - sample options with the uniform options set.
+		 */
+		void add(const SqSamplePllgram& region, CqSampleOptionExtractor& optExtractor,
+				TqInt gridIdx, const CqTextureSampleOptions& uniformOpts)
+		{
+			if(!m_enabled)
+				return;
+			m_regions.push_back(region);
+			m_opts.push_back(uniformOpts);
+			optExtractor.extractVarying(gridIdx, m_opts.back());
+		}
+
+		/// Start loading the texture tiles covered by the regions.
+		void prefetch(const IqTextureSampler& sampler) const
+		{
+			if(!m_regions.empty())
+				sampler.prefetch(&m_regions[0], &m_opts[0], m_regions.size());
+		}
+
+	private:
+		bool m_enabled;
+		std::vector<SqSamplePllgram> m_regions;
+		std::vector<CqTextureSampleOptions> m_opts;
+};
+
+
 //------------------------------------------------------------------------------
 /// Fill any shadow sampling options obtainable from the renderer context via RiOptions.
 void getRenderContextShadowOpts(const IqRenderer& context, CqShadowSampleOptions& sampleOpts)
@@ -386,12 +439,16 @@ void CqShaderExecEnv::SO_ftexture2(IqShaderData* name, IqShaderData* s, IqShader
 	CqSampleOptionExtractor optExtractor(apParams, cParams, sampleOpts);
 
 	const CqBitVector& RS = RunningState();
+	// Find the filter regions for the whole grid first, so that the texture
+	// tiles under them can be loaded while the grid is being sampled.
+	std::vector<SqSamplePllgram> regions;
+	regions.reserve(shadingPointCount());
+	CqPrefetchRegions prefetchRegions(shadingPointCount());
 	gridIdx = 0;
 	do
 	{
 		if(RS.Value(gridIdx))
 		{
-			optExtractor.extractVarying(gridIdx, sampleOpts);
 			// Edges of region to be filtered.
 			CqVector2D diffUst(diffU<TqFloat>(s, gridIdx), diffU<TqFloat>(t, gridIdx));
 			CqVector2D diffVst(diffV<TqFloat>(s, gridIdx), diffV<TqFloat>(t, gridIdx));
@@ -401,7 +458,21 @@ void CqShaderExecEnv::SO_ftexture2(IqShaderData* name, IqShaderData* s, IqShader
 			s->GetFloat(ss,gridIdx);
 			t->GetFloat(tt,gridIdx);
 			// Filter region
-			SqSamplePllgram region(CqVector2D(ss,tt), diffUst, diffVst);
+			regions.push_back(SqSamplePllgram(CqVector2D(ss,tt), diffUst, diffVst));
+			prefetchRegions.add(regions.back(), optExtractor, gridIdx, sampleOpts);
+		}
+	}
+	while( ++gridIdx < static_cast<TqInt>(shadingPointCount()) );
+	prefetchRegions.prefetch(texSampler);
+
+	gridIdx = 0;
+	TqInt regionIdx = 0;
+	do
+	{
+		if(RS.Value(gridIdx))
+		{
+			optExtractor.extractVarying(gridIdx, sampleOpts);
+			const SqSamplePllgram& region = regions[regionIdx++];
 			// length-1 "array" where filtered results will be placed.
 			TqFloat texSample = 0;
 			texSampler.sample(region, sampleOpts, &texSample);
@@ -438,12 +509,16 @@ void CqShaderExecEnv::SO_ftexture3( IqShaderData* name, IqShaderData* s1, IqShad
 	CqSampleOptionExtractor optExtractor(apParams, cParams, sampleOpts);
 
 	const CqBitVector& RS = RunningState();
+	// Find the filter regions for the whole grid first, so that the texture
+	// tiles under them can be loaded while the grid is being sampled.
+	std::vector<SqSampleQuad> quads;
+	quads.reserve(shadingPointCount());
+	CqPrefetchRegions prefetchRegions(shadingPointCount());
 	gridIdx = 0;
 	do
 	{
 		if(RS.Value(gridIdx))
 		{
-			optExtractor.extractVarying(gridIdx, sampleOpts);
 			// Compute the sample quadrilateral box.  Unfortunately we need all
 			// these temporaries because the shader data interface leaves a bit
 			// to be desired ;-)
@@ -455,9 +530,23 @@ void CqShaderExecEnv::SO_ftexture3( IqShaderData* name, IqShaderData* s1, IqShad
 			TqFloat t2Val = 0;  t2->GetFloat(t2Val, gridIdx);
 			TqFloat t3Val = 0;  t3->GetFloat(t3Val, gridIdx);
 			TqFloat t4Val = 0;  t4->GetFloat(t4Val, gridIdx);
-			SqSampleQuad sampleQuad(CqVector2D(s1Val, t1Val), CqVector2D(s2Val, t2Val),
-						CqVector2D(s3Val, t3Val), CqVector2D(s4Val, t4Val));
+			quads.push_back(SqSampleQuad(CqVector2D(s1Val, t1Val), CqVector2D(s2Val, t2Val),
+					CqVector2D(s3Val, t3Val), CqVector2D(s4Val, t4Val)));
+			prefetchRegions.add(SqSamplePllgram(quads.back()), optExtractor,
+					gridIdx, sampleOpts);
+		}
+	}
+	while( ++gridIdx < static_cast<TqInt>(shadingPointCount()) );
+	prefetchRegions.prefetch(texSampler);
 
+	gridIdx = 0;
+	TqInt quadIdx = 0;
+	do
+	{
+		if(RS.Value(gridIdx))
+		{
+			optExtractor.extractVarying(gridIdx, sampleOpts);
+			const SqSampleQuad& sampleQuad = quads[quadIdx++];
 			// length-1 "array" where filtered results will be placed.
 			TqFloat texSample = 0;
 			texSampler.sample(sampleQuad, sampleOpts, &texSample);
@@ -501,12 +590,16 @@ void CqShaderExecEnv::SO_ctexture2( IqShaderData* name, IqShaderData* s, IqShade
 	CqSampleOptionExtractor optExtractor(apParams, cParams, sampleOpts);
 
 	const CqBitVector& RS = RunningState();
+	// Find the filter regions for the whole grid first, so that the texture
+	// tiles under them can be loaded while the grid is being sampled.
+	std::vector<SqSamplePllgram> regions;
+	regions.reserve(shadingPointCount());
+	CqPrefetchRegions prefetchRegions(shadingPointCount());
 	gridIdx = 0;
 	do
 	{
 		if(RS.Value(gridIdx))
 		{
-			optExtractor.extractVarying(gridIdx, sampleOpts);
 			// Edges of region to be filtered.
 			CqVector2D diffUst(diffU<TqFloat>(s, gridIdx), diffU<TqFloat>(t, gridIdx));
 			CqVector2D diffVst(diffV<TqFloat>(s, gridIdx), diffV<TqFloat>(t, gridIdx));
@@ -516,7 +609,21 @@ void CqShaderExecEnv::SO_ctexture2( IqShaderData* name, IqShaderData* s, IqShade
 			s->GetFloat(ss,gridIdx);
 			t->GetFloat(tt,gridIdx);
 			// Filter region
-			SqSamplePllgram region(CqVector2D(ss,tt), diffUst, diffVst);
+			regions.push_back(SqSamplePllgram(CqVector2D(ss,tt), diffUst, diffVst));
+			prefetchRegions.add(regions.back(), optExtractor, gridIdx, sampleOpts);
+		}
+	}
+	while( ++gridIdx < static_cast<TqInt>(shadingPointCount()) );
+	prefetchRegions.prefetch(texSampler);
+
+	gridIdx = 0;
+	TqInt regionIdx = 0;
+	do
+	{
+		if(RS.Value(gridIdx))
+		{
+			optExtractor.extractVarying(gridIdx, sampleOpts);
+			const SqSamplePllgram& region = regions[regionIdx++];
 			// array where filtered results will be placed.
 			TqFloat texSample[3] = {0,0,0};
 			texSampler.sample(region, sampleOpts, texSample);
@@ -554,12 +661,16 @@ void CqShaderExecEnv::SO_ctexture3( IqShaderData* name, IqShaderData* s1, IqShad
 	CqSampleOptionExtractor optExtractor(apParams, cParams, sampleOpts);
 
 	const CqBitVector& RS = RunningState();
+	// Find the filter regions for the whole grid first, so that the texture
+	// tiles under them can be loaded while the grid is being sampled.
+	std::vector<SqSampleQuad> quads;
+	quads.reserve(shadingPointCount());
+	CqPrefetchRegions prefetchRegions(shadingPointCount());
 	gridIdx = 0;
 	do
 	{
 		if(RS.Value(gridIdx))
 		{
-			optExtractor.extractVarying(gridIdx, sampleOpts);
 			// Compute the sample quadrilateral box.  Unfortunately we need all
 			// these temporaries because the shader data interface leaves a bit
 			// to be desired ;-)
@@ -571,8 +682,23 @@ void CqShaderExecEnv::SO_ctexture3( IqShaderData* name, IqShaderData* s1, IqShad
 			TqFloat t2Val = 0;  t2->GetFloat(t2Val, gridIdx);
 			TqFloat t3Val = 0;  t3->GetFloat(t3Val, gridIdx);
 			TqFloat t4Val = 0;  t4->GetFloat(t4Val, gridIdx);
-			SqSampleQuad sampleQuad(CqVector2D(s1Val, t1Val), CqVector2D(s2Val, t2Val),
-					CqVector2D(s3Val, t3Val), CqVector2D(s4Val, t4Val));
+			quads.push_back(SqSampleQuad(CqVector2D(s1Val, t1Val), CqVector2D(s2Val, t2Val),
+					CqVector2D(s3Val, t3Val), CqVector2D(s4Val, t4Val)));
+			prefetchRegions.add(SqSamplePllgram(quads.back()), optExtractor,
+					gridIdx, sampleOpts);
+		}
+	}
+	while( ++gridIdx < static_cast<TqInt>(shadingPointCount()) );
+	prefetchRegions.prefetch(texSampler);
+
+	gridIdx = 0;
+	TqInt quadIdx = 0;
+	do
+	{
+		if(RS.Value(gridIdx))
+		{
+			optExtractor.extractVarying(gridIdx, sampleOpts);
+			const SqSampleQuad& sampleQuad = quads[quadIdx++];
 			// array where filtered results will be placed.
 			TqFloat texSample[3] = {0,0,0};
 			texSampler.sample(sampleQuad, sampleOpts, texSample);
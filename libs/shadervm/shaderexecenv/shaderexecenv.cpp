@@ -136,6 +136,9 @@ CqShaderExecEnv::CqShaderExecEnv(IqRenderer* pRenderContext)
 	m_li(0),
 	m_Illuminate(0),
 	m_IlluminanceCacheValid(false),
+	m_culledLights(),
+	m_illuminateConesKnown(true),
+	m_illuminateCones(),
 	m_gatherSample(0),
 	m_pAttributes(),
 	m_pTransform(),
@@ -189,6 +192,9 @@ void CqShaderExecEnv::Initialise( const TqInt uGridRes, const TqInt vGridRes,
 	m_li = 0;
 	m_Illuminate = 0;
 	m_IlluminanceCacheValid = false;
+	m_culledLights.clear();
+	m_illuminateConesKnown = true;
+	m_illuminateCones.clear();
 
 	// Initialise the state bitvectors
 	m_CurrentState.SetSize( m_shadingPointCount );
@@ -45,6 +45,7 @@
 #include	<aqsis/shadervm/ishaderexecenv.h>
 #include	<aqsis/core/isurface.h>
 #include	<aqsis/core/irenderer.h>
+#include	<aqsis/core/iraytrace.h>
 #include	<aqsis/math/matrix.h>
 #include	<aqsis/math/derivatives.h>
 
@@ -116,6 +117,13 @@ class AQSIS_SHADERVM_SHARE CqShaderExecEnv : public IqShaderExecEnv, boost::nonc
 		{
 			m_IlluminanceCacheValid = false;
 		}
+		virtual	bool	illuminateCones( std::vector<SqIlluminateCone>& cones ) const
+		{
+			if ( !m_illuminateConesKnown || m_illuminateCones.empty() )
+				return ( false );
+			cones = m_illuminateCones;
+			return ( true );
+		}
 		virtual	CqBitVector& CurrentState()
 		{
 			return ( m_CurrentState );
@@ -383,6 +391,38 @@ class AQSIS_SHADERVM_SHARE CqShaderExecEnv : public IqShaderExecEnv, boost::nonc
 								 IqShaderData* result, int cParams,
 								 IqShaderData** apParams, IqShader* pShader);
 
+		/// Helper function for SO_occlusion_rt.
+		///
+		/// Computes ambient occlusion by tracing rays against the
+		/// raytracing database, storing the occluded fraction in result.
+		void raytraceOcclusion(IqShaderData* P, IqShaderData* N,
+							   IqShaderData* samples, IqShaderData* result,
+							   int cParams, IqShaderData** apParams,
+							   IqShader* pShader);
+
+		/// Get the raytracer, or NULL if there's nothing to trace against.
+		IqRaytrace* raytracer() const;
+		/// Distance to offset ray origins, from the "trace" "bias" attribute.
+		TqFloat rayBias() const;
+		/// Whether a light was skipped by the last ValidateIlluminanceCache().
+		bool isCulled(TqUint lightIndex) const
+		{
+			return lightIndex < m_culledLights.size() && m_culledLights[lightIndex];
+		}
+
+		/** Pick a direction inside a cone.
+		 *
+		 * \param axis - unit vector along the cone axis.
+		 * \param cosMax - cosine of the cone half angle.
+		 * \param r1,r2 - uniform random numbers in [0,1).
+		 * \param cosineWeighted - if true, directions are distributed
+		 *                         according to their cosine with the axis,
+		 *                         otherwise uniformly over solid angle.
+		 */
+		static CqVector3D sampleCone(const CqVector3D& axis, TqFloat cosMax,
+									 TqFloat r1, TqFloat r2,
+									 bool cosineWeighted);
+
 		/// Turn 1D iteration into 2D grid indices
 		///
 		/// u is the fast changing index; v is slow changing.
@@ -431,6 +471,9 @@ class AQSIS_SHADERVM_SHARE CqShaderExecEnv : public IqShaderExecEnv, boost::nonc
 		TqUint	m_li;					///< Light index, used during illuminance loop.
 		TqInt	m_Illuminate;
 		bool	m_IlluminanceCacheValid;	///< Flag indicating whether the illuminance cache is valid.
+		std::vector<bool>	m_culledLights;	///< Lights skipped for the current grid by ValidateIlluminanceCache().
+		bool	m_illuminateConesKnown;	///< Whether every illuminate() so far had a uniform cone.
+		std::vector<SqIlluminateCone>	m_illuminateCones;	///< Cones of the illuminate() statements run so far.
 		TqUint	m_gatherSample;				///< Sample index, used during gather loop.
 		IqConstAttributesPtr m_pAttributes;	///< Pointer to the associated attributes.
 		IqConstTransformPtr m_pTransform;		///< Pointer to the associated transform.
@@ -0,0 +1,269 @@
+// Aqsis
+// Copyright (C) 1997 - 2001, Paul C. Gregory
+//
+// Contact: pgregory@aqsis.org
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation; either
+// version 2 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+/** \file
+		\brief Batched kernels for float shader VM operations across a grid.
+
+		The generic opcode templates in shaderstack.h test the running state
+		bit for every shading point before touching the data.  The kernels
+		here instead work on the contiguous value arrays of the shader
+		variables in fixed size chunks of eight shading points, which is one
+		byte of the running state bitvector.  Each byte becomes a lane mask:
+		chunks with no running points are skipped, fully running chunks are
+		stored directly and partially running chunks are blended lane by lane.
+		The chunk loops have a fixed trip count and no branches on the data,
+		so the compiler can turn them into SSE/AVX code.
+*/
+
+#ifndef SHADERSIMD_H_INCLUDED
+#define SHADERSIMD_H_INCLUDED 1
+
+#include	<aqsis/aqsis.h>
+
+#include	<aqsis/math/color.h>
+#include	<aqsis/math/vector3d.h>
+#include	<aqsis/shadervm/ishaderdata.h>
+#include	<aqsis/util/bitvector.h>
+
+namespace Aqsis {
+
+namespace simd {
+
+/// Number of shading points processed together: one byte of running state.
+const TqInt chunkSize = CHAR_BIT;
+
+//----------------------------------------------------------------------
+// Operations on single float lanes.  Comparisons and logical operations
+// produce 1 or 0, as the generic templates do.
+
+struct SqAdd { static TqFloat apply(TqFloat a, TqFloat b) { return a + b; } };
+struct SqSub { static TqFloat apply(TqFloat a, TqFloat b) { return a - b; } };
+struct SqMul { static TqFloat apply(TqFloat a, TqFloat b) { return a * b; } };
+struct SqDiv { static TqFloat apply(TqFloat a, TqFloat b) { return a / b; } };
+struct SqLss { static TqFloat apply(TqFloat a, TqFloat b) { return a < b; } };
+struct SqGrt { static TqFloat apply(TqFloat a, TqFloat b) { return a > b; } };
+struct SqLe  { static TqFloat apply(TqFloat a, TqFloat b) { return a <= b; } };
+struct SqGe  { static TqFloat apply(TqFloat a, TqFloat b) { return a >= b; } };
+struct SqEq  { static TqFloat apply(TqFloat a, TqFloat b) { return a == b; } };
+struct SqNe  { static TqFloat apply(TqFloat a, TqFloat b) { return a != b; } };
+struct SqLand { static TqFloat apply(TqFloat a, TqFloat b) { return a != 0 && b != 0; } };
+struct SqLor  { static TqFloat apply(TqFloat a, TqFloat b) { return a != 0 || b != 0; } };
+/// Unary negation of the second operand.
+struct SqNeg { static TqFloat apply(TqFloat, TqFloat b) { return -b; } };
+
+//----------------------------------------------------------------------
+/** \brief Store one chunk of results under a running state mask.
+ *
+ * \param res - results computed for all lanes of the chunk.
+ * \param r - destination of the chunk.
+ * \param mask - running state byte for the chunk.
+ */
+inline void storeChunk(const TqFloat* res, TqFloat* r, bit mask)
+{
+	if(mask == 0xFF)
+	{
+		for(TqInt j = 0; j < chunkSize; ++j)
+			r[j] = res[j];
+	}
+	else
+	{
+		for(TqInt j = 0; j < chunkSize; ++j)
+			r[j] = ((mask >> j) & 1) ? res[j] : r[j];
+	}
+}
+
+//----------------------------------------------------------------------
+/** \brief Apply a binary float operation across a grid.
+ *
+ * Uniform operands are passed as a pointer to their single value.  The
+ * results for a whole chunk are computed before any are stored, so r may
+ * alias either of the operands.
+ *
+ * \param a, b - operand arrays.
+ * \param r - result array of length n.
+ * \param n - number of shading points.
+ * \param runningState - only points with their bit set are written.
+ */
+template<typename OpT, bool aVarying, bool bVarying>
+inline void binaryOp(const TqFloat* a, const TqFloat* b, TqFloat* r, TqInt n,
+		const CqBitVector& runningState)
+{
+	const bit* state = runningState.IntArray();
+	const TqInt numChunks = n / chunkSize;
+	for(TqInt c = 0; c < numChunks; ++c)
+	{
+		const bit mask = state[c];
+		if(!mask)
+			continue;
+		const TqInt base = c*chunkSize;
+		const TqFloat* ca = aVarying ? a + base : a;
+		const TqFloat* cb = bVarying ? b + base : b;
+		TqFloat res[chunkSize];
+		for(TqInt j = 0; j < chunkSize; ++j)
+			res[j] = OpT::apply(ca[aVarying ? j : 0], cb[bVarying ? j : 0]);
+		storeChunk(res, r + base, mask);
+	}
+	for(TqInt i = numChunks*chunkSize; i < n; ++i)
+	{
+		if(runningState.Value(i))
+			r[i] = OpT::apply(a[aVarying ? i : 0], b[bVarying ? i : 0]);
+	}
+}
+
+/** \brief Apply a binary float operation to shader variables.
+ *
+ * This has the same semantics as the generic opcode templates in
+ * shaderstack.h for three float variables.
+ */
+template<typename OpT>
+inline void binaryOp(IqShaderData* pA, IqShaderData* pB, IqShaderData* pRes,
+		const CqBitVector& runningState)
+{
+	const bool fAVar = pA->Size() > 1;
+	const bool fBVar = pB->Size() > 1;
+	const TqFloat* pdA = 0;
+	const TqFloat* pdB = 0;
+	TqFloat* pdR = 0;
+	const IqShaderData* pcA = pA;
+	const IqShaderData* pcB = pB;
+	pcA->GetValuePtr(pdA);
+	pcB->GetValuePtr(pdB);
+	if(fAVar && fBVar)
+	{
+		pRes->GetValuePtr(pdR);
+		binaryOp<OpT, true, true>(pdA, pdB, pdR, pA->Size(), runningState);
+	}
+	else if(fAVar)
+	{
+		pRes->GetValuePtr(pdR);
+		binaryOp<OpT, true, false>(pdA, pdB, pdR, pA->Size(), runningState);
+	}
+	else if(fBVar)
+	{
+		pRes->GetValuePtr(pdR);
+		binaryOp<OpT, false, true>(pdA, pdB, pdR, pB->Size(), runningState);
+	}
+	else
+	{
+		pRes->SetValue(OpT::apply(*pdA, *pdB));
+	}
+}
+
+/** \brief Negate a float shader variable across a grid.
+ */
+inline void negate(IqShaderData* pA, IqShaderData* pRes,
+		const CqBitVector& runningState)
+{
+	const IqShaderData* pcA = pA;
+	const TqFloat* pdA = 0;
+	pcA->GetValuePtr(pdA);
+	if(pA->Size() > 1)
+	{
+		TqFloat* pdR = 0;
+		pRes->GetValuePtr(pdR);
+		binaryOp<SqNeg, false, true>(pdA, pdA, pdR, pA->Size(), runningState);
+	}
+	else
+	{
+		pRes->SetValue(-(*pdA));
+	}
+}
+
+//----------------------------------------------------------------------
+/** \brief Select between two arrays of values using a float condition.
+ *
+ * Merges are evaluated for every shading point regardless of the running
+ * state.  Uniform values are given a stride of zero.
+ */
+template<typename T>
+inline void select(const TqFloat* cond, const T* t, TqInt tStride,
+		const T* f, TqInt fStride, T* r, TqInt n)
+{
+	for(TqInt i = 0; i < n; ++i)
+		r[i] = cond[i] != 0 ? t[i*tStride] : f[i*fStride];
+}
+
+/// Float specialisation, written so that the select becomes a blend.
+inline void select(const TqFloat* cond, const TqFloat* t, TqInt tStride,
+		const TqFloat* f, TqInt fStride, TqFloat* r, TqInt n)
+{
+	if(tStride && fStride)
+	{
+		for(TqInt i = 0; i < n; ++i)
+			r[i] = cond[i] != 0 ? t[i] : f[i];
+	}
+	else
+	{
+		for(TqInt i = 0; i < n; ++i)
+			r[i] = cond[i] != 0 ? t[i*tStride] : f[i*fStride];
+	}
+}
+
+/** \brief Merge two shader variables using a varying float condition.
+ *
+ * \param typeMatches - predicate on the variable types which holds when
+ *                      values can be accessed directly as arrays of T.
+ * \return false if the variables are not stored in a form the batched
+ *         merge understands, in which case nothing is written.
+ */
+template<typename T>
+inline bool merge(IqShaderData* pCond, IqShaderData* pT, IqShaderData* pF,
+		IqShaderData* pRes, TqInt n, bool (*typeMatches)(EqVariableType))
+{
+	if(pCond->Type() != type_float || pCond->Size() != static_cast<TqUint>(n)
+		|| pRes->Size() != static_cast<TqUint>(n)
+		|| !typeMatches(pT->Type()) || !typeMatches(pF->Type())
+		|| !typeMatches(pRes->Type()))
+		return false;
+	const IqShaderData* pcCond = pCond;
+	const IqShaderData* pcT = pT;
+	const IqShaderData* pcF = pF;
+	const TqFloat* cond = 0;
+	const T* t = 0;
+	const T* f = 0;
+	T* r = 0;
+	pcCond->GetValuePtr(cond);
+	pcT->GetValuePtr(t);
+	pcF->GetValuePtr(f);
+	pRes->GetValuePtr(r);
+	select(cond, t, pT->Size() > 1 ? 1 : 0, f, pF->Size() > 1 ? 1 : 0, r, n);
+	return true;
+}
+
+inline bool isFloatType(EqVariableType type)
+{
+	return type == type_float;
+}
+
+inline bool isVectorType(EqVariableType type)
+{
+	return type == type_point || type == type_normal || type == type_vector;
+}
+
+inline bool isColorType(EqVariableType type)
+{
+	return type == type_color;
+}
+
+} // namespace simd
+
+} // namespace Aqsis
+
+#endif // SHADERSIMD_H_INCLUDED
@@ -41,6 +41,7 @@
 #include	<aqsis/shadervm/ishaderdata.h>
 #include	<aqsis/util/bitvector.h>
 #include	"shadervariable.h"
+#include	"shadersimd.h"
 #include	"shadervm_common.h"
 #include	<aqsis/math/vectorcast.h>
 
@@ -562,6 +563,28 @@ OpABRS( && , LAND )
  */
 OpABRS( || , LOR )
 
+// Float versions of the operators above.  Overload resolution prefers these
+// to the templates when all three types are floats, so the _FF and _B macros
+// run the batched kernels from shadersimd.h.
+#define OpABRS_FLOAT(KERNEL, NAME) \
+		inline void	Op##NAME( TqFloat& a, TqFloat& b, TqFloat& r, IqShaderData* pA, IqShaderData* pB, IqShaderData* pRes, const CqBitVector& RunningState ) \
+		{ \
+			simd::binaryOp<simd::KERNEL>( pA, pB, pRes, RunningState ); \
+		}
+
+OpABRS_FLOAT( SqLss, LSS )
+OpABRS_FLOAT( SqGrt, GRT )
+OpABRS_FLOAT( SqLe, LE )
+OpABRS_FLOAT( SqGe, GE )
+OpABRS_FLOAT( SqEq, EQ )
+OpABRS_FLOAT( SqNe, NE )
+OpABRS_FLOAT( SqMul, MUL )
+OpABRS_FLOAT( SqDiv, DIV )
+OpABRS_FLOAT( SqAdd, ADD )
+OpABRS_FLOAT( SqSub, SUB )
+OpABRS_FLOAT( SqLand, LAND )
+OpABRS_FLOAT( SqLor, LOR )
+
 /* Templatised negation operator. The template classes decide the cast used, there must be an appropriate operator between the two types.
  * \param a The type of the first operand, used to determine templateisation, needed by VC++..
  * \param pA The shader data to use as the second operand.
@@ -598,6 +621,14 @@ inline void	OpNEG( A& a, IqShaderData* pA, IqShaderData* pRes,
 	}
 }
 
+/* Float negation, using the batched kernels from shadersimd.h.
+ */
+inline void	OpNEG( TqFloat& a, IqShaderData* pA, IqShaderData* pRes,
+		const CqBitVector& RunningState )
+{
+	simd::negate( pA, pRes, RunningState );
+}
+
 namespace detail {
 
 template<typename T1, typename T2>
@@ -26,13 +26,22 @@
 #include "shadervm.h"
 
 #include <cstring>
+#include <ctime>
 #include <ctype.h>
 #include <iostream>
+#include <map>
 #include <sstream>
 #include <stddef.h>
 
+#include <boost/filesystem/fstream.hpp>
+#include <boost/filesystem/operations.hpp>
+#ifdef ENABLE_THREADING
+#include <boost/thread/mutex.hpp>
+#endif
+
 #include <aqsis/core/isurface.h>
 #include <aqsis/slcomp/icodegen.h>
+#include <aqsis/util/file.h>
 #include <aqsis/util/logging.h>
 #include "shadervariable.h"
 #include <aqsis/util/sstring.h>
@@ -59,6 +68,91 @@ boost::shared_ptr<IqShader> createShaderVM(IqRenderer* renderContext,
 	return shader;
 }
 
+namespace {
+
+/// Loaded program image along with the size and modification time of its file.
+struct SqCachedProgram
+{
+	boost::uintmax_t fileSize;
+	std::time_t modTime;
+	boost::shared_ptr<SqProgramImage> image;
+};
+
+/// Cache of program images keyed on (shader path, DSO search path).
+typedef std::map<std::pair<std::string, std::string>, SqCachedProgram>
+	TqProgramCache;
+
+/** Get the process-wide program cache.
+ *
+ * Procedurals and shader plugins may load shaders from any thread, so all
+ * access must hold programCacheMutex.
+ */
+TqProgramCache& programCache()
+{
+	static TqProgramCache cache;
+	return cache;
+}
+
+#ifdef ENABLE_THREADING
+boost::mutex programCacheMutex;
+#endif
+
+} // unnamed namespace
+
+boost::shared_ptr<IqShader> createShaderVM(IqRenderer* renderContext,
+                                           const boost::filesystem::path& programPath,
+                                           const std::string& dsoPath)
+{
+	boost::filesystem::ifstream programFile(programPath);
+	if(!programFile)
+	{
+		AQSIS_THROW_XQERROR(XqBadShader, EqE_NoShader,
+			"Could not open compiled shader \"" << native(programPath) << "\"");
+	}
+	// The modification time alone has a granularity of a second on many
+	// filesystems, so a shader recompiled straight after a render could be
+	// missed; comparing the size as well catches most of those.
+	boost::uintmax_t fileSize = boost::filesystem::file_size(programPath);
+	std::time_t modTime = boost::filesystem::last_write_time(programPath);
+	boost::shared_ptr<CqShaderVM> shader(new CqShaderVM(renderContext));
+	TqProgramCache::key_type key(native(programPath), dsoPath);
+	boost::shared_ptr<SqProgramImage> image;
+	{
+#ifdef ENABLE_THREADING
+		boost::mutex::scoped_lock lock(programCacheMutex);
+#endif
+		TqProgramCache::iterator cached = programCache().find(key);
+		if(cached != programCache().end() && cached->second.fileSize == fileSize
+				&& cached->second.modTime == modTime)
+			image = cached->second.image;
+	}
+	if(image)
+	{
+		shader->InstantiateProgram(image);
+		return shader;
+	}
+	if(!dsoPath.empty())
+		shader->SetDSOPath(dsoPath.c_str());
+	shader->LoadProgram(&programFile);
+	// The lock isn't held while loading; if two threads load the same shader
+	// at once the last one to finish wins, which is harmless.
+#ifdef ENABLE_THREADING
+	boost::mutex::scoped_lock lock(programCacheMutex);
+#endif
+	// DSO shadeop descriptors are owned by the shader which resolved them,
+	// so only programs without external calls can outlive their loader.
+	if(!shader->m_programImage->m_fExternals)
+	{
+		SqCachedProgram& entry = programCache()[key];
+		entry.fileSize = fileSize;
+		entry.modTime = modTime;
+		entry.image = shader->m_programImage;
+	}
+	else
+		programCache().erase(key);
+	return shader;
+}
+
 void shutdownShaderVM()
 {
 	CqShaderVM::ShutdownShaderEngine();
@@ -503,9 +597,7 @@ CqShaderVM::CqShaderVM(IqRenderer* pRenderContext)
 	m_LocalVars(),
 	m_InstancedParams(),
 	m_StoredArguments(),
-	m_ProgramInit(),
-	m_Program(),
-	m_ProgramStrings(),
+	m_programImage(),
 	m_uGridRes(0),
 	m_vGridRes(0),
 	m_shadingPointCount(0),
@@ -536,9 +628,7 @@ CqShaderVM::CqShaderVM(const CqShaderVM& From)
 	m_pTransform(),
 	m_LocalVars(),
 	m_StoredArguments(),
-	m_ProgramInit(),
-	m_Program(),
-	m_ProgramStrings(),
+	m_programImage(),
 	m_uGridRes(0),
 	m_vGridRes(0),
 	m_shadingPointCount(0),
@@ -574,12 +664,6 @@ CqShaderVM::~CqShaderVM()
 	{
 		delete *i;
 	}
-	// Delete strings used by the program
-	for ( std::list<CqString*>::iterator i = m_ProgramStrings.begin();
-			i != m_ProgramStrings.end(); i++ )
-	{
-		delete *i;
-	}
 	// Delete stored shader arguments
 	for(std::vector<SqArgumentRecord>::iterator i = m_StoredArguments.begin();
 			i != m_StoredArguments.end(); ++i)
@@ -932,6 +1016,9 @@ void CqShaderVM::LoadProgram( std::istream* pFile )
 	TqInt	array_count = 0;
 	TqUlong  htoken, i;
 
+	m_programImage.reset(new SqProgramImage());
+	std::vector<UsProgramElement>& program = m_programImage->m_Program;
+
 	bool fShaderSpec = false;
 	while ( !pFile->eof() )
 	{
@@ -1011,13 +1098,13 @@ void CqShaderVM::LoadProgram( std::istream* pFile )
 			else if ( ihash == htoken) // == "Init"
 			{
 				Segment = Seg_Init;
-				pProgramArea = &m_ProgramInit;
+				pProgramArea = &m_programImage->m_ProgramInit;
 				aLabels.clear();
 			}
 			else if (chash == htoken ) // == "Code"
 			{
 				Segment = Seg_Code;
-				pProgramArea = &m_Program;
+				pProgramArea = &program;
 				aLabels.clear();
 			}
 		}
@@ -1073,6 +1160,16 @@ void CqShaderVM::LoadProgram( std::istream* pFile )
 					        VarClass == class_invalid )
 						continue;
 
+					{
+						SqProgramImage::SqVariableDesc desc;
+						desc.m_Type = VarType;
+						desc.m_Class = VarClass;
+						desc.m_strName = token;
+						desc.m_fArray = fVarArray;
+						desc.m_ArrayCount = array_count;
+						desc.m_Storage = varStorage;
+						m_programImage->m_Variables.push_back( desc );
+					}
 					if ( fVarArray )
 						AddLocalVariable( CreateVariableArray( VarType, VarClass, token, array_count, varStorage ) );
 					else
@@ -1232,6 +1329,7 @@ void CqShaderVM::LoadProgram( std::istream* pFile )
 
 							AddCommand( &CqShaderVM::SO_external, pProgramArea );
 							AddDSOExternalCall( (*candidate),pProgramArea );
+							m_programImage->m_fExternals = true;
 
 							break;
 						}
@@ -1317,9 +1415,9 @@ void CqShaderVM::LoadProgram( std::istream* pFile )
 	}
 	// Now we need to complete any label jump statements.
 	i = 0;
-	while ( i < m_Program.size() )
+	while ( i < program.size() )
 	{
-		UsProgramElement E = m_Program[ i++ ]
+		UsProgramElement E = program[ i++ ]
 		                     ;
 		if ( E.m_Command == &CqShaderVM::SO_jnz ||
 		        E.m_Command == &CqShaderVM::SO_jmp ||
@@ -1328,9 +1426,9 @@ void CqShaderVM::LoadProgram( std::istream* pFile )
 		        E.m_Command == &CqShaderVM::SO_S_JZ)
 		{
 			SqLabel lab;
-			lab.m_Offset = aLabels[ static_cast<unsigned int>( m_Program[ i ].m_FloatVal ) ];
-			lab.m_pAddress = &m_Program[ lab.m_Offset ];
-			m_Program[ i ].m_Label = lab;
+			lab.m_Offset = aLabels[ static_cast<unsigned int>( program[ i ].m_FloatVal ) ];
+			lab.m_pAddress = &program[ lab.m_Offset ];
+			program[ i ].m_Label = lab;
 			i++;
 		}
 		else
@@ -1347,6 +1445,33 @@ void CqShaderVM::LoadProgram( std::istream* pFile )
 			}
 		}
 	}
+
+	m_programImage->m_Type = m_Type;
+	m_programImage->m_Uses = m_Uses;
+	m_programImage->m_fAmbient = m_fAmbient;
+}
+
+
+//---------------------------------------------------------------------
+/** Set up the shader from a program image loaded by another instance.
+*/
+
+void CqShaderVM::InstantiateProgram( const boost::shared_ptr<SqProgramImage>& image )
+{
+	m_Type = image->m_Type;
+	m_Uses = image->m_Uses;
+	m_fAmbient = image->m_fAmbient;
+	for ( std::vector<SqProgramImage::SqVariableDesc>::const_iterator
+			desc = image->m_Variables.begin(); desc != image->m_Variables.end(); ++desc )
+	{
+		if ( desc->m_fArray )
+			AddLocalVariable( CreateVariableArray( desc->m_Type, desc->m_Class,
+						desc->m_strName, desc->m_ArrayCount, desc->m_Storage ) );
+		else
+			AddLocalVariable( CreateVariable( desc->m_Type, desc->m_Class,
+						desc->m_strName, desc->m_Storage ) );
+	}
+	m_programImage = image;
 }
 
 CqString CqShaderVM::GetString(std::istream* pFile)
@@ -1519,11 +1644,8 @@ CqShaderVM&	CqShaderVM::operator=( const CqShaderVM& From )
 	for ( i = From.m_LocalVars.begin(); i != From.m_LocalVars.end(); i++ )
 		m_LocalVars.push_back( ( *i ) ->Clone() );
 
-	// Copy the intialisation program.
-	m_ProgramInit.assign(From.m_ProgramInit.begin(), From.m_ProgramInit.end());
-
-	// Copy the main program.
-	m_Program.assign(From.m_Program.begin(), From.m_Program.end());
+	// Share the program; it's never modified after loading.
+	m_programImage = From.m_programImage;
 
 	return ( *this );
 }
@@ -1536,7 +1658,7 @@ CqShaderVM&	CqShaderVM::operator=( const CqShaderVM& From )
 void CqShaderVM::Execute(IqShaderExecEnv* pEnv)
 {
 	// Check if there is anything to execute.
-	if ( m_Program.size() <= 0 )
+	if ( !m_programImage || m_programImage->m_Program.empty() )
 		return ;
 
 	m_pEnv = pEnv;
@@ -1544,9 +1666,9 @@ void CqShaderVM::Execute(IqShaderExecEnv* pEnv)
 	pEnv->InvalidateIlluminanceCache();
 
 	// Execute the main program.
-	m_PC = &m_Program[ 0 ];
+	m_PC = &m_programImage->m_Program[ 0 ];
 	m_PO = 0;
-	m_PE = m_Program.size();
+	m_PE = m_programImage->m_Program.size();
 	UsProgramElement* pE;
 
 	while ( !fDone() )
@@ -1567,7 +1689,7 @@ void CqShaderVM::Execute(IqShaderExecEnv* pEnv)
 void CqShaderVM::ExecuteInit()
 {
 	// Check if there is anything to execute.
-	if ( m_ProgramInit.size() <= 0 )
+	if ( !m_programImage || m_programImage->m_ProgramInit.empty() )
 		return ;
 
 	// Fake an environment
@@ -1578,9 +1700,9 @@ void CqShaderVM::ExecuteInit()
 	Initialise( 1, 1, 1, &Env );
 
 	// Execute the init program.
-	m_PC = &m_ProgramInit[ 0 ];
+	m_PC = &m_programImage->m_ProgramInit[ 0 ];
 	m_PO = 0;
-	m_PE = m_ProgramInit.size();
+	m_PE = m_programImage->m_ProgramInit.size();
 	UsProgramElement* pE;
 
 	while ( !fDone() )
@@ -29,6 +29,7 @@
 
 #include	<vector>
 #include	<list>
+#include	<boost/noncopyable.hpp>
 #include	<boost/shared_ptr.hpp>
 
 #include	<aqsis/aqsis.h>
@@ -105,6 +106,54 @@ union UsProgramElement
 	SqDSOExternalCall *m_pExtCall	;		///< Call a DSO function
 };
 
+
+//----------------------------------------------------------------------
+/** \struct SqProgramImage
+ * The loaded form of a compiled shader program.
+ *
+ * Holds everything LoadProgram() derives from an slx file which doesn't
+ * depend on a particular instance: the resolved bytecodes of both program
+ * segments, the string constants they refer to and descriptors for the local
+ * variables.  The image is immutable once loaded, so all instances of a
+ * shader share one copy, and label addresses within it stay valid.
+ */
+
+struct SqProgramImage : boost::noncopyable
+{
+	/// Descriptor from which a local variable can be recreated.
+	struct SqVariableDesc
+	{
+		EqVariableType	m_Type;
+		EqVariableClass	m_Class;
+		CqString	m_strName;
+		bool	m_fArray;
+		TqInt	m_ArrayCount;
+		IqShaderData::EqStorage	m_Storage;
+	};
+
+	SqProgramImage()
+		: m_Type(Type_Surface),
+		m_Uses(0xFFFFFFFF),
+		m_fAmbient(true),
+		m_fExternals(false)
+	{}
+	~SqProgramImage()
+	{
+		for ( std::list<CqString*>::iterator i = m_ProgramStrings.begin();
+				i != m_ProgramStrings.end(); i++ )
+			delete *i;
+	}
+
+	EqShaderType	m_Type;		///< Type of the shader.
+	TqInt	m_Uses;			///< Bit vector of the system variables used.
+	bool	m_fAmbient;		///< Flag indicating an ambient light source.
+	bool	m_fExternals;		///< Flag indicating the program calls DSO shadeops.
+	std::vector<SqVariableDesc>	m_Variables;		///< Local variable descriptors, in index order.
+	std::vector<UsProgramElement>	m_ProgramInit;		///< Bytecodes of the intialisation program.
+	std::vector<UsProgramElement>	m_Program;			///< Bytecodes of the main program.
+	std::list<CqString*>			m_ProgramStrings;	///< Strings used by the program, which are stored additionally as UsProgramElements.
+};
+
 //----------------------------------------------------------------------
 /** \class CqShaderVM
  * Main class handling the execution of a program in shader language bytecodes.
@@ -212,6 +261,13 @@ class AQSIS_SHADERVM_SHARE CqShaderVM : public CqShaderStack, public IqShader, p
 		 *   version of aqsis, or is invalid in any other way.
 		 */
 		void	LoadProgram( std::istream* pFile );
+		/** \brief Set up this shader from an already loaded program image
+		 *
+		 * Creates the local variables described by the image and shares its
+		 * bytecodes, giving the same result as LoadProgram() on the file the
+		 * image came from.
+		 */
+		void	InstantiateProgram( const boost::shared_ptr<SqProgramImage>& image );
 		void	Execute( IqShaderExecEnv* pEnv );
 		void	ExecuteInit();
 
@@ -219,6 +275,10 @@ class AQSIS_SHADERVM_SHARE CqShaderVM : public CqShaderStack, public IqShader, p
 		friend boost::shared_ptr<IqShader> createShaderVM(
 				IqRenderer* renderContext, std::istream& programFile,
 				const std::string& dsoPath);
+		friend boost::shared_ptr<IqShader> createShaderVM(
+				IqRenderer* renderContext,
+				const boost::filesystem::path& programPath,
+				const std::string& dsoPath);
 
 		struct SqArgumentRecord
 		{
@@ -238,9 +298,7 @@ class AQSIS_SHADERVM_SHARE CqShaderVM : public CqShaderStack, public IqShader, p
 		std::vector<IqShaderData*>	m_LocalVars;		///< Array of local variables.
 		std::vector<IqShaderData*>	m_InstancedParams;	///< Array of (instance parameter,local var) pairs.  Includes default params.
 		std::vector<SqArgumentRecord>	m_StoredArguments;		///< Array of arguments specified during construction.
-		std::vector<UsProgramElement>	m_ProgramInit;		///< Bytecodes of the intialisation program.
-		std::vector<UsProgramElement>	m_Program;			///< Bytecodes of the main program.
-		std::list<CqString*>			m_ProgramStrings;	///< Strings used by the program, which are stored additionally as UsProgramElements.
+		boost::shared_ptr<SqProgramImage>	m_programImage;	///< Loaded program, shared between instances.
 		TqInt	m_uGridRes;
 		TqInt	m_vGridRes;
 		TqInt	m_shadingPointCount;
@@ -373,7 +431,7 @@ class AQSIS_SHADERVM_SHARE CqShaderVM : public CqShaderStack, public IqShader, p
 			UsProgramElement E;
 			E.m_pString = ps;
 			pProgramArea->push_back( E );
-			m_ProgramStrings.push_back( ps ); // Store here as well to avoid mem leak.
+			m_programImage->m_ProgramStrings.push_back( ps ); // Store here as well to avoid mem leak.
 		}
 		/** Add an variable index value to the program area.
 		 * \param iVar Integer variable index to add, top bit indicates system variable.
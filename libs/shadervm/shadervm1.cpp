@@ -198,17 +198,20 @@ void CqShaderVM::SO_mergef()
 	{
 		TqInt i;
 		TqInt ext = m_pEnv->shadingPointCount();
-		for ( i = 0; i < ext; i++ )
+		if ( !simd::merge<TqFloat>( A, T, F, pResult, ext, simd::isFloatType ) )
 		{
-			bool _aq_A;
-			TqFloat _aq_T, _aq_F;
-			A->GetBool( _aq_A, i );
-			T->GetFloat( _aq_T, i );
-			F->GetFloat( _aq_F, i );
-			if ( _aq_A )
-				pResult->SetValue( _aq_T, i );
-			else
-				pResult->SetValue( _aq_F, i );
+			for ( i = 0; i < ext; i++ )
+			{
+				bool _aq_A;
+				TqFloat _aq_T, _aq_F;
+				A->GetBool( _aq_A, i );
+				T->GetFloat( _aq_T, i );
+				F->GetFloat( _aq_F, i );
+				if ( _aq_A )
+					pResult->SetValue( _aq_T, i );
+				else
+					pResult->SetValue( _aq_F, i );
+			}
 		}
 	}
 	Push( pResult );
@@ -260,17 +263,20 @@ void CqShaderVM::SO_mergep()
 	{
 		TqInt i;
 		TqInt ext = m_pEnv->shadingPointCount();
-		for ( i = 0; i < ext; i++ )
+		if ( !simd::merge<CqVector3D>( A, T, F, pResult, ext, simd::isVectorType ) )
 		{
-			bool _aq_A;
-			CqVector3D _aq_T, _aq_F;
-			A->GetBool( _aq_A, i );
-			T->GetPoint( _aq_T, i );
-			F->GetPoint( _aq_F, i );
-			if ( _aq_A )
-				pResult->SetValue( _aq_T, i );
-			else
-				pResult->SetValue( _aq_F, i );
+			for ( i = 0; i < ext; i++ )
+			{
+				bool _aq_A;
+				CqVector3D _aq_T, _aq_F;
+				A->GetBool( _aq_A, i );
+				T->GetPoint( _aq_T, i );
+				F->GetPoint( _aq_F, i );
+				if ( _aq_A )
+					pResult->SetValue( _aq_T, i );
+				else
+					pResult->SetValue( _aq_F, i );
+			}
 		}
 	}
 	Push( pResult );
@@ -291,17 +297,20 @@ void CqShaderVM::SO_mergec()
 	{
 		TqInt i;
 		TqInt ext = m_pEnv->shadingPointCount();
-		for ( i = 0; i < ext; i++ )
+		if ( !simd::merge<CqColor>( A, T, F, pResult, ext, simd::isColorType ) )
 		{
-			bool _aq_A;
-			CqColor _aq_T, _aq_F;
-			A->GetBool( _aq_A, i );
-			T->GetColor( _aq_T, i );
-			F->GetColor( _aq_F, i );
-			if ( _aq_A )
-				pResult->SetValue( _aq_T, i );
-			else
-				pResult->SetValue( _aq_F, i );
+			for ( i = 0; i < ext; i++ )
+			{
+				bool _aq_A;
+				CqColor _aq_T, _aq_F;
+				A->GetBool( _aq_A, i );
+				T->GetColor( _aq_T, i );
+				F->GetColor( _aq_F, i );
+				if ( _aq_A )
+					pResult->SetValue( _aq_T, i );
+				else
+					pResult->SetValue( _aq_F, i );
+			}
 		}
 	}
 	Push( pResult );
@@ -0,0 +1,98 @@
+// Aqsis
+// Copyright (C) 1997 - 2001, Paul C. Gregory
+//
+// Contact: pgregory@aqsis.org
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation; either
+// version 2 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+/** \file Unit tests for the cache of loaded shader programs.
+ */
+
+#include <aqsis/shadervm/ishader.h>
+
+#include <cstdio>
+#include <ctime>
+#include <fstream>
+#include <string>
+
+#include <boost/filesystem/operations.hpp>
+
+#include <aqsis/slcomp/icodegen.h>
+#include <aqsis/util/file.h>
+
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/auto_unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(shadervm_tests)
+
+using namespace Aqsis;
+
+namespace {
+
+// Write a compiled surface shader with a single parameter.
+void writeShader(const std::string& fileName, const std::string& paramDecl)
+{
+	std::ofstream out(fileName.c_str());
+	out << "surface\n"
+		<< "AQSIS_V " << AQSIS_XSTR(AQSIS_SLX_VERSION) << "\n\n\n"
+		<< "segment Data\n\n"
+		<< "USES 0\n\n"
+		<< paramDecl << "\n\n\n"
+		<< "segment Init\n\n\n"
+		<< "segment Code\n";
+}
+
+bool hasParam(const boost::shared_ptr<IqShader>& shader, const char* name)
+{
+	return shader->FindArgument(name) != 0;
+}
+
+} // unnamed namespace
+
+BOOST_AUTO_TEST_CASE(shadervm_program_cache_reload)
+{
+	const std::string fileName = uniqueTempName("shadervm_test.slx");
+	writeShader(fileName, "param uniform float Kd");
+	std::time_t modTime = boost::filesystem::last_write_time(fileName);
+
+	boost::shared_ptr<IqShader> first = createShaderVM(0, fileName, "");
+	BOOST_CHECK(hasParam(first, "Kd"));
+
+	// Rewrite the file with the same size and modification time; the second
+	// load must share the cached program rather than parse the new file.
+	writeShader(fileName, "param uniform float Ks");
+	boost::filesystem::last_write_time(fileName, modTime);
+	boost::shared_ptr<IqShader> second = createShaderVM(0, fileName, "");
+	BOOST_CHECK(hasParam(second, "Kd"));
+	BOOST_CHECK(!hasParam(second, "Ks"));
+	// Instances share the program but not their parameter storage.
+	BOOST_CHECK(first->FindArgument("Kd") != second->FindArgument("Kd"));
+
+	// Touching the file reloads it.
+	boost::filesystem::last_write_time(fileName, modTime + 10);
+	boost::shared_ptr<IqShader> touched = createShaderVM(0, fileName, "");
+	BOOST_CHECK(hasParam(touched, "Ks"));
+	BOOST_CHECK(!hasParam(touched, "Kd"));
+
+	// So does a change of size within the same second.
+	writeShader(fileName, "param uniform float Kdiffuse");
+	boost::filesystem::last_write_time(fileName, modTime + 10);
+	boost::shared_ptr<IqShader> resized = createShaderVM(0, fileName, "");
+	BOOST_CHECK(hasParam(resized, "Kdiffuse"));
+
+	std::remove(fileName.c_str());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
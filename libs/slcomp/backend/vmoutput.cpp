@@ -757,6 +757,26 @@ void CqCodeGenOutput::Visit( IqParseNodeConditional& C )
 	assert( pTrueStmt != 0 );
 	IqParseNode* pFalseStmt = pTrueStmt->pNextSibling();
 
+	if ( IsUniformExpression( pArg ) )
+	{
+		// The condition is the same for every shading point, so jump on it
+		// directly instead of masking the running state.
+		if ( pFalseStmt )
+			iLabelB = m_gcLabels++;
+		m_slxFile << "\tRS_JZ " << iLabelA << std::endl;	// exit if nothing is running
+		pArg->Accept( *this );							// relation
+		m_slxFile << "\tjz " << iLabelB << std::endl;	// skip true statement if false
+		pTrueStmt->Accept( *this );						// true statement
+		if ( pFalseStmt )
+		{
+			m_slxFile << "\tjmp " << iLabelA << std::endl;	// skip false statement
+			m_slxFile << ":" << iLabelB << std::endl;	// false part label
+			pFalseStmt->Accept( *this );				// false statement
+		}
+		m_slxFile << ":" << iLabelA << std::endl;		// conditional exit point
+		return;
+	}
+
 	m_slxFile << "\tS_CLEAR" << std::endl;			// clear current state
 	pArg->Accept( *this );							// relation
 	m_slxFile << "\tS_GET" << std::endl;			// Get the current state by popping the top value off the stack
@@ -794,6 +814,22 @@ void CqCodeGenOutput::Visit( IqParseNodeConditionalExpression& CE )
 	IqParseNode* pFalseStmt = pTrueStmt->pNextSibling();
 	assert( pFalseStmt != 0 );
 
+	if ( IsUniformExpression( pCondition ) )
+	{
+		// A uniform condition selects one of the expressions for every
+		// shading point, so only that one needs to be evaluated.
+		TqInt iLabelA = m_gcLabels++;
+		TqInt iLabelB = m_gcLabels++;
+		pCondition->Accept( *this );
+		m_slxFile << "\tjz " << iLabelA << "\n";
+		pTrueStmt->Accept( *this );
+		m_slxFile << "\tjmp " << iLabelB << "\n";
+		m_slxFile << ":" << iLabelA << "\n";
+		pFalseStmt->Accept( *this );
+		m_slxFile << ":" << iLabelB << "\n";
+		return;
+	}
+
 	// Write out VM code to evaluate each branch with the correct running state
 	m_slxFile << "\tS_CLEAR\n";		// clear current tmp state
 	pCondition->Accept( *this );	// evaluate conditional
@@ -1058,6 +1094,58 @@ const char* CqCodeGenOutput::MathOpName( TqInt op )
 	}
 }
 
+/** \brief Determine whether an expression has the same value at every
+ * shading point.
+ *
+ * This is conservative: constants and uniform variables are uniform, as
+ * are operators, casts and tuples of uniform operands.  Anything else,
+ * including all function calls, is assumed to be varying.
+ */
+bool CqCodeGenOutput::IsUniformExpression( IqParseNode* pNode )
+{
+	switch ( pNode->NodeType() )
+	{
+			case ParseNode_ConstantFloat:
+			case ParseNode_ConstantString:
+			return ( true );
+
+			case ParseNode_Variable:
+			{
+				IqParseNodeVariable* pVN;
+				pVN = static_cast<IqParseNodeVariable*>(pNode->GetInterface( ParseNode_Variable ));
+				SqVarRef temp( pVN->VarRef() );
+				IqVarDef* pVD = pTranslatedVariable( temp, m_saTransTable );
+				// Parameters of inlined functions which are bound to a
+				// temporary take the storage of the parameter, not the argument.
+				if ( pVD == 0 || pVD->fExtern() ||
+				        FindTemporaryVariable( pVD->strName(), m_StackVarMap ) != NULL )
+					return ( false );
+				return ( ( pVD->Type() & Type_Uniform ) != 0 );
+			}
+
+			case ParseNode_MathOp:
+			case ParseNode_RelationalOp:
+			case ParseNode_UnaryOp:
+			case ParseNode_LogicalOp:
+			case ParseNode_TypeCast:
+			case ParseNode_Triple:
+			case ParseNode_SixteenTuple:
+			{
+				IqParseNode* pChild = pNode->pChild();
+				while ( pChild )
+				{
+					if ( !IsUniformExpression( pChild ) )
+						return ( false );
+					pChild = pChild->pNextSibling();
+				}
+				return ( true );
+			}
+
+			default:
+			return ( false );
+	}
+}
+
 void CqCodeGenOutput::rsPush()
 {
 	// push the running state
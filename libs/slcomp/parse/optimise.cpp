@@ -8,9 +8,197 @@
 
 #include	<aqsis/aqsis.h>
 #include	"parsenode.h"
+#include	"vardef.h"
+#include	"funcdef.h"
 
 namespace Aqsis {
 
+namespace {
+
+///---------------------------------------------------------------------
+/// DeleteTree
+/// Delete a node and all the nodes below it.
+
+void DeleteTree( CqParseNode* pNode )
+{
+	CqParseNode * pChild = pNode->pFirstChild();
+	while ( pChild )
+	{
+		CqParseNode * pNext = pChild->pNext();
+		DeleteTree( pChild );
+		pChild = pNext;
+	}
+	delete( pNode );
+}
+
+
+///---------------------------------------------------------------------
+/// FloatConstValue
+/// Get the value of a float constant, looking through a cast to one of the
+/// types which holds the float in every component.
+
+bool FloatConstValue( const CqParseNode* pNode, TqFloat& Value, TqInt& Type )
+{
+	Type = Type_Float;
+	if ( pNode->NodeType() == IqParseNodeTypeCast::m_ID )
+	{
+		Type = pNode->ResType() & Type_Mask;
+		if ( Type != Type_Float && Type != Type_Point && Type != Type_Vector &&
+		        Type != Type_Normal && Type != Type_Color )
+			return ( false );
+		pNode = pNode->pFirstChild();
+	}
+	if ( pNode == 0 || pNode->NodeType() != IqParseNodeConstantFloat::m_ID )
+		return ( false );
+	Value = static_cast<const CqParseNodeFloatConst*>( pNode ) ->Value();
+	return ( true );
+}
+
+
+///---------------------------------------------------------------------
+/// FloatConstNode
+/// Create a node holding a float constant, cast to the given type.
+
+CqParseNode* FloatConstNode( TqFloat Value, TqInt Type )
+{
+	CqParseNode * pConst = new CqParseNodeFloatConst( Value );
+	if ( ( Type & Type_Mask ) == Type_Float )
+		return ( pConst );
+	CqParseNode* pCast = new CqParseNodeCast( Type );
+	pCast->AddLastChild( pConst );
+	return ( pCast );
+}
+
+
+///---------------------------------------------------------------------
+/// IsConstCondition
+/// Determine the value of a constant condition.
+
+bool IsConstCondition( const CqParseNode* pNode, bool& fValue )
+{
+	TqFloat Value;
+	TqInt Type;
+	if ( !FloatConstValue( pNode, Value, Type ) || Type != Type_Float )
+		return ( false );
+	fValue = ( Value != 0.0f );
+	return ( true );
+}
+
+
+///---------------------------------------------------------------------
+/// SqLocalUse
+/// What the constant propagation has found out about a local variable.
+
+struct SqLocalUse
+{
+	SqLocalUse() :
+			m_cAssigns( 0 ),
+			m_pAssign( 0 ),
+			m_iTree( -1 ),
+			m_fUnsafe( false )
+	{}
+
+	TqInt	m_cAssigns;				///< Number of assignments to the variable.
+	CqParseNodeAssign*	m_pAssign;	///< The first assignment.
+	std::vector<CqParseNode*>	m_aReads;	///< Nodes reading the variable.
+	TqInt	m_iTree;				///< Index of the tree holding the references.
+	bool	m_fUnsafe;				///< Set if the variable can't be substituted.
+};
+
+
+///---------------------------------------------------------------------
+/// IsValueRead
+/// Determine whether a variable is only read by its parent, rather than
+/// passed on to something which might write to it.
+
+bool IsValueRead( const CqParseNode* pNode, const CqParseNode* pParent )
+{
+	if ( pParent == 0 )
+		return ( false );
+	TqInt Type = pParent->NodeType();
+	if ( Type == IqParseNodeMathOp::m_ID ||
+	        Type == IqParseNodeRelationalOp::m_ID ||
+	        Type == IqParseNodeUnaryOp::m_ID ||
+	        Type == IqParseNodeLogicalOp::m_ID ||
+	        Type == IqParseNodeTypeCast::m_ID ||
+	        Type == IqParseNodeTriple::m_ID ||
+	        Type == IqParseNodeSixteenTuple::m_ID ||
+	        Type == IqParseNodeConditionalExpression::m_ID ||
+	        Type == IqParseNodeDiscardResult::m_ID ||
+	        Type == IqParseNodeVariableAssign::m_ID ||
+	        Type == IqParseNodeArrayVariableAssign::m_ID ||
+	        Type == IqParseNodeArrayVariable::m_ID )
+		return ( true );
+	// Conditions of if and while statements.
+	if ( Type == IqParseNodeConditional::m_ID ||
+	        Type == IqParseNodeWhileConstruct::m_ID )
+		return ( pParent->pFirstChild() == pNode );
+	return ( false );
+}
+
+
+///---------------------------------------------------------------------
+/// GatherLocalUses
+/// Record the assignments to and reads of local variables below a node,
+/// in the order they are executed.  fNested is set once the walk is below
+/// anything other than a plain statement list, where an assignment might
+/// not be executed, or be executed more than once.
+
+void GatherLocalUses( CqParseNode* pNode, CqParseNode* pParent, TqInt iTree,
+                      bool fNested, std::vector<SqLocalUse>& aUses )
+{
+	TqInt Type = pNode->NodeType();
+	SqLocalUse* pUse = 0;
+	if ( Type == IqParseNodeVariable::m_ID ||
+	        Type == IqParseNodeArrayVariable::m_ID ||
+	        Type == IqParseNodeVariableAssign::m_ID ||
+	        Type == IqParseNodeArrayVariableAssign::m_ID )
+	{
+		SqVarRef Ref = static_cast<CqParseNodeVariable*>( pNode ) ->VarRef();
+		if ( Ref.m_Type == VarTypeLocal && Ref.m_Index < aUses.size() )
+			pUse = &aUses[ Ref.m_Index ];
+	}
+	else if ( Type == IqParseNodeMessagePassingFunction::m_ID )
+	{
+		// Message passing functions write straight to their variable.
+		SqVarRef Ref = static_cast<CqParseNodeCommFunction*>( pNode ) ->VarRef();
+		if ( Ref.m_Type == VarTypeLocal && Ref.m_Index < aUses.size() )
+			aUses[ Ref.m_Index ].m_fUnsafe = true;
+	}
+
+	if ( pUse != 0 )
+	{
+		if ( pUse->m_iTree >= 0 && pUse->m_iTree != iTree )
+			pUse->m_fUnsafe = true;
+		pUse->m_iTree = iTree;
+
+		if ( Type == IqParseNodeVariableAssign::m_ID )
+		{
+			pUse->m_cAssigns++;
+			if ( pUse->m_pAssign == 0 )
+				pUse->m_pAssign = static_cast<CqParseNodeAssign*>( pNode );
+			if ( fNested )
+				pUse->m_fUnsafe = true;
+		}
+		else if ( Type == IqParseNodeVariable::m_ID && pUse->m_pAssign != 0 &&
+		          IsValueRead( pNode, pParent ) )
+			pUse->m_aReads.push_back( pNode );
+		else
+			pUse->m_fUnsafe = true;
+	}
+
+	fNested = fNested || ( Type != IqParseNode::m_ID && Type != IqParseNodeShader::m_ID );
+	CqParseNode * pChild = pNode->pFirstChild();
+	while ( pChild )
+	{
+		GatherLocalUses( pChild, pNode, iTree, fNested, aUses );
+		pChild = pChild->pNext();
+	}
+}
+
+} // unnamed namespace
+
+
 ///---------------------------------------------------------------------
 /// CqParseNode::Optimise
 
@@ -30,6 +218,36 @@ bool CqParseNode::Optimise()
 }
 
 
+///---------------------------------------------------------------------
+/// CqParseNode::fReplaceable
+/// Determine whether the optimiser may replace this node.  Roots of the
+/// trees are referenced from outside, as are the default values of shader
+/// parameters, which are the children of the parameter variable nodes.
+
+bool CqParseNode::fReplaceable() const
+{
+	return ( m_pParent != 0 &&
+	         m_pParent->NodeType() != IqParseNodeVariable::m_ID );
+}
+
+
+///---------------------------------------------------------------------
+/// CqParseNode::ReplaceWith
+/// Put another node in place of this one, and delete this node along with
+/// whatever is left below it.  The new node may be one of the children.
+
+void CqParseNode::ReplaceWith( CqParseNode* pNew )
+{
+	assert( fReplaceable() );
+
+	pNew->UnLink();
+	pNew->LinkAfter( this );
+	if ( pNew->m_LineNo < 0 )
+		pNew->SetPos( m_LineNo, m_strFileName.c_str() );
+	DeleteTree( this );
+}
+
+
 ///---------------------------------------------------------------------
 /// CqParseNodeFunction:Call:Optimise
 /// Optimise a function definition, basically optimise the parameters.
@@ -75,6 +293,300 @@ bool CqParseNodeAssign::Optimise()
 }
 
 
+///---------------------------------------------------------------------
+/// CqParseNodeMathOp::Optimise
+/// Fold arithmetic on constants, and remove additions of zero and
+/// multiplications by one.
+
+bool CqParseNodeMathOp::Optimise()
+{
+	CqParseNode::Optimise();
+
+	CqParseNode * pA = m_pChild;
+	CqParseNode* pB = ( pA != 0 ) ? pA->pNext() : 0;
+	if ( pB == 0 || !fReplaceable() )
+		return ( false );
+
+	TqFloat A = 0.0f, B = 0.0f;
+	TqInt TypeA, TypeB;
+	bool fConstA = FloatConstValue( pA, A, TypeA );
+	bool fConstB = FloatConstValue( pB, B, TypeB );
+	TqInt ResultType = ResType() & Type_Mask;
+
+	// A float held in every component stays that way under componentwise
+	// arithmetic, so the result can be folded to a single cast constant.
+	if ( fConstA && fConstB &&
+	        ( TypeA == Type_Float || TypeA == ResultType ) &&
+	        ( TypeB == Type_Float || TypeB == ResultType ) &&
+	        ( ResultType == Type_Float || ResultType == TypeA || ResultType == TypeB ) )
+	{
+		TqFloat Result;
+		switch ( m_Operator )
+		{
+				case Op_Add:
+				Result = A + B;
+				break;
+				case Op_Sub:
+				Result = A - B;
+				break;
+				case Op_Mul:
+				Result = A * B;
+				break;
+				case Op_Div:
+				// Leave division by zero to the VM.
+				if ( B == 0.0f )
+					return ( false );
+				Result = A / B;
+				break;
+				default:
+				return ( false );
+		}
+		ReplaceWith( FloatConstNode( Result, ResultType ) );
+		return ( true );
+	}
+
+	CqParseNode* pKeep = 0;
+	switch ( m_Operator )
+	{
+			case Op_Add:
+			if ( fConstA && A == 0.0f )
+				pKeep = pB;
+			else if ( fConstB && B == 0.0f )
+				pKeep = pA;
+			break;
+			case Op_Sub:
+			if ( fConstB && B == 0.0f )
+				pKeep = pA;
+			break;
+			case Op_Mul:
+			if ( fConstA && A == 1.0f )
+				pKeep = pB;
+			else if ( fConstB && B == 1.0f )
+				pKeep = pA;
+			break;
+			case Op_Div:
+			if ( fConstB && B == 1.0f )
+				pKeep = pA;
+			break;
+			default:
+			break;
+	}
+	// The operand can only stand in for the result if it has the same type.
+	if ( pKeep != 0 && ( pKeep->ResType() & Type_Mask ) == ResultType )
+	{
+		ReplaceWith( pKeep );
+		return ( true );
+	}
+
+	return ( false );
+}
+
+
+///---------------------------------------------------------------------
+/// CqParseNodeRelOp::Optimise
+/// Fold comparisons of constants.
+
+bool CqParseNodeRelOp::Optimise()
+{
+	CqParseNode::Optimise();
+
+	CqParseNode * pA = m_pChild;
+	CqParseNode* pB = ( pA != 0 ) ? pA->pNext() : 0;
+	if ( pB == 0 || !fReplaceable() )
+		return ( false );
+
+	TqFloat A, B;
+	TqInt TypeA, TypeB;
+	if ( !FloatConstValue( pA, A, TypeA ) || !FloatConstValue( pB, B, TypeB ) )
+		return ( false );
+
+	bool fResult;
+	switch ( m_Operator )
+	{
+			case Op_EQ:
+			fResult = ( A == B );
+			break;
+			case Op_NE:
+			fResult = ( A != B );
+			break;
+			case Op_L:
+			fResult = ( A < B );
+			break;
+			case Op_G:
+			fResult = ( A > B );
+			break;
+			case Op_GE:
+			fResult = ( A >= B );
+			break;
+			case Op_LE:
+			fResult = ( A <= B );
+			break;
+			default:
+			return ( false );
+	}
+	ReplaceWith( new CqParseNodeFloatConst( fResult ? 1.0f : 0.0f ) );
+	return ( true );
+}
+
+
+///---------------------------------------------------------------------
+/// CqParseNodeUnaryOp::Optimise
+/// Fold unary operations on constants.
+
+bool CqParseNodeUnaryOp::Optimise()
+{
+	CqParseNode::Optimise();
+
+	if ( m_pChild == 0 || !fReplaceable() )
+		return ( false );
+
+	if ( m_Operator == Op_Plus )
+	{
+		ReplaceWith( m_pChild );
+		return ( true );
+	}
+
+	TqFloat A;
+	TqInt TypeA;
+	if ( !FloatConstValue( m_pChild, A, TypeA ) )
+		return ( false );
+
+	switch ( m_Operator )
+	{
+			case Op_Neg:
+			ReplaceWith( FloatConstNode( -A, TypeA ) );
+			return ( true );
+			case Op_LogicalNot:
+			if ( TypeA != Type_Float )
+				return ( false );
+			ReplaceWith( new CqParseNodeFloatConst( ( A == 0.0f ) ? 1.0f : 0.0f ) );
+			return ( true );
+			default:
+			return ( false );
+	}
+}
+
+
+///---------------------------------------------------------------------
+/// CqParseNodeLogicalOp::Optimise
+/// Fold logical operations on constants.  Both operands are always
+/// evaluated, so nothing is done unless both are constant.
+
+bool CqParseNodeLogicalOp::Optimise()
+{
+	CqParseNode::Optimise();
+
+	CqParseNode * pA = m_pChild;
+	CqParseNode* pB = ( pA != 0 ) ? pA->pNext() : 0;
+	bool fA, fB;
+	if ( pB == 0 || !fReplaceable() ||
+	        !IsConstCondition( pA, fA ) || !IsConstCondition( pB, fB ) )
+		return ( false );
+
+	bool fResult;
+	switch ( m_Operator )
+	{
+			case Op_LogAnd:
+			fResult = ( fA && fB );
+			break;
+			case Op_LogOr:
+			fResult = ( fA || fB );
+			break;
+			default:
+			return ( false );
+	}
+	ReplaceWith( new CqParseNodeFloatConst( fResult ? 1.0f : 0.0f ) );
+	return ( true );
+}
+
+
+///---------------------------------------------------------------------
+/// CqParseNodeDrop::Optimise
+/// Remove discarded results which have no side effects.
+
+bool CqParseNodeDrop::Optimise()
+{
+	CqParseNode::Optimise();
+
+	if ( m_pChild == 0 || !fReplaceable() )
+		return ( false );
+
+	TqInt Type = m_pChild->NodeType();
+	if ( Type == IqParseNodeConstantFloat::m_ID ||
+	        Type == IqParseNodeConstantString::m_ID ||
+	        Type == IqParseNodeVariable::m_ID )
+	{
+		ReplaceWith( new CqParseNode() );
+		return ( true );
+	}
+
+	return ( false );
+}
+
+
+///---------------------------------------------------------------------
+/// CqParseNodeWhileConstruct::Optimise
+/// Remove loops which never run.
+
+bool CqParseNodeWhileConstruct::Optimise()
+{
+	CqParseNode::Optimise();
+
+	bool fCond;
+	if ( m_pChild == 0 || !fReplaceable() ||
+	        !IsConstCondition( m_pChild, fCond ) || fCond )
+		return ( false );
+
+	ReplaceWith( new CqParseNode() );
+	return ( true );
+}
+
+
+///---------------------------------------------------------------------
+/// CqParseNodeConditional::Optimise
+/// Replace a conditional with a constant condition by the branch which is
+/// taken.  If there is no such branch an empty node takes its place, so
+/// that parents which expect a statement at that position still find one.
+
+bool CqParseNodeConditional::Optimise()
+{
+	CqParseNode::Optimise();
+
+	bool fCond;
+	if ( m_pChild == 0 || !fReplaceable() || !IsConstCondition( m_pChild, fCond ) )
+		return ( false );
+
+	CqParseNode * pTrueStmt = m_pChild->pNext();
+	CqParseNode* pFalseStmt = ( pTrueStmt != 0 ) ? pTrueStmt->pNext() : 0;
+	CqParseNode* pTaken = fCond ? pTrueStmt : pFalseStmt;
+	ReplaceWith( ( pTaken != 0 ) ? pTaken : new CqParseNode() );
+	return ( true );
+}
+
+
+///---------------------------------------------------------------------
+/// CqParseNodeQCond::Optimise
+/// Replace a ?: expression with a constant condition by the chosen
+/// expression.
+
+bool CqParseNodeQCond::Optimise()
+{
+	CqParseNode::Optimise();
+
+	bool fCond;
+	if ( m_pChild == 0 || !fReplaceable() || !IsConstCondition( m_pChild, fCond ) )
+		return ( false );
+
+	CqParseNode * pTrue = m_pChild->pNext();
+	CqParseNode* pFalse = ( pTrue != 0 ) ? pTrue->pNext() : 0;
+	if ( pFalse == 0 )
+		return ( false );
+
+	ReplaceWith( fCond ? pTrue : pFalse );
+	return ( true );
+}
+
+
 ///---------------------------------------------------------------------
 /// CqParseNodeCast::Optimise
 
@@ -117,5 +629,75 @@ bool CqParseNodeCast::Optimise()
 	return ( false );
 }
 
+
+///---------------------------------------------------------------------
+/// PropagateConstants
+/// Find local float variables which are assigned a constant once, by a
+/// statement which is always executed before any of the reads, and replace
+/// the reads with the constant.  The assignment is removed, which leaves the
+/// variable unused.  Local function bodies are examined as well as the
+/// shader.  Returns true if anything was changed, in which case the trees
+/// are worth optimising again.
+
+bool PropagateConstants( CqParseNode* pShaderTree )
+{
+	std::vector<SqLocalUse> aUses( gLocalVars.size() );
+
+	// Variables reached from elsewhere by extern declarations, and the
+	// parameters of local functions, which are bound to the arguments.
+	TqUint i;
+	for ( i = 0; i < gLocalVars.size(); i++ )
+	{
+		if ( gLocalVars[ i ].fExtern() )
+		{
+			aUses[ i ].m_fUnsafe = true;
+			SqVarRef Ref = gLocalVars[ i ].vrExtern();
+			if ( Ref.m_Type == VarTypeLocal && Ref.m_Index < aUses.size() )
+				aUses[ Ref.m_Index ].m_fUnsafe = true;
+		}
+	}
+	for ( i = 0; i < gLocalFuncs.size(); i++ )
+	{
+		CqParseNode * pArgs = gLocalFuncs[ i ].pArgs();
+		if ( pArgs )
+			GatherLocalUses( pArgs, 0, -1, true, aUses );
+	}
+
+	TqInt iTree = 0;
+	for ( i = 0; i < gLocalFuncs.size(); i++ )
+	{
+		if ( gLocalFuncs[ i ].pDefNode() != 0 )
+			GatherLocalUses( gLocalFuncs[ i ].pDefNode(), 0, iTree++, false, aUses );
+	}
+	if ( pShaderTree )
+		GatherLocalUses( pShaderTree, 0, iTree++, false, aUses );
+
+	bool fChanged = false;
+	for ( i = 0; i < aUses.size(); i++ )
+	{
+		SqLocalUse& Use = aUses[ i ];
+		TqInt Type = gLocalVars[ i ].Type();
+		if ( Use.m_fUnsafe || Use.m_cAssigns != 1 || !Use.m_pAssign->fDiscardResult() ||
+		        ( Type & Type_Mask ) != Type_Float ||
+		        ( Type & ( Type_Array | Type_Param | Type_Output ) ) != 0 ||
+		        !Use.m_pAssign->fReplaceable() )
+			continue;
+
+		CqParseNode* pValue = Use.m_pAssign->pFirstChild();
+		if ( pValue == 0 || pValue->pNext() != 0 ||
+		        pValue->NodeType() != IqParseNodeConstantFloat::m_ID )
+			continue;
+		TqFloat Value = static_cast<CqParseNodeFloatConst*>( pValue ) ->Value();
+
+		std::vector<CqParseNode*>::iterator iRead;
+		for ( iRead = Use.m_aReads.begin(); iRead != Use.m_aReads.end(); iRead++ )
+			( *iRead ) ->ReplaceWith( new CqParseNodeFloatConst( Value ) );
+		Use.m_pAssign->ReplaceWith( new CqParseNode() );
+		fChanged = true;
+	}
+
+	return ( fChanged );
+}
+
 } // namespace Aqsis
 //---------------------------------------------------------------------
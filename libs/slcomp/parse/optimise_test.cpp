@@ -0,0 +1,155 @@
+// Aqsis
+// Copyright (C) 1997 - 2001, Paul C. Gregory
+//
+// Contact: pgregory@aqsis.org
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation; either
+// version 2 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+/** \file Unit tests for the parse tree optimiser.
+ */
+
+#include "parsenode.h"
+#include "vardef.h"
+
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/auto_unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(optimise_tests)
+
+using namespace Aqsis;
+
+namespace {
+
+/// Delete a tree built by one of the tests.
+void deleteTree(CqParseNode* node)
+{
+	CqParseNode* child = node->pFirstChild();
+	while(child)
+	{
+		CqParseNode* next = child->pNext();
+		deleteTree(child);
+		child = next;
+	}
+	delete node;
+}
+
+/// Make a binary math operation on two float constants.
+CqParseNode* floatMathOp(EqMathOp op, TqFloat a, TqFloat b)
+{
+	CqParseNode* node = new CqParseNodeMathOp(op);
+	node->AddLastChild(new CqParseNodeFloatConst(a));
+	node->AddLastChild(new CqParseNodeFloatConst(b));
+	return node;
+}
+
+/// Get the value of a node which should be a float constant.
+TqFloat constValue(const CqParseNode* node)
+{
+	BOOST_REQUIRE(node != 0);
+	BOOST_REQUIRE_EQUAL(node->NodeType(), IqParseNodeConstantFloat::m_ID);
+	return static_cast<const CqParseNodeFloatConst*>(node)->Value();
+}
+
+} // unnamed namespace
+
+BOOST_AUTO_TEST_CASE(optimise_folds_float_arithmetic)
+{
+	CqParseNode* root = new CqParseNode();
+	CqParseNode* sum = new CqParseNodeMathOp(Op_Add);
+	sum->AddLastChild(floatMathOp(Op_Mul, 2, 3));
+	sum->AddLastChild(new CqParseNodeFloatConst(1));
+	root->AddLastChild(sum);
+
+	root->Optimise();
+	BOOST_CHECK_EQUAL(constValue(root->pFirstChild()), 7);
+	BOOST_CHECK(root->pFirstChild()->pNext() == 0);
+	deleteTree(root);
+}
+
+BOOST_AUTO_TEST_CASE(optimise_leaves_division_by_zero)
+{
+	CqParseNode* root = new CqParseNode();
+	root->AddLastChild(floatMathOp(Op_Div, 1, 0));
+
+	root->Optimise();
+	BOOST_CHECK_EQUAL(root->pFirstChild()->NodeType(), IqParseNodeMathOp::m_ID);
+	deleteTree(root);
+}
+
+BOOST_AUTO_TEST_CASE(optimise_removes_untaken_branches)
+{
+	CqParseNode* root = new CqParseNode();
+	// if(1 > 2) 10; else 20;
+	CqParseNode* cond = new CqParseNodeConditional();
+	CqParseNode* test = new CqParseNodeRelOp(Op_G);
+	test->AddLastChild(new CqParseNodeFloatConst(1));
+	test->AddLastChild(new CqParseNodeFloatConst(2));
+	cond->AddLastChild(test);
+	cond->AddLastChild(new CqParseNodeFloatConst(10));
+	cond->AddLastChild(new CqParseNodeFloatConst(20));
+	root->AddLastChild(cond);
+	// if(0) 30; with no else leaves an empty statement.
+	cond = new CqParseNodeConditional();
+	cond->AddLastChild(new CqParseNodeFloatConst(0));
+	cond->AddLastChild(new CqParseNodeFloatConst(30));
+	root->AddLastChild(cond);
+
+	root->Optimise();
+	CqParseNode* stmt = root->pFirstChild();
+	BOOST_CHECK_EQUAL(constValue(stmt), 20);
+	stmt = stmt->pNext();
+	BOOST_REQUIRE(stmt != 0);
+	BOOST_CHECK_EQUAL(stmt->NodeType(), IqParseNode::m_ID);
+	BOOST_CHECK(stmt->pFirstChild() == 0);
+	BOOST_CHECK(stmt->pNext() == 0);
+	deleteTree(root);
+}
+
+BOOST_AUTO_TEST_CASE(propagate_constants_substitutes_locals)
+{
+	gLocalVars.clear();
+	gLocalVars.push_back(CqVarDef(Type_Float, "x"));
+	gLocalVars.push_back(CqVarDef(Type_Float, "y"));
+	SqVarRef x = { VarTypeLocal, 0 };
+	SqVarRef y = { VarTypeLocal, 1 };
+
+	// x = 2; y = x * 3;
+	CqParseNode* root = new CqParseNode();
+	CqParseNodeAssign* assignX = new CqParseNodeAssign(x);
+	assignX->NoDup();
+	assignX->AddLastChild(new CqParseNodeFloatConst(2));
+	root->AddLastChild(assignX);
+	CqParseNodeAssign* assignY = new CqParseNodeAssign(y);
+	assignY->NoDup();
+	CqParseNode* product = new CqParseNodeMathOp(Op_Mul);
+	product->AddLastChild(new CqParseNodeVariable(x));
+	product->AddLastChild(new CqParseNodeFloatConst(3));
+	assignY->AddLastChild(product);
+	root->AddLastChild(assignY);
+
+	BOOST_CHECK(PropagateConstants(root));
+	root->Optimise();
+	// The assignment to x is gone, and y is assigned the folded product.
+	CqParseNode* stmt = root->pFirstChild();
+	BOOST_CHECK_EQUAL(stmt->NodeType(), IqParseNode::m_ID);
+	stmt = stmt->pNext();
+	BOOST_REQUIRE(stmt == assignY);
+	BOOST_CHECK_EQUAL(constValue(assignY->pFirstChild()), 6);
+
+	deleteTree(root);
+	gLocalVars.clear();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
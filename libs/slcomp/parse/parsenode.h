@@ -193,6 +193,8 @@ class CqParseNode : public CqListEntry<CqParseNode>, public IqParseNode
 		}
 
 		virtual	bool	Optimise();
+		bool	fReplaceable() const;
+		void	ReplaceWith( CqParseNode* pNew );
 		virtual TqInt	TypeCheck( TqInt* pTypes, TqInt Count, bool& needsCast, bool CheckOnly )
 		{
 			TqInt NewType = Type_Nil;
@@ -830,6 +832,7 @@ class CqParseNodeMathOp : public CqParseNodeOp, public IqParseNodeMathOp
 
 
 
+		virtual	bool	Optimise();
 		virtual	TqInt	ResType() const;
 		virtual	CqParseNode*	Clone( CqParseNode* pParent = 0 )
 		{
@@ -914,6 +917,7 @@ class CqParseNodeRelOp : public CqParseNodeOp, public IqParseNodeRelationalOp
 
 
 
+		virtual	bool	Optimise();
 		virtual	CqParseNode*	Clone( CqParseNode* pParent = 0 )
 		{
 			CqParseNodeRelOp * pNew = new CqParseNodeRelOp( *this );
@@ -973,6 +977,7 @@ class CqParseNodeUnaryOp : public CqParseNodeOp, public IqParseNodeUnaryOp
 		}
 
 
+		virtual	bool	Optimise();
 		virtual	TqInt	TypeCheck( TqInt* pTypes, TqInt Count, bool& needsCast, bool CheckOnly );
 		virtual	CqParseNode*	Clone( CqParseNode* pParent = 0 )
 		{
@@ -1037,6 +1042,7 @@ class CqParseNodeLogicalOp : public CqParseNodeOp, public IqParseNodeLogicalOp
 
 
 
+		virtual	bool	Optimise();
 		virtual	CqParseNode*	Clone( CqParseNode* pParent = 0 )
 		{
 			CqParseNodeLogicalOp * pNew = new CqParseNodeLogicalOp( *this );
@@ -1088,6 +1094,7 @@ class CqParseNodeDrop : public CqParseNode, public IqParseNodeDiscardResult
 		}
 
 
+		virtual	bool	Optimise();
 		virtual	CqParseNode*	Clone( CqParseNode* pParent = 0 )
 		{
 			CqParseNodeDrop * pNew = new CqParseNodeDrop( *this );
@@ -1284,6 +1291,7 @@ class CqParseNodeWhileConstruct : public CqParseNode, public IqParseNodeWhileCon
 		}
 
 
+		virtual	bool	Optimise();
 		virtual	CqParseNode*	Clone( CqParseNode* pParent = 0 )
 		{
 			CqParseNodeWhileConstruct * pNew = new CqParseNodeWhileConstruct( *this );
@@ -1610,6 +1618,7 @@ class CqParseNodeConditional : public CqParseNode, public IqParseNodeConditional
 		}
 
 
+		virtual	bool	Optimise();
 		virtual	CqParseNode*	Clone( CqParseNode* pParent = 0 )
 		{
 			CqParseNodeConditional * pNew = new CqParseNodeConditional( *this );
@@ -1679,6 +1688,7 @@ class CqParseNodeQCond : public CqParseNode, public IqParseNodeConditionalExpres
 		}
 
 
+		virtual	bool	Optimise();
 		virtual	TqInt	TypeCheck( TqInt* pTypes, TqInt Count, bool& needsCast, bool CheckOnly );
 		virtual	CqParseNode*	Clone( CqParseNode* pParent = 0 )
 		{
@@ -2062,6 +2072,10 @@ class CqParseNodeTextureNameWithChannel : public CqParseNode
 };
 
 
+/// Replace reads of local float variables which are only ever assigned a constant.
+bool	PropagateConstants( CqParseNode* pShaderTree );
+
+
 //-----------------------------------------------------------------------
 
 } // namespace Aqsis
@@ -2136,6 +2136,19 @@ void Optimise()
 
 	if(ParseTreePointer)
 		ParseTreePointer->Optimise();
+
+	// Substituting constant variables can make more of the tree constant,
+	// so keep going until nothing more changes.
+	while(PropagateConstants(ParseTreePointer))
+	{
+		for(i=0; i<gLocalFuncs.size(); i++)
+		{
+			if(gLocalFuncs[i].pDef()!=0)
+				gLocalFuncs[i].pDefNode()->Optimise();
+		}
+		if(ParseTreePointer)
+			ParseTreePointer->Optimise();
+	}
 }
 
 
@@ -1,6 +1,7 @@
 set(buffers_srcs
 	imagechannel.cpp
 	mixedimagebuffer.cpp
+	tilecache.cpp
 )
 make_absolute(buffers_srcs ${buffers_SOURCE_DIR})
 
@@ -8,5 +9,7 @@ set(buffers_test_srcs
 	channellist_test.cpp
 	imagechannel_test.cpp
 	mixedimagebuffer_test.cpp
+	tilearray_test.cpp
+	tilecache_test.cpp
 )
 make_absolute(buffers_test_srcs ${buffers_SOURCE_DIR})
@@ -0,0 +1,101 @@
+// Aqsis
+// Copyright (C) 2001, Paul C. Gregory and the other authors and contributors
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// * Neither the name of the software's owners nor the names of its
+//   contributors may be used to endorse or promote products derived from this
+//   software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+// (This is the New BSD license)
+
+/** \file
+ *
+ * \brief Unit tests for tiled texture arrays
+ */
+
+#include <aqsis/tex/buffers/tilearray.h>
+
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/auto_unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(tilearray_tests)
+
+using namespace Aqsis;
+
+namespace {
+
+/// In-memory tiled file of 4x4 float pixels with value x + 10*y.
+class CqTestTiledFile : public IqTiledTexInputFile
+{
+	public:
+		CqTestTiledFile()
+		{
+			m_header.channelList().addChannel(
+					SqChannelInfo("r", Channel_Float32));
+		}
+		virtual boostfs::path fileName() const { return "test.tex"; }
+		virtual EqImageFileType fileType() const { return ImageFile_Tiff; }
+		virtual const CqTexFileHeader& header(TqInt index = 0) const
+		{
+			return m_header;
+		}
+		virtual SqTileInfo tileInfo() const { return SqTileInfo(2,2); }
+		virtual TqInt numSubImages() const { return 1; }
+		virtual TqInt width(TqInt index) const { return 4; }
+		virtual TqInt height(TqInt index) const { return 4; }
+	protected:
+		virtual void readTileImpl(TqUint8* buffer, TqInt tileX, TqInt tileY,
+				TqInt subImageIdx, const SqTileInfo tileSize) const
+		{
+			TqFloat* pixels = reinterpret_cast<TqFloat*>(buffer);
+			for(TqInt y = 0; y < tileSize.height; ++y)
+				for(TqInt x = 0; x < tileSize.width; ++x)
+					pixels[y*tileSize.width + x] = 2*tileX + x
+						+ 10*(2*tileY + y);
+		}
+	private:
+		CqTexFileHeader m_header;
+};
+
+} // unnamed namespace
+
+BOOST_AUTO_TEST_CASE(tilearray_pixel_access)
+{
+	CqTileArray<TqFloat> array(boost::shared_ptr<IqTiledTexInputFile>(
+				new CqTestTiledFile()), 0);
+	BOOST_CHECK_EQUAL(array(0,0)[0], 0);
+	BOOST_CHECK_EQUAL(array(3,1)[0], 13);
+	BOOST_CHECK_EQUAL(array(2,3)[0], 32);
+}
+
+BOOST_AUTO_TEST_CASE(tilearray_pixel_outlives_cache_entry)
+{
+	CqTileArray<TqFloat> array(boost::shared_ptr<IqTiledTexInputFile>(
+				new CqTestTiledFile()), 0);
+	CqTileArray<TqFloat>::CqPixel pixel = array(1,2);
+	// Dropping the tile from the cache mustn't free the pixel data.
+	CqTileCache::instance().clear();
+	BOOST_CHECK_EQUAL(pixel[0], 21);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
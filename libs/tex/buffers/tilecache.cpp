@@ -0,0 +1,455 @@
+// Aqsis
+// Copyright (C) 2001, Paul C. Gregory and the other authors and contributors
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// * Neither the name of the software's owners nor the names of its
+//   contributors may be used to endorse or promote products derived from this
+//   software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+// (This is the New BSD license)
+
+/** \file
+ *
+ * \brief Texture tile cache implementation.
+ */
+
+#include <aqsis/tex/buffers/tilecache.h>
+
+#include <algorithm>
+#include <climits>
+#include <deque>
+#include <list>
+#include <map>
+#include <set>
+#include <vector>
+
+#ifdef ENABLE_THREADING
+#include <boost/bind.hpp>
+#include <boost/thread/condition.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+#endif
+
+#include <aqsis/util/mutex.h>
+
+namespace Aqsis {
+
+namespace {
+
+/// Default memory ceiling: 1GB
+const std::size_t defaultMaxMemory = 1024*1024*1024;
+
+/// Number of locks used to serialise file reads.
+const TqInt numReadLocks = 16;
+TqMutex g_readLocks[numReadLocks];
+
+/// Lock protecting CqTileCache::m_nextOwner.
+TqMutex g_ownerLock;
+/// Lock protecting CqTileCache::m_maxMemory.
+TqMutex g_maxMemoryLock;
+
+/// Maximum number of tiles waiting to be prefetched.
+const std::size_t maxQueuedPrefetches = 1024;
+
+} // unnamed namespace
+
+
+//------------------------------------------------------------------------------
+/// One independently locked part of the cache.
+struct CqTileCache::SqStripe
+{
+	struct SqEntry
+	{
+		SqTileKey key;
+		TqTilePtr tile;
+		std::size_t size;
+
+		SqEntry(const SqTileKey& key, const TqTilePtr& tile, std::size_t size)
+			: key(key), tile(tile), size(size)
+		{ }
+	};
+	typedef std::list<SqEntry> TqLruList;
+	typedef std::map<SqTileKey, TqLruList::iterator> TqIndex;
+
+	/// Tiles, most recently used first.
+	TqLruList lru;
+	/// Map from key to position in the LRU list.
+	TqIndex index;
+	/// Counters for this stripe; memoryUsed is the stripe total.
+	SqTileCacheStats stats;
+	mutable TqMutex mutex;
+
+	SqStripe()
+		: lru(),
+		index(),
+		stats(),
+		mutex()
+	{ }
+
+	void erase(TqIndex::iterator i)
+	{
+		stats.memoryUsed -= i->second->size;
+		lru.erase(i->second);
+		index.erase(i);
+	}
+
+	/// Discard least recently used tiles until the stripe fits its budget.
+	void evict(std::size_t budget)
+	{
+		// Always keep the most recently used tile, even if it alone is
+		// larger than the budget.
+		while(stats.memoryUsed > budget && lru.size() > 1)
+		{
+			erase(index.find(lru.back().key));
+			++stats.evictions;
+		}
+	}
+};
+
+
+//------------------------------------------------------------------------------
+// CqTileCache implementation
+
+CqTileCache::CqTileCache(std::size_t maxMemory)
+	: m_stripes(new SqStripe[m_numStripes]),
+	m_maxMemory(maxMemory),
+	m_nextOwner(0)
+{ }
+
+CqTileCache::~CqTileCache()
+{ }
+
+CqTileCache& CqTileCache::instance()
+{
+	static CqTileCache cache(defaultMaxMemory);
+	return cache;
+}
+
+void CqTileCache::setMaxMemory(std::size_t maxMemory)
+{
+	TqMutexLock lock(g_maxMemoryLock);
+	m_maxMemory = maxMemory;
+}
+
+std::size_t CqTileCache::maxMemory() const
+{
+	TqMutexLock lock(g_maxMemoryLock);
+	return m_maxMemory;
+}
+
+TqUint CqTileCache::newOwner()
+{
+	TqMutexLock lock(g_ownerLock);
+	return m_nextOwner++;
+}
+
+void CqTileCache::removeOwner(TqUint owner)
+{
+	SqTileKey first(owner, INT_MIN, INT_MIN);
+	for(TqInt s = 0; s < m_numStripes; ++s)
+	{
+		SqStripe& stripe = m_stripes[s];
+		TqMutexLock lock(stripe.mutex);
+		SqStripe::TqIndex::iterator i = stripe.index.lower_bound(first);
+		while(i != stripe.index.end() && i->first.owner == owner)
+			stripe.erase(i++);
+	}
+}
+
+CqTileCache::TqTilePtr CqTileCache::find(const SqTileKey& key, bool countLookup)
+{
+	SqStripe& stripe = stripeFor(key);
+	TqMutexLock lock(stripe.mutex);
+	SqStripe::TqIndex::iterator i = stripe.index.find(key);
+	if(i == stripe.index.end())
+	{
+		if(countLookup)
+			++stripe.stats.misses;
+		return TqTilePtr();
+	}
+	if(countLookup)
+		++stripe.stats.hits;
+	// Move to the front of the LRU list.
+	stripe.lru.splice(stripe.lru.begin(), stripe.lru, i->second);
+	return i->second->tile;
+}
+
+CqTileCache::TqTilePtr CqTileCache::insert(const SqTileKey& key,
+		const TqTilePtr& tile, std::size_t size)
+{
+	SqStripe& stripe = stripeFor(key);
+	TqMutexLock lock(stripe.mutex);
+	SqStripe::TqIndex::iterator i = stripe.index.find(key);
+	if(i != stripe.index.end())
+		return i->second->tile;
+	stripe.lru.push_front(SqStripe::SqEntry(key, tile, size));
+	stripe.index.insert(std::make_pair(key, stripe.lru.begin()));
+	stripe.stats.memoryUsed += size;
+	stripe.stats.peakMemory = std::max(stripe.stats.peakMemory,
+			stripe.stats.memoryUsed);
+	stripe.evict(maxMemory()/m_numStripes);
+	return tile;
+}
+
+void CqTileCache::clear()
+{
+	for(TqInt s = 0; s < m_numStripes; ++s)
+	{
+		SqStripe& stripe = m_stripes[s];
+		TqMutexLock lock(stripe.mutex);
+		stripe.lru.clear();
+		stripe.index.clear();
+		stripe.stats.memoryUsed = 0;
+	}
+}
+
+SqTileCacheStats CqTileCache::stats() const
+{
+	SqTileCacheStats total;
+	for(TqInt s = 0; s < m_numStripes; ++s)
+	{
+		const SqStripe& stripe = m_stripes[s];
+		TqMutexLock lock(stripe.mutex);
+		total.hits += stripe.stats.hits;
+		total.misses += stripe.stats.misses;
+		total.evictions += stripe.stats.evictions;
+		total.memoryUsed += stripe.stats.memoryUsed;
+		// The stripes peak at different times, so this is an upper bound.
+		total.peakMemory += stripe.stats.peakMemory;
+	}
+	return total;
+}
+
+void CqTileCache::resetStats()
+{
+	for(TqInt s = 0; s < m_numStripes; ++s)
+	{
+		SqStripe& stripe = m_stripes[s];
+		TqMutexLock lock(stripe.mutex);
+		stripe.stats.hits = 0;
+		stripe.stats.misses = 0;
+		stripe.stats.evictions = 0;
+		stripe.stats.peakMemory = stripe.stats.memoryUsed;
+	}
+}
+
+CqTileCache::SqStripe& CqTileCache::stripeFor(const SqTileKey& key) const
+{
+	// Neighbouring tiles should land in different stripes, so mix all the
+	// key fields together.
+	TqUint h = key.owner*2654435761u;
+	h = (h ^ static_cast<TqUint>(key.x))*2246822519u;
+	h = (h ^ static_cast<TqUint>(key.y))*3266489917u;
+	return m_stripes[(h >> 16) % m_numStripes];
+}
+
+
+//------------------------------------------------------------------------------
+// CqTileCache::CqReadLock implementation
+
+CqTileCache::CqReadLock::CqReadLock(const void* file)
+	: m_index((reinterpret_cast<std::size_t>(file) >> 4) % numReadLocks)
+{
+	g_readLocks[m_index].lock();
+}
+
+CqTileCache::CqReadLock::~CqReadLock()
+{
+	g_readLocks[m_index].unlock();
+}
+
+
+//------------------------------------------------------------------------------
+// CqTilePrefetcher implementation
+
+/// Request queue and worker threads for CqTilePrefetcher.
+struct CqTilePrefetcher::SqState
+{
+	struct SqRequest
+	{
+		SqTileKey key;
+		TqLoadFunc load;
+
+		SqRequest(const SqTileKey& key, const TqLoadFunc& load)
+			: key(key), load(load)
+		{ }
+	};
+
+	/// Requests in the order they were made.
+	std::deque<SqRequest> queue;
+	/// Keys of the queued requests.
+	std::set<SqTileKey> queued;
+	/// Owners of the tiles currently being loaded, one entry per tile.
+	std::multiset<TqUint> loading;
+#ifdef ENABLE_THREADING
+	bool stop;
+	boost::mutex mutex;
+	/// Signalled when a request is queued, or the threads should stop.
+	boost::condition workAvailable;
+	/// Signalled when a thread finishes loading a tile.
+	boost::condition loadDone;
+	std::vector<boost::shared_ptr<boost::thread> > threads;
+
+	SqState()
+		: stop(false)
+	{ }
+
+	void workerLoop()
+	{
+		boost::mutex::scoped_lock lock(mutex);
+		while(true)
+		{
+			while(!stop && queue.empty())
+				workAvailable.wait(lock);
+			if(stop)
+				return;
+			SqRequest request = queue.front();
+			queue.pop_front();
+			queued.erase(request.key);
+			std::multiset<TqUint>::iterator owner = loading.insert(request.key.owner);
+			lock.unlock();
+			try
+			{
+				request.load();
+			}
+			catch(...)
+			{
+				// Leave errors to be reported when the tile is read on
+				// demand by the shading thread.
+			}
+			lock.lock();
+			loading.erase(owner);
+			loadDone.notify_all();
+		}
+	}
+
+	/** Stop and join all the worker threads.
+	 *
+	 * Requests made while the threads are stopping are dropped, since they
+	 * would otherwise start threads which exit straight away.
+	 */
+	void stopThreads()
+	{
+		std::vector<boost::shared_ptr<boost::thread> > stopping;
+		{
+			boost::mutex::scoped_lock lock(mutex);
+			stop = true;
+			stopping.swap(threads);
+			workAvailable.notify_all();
+		}
+		for(TqInt i = 0, end = stopping.size(); i < end; ++i)
+			stopping[i]->join();
+		boost::mutex::scoped_lock lock(mutex);
+		stop = false;
+	}
+#endif
+};
+
+CqTilePrefetcher::CqTilePrefetcher()
+	: m_numThreads(0),
+	m_state(new SqState())
+{ }
+
+CqTilePrefetcher::~CqTilePrefetcher()
+{
+#ifdef ENABLE_THREADING
+	m_state->stopThreads();
+#endif
+}
+
+CqTilePrefetcher& CqTilePrefetcher::instance()
+{
+	static CqTilePrefetcher prefetcher;
+	return prefetcher;
+}
+
+void CqTilePrefetcher::setNumThreads(TqInt numThreads)
+{
+#ifdef ENABLE_THREADING
+	numThreads = std::max(numThreads, 0);
+	// Surplus threads are stopped by restarting the pool; it's only resized
+	// between frames.
+	TqInt numRunning = 0;
+	{
+		boost::mutex::scoped_lock lock(m_state->mutex);
+		m_numThreads = numThreads;
+		numRunning = m_state->threads.size();
+	}
+	if(numThreads < numRunning)
+		m_state->stopThreads();
+#endif
+}
+
+bool CqTilePrefetcher::enabled() const
+{
+#ifdef ENABLE_THREADING
+	boost::mutex::scoped_lock lock(m_state->mutex);
+	return m_numThreads > 0;
+#else
+	return false;
+#endif
+}
+
+void CqTilePrefetcher::request(const SqTileKey& key, const TqLoadFunc& load)
+{
+#ifdef ENABLE_THREADING
+	boost::mutex::scoped_lock lock(m_state->mutex);
+	if(m_numThreads <= 0 || m_state->stop
+			|| m_state->queue.size() >= maxQueuedPrefetches
+			|| !m_state->queued.insert(key).second)
+		return;
+	m_state->queue.push_back(SqState::SqRequest(key, load));
+	while(static_cast<TqInt>(m_state->threads.size()) < m_numThreads)
+	{
+		m_state->threads.push_back(boost::shared_ptr<boost::thread>(new boost::thread(
+				boost::bind(&SqState::workerLoop, m_state.get()))));
+	}
+	m_state->workAvailable.notify_one();
+#endif
+}
+
+void CqTilePrefetcher::removeOwner(TqUint owner)
+{
+#ifdef ENABLE_THREADING
+	boost::mutex::scoped_lock lock(m_state->mutex);
+	SqTileKey first(owner, INT_MIN, INT_MIN);
+	std::set<SqTileKey>::iterator i = m_state->queued.lower_bound(first);
+	if(i != m_state->queued.end() && i->owner == owner)
+	{
+		while(i != m_state->queued.end() && i->owner == owner)
+			m_state->queued.erase(i++);
+		std::deque<SqState::SqRequest> remaining;
+		for(std::deque<SqState::SqRequest>::const_iterator r = m_state->queue.begin();
+				r != m_state->queue.end(); ++r)
+		{
+			if(r->key.owner != owner)
+				remaining.push_back(*r);
+		}
+		m_state->queue.swap(remaining);
+	}
+	while(m_state->loading.count(owner) > 0)
+		m_state->loadDone.wait(lock);
+#endif
+}
+
+} // namespace Aqsis
@@ -0,0 +1,186 @@
+// Aqsis
+// Copyright (C) 2001, Paul C. Gregory and the other authors and contributors
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// * Neither the name of the software's owners nor the names of its
+//   contributors may be used to endorse or promote products derived from this
+//   software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+// (This is the New BSD license)
+
+/** \file
+ *
+ * \brief Unit tests for the texture tile cache
+ */
+
+#include <aqsis/tex/buffers/tilecache.h>
+
+#include <boost/bind.hpp>
+#ifdef ENABLE_THREADING
+#include <boost/thread/thread.hpp>
+#endif
+
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/auto_unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(tilecache_tests)
+
+using Aqsis::CqTileCache;
+using Aqsis::CqTilePrefetcher;
+using Aqsis::SqTileKey;
+
+namespace {
+CqTileCache::TqTilePtr makeTile(int value)
+{
+	return CqTileCache::TqTilePtr(new int(value));
+}
+
+void loadTile(CqTileCache* cache, SqTileKey key)
+{
+	cache->insert(key, makeTile(key.x), 10);
+}
+}
+
+BOOST_AUTO_TEST_CASE(tilecache_find_insert)
+{
+	CqTileCache cache(1024*1024);
+	TqUint owner = cache.newOwner();
+	SqTileKey key(owner, 1, 2);
+	BOOST_CHECK(!cache.find(key));
+
+	CqTileCache::TqTilePtr tile = makeTile(42);
+	BOOST_CHECK(cache.insert(key, tile, 100) == tile);
+	BOOST_CHECK(cache.find(key) == tile);
+
+	// A second insert of the same key keeps the resident tile.
+	BOOST_CHECK(cache.insert(key, makeTile(0), 100) == tile);
+
+	Aqsis::SqTileCacheStats stats = cache.stats();
+	BOOST_CHECK_EQUAL(stats.hits, 1U);
+	BOOST_CHECK_EQUAL(stats.misses, 1U);
+	BOOST_CHECK_EQUAL(stats.memoryUsed, 100U);
+}
+
+BOOST_AUTO_TEST_CASE(tilecache_memory_limit)
+{
+	const std::size_t tileSize = 1000;
+	const std::size_t maxMemory = 64*tileSize;
+	CqTileCache cache(maxMemory);
+	TqUint owner = cache.newOwner();
+	for(int y = 0; y < 32; ++y)
+		for(int x = 0; x < 32; ++x)
+			cache.insert(SqTileKey(owner, x, y), makeTile(x), tileSize);
+
+	Aqsis::SqTileCacheStats stats = cache.stats();
+	BOOST_CHECK(stats.memoryUsed <= maxMemory);
+	BOOST_CHECK_EQUAL(stats.evictions*tileSize + stats.memoryUsed,
+			32*32*tileSize);
+	// The most recently inserted tile is always resident.
+	BOOST_CHECK(cache.find(SqTileKey(owner, 31, 31)));
+}
+
+BOOST_AUTO_TEST_CASE(tilecache_lru_order)
+{
+	// Every stripe gets a budget of two tiles.
+	CqTileCache cache(16*2*10);
+	TqUint owner = cache.newOwner();
+	// Keep touching tile 0 while inserting others; it should never be
+	// evicted since other tiles in its stripe are always older.
+	SqTileKey key0(owner, 0, 0);
+	cache.insert(key0, makeTile(0), 10);
+	for(int i = 1; i < 200; ++i)
+	{
+		cache.insert(SqTileKey(owner, i, 0), makeTile(i), 10);
+		BOOST_CHECK(cache.find(key0));
+	}
+}
+
+BOOST_AUTO_TEST_CASE(tilecache_remove_owner)
+{
+	CqTileCache cache(1024*1024);
+	TqUint owner1 = cache.newOwner();
+	TqUint owner2 = cache.newOwner();
+	for(int i = 0; i < 10; ++i)
+	{
+		cache.insert(SqTileKey(owner1, i, 0), makeTile(i), 10);
+		cache.insert(SqTileKey(owner2, i, 0), makeTile(i), 10);
+	}
+	cache.removeOwner(owner1);
+	BOOST_CHECK_EQUAL(cache.stats().memoryUsed, 100U);
+	BOOST_CHECK(!cache.find(SqTileKey(owner1, 3, 0)));
+	BOOST_CHECK(cache.find(SqTileKey(owner2, 3, 0)));
+
+	cache.clear();
+	BOOST_CHECK_EQUAL(cache.stats().memoryUsed, 0U);
+}
+
+BOOST_AUTO_TEST_CASE(tilecache_uncounted_find)
+{
+	CqTileCache cache(1024*1024);
+	SqTileKey key(cache.newOwner(), 0, 0);
+	BOOST_CHECK(!cache.find(key, false));
+	cache.insert(key, makeTile(1), 10);
+	BOOST_CHECK(cache.find(key, false));
+	Aqsis::SqTileCacheStats stats = cache.stats();
+	BOOST_CHECK_EQUAL(stats.hits, 0U);
+	BOOST_CHECK_EQUAL(stats.misses, 0U);
+}
+
+BOOST_AUTO_TEST_CASE(tileprefetcher_disabled)
+{
+	CqTileCache cache(1024*1024);
+	CqTilePrefetcher prefetcher;
+	BOOST_CHECK(!prefetcher.enabled());
+	SqTileKey key(cache.newOwner(), 0, 0);
+	prefetcher.request(key, boost::bind(&loadTile, &cache, key));
+	prefetcher.removeOwner(key.owner);
+	BOOST_CHECK(!cache.find(key));
+}
+
+#ifdef ENABLE_THREADING
+BOOST_AUTO_TEST_CASE(tileprefetcher_load)
+{
+	CqTileCache cache(1024*1024);
+	TqUint owner = cache.newOwner();
+	CqTilePrefetcher prefetcher;
+	prefetcher.setNumThreads(2);
+	BOOST_CHECK(prefetcher.enabled());
+	const int numTiles = 20;
+	for(int i = 0; i < numTiles; ++i)
+	{
+		SqTileKey key(owner, i, 0);
+		prefetcher.request(key, boost::bind(&loadTile, &cache, key));
+		// Repeated requests are ignored.
+		prefetcher.request(key, boost::bind(&loadTile, &cache, key));
+	}
+	// Wait up to a few seconds for the threads to work through the queue.
+	for(int wait = 0; wait < 500 && cache.stats().memoryUsed < numTiles*10U; ++wait)
+		boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+	BOOST_CHECK_EQUAL(cache.stats().memoryUsed, numTiles*10U);
+	for(int i = 0; i < numTiles; ++i)
+		BOOST_CHECK(cache.find(SqTileKey(owner, i, 0)));
+	prefetcher.removeOwner(owner);
+}
+#endif
+
+BOOST_AUTO_TEST_SUITE_END()
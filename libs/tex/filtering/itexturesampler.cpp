@@ -86,6 +86,10 @@ const CqTextureSampleOptions& IqTextureSampler::defaultSampleOptions() const
 	return defaultOptions;
 }
 
+void IqTextureSampler::prefetch(const SqSamplePllgram* samplePllgrams,
+		const CqTextureSampleOptions* sampleOpts, TqInt numPllgrams) const
+{ }
+
 boost::shared_ptr<IqTextureSampler> IqTextureSampler::create(
 		const boost::shared_ptr<IqTiledTexInputFile>& file)
 {
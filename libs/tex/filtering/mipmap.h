@@ -44,6 +44,9 @@
 #include <vector>
 
 #include <boost/shared_ptr.hpp>
+#ifdef ENABLE_THREADING
+#include <boost/thread/mutex.hpp>
+#endif
 
 #include <aqsis/util/autobuffer.h>
 #include <aqsis/util/exception.h>
@@ -53,6 +56,7 @@
 #include <aqsis/tex/filtering/sampleaccum.h>
 #include <aqsis/tex/texexception.h>
 #include <aqsis/tex/filtering/texturesampleoptions.h>
+#include "ewafilter.h"
 
 namespace Aqsis
 {
@@ -119,10 +123,56 @@ class CqMipmap
 		void applyFilter(const FilterFactoryT& filterFactory,
 				const CqTextureSampleOptions& sampleOpts, TqFloat* outSamps);
 
+		/// Filter supports indexed by mipmap level.
+		typedef std::vector<std::vector<SqFilterSupport> > TqLevelSupports;
+		/** \brief Record the regions which applyFilter() would read.
+		 *
+		 * The mipmap levels are chosen exactly as for applyFilter(), and the
+		 * filter supports appended to the list for their level.
+		 *
+		 * \param filterFactory - filter factory, as for applyFilter()
+		 * \param sampleOpts - Sample options structure.
+		 * \param supports - destination for the supports.
+		 */
+		template<typename FilterFactoryT>
+		void addFilterSupports(const FilterFactoryT& filterFactory,
+				const CqTextureSampleOptions& sampleOpts,
+				TqLevelSupports& supports) const;
+		/** \brief Start loading the texture tiles covered by a set of supports.
+		 *
+		 * Supports lying outside the texture are wrapped back onto it using
+		 * the wrap modes in sampleOpts.
+		 *
+		 * \param supports - supports from addFilterSupports()
+		 * \param sampleOpts - Sample options structure.
+		 */
+		void prefetch(const TqLevelSupports& supports,
+				const CqTextureSampleOptions& sampleOpts) const;
+
 	private:
 		/// Initialize all mipmap levels
 		void initLevels();
 
+		/** \brief Choose the mipmap level to filter a region over.
+		 *
+		 * \param filterFactory - factory for filters over the region.
+		 * \param sampleOpts - sample options structure
+		 * \param levelCts - set to the continuous level position.
+		 * \param useLerp - set to whether the next level should also be
+		 *            filtered over and the results interpolated.
+		 * \return the level to use.
+		 */
+		template<typename FilterFactoryT>
+		TqInt selectLevel(const FilterFactoryT& filterFactory,
+				const CqTextureSampleOptions& sampleOpts, TqFloat& levelCts,
+				bool& useLerp) const;
+		/** \brief Get the region of a level to filter over.
+		 *
+		 * \param level - mipmap level
+		 * \param weights - filter weights for the level.
+		 */
+		SqFilterSupport levelSupport(TqInt level, const CqEwaFilter& weights) const;
+
 		/** \brief Filter the given mipmap level into a sample array.
 		 *
 		 * \param level - mipmap level to filter over.
@@ -156,6 +206,10 @@ class CqMipmap
 		 * demand.  Mutable so that levels can be added on demand.
 		 */
 		mutable std::vector<boost::shared_ptr<TextureBufferT> > m_levels;
+#ifdef ENABLE_THREADING
+		/// Lock protecting the on-demand creation of m_levels.
+		mutable boost::mutex m_levelsMutex;
+#endif
 		/// Transformation information for each level.
 		std::vector<SqLevelTrans> m_levelTransforms;
 		/// Width of the first mipmap level
@@ -219,6 +273,9 @@ CqMipmap<TextureBufferT>::CqMipmap(
 			const boost::shared_ptr<IqTiledTexInputFile>& file)
 	: m_texFile(file),
 	m_levels(),
+#ifdef ENABLE_THREADING
+	m_levelsMutex(),
+#endif
 	m_levelTransforms(),
 	m_width0(0),
 	m_height0(0),
@@ -258,59 +315,17 @@ template<typename FilterFactoryT>
 void CqMipmap<TextureBufferT>::applyFilter(const FilterFactoryT& filterFactory,
 		const CqTextureSampleOptions& sampleOpts, TqFloat* outSamps)
 {
-	// Select mipmap level to use.
-	//
-	// The minimum filter width is the minimum number of pixels over which the
-	// shortest length scale of the filter should extend.
-	TqFloat minFilterWidth = sampleOpts.minWidth();
-	// Blur ratio ranges from 0 at no blur to 1 for a "lot" of blur.
-	TqFloat blurRatio = 0;
-	if(sampleOpts.lerp() == Lerp_Auto && (sampleOpts.sBlur() != 0 || sampleOpts.tBlur() != 0))
-	{
-		// When using blur, the minimum filter width needs to be increased.
-		//
-		// Experiments show that for large blur factors minFilterWidth should
-		// be about 4 for good results.
-		TqFloat maxBlur = max(sampleOpts.sBlur()*m_width0,
-				sampleOpts.tBlur()*m_height0);
-		// To estimate how much to increase the blur, we take the ratio of the
-		// the blur to the computed width of the minor axis of the filter.
-		// This should be near 0 for blur which doesn't effect the filtering
-		// much, and a asymptote to a positive constant when the blur is the
-		// dominant factor.
-		blurRatio = clamp(2*maxBlur/filterFactory.minorAxisWidth(), 0.0f, 1.0f);
-		minFilterWidth += 2*blurRatio;
-	}
-	TqFloat levelCts = log2(filterFactory.minorAxisWidth()/minFilterWidth);
-	TqInt level = clamp<TqInt>(lfloor(levelCts), 0, numLevels()-1);
+	TqFloat levelCts = 0;
+	bool useLerp = false;
+	TqInt level = selectLevel(filterFactory, sampleOpts, levelCts, useLerp);
 
 	filterLevel(level, filterFactory, sampleOpts, outSamps);
 
 	// Sometimes we might want to interpolate between the filtered result
 	// already computed above and the next lower mipmap level.  We do that now
 	// if necessary.
-	if( ( sampleOpts.lerp() == Lerp_Always
-		|| (sampleOpts.lerp() == Lerp_Auto && blurRatio > 0.2) )
-		&& level < numLevels()-1 && levelCts > 0)
+	if(useLerp)
 	{
-		// Use interpolation between the results of filtering on two different
-		// mipmap levels.  This should only be necessary if using filter blur,
-		// however the user can also turn it on explicitly using the "lerp"
-		// option.
-		//
-		// Experiments with large amounts of blurring show that some form of
-		// interpolation near level transitions is necessary to ensure that
-		// they're smooth and invisible.
-		//
-		// Such interpolation is mainly necessary when large regions of the
-		// output image arise from filtering over a small part of a high mipmap
-		// level - something which only occurs with artifically large filter
-		// widths such as those arising from lots of blur.
-		//
-		// Since this extra interpolation isn't really needed for small amounts
-		// of blur, we only do the interpolation when the blur ratio is large
-		// enough to make it worthwhile.
-
 		// Filter second level into tmpSamps.
 		CqAutoBuffer<TqFloat, 16> tmpSamps(sampleOpts.numChannels());
 		filterLevel(level+1, filterFactory, sampleOpts, tmpSamps.get());
@@ -328,11 +343,125 @@ void CqMipmap<TextureBufferT>::applyFilter(const FilterFactoryT& filterFactory,
 	// outSamps[level%sampleOpts.numCahnnels()] += 0.1;
 }
 
+template<typename TextureBufferT>
+template<typename FilterFactoryT>
+void CqMipmap<TextureBufferT>::addFilterSupports(
+		const FilterFactoryT& filterFactory,
+		const CqTextureSampleOptions& sampleOpts,
+		TqLevelSupports& supports) const
+{
+	TqFloat levelCts = 0;
+	bool useLerp = false;
+	TqInt level = selectLevel(filterFactory, sampleOpts, levelCts, useLerp);
+	supports.resize(numLevels());
+	for(TqInt l = level, end = useLerp ? level+2 : level+1; l < end; ++l)
+	{
+		const SqLevelTrans& trans = levelTrans(l);
+		CqEwaFilter weights = filterFactory.createFilter(
+			trans.xScale, trans.xOffset,
+			trans.yScale, trans.yOffset
+		);
+		supports[l].push_back(levelSupport(l, weights));
+	}
+}
+
+namespace detail {
+
+/** \brief Map a 1D support onto the texture range [0,size).
+ *
+ * Parts of the support lying outside the range are wrapped to the texels
+ * which filterTexture() would read for them.
+ *
+ * \param support - support to wrap
+ * \param size - size of the texture
+ * \param wrapMode - texture wrap mode
+ * \param out - the wrapped pieces (at most two) are appended here.
+ */
+inline void wrapSupport(const SqFilterSupport1D& support, TqInt size,
+		EqWrapMode wrapMode, std::vector<SqFilterSupport1D>& out)
+{
+	if(support.isEmpty())
+		return;
+	if(support.start >= 0 && support.end <= size)
+	{
+		out.push_back(support);
+		return;
+	}
+	switch(wrapMode)
+	{
+		case WrapMode_Periodic:
+			if(support.range() >= size)
+				out.push_back(SqFilterSupport1D(0, size));
+			else
+			{
+				TqInt start = support.start % size;
+				if(start < 0)
+					start += size;
+				TqInt end = start + support.range();
+				out.push_back(SqFilterSupport1D(start, min(end, size)));
+				if(end > size)
+					out.push_back(SqFilterSupport1D(0, end - size));
+			}
+			break;
+		case WrapMode_Clamp:
+			{
+				TqInt start = clamp(support.start, 0, size-1);
+				out.push_back(SqFilterSupport1D(start,
+							clamp(support.end, start+1, size)));
+			}
+			break;
+		default:
+			{
+				SqFilterSupport1D inside = intersect(support,
+						SqFilterSupport1D(0, size));
+				if(!inside.isEmpty())
+					out.push_back(inside);
+			}
+			break;
+	}
+}
+
+} // namespace detail
+
+template<typename TextureBufferT>
+void CqMipmap<TextureBufferT>::prefetch(const TqLevelSupports& supports,
+		const CqTextureSampleOptions& sampleOpts) const
+{
+	std::vector<SqFilterSupport> wrapped;
+	std::vector<SqFilterSupport1D> sx;
+	std::vector<SqFilterSupport1D> sy;
+	for(TqInt level = 0, end = supports.size(); level < end; ++level)
+	{
+		if(supports[level].empty())
+			continue;
+		const TextureBufferT& buffer = getLevel(level);
+		wrapped.clear();
+		for(TqInt i = 0, numSupports = supports[level].size(); i < numSupports; ++i)
+		{
+			const SqFilterSupport& support = supports[level][i];
+			sx.clear();
+			sy.clear();
+			detail::wrapSupport(support.sx, buffer.width(), sampleOpts.sWrapMode(), sx);
+			detail::wrapSupport(support.sy, buffer.height(), sampleOpts.tWrapMode(), sy);
+			for(TqInt j = 0, jEnd = sy.size(); j < jEnd; ++j)
+				for(TqInt k = 0, kEnd = sx.size(); k < kEnd; ++k)
+					wrapped.push_back(SqFilterSupport(sx[k], sy[j]));
+		}
+		if(!wrapped.empty())
+			buffer.prefetch(&wrapped[0], wrapped.size());
+	}
+}
+
 template<typename TextureBufferT>
 const TextureBufferT& CqMipmap<TextureBufferT>::getLevel(TqInt levelNum) const
 {
 	assert(levelNum < static_cast<TqInt>(m_levels.size()));
 	assert(levelNum >= 0);
+#ifdef ENABLE_THREADING
+	// Levels are shared by all the shading threads and the texture
+	// prefetcher, so creating them needs to be serialised.
+	boost::mutex::scoped_lock lock(m_levelsMutex);
+#endif
 	if(!m_levels[levelNum])
 	{
 		// read in requested level if it's not loaded yet.
@@ -417,6 +546,78 @@ void CqMipmap<TextureBufferT>::initLevels()
 	}
 }
 
+template<typename TextureBufferT>
+template<typename FilterFactoryT>
+TqInt CqMipmap<TextureBufferT>::selectLevel(const FilterFactoryT& filterFactory,
+		const CqTextureSampleOptions& sampleOpts, TqFloat& levelCts,
+		bool& useLerp) const
+{
+	// Select mipmap level to use.
+	//
+	// The minimum filter width is the minimum number of pixels over which the
+	// shortest length scale of the filter should extend.
+	TqFloat minFilterWidth = sampleOpts.minWidth();
+	// Blur ratio ranges from 0 at no blur to 1 for a "lot" of blur.
+	TqFloat blurRatio = 0;
+	if(sampleOpts.lerp() == Lerp_Auto && (sampleOpts.sBlur() != 0 || sampleOpts.tBlur() != 0))
+	{
+		// When using blur, the minimum filter width needs to be increased.
+		//
+		// Experiments show that for large blur factors minFilterWidth should
+		// be about 4 for good results.
+		TqFloat maxBlur = max(sampleOpts.sBlur()*m_width0,
+				sampleOpts.tBlur()*m_height0);
+		// To estimate how much to increase the blur, we take the ratio of the
+		// the blur to the computed width of the minor axis of the filter.
+		// This should be near 0 for blur which doesn't effect the filtering
+		// much, and a asymptote to a positive constant when the blur is the
+		// dominant factor.
+		blurRatio = clamp(2*maxBlur/filterFactory.minorAxisWidth(), 0.0f, 1.0f);
+		minFilterWidth += 2*blurRatio;
+	}
+	levelCts = log2(filterFactory.minorAxisWidth()/minFilterWidth);
+	TqInt level = clamp<TqInt>(lfloor(levelCts), 0, numLevels()-1);
+
+	// Use interpolation between the results of filtering on two different
+	// mipmap levels.  This should only be necessary if using filter blur,
+	// however the user can also turn it on explicitly using the "lerp"
+	// option.
+	//
+	// Experiments with large amounts of blurring show that some form of
+	// interpolation near level transitions is necessary to ensure that
+	// they're smooth and invisible.
+	//
+	// Such interpolation is mainly necessary when large regions of the
+	// output image arise from filtering over a small part of a high mipmap
+	// level - something which only occurs with artifically large filter
+	// widths such as those arising from lots of blur.
+	//
+	// Since this extra interpolation isn't really needed for small amounts
+	// of blur, we only do the interpolation when the blur ratio is large
+	// enough to make it worthwhile.
+	useLerp = ( sampleOpts.lerp() == Lerp_Always
+		|| (sampleOpts.lerp() == Lerp_Auto && blurRatio > 0.2) )
+		&& level < numLevels()-1 && levelCts > 0;
+	return level;
+}
+
+template<typename TextureBufferT>
+SqFilterSupport CqMipmap<TextureBufferT>::levelSupport(TqInt level,
+		const CqEwaFilter& weights) const
+{
+	SqFilterSupport support = weights.support();
+	if(level == numLevels() - 1)
+	{
+		// Truncate the support to a maximum size of 20x20 if we're on the
+		// highest mipmap level.  If we don't do this, the support can
+		// occasionally be very large, resulting in very long filter times.
+		TqInt cx = (support.sx.start + support.sx.end)/2;
+		TqInt cy = (support.sy.start + support.sy.end)/2;
+		support = intersect(support, SqFilterSupport(cx-10, cx+11, cy-10, cy+11));
+	}
+	return support;
+}
+
 template<typename TextureBufferT>
 template<typename FilterFactoryT>
 void CqMipmap<TextureBufferT>::filterLevel(
@@ -437,21 +638,11 @@ void CqMipmap<TextureBufferT>::filterLevel(
 		outSamps,
 		sampleOpts.fill()
 	);
-	SqFilterSupport support = weights.support();
-	if(level == numLevels() - 1)
-	{
-		// Truncate the support to a maximum size of 20x20 if we're on the
-		// highest mipmap level.  If we don't do this, the support can
-		// occasionally be very large, resulting in very long filter times.
-		TqInt cx = (support.sx.start + support.sx.end)/2;
-		TqInt cy = (support.sy.start + support.sy.end)/2;
-		support = intersect(support, SqFilterSupport(cx-10, cx+11, cy-10, cy+11));
-	}
 	// filter the texture
 	filterTexture(
 		accumulator,
 		getLevel(level),
-		support,
+		levelSupport(level, weights),
 		SqWrapModes(sampleOpts.sWrapMode(), sampleOpts.tWrapMode())
 	);
 }
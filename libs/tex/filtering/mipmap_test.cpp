@@ -0,0 +1,170 @@
+// Aqsis
+// Copyright (C) 2001, Paul C. Gregory and the other authors and contributors
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// * Neither the name of the software's owners nor the names of its
+//   contributors may be used to endorse or promote products derived from this
+//   software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+// (This is the New BSD license)
+
+/** \file
+ *
+ * \brief Unit tests for mipmap level selection and filtering.
+ */
+
+#include "mipmap.h"
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include <aqsis/tex/buffers/tilearray.h>
+#include "ewafilter.h"
+
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/auto_unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(mipmap_tests)
+
+using namespace Aqsis;
+
+namespace {
+
+const TqInt baseRes = 64;
+
+/// In-memory mipmapped file with a 64x64 base level of one float channel.
+class CqTestMipmapFile : public IqTiledTexInputFile
+{
+	public:
+		CqTestMipmapFile()
+		{
+			m_header.channelList().addChannel(
+					SqChannelInfo("r", Channel_Float32));
+		}
+		virtual boostfs::path fileName() const { return "test.tex"; }
+		virtual EqImageFileType fileType() const { return ImageFile_Tiff; }
+		virtual const CqTexFileHeader& header(TqInt index = 0) const
+		{
+			return m_header;
+		}
+		virtual SqTileInfo tileInfo() const { return SqTileInfo(8,8); }
+		virtual TqInt numSubImages() const { return 7; }
+		virtual TqInt width(TqInt index) const { return baseRes >> index; }
+		virtual TqInt height(TqInt index) const { return baseRes >> index; }
+	protected:
+		virtual void readTileImpl(TqUint8* buffer, TqInt tileX, TqInt tileY,
+				TqInt subImageIdx, const SqTileInfo tileSize) const
+		{
+			TqFloat* pixels = reinterpret_cast<TqFloat*>(buffer);
+			std::fill(pixels, pixels + tileSize.width*tileSize.height, 1.0f);
+		}
+	private:
+		CqTexFileHeader m_header;
+};
+
+/// Supports read from the mipmap levels, with the level they were read from.
+typedef std::vector<std::pair<TqInt, SqFilterSupport> > TqSupportList;
+TqSupportList g_supportsRead;
+
+/// Tile array recording the regions which are filtered over.
+class CqRecordingArray : public CqTileArray<TqFloat>
+{
+	public:
+		CqRecordingArray(const boost::shared_ptr<IqTiledTexInputFile>& file,
+				TqInt level)
+			: CqTileArray<TqFloat>(file, level),
+			m_level(level)
+		{ }
+		TqIterator begin(const SqFilterSupport& support) const
+		{
+			g_supportsRead.push_back(std::make_pair(m_level, support));
+			return CqTileArray<TqFloat>::begin(support);
+		}
+	private:
+		TqInt m_level;
+};
+
+typedef CqMipmap<CqRecordingArray> TqTestMipmap;
+
+/// Check that addFilterSupports() predicts what applyFilter() reads.
+void checkSupportsMatch(TqTestMipmap& mipmap, TqFloat width,
+		const CqTextureSampleOptions& sampleOpts)
+{
+	SqSamplePllgram pllgram(CqVector2D(0.5, 0.5), CqVector2D(width, 0),
+			CqVector2D(0, 0.5*width));
+	// Build the filter as CqTextureSampler does.
+	CqEwaFilterFactory factory(pllgram, baseRes, baseRes,
+			ewaBlurMatrix(sampleOpts.sBlur(), sampleOpts.tBlur()),
+			-sampleOpts.logTruncAmount());
+
+	TqTestMipmap::TqLevelSupports predicted;
+	mipmap.addFilterSupports(factory, sampleOpts, predicted);
+
+	g_supportsRead.clear();
+	TqFloat outSamps[1] = {0};
+	mipmap.applyFilter(factory, sampleOpts, outSamps);
+
+	TqSupportList expected;
+	for(TqInt level = 0; level < static_cast<TqInt>(predicted.size()); ++level)
+		for(TqInt i = 0; i < static_cast<TqInt>(predicted[level].size()); ++i)
+			expected.push_back(std::make_pair(level, predicted[level][i]));
+
+	BOOST_REQUIRE_EQUAL(g_supportsRead.size(), expected.size());
+	for(TqInt i = 0; i < static_cast<TqInt>(expected.size()); ++i)
+	{
+		const SqFilterSupport& read = g_supportsRead[i].second;
+		const SqFilterSupport& pred = expected[i].second;
+		BOOST_CHECK_EQUAL(g_supportsRead[i].first, expected[i].first);
+		BOOST_CHECK_EQUAL(read.sx.start, pred.sx.start);
+		BOOST_CHECK_EQUAL(read.sx.end, pred.sx.end);
+		BOOST_CHECK_EQUAL(read.sy.start, pred.sy.start);
+		BOOST_CHECK_EQUAL(read.sy.end, pred.sy.end);
+	}
+}
+
+} // unnamed namespace
+
+BOOST_AUTO_TEST_CASE(mipmap_addFilterSupports_matches_applyFilter)
+{
+	TqTestMipmap mipmap(boost::shared_ptr<IqTiledTexInputFile>(
+				new CqTestMipmapFile()));
+	CqTextureSampleOptions sampleOpts;
+	sampleOpts.setNumChannels(1);
+	const TqFloat widths[] = {0.005, 0.02, 0.1, 0.4};
+	for(TqInt i = 0; i < 4; ++i)
+	{
+		sampleOpts.setBlur(0);
+		sampleOpts.setLerp(Lerp_Auto);
+		checkSupportsMatch(mipmap, widths[i], sampleOpts);
+		// Blur raises the minimum filter width, and with Lerp_Auto makes the
+		// filter read from two levels.
+		sampleOpts.setBlur(0.05);
+		checkSupportsMatch(mipmap, widths[i], sampleOpts);
+		sampleOpts.setBlur(0);
+		sampleOpts.setLerp(Lerp_Always);
+		checkSupportsMatch(mipmap, widths[i], sampleOpts);
+	}
+}
+
+BOOST_AUTO_TEST_SUITE_END()
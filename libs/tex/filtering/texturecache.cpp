@@ -39,6 +39,7 @@
 
 #include <aqsis/util/exception.h>
 #include <aqsis/util/file.h>
+#include <aqsis/util/trace.h>
 #include <aqsis/tex/filtering/ienvironmentsampler.h>
 #include <aqsis/tex/filtering/iocclusionsampler.h>
 #include <aqsis/tex/filtering/ishadowsampler.h>
@@ -95,6 +96,9 @@ IqOcclusionSampler& CqTextureCache::findOcclusionSampler(const char* name)
 
 void CqTextureCache::flush()
 {
+#ifdef ENABLE_THREADING
+	boost::mutex::scoped_lock lock(m_mutex);
+#endif
 	m_textureCache.clear();
 	m_environmentCache.clear();
 	m_shadowCache.clear();
@@ -102,8 +106,24 @@ void CqTextureCache::flush()
 	m_texFileCache.clear();
 }
 
+void CqTextureCache::flush(const char* name)
+{
+#ifdef ENABLE_THREADING
+	boost::mutex::scoped_lock lock(m_mutex);
+#endif
+	TqUlong hash = CqString::hash(name);
+	m_textureCache.erase(hash);
+	m_environmentCache.erase(hash);
+	m_shadowCache.erase(hash);
+	m_occlusionCache.erase(hash);
+	m_texFileCache.erase(hash);
+}
+
 const CqTexFileHeader* CqTextureCache::textureInfo(const char* name)
 {
+#ifdef ENABLE_THREADING
+	boost::mutex::scoped_lock lock(m_mutex);
+#endif
 	boost::shared_ptr<IqTiledTexInputFile> file;
 	try
 	{
@@ -128,6 +148,9 @@ SamplerT& CqTextureCache::findSampler(
 		std::map<TqUlong, boost::shared_ptr<SamplerT> >& samplerMap,
 		const char* name)
 {
+#ifdef ENABLE_THREADING
+	boost::mutex::scoped_lock lock(m_mutex);
+#endif
 	TqUlong hash = CqString::hash(name);
 	typename std::map<TqUlong, boost::shared_ptr<SamplerT> >::const_iterator
 		texIter = samplerMap.find(hash);
@@ -173,6 +196,7 @@ boost::shared_ptr<IqTiledTexInputFile> CqTextureCache::getTextureFile(
 		// File exists in the cache; return it.
 		return fileIter->second;
 	// Else try to open the file and store it in the cache before returning it.
+	AQSIS_TRACE_SCOPE("Open_texture");
 	boostfs::path fullName = findFile(name, m_searchPathCallback());
 	boost::shared_ptr<IqTiledTexInputFile> file;
 	try
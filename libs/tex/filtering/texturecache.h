@@ -43,6 +43,9 @@
 #include <map>
 
 #include <boost/utility.hpp>
+#ifdef ENABLE_THREADING
+#include <boost/thread/mutex.hpp>
+#endif
 
 #include <aqsis/tex/filtering/itexturecache.h>
 #include <aqsis/math/matrix.h>
@@ -57,6 +60,11 @@ class IqTiledTexInputFile;
 class CqTexFileHeader;
 
 /** \brief A cache managing the various types of texture samplers.
+ *
+ * The samplers themselves are small; the bulk of the texture data is held in
+ * the global CqTileCache, which bounds the memory used.  Sampler lookups are
+ * serialised by a mutex so that shaders on several threads may share the
+ * cache.
  */
 #ifdef AQSIS_SYSTEM_WIN32
 class AQSIS_TEX_SHARE boost::noncopyable_::noncopyable;
@@ -77,6 +85,7 @@ class AQSIS_TEX_SHARE CqTextureCache : public IqTextureCache, private boost::non
 		virtual IqShadowSampler& findShadowSampler(const char* name);
 		virtual IqOcclusionSampler& findOcclusionSampler(const char* name);
 		virtual void flush();
+		virtual void flush(const char* name);
 		virtual const CqTexFileHeader* textureInfo(const char* name);
 		virtual void setCurrToWorldMatrix(const CqMatrix& currToWorld);
 
@@ -122,6 +131,10 @@ class AQSIS_TEX_SHARE CqTextureCache : public IqTextureCache, private boost::non
 		CqMatrix m_currToWorld;
 		/// Callback function to obtain the current texture search path.
 		TqSearchPathCallback m_searchPathCallback;
+#ifdef ENABLE_THREADING
+		/// Protects the sampler and file maps.
+		boost::mutex m_mutex;
+#endif
 };
 
 
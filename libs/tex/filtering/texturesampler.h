@@ -43,6 +43,7 @@
 #include <boost/shared_ptr.hpp>
 
 #include "ewafilter.h"
+#include <aqsis/tex/buffers/tilecache.h>
 #include <aqsis/tex/filtering/itexturesampler.h>
 #include "mipmap.h"
 
@@ -66,7 +67,13 @@ class AQSIS_TEX_SHARE CqTextureSampler : public IqTextureSampler
 		virtual void sample(const SqSamplePllgram& samplePllgram,
 				const CqTextureSampleOptions& sampleOpts, TqFloat* outSamps) const;
 		virtual const CqTextureSampleOptions& defaultSampleOptions() const;
+		virtual void prefetch(const SqSamplePllgram* samplePllgrams,
+				const CqTextureSampleOptions* sampleOpts, TqInt numPllgrams) const;
 	private:
+		/// Create the EWA filter factory for sampling the given region.
+		CqEwaFilterFactory filterFactory(const SqSamplePllgram& samplePllgram,
+				const CqTextureSampleOptions& sampleOpts) const;
+
 		boost::shared_ptr<LevelCacheT> m_levels;
 };
 
@@ -84,6 +91,32 @@ CqTextureSampler<LevelCacheT>::CqTextureSampler(
 template<typename LevelCacheT>
 void CqTextureSampler<LevelCacheT>::sample(const SqSamplePllgram& samplePllgram,
 		const CqTextureSampleOptions& sampleOpts, TqFloat* outSamps) const
+{
+	// Call through to the mipmap class to do the main filtering work.
+	m_levels->applyFilter(filterFactory(samplePllgram, sampleOpts),
+			sampleOpts, outSamps);
+}
+
+template<typename LevelCacheT>
+void CqTextureSampler<LevelCacheT>::prefetch(const SqSamplePllgram* samplePllgrams,
+		const CqTextureSampleOptions* sampleOpts, TqInt numPllgrams) const
+{
+	if(numPllgrams <= 0 || !CqTilePrefetcher::instance().enabled())
+		return;
+	typename LevelCacheT::TqLevelSupports supports;
+	for(TqInt i = 0; i < numPllgrams; ++i)
+	{
+		m_levels->addFilterSupports(filterFactory(samplePllgrams[i], sampleOpts[i]),
+				sampleOpts[i], supports);
+	}
+	// Wrap modes are uniform, so any of the options will do here.
+	m_levels->prefetch(supports, sampleOpts[0]);
+}
+
+template<typename LevelCacheT>
+CqEwaFilterFactory CqTextureSampler<LevelCacheT>::filterFactory(
+		const SqSamplePllgram& samplePllgram,
+		const CqTextureSampleOptions& sampleOpts) const
 {
 	// Scale width if necessary
 	SqSamplePllgram pllgram(samplePllgram);
@@ -93,12 +126,9 @@ void CqTextureSampler<LevelCacheT>::sample(const SqSamplePllgram& samplePllgram,
 			sampleOpts.tWrapMode() == WrapMode_Periodic);
 
 	// Construct EWA filter factory
-	CqEwaFilterFactory ewaFactory(pllgram, m_levels->width0(), m_levels->height0(),
+	return CqEwaFilterFactory(pllgram, m_levels->width0(), m_levels->height0(),
 			ewaBlurMatrix(sampleOpts.sBlur(), sampleOpts.tBlur()),
 			-sampleOpts.logTruncAmount());
-
-	// Call through to the mipmap class to do the main filtering work.
-	m_levels->applyFilter(ewaFactory, sampleOpts, outSamps);
 }
 
 template<typename LevelCacheT>
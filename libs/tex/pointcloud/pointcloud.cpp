@@ -41,6 +41,8 @@
 #include <float.h>
 #include <math.h>
 
+#include <algorithm>
+
 // The file structure is equivalent to the following.
 // Except it is in binary.
 //----------------------------------
@@ -97,6 +99,10 @@ typedef struct
 	int   datasize;
 	int   maxpoints;
 	PtcPointCloudKey *key;
+	// kd-tree over the keys, built when a file is opened for reading.  See
+	// buildTree() for the layout.
+	int   *tree;
+	unsigned char *treeaxis;
 }
 PtcPointCloudHandle;
 
@@ -104,12 +110,161 @@ PtcPointCloudHandle;
 #define MIN(a, b)  (((a) <= (b)) ? (a) : (b))
 #define MAX(a, b)  (((a) >= (b)) ? (a) : (b))
 
-int diff(const void *a, const void *b)
+//---------------------------------------------------------------------
+// kd-tree used to answer spatial queries.
+//
+// The tree is stored implicitly in ptc->tree, which is a permutation of the
+// key indices.  For the subrange [begin, end) the node itself is the element
+// at mid = (begin+end)/2; it splits the points along the axis treeaxis[mid],
+// with the points in [begin, mid) below the split and those in (mid, end)
+// above it.  The tree is balanced by construction, so no explicit child
+// pointers are needed.
+
+namespace {
+
+/// Orders key indices by one coordinate of the key position.
+struct PtcKeyLess
+{
+	const PtcPointCloudKey *key;
+	int axis;
+
+	PtcKeyLess(const PtcPointCloudKey *key, int axis) : key(key), axis(axis) {}
+	bool operator()(int a, int b) const
+	{
+		return key[a].point[axis] < key[b].point[axis];
+	}
+};
+
+void buildTree(PtcPointCloudHandle *ptc, int begin, int end)
 {
-	PtcPointCloudKey *A = (PtcPointCloudKey *) a;
-	PtcPointCloudKey *B = (PtcPointCloudKey *) b;
-	return  memcmp((void *) A->point, (void *) B->point, sizeof(float) * 3);
+	if (end - begin <= 1)
+	{
+		if (end > begin)
+			ptc->treeaxis[begin] = 0;
+		return;
+	}
+	// Split along the axis with the largest extent.
+	float bmin[3] = {FLT_MAX, FLT_MAX, FLT_MAX};
+	float bmax[3] = {-FLT_MAX, -FLT_MAX, -FLT_MAX};
+	for (int i = begin; i < end; i++)
+	{
+		const float *p = ptc->key[ptc->tree[i]].point;
+		for (int j = 0; j < 3; j++)
+		{
+			bmin[j] = MIN(bmin[j], p[j]);
+			bmax[j] = MAX(bmax[j], p[j]);
+		}
+	}
+	int axis = 0;
+	for (int j = 1; j < 3; j++)
+		if (bmax[j] - bmin[j] > bmax[axis] - bmin[axis])
+			axis = j;
+
+	int mid = (begin + end) / 2;
+	std::nth_element(ptc->tree + begin, ptc->tree + mid, ptc->tree + end,
+	                 PtcKeyLess(ptc->key, axis));
+	ptc->treeaxis[mid] = axis;
+	buildTree(ptc, begin, mid);
+	buildTree(ptc, mid + 1, end);
+}
+
+/// State for a nearest neighbour search.
+struct PtcNearestQuery
+{
+	const float *point;
+	int maxpoints;
+	/// Squared search radius; shrinks once maxpoints candidates are found.
+	float maxdist2;
+	int nfound;
+	/// Candidates found so far, as a max-heap on distance.
+	std::pair<float, int> *found;
+};
+
+void searchTree(const PtcPointCloudHandle *ptc, int begin, int end,
+                PtcNearestQuery &query)
+{
+	while (begin < end)
+	{
+		int mid = (begin + end) / 2;
+		int index = ptc->tree[mid];
+		const float *p = ptc->key[index].point;
+		float dx = p[0] - query.point[0];
+		float dy = p[1] - query.point[1];
+		float dz = p[2] - query.point[2];
+		float d2 = dx*dx + dy*dy + dz*dz;
+		if (d2 <= query.maxdist2)
+		{
+			if (query.nfound == query.maxpoints)
+			{
+				std::pop_heap(query.found, query.found + query.nfound);
+				--query.nfound;
+			}
+			query.found[query.nfound++] = std::make_pair(d2, index);
+			std::push_heap(query.found, query.found + query.nfound);
+			if (query.nfound == query.maxpoints)
+				query.maxdist2 = query.found[0].first;
+		}
+		// Descend into the near side first, then visit the far side only if
+		// the splitting plane is within the current search radius.
+		int axis = ptc->treeaxis[mid];
+		float delta = query.point[axis] - p[axis];
+		if (delta < 0)
+		{
+			searchTree(ptc, begin, mid, query);
+			if (delta*delta > query.maxdist2)
+				return;
+			begin = mid + 1;
+		}
+		else
+		{
+			searchTree(ptc, mid + 1, end, query);
+			if (delta*delta > query.maxdist2)
+				return;
+			end = mid;
+		}
+	}
 }
+
+/// Find up to maxpoints nearest keys within sqrt(maxdist2) of point.
+///
+/// The results are sorted, nearest first.  Returns the number found.
+int findNearest(const PtcPointCloudHandle *ptc, const float *point,
+                float maxdist2, int maxpoints, int *indices, float *distsquared)
+{
+	if (!ptc->tree || maxpoints <= 0)
+		return 0;
+	std::pair<float, int> *found = new std::pair<float, int>[maxpoints];
+	PtcNearestQuery query = {point, maxpoints, maxdist2, 0, found};
+	searchTree(ptc, 0, ptc->npoints, query);
+	std::sort_heap(found, found + query.nfound);
+	for (int i = 0; i < query.nfound; i++)
+	{
+		if (indices)
+			indices[i] = found[i].second;
+		if (distsquared)
+			distsquared[i] = found[i].first;
+	}
+	delete[] found;
+	return query.nfound;
+}
+
+/// Copy the data for a key out to the user supplied buffers.
+void copyKey(const PtcPointCloudHandle *ptc, int index, float *point,
+             float *normal, float *radius, float *user_data)
+{
+	const PtcPointCloudKey &key = ptc->key[index];
+	if (point != NULL)
+		memcpy(point, key.point, 3 * sizeof(float));
+	if (normal != NULL)
+		memcpy(normal, key.normal, 3 * sizeof(float));
+	if (radius != NULL)
+		*radius = key.radius;
+	if (user_data != NULL)
+		memcpy(user_data, key.user_data, ptc->datasize * sizeof(float));
+}
+
+} // unnamed namespace
+
 //---------------------------------------------------------------------
 /**
 * This function opens a given file for reading
@@ -210,6 +365,12 @@ extern "C" PtcPointCloud PtcOpenPointCloudFile ( const char *filename, int *nvar
 					ptc->key[i].user_data = (float *) (malloc(ptc->datasize * sizeof(float) ));
 					fread(ptc->key[i].user_data, sizeof(float), ptc->datasize, ptc->fp);
 				}
+
+				ptc->tree = (int *) malloc(ptc->npoints * sizeof(int));
+				ptc->treeaxis = (unsigned char *) malloc(ptc->npoints);
+				for (i = 0; i < ptc->npoints; i++)
+					ptc->tree[i] = i;
+				buildTree(ptc, 0, ptc->npoints);
 			}
 
 			if (nvars) *nvars = ptc->nvars;
@@ -378,69 +539,97 @@ extern "C" int PtcReadDataPoint ( PtcPointCloud pointcloud, float *point, float*
 	return error;
 }
 
+//---------------------------------------------------------------------
+/**
+* Finds the data point nearest to a given position.
+* \param pointcloud  The handle to the point cloud file as returned by
+*                  PtcOpenPointCloudFile.
+* \param point       The position to look up.
+* \param normal      Filled with the normal of the nearest point.
+* \param radius      Filled with the radius of the nearest point.
+* \param user_data   Filled with the user data of the nearest point.
+*
+* \return 1 if a point was found, 0 otherwise (the point cloud is empty).
+* note: normal, radius and user data can be null if their value is not needed.
+*/
 extern "C" int PtcFindDataPoint ( PtcPointCloud pointcloud, float *point, float*normal, float *radius, float *user_data )
 {
-	int error = 1;
 	PtcPointCloudHandle * ptc = (PtcPointCloudHandle *)(pointcloud);
+	if (!ptc || ptc->signature != PTCVERSION)
+		return 0;
 
-	if (!ptc || (ptc->signature != PTCVERSION || ptc->seek >= ptc->npoints))
-	{
-		error = 0;
-	}
-	else
-	{
-		// reject points outside the bounding box
-		if (point[0] < ptc->bbox[0] || point[1] < ptc->bbox[2]  || point[2] < ptc->bbox[4]  ||
-		        point[0] > ptc->bbox[1] || point[1] > ptc->bbox[3]  || point[2] > ptc->bbox[5] )
-			return 1;
-
-		int seek = ptc->seek;
-
-		// order all the read keys (once)
-		if (ptc->seek == 0)
-		{
-			qsort(ptc->key, ptc->npoints, sizeof(PtcPointCloudKey), diff);
-			ptc->seek = 1;
-		}
-
-
-		PtcPointCloudKey key;
-		memcpy((void *) key.point, point, 3 * sizeof(float));
-		PtcPointCloudKey *found = NULL;
-		if ((found = (PtcPointCloudKey *) bsearch(&key, ptc->key, ptc->npoints, sizeof(PtcPointCloudKey), diff)))
-		{
-			seek = found - ptc->key;
-		}
-		else
-		{
-			// Not found !!!
-			return 0;
-		}
+	int index = 0;
+	if (findNearest(ptc, point, FLT_MAX, 1, &index, NULL) == 0)
+		return 0;
+	copyKey(ptc, index, NULL, normal, radius, user_data);
+	return 1;
+}
 
-		// Try the previous value
-		if (seek != -1)
-		{
-			if (normal != NULL)
-			{
-				memcpy(normal,  ptc->key[seek].normal, 3 * sizeof(float));
-			}
-			if (user_data != NULL)
-			{
-				memcpy(user_data, ptc->key[seek].user_data, ptc->datasize * sizeof(float));
-			}
-			if (radius != NULL)
-			{
-				*radius =  ptc->key[seek].radius;
-			}
-		}
+//---------------------------------------------------------------------
+/**
+* Finds the data points nearest to a given position.
+* \param pointcloud  The handle to the point cloud file as returned by
+*                  PtcOpenPointCloudFile.
+* \param point       The position to look up.
+* \param maxpoints   Maximum number of points to find.
+* \param indices     Array of maxpoints ints filled with the indices of the
+*                  points found, nearest first.  The indices may be passed to
+*                  PtcGetDataPoint.
+* \param distsquared Array of maxpoints floats filled with the squared
+*                  distances to the points found.  May be null.
+*
+* \return the number of points found.
+*/
+extern "C" int PtcFindNearestDataPoints ( PtcPointCloud pointcloud, float *point, int maxpoints, int *indices, float *distsquared )
+{
+	PtcPointCloudHandle * ptc = (PtcPointCloudHandle *)(pointcloud);
+	if (!ptc || ptc->signature != PTCVERSION)
+		return 0;
+	return findNearest(ptc, point, FLT_MAX, maxpoints, indices, distsquared);
+}
 
-	}
+//---------------------------------------------------------------------
+/**
+* Finds the data points within a given distance of a position.
+*
+* If more than maxpoints points lie within the radius, the nearest maxpoints
+* of them are returned.  The parameters are as for PtcFindNearestDataPoints,
+* with
+* \param radius      The search radius.
+*
+* \return the number of points found.
+*/
+extern "C" int PtcFindDataPointsInRadius ( PtcPointCloud pointcloud, float *point, float radius, int maxpoints, int *indices, float *distsquared )
+{
+	PtcPointCloudHandle * ptc = (PtcPointCloudHandle *)(pointcloud);
+	if (!ptc || ptc->signature != PTCVERSION || radius < 0)
+		return 0;
+	return findNearest(ptc, point, radius*radius, maxpoints, indices, distsquared);
+}
 
-	return error;
+//---------------------------------------------------------------------
+/**
+* Reads the data point with the given index, as returned by
+* PtcFindNearestDataPoints or PtcFindDataPointsInRadius.  Indices run from 0
+* to npoints-1 in file order.  The output parameters are as for
+* PtcReadDataPoint.
+*
+* \return 1 if the operation is successful, 0 otherwise.
+*/
+extern "C" int PtcGetDataPoint ( PtcPointCloud pointcloud, int index, float *point, float*normal, float *radius, float *user_data )
+{
+	PtcPointCloudHandle * ptc = (PtcPointCloudHandle *)(pointcloud);
+	if (!ptc || ptc->signature != PTCVERSION || index < 0 || index >= ptc->npoints)
+		return 0;
+	copyKey(ptc, index, point, normal, radius, user_data);
+	return 1;
 }
+
 //---------------------------------------------------------------------
 /**
-* Closes a file opened with PtcOpenPointCloudFile.
+* Closes a file opened with PtcOpenPointCloudFile and frees the handle.  The
+* variable names and types returned by PtcOpenPointCloudFile are no longer
+* valid afterwards.
 */
 extern "C" void PtcClosePointCloudFile ( PtcPointCloud pointcloud )
 {
@@ -457,7 +646,26 @@ extern "C" void PtcClosePointCloudFile ( PtcPointCloud pointcloud )
 			fclose(ptc->fp);
 			ptc->fp = NULL;
 		}
-		ptc->seek = 0;
+		if (ptc->key)
+		{
+			for (int i = 0; i < ptc->maxpoints; i++)
+				free(ptc->key[i].user_data);
+			free(ptc->key);
+		}
+		if (ptc->vartypes || ptc->varnames)
+		{
+			for (int i = 0; i < ptc->nvars; i++)
+			{
+				free(ptc->vartypes[i]);
+				free(ptc->varnames[i]);
+			}
+			free(ptc->vartypes);
+			free(ptc->varnames);
+		}
+		free(ptc->tree);
+		free(ptc->treeaxis);
+		ptc->signature = 0;
+		delete ptc;
 	}
 }
 
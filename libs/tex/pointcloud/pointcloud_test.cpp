@@ -0,0 +1,144 @@
+// Aqsis
+// Copyright (C) 2001, Paul C. Gregory and the other authors and contributors
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// * Neither the name of the software's owners nor the names of its
+//   contributors may be used to endorse or promote products derived from this
+//   software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+// (This is the New BSD license)
+
+/** \file
+ *
+ * \brief Unit tests for the spatial queries of the point cloud API.
+ */
+
+#include <aqsis/ri/pointcloud.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <algorithm>
+
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/auto_unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(pointcloud_tests)
+
+namespace {
+
+const char* testFileName = "pointcloud_test.ptc";
+
+float randf()
+{
+	return std::rand()/static_cast<float>(RAND_MAX);
+}
+
+float dist2(const float* a, const float* b)
+{
+	float dx = a[0]-b[0], dy = a[1]-b[1], dz = a[2]-b[2];
+	return dx*dx + dy*dy + dz*dz;
+}
+
+// Write a cloud of random points, each carrying its own index as data.
+void writeCloud(std::vector<float>& positions, int npoints)
+{
+	const char* vartypes[] = {"float"};
+	const char* varnames[] = {"id"};
+	PtcPointCloud out = PtcCreatePointCloudFile(testFileName, 1, vartypes,
+			varnames, 0, 0, 0);
+	BOOST_REQUIRE(out);
+	for(int i = 0; i < npoints; ++i)
+	{
+		float P[3] = {randf(), randf(), randf()};
+		float N[3] = {0, 0, 1};
+		float id = i;
+		positions.insert(positions.end(), P, P+3);
+		PtcWriteDataPoint(out, P, N, 0.01f, &id);
+	}
+	PtcFinishPointCloudFile(out);
+}
+
+} // unnamed namespace
+
+BOOST_AUTO_TEST_CASE(pointcloud_nearest_matches_brute_force)
+{
+	std::srand(42);
+	const int npoints = 2000;
+	std::vector<float> positions;
+	writeCloud(positions, npoints);
+
+	int nvars = 0;
+	PtcPointCloud ptc = PtcOpenPointCloudFile(testFileName, &nvars, 0, 0);
+	BOOST_REQUIRE(ptc);
+	BOOST_CHECK_EQUAL(nvars, 1);
+
+	for(int q = 0; q < 100; ++q)
+	{
+		float P[3] = {1.2f*randf() - 0.1f, 1.2f*randf() - 0.1f,
+			1.2f*randf() - 0.1f};
+		std::vector<float> d2(npoints);
+		for(int i = 0; i < npoints; ++i)
+			d2[i] = dist2(P, &positions[3*i]);
+		std::vector<float> sorted = d2;
+		std::sort(sorted.begin(), sorted.end());
+
+		// Single nearest point; the id recovers which point was found.
+		float id = -1;
+		BOOST_REQUIRE(PtcFindDataPoint(ptc, P, 0, 0, &id));
+		BOOST_CHECK_EQUAL(d2[static_cast<int>(id)], sorted[0]);
+
+		// k nearest, sorted nearest first.
+		const int k = 8;
+		int indices[k];
+		float found2[k];
+		BOOST_REQUIRE_EQUAL(PtcFindNearestDataPoints(ptc, P, k, indices,
+					found2), k);
+		for(int i = 0; i < k; ++i)
+		{
+			BOOST_CHECK_EQUAL(found2[i], sorted[i]);
+			BOOST_CHECK_EQUAL(d2[indices[i]], found2[i]);
+		}
+
+		// Radius query
+		const float radius = 0.1f;
+		int expected = std::upper_bound(sorted.begin(), sorted.end(),
+				radius*radius) - sorted.begin();
+		std::vector<int> inRadius(npoints);
+		BOOST_CHECK_EQUAL(PtcFindDataPointsInRadius(ptc, P, radius, npoints,
+					&inRadius[0], 0), expected);
+	}
+
+	// Lookup by index is in file order.
+	float pos[3];
+	float id = -1;
+	BOOST_CHECK(PtcGetDataPoint(ptc, 10, pos, 0, 0, &id));
+	BOOST_CHECK_EQUAL(id, 10);
+	BOOST_CHECK_EQUAL(pos[0], positions[30]);
+	BOOST_CHECK(!PtcGetDataPoint(ptc, npoints, pos, 0, 0, 0));
+
+	PtcClosePointCloudFile(ptc);
+	std::remove(testFileName);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
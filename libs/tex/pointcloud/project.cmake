@@ -3,3 +3,7 @@ set(pointcloud_srcs
 )
 make_absolute(pointcloud_srcs ${pointcloud_SOURCE_DIR})
 
+set(pointcloud_test_srcs
+	pointcloud_test.cpp
+)
+make_absolute(pointcloud_test_srcs ${pointcloud_SOURCE_DIR})
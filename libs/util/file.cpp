@@ -28,16 +28,22 @@
 #include <aqsis/util/file.h>
 
 #include <cctype>
+#include <cstdio>
 #include <cstring>
 #include <fstream>
+#include <sstream>
 
 #ifdef AQSIS_SYSTEM_WIN32
 #	include <direct.h>
 #	include <io.h>
+#	include <process.h>
 #else
 #	include <glob.h>
+#	include <unistd.h>
 #endif
 
+#include <boost/detail/atomic_count.hpp>
+
 #include <boost/filesystem/path.hpp>
 #include <boost/filesystem/operations.hpp>
 
@@ -263,6 +269,37 @@ std::vector<std::string> cliGlob(const std::string& pattern)
 
 #endif // AQSIS_SYSTEM_WIN32
 
+//------------------------------------------------------------------------------
+// Temporary files
+
+std::string uniqueTempName(const std::string& fileName)
+{
+	static boost::detail::atomic_count counter(0);
+#ifdef AQSIS_SYSTEM_WIN32
+	long pid = _getpid();
+#else
+	long pid = getpid();
+#endif
+	std::ostringstream name;
+	name << fileName << "." << pid << "." << ++counter << ".tmp";
+	return name.str();
+}
+
+bool replaceFile(const std::string& tmpName, const std::string& fileName)
+{
+	if(std::rename(tmpName.c_str(), fileName.c_str()) == 0)
+		return true;
+#ifdef AQSIS_SYSTEM_WIN32
+	// Windows won't rename over an existing file.
+	std::remove(fileName.c_str());
+	if(std::rename(tmpName.c_str(), fileName.c_str()) == 0)
+		return true;
+#endif
+	std::remove(tmpName.c_str());
+	return false;
+}
+
+
 // Define BOOST_FILESYSTEM_VERSION for convenience; older boost versions don't
 // define this for us.
 #ifndef BOOST_FILESYSTEM_VERSION
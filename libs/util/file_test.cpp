@@ -83,6 +83,34 @@ BOOST_AUTO_TEST_CASE(findFile_test)
 }
 
 
+//------------------------------------------------------------------------------
+// Temporary file tests
+
+BOOST_AUTO_TEST_CASE(uniqueTempName_test)
+{
+	std::string name1 = uniqueTempName("./foo/out.dat");
+	std::string name2 = uniqueTempName("./foo/out.dat");
+	BOOST_CHECK(name1 != name2);
+	BOOST_CHECK_EQUAL(name1.compare(0, 13, "./foo/out.dat"), 0);
+}
+
+BOOST_AUTO_TEST_CASE(replaceFile_test)
+{
+	touch("./foo/replaced.txt");
+	std::string tmpName = uniqueTempName("./foo/replaced.txt");
+	{
+		boostfs::ofstream file(tmpName);
+		file << "new";
+	}
+	BOOST_CHECK(replaceFile(tmpName, "./foo/replaced.txt"));
+	BOOST_CHECK(!boostfs::exists(tmpName));
+	boostfs::ifstream file("./foo/replaced.txt");
+	std::string contents;
+	file >> contents;
+	BOOST_CHECK_EQUAL(contents, "new");
+}
+
+
 //------------------------------------------------------------------------------
 // Path tokenizer tests
 
@@ -0,0 +1,81 @@
+// Aqsis
+// Copyright (C) 1997 - 2001, Paul C. Gregory
+//
+// Contact: pgregory@aqsis.org
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation; either
+// version 2 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+/** \file
+		\brief Implements the global table of interned names.
+*/
+
+#include <aqsis/util/nametable.h>
+
+#include <map>
+#include <string>
+
+#include <aqsis/util/mutex.h>
+
+namespace Aqsis {
+
+namespace {
+
+typedef std::map<std::string, TqInt> TqNameMap;
+
+/// Construct the table on first use, so it can be used by static initialisers.
+TqNameMap& nameMap()
+{
+	static TqNameMap names;
+	return names;
+}
+
+/// Lock protecting the table, which is also reached from render threads
+/// when procedurals are expanded.
+TqMutex& nameMutex()
+{
+	static TqMutex mutex;
+	return mutex;
+}
+
+} // unnamed namespace
+
+TqInt CqNameTable::intern(const char* name)
+{
+	TqMutexLock lock(nameMutex());
+	TqNameMap& names = nameMap();
+	TqNameMap::iterator i = names.lower_bound(name);
+	if(i != names.end() && i->first == name)
+		return i->second;
+	TqInt id = names.size();
+	names.insert(i, TqNameMap::value_type(name, id));
+	return id;
+}
+
+TqInt CqNameTable::find(const char* name)
+{
+	TqMutexLock lock(nameMutex());
+	const TqNameMap& names = nameMap();
+	TqNameMap::const_iterator i = names.find(name);
+	return i == names.end() ? -1 : i->second;
+}
+
+TqInt CqNameTable::size()
+{
+	TqMutexLock lock(nameMutex());
+	return nameMap().size();
+}
+
+} // namespace Aqsis
@@ -0,0 +1,55 @@
+// Aqsis
+// Copyright (C) 1997 - 2001, Paul C. Gregory
+//
+// Contact: pgregory@aqsis.org
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation; either
+// version 2 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+/** \file
+ *
+ * \brief Unit tests for the interned name table.
+ */
+
+#include <aqsis/util/nametable.h>
+
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/auto_unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(nametable_tests)
+
+using namespace Aqsis;
+
+BOOST_AUTO_TEST_CASE(nametable_intern)
+{
+	TqInt a = CqNameTable::intern("nametable_test_a");
+	TqInt b = CqNameTable::intern("nametable_test_b");
+	BOOST_CHECK(a != b);
+	BOOST_CHECK(a >= 0 && a < CqNameTable::size());
+	BOOST_CHECK(b >= 0 && b < CqNameTable::size());
+	// Interning the same name again gives the same id.
+	BOOST_CHECK_EQUAL(CqNameTable::intern("nametable_test_a"), a);
+	BOOST_CHECK_EQUAL(CqNameTable::find("nametable_test_b"), b);
+}
+
+BOOST_AUTO_TEST_CASE(nametable_find_missing)
+{
+	TqInt size = CqNameTable::size();
+	BOOST_CHECK_EQUAL(CqNameTable::find("nametable_test_missing"), -1);
+	// find() doesn't add names.
+	BOOST_CHECK_EQUAL(CqNameTable::size(), size);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
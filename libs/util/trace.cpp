@@ -0,0 +1,282 @@
+// Aqsis
+// Copyright (C) 1997 - 2001, Paul C. Gregory
+//
+// Contact: pgregory@aqsis.org
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation; either
+// version 2 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+/** \file
+ * \brief Per-thread wall clock tracing of renderer operations.
+ */
+
+#include <aqsis/util/trace.h>
+
+#include <ostream>
+#include <vector>
+
+#ifdef AQSIS_SYSTEM_WIN32
+#include <Windows.h>		/* QueryPerformanceCounter() */
+#else
+#include <sys/time.h>		/* gettimeofday() */
+#endif
+
+#ifdef ENABLE_THREADING
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/tss.hpp>
+#endif
+
+namespace Aqsis {
+
+bool g_tracingEnabled = false;
+
+namespace {
+
+/// Wall clock time in microseconds from an arbitrary origin.
+boost::uint64_t wallClockTime()
+{
+#ifdef AQSIS_SYSTEM_WIN32
+	LARGE_INTEGER freq;
+	LARGE_INTEGER count;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&count);
+	return static_cast<boost::uint64_t>(count.QuadPart
+			/ (static_cast<double>(freq.QuadPart) * 1e-6));
+#else
+	timeval t;
+	gettimeofday(&t, 0);
+	return static_cast<boost::uint64_t>(t.tv_sec)*1000000 + t.tv_usec;
+#endif
+}
+
+struct SqTraceEvent
+{
+	const char* name;
+	boost::uint64_t start;
+	boost::uint64_t end;
+	TqInt x;
+	TqInt y;
+};
+
+/** \brief Ring buffer of the events recorded by one thread.
+ *
+ * Only the owning thread adds events, but the buffer is locked so that it
+ * can be written out or cleared while the thread is still running.
+ */
+class CqTraceBuffer
+{
+	public:
+		CqTraceBuffer(TqInt threadId, TqInt size)
+			: m_threadId(threadId),
+			m_events(size),
+			m_next(0),
+			m_count(0),
+			m_dropped(0),
+			m_threadDone(false)
+		{ }
+
+		void push(const SqTraceEvent& event)
+		{
+#			ifdef ENABLE_THREADING
+			boost::mutex::scoped_lock lock(m_mutex);
+#			endif
+			TqInt size = m_events.size();
+			if(size == 0)
+				return;
+			m_events[m_next] = event;
+			m_next = (m_next + 1) % size;
+			if(m_count < size)
+				++m_count;
+			else
+				++m_dropped;
+		}
+
+		/// Write the events oldest first, and return the number written.
+		TqInt write(std::ostream& out, bool& first)
+		{
+#			ifdef ENABLE_THREADING
+			boost::mutex::scoped_lock lock(m_mutex);
+#			endif
+			TqInt size = m_events.size();
+			for(TqInt i = 0; i < m_count; ++i)
+			{
+				const SqTraceEvent& e = m_events[(m_next - m_count + i + size) % size];
+				// A scope which was open when tracing was restarted may end
+				// before it started on the new clock.
+				boost::uint64_t duration = e.end > e.start ? e.end - e.start : 0;
+				out << (first ? "\n" : ",\n")
+					<< "{\"name\":\"" << e.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":"
+					<< m_threadId << ",\"ts\":" << e.start << ",\"dur\":" << duration;
+				if(e.x >= 0)
+					out << ",\"args\":{\"x\":" << e.x << ",\"y\":" << e.y << "}";
+				out << "}";
+				first = false;
+			}
+			return m_count;
+		}
+
+		/// Discard all events and change the buffer size.
+		void reset(TqInt size)
+		{
+#			ifdef ENABLE_THREADING
+			boost::mutex::scoped_lock lock(m_mutex);
+#			endif
+			std::vector<SqTraceEvent>(size).swap(m_events);
+			m_next = 0;
+			m_count = 0;
+			m_dropped = 0;
+		}
+
+		TqInt threadId() const { return m_threadId; }
+		TqInt dropped() const { return m_dropped; }
+		bool threadDone() const { return m_threadDone; }
+		void setThreadDone() { m_threadDone = true; }
+
+	private:
+		TqInt m_threadId;
+		std::vector<SqTraceEvent> m_events;
+		/// Position of the next event to be written.
+		TqInt m_next;
+		/// Number of valid events in the buffer.
+		TqInt m_count;
+		/// Number of events overwritten because the buffer was full.
+		TqInt m_dropped;
+		/// True once the owning thread has exited.
+		bool m_threadDone;
+#		ifdef ENABLE_THREADING
+		boost::mutex m_mutex;
+#		endif
+};
+
+// The buffers of all threads which have recorded events.  The buffers
+// outlive their threads so that the events of bucket threads are still
+// available when the trace is written at the end of the frame.
+std::vector<CqTraceBuffer*> g_buffers;
+TqInt g_bufferSize = 0;
+TqInt g_nextThreadId = 0;
+boost::uint64_t g_traceOrigin = 0;
+
+#ifdef ENABLE_THREADING
+
+boost::mutex g_buffersMutex;
+
+/// Called when a thread exits; the buffer is deleted once it's written out.
+void releaseThreadBuffer(CqTraceBuffer* buffer)
+{
+	boost::mutex::scoped_lock lock(g_buffersMutex);
+	buffer->setThreadDone();
+}
+
+boost::thread_specific_ptr<CqTraceBuffer> g_threadBuffer(&releaseThreadBuffer);
+
+#else
+
+CqTraceBuffer* g_threadBuffer = 0;
+
+#endif
+
+/// Get the buffer for the current thread, creating it if necessary.
+CqTraceBuffer& threadBuffer()
+{
+#ifdef ENABLE_THREADING
+	CqTraceBuffer* buffer = g_threadBuffer.get();
+	if(!buffer)
+	{
+		boost::mutex::scoped_lock lock(g_buffersMutex);
+		buffer = new CqTraceBuffer(g_nextThreadId++, g_bufferSize);
+		g_buffers.push_back(buffer);
+		g_threadBuffer.reset(buffer);
+	}
+	return *buffer;
+#else
+	if(!g_threadBuffer)
+	{
+		g_threadBuffer = new CqTraceBuffer(g_nextThreadId++, g_bufferSize);
+		g_buffers.push_back(g_threadBuffer);
+	}
+	return *g_threadBuffer;
+#endif
+}
+
+/** Reset the buffers to the given size, deleting those whose threads have
+ * exited.  The buffer mutex must be held by the caller.
+ */
+void resetBuffers(TqInt size)
+{
+	std::vector<CqTraceBuffer*> live;
+	for(TqInt i = 0, end = g_buffers.size(); i < end; ++i)
+	{
+		if(g_buffers[i]->threadDone())
+			delete g_buffers[i];
+		else
+		{
+			g_buffers[i]->reset(size);
+			live.push_back(g_buffers[i]);
+		}
+	}
+	g_buffers.swap(live);
+}
+
+} // unnamed namespace
+
+
+void enableTracing(bool enabled, TqInt bufferSize)
+{
+#	ifdef ENABLE_THREADING
+	boost::mutex::scoped_lock lock(g_buffersMutex);
+#	endif
+	// Buffers are emptied when tracing is switched off to free their memory.
+	g_bufferSize = enabled ? bufferSize : 0;
+	resetBuffers(g_bufferSize);
+	g_traceOrigin = wallClockTime();
+	g_tracingEnabled = enabled;
+}
+
+boost::uint64_t traceTime()
+{
+	boost::uint64_t now = wallClockTime();
+	return now > g_traceOrigin ? now - g_traceOrigin : 0;
+}
+
+void traceEvent(const char* name, boost::uint64_t start, boost::uint64_t end,
+		TqInt x, TqInt y)
+{
+	SqTraceEvent event = { name, start, end, x, y };
+	threadBuffer().push(event);
+}
+
+void writeTrace(std::ostream& out)
+{
+#	ifdef ENABLE_THREADING
+	boost::mutex::scoped_lock lock(g_buffersMutex);
+#	endif
+	TqInt dropped = 0;
+	bool first = true;
+	out << "{\"traceEvents\":[";
+	for(TqInt i = 0, end = g_buffers.size(); i < end; ++i)
+	{
+		CqTraceBuffer& buffer = *g_buffers[i];
+		if(buffer.write(out, first) == 0)
+			continue;
+		out << ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":"
+			<< buffer.threadId() << ",\"args\":{\"name\":\"thread "
+			<< buffer.threadId() << "\"}}";
+		dropped += buffer.dropped();
+	}
+	out << "\n],\n\"displayTimeUnit\":\"ms\",\n"
+		<< "\"otherData\":{\"droppedEvents\":" << dropped << "}}\n";
+	resetBuffers(g_bufferSize);
+}
+
+} // namespace Aqsis
@@ -0,0 +1,103 @@
+// Aqsis
+// Copyright (C) 1997 - 2001, Paul C. Gregory
+//
+// Contact: pgregory@aqsis.org
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation; either
+// version 2 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+/** \file
+ *
+ * \brief Unit tests for tracing.
+ */
+
+#include <aqsis/util/trace.h>
+
+#include <sstream>
+#include <string>
+
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/auto_unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(trace_tests)
+
+using namespace Aqsis;
+
+namespace {
+
+TqInt countOccurrences(const std::string& str, const std::string& sub)
+{
+	TqInt count = 0;
+	for(std::string::size_type pos = str.find(sub); pos != std::string::npos;
+			pos = str.find(sub, pos + 1))
+		++count;
+	return count;
+}
+
+} // unnamed namespace
+
+BOOST_AUTO_TEST_CASE(trace_disabled_records_nothing)
+{
+	enableTracing(false);
+	{
+		AQSIS_TRACE_SCOPE("trace_test_disabled");
+	}
+	std::ostringstream out;
+	writeTrace(out);
+	BOOST_CHECK_EQUAL(countOccurrences(out.str(), "trace_test_disabled"), 0);
+}
+
+BOOST_AUTO_TEST_CASE(trace_records_scopes)
+{
+	enableTracing(true);
+	{
+		AQSIS_TRACE_SCOPE("trace_test_outer");
+		{
+			AQSIS_TRACE_SCOPE_XY("trace_test_bucket", 3, 4);
+		}
+	}
+	std::ostringstream out;
+	writeTrace(out);
+	std::string trace = out.str();
+	BOOST_CHECK_EQUAL(countOccurrences(trace, "\"trace_test_outer\""), 1);
+	BOOST_CHECK_EQUAL(countOccurrences(trace, "\"trace_test_bucket\""), 1);
+	BOOST_CHECK_EQUAL(countOccurrences(trace, "\"args\":{\"x\":3,\"y\":4}"), 1);
+	BOOST_CHECK_EQUAL(countOccurrences(trace, "\"thread_name\""), 1);
+
+	// Writing the trace clears the recorded events.
+	std::ostringstream out2;
+	writeTrace(out2);
+	BOOST_CHECK_EQUAL(countOccurrences(out2.str(), "trace_test_outer"), 0);
+	enableTracing(false);
+}
+
+BOOST_AUTO_TEST_CASE(trace_ring_buffer_keeps_newest_events)
+{
+	enableTracing(true, 2);
+	traceEvent("trace_test_a", 0, 1);
+	traceEvent("trace_test_b", 1, 2);
+	traceEvent("trace_test_c", 2, 3);
+	std::ostringstream out;
+	writeTrace(out);
+	std::string trace = out.str();
+	BOOST_CHECK_EQUAL(countOccurrences(trace, "trace_test_a"), 0);
+	BOOST_CHECK_EQUAL(countOccurrences(trace, "trace_test_b"), 1);
+	BOOST_CHECK_EQUAL(countOccurrences(trace, "trace_test_c"), 1);
+	BOOST_CHECK(trace.find("trace_test_b") < trace.find("trace_test_c"));
+	BOOST_CHECK_EQUAL(countOccurrences(trace, "\"droppedEvents\":1"), 1);
+	enableTracing(false);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
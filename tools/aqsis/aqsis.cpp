@@ -56,6 +56,7 @@
 #include <memory>
 
 #include <aqsis/core/corecontext.h>
+#include <aqsis/riutil/ribparser.h>
 #include <aqsis/riutil/ricxxutil.h>
 #include <aqsis/riutil/ricxx_filter.h>
 #include <aqsis/util/exception.h>
@@ -649,10 +650,11 @@ int main( int argc, const char** argv )
 				for(ArgParse::apstringvec::const_iterator fileName = ap.leftovers().begin();
 						fileName != ap.leftovers().end(); fileName++)
 				{
-					std::ifstream inFile(fileName->c_str());
-					if(inFile)
+					boost::shared_ptr<std::istream> inFile =
+						Aqsis::RibParser::openFile(*fileName);
+					if(*inFile)
 					{
-						Aqsis::cxxRenderContext()->parseRib(inFile, fileName->c_str());
+						Aqsis::cxxRenderContext()->parseRib(*inFile, fileName->c_str());
 						returnCode = RiLastError;
 					}
 					else
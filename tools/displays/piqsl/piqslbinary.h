@@ -0,0 +1,265 @@
+// Aqsis
+// Copyright (C) 2001, Paul C. Gregory and the other authors and contributors
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// * Neither the name of the software's owners nor the names of its
+//   contributors may be used to endorse or promote products derived from this
+//   software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+// (This is the New BSD license)
+
+/** \file
+		\brief Binary framing of bucket data sent from the piqsl display
+			driver to piqsl.
+
+		The open and close handshake between the display driver and piqsl
+		is made of XML messages, each terminated by a null character.  If
+		piqsl answers the open message with a "binarydata" attribute on its
+		Formats reply, the pixel data is sent as binary messages instead:
+
+		\verbatim
+		header:  magic[4] compression payloadSize rawSize bucketCount
+		payload: payloadSize bytes, compressed according to compression
+		'\0'     terminator, as for the XML messages
+		\endverbatim
+
+		Once decompressed, the payload holds bucketCount buckets, each
+		written as xmin xmaxplus1 ymin ymaxplus1 elementSize followed by the
+		pixel data.  All integers are 32 bit, in network byte order.  The
+		first magic byte can never start an XML message, so the two kinds
+		of message can be told apart from their first byte.
+*/
+
+#ifndef PIQSLBINARY_H_INCLUDED
+#define PIQSLBINARY_H_INCLUDED 1
+
+#include <aqsis/aqsis.h>
+
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <zlib.h>
+
+namespace Aqsis {
+
+namespace piqsl {
+
+/// Magic number at the start of each binary message.
+const char binaryMagic[4] = { '\x89', 'A', 'Q', 'B' };
+/// Size of the binary message header in bytes.
+const TqInt binaryHeaderSize = 20;
+/// Size of the header before each bucket in the payload.
+const TqInt bucketHeaderSize = 20;
+
+/// Compression schemes for the payload of binary messages.
+enum EqCompression
+{
+	Compression_None = 0,
+	Compression_Zlib = 1
+};
+
+/// Header of a binary message.
+struct SqBinaryHeader
+{
+	TqUint32 compression;	///< One of EqCompression.
+	TqUint32 payloadSize;	///< Size of the payload as sent.
+	TqUint32 rawSize;		///< Size of the payload after decompression.
+	TqUint32 bucketCount;	///< Number of buckets in the payload.
+};
+
+/// Description of a bucket found in a decoded payload.
+struct SqBucketData
+{
+	TqInt xmin;
+	TqInt xmaxplus1;
+	TqInt ymin;
+	TqInt ymaxplus1;
+	TqInt elementSize;
+	const unsigned char* data;
+};
+
+inline void putUint32(std::vector<char>& buf, TqUint32 value)
+{
+	buf.push_back(static_cast<char>((value >> 24) & 0xFF));
+	buf.push_back(static_cast<char>((value >> 16) & 0xFF));
+	buf.push_back(static_cast<char>((value >> 8) & 0xFF));
+	buf.push_back(static_cast<char>(value & 0xFF));
+}
+
+inline TqUint32 getUint32(const char* p)
+{
+	const unsigned char* u = reinterpret_cast<const unsigned char*>(p);
+	return (TqUint32(u[0]) << 24) | (TqUint32(u[1]) << 16)
+		| (TqUint32(u[2]) << 8) | TqUint32(u[3]);
+}
+
+/** \brief Determine whether a message starts with the binary magic number.
+ *
+ * Only the first byte is examined, so this can be used as soon as a single
+ * byte of the message has arrived.
+ */
+inline bool isBinaryMessage(const char* msg)
+{
+	return msg[0] == binaryMagic[0];
+}
+
+/** \brief Append a bucket of pixel data to an uncompressed payload.
+ */
+inline void appendBucket(std::vector<char>& raw, TqInt xmin, TqInt xmaxplus1,
+		TqInt ymin, TqInt ymaxplus1, TqInt elementSize,
+		const unsigned char* data)
+{
+	putUint32(raw, xmin);
+	putUint32(raw, xmaxplus1);
+	putUint32(raw, ymin);
+	putUint32(raw, ymaxplus1);
+	putUint32(raw, elementSize);
+	const char* begin = reinterpret_cast<const char*>(data);
+	raw.insert(raw.end(), begin,
+			begin + elementSize*(xmaxplus1 - xmin)*(ymaxplus1 - ymin));
+}
+
+/** \brief Build a complete binary message from a payload.
+ *
+ * If compression doesn't reduce the size of the payload, it's sent
+ * uncompressed.
+ *
+ * \param raw - uncompressed payload built with appendBucket().
+ * \param bucketCount - number of buckets in raw.
+ * \param compression - compression to use for the payload.
+ * \param msg - returns the message, excluding the null terminator.
+ */
+inline void encodeMessage(const std::vector<char>& raw, TqInt bucketCount,
+		EqCompression compression, std::string& msg)
+{
+	std::vector<char> header;
+	header.reserve(binaryHeaderSize);
+	header.insert(header.end(), binaryMagic, binaryMagic + 4);
+
+	std::vector<Bytef> packed;
+	if(compression == Compression_Zlib && !raw.empty())
+	{
+		uLongf packedSize = compressBound(raw.size());
+		packed.resize(packedSize);
+		// Favour speed, since this is used for interactive display.
+		if(compress2(&packed[0], &packedSize,
+				reinterpret_cast<const Bytef*>(&raw[0]), raw.size(),
+				Z_BEST_SPEED) == Z_OK && packedSize < raw.size())
+			packed.resize(packedSize);
+		else
+			packed.clear();
+	}
+	if(packed.empty())
+		compression = Compression_None;
+
+	putUint32(header, compression);
+	putUint32(header, compression == Compression_None ? raw.size() : packed.size());
+	putUint32(header, raw.size());
+	putUint32(header, bucketCount);
+
+	msg.assign(header.begin(), header.end());
+	if(compression == Compression_None)
+		msg.append(raw.begin(), raw.end());
+	else
+		msg.append(packed.begin(), packed.end());
+}
+
+/** \brief Read the header of a binary message.
+ *
+ * \param msg - start of the message; must hold at least binaryHeaderSize
+ *              bytes.
+ * \return false if the message isn't a valid binary message.
+ */
+inline bool decodeHeader(const char* msg, SqBinaryHeader& header)
+{
+	if(std::memcmp(msg, binaryMagic, 4) != 0)
+		return false;
+	header.compression = getUint32(msg + 4);
+	header.payloadSize = getUint32(msg + 8);
+	header.rawSize = getUint32(msg + 12);
+	header.bucketCount = getUint32(msg + 16);
+	return header.compression == Compression_None
+		|| header.compression == Compression_Zlib;
+}
+
+/** \brief Decompress the payload of a binary message.
+ *
+ * \param header - header of the message.
+ * \param payload - payload of header.payloadSize bytes following the header.
+ * \param raw - returns the uncompressed payload.
+ * \return false if the payload couldn't be decompressed.
+ */
+inline bool decodePayload(const SqBinaryHeader& header, const char* payload,
+		std::vector<char>& raw)
+{
+	raw.resize(header.rawSize);
+	if(header.rawSize == 0)
+		return true;
+	if(header.compression == Compression_None)
+	{
+		if(header.payloadSize != header.rawSize)
+			return false;
+		std::memcpy(&raw[0], payload, header.rawSize);
+		return true;
+	}
+	uLongf rawSize = header.rawSize;
+	return uncompress(reinterpret_cast<Bytef*>(&raw[0]), &rawSize,
+			reinterpret_cast<const Bytef*>(payload), header.payloadSize) == Z_OK
+		&& rawSize == header.rawSize;
+}
+
+/** \brief Read the next bucket from an uncompressed payload.
+ *
+ * \param pos - position of the bucket in the payload.
+ * \param end - end of the payload.
+ * \param bucket - returns the bucket dimensions and data.
+ * \return the position of the following bucket, or 0 if the payload is
+ *         truncated.
+ */
+inline const char* nextBucket(const char* pos, const char* end,
+		SqBucketData& bucket)
+{
+	if(end - pos < bucketHeaderSize)
+		return 0;
+	bucket.xmin = getUint32(pos);
+	bucket.xmaxplus1 = getUint32(pos + 4);
+	bucket.ymin = getUint32(pos + 8);
+	bucket.ymaxplus1 = getUint32(pos + 12);
+	bucket.elementSize = getUint32(pos + 16);
+	pos += bucketHeaderSize;
+	if(bucket.xmaxplus1 < bucket.xmin || bucket.ymaxplus1 < bucket.ymin)
+		return 0;
+	std::size_t size = static_cast<std::size_t>(bucket.elementSize)
+		* (bucket.xmaxplus1 - bucket.xmin) * (bucket.ymaxplus1 - bucket.ymin);
+	if(static_cast<std::size_t>(end - pos) < size)
+		return 0;
+	bucket.data = reinterpret_cast<const unsigned char*>(pos);
+	return pos + size;
+}
+
+} // namespace piqsl
+
+} // namespace Aqsis
+
+#endif // PIQSLBINARY_H_INCLUDED
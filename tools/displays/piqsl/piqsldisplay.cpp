@@ -20,7 +20,7 @@
 
 /** \file
 		\brief A display device that communicates with a separate process
-			using sockets and XML based data packets.
+			using sockets, XML based control messages and binary bucket data.
 		\author Paul C. Gregory (pgregory@aqsis.org)
 */
 
@@ -36,6 +36,7 @@
 #include <boost/archive/iterators/base64_from_binary.hpp>
 #include <boost/archive/iterators/transform_width.hpp>
 #include <boost/archive/iterators/insert_linebreaks.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
 #include <boost/shared_ptr.hpp>
 
 #ifdef AQSIS_SYSTEM_WIN32
@@ -66,6 +67,8 @@
 #include <aqsis/util/logging_streambufs.h>
 #include <aqsis/math/math.h>
 
+#include "piqslbinary.h"
+
 using namespace Aqsis;
 
 struct SqPiqslDisplayInstance
@@ -76,12 +79,29 @@ struct SqPiqslDisplayInstance
 	CqSocket		m_socket;
 	// The number of pixels that have already been rendered (used for progress reporting)
 	TqInt		m_pixelsReceived;
+	// Whether piqsl accepts binary bucket data.
+	bool		m_binary;
+	// Compression used for binary bucket data.
+	piqsl::EqCompression	m_compression;
+	// Buckets are batched up until this many bytes are waiting to be sent.
+	TqInt		m_batchSize;
+	// Bucket data waiting to be sent, and the number of buckets it contains.
+	std::vector<char>	m_batch;
+	TqInt		m_batchBuckets;
+	// Time at which the oldest bucket in the batch arrived.
+	boost::posix_time::ptime	m_batchStart;
+	// Width of the image, used to spot the end of each row of buckets.
+	TqInt		m_width;
 
 	friend std::istream& operator >>(std::istream &is,struct SqPiqslDisplayInstance &obj);
 	friend std::ostream& operator <<(std::ostream &os,const struct SqPiqslDisplayInstance &obj);
 };
 
+// Longest time in milliseconds that bucket data waits in a batch.
+static const TqInt maxBatchDelay = 250;
+
 static int sendXMLMessage(TiXmlDocument& msg, CqSocket& sock);
+static void flushBatch(SqPiqslDisplayInstance* pImage);
 static boost::shared_ptr<TiXmlDocument> recvXMLMessage(CqSocket& sock);
 
 // Define a base64 encoding stream iterator using the boost archive data flow iterators.
@@ -139,6 +159,21 @@ extern "C" PtDspyError DspyImageOpen(PtDspyImageHandle * image,
 		*image = pImage;
 
 		pImage->m_filename = filename;
+		pImage->m_binary = false;
+		pImage->m_batchBuckets = 0;
+		pImage->m_width = width;
+
+		// Compression of the bucket data, "zlib" or "none".
+		pImage->m_compression = piqsl::Compression_Zlib;
+		char* compression = NULL;
+		if( DspyFindStringInParamList("compression", &compression, paramCount, parameters ) == PkDspyErrorNone
+			&& std::string(compression) == "none" )
+			pImage->m_compression = piqsl::Compression_None;
+		// Number of bytes of bucket data to collect before sending.
+		pImage->m_batchSize = 64*1024;
+		int batchSize;
+		if( DspyFindIntInParamList("batchsize", &batchSize, paramCount, parameters ) == PkDspyErrorNone )
+			pImage->m_batchSize = batchSize;
 
 		int scanorder;
 		if( DspyFindIntInParamList("scanlineorder", &scanorder, paramCount, parameters ) == PkDspyErrorNone )
@@ -382,6 +417,9 @@ extern "C" PtDspyError DspyImageOpen(PtDspyImageHandle * image,
 			TiXmlElement* child = formats->FirstChildElement("Formats");
 			if(child)
 			{
+				// Versions of piqsl which understand binary bucket data say so
+				// in their reply; older ones only accept XML.
+				pImage->m_binary = child->Attribute("binarydata") != 0;
 				TiXmlElement* formatNode = child->FirstChildElement("Format");
 				// If we are recieving "rgba" data, ensure that it is in the
 				// correct order.  First copy the XML "formats" document into
@@ -435,6 +473,24 @@ extern "C" PtDspyError DspyImageData(PtDspyImageHandle image,
 	SqPiqslDisplayInstance* pImage;
 	pImage = reinterpret_cast<SqPiqslDisplayInstance*>(image);
 
+	if(pImage->m_binary)
+	{
+		boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+		if(pImage->m_batchBuckets == 0)
+			pImage->m_batchStart = now;
+		piqsl::appendBucket(pImage->m_batch, xmin, xmaxplus1, ymin, ymaxplus1,
+				entrysize, data);
+		++pImage->m_batchBuckets;
+		// Send the batch once it's full, but also at the end of each row of
+		// buckets and when it has been waiting a while, so that slow or small
+		// renders still update the display progressively.
+		if(static_cast<TqInt>(pImage->m_batch.size()) >= pImage->m_batchSize
+			|| xmaxplus1 >= pImage->m_width
+			|| now - pImage->m_batchStart >= boost::posix_time::milliseconds(maxBatchDelay))
+			flushBatch(pImage);
+		return(PkDspyErrorNone);
+	}
+
 	TqInt bucketlinelen = entrysize * (xmaxplus1 - xmin);
 	TqInt bufferlength = bucketlinelen * (ymaxplus1 - ymin);
 	TiXmlDocument msg;
@@ -484,6 +540,7 @@ extern "C" PtDspyError DspyImageDelayClose(PtDspyImageHandle image)
 	// Close the socket
 	if(pImage && pImage->m_socket)
 	{
+		flushBatch(pImage);
 		TiXmlDocument doc("close.xml");
 		TiXmlDeclaration* decl = new TiXmlDeclaration("1.0","","yes");
 		TiXmlElement* closeMsgXML = new TiXmlElement("Close");
@@ -564,6 +621,19 @@ static int sendXMLMessage(TiXmlDocument& msg, CqSocket& sock)
 	return( sock.sendData( message.str() ) );
 }
 
+/// Send any batched bucket data to piqsl as a single binary message.
+static void flushBatch(SqPiqslDisplayInstance* pImage)
+{
+	if(pImage->m_batchBuckets == 0)
+		return;
+	std::string message;
+	piqsl::encodeMessage(pImage->m_batch, pImage->m_batchBuckets,
+			pImage->m_compression, message);
+	pImage->m_socket.sendData(message);
+	pImage->m_batch.clear();
+	pImage->m_batchBuckets = 0;
+}
+
 static boost::shared_ptr<TiXmlDocument> recvXMLMessage(CqSocket& sock)
 {
 	boost::shared_ptr<TiXmlDocument> xmlMsg(new TiXmlDocument());
@@ -40,8 +40,6 @@
 #include	<algorithm>
 #include <float.h>
 
-#include <QTimer>
-
 #include        <boost/archive/iterators/binary_from_base64.hpp>
 #include	<boost/archive/iterators/base64_from_binary.hpp>
 #include	<boost/archive/iterators/transform_width.hpp>
@@ -51,6 +49,7 @@
 #include	<boost/filesystem.hpp>
 
 #include	"displayserverimage.h"
+#include	"piqslbinary.h"
 
 #include	<aqsis/math/math.h>
 #include 	<aqsis/util/file.h>
@@ -179,31 +178,95 @@ typedef
     > 
     base64_text; // compose all the above operations in to a new iterator
 
-    void CqDisplayServerImage::processMessage()
-    {
-        QByteArray msg;
-    
-        if (socket->state() != QAbstractSocket::ConnectedState)
-            return;
-
-        const int bytesAvailable = socket->bytesAvailable();
-
-        int bytesRead = 1;
-        char c;
-        socket->getChar(&c);
-        while (c != '\0') {
-            msg.append(c);
-            if (!socket->getChar(&c))
-	        break;
-            bytesRead++;
-        }
-
-        if (bytesAvailable > bytesRead) // grab another chunk in half-a-second
-            QTimer::singleShot(200, this, SLOT(processMessage()));
+void CqDisplayServerImage::processMessage()
+{
+	if (socket->state() != QAbstractSocket::ConnectedState)
+		return;
+
+	// Messages may arrive split across several reads, or several at once, so
+	// everything is collected and complete messages are taken off the front.
+	// Each message is removed from the buffer before it's processed, since
+	// replying to it may process socket events and re-enter this function.
+	m_buffer.append(socket->readAll());
+	while(!m_buffer.isEmpty())
+	{
+		if(piqsl::isBinaryMessage(m_buffer.constData()))
+		{
+			if(m_buffer.size() < piqsl::binaryHeaderSize)
+				break;
+			piqsl::SqBinaryHeader header;
+			if(!piqsl::decodeHeader(m_buffer.constData(), header)
+				|| !validBinaryHeader(header))
+			{
+				Aqsis::log() << error << "Invalid bucket data received, closing connection" << std::endl;
+				m_buffer.clear();
+				socket->abort();
+				return;
+			}
+			// The payload is followed by a null terminator.
+			const qint64 msgSize = qint64(piqsl::binaryHeaderSize) + header.payloadSize + 1;
+			if(m_buffer.size() < msgSize)
+				break;
+			QByteArray payload = m_buffer.mid(piqsl::binaryHeaderSize, header.payloadSize);
+			m_buffer.remove(0, msgSize);
+			processBinaryMessage(header, payload.constData());
+		}
+		else
+		{
+			const int end = m_buffer.indexOf('\0');
+			if(end < 0)
+				break;
+			QByteArray msg = m_buffer.left(end);
+			m_buffer.remove(0, end + 1);
+			processXmlMessage(msg.constData());
+		}
+	}
+}
+
+bool CqDisplayServerImage::validBinaryHeader(const piqsl::SqBinaryHeader& header) const
+{
+	// The sizes come from the other end of the socket, so check them against
+	// the image before buffering or allocating anything.  A batch holds at
+	// most the whole image, plus a small header per bucket, and payloads are
+	// only sent compressed when that makes them smaller.
+	if(!m_realData)
+		return false;
+	const qint64 numPixels = qint64(imageWidth()) * imageHeight();
+	const qint64 maxRawSize = numPixels * channelList().bytesPerPixel()
+		+ qint64(header.bucketCount) * piqsl::bucketHeaderSize;
+	return header.bucketCount <= numPixels
+		&& header.rawSize <= maxRawSize
+		&& header.payloadSize <= header.rawSize;
+}
+
+void CqDisplayServerImage::processBinaryMessage(const piqsl::SqBinaryHeader& header,
+		const char* payload)
+{
+	std::vector<char> raw;
+	if(!piqsl::decodePayload(header, payload, raw))
+	{
+		Aqsis::log() << error << "Could not decompress bucket data" << std::endl;
+		return;
+	}
+	const char* pos = raw.empty() ? 0 : &raw[0];
+	const char* end = pos + raw.size();
+	for(TqUint32 i = 0; i < header.bucketCount && pos; ++i)
+	{
+		piqsl::SqBucketData bucket;
+		pos = piqsl::nextBucket(pos, end, bucket);
+		if(pos)
+			acceptData(bucket.xmin, bucket.xmaxplus1, bucket.ymin, bucket.ymaxplus1,
+					bucket.elementSize, bucket.data);
+	}
+	if(!pos)
+		Aqsis::log() << error << "Truncated bucket data received" << std::endl;
+}
 
+void CqDisplayServerImage::processXmlMessage(const char* msg)
+{
             // Parse the XML message sent.
             TiXmlDocument xmlMsg;
-            xmlMsg.Parse(msg.data());
+            xmlMsg.Parse(msg);
             // Get the root element, which is the base type of the message.
             TiXmlElement* root = xmlMsg.RootElement();
 
@@ -317,6 +380,8 @@ typedef
                             formatv->LinkEndChild(formatText);
                             formatsXML->LinkEndChild(formatv);
                         }
+                        // Tell the display driver it may send bucket data in binary.
+                        formatsXML->SetAttribute("binarydata", "zlib");
                         doc.LinkEndChild(decl);
                         doc.LinkEndChild(formatsXML);
 
@@ -387,8 +452,7 @@ typedef
                     close();
                 }
             }
-    }
-
+}
 
 
 } // namespace Aqsis
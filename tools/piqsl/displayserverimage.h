@@ -45,6 +45,7 @@
 
 #include	<aqsis/ri/ndspy.h>
 
+#include <QByteArray>
 #include <QTcpSocket>
 
 #include	"image.h"
@@ -53,6 +54,9 @@ namespace Aqsis {
 
 struct SqDDMessageBase;
 struct SqDDMessageData;
+namespace piqsl {
+struct SqBinaryHeader;
+}
 
 //---------------------------------------------------------------------
 /** \class CqDDClient
@@ -106,8 +110,23 @@ public:
 	void processMessage();
 
 private:
+	/** \brief Handle an XML control message, or bucket data sent as XML.
+	 * \param msg	The null terminated message.
+	 */
+	void processXmlMessage(const char* msg);
+	/** \brief Handle a message of binary bucket data.
+	 * \param header	The decoded message header.
+	 * \param payload	The message payload of header.payloadSize bytes.
+	 */
+	void processBinaryMessage(const piqsl::SqBinaryHeader& header, const char* payload);
+	/** \brief Check the sizes in a binary message header against the image.
+	 * \param header	The decoded message header.
+	 */
+	bool validBinaryHeader(const piqsl::SqBinaryHeader& header) const;
 
 	QTcpSocket* socket;
+	/// Data received which doesn't yet make up a complete message.
+	QByteArray m_buffer;
 };
 
 
@@ -410,13 +410,14 @@ static void coverageToColor(const float* face, int size, int stride, GLubyte* co
     }
 }
 
-static void floatColToColor(const float* face, int size, int stride, GLubyte* col)
+/// Convert float RGB color, stored as three planes, to 8 bit color
+static void floatColToColor(const float* face, int size, int planeSize, GLubyte* col)
 {
     for(int i = 0; i < size; ++i)
     {
-        col[3*i]   = Imath::clamp(int(255*(face[stride*i])), 0, 255);
-        col[3*i+1] = Imath::clamp(int(255*(face[stride*i+1])), 0, 255);
-        col[3*i+2] = Imath::clamp(int(255*(face[stride*i+2])), 0, 255);
+        col[3*i]   = Imath::clamp(int(255*(face[i])), 0, 255);
+        col[3*i+1] = Imath::clamp(int(255*(face[i + planeSize])), 0, 255);
+        col[3*i+2] = Imath::clamp(int(255*(face[i + 2*planeSize])), 0, 255);
     }
 }
 
@@ -481,13 +482,19 @@ static void drawMicroBuf(const MicroBuf& envBuf)
     // Convert each face to 8-bit colour texels
     if(false)
     {
-        float zMin = 0;
-        float zMax = 0;
-        depthRange(envBuf.face(MicroBuf::Face_xp), npix*6, envBuf.getNChans(),
-                   zMin, zMax);
+        float zMin = FLT_MAX;
+        float zMax = -FLT_MAX;
         for(int iface = MicroBuf::Face_begin; iface < MicroBuf::Face_end; ++iface) {
 		MicroBuf::Face face = static_cast<MicroBuf::Face>(iface);
-            depthToColor(envBuf.face(face), npix, envBuf.getNChans(),
+            float faceMin = 0;
+            float faceMax = 0;
+            depthRange(envBuf.channel(face, 0), npix, 1, faceMin, faceMax);
+            zMin = std::min(zMin, faceMin);
+            zMax = std::max(zMax, faceMax);
+        }
+        for(int iface = MicroBuf::Face_begin; iface < MicroBuf::Face_end; ++iface) {
+		MicroBuf::Face face = static_cast<MicroBuf::Face>(iface);
+            depthToColor(envBuf.channel(face, 0), npix, 1,
                          &colBuf[faceSize*face], zMin, zMax);
         }
     }
@@ -495,7 +502,7 @@ static void drawMicroBuf(const MicroBuf& envBuf)
     {
 	for(int iface = MicroBuf::Face_begin; iface < MicroBuf::Face_end; ++iface) {
 		MicroBuf::Face face = static_cast<MicroBuf::Face>(iface);
-            coverageToColor(envBuf.face(face), npix, envBuf.getNChans(),
+            coverageToColor(envBuf.channel(face, 1), npix, 1,
                             &colBuf[faceSize*face]);
 	}
     }
@@ -504,7 +511,7 @@ static void drawMicroBuf(const MicroBuf& envBuf)
         // Convert float face color into 8-bit color texels for OpenGL
 	for(int iface = MicroBuf::Face_begin; iface < MicroBuf::Face_end; ++iface) {
 		MicroBuf::Face face = static_cast<MicroBuf::Face>(iface);
-		floatColToColor(envBuf.face(face) + 2, npix, envBuf.getNChans(),
+		floatColToColor(envBuf.channel(face, 2), npix, npix,
                             &colBuf[faceSize*face]);
 	}
     }